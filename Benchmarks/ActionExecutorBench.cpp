@@ -0,0 +1,264 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Load test for CActionExecutor. One thread submits actions in bursts, as the key
+   handler would, to actions whose work takes a while:
+
+     save    2 ms of work, coalescing (like "stats")
+     script  1 ms of work, 8 may wait, the newest dropped when full (like "script")
+     log     20 us of work, 64 may wait, the oldest dropped when full
+
+   while another collects the completions, woken by the executor. It checks that every
+   request was completed, merged or dropped exactly once, that each action's jobs ran one
+   at a time and in order, and reports how long Submit() takes, which is all the key
+   handler ever waits for. Built by the CMake build as ActionExecutorBench. */
+#include "ActionExecutor.h"
+#include "LatencyHistogram.h"
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace {
+
+enum bench_actions {
+    BENCH_SAVE = 1,
+    BENCH_SCRIPT,
+    BENCH_LOG,
+    BENCH_ACTION_COUNT
+};
+
+char const *const g_benchActionNames[BENCH_ACTION_COUNT] = { "", "save", "script", "log" };
+
+/* Spins for its work time rather than sleeping, to look like real work to the
+   scheduler, and checks that it's never running twice at once. */
+class CBusyWorker : public IActionWorker
+{
+public:
+    explicit CBusyWorker(uint64_t workNs) : m_workNs(workNs), m_running(0), m_overlaps(0) {}
+
+    virtual int RunAction(KeyEvent const &event)
+    {
+        (void)event;
+        if (m_running.fetch_add(1) != 0) {
+            ++m_overlaps;
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::nanoseconds(m_workNs);
+        while (std::chrono::steady_clock::now() < end) {
+        }
+        m_running.fetch_sub(1);
+        return 0;
+    }
+
+    uint32_t GetOverlapCount() const { return m_overlaps.load(); }
+
+private:
+    uint64_t m_workNs;
+    std::atomic<int> m_running;
+    std::atomic<uint32_t> m_overlaps;
+};
+
+struct ActionTally
+{
+    uint64_t queued;
+    uint64_t merged;
+    uint64_t dropped;
+    uint64_t completed;
+    uint64_t completedMerged;
+    uint32_t lastTime;
+    uint64_t outOfOrder;
+};
+
+/* Collects completions whenever the executor wakes it. */
+class CCollector
+{
+public:
+    CCollector(CActionExecutor &executor, ActionTally *tallies) :
+        m_executor(executor), m_tallies(tallies), m_woken(false), m_stop(false), m_wakeCount(0) {}
+
+    static bool Wake(void *context)
+    {
+        CCollector *collector = static_cast<CCollector *>(context);
+        {
+            std::lock_guard<std::mutex> lock(collector->m_lock);
+            collector->m_woken = true;
+            ++collector->m_wakeCount;
+        }
+        collector->m_wake.notify_one();
+        return true;
+    }
+
+    void Run()
+    {
+        for (;;) {
+            bool stop;
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_wake.wait(lock, [this] { return m_woken || m_stop; });
+                m_woken = false;
+                stop = m_stop;
+            }
+            Drain();
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stop = true;
+        }
+        m_wake.notify_one();
+    }
+
+    uint64_t GetWakeCount() const { return m_wakeCount; }
+
+private:
+    void Drain()
+    {
+        ActionCompletion completion;
+        while (m_executor.PopCompletion(completion)) {
+            ActionTally &tally = m_tallies[completion.event.action];
+            ++tally.completed;
+            tally.completedMerged += completion.merged;
+            if (completion.event.time < tally.lastTime) {
+                ++tally.outOfOrder;
+            }
+            tally.lastTime = completion.event.time;
+        }
+    }
+
+    CActionExecutor &m_executor;
+    ActionTally *m_tallies;
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    bool m_woken;
+    bool m_stop;
+    uint64_t m_wakeCount;
+};
+
+} // namespace
+
+int main()
+{
+    static unsigned const BURSTS = 2000;
+    CBusyWorker save(2000000);
+    CBusyWorker script(1000000);
+    CBusyWorker log(20000);
+
+    CActionExecutor executor;
+    executor.SetWorker(BENCH_SAVE, &save, 1, CActionExecutor::POLICY_COALESCE);
+    executor.SetWorker(BENCH_SCRIPT, &script, 8, CActionExecutor::POLICY_DROP_NEWEST);
+    executor.SetWorker(BENCH_LOG, &log, 64, CActionExecutor::POLICY_DROP_OLDEST);
+
+    ActionTally tallies[BENCH_ACTION_COUNT] = {};
+    CCollector collector(executor, tallies);
+    executor.SetWakeFunction(CCollector::Wake, &collector);
+    executor.Start(2);
+    std::thread collecting(&CCollector::Run, &collector);
+
+    // Bursts of 1-100 requests as fast as they can be made, with 0-2 ms between bursts.
+    CLatencyHistogram submitLatency;
+    std::mt19937 random(4242);
+    uint32_t time = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned burst = 0; burst < BURSTS; ++burst) {
+        unsigned count = 1 + random() % 100;
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned n = random() % 10;
+            uint16_t action = static_cast<uint16_t>((n < 1) ? BENCH_SAVE : ((n < 3) ? BENCH_SCRIPT : BENCH_LOG));
+            KeyEvent event = { ++time, action, 0, KeyEvent::FLAG_DOWN };
+            uint64_t submitStart = LatencyClockNow();
+            unsigned result = executor.Submit(event);
+            submitLatency.RecordTicks(submitStart);
+
+            ActionTally &tally = tallies[action];
+            if (result == CActionExecutor::SUBMIT_QUEUED) {
+                ++tally.queued;
+            } else if (result == CActionExecutor::SUBMIT_MERGED) {
+                ++tally.merged;
+            } else if (result == CActionExecutor::SUBMIT_DROPPED) {
+                ++tally.dropped;
+                // Dropping the oldest still queues this one.
+                if (action == BENCH_LOG) {
+                    ++tally.queued;
+                }
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(random() % 2000));
+    }
+    double submitSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Let everything waiting run, then stop.
+    while (executor.GetCompletedCount() + executor.GetMergedCount() + executor.GetDroppedCount() < executor.GetSubmittedCount()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    executor.Stop();
+    collector.Stop();
+    collecting.join();
+
+    printf("%-8s %10s %10s %10s %10s %10s\n", "action", "queued", "merged", "dropped", "completed", "in order");
+    int failures = 0;
+    for (unsigned a = 1; a < BENCH_ACTION_COUNT; ++a) {
+        ActionTally const &tally = tallies[a];
+        uint64_t droppedWaiting = (a == BENCH_LOG) ? tally.dropped : 0;
+        printf("%-8s %10llu %10llu %10llu %10llu %10s\n", g_benchActionNames[a],
+            static_cast<unsigned long long>(tally.queued), static_cast<unsigned long long>(tally.merged),
+            static_cast<unsigned long long>(tally.dropped), static_cast<unsigned long long>(tally.completed),
+            tally.outOfOrder ? "NO" : "yes");
+        if ((tally.completed != tally.queued - droppedWaiting) || (tally.completedMerged != tally.merged) || tally.outOfOrder) {
+            ++failures;
+        }
+    }
+    uint32_t overlaps = save.GetOverlapCount() + script.GetOverlapCount() + log.GetOverlapCount();
+    printf("\nsubmitted %llu in %.2f s, %llu wake-ups, %llu completions lost, %u overlapping runs\n",
+        static_cast<unsigned long long>(executor.GetSubmittedCount()), submitSeconds,
+        static_cast<unsigned long long>(collector.GetWakeCount()),
+        static_cast<unsigned long long>(executor.GetLostCompletionCount()), overlaps);
+    printf("Submit() ns: p50 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+        static_cast<unsigned long long>(submitLatency.GetValueAtPercentile(50.0)),
+        static_cast<unsigned long long>(submitLatency.GetValueAtPercentile(99.0)),
+        static_cast<unsigned long long>(submitLatency.GetValueAtPercentile(99.9)),
+        static_cast<unsigned long long>(submitLatency.GetMax()));
+    if (overlaps || executor.GetLostCompletionCount()) {
+        ++failures;
+    }
+    if (failures) {
+        printf("FAIL\n");
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "BenchSupport.h"
+#include "AppActions.h"
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static std::atomic<uint64_t> s_allocationCount(0);
+
+void *operator new(size_t size)
+{
+    s_allocationCount.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+// The standard library uses these too (std::stable_sort's buffer, for one), and they
+// must pair with the replaced delete.
+void *operator new(size_t size, std::nothrow_t const &) noexcept
+{
+    s_allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, std::nothrow_t const &tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+uint64_t GetAllocationCount()
+{
+    return s_allocationCount.load(std::memory_order_relaxed);
+}
+
+#ifdef __linux__
+CCacheMissCounter::CCacheMissCounter() :
+    m_fd(-1)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    m_fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+CCacheMissCounter::~CCacheMissCounter()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+void CCacheMissCounter::Start()
+{
+    if (m_fd >= 0) {
+        ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void CCacheMissCounter::Stop()
+{
+    if (m_fd >= 0) {
+        ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+uint64_t CCacheMissCounter::Read() const
+{
+    uint64_t count = 0;
+    if ((m_fd < 0) || (read(m_fd, &count, sizeof(count)) != sizeof(count))) {
+        return 0;
+    }
+    return count;
+}
+#else
+CCacheMissCounter::CCacheMissCounter() :
+    m_fd(-1)
+{
+}
+
+CCacheMissCounter::~CCacheMissCounter()
+{
+}
+
+void CCacheMissCounter::Start()
+{
+}
+
+void CCacheMissCounter::Stop()
+{
+}
+
+uint64_t CCacheMissCounter::Read() const
+{
+    return 0;
+}
+#endif
+
+CRecordingFrontend::CRecordingFrontend(CTimerWheel const *timers) :
+    m_submitted(0),
+    m_timers(timers)
+{
+}
+
+void CRecordingFrontend::ShowIcon(unsigned icon)
+{
+    IconChange change = { m_timers ? m_timers->GetTime() : 0, icon };
+    m_icons.push_back(change);
+}
+
+void CRecordingFrontend::Clear()
+{
+    m_icons.clear();
+    m_submitted = 0;
+}
+
+unsigned CRecordingFrontend::GetLastIcon() const
+{
+    return m_icons.empty() ? static_cast<unsigned>(ICON_COUNT) : m_icons.back().icon;
+}
@@ -0,0 +1,100 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "AppController.h"
+#include "OutputEngine.h"
+#include "TimerWheel.h"
+
+/* Shared by the benchmarks: counts of heap allocations and, where the OS offers them,
+   hardware cache misses, so a benchmark can report both per event, and stand-ins for
+   what the app controller drives. */
+
+/* Every operator new since the program started. BenchSupport.cpp replaces the global
+   operators to count them, so link it into one benchmark only once. */
+uint64_t GetAllocationCount();
+
+/* A hardware cache-miss counter for the calling thread (Linux perf events). It isn't
+   available everywhere (other platforms, containers, perf_event_paranoid), in which case
+   IsAvailable() is false and Read() returns 0. */
+class CCacheMissCounter
+{
+public:
+    CCacheMissCounter();
+    ~CCacheMissCounter();
+
+    bool IsAvailable() const { return m_fd >= 0; }
+
+    void Start();
+    void Stop();
+    uint64_t Read() const;
+
+private:
+    int m_fd;
+};
+
+/* An app frontend that records the icons shown, at the time on timers if it's given one,
+   and counts the actions submitted. */
+class CRecordingFrontend : public IAppFrontend
+{
+public:
+    explicit CRecordingFrontend(CTimerWheel const *timers = nullptr);
+
+    virtual void ShowIcon(unsigned icon);
+    virtual void SubmitAction(KeyEvent const &) { ++m_submitted; }
+    virtual void ProcessTimeout(uint32_t) {}
+
+    void Clear();
+
+    /* The icon shown last, or ICON_COUNT if none has been. */
+    unsigned GetLastIcon() const;
+
+    struct IconChange
+    {
+        uint64_t time;
+        unsigned icon;
+    };
+    std::vector<IconChange> m_icons;
+    unsigned m_submitted;
+
+private:
+    CTimerWheel const *m_timers;
+};
+
+/* An output sink that takes every key and does nothing with it. */
+class CNullSink : public IOutputSink
+{
+public:
+    virtual size_t SendKeys(KeyEvent const *, size_t count) { return count; }
+};
@@ -0,0 +1,345 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Load test for the control plane (CControlPlane and CControlClient), through real
+   shared memory. While one thread publishes statistics as fast as it can, and drains
+   commands between publishes:
+
+     - reader threads, each with a mapping of its own, and (on POSIX systems) reader
+       processes forked off for the purpose poll the statistics without pausing
+     - client threads post commands, waiting whenever the ring is full
+
+   It checks that every copy a reader gets is one whole publish (every word from the
+   same one) and that the publishes a reader sees only ever go forward, that every
+   command posted is taken exactly once and in ticket order, and that commandsDone
+   catches up with the last ticket. It reports publishes and reads per second, how
+   often a read had to be retried, and what a publish and a read cost. Built by the
+   CMake build as ControlPlaneBench. */
+#include "ControlPlane.h"
+#include "LatencyHistogram.h"
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+unsigned const READER_THREADS = 6;
+unsigned const READER_PROCESSES = 2;
+unsigned const CLIENT_THREADS = 3;
+unsigned const COMMANDS_PER_CLIENT = 20000;
+double const RUN_TIME = 2.0;    // seconds
+
+/* What the writer publishes as its nth: every word a function of n, so a copy made of
+   more than one publish shows. */
+void MakeStats(ControlStats &stats, uint64_t n)
+{
+    uint64_t words[CONTROL_STATS_WORDS];
+    for (size_t i = 0; i < CONTROL_STATS_WORDS; ++i) {
+        words[i] = n * (i + 1) + (n << 40);
+    }
+    memcpy(&stats, words, sizeof(stats));
+}
+
+/* Whether stats is exactly the writer's publish number stats.publishCount. */
+bool IsWhole(ControlStats const &stats)
+{
+    ControlStats expected;
+    MakeStats(expected, stats.publishCount);
+    expected.publishCount = stats.publishCount;
+    expected.commandsDone = stats.commandsDone;
+    expected.application[sizeof(expected.application) - 1] = '\0';
+    return memcmp(&expected, &stats, sizeof(stats)) == 0;
+}
+
+struct ReaderResult
+{
+    uint64_t reads;
+    uint64_t retries;
+    uint64_t failures;      // reads that never got a whole copy
+    uint64_t torn;          // copies that weren't one whole publish
+    uint64_t backwards;     // publishes older than one already seen
+};
+
+ReaderResult RunReader(char const *name, std::atomic<bool> const *stop, double seconds)
+{
+    ReaderResult result = {};
+    CControlClient client;
+    if (!client.Open(name)) {
+        result.failures = 1;
+        return result;
+    }
+    uint64_t last = 0;
+    auto end = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    for (;;) {
+        // Only look at the time (or the flag) now and then; reading is the point.
+        if (((result.reads & 255) == 0) &&
+            ((stop && stop->load(std::memory_order_relaxed)) || (std::chrono::steady_clock::now() >= end))) {
+            break;
+        }
+        ControlStats stats;
+        unsigned attempts;
+        ++result.reads;
+        if (!client.Read(stats, &attempts)) {
+            ++result.failures;
+            continue;
+        }
+        result.retries += attempts - 1;
+        if (!IsWhole(stats)) {
+            ++result.torn;
+        }
+        if (stats.publishCount < last) {
+            ++result.backwards;
+        }
+        last = stats.publishCount;
+    }
+    return result;
+}
+
+struct ClientResult
+{
+    uint32_t lastTicket;
+    uint64_t fullWaits;
+};
+
+/* The app never sees these: each client's commands carry its number and a count, so
+   the writer can tell that it took them all, once each and in order. */
+unsigned MakeCommand(unsigned client, unsigned count) { return ((client + 1) << 24) | count; }
+
+struct CommandCheck
+{
+    unsigned next[CLIENT_THREADS];
+    uint64_t taken;
+    uint64_t errors;
+
+    void Take(unsigned command)
+    {
+        unsigned client = (command >> 24) - 1;
+        if ((client >= CLIENT_THREADS) || ((command & 0xFFFFFF) != next[client])) {
+            ++errors;
+            return;
+        }
+        ++next[client];
+        ++taken;
+    }
+};
+
+} // namespace
+
+int main()
+{
+    char name[64];
+#ifdef _WIN32
+    snprintf(name, sizeof(name), "Local\\CaptainHookLL.bench.%u", static_cast<unsigned>(::GetCurrentProcessId()));
+#else
+    snprintf(name, sizeof(name), "/captainhook.bench.%u", static_cast<unsigned>(getpid()));
+#endif
+    CControlPlane plane;
+    if (!plane.Create(name, 1)) {
+        printf("Can't create %s\n", name);
+        return 1;
+    }
+    ControlStats stats;
+    MakeStats(stats, 1);
+    plane.Publish(stats);
+
+#ifndef _WIN32
+    // Forked readers report through a pipe, since they have a mapping of their own.
+    int results[2];
+    if (pipe(results) < 0) {
+        perror("pipe");
+        return 1;
+    }
+    std::vector<pid_t> children;
+    for (unsigned i = 0; i < READER_PROCESSES; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            ReaderResult result = RunReader(name, nullptr, RUN_TIME);
+            ssize_t written = write(results[1], &result, sizeof(result));
+            _exit(written == sizeof(result) ? 0 : 1);
+        }
+        if (pid > 0) {
+            children.push_back(pid);
+        }
+    }
+#endif
+
+    std::atomic<bool> stop(false);
+    std::vector<ReaderResult> readerResults(READER_THREADS);
+    std::vector<std::thread> readers;
+    for (unsigned i = 0; i < READER_THREADS; ++i) {
+        readers.emplace_back([&, i] { readerResults[i] = RunReader(name, &stop, RUN_TIME * 2); });
+    }
+
+    // Each client posts its own command over and over, so the order can be checked.
+    std::vector<ClientResult> clientResults(CLIENT_THREADS);
+    std::atomic<unsigned> clientsDone(0);
+    std::vector<std::thread> clients;
+    for (unsigned i = 0; i < CLIENT_THREADS; ++i) {
+        clients.emplace_back([&, i] {
+            CControlClient client;
+            ClientResult &result = clientResults[i];
+            result = ClientResult();
+            if (!client.Open(name)) {
+                return;
+            }
+            for (unsigned posted = 0; posted < COMMANDS_PER_CLIENT; ) {
+                uint32_t ticket;
+                if (client.Post(MakeCommand(i, posted), ticket)) {
+                    result.lastTicket = (ticket > result.lastTicket) ? ticket : result.lastTicket;
+                    ++posted;
+                } else {
+                    ++result.fullWaits;
+                    std::this_thread::yield();
+                }
+            }
+            clientsDone.fetch_add(1);
+        });
+    }
+
+    CommandCheck check = {};
+    uint64_t publishes = 1;
+    CLatencyHistogram publishLatency;
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::duration<double>(RUN_TIME);
+    while (std::chrono::steady_clock::now() < end) {
+        for (unsigned i = 0; i < 64; ++i) {
+            unsigned command;
+            while (plane.PopCommand(command)) {
+                check.Take(command);
+            }
+            MakeStats(stats, ++publishes);
+            uint64_t begin = LatencyClockNow();
+            plane.Publish(stats);
+            publishLatency.RecordTicks(begin);
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Let the clients finish, then take what's left and publish once more.
+    unsigned command;
+    while (clientsDone.load() < CLIENT_THREADS) {
+        while (plane.PopCommand(command)) {
+            check.Take(command);
+        }
+        std::this_thread::yield();
+    }
+    for (std::thread &client : clients) {
+        client.join();
+    }
+    while (plane.PopCommand(command)) {
+        check.Take(command);
+    }
+    MakeStats(stats, ++publishes);
+    plane.Publish(stats);
+    stop.store(true);
+    for (std::thread &reader : readers) {
+        reader.join();
+    }
+
+    std::vector<ReaderResult> all(readerResults);
+#ifndef _WIN32
+    for (pid_t pid : children) {
+        ReaderResult result;
+        int status;
+        if ((read(results[0], &result, sizeof(result)) != sizeof(result)) ||
+            (waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+            result = ReaderResult();
+            result.failures = 1;
+        }
+        all.push_back(result);
+    }
+    close(results[0]);
+    close(results[1]);
+#endif
+
+    ReaderResult total = {};
+    for (ReaderResult const &result : all) {
+        total.reads += result.reads;
+        total.retries += result.retries;
+        total.failures += result.failures;
+        total.torn += result.torn;
+        total.backwards += result.backwards;
+    }
+
+    // Every ticket was handed out once, so the last one is the number posted.
+    CControlClient checker;
+    ControlStats final;
+    bool read = checker.Open(name) && checker.Read(final);
+    uint64_t posted = static_cast<uint64_t>(CLIENT_THREADS) * COMMANDS_PER_CLIENT;
+    uint32_t lastTicket = 0;
+    uint64_t fullWaits = 0;
+    for (unsigned i = 0; i < CLIENT_THREADS; ++i) {
+        lastTicket = (clientResults[i].lastTicket > lastTicket) ? clientResults[i].lastTicket : lastTicket;
+        fullWaits += clientResults[i].fullWaits;
+    }
+    bool commandsOk = (check.errors == 0) && (check.taken == posted) && (lastTicket == posted) &&
+        read && (final.commandsDone == posted);
+
+    // How long a read takes with nobody writing.
+    CLatencyHistogram readLatency;
+    for (unsigned i = 0; read && (i < 100000); ++i) {
+        uint64_t begin = LatencyClockNow();
+        checker.Read(final);
+        readLatency.RecordTicks(begin);
+    }
+
+    printf("%zu readers (%u in other processes), %u clients posting %u commands each, %.1f s\n",
+        all.size(), static_cast<unsigned>(all.size() - READER_THREADS), CLIENT_THREADS, COMMANDS_PER_CLIENT, elapsed);
+    printf("publishes            %10.0f a second, p50 %llu ns, p99 %llu ns\n", publishes / elapsed,
+        static_cast<unsigned long long>(publishLatency.GetValueAtPercentile(50.0)),
+        static_cast<unsigned long long>(publishLatency.GetValueAtPercentile(99.0)));
+    printf("reads                %10.0f a second, %.3f%% retried, p50 %llu ns idle\n", total.reads / elapsed,
+        total.reads ? 100.0 * total.retries / total.reads : 0.0,
+        static_cast<unsigned long long>(readLatency.GetValueAtPercentile(50.0)));
+    printf("torn copies          %10llu, backwards %llu, failed reads %llu\n",
+        static_cast<unsigned long long>(total.torn), static_cast<unsigned long long>(total.backwards),
+        static_cast<unsigned long long>(total.failures));
+    printf("commands             %10llu taken in order of %llu (%llu out of order), %llu waits for a full ring, done %llu\n",
+        static_cast<unsigned long long>(check.taken), static_cast<unsigned long long>(posted),
+        static_cast<unsigned long long>(check.errors), static_cast<unsigned long long>(fullWaits),
+        static_cast<unsigned long long>(read ? final.commandsDone : 0));
+
+    bool ok = commandsOk && (total.torn == 0) && (total.backwards == 0) && (total.failures == 0) && (total.reads > 0);
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,318 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* The debounce filter (debounce in the keymap). It replays synthetic chatter: typing on
+   every letter and Space, where some strokes bounce as the key goes down (press, release,
+   press... then the real release), some bounce as it comes up (release, press, release),
+   and some are held into autorepeat. It checks that:
+
+     - every edge is passed or swallowed exactly as the pattern says: the first press and
+       release of each stroke pass, on the very event (so nothing is delayed), and every
+       bounce after them is swallowed with its release and autorepeats, on keys with a
+       debounce time; on Space, which has none, everything passes
+     - the count of swallowed bounces matches the pattern's, and no key is left held
+     - the same holds for the keymap saved as an image and attached
+     - on Linux, the same events read through the daemon's CLinuxKeyboardHook come out of
+       its uinput writer as exactly the edges that should pass, in order
+
+   and reports what the filter costs per event against a keymap without it. Built by the
+   CMake build as DebounceBench. */
+#include "KeyEngine.h"
+#include "LatencyHistogram.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#ifdef BENCH_LINUX_HOOK
+#include <unistd.h>
+#include "EvdevKeys.h"
+#include "LinuxKeyboardHook.h"
+#include "UinputOutput.h"
+#endif
+
+namespace {
+
+size_t const STROKES = 200000;
+uint32_t const LETTER_DEBOUNCE = 30;   // ms, and E's below
+uint32_t const E_DEBOUNCE = 60;
+uint32_t const REPEAT_DELAY = 500;
+uint32_t const REPEAT_INTERVAL = 33;
+
+char const s_keymapText[] =
+    "# Every key, then E more, then Space not at all.\n"
+    "debounce 30\n"
+    "debounce 60 E\n"
+    "debounce 0 Space\n";
+
+struct Edge
+{
+    uint32_t time;
+    uint8_t keycode;
+    bool down;
+    bool repeat;
+    bool pass;      // what the filter should do with it
+};
+
+uint32_t DebounceTime(uint8_t keycode)
+{
+    if (keycode == VKEY_SPACE) {
+        return 0;
+    }
+    return (keycode == 'E') ? E_DEBOUNCE : LETTER_DEBOUNCE;
+}
+
+/* Strokes on random keys, each starting 10-80 ms after the one before, or later if its key
+   is still settling. Bounces are 1-4 ms apart, so a stroke's chatter is over well within
+   its key's debounce time. */
+void GenerateChatter(std::vector<Edge> &edges, uint32_t &bounces)
+{
+    std::mt19937 random(19);
+    std::uniform_int_distribution<int> keyPick(0, 26);
+    std::uniform_int_distribution<int> kindPick(0, 9);
+    std::uniform_int_distribution<uint32_t> gapPick(10, 80);
+    std::uniform_int_distribution<uint32_t> holdPick(40, 160);
+    std::uniform_int_distribution<uint32_t> bouncePick(1, 4);
+    std::uniform_int_distribution<int> bounceCountPick(1, 3);
+
+    uint32_t keyFree[256] = {};
+    uint32_t now = 1000000;
+    edges.clear();
+    bounces = 0;
+    for (size_t stroke = 0; stroke < STROKES; ++stroke) {
+        int pick = keyPick(random);
+        uint8_t keycode = (pick == 26) ? static_cast<uint8_t>(VKEY_SPACE) : static_cast<uint8_t>('A' + pick);
+        bool filtered = DebounceTime(keycode) != 0;
+        now += gapPick(random);
+        uint32_t t = (static_cast<int32_t>(keyFree[keycode] - now) > 0) ? keyFree[keycode] : now;
+
+        // 0-3: clean, 4-6: bounces going down, 7-8: bounces coming up, 9: held to repeat.
+        int kind = kindPick(random);
+        uint32_t hold = (kind == 9) ? REPEAT_DELAY + 4 * REPEAT_INTERVAL : holdPick(random);
+        edges.push_back({ t, keycode, true, false, true });
+        if ((kind >= 4) && (kind <= 6)) {
+            // The first release passes; the presses after it, with their releases, the
+            // repeats of the last one and the real release at the end don't.
+            uint32_t b = t;
+            int count = bounceCountPick(random);
+            for (int i = 0; i < count; ++i) {
+                b += bouncePick(random);
+                edges.push_back({ b, keycode, false, false, (i == 0) || !filtered });
+                b += bouncePick(random);
+                edges.push_back({ b, keycode, true, false, !filtered });
+            }
+            bounces += filtered ? count : 0;
+            hold += REPEAT_DELAY;
+            for (uint32_t r = b + REPEAT_DELAY; r < t + hold; r += REPEAT_INTERVAL) {
+                edges.push_back({ r, keycode, true, true, !filtered });
+            }
+            edges.push_back({ t + hold, keycode, false, false, !filtered });
+            keyFree[keycode] = t + hold + DebounceTime(keycode) + 1;
+            continue;
+        }
+        for (uint32_t r = t + REPEAT_DELAY; r < t + hold; r += REPEAT_INTERVAL) {
+            edges.push_back({ r, keycode, true, true, true });
+        }
+        uint32_t b = t + hold;
+        edges.push_back({ b, keycode, false, false, true });
+        if ((kind == 7) || (kind == 8)) {
+            int count = bounceCountPick(random);
+            for (int i = 0; i < count; ++i) {
+                b += bouncePick(random);
+                edges.push_back({ b, keycode, true, false, !filtered });
+                b += bouncePick(random);
+                edges.push_back({ b, keycode, false, false, !filtered });
+            }
+            bounces += filtered ? count : 0;
+        }
+        keyFree[keycode] = b + DebounceTime(keycode) + 1;
+    }
+
+    // Strokes on different keys overlap, so their edges interleave.
+    std::stable_sort(edges.begin(), edges.end(), [](Edge const &a, Edge const &b) {
+        return static_cast<int32_t>(a.time - b.time) < 0;
+    });
+}
+
+KeyEvent MakeInput(Edge const &edge)
+{
+    KeyEvent input;
+    input.time = edge.time;
+    input.action = KEYMAP_ACTION_NONE;
+    input.keycode = edge.keycode;
+    input.flags = edge.down ? KeyEvent::FLAG_DOWN : 0;
+    return input;
+}
+
+bool CheckEngine(CKeymap const &keymap, std::vector<Edge> const &edges, uint32_t bounces, char const *name)
+{
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    size_t wrong = 0;
+    for (size_t i = 0; i < edges.size(); ++i) {
+        bool passed = !(engine.ProcessKey(MakeInput(edges[i])) & CKeyEngine::RESULT_CONSUME);
+        if (passed != edges[i].pass) {
+            if (wrong++ == 0) {
+                printf("%s: edge %zu (%s of key 0x%02X at %u) %s\n", name, i, edges[i].down ? "press" : "release",
+                    edges[i].keycode, edges[i].time, passed ? "passed" : "swallowed");
+            }
+        }
+    }
+    bool held = false;
+    for (unsigned k = 0; k < KEYMAP_KEYS; ++k) {
+        held = held || engine.GetKeyState().IsDown(static_cast<uint8_t>(k));
+    }
+    bool ok = (wrong == 0) && (engine.GetDebouncedCount() == bounces) && !held;
+    printf("%s: %zu edges, %zu wrong, %u bounces swallowed (expected %u)%s\n", name, edges.size(), wrong,
+        engine.GetDebouncedCount(), bounces, held ? ", a key left held" : "");
+    return ok;
+}
+
+double TimeEngine(CKeymap const &keymap, std::vector<Edge> const &edges)
+{
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    uint64_t start = LatencyClockNow();
+    for (size_t i = 0; i < edges.size(); ++i) {
+        engine.ProcessKey(MakeInput(edges[i]));
+    }
+    return static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / edges.size();
+}
+
+#ifdef BENCH_LINUX_HOOK
+
+/* Replay the chatter through the daemon's hook in batches of up to 8 events, as reads
+   from the keyboard would deliver them, into a temporary file in place of uinput. */
+bool CheckLinuxHook(CKeymap const &keymap, std::vector<Edge> const &edges)
+{
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    CUinputOutput output;
+    FILE *file = tmpfile();
+    if (!file || !output.Attach(dup(fileno(file)))) {
+        printf("Can't make a temporary file\n");
+        return false;
+    }
+    CLinuxKeyboardHook hook(engine, output);
+
+    std::vector<struct input_event> batch;
+    for (size_t i = 0; i < edges.size(); ) {
+        batch.clear();
+        for (size_t n = 0; (n < 8) && (i < edges.size()); ++n, ++i) {
+            struct input_event event;
+            event.time.tv_sec = static_cast<time_t>(edges[i].time / 1000);
+            event.time.tv_usec = static_cast<suseconds_t>(edges[i].time % 1000 * 1000);
+            event.type = EV_KEY;
+            event.code = EvdevFromVirtualKey(edges[i].keycode);
+            event.value = edges[i].repeat ? 2 : (edges[i].down ? 1 : 0);
+            batch.push_back(event);
+        }
+        hook.OnInputEvents(batch.data(), batch.size());
+    }
+
+    // What came out, key events only, against what should have.
+    fflush(file);
+    rewind(file);
+    size_t expected = 0;
+    size_t wrong = 0;
+    size_t written = 0;
+    struct input_event event;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        if (event.type != EV_KEY) {
+            continue;
+        }
+        ++written;
+        while ((expected < edges.size()) && !edges[expected].pass) {
+            ++expected;
+        }
+        if ((expected == edges.size()) || (event.code != EvdevFromVirtualKey(edges[expected].keycode)) ||
+            (event.value != (edges[expected].repeat ? 2 : (edges[expected].down ? 1 : 0)))) {
+            ++wrong;
+        }
+        ++expected;
+    }
+    while ((expected < edges.size()) && !edges[expected].pass) {
+        ++expected;
+    }
+    fclose(file);
+    bool ok = (wrong == 0) && (expected == edges.size());
+    printf("linux hook: %zu key events written, %zu wrong, %s\n", written, wrong,
+        (expected == edges.size()) ? "none missing" : "some missing");
+    return ok;
+}
+
+#endif
+
+} // namespace
+
+int main()
+{
+    std::vector<Edge> edges;
+    uint32_t bounces;
+    GenerateChatter(edges, bounces);
+
+    CKeymap keymap;
+    KeymapError error;
+    if (!keymap.Load(s_keymapText, sizeof(s_keymapText) - 1, nullptr, 0, &error)) {
+        printf("line %u: %s\n", error.line, error.message);
+        return 1;
+    }
+    bool ok = CheckEngine(keymap, edges, bounces, "compiled");
+
+    std::vector<uint8_t> image;
+    keymap.WriteImage(image);
+    std::vector<uint64_t> aligned((image.size() + 63) / 8 + 8);
+    uint8_t *start = reinterpret_cast<uint8_t *>(aligned.data());
+    start += (64 - reinterpret_cast<uintptr_t>(start) % 64) % 64;
+    memcpy(start, image.data(), image.size());
+    CKeymap attached;
+    if (!attached.AttachImage(start, image.size(), &error)) {
+        printf("image: %s\n", error.message);
+        ok = false;
+    } else {
+        ok = CheckEngine(attached, edges, bounces, "image") && ok;
+    }
+
+#ifdef BENCH_LINUX_HOOK
+    ok = CheckLinuxHook(keymap, edges) && ok;
+#endif
+
+    CKeymap plain;
+    double filtered = TimeEngine(keymap, edges);
+    double unfiltered = TimeEngine(plain, edges);
+    printf("per event: %.1f ns with debounce, %.1f ns without\n", filtered, unfiltered);
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,360 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Measures the whole per-key path, from the hook's ProcessKey() through draining the
+   queue and running the actions, with generated workloads:
+
+     typing      bursts of typing on the default keymap plus a few sequences
+     autorepeat  keys held down autorepeating at 30 Hz, some bindings wanting repeats
+     chording    gaming-style play: movement keys held and overlapping, plus chords
+     large       typing on a keymap that binds every key in every modifier state, with
+                 thousands of sequences
+
+   For each it reports nanoseconds, heap allocations and (where perf counters are
+   available) cache misses per event. The actions do what the tray app's do, against a
+   stand-in icon: change the icon through a CIconUpdateCoalescer and arm the bait timer
+   on a CTimerWheel. Built by the CMake build as DispatchBench. */
+#include "AppActions.h"
+#include "BenchSupport.h"
+#include "IconUpdateCoalescer.h"
+#include "KeyEngine.h"
+#include "Keymap.h"
+#include "TimerWheel.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+class CNullIconBackend : public IIconBackend
+{
+public:
+    virtual bool ShowIcon(uintptr_t icon) { m_icon = icon; return true; }
+    uintptr_t m_icon = 0;
+};
+
+/* The consumer side, as the tray app's ProcessKeyEvents() and HandleKeyEvent() do it. */
+class CDispatcher
+{
+public:
+    CDispatcher(CKeyEngine &engine) : m_engine(engine), m_icons(m_backend), m_baitTimer(INVALID_TIMER), m_actionCount(0) {}
+
+    void ProcessKey(KeyEvent const &input)
+    {
+        m_timers.Advance(input.time);
+        if (m_engine.ProcessKey(input) & CKeyEngine::RESULT_WAKE) {
+            Drain();
+        }
+    }
+
+    unsigned GetActionCount() const { return m_actionCount; }
+
+private:
+    void Drain()
+    {
+        bool wake;
+        do {
+            m_engine.BeginDrain();
+            wake = false;
+            KeyEvent event;
+            while (m_engine.PopEvent(event)) {
+                if (event.flags & KeyEvent::FLAG_REPLAY) {
+                    event.flags |= KeyEvent::FLAG_INJECTED;
+                    wake = wake || ((m_engine.ProcessKey(event) & CKeyEngine::RESULT_WAKE) != 0);
+                } else {
+                    HandleKeyEvent(event);
+                }
+            }
+        } while (wake);
+    }
+
+    void HandleKeyEvent(KeyEvent const &event)
+    {
+        ++m_actionCount;
+        switch (event.action) {
+        case ACTION_SHOW_HOOK:
+            m_icons.SetIcon(1, event.time);
+            break;
+        case ACTION_SHOW_FISH:
+            m_icons.SetIcon(2, event.time);
+            break;
+        case ACTION_SHOW_BAIT: {
+            m_icons.SetIcon(3, event.time);
+            uint64_t deadline = m_timers.GetTime() + BAIT_DURATION;
+            if (!m_timers.Rearm(m_baitTimer, deadline)) {
+                m_baitTimer = m_timers.Arm(deadline, OnBaitTimer, this);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    static void OnBaitTimer(void *context, TimerHandle timer)
+    {
+        (void)timer;
+        CDispatcher *dispatcher = static_cast<CDispatcher *>(context);
+        dispatcher->m_icons.SetIcon(1, static_cast<uint32_t>(dispatcher->m_timers.GetTime()));
+    }
+
+    CKeyEngine &m_engine;
+    CNullIconBackend m_backend;
+    CIconUpdateCoalescer m_icons;
+    CTimerWheel m_timers;
+    TimerHandle m_baitTimer;
+    unsigned m_actionCount;
+};
+
+struct Workload
+{
+    char const *name;
+    std::string keymap;
+    bool large;
+    std::vector<KeyEvent> events;
+};
+
+void AddKey(std::vector<KeyEvent> &events, uint32_t time, uint8_t keycode, bool down)
+{
+    KeyEvent event = { time, 0, keycode, static_cast<uint8_t>(down ? KeyEvent::FLAG_DOWN : 0) };
+    events.push_back(event);
+}
+
+uint8_t RandomTypingKey(std::mt19937 &random)
+{
+    static uint8_t const others[] = { VKEY_SPACE, VKEY_SPACE, VKEY_RETURN, VKEY_BACK, VKEY_OEM_COMMA, VKEY_OEM_PERIOD };
+    unsigned n = random() % 32;
+    return (n < 26) ? static_cast<uint8_t>(VKEY_A + n) : others[n - 26];
+}
+
+/* Bursts of 5-60 keys at 60-150 ms, with pauses between them and Shift now and then. */
+void GenerateTyping(size_t count, std::mt19937 &random, std::vector<KeyEvent> &events)
+{
+    uint32_t time = 1000;
+    while (events.size() < count) {
+        unsigned burst = 5 + random() % 56;
+        for (unsigned i = 0; i < burst; ++i) {
+            bool shift = (random() % 12) == 0;
+            uint8_t keycode = RandomTypingKey(random);
+            if (shift) {
+                AddKey(events, time, VKEY_LSHIFT, true);
+                time += 15;
+            }
+            AddKey(events, time, keycode, true);
+            time += 30 + random() % 60;
+            AddKey(events, time, keycode, false);
+            if (shift) {
+                AddKey(events, time + 5, VKEY_LSHIFT, false);
+            }
+            time += 30 + random() % 90;
+        }
+        time += 500 + random() % 3000;
+    }
+}
+
+/* Held keys (arrows, Backspace, letters) repeating every 33 ms for 0.5-3 seconds. */
+void GenerateAutorepeat(size_t count, std::mt19937 &random, std::vector<KeyEvent> &events)
+{
+    static uint8_t const keys[] = { VKEY_LEFT, VKEY_RIGHT, VKEY_DOWN, VKEY_BACK, VKEY_A, 'X', VKEY_NEXT };
+    uint32_t time = 1000;
+    while (events.size() < count) {
+        uint8_t keycode = keys[random() % (sizeof(keys) / sizeof(keys[0]))];
+        AddKey(events, time, keycode, true);
+        time += 500;
+        unsigned repeats = 15 + random() % 76;
+        for (unsigned i = 0; i < repeats; ++i) {
+            AddKey(events, time, keycode, true);
+            time += 33;
+        }
+        AddKey(events, time, keycode, false);
+        time += 200 + random() % 800;
+    }
+}
+
+/* WASD movement held and overlapping, Shift and Space taps, and J&K / J&L chords, with
+   an event every few milliseconds. */
+void GenerateChording(size_t count, std::mt19937 &random, std::vector<KeyEvent> &events)
+{
+    static uint8_t const movement[] = { 'W', 'A', 'S', 'D' };
+    bool held[4] = { false, false, false, false };
+    uint32_t time = 1000;
+    while (events.size() < count) {
+        unsigned n = random() % 10;
+        if (n < 6) {
+            unsigned key = random() % 4;
+            held[key] = !held[key];
+            AddKey(events, time, movement[key], held[key]);
+        } else if (n < 8) {
+            uint8_t keycode = (n == 6) ? VKEY_SPACE : VKEY_LSHIFT;
+            AddKey(events, time, keycode, true);
+            AddKey(events, time + 20, keycode, false);
+        } else {
+            uint8_t second = (n == 8) ? 'K' : 'L';
+            AddKey(events, time, 'J', true);
+            AddKey(events, time + 3 + random() % 10, second, true);
+            AddKey(events, time + 40, 'J', false);
+            AddKey(events, time + 45, second, false);
+            time += 40;
+        }
+        time += 4 + random() % 12;
+    }
+}
+
+/* Every key in every modifier state bound, half of them to an action, plus sequences
+   on Ctrl and Alt letters. */
+void BuildLargeKeymap(std::mt19937 &random, CKeymap &keymap)
+{
+    std::vector<KeyBinding> bindings;
+    for (unsigned modifiers = 0; modifiers < KEYMAP_MODIFIER_STATES; ++modifiers) {
+        for (unsigned keycode = 1; keycode < KEYMAP_KEYS; ++keycode) {
+            KeyBinding binding;
+            memset(&binding, 0, sizeof(binding));
+            binding.keycode = static_cast<uint8_t>(keycode);
+            binding.modifiers = static_cast<uint8_t>(modifiers);
+            binding.modifierMask = KEYMOD_SHIFT | KEYMOD_CONTROL | KEYMOD_ALT | KEYMOD_WIN;
+            binding.consume = (random() % 4) == 0;
+            binding.repeat = (random() % 2) == 0;
+            if (random() % 2) {
+                binding.pressAction = static_cast<uint16_t>(ACTION_SHOW_HOOK + random() % 3);
+            }
+            bindings.push_back(binding);
+        }
+    }
+
+    std::vector<SequenceBinding> sequences;
+    for (unsigned i = 0; i < 5000; ++i) {
+        SequenceBinding sequence;
+        memset(&sequence, 0, sizeof(sequence));
+        sequence.length = static_cast<uint8_t>(2 + random() % 2);
+        unsigned modifiers = (random() % 4) ? KEYMOD_CONTROL : KEYMOD_ALT;
+        for (unsigned n = 0; n < sequence.length; ++n) {
+            sequence.strokes[n] = MakeStroke(modifiers, static_cast<uint8_t>(VKEY_A + random() % 26));
+        }
+        sequence.action = ACTION_SHOW_FISH;
+        sequences.push_back(sequence);
+    }
+    KeymapSource source;
+    source.bindings = bindings.data();
+    source.bindingCount = bindings.size();
+    source.sequences = sequences.data();
+    source.sequenceCount = sequences.size();
+    keymap.Compile(source);
+}
+
+} // namespace
+
+int main()
+{
+    static size_t const EVENTS = 1000000;
+    static char const extraBindings[] =
+        "Ctrl+K,Ctrl+C   press=fish\n"
+        "Ctrl+K,Ctrl+U   press=hook\n"
+        "J&K             press=bait\n"
+        "J&L             press=fish\n"
+        "*+Left          press=fish release=hook repeat\n"
+        "*+Right         press=fish release=hook\n"
+        "*+X             press=bait repeat\n"
+        "*+W             press=fish release=hook\n"
+        "*+Space         press=bait\n";
+    std::string keymapText = std::string(g_defaultKeymap, g_defaultKeymapLength) + extraBindings;
+
+    std::mt19937 random(12345);
+    Workload workloads[4];
+    workloads[0].name = "typing";
+    workloads[0].large = false;
+    GenerateTyping(EVENTS, random, workloads[0].events);
+    workloads[1].name = "autorepeat";
+    workloads[1].large = false;
+    GenerateAutorepeat(EVENTS, random, workloads[1].events);
+    workloads[2].name = "chording";
+    workloads[2].large = false;
+    GenerateChording(EVENTS, random, workloads[2].events);
+    workloads[3].name = "large";
+    workloads[3].large = true;
+    GenerateTyping(EVENTS, random, workloads[3].events);
+
+    CCacheMissCounter cacheMisses;
+    printf("%-12s %10s %10s %12s %14s %10s\n", "workload", "events", "ns/event", "allocs/event", "misses/event", "actions");
+    for (unsigned w = 0; w < sizeof(workloads) / sizeof(workloads[0]); ++w) {
+        Workload const &workload = workloads[w];
+        CKeymap keymap;
+        if (workload.large) {
+            BuildLargeKeymap(random, keymap);
+        } else {
+            KeymapError error;
+            if (!keymap.Load(keymapText.data(), keymapText.size(), g_actionNames, g_actionNameCount, &error)) {
+                printf("Keymap line %u: %s\n", error.line, error.message);
+                return 1;
+            }
+        }
+
+        // An untimed run through part of the workload first, so that the keymap is warm,
+        // as it is in a running app.
+        {
+            CKeyEngine engine;
+            engine.SetKeymap(&keymap);
+            CDispatcher dispatcher(engine);
+            for (size_t i = 0; i < workload.events.size() / 10; ++i) {
+                dispatcher.ProcessKey(workload.events[i]);
+            }
+        }
+
+        CKeyEngine engine;
+        engine.SetKeymap(&keymap);
+        CDispatcher dispatcher(engine);
+
+        uint64_t allocations = GetAllocationCount();
+        cacheMisses.Start();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < workload.events.size(); ++i) {
+            dispatcher.ProcessKey(workload.events[i]);
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        cacheMisses.Stop();
+        allocations = GetAllocationCount() - allocations;
+
+        double events = static_cast<double>(workload.events.size());
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        char misses[32];
+        if (cacheMisses.IsAvailable()) {
+            snprintf(misses, sizeof(misses), "%.3f", static_cast<double>(cacheMisses.Read()) / events);
+        } else {
+            snprintf(misses, sizeof(misses), "n/a");
+        }
+        printf("%-12s %10zu %10.1f %12.3f %14s %10u\n", workload.name, workload.events.size(), ns / events,
+            static_cast<double>(allocations) / events, misses, dispatcher.GetActionCount());
+    }
+    return 0;
+}
@@ -0,0 +1,335 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Drives the Linux daemon's input path end to end: raw input_events written to a pipe,
+   read as a fake device by CEvdevInput, handled by CLinuxKeyboardHook and written by
+   CUinputOutput to a temporary file in place of the uinput device. It checks, for each
+   scenario, exactly which key events come out and which actions run:
+
+     - a bound key is swallowed, press and release; one bound with "pass" and an unbound
+       one come out untouched
+     - a completed sequence runs its action and types nothing
+     - a sequence broken off by another key replays its keys, then that key, in order
+     - a sequence that times out replays its keys when the deadline passes
+     - a chord runs its action whichever key goes down first, and a lone chord key is
+       replayed
+
+   then pushes a million keys through the pipe and reports keys per second. Built by the
+   CMake build as EvdevBench, and only does anything where the daemon's hook is built. */
+#include <stdio.h>
+#ifdef BENCH_LINUX_HOOK
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "EvdevInput.h"
+#include "EvdevKeys.h"
+#include "Keymap.h"
+#include "KeyEngine.h"
+#include "LinuxKeyboardHook.h"
+#include "UinputOutput.h"
+#endif
+
+#ifdef BENCH_LINUX_HOOK
+
+namespace {
+
+enum bench_actions {
+    ACTION_FISH = 1,
+    ACTION_BAIT,
+    ACTION_HOOK,
+    ACTION_LINE,
+};
+
+KeymapActionName const g_actions[] = {
+    { "fish", ACTION_FISH },
+    { "bait", ACTION_BAIT },
+    { "hook", ACTION_HOOK },
+    { "line", ACTION_LINE },
+};
+
+char const s_keymapText[] =
+    "*+A press=fish release=bait\n"
+    "*+B press=bait pass\n"
+    "K,C press=hook timeout=300\n"
+    "J&L press=line timeout=300\n";
+
+uint32_t const SEQUENCE_TIMEOUT = 300;
+
+/* Keys as letters: upper case goes down, lower case comes up. */
+struct Scenario
+{
+    char const *name;
+    char const *input;
+    bool timeout;           // let the sequence deadline pass afterwards
+    char const *output;     // the keys that should come out
+    uint16_t actions[4];    // the actions that should run, 0-terminated
+};
+
+Scenario const g_scenarios[] = {
+    { "swallowed", "Aa", false, "", { ACTION_FISH, ACTION_BAIT } },
+    { "passed", "Bb", false, "Bb", { ACTION_BAIT } },
+    { "unbound", "Zz", false, "Zz", { 0 } },
+    { "sequence", "KkCc", false, "", { ACTION_HOOK } },
+    { "sequence broken off", "KkXx", false, "KkXx", { 0 } },
+    { "sequence timed out", "Kk", true, "Kk", { 0 } },
+    { "chord", "JLjl", false, "", { ACTION_LINE } },
+    { "chord, other way round", "LJlj", false, "", { ACTION_LINE } },
+    { "lone chord key", "Jj", true, "Jj", { 0 } },
+};
+
+struct Recorder
+{
+    std::vector<uint16_t> actions;
+};
+
+void RecordAction(void *context, KeyEvent const &event)
+{
+    if (event.action) {
+        static_cast<Recorder *>(context)->actions.push_back(event.action);
+    }
+}
+
+/* Everything a scenario needs: the pipe, the fake device, the hook and its output. */
+class CRig
+{
+public:
+    CRig() : m_hook(m_engine, m_output), m_write(-1), m_file(nullptr), m_read(0), m_time(1000000) {}
+
+    ~CRig()
+    {
+        if (m_write >= 0) {
+            close(m_write);
+        }
+        if (m_file) {
+            fclose(m_file);
+        }
+    }
+
+    bool Open(CKeymap const &keymap)
+    {
+        int fds[2];
+        m_file = tmpfile();
+        if (!m_file || (pipe(fds) != 0) || !m_input.Open(nullptr) || !m_input.AddFakeDevice(fds[0], "fake") ||
+            !m_output.Attach(dup(fileno(m_file)))) {
+            return false;
+        }
+        m_write = fds[1];
+        m_engine.SetKeymap(&keymap);
+        m_hook.SetActionHandler(RecordAction, &m_recorder);
+        return true;
+    }
+
+    /* Write events to the pipe, a SYN_REPORT after each key, and let the hook have them. */
+    bool Type(std::vector<struct input_event> const &keys)
+    {
+        std::vector<struct input_event> events;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            events.push_back(keys[i]);
+            struct input_event sync = keys[i];
+            sync.type = EV_SYN;
+            sync.code = SYN_REPORT;
+            sync.value = 0;
+            events.push_back(sync);
+        }
+        // Half a pipe's worth at a time, so writing never blocks.
+        size_t const chunk = 2048;
+        for (size_t first = 0; first < events.size(); first += chunk) {
+            size_t count = (events.size() - first < chunk) ? events.size() - first : chunk;
+            size_t bytes = count * sizeof(struct input_event);
+            if (write(m_write, &events[first], bytes) != static_cast<ssize_t>(bytes)) {
+                return false;
+            }
+            size_t delivered = 0;
+            while (delivered < count) {
+                int result = m_input.Wait(1000, m_hook);
+                if (result <= 0) {
+                    return false;
+                }
+                delivered += static_cast<size_t>(result);
+            }
+        }
+        return true;
+    }
+
+    struct input_event MakeKey(char key)
+    {
+        struct input_event event;
+        memset(&event, 0, sizeof(event));
+        m_time += 20;
+        event.time.tv_sec = static_cast<time_t>(m_time / 1000);
+        event.time.tv_usec = static_cast<suseconds_t>(m_time % 1000 * 1000);
+        event.type = EV_KEY;
+        event.code = EvdevFromVirtualKey(static_cast<uint8_t>((key >= 'a') ? key - 'a' + 'A' : key));
+        event.value = (key >= 'a') ? 0 : 1;
+        return event;
+    }
+
+    void PassDeadline()
+    {
+        uint32_t deadline;
+        if (m_engine.GetSequenceDeadline(deadline)) {
+            m_time = deadline + 1;
+            m_hook.ProcessTimeout(deadline + 1);
+        } else {
+            m_time += SEQUENCE_TIMEOUT + 1;
+        }
+    }
+
+    /* The keys written since the last call, as letters, upper case for down. The output
+       shares the file's offset, so it's read from where the last call left off. */
+    std::string TakeOutput()
+    {
+        std::string keys;
+        struct input_event event;
+        while (pread(fileno(m_file), &event, sizeof(event), m_read) == static_cast<ssize_t>(sizeof(event))) {
+            m_read += static_cast<off_t>(sizeof(event));
+            if (event.type != EV_KEY) {
+                continue;
+            }
+            char key = '?';
+            for (char c = 'A'; c <= 'Z'; ++c) {
+                if (EvdevFromVirtualKey(static_cast<uint8_t>(c)) == event.code) {
+                    key = c;
+                }
+            }
+            keys += event.value ? key : static_cast<char>(key - 'A' + 'a');
+        }
+        return keys;
+    }
+
+    std::vector<uint16_t> TakeActions()
+    {
+        std::vector<uint16_t> actions;
+        actions.swap(m_recorder.actions);
+        return actions;
+    }
+
+private:
+    CKeyEngine m_engine;
+    CUinputOutput m_output;
+    CEvdevInput m_input;
+    CLinuxKeyboardHook m_hook;
+    Recorder m_recorder;
+    int m_write;
+    FILE *m_file;
+    off_t m_read;
+    uint64_t m_time;    // ms
+};
+
+bool RunScenarios(CKeymap const &keymap)
+{
+    CRig rig;
+    if (!rig.Open(keymap)) {
+        printf("Can't set up the pipe and the output file\n");
+        return false;
+    }
+    size_t failures = 0;
+    for (size_t i = 0; i < sizeof(g_scenarios) / sizeof(g_scenarios[0]); ++i) {
+        Scenario const &scenario = g_scenarios[i];
+        std::vector<struct input_event> keys;
+        for (char const *key = scenario.input; *key; ++key) {
+            keys.push_back(rig.MakeKey(*key));
+        }
+        if (!rig.Type(keys)) {
+            printf("%s: the fake device didn't deliver\n", scenario.name);
+            return false;
+        }
+        if (scenario.timeout) {
+            rig.PassDeadline();
+        }
+        std::string output = rig.TakeOutput();
+        std::vector<uint16_t> actions = rig.TakeActions();
+        std::vector<uint16_t> expected;
+        for (size_t a = 0; (a < 4) && scenario.actions[a]; ++a) {
+            expected.push_back(scenario.actions[a]);
+        }
+        bool ok = (output == scenario.output) && (actions == expected);
+        printf("%-24s %-6s -> %-6s %zu action%s%s\n", scenario.name, scenario.input, output.c_str(), actions.size(),
+            (actions.size() == 1) ? "" : "s", ok ? "" : "  WRONG");
+        failures += ok ? 0 : 1;
+    }
+    return failures == 0;
+}
+
+bool RunThroughput(CKeymap const &keymap)
+{
+    CRig rig;
+    if (!rig.Open(keymap)) {
+        printf("Can't set up the pipe and the output file\n");
+        return false;
+    }
+    // Unbound and passed keys, so that every one is read, decided and written.
+    static char const text[] = "ZzBbXxYy";
+    size_t const KEYS = 1000000;
+    std::vector<struct input_event> keys;
+    for (size_t i = 0; i < KEYS; ++i) {
+        keys.push_back(rig.MakeKey(text[i % 8]));
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool ok = rig.Type(keys);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t written = rig.TakeOutput().size();
+    ok = ok && (written == KEYS);
+    printf("throughput: %zu keys in, %zu out, %.1f M keys/s through the pipe, hook and output\n", KEYS, written,
+        KEYS / seconds / 1e6);
+    return ok;
+}
+
+} // namespace
+
+int main()
+{
+    CKeymap keymap;
+    KeymapError error;
+    if (!keymap.Load(s_keymapText, sizeof(s_keymapText) - 1, g_actions, sizeof(g_actions) / sizeof(g_actions[0]), &error)) {
+        printf("Keymap line %u: %s\n", error.line, error.message);
+        return 1;
+    }
+    bool ok = RunScenarios(keymap);
+    ok = RunThroughput(keymap) && ok;
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
+
+#else
+
+int main()
+{
+    printf("EvdevBench needs the Linux daemon's hook\n");
+    return 0;
+}
+
+#endif
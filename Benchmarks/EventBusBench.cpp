@@ -0,0 +1,371 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* The event bus that hands action events to the app and to handler plugins (see
+   EventBus.h). For buses of up to 64 handlers with random priorities, interests and
+   appetites, it checks that:
+
+     - every event reaches exactly the handlers a plain loop over them in priority order
+       says it should, in that order, stopping at the first that consumes it
+     - that still holds as handlers are removed and added again
+     - through CAppController, a handler above the app's priority sees events first and
+       can keep the app from acting on them, one below sees only what the app leaves
+       alone, and keys bound to press=plugin are left alone by the app
+
+   and reports nanoseconds per event against the number of handlers, when each handler
+   wants a few keys and when they all want every key, for the bus and for a loop that
+   tests every handler's mask in turn. Where the example plugin is built, it also loads it
+   through the C ABI, checks what it consumes, and times events through it. Built by the
+   CMake build as EventBusBench. */
+#include "BenchSupport.h"
+#include "AppActions.h"
+#include "AppController.h"
+#include "EventBus.h"
+#include "LatencyHistogram.h"
+#include "PluginLibrary.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace {
+
+size_t const CHECKED_EVENTS = 200000;
+size_t const TIMED_EVENTS = 2000000;
+
+/* A handler that records its calls and consumes every appetite-th key code. */
+struct TestHandler
+{
+    unsigned index;
+    int32_t priority;
+    uint64_t interest[4];
+    unsigned appetite;      // 0 for none
+    EventHandlerId id;
+    std::vector<unsigned> *calls;
+    uint64_t callCount;
+};
+
+int HandleTestEvent(void *context, CaptainHookEvent const *event)
+{
+    TestHandler *handler = static_cast<TestHandler *>(context);
+    ++handler->callCount;
+    if (handler->calls) {
+        handler->calls->push_back(handler->index);
+    }
+    return (handler->appetite && ((event->keycode % handler->appetite) == 0)) ? 1 : 0;
+}
+
+bool Wants(TestHandler const &handler, uint8_t keycode)
+{
+    return ((handler.interest[keycode >> 6] >> (keycode & 63)) & 1) != 0;
+}
+
+/* Handlers with random priorities (often equal), each wanting keyCount keys (all of them
+   for 256) and consuming some of them. */
+std::vector<TestHandler> MakeHandlers(size_t count, unsigned keyCount, bool consume, std::mt19937 &random)
+{
+    std::vector<TestHandler> handlers(count);
+    for (size_t i = 0; i < count; ++i) {
+        TestHandler &handler = handlers[i];
+        handler.index = static_cast<unsigned>(i);
+        handler.priority = static_cast<int32_t>(random() % 9) - 4;
+        memset(handler.interest, 0, sizeof(handler.interest));
+        for (unsigned k = 0; k < keyCount; ++k) {
+            unsigned keycode = (keyCount >= 256) ? k : random() % 256;
+            handler.interest[keycode >> 6] |= 1ull << (keycode & 63);
+        }
+        handler.appetite = consume ? 3 + random() % 13 : 0;
+        handler.id = INVALID_EVENT_HANDLER;
+        handler.calls = nullptr;
+        handler.callCount = 0;
+    }
+    return handlers;
+}
+
+/* Which of the handlers added (in order) should see an event, and who consumes it, by
+   going through all of them. */
+void ExpectedCalls(std::vector<TestHandler> const &handlers, std::vector<size_t> const &added, uint8_t keycode,
+    std::vector<unsigned> &calls)
+{
+    std::vector<size_t> order = added;
+    std::stable_sort(order.begin(), order.end(),
+        [&handlers](size_t a, size_t b) { return handlers[a].priority > handlers[b].priority; });
+    calls.clear();
+    for (size_t i = 0; i < order.size(); ++i) {
+        TestHandler const &handler = handlers[order[i]];
+        if (!Wants(handler, keycode)) {
+            continue;
+        }
+        calls.push_back(handler.index);
+        if (handler.appetite && ((keycode % handler.appetite) == 0)) {
+            break;
+        }
+    }
+}
+
+bool CheckDispatch(size_t count, std::mt19937 &random)
+{
+    std::vector<TestHandler> handlers = MakeHandlers(count, 1 + random() % 40, true, random);
+    std::vector<unsigned> calls;
+    std::vector<unsigned> expected;
+    CEventBus bus;
+    std::vector<size_t> added;
+    for (size_t i = 0; i < count; ++i) {
+        handlers[i].calls = &calls;
+        handlers[i].id = bus.Add("test", handlers[i].priority, handlers[i].interest, HandleTestEvent, &handlers[i]);
+        added.push_back(i);
+    }
+    uint64_t consumed = 0;
+    for (size_t e = 0; e < CHECKED_EVENTS; ++e) {
+        if (((e % 10000) == 9999) && !added.empty()) {
+            // Take a handler off and put it back, so that it goes after its equals.
+            size_t which = random() % added.size();
+            size_t index = added[which];
+            bus.Remove(handlers[index].id);
+            added.erase(added.begin() + which);
+            handlers[index].id = bus.Add("test", handlers[index].priority, handlers[index].interest, HandleTestEvent,
+                &handlers[index]);
+            added.push_back(index);
+        }
+        KeyEvent event = { static_cast<uint32_t>(e), ACTION_PLUGIN, static_cast<uint8_t>(random()), KeyEvent::FLAG_DOWN };
+        calls.clear();
+        bool wasConsumed = bus.Dispatch(event);
+        ExpectedCalls(handlers, added, event.keycode, expected);
+        bool shouldConsume = !expected.empty() && handlers[expected.back()].appetite &&
+            ((event.keycode % handlers[expected.back()].appetite) == 0);
+        if ((calls != expected) || (wasConsumed != shouldConsume)) {
+            printf("%zu handlers: event %zu on key %02X reached %zu handlers, not %zu\n", count, e, event.keycode,
+                calls.size(), expected.size());
+            return false;
+        }
+        consumed += wasConsumed ? 1 : 0;
+    }
+    if ((bus.GetEventCount() != CHECKED_EVENTS) || (bus.GetConsumedCount() != consumed)) {
+        printf("%zu handlers: counted %llu events and %llu consumed\n", count,
+            static_cast<unsigned long long>(bus.GetEventCount()), static_cast<unsigned long long>(bus.GetConsumedCount()));
+        return false;
+    }
+    return true;
+}
+
+bool CheckController()
+{
+    CKeyEngine engine;
+    CNullSink sink;
+    COutputEngine output(sink);
+    CTimerWheel timers;
+    CRecordingFrontend frontend;
+    CAppController controller(engine, output, timers, frontend);
+
+    std::vector<unsigned> calls;
+    TestHandler before = { 1, CAPTAINHOOK_PRIORITY_APP + 1, { 0, 1ull << ('F' - 64), 0, 0 }, 2, 0, &calls, 0 };
+    TestHandler after = { 2, CAPTAINHOOK_PRIORITY_APP - 1, { ~0ull, ~0ull, ~0ull, ~0ull }, 0, 0, &calls, 0 };
+    CEventBus &bus = controller.GetEventBus();
+    bus.Add("before", before.priority, before.interest, HandleTestEvent, &before);
+    bus.Add("after", after.priority, after.interest, HandleTestEvent, &after);
+
+    struct Case
+    {
+        char const *name;
+        KeyEvent event;
+        unsigned icon;              // ICON_COUNT for none
+        unsigned submitted;
+        std::vector<unsigned> calls;
+    };
+    Case const cases[] = {
+        // 'F' is even: the handler before the app consumes it.
+        { "fish on F, taken first", { 0, ACTION_SHOW_FISH, 'F', KeyEvent::FLAG_DOWN }, ICON_COUNT, 0, { 1 } },
+        { "fish on A", { 0, ACTION_SHOW_FISH, 'A', KeyEvent::FLAG_DOWN }, ICON_FISH, 0, {} },
+        { "script on A", { 0, ACTION_RUN_SCRIPT, 'A', KeyEvent::FLAG_DOWN }, ICON_COUNT, 1, {} },
+        { "plugin on A", { 0, ACTION_PLUGIN, 'A', KeyEvent::FLAG_DOWN }, ICON_COUNT, 0, { 2 } },
+    };
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        Case const &c = cases[i];
+        frontend.Clear();
+        calls.clear();
+        controller.HandleKeyEvent(c.event, 0);
+        if ((frontend.GetLastIcon() != c.icon) || (frontend.m_submitted != c.submitted) || (calls != c.calls)) {
+            printf("Controller, %s: icon %u, %u submitted, %zu handler calls\n", c.name, frontend.GetLastIcon(),
+                frontend.m_submitted, calls.size());
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/* The obvious way: test each handler's mask in priority order. */
+struct MaskLoop
+{
+    struct Entry
+    {
+        uint64_t interest[4];
+        CaptainHookHandler handle;
+        void *context;
+    };
+    std::vector<Entry> handlers;
+
+    void Add(TestHandler &handler)
+    {
+        Entry entry;
+        memcpy(entry.interest, handler.interest, sizeof(entry.interest));
+        entry.handle = HandleTestEvent;
+        entry.context = &handler;
+        handlers.push_back(entry);
+    }
+
+    bool Dispatch(KeyEvent const &event)
+    {
+        CaptainHookEvent delivered = { event.time, event.action, event.keycode, event.flags };
+        for (size_t i = 0; i < handlers.size(); ++i) {
+            Entry const &entry = handlers[i];
+            if (((entry.interest[event.keycode >> 6] >> (event.keycode & 63)) & 1) &&
+                entry.handle(entry.context, &delivered)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+template <typename Dispatcher>
+double TimeDispatch(Dispatcher &dispatcher, std::vector<KeyEvent> const &events, uint64_t &checksum)
+{
+    uint64_t consumed = 0;
+    uint64_t start = LatencyClockNow();
+    for (size_t i = 0; i < events.size(); ++i) {
+        consumed += dispatcher.Dispatch(events[i]) ? 1 : 0;
+    }
+    double ns = static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / events.size();
+    checksum += consumed;
+    return ns;
+}
+
+#ifdef BENCH_PLUGIN
+bool CheckPlugin(std::vector<KeyEvent> events)
+{
+    CPluginLibrary library;
+    char const *error = nullptr;
+    if (!library.Load(BENCH_PLUGIN, &error)) {
+        printf("Plugin %s: %s\n", BENCH_PLUGIN, error);
+        return false;
+    }
+    CaptainHookPlugin const *plugin = library.GetPlugin();
+    CEventBus bus;
+    EventHandlerId id = bus.Add(plugin->name, plugin->priority, plugin->interest, plugin->handleEvent, plugin->context);
+
+    // F13 bound to press=plugin is its own; F12 isn't, and neither is F13 bound to
+    // anything else.
+    KeyEvent const f13 = { 0, ACTION_PLUGIN, VKEY_F1 + 12, 0 };
+    KeyEvent const f12 = { 0, ACTION_PLUGIN, VKEY_F1 + 11, 0 };
+    KeyEvent const fish = { 0, ACTION_SHOW_FISH, VKEY_F1 + 12, 0 };
+    bool ok = (id != INVALID_EVENT_HANDLER) && bus.Dispatch(f13) && !bus.Dispatch(f12) && !bus.Dispatch(fish);
+
+    // Not plugin actions, or it would print every one it consumes.
+    for (size_t i = 0; i < events.size(); ++i) {
+        events[i].action = ACTION_SHOW_HOOK;
+    }
+    uint64_t checksum = 0;
+    double ns = TimeDispatch(bus, events, checksum);
+    printf("Example plugin \"%s\": %s, %.1f ns per event\n", plugin->name, ok ? "ok" : "WRONG", ns);
+    bus.Remove(id);
+    return ok;
+}
+#endif
+
+} // namespace
+
+int main()
+{
+    std::mt19937 random(24);
+    bool ok = true;
+    static size_t const counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+    size_t countCount = sizeof(counts) / sizeof(counts[0]);
+    for (size_t c = 0; c < countCount; ++c) {
+        ok = CheckDispatch(counts[c], random) && ok;
+    }
+    {
+        // A full bus turns more away.
+        CEventBus bus;
+        uint64_t const none[4] = { 0, 0, 0, 0 };
+        for (unsigned i = 0; i < EVENTBUS_MAX_HANDLERS; ++i) {
+            bus.Add("full", 0, none, HandleTestEvent, nullptr);
+        }
+        ok = (bus.Add("one too many", 0, none, HandleTestEvent, nullptr) == INVALID_EVENT_HANDLER) && ok;
+    }
+    ok = CheckController() && ok;
+    printf("Dispatch to up to %u handlers against a plain loop: %s\n", EVENTBUS_MAX_HANDLERS, ok ? "ok" : "WRONG");
+
+    // Action events on random keys, none of them consumed, so that every interested
+    // handler is called.
+    std::vector<KeyEvent> events(TIMED_EVENTS);
+    for (size_t i = 0; i < TIMED_EVENTS; ++i) {
+        KeyEvent event = { static_cast<uint32_t>(i), ACTION_PLUGIN, static_cast<uint8_t>(random()), KeyEvent::FLAG_DOWN };
+        events[i] = event;
+    }
+    uint64_t checksum = 0;
+    printf("\nns per event, no handler consuming, each handler wanting 8 keys or all of them:\n");
+    printf("%9s %12s %12s %12s %12s\n", "handlers", "8 keys bus", "8 keys loop", "all bus", "all loop");
+    for (size_t c = 0; c < countCount; ++c) {
+        size_t count = counts[c];
+        double results[4];
+        for (int dense = 0; dense < 2; ++dense) {
+            std::vector<TestHandler> handlers = MakeHandlers(count, dense ? 256 : 8, false, random);
+            CEventBus bus;
+            for (size_t i = 0; i < count; ++i) {
+                bus.Add("test", handlers[i].priority, handlers[i].interest, HandleTestEvent, &handlers[i]);
+            }
+            std::stable_sort(handlers.begin(), handlers.end(),
+                [](TestHandler const &a, TestHandler const &b) { return a.priority > b.priority; });
+            MaskLoop loop;
+            for (size_t i = 0; i < count; ++i) {
+                loop.Add(handlers[i]);
+            }
+            TimeDispatch(bus, events, checksum);
+            results[dense * 2] = TimeDispatch(bus, events, checksum);
+            results[dense * 2 + 1] = TimeDispatch(loop, events, checksum);
+        }
+        printf("%9zu %12.1f %12.1f %12.1f %12.1f\n", count, results[0], results[1], results[2], results[3]);
+    }
+    printf("(checksum %llu)\n", static_cast<unsigned long long>(checksum));
+
+#ifdef BENCH_PLUGIN
+    ok = CheckPlugin(events) && ok;
+#endif
+
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Stress test for CEventQueue, the ring between the hook and the message loop. A
+   producer thread pushes numbered KeyEvents, in bursts now and then too big for the
+   ring, while the consumer pops them, sometimes stalling as the message loop would
+   behind a slow action. It checks that:
+
+     - a full ring refuses the next push and counts it dropped, and an empty one pops
+       nothing
+     - the consumer sees the numbers strictly in order, and every gap in them is an
+       event the producer was told it dropped
+     - pushed plus dropped is every attempt, everything pushed is popped, and the
+       high-water mark never passes the capacity (and reaches it if anything dropped)
+
+   and reports events per second through the ring. Built by the CMake build as
+   EventQueueBench. */
+#include "EventQueue.h"
+#include "KeyEvent.h"
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+
+namespace {
+
+size_t const CAPACITY = 1024;   // the key engine's
+uint32_t const EVENTS = 20000000;
+
+typedef CEventQueue<KeyEvent, CAPACITY> Queue;
+
+/* The sequence number rides in the time and action fields. */
+KeyEvent MakeEvent(uint32_t sequence)
+{
+    KeyEvent event = { sequence, static_cast<uint16_t>(sequence >> 16), static_cast<uint8_t>(sequence), KeyEvent::FLAG_DOWN };
+    return event;
+}
+
+bool RunEdges()
+{
+    Queue queue;
+    KeyEvent event;
+    bool ok = !queue.Pop(event) && queue.IsEmpty();
+    for (uint32_t i = 0; i < CAPACITY; ++i) {
+        ok = ok && queue.Push(MakeEvent(i));
+    }
+    ok = ok && !queue.Push(MakeEvent(CAPACITY)) && (queue.GetDroppedCount() == 1) &&
+        (queue.GetPushedCount() == CAPACITY) && (queue.GetHighWaterMark() == CAPACITY);
+    for (uint32_t i = 0; i < CAPACITY; ++i) {
+        ok = ok && queue.Pop(event) && (event.time == i);
+    }
+    ok = ok && !queue.Pop(event) && queue.IsEmpty() && queue.Push(MakeEvent(0));
+    printf("edges: %s\n", ok ? "full refuses and counts, empty pops nothing" : "wrong");
+    return ok;
+}
+
+bool RunStress()
+{
+    Queue queue;
+    std::atomic<bool> done(false);
+    uint32_t producerDropped = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::thread producer([&queue, &done, &producerDropped]() {
+        std::mt19937 random(1);
+        for (uint32_t sequence = 1; sequence <= EVENTS; ++sequence) {
+            if (!queue.Push(MakeEvent(sequence))) {
+                ++producerDropped;
+            }
+            // Now and then, a pause, as between keys.
+            if ((random() % 4096) == 0) {
+                std::this_thread::yield();
+            }
+        }
+        done.store(true, std::memory_order_release);
+    });
+
+    std::mt19937 random(2);
+    uint32_t popped = 0;
+    uint32_t last = 0;
+    uint32_t gaps = 0;
+    size_t disorders = 0;
+    KeyEvent event;
+    for (;;) {
+        bool finished = done.load(std::memory_order_acquire);
+        while (queue.Pop(event)) {
+            if (event.time <= last) {
+                ++disorders;
+            } else {
+                gaps += event.time - last - 1;
+            }
+            if ((event.action != static_cast<uint16_t>(event.time >> 16)) ||
+                (event.keycode != static_cast<uint8_t>(event.time))) {
+                ++disorders;
+            }
+            last = event.time;
+            ++popped;
+            // A slow action now and then lets the ring fill.
+            if ((random() % 65536) == 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        }
+        if (finished) {
+            break;
+        }
+    }
+    producer.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    gaps += EVENTS - last;
+
+    uint32_t pushed = queue.GetPushedCount();
+    uint32_t dropped = queue.GetDroppedCount();
+    uint32_t highWater = queue.GetHighWaterMark();
+    printf("%u events, %u popped, %u dropped (%u gaps), high water %u of %zu, %zu out of order\n",
+        EVENTS, popped, dropped, gaps, highWater, CAPACITY, disorders);
+    printf("%.1f M events/s through the ring\n", EVENTS / seconds / 1e6);
+    return (disorders == 0) && (pushed + dropped == EVENTS) && (popped == pushed) &&
+        (dropped == producerDropped) && (gaps == dropped) && (highWater <= CAPACITY) &&
+        (!dropped || (highWater == CAPACITY));
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = RunEdges();
+    ok = RunStress() && ok;
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
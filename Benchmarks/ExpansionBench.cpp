@@ -0,0 +1,266 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Measures the text-expansion matcher as the number of abbreviations grows. Built by the
+   CMake build as ExpansionBench.
+
+   Each run generates random abbreviations (half of them behind a ';', as people tend to
+   write them) and a stream of random words with some of the abbreviations mixed in, then
+   reports nanoseconds per character three ways: a straightforward matcher that looks up
+   every suffix of the last few characters typed in a hash map, the Aho-Corasick table on
+   its own, and the whole hook path, with the text typed as key events through a
+   CKeyEngine. The automaton's cost should stay flat however many abbreviations there are
+   (apart from cache misses as the table outgrows the caches); the suffix lookups cost
+   one hash per possible abbreviation length on every key.
+
+   It also checks that the automaton finds exactly the matches the suffix lookups do, and
+   still does from a saved image, and that typing allocates nothing. */
+#include "BenchSupport.h"
+#include "KeyEngine.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+size_t const TEXT_LENGTH = 4000000;
+size_t const MACROS = 1000;
+
+void GenerateAbbreviations(size_t count, std::mt19937 &random, std::vector<ExpansionBinding> &expansions)
+{
+    expansions.clear();
+    for (size_t i = 0; i < count; ++i) {
+        ExpansionBinding expansion;
+        memset(&expansion, 0, sizeof(expansion));
+        unsigned length = 3 + random() % 6;
+        unsigned n = 0;
+        if (i % 2 == 0) {
+            expansion.text[n++] = ';';
+        }
+        while (n < length) {
+            expansion.text[n++] = static_cast<char>('a' + random() % 26);
+        }
+        expansion.length = static_cast<uint8_t>(length);
+        expansion.action = static_cast<uint16_t>(KEYMAP_MACRO_FIRST + i % MACROS);
+        expansions.push_back(expansion);
+    }
+}
+
+/* Words of two to nine letters, with an abbreviation in place of one word in fifty. */
+void GenerateText(std::vector<ExpansionBinding> const &expansions, std::mt19937 &random, std::string &text)
+{
+    text.clear();
+    while (text.size() < TEXT_LENGTH) {
+        if (!expansions.empty() && (random() % 50 == 0)) {
+            ExpansionBinding const &expansion = expansions[random() % expansions.size()];
+            text.append(expansion.text, expansion.length);
+        } else {
+            unsigned length = 2 + random() % 8;
+            for (unsigned n = 0; n < length; ++n) {
+                text.push_back(static_cast<char>('a' + random() % 26));
+            }
+        }
+        text.push_back((random() % 12 == 0) ? '.' : ' ');
+    }
+}
+
+/* The obvious way: remember the last few characters typed and look each of their
+   suffixes up, longest first. Returns the number of matches and their checksum. */
+size_t MatchBySuffix(std::vector<ExpansionBinding> const &expansions, std::string const &text, uint64_t &checksum)
+{
+    std::unordered_map<std::string, uint16_t> abbreviations;
+    for (size_t i = 0; i < expansions.size(); ++i) {
+        abbreviations[std::string(expansions[i].text, expansions[i].length)] = expansions[i].action;
+    }
+
+    size_t matches = 0;
+    checksum = 0;
+    std::string typed;
+    std::string suffix;
+    for (size_t i = 0; i < text.size(); ++i) {
+        typed.push_back(text[i]);
+        if (typed.size() > EXPANSION_MAX_LENGTH) {
+            typed.erase(0, 1);
+        }
+        for (size_t length = typed.size(); length > 0; --length) {
+            suffix.assign(typed, typed.size() - length, length);
+            std::unordered_map<std::string, uint16_t>::const_iterator found = abbreviations.find(suffix);
+            if (found != abbreviations.end()) {
+                ++matches;
+                checksum = checksum * 31 + i * 7 + found->second;
+                typed.clear();
+                break;
+            }
+        }
+    }
+    return matches;
+}
+
+size_t MatchByTable(CExpansionTable const &table, std::string const &text, uint64_t &checksum)
+{
+    CExpansionMatcher matcher;
+    matcher.SetTable(&table);
+    size_t matches = 0;
+    checksum = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        uint16_t action = matcher.Type(text[i]);
+        if (action != 0) {
+            ++matches;
+            checksum = checksum * 31 + i * 7 + action;
+        }
+    }
+    return matches;
+}
+
+/* The text as key presses and releases (it has no capitals, so no Shift). */
+void GenerateKeys(std::string const &text, std::vector<KeyEvent> &events)
+{
+    events.clear();
+    uint32_t time = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        uint8_t keycode = static_cast<uint8_t>(CKeymap::StrokeFromCharacter(text[i]));
+        KeyEvent press = { time, 0, keycode, KeyEvent::FLAG_DOWN };
+        events.push_back(press);
+        KeyEvent release = { time + 5, 0, keycode, 0 };
+        events.push_back(release);
+        time += 30;
+    }
+}
+
+double NanosecondsSince(std::chrono::steady_clock::time_point start, size_t count)
+{
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / static_cast<double>(count);
+}
+
+} // namespace
+
+int main()
+{
+    static size_t const abbreviationCounts[] = { 100, 1000, 10000, 50000, 100000 };
+
+    // Every abbreviation's macro just types a key, and they take turns at the macros.
+    std::vector<KeymapMacro> macros;
+    std::vector<uint16_t> macroStrokes(1, MakeStroke(0, VKEY_F1));
+    for (size_t i = 0; i < MACROS; ++i) {
+        KeymapMacro macro = { 0, 1, 0 };
+        macros.push_back(macro);
+    }
+
+    std::mt19937 random(12345);
+    bool ok = true;
+    printf("%8s %8s %8s %10s %10s %10s %8s %8s\n",
+        "abbrevs", "states", "KB", "suffix ns", "table ns", "engine ns", "matches", "allocs");
+    for (size_t c = 0; c < sizeof(abbreviationCounts) / sizeof(abbreviationCounts[0]); ++c) {
+        std::vector<ExpansionBinding> expansions;
+        GenerateAbbreviations(abbreviationCounts[c], random, expansions);
+        std::string text;
+        GenerateText(expansions, random, text);
+
+        CKeymap keymap;
+        KeymapSource source;
+        source.macros = macros.data();
+        source.macroCount = macros.size();
+        source.macroStrokes = macroStrokes.data();
+        source.macroStrokeCount = macroStrokes.size();
+        source.expansions = expansions.data();
+        source.expansionCount = expansions.size();
+        if (!keymap.Compile(source)) {
+            printf("Failed to compile %zu abbreviations\n", expansions.size());
+            return 1;
+        }
+        CExpansionTable const &table = keymap.GetExpansions();
+
+        uint64_t suffixChecksum;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        size_t suffixMatches = MatchBySuffix(expansions, text, suffixChecksum);
+        double suffixNs = NanosecondsSince(start, text.size());
+
+        uint64_t tableChecksum;
+        start = std::chrono::steady_clock::now();
+        size_t tableMatches = MatchByTable(table, text, tableChecksum);
+        double tableNs = NanosecondsSince(start, text.size());
+        if ((tableMatches != suffixMatches) || (tableChecksum != suffixChecksum)) {
+            printf("%zu abbreviations: the table found %zu matches, the suffix lookups %zu\n",
+                expansions.size(), tableMatches, suffixMatches);
+            ok = false;
+        }
+
+        // The same again, from a saved image.
+        std::vector<uint8_t> image;
+        table.WriteImage(image);
+        std::vector<uint64_t> aligned((image.size() + 7) / 8);
+        memcpy(aligned.data(), image.data(), image.size());
+        CExpansionTable attached;
+        uint64_t attachedChecksum = 0;
+        if (!attached.AttachImage(aligned.data(), image.size()) ||
+            (MatchByTable(attached, text, attachedChecksum) != tableMatches) || (attachedChecksum != tableChecksum)) {
+            printf("%zu abbreviations: the image doesn't match the same\n", expansions.size());
+            ok = false;
+        }
+
+        // The whole hook path. The queue is drained as the consumer would, which also
+        // counts the matches it saw.
+        std::vector<KeyEvent> keys;
+        GenerateKeys(text, keys);
+        CKeyEngine engine;
+        engine.SetKeymap(&keymap);
+        size_t engineMatches = 0;
+        uint64_t allocations = GetAllocationCount();
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (engine.ProcessKey(keys[i]) & CKeyEngine::RESULT_WAKE) {
+                engine.BeginDrain();
+                KeyEvent event;
+                while (engine.PopEvent(event)) {
+                    engineMatches += IsKeymapMacro(event.action) ? 1 : 0;
+                }
+            }
+        }
+        double engineNs = NanosecondsSince(start, text.size());
+        allocations = GetAllocationCount() - allocations;
+        if ((engineMatches != tableMatches) || (engine.GetExpansionCount() != tableMatches) || (allocations != 0)) {
+            printf("%zu abbreviations: the engine queued %zu expansions (counted %u) for %zu matches, with %llu allocations\n",
+                expansions.size(), engineMatches, engine.GetExpansionCount(), tableMatches,
+                static_cast<unsigned long long>(allocations));
+            ok = false;
+        }
+
+        printf("%8zu %8zu %8zu %10.1f %10.1f %10.1f %8zu %8llu\n", expansions.size(), table.GetStateCount(),
+            image.size() / 1024, suffixNs, tableNs, engineNs, tableMatches, static_cast<unsigned long long>(allocations));
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Checks CIconUpdateCoalescer against a backend that counts its calls and can be told to
+   fail:
+
+     - a request for the icon already on screen (or already pending) never reaches the
+       backend
+     - the first change after a quiet spell goes straight through, and a burst within a
+       frame after it becomes a single update, with the burst's last icon
+     - a burst that ends on the icon already shown costs nothing at all
+     - frame timing holds across the millisecond clock wrapping
+     - a failed update stays pending and is retried a frame later, not sooner
+
+   then drives it with a random stream of requests and flushes, checking that the backend
+   is never called twice within a frame and always ends up showing the last icon asked
+   for. It reports the backend calls saved and the cost of a request. Built by the CMake
+   build as IconCoalescerBench. */
+#include "IconUpdateCoalescer.h"
+#include "LatencyHistogram.h"
+#include <stdio.h>
+#include <random>
+
+namespace {
+
+uint32_t const FRAME = CIconUpdateCoalescer::DEFAULT_FRAME_INTERVAL;
+
+class CCountingBackend : public IIconBackend
+{
+public:
+    CCountingBackend() : m_calls(0), m_failures(0), m_shown(0), m_lastCall(0), m_tooSoon(0), m_now(0) {}
+
+    virtual bool ShowIcon(uintptr_t icon)
+    {
+        if (m_calls && (m_now - m_lastCall < FRAME)) {
+            ++m_tooSoon;
+        }
+        ++m_calls;
+        m_lastCall = m_now;
+        if (m_failures) {
+            --m_failures;
+            return false;
+        }
+        m_shown = icon;
+        return true;
+    }
+
+    unsigned m_calls;
+    unsigned m_failures;    // how many calls to come fail
+    uintptr_t m_shown;
+    uint32_t m_lastCall;
+    unsigned m_tooSoon;
+    uint32_t m_now;         // the time the coalescer is being called with
+};
+
+bool Check(bool condition, char const *what)
+{
+    if (!condition) {
+        printf("%s: wrong\n", what);
+    }
+    return condition;
+}
+
+bool RunRedundant()
+{
+    CCountingBackend backend;
+    CIconUpdateCoalescer coalescer(backend);
+    coalescer.SetShownIcon(1);
+    bool ok = Check(!coalescer.SetIcon(1, 100) && (backend.m_calls == 0) && (coalescer.GetRedundantCount() == 1),
+        "redundant, shown");
+    coalescer.SetIcon(2, 100);
+    coalescer.SetIcon(3, 101);
+    coalescer.SetIcon(3, 102);
+    ok = Check((backend.m_calls == 1) && (coalescer.GetRedundantCount() == 2), "redundant, pending") && ok;
+    printf("redundant: %u requests, %u redundant, %u backend calls\n", coalescer.GetRequestCount(),
+        coalescer.GetRedundantCount(), backend.m_calls);
+    return ok;
+}
+
+bool RunBurst()
+{
+    CCountingBackend backend;
+    CIconUpdateCoalescer coalescer(backend);
+    coalescer.SetShownIcon(1);
+
+    // The first change goes straight through.
+    bool ok = Check(!coalescer.SetIcon(2, 1000) && (backend.m_calls == 1) && (backend.m_shown == 2), "first change");
+
+    // Then 100 within the frame wait for it, and go as one.
+    for (unsigned i = 0; i < 100; ++i) {
+        coalescer.SetIcon(3 + (i % 5), 1001 + (i % (FRAME - 1)));
+    }
+    ok = Check((backend.m_calls == 1) && (coalescer.GetFlushDelay(1010) == FRAME - 10), "burst held") && ok;
+    ok = Check(coalescer.Flush(1000 + FRAME - 1) && (backend.m_calls == 1), "flush too soon") && ok;
+    ok = Check(!coalescer.Flush(1000 + FRAME) && (backend.m_calls == 2) && (backend.m_shown == 3 + (99 % 5)), "burst") && ok;
+
+    // A burst that ends where it started costs nothing.
+    coalescer.SetIcon(9, 1020);
+    coalescer.SetIcon(3 + (99 % 5), 1021);
+    ok = Check(!coalescer.IsPending() && (coalescer.GetFlushDelay(1021) == CIconUpdateCoalescer::NO_FLUSH_PENDING) &&
+        !coalescer.Flush(1100) && (backend.m_calls == 2), "burst cancelled out") && ok;
+    printf("bursts: %u requests, %u coalesced, %u backend calls\n", coalescer.GetRequestCount(),
+        coalescer.GetCoalescedCount(), backend.m_calls);
+    return ok;
+}
+
+bool RunWrap()
+{
+    CCountingBackend backend;
+    CIconUpdateCoalescer coalescer(backend);
+    uint32_t start = 0xFFFFFFF8;
+    coalescer.SetIcon(1, start);
+    bool ok = Check(coalescer.SetIcon(2, start + 10) && (coalescer.GetFlushDelay(start + 10) == FRAME - 10), "wrap, held");
+    ok = Check(coalescer.Flush(start + FRAME - 1) && (backend.m_calls == 1), "wrap, too soon") && ok;
+    ok = Check(!coalescer.Flush(start + FRAME) && (backend.m_calls == 2) && (backend.m_shown == 2), "wrap, flushed") && ok;
+    printf("wrap: frame held across 0x%08X to 0x%08X\n", start, start + FRAME);
+    return ok;
+}
+
+bool RunFailure()
+{
+    CCountingBackend backend;
+    CIconUpdateCoalescer coalescer(backend);
+    backend.m_failures = 2;
+    bool ok = Check(coalescer.SetIcon(1, 0) && (backend.m_calls == 1) && coalescer.IsPending(), "failed update pending");
+    ok = Check(coalescer.Flush(FRAME - 1) && (backend.m_calls == 1), "no retry within the frame") && ok;
+    ok = Check(coalescer.Flush(FRAME) && (backend.m_calls == 2), "retried and failed again") && ok;
+    ok = Check(!coalescer.Flush(2 * FRAME) && (backend.m_calls == 3) && (coalescer.GetShownIcon() == 1) &&
+        (backend.m_shown == 1), "retried") && ok;
+    printf("failure: shown after %u backend calls, two of them failed\n", backend.m_calls);
+    return ok;
+}
+
+bool RunRandom()
+{
+    std::mt19937 random(3);
+    CCountingBackend backend;
+    CIconUpdateCoalescer coalescer(backend);
+    CLatencyHistogram requests;
+    uint32_t now = 0xFFF00000;      // wraps part way through
+    uintptr_t last = 0;
+    for (unsigned i = 0; i < 2000000; ++i) {
+        now += (random() % 8 == 0) ? random() % 200 : random() % 3;
+        backend.m_now = now;
+        backend.m_failures += (random() % 1000 == 0) ? 1 : 0;
+        if (random() % 4) {
+            last = 1 + random() % 3;
+            uint64_t start = LatencyClockNow();
+            coalescer.SetIcon(last, now);
+            requests.RecordTicks(start);
+        } else {
+            coalescer.Flush(now);
+        }
+    }
+    backend.m_failures = 0;
+    now += FRAME;
+    backend.m_now = now;
+    coalescer.Flush(now);
+    bool ok = Check((backend.m_tooSoon == 0) && (backend.m_shown == last) && !coalescer.IsPending(), "random stream");
+    printf("random: %u requests, %u redundant, %u coalesced, %u backend calls, %.0f ns a request (median)\n",
+        coalescer.GetRequestCount(), coalescer.GetRedundantCount(), coalescer.GetCoalescedCount(), backend.m_calls,
+        static_cast<double>(requests.GetValueAtPercentile(50.0)));
+    return ok;
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = RunRedundant();
+    ok = RunBurst() && ok;
+    ok = RunWrap() && ok;
+    ok = RunFailure() && ok;
+    ok = RunRandom() && ok;
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,291 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Checks the keymap's parser and compiler, and through the key engine what the hook
+   does with the result:
+
+     - bad lines are rejected with the line they're on and the word that's wrong, and
+       leave the keymap as it was
+     - where bindings overlap, the one that names more modifiers wins, and between
+       equally specific ones the later line
+     - a binding without '*' applies only with exactly its modifiers held, and with '*'
+       whatever else is held
+     - bound keys are swallowed (press and release) unless "pass" is given, with their
+       actions run either way, and unbound keys pass untouched
+
+   and reports how long a 4,000-line keymap takes to load. Built by the CMake build as
+   KeymapBench. */
+#include "Keymap.h"
+#include "KeyEngine.h"
+#include "LatencyHistogram.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+namespace {
+
+enum bench_actions {
+    ACTION_FISH = 1,
+    ACTION_BAIT,
+    ACTION_HOOK,
+    ACTION_LINE,
+};
+
+KeymapActionName const g_actions[] = {
+    { "fish", ACTION_FISH },
+    { "bait", ACTION_BAIT },
+    { "hook", ACTION_HOOK },
+    { "line", ACTION_LINE },
+};
+size_t const g_actionCount = sizeof(g_actions) / sizeof(g_actions[0]);
+
+struct BadKeymap
+{
+    char const *text;
+    unsigned line;
+    char const *word;   // the message must mention it
+};
+
+BadKeymap const g_badKeymaps[] = {
+    { "A press=fish\nFoo press=fish\n", 2, "'Foo'" },
+    { "A press=fish\n\n# comment\nB press=nothing\n", 4, "'nothing'" },
+    { "Hyper+A\n", 1, "Hyper" },
+    { "A press=fish bogus\n", 1, "'bogus'" },
+    { "A press=\n", 1, "'press='" },
+    { "*+A\n*+B pass\nA pass release=\n", 3, "'release='" },
+    { "Ctrl+\n", 1, "'Ctrl+'" },
+    { "Ctrl+K,*+C press=fish\n", 1, "'Ctrl+K,*+C'" },
+    { "B\n\n\nA when=\"capslock &&\"\n", 4, "Condition" },
+};
+
+bool Load(CKeymap &keymap, char const *text)
+{
+    KeymapError error;
+    if (!keymap.Load(text, strlen(text), g_actions, g_actionCount, &error)) {
+        printf("line %u: %s\n", error.line, error.message);
+        return false;
+    }
+    return true;
+}
+
+bool RunErrors()
+{
+    size_t failures = 0;
+    for (size_t i = 0; i < sizeof(g_badKeymaps) / sizeof(g_badKeymaps[0]); ++i) {
+        BadKeymap const &bad = g_badKeymaps[i];
+        CKeymap keymap;
+        if (!Load(keymap, "Q press=line\n")) {
+            return false;
+        }
+        KeymapError error;
+        memset(&error, 0, sizeof(error));
+        bool loaded = keymap.Load(bad.text, strlen(bad.text), g_actions, g_actionCount, &error);
+        bool kept = KeymapPressAction(keymap.Lookup(0, 'Q')) == ACTION_LINE;
+        if (loaded || (error.line != bad.line) || !strstr(error.message, bad.word) || !kept) {
+            printf("errors: keymap %zu gave line %u '%s' (expected line %u mentioning %s)%s\n", i,
+                error.line, error.message, bad.line, bad.word, kept ? "" : ", and lost the old keymap");
+            ++failures;
+        }
+    }
+    printf("errors: %zu bad keymaps, %zu reported wrongly\n", sizeof(g_badKeymaps) / sizeof(g_badKeymaps[0]), failures);
+    return failures == 0;
+}
+
+/* Checks one key's press action in every modifier state against expected[modifiers]. */
+bool CheckKey(CKeymap const &keymap, uint8_t keycode, uint16_t const expected[KEYMAP_MODIFIER_STATES], char const *what)
+{
+    for (unsigned modifiers = 0; modifiers < KEYMAP_MODIFIER_STATES; ++modifiers) {
+        uint16_t action = KeymapPressAction(keymap.Lookup(modifiers, keycode));
+        if (action != expected[modifiers]) {
+            printf("%s: modifiers %X give action %u, expected %u\n", what, modifiers, action, expected[modifiers]);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RunSpecificity()
+{
+    // The same bindings in both orders, so the winner can't just be the later line.
+    static char const *const texts[2] = {
+        "*+K press=fish\n*+Ctrl+K press=bait\nCtrl+Shift+K press=hook\n",
+        "Ctrl+Shift+K press=hook\n*+Ctrl+K press=bait\n*+K press=fish\n",
+    };
+    bool ok = true;
+    for (unsigned i = 0; i < 2; ++i) {
+        CKeymap keymap;
+        if (!Load(keymap, texts[i])) {
+            return false;
+        }
+        uint16_t expected[KEYMAP_MODIFIER_STATES];
+        for (unsigned modifiers = 0; modifiers < KEYMAP_MODIFIER_STATES; ++modifiers) {
+            expected[modifiers] = (modifiers == (KEYMOD_CONTROL | KEYMOD_SHIFT)) ? ACTION_HOOK :
+                ((modifiers & KEYMOD_CONTROL) ? ACTION_BAIT : ACTION_FISH);
+        }
+        ok = CheckKey(keymap, 'K', expected, "specificity") && ok;
+    }
+
+    // Equally specific: the later line wins.
+    CKeymap keymap;
+    if (!Load(keymap, "Ctrl+J press=fish\nCtrl+J press=bait\n*+Alt+J press=fish\n*+Alt+J press=hook\n")) {
+        return false;
+    }
+    uint16_t expected[KEYMAP_MODIFIER_STATES];
+    for (unsigned modifiers = 0; modifiers < KEYMAP_MODIFIER_STATES; ++modifiers) {
+        expected[modifiers] = (modifiers == KEYMOD_CONTROL) ? ACTION_BAIT : ((modifiers & KEYMOD_ALT) ? ACTION_HOOK : 0);
+    }
+    ok = CheckKey(keymap, 'J', expected, "later line") && ok;
+    printf("specificity: %s\n", ok ? "more modifiers win, then later lines" : "wrong");
+    return ok;
+}
+
+bool RunDontCare()
+{
+    CKeymap keymap;
+    if (!Load(keymap, "A press=fish\n*+B press=bait\nShift+Win+C press=hook\n*+Shift+D press=line\n")) {
+        return false;
+    }
+    uint16_t a[KEYMAP_MODIFIER_STATES];
+    uint16_t b[KEYMAP_MODIFIER_STATES];
+    uint16_t c[KEYMAP_MODIFIER_STATES];
+    uint16_t d[KEYMAP_MODIFIER_STATES];
+    for (unsigned modifiers = 0; modifiers < KEYMAP_MODIFIER_STATES; ++modifiers) {
+        a[modifiers] = modifiers ? 0 : ACTION_FISH;
+        b[modifiers] = ACTION_BAIT;
+        c[modifiers] = (modifiers == (KEYMOD_SHIFT | KEYMOD_WIN)) ? ACTION_HOOK : 0;
+        d[modifiers] = (modifiers & KEYMOD_SHIFT) ? ACTION_LINE : 0;
+    }
+    bool ok = CheckKey(keymap, 'A', a, "exact") && CheckKey(keymap, 'B', b, "'*'") &&
+        CheckKey(keymap, 'C', c, "exact") && CheckKey(keymap, 'D', d, "'*' with Shift");
+    printf("don't-care: %s\n", ok ? "'*' covers every other modifier, exact covers one state" : "wrong");
+    return ok;
+}
+
+/* Run a key through the engine; returns the action it queued, if any. */
+uint16_t SendKey(CKeyEngine &engine, uint8_t keycode, bool down, uint32_t time, bool &consumed)
+{
+    KeyEvent event = { time, 0, keycode, static_cast<uint8_t>(down ? KeyEvent::FLAG_DOWN : 0) };
+    unsigned result = engine.ProcessKey(event);
+    consumed = (result & CKeyEngine::RESULT_CONSUME) != 0;
+    uint16_t action = KEYMAP_ACTION_NONE;
+    if (result & CKeyEngine::RESULT_WAKE) {
+        engine.BeginDrain();
+        KeyEvent queued;
+        while (engine.PopEvent(queued)) {
+            action = queued.action;
+        }
+    }
+    return action;
+}
+
+bool RunConsume()
+{
+    CKeymap keymap;
+    if (!Load(keymap, "*+A press=fish release=bait\n*+B press=hook pass\nCtrl+C\n*+D release=line pass\n")) {
+        return false;
+    }
+    // The entries themselves.
+    bool ok = true;
+    for (unsigned modifiers = 0; modifiers < KEYMAP_MODIFIER_STATES; ++modifiers) {
+        ok = ok && KeymapIsConsumed(keymap.Lookup(modifiers, 'A')) && !KeymapIsConsumed(keymap.Lookup(modifiers, 'B')) &&
+            (KeymapIsConsumed(keymap.Lookup(modifiers, 'C')) == (modifiers == KEYMOD_CONTROL)) &&
+            !KeymapIsConsumed(keymap.Lookup(modifiers, 'D')) && !KeymapIsConsumed(keymap.Lookup(modifiers, 'E'));
+    }
+
+    // And what the hook makes of them: key, down, action expected, swallowed expected.
+    static struct {
+        uint8_t keycode;
+        bool down;
+        uint16_t action;
+        bool consumed;
+    } const strokes[] = {
+        { 'A', true, ACTION_FISH, true }, { 'A', false, ACTION_BAIT, true },
+        { 'B', true, ACTION_HOOK, false }, { 'B', false, 0, false },
+        { 'C', true, 0, false }, { 'C', false, 0, false },
+        { VKEY_LCONTROL, true, 0, false },
+        { 'C', true, 0, true }, { 'C', false, 0, true },
+        { 'D', true, 0, false }, { 'D', false, ACTION_LINE, false },
+        { VKEY_LCONTROL, false, 0, false },
+        { 'E', true, 0, false }, { 'E', false, 0, false },
+    };
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    uint32_t time = 1000;
+    for (size_t i = 0; i < sizeof(strokes) / sizeof(strokes[0]); ++i) {
+        bool consumed;
+        uint16_t action = SendKey(engine, strokes[i].keycode, strokes[i].down, time += 50, consumed);
+        if ((action != strokes[i].action) || (consumed != strokes[i].consumed)) {
+            printf("consume: stroke %zu (%02X %s) ran %u and was %s\n", i, strokes[i].keycode,
+                strokes[i].down ? "down" : "up", action, consumed ? "swallowed" : "passed");
+            ok = false;
+        }
+    }
+    printf("consume: %s\n", ok ? "bound keys swallowed unless 'pass', actions run either way" : "wrong");
+    return ok;
+}
+
+void RunLoadTime()
+{
+    static char const *const modifiers[] = { "", "Ctrl+", "Alt+", "Shift+", "Ctrl+Shift+", "*+Win+", "Ctrl+Alt+", "*+" };
+    static char const *const keys[] = { "A", "B", "F1", "F5", "PageUp", "Home", "Space", "Tab" };
+    std::string text;
+    for (unsigned i = 0; i < 4000; ++i) {
+        text += modifiers[i % 8];
+        text += keys[(i / 8) % 8];
+        text += (i % 3) ? " press=fish release=bait\n" : " press=hook pass\n";
+    }
+    CLatencyHistogram loads;
+    for (unsigned i = 0; i < 50; ++i) {
+        CKeymap keymap;
+        KeymapError error;
+        uint64_t start = LatencyClockNow();
+        keymap.Load(text.data(), text.size(), g_actions, g_actionCount, &error);
+        loads.RecordTicks(start);
+    }
+    printf("load, 4000 lines: %.3f ms median\n", loads.GetValueAtPercentile(50.0) / 1e6);
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = RunErrors();
+    ok = RunSpecificity() && ok;
+    ok = RunDontCare() && ok;
+    ok = RunConsume() && ok;
+    RunLoadTime();
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
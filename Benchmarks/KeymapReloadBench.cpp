@@ -0,0 +1,260 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Hot keymap reloading under load. One thread types through a CKeyEngine as fast as it
+   can, the way the hook does, while another keeps rewriting the keymap file and reloading
+   it through a CKeymapReloader, alternating between two keymaps that bind F1 and F2 the
+   opposite ways round. It checks that:
+
+     - every key sees one whole keymap or the other, never a mixture or a freed one (run
+       it under AddressSanitizer to make the latter airtight)
+     - keymaps are only ever replaced by newer ones
+     - every retired keymap is reclaimed
+
+   and reports how long a reload takes (compile, save the image, map it and publish it),
+   how long startup takes from the text and from the saved image, and the per-key latency
+   seen by the typing thread while reloads are going on. Built by the CMake build as
+   KeymapReloadBench. */
+#include "AppActions.h"
+#include "KeyEngine.h"
+#include "KeymapPublisher.h"
+#include "KeymapReloader.h"
+#include "LatencyHistogram.h"
+#include "MappedFile.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+
+namespace {
+
+#ifdef _WIN32
+FileNameChar const KEYMAP_PATH[] = L"KeymapReloadBench.keymap";
+FileNameChar const IMAGE_PATH[] = L"KeymapReloadBench.keymap.bin";
+#else
+FileNameChar const KEYMAP_PATH[] = "KeymapReloadBench.keymap";
+FileNameChar const IMAGE_PATH[] = "KeymapReloadBench.keymap.bin";
+#endif
+
+unsigned const RELOADS = 200;
+uint8_t const VKEY_F2 = VKEY_F1 + 1;
+
+/* A keymap with thousands of sequences, so that compiling it takes a realistic while.
+   The first binds F1 to hook and F2 to fish, the second the other way round. */
+std::string BuildKeymapText(bool second, unsigned sequences)
+{
+    std::string text = second ?
+        "F1 press=fish\nF2 press=hook\n" :
+        "F1 press=hook\nF2 press=fish\n";
+    std::mt19937 random(777);
+    char line[64];
+    for (unsigned i = 0; i < sequences; ++i) {
+        snprintf(line, sizeof(line), "Ctrl+%c,Ctrl+%c,Alt+%c press=bait\n",
+            'A' + static_cast<char>(random() % 26), 'A' + static_cast<char>(random() % 26), 'A' + static_cast<char>(random() % 26));
+        text += line;
+    }
+    return text;
+}
+
+void RemoveFiles()
+{
+#ifdef _WIN32
+    _wremove(KEYMAP_PATH);
+    _wremove(IMAGE_PATH);
+#else
+    remove(KEYMAP_PATH);
+    remove(IMAGE_PATH);
+#endif
+}
+
+bool WriteKeymap(std::string const &text)
+{
+    return WriteFileAtomically(KEYMAP_PATH, text.data(), text.size());
+}
+
+struct TypingResult
+{
+    uint64_t keys;
+    uint64_t mixed;         // F1 and F2 pressed together but not bound the opposite ways round
+    uint64_t wrongActions;
+    uint64_t versionsBackwards;
+};
+
+/* Presses F1 and F2 in turn until told to stop, draining the engine as the tray app does
+   and timing each key. */
+void Type(CKeyEngine &engine, CKeymapPublisher &publisher, std::atomic<bool> &stop,
+    CLatencyHistogram &latency, TypingResult &result)
+{
+    // A reader of its own, to look at the whole keymap the engine would see.
+    unsigned reader;
+    publisher.AddReader(reader);
+
+    result = TypingResult();
+    uint64_t lastVersion = 0;
+    uint32_t time = 1000;
+    while (!stop.load(std::memory_order_relaxed)) {
+        uint64_t version;
+        CKeymap const *keymap = publisher.Enter(reader, version);
+        uint16_t f1 = KeymapPressAction(keymap->Lookup(0, VKEY_F1));
+        uint16_t f2 = KeymapPressAction(keymap->Lookup(0, VKEY_F2));
+        publisher.Exit(reader);
+        if (!(((f1 == ACTION_SHOW_HOOK) && (f2 == ACTION_SHOW_FISH)) || ((f1 == ACTION_SHOW_FISH) && (f2 == ACTION_SHOW_HOOK)))) {
+            ++result.mixed;
+        }
+        if (version < lastVersion) {
+            ++result.versionsBackwards;
+        }
+        lastVersion = version;
+
+        for (uint8_t keycode = VKEY_F1; keycode <= VKEY_F2; ++keycode) {
+            for (int down = 1; down >= 0; --down) {
+                KeyEvent input = { time++, 0, keycode, static_cast<uint8_t>(down ? KeyEvent::FLAG_DOWN : 0) };
+                uint64_t start = LatencyClockNow();
+                if (engine.ProcessKey(input) & CKeyEngine::RESULT_WAKE) {
+                    engine.BeginDrain();
+                    KeyEvent event;
+                    while (engine.PopEvent(event)) {
+                        if ((event.action != ACTION_SHOW_HOOK) && (event.action != ACTION_SHOW_FISH)) {
+                            ++result.wrongActions;
+                        }
+                    }
+                }
+                latency.RecordTicks(start);
+                ++result.keys;
+            }
+        }
+    }
+}
+
+void PrintLatency(char const *name, CLatencyHistogram const &histogram)
+{
+    printf("%-22s %10llu %10.1f %10.1f %10.1f %10.1f\n", name,
+        static_cast<unsigned long long>(histogram.GetCount()),
+        histogram.GetValueAtPercentile(50.0) / 1e3, histogram.GetValueAtPercentile(99.0) / 1e3,
+        histogram.GetValueAtPercentile(99.9) / 1e3, histogram.GetMax() / 1e3);
+}
+
+} // namespace
+
+int main()
+{
+    std::string texts[2] = { BuildKeymapText(false, 4000), BuildKeymapText(true, 4000) };
+    int failures = 0;
+
+    // Startup, compiling the text (no image yet) and then mapping the image it saved.
+    RemoveFiles();
+    if (!WriteKeymap(texts[0])) {
+        printf("Can't write the keymap file\n");
+        return 1;
+    }
+    uint64_t fromText;
+    uint64_t fromImage;
+    {
+        CKeymapPublisher publisher;
+        CKeymapReloader reloader(publisher, g_actionNames, g_actionNameCount);
+        reloader.SetPaths(KEYMAP_PATH, IMAGE_PATH);
+        KeymapError error;
+        if (!reloader.Load(&error)) {
+            printf("Keymap line %u: %s\n", error.line, error.message);
+            return 1;
+        }
+        fromText = reloader.GetLastLoadDuration();
+    }
+    {
+        CKeymapPublisher publisher;
+        CKeymapReloader reloader(publisher, g_actionNames, g_actionNameCount);
+        reloader.SetPaths(KEYMAP_PATH, IMAGE_PATH);
+        if (!reloader.IsImageUpToDate() || !reloader.Load(nullptr)) {
+            printf("The saved image wasn't used\n");
+            ++failures;
+        }
+        fromImage = reloader.GetLastLoadDuration();
+    }
+    printf("startup from text   %10.3f ms\n", fromText / 1e6);
+    printf("startup from image  %10.3f ms\n\n", fromImage / 1e6);
+
+    // Reloads while typing.
+    CKeymapPublisher publisher;
+    CKeymapReloader reloader(publisher, g_actionNames, g_actionNameCount);
+    reloader.SetPaths(KEYMAP_PATH, IMAGE_PATH);
+    reloader.Load(nullptr);
+    CKeyEngine engine;
+    engine.SetKeymapPublisher(&publisher);
+
+    CLatencyHistogram keyLatency;
+    CLatencyHistogram reloadLatency;
+    TypingResult typing;
+    std::atomic<bool> stop(false);
+    std::thread typist(Type, std::ref(engine), std::ref(publisher), std::ref(stop), std::ref(keyLatency), std::ref(typing));
+
+    unsigned reloadFailures = 0;
+    size_t waiting = 0;
+    for (unsigned i = 1; i <= RELOADS; ++i) {
+        KeymapError error;
+        if (!WriteKeymap(texts[i % 2]) || !reloader.Reload(&error)) {
+            ++reloadFailures;
+        }
+        reloadLatency.Record(reloader.GetLastLoadDuration());
+        waiting = publisher.Reclaim();
+        std::this_thread::yield();
+    }
+    stop = true;
+    typist.join();
+    // The typist has finished with every keymap but the current one.
+    waiting = publisher.Reclaim();
+
+    printf("%-22s %10s %10s %10s %10s %10s\n", "latency (us)", "count", "p50", "p99", "p99.9", "max");
+    PrintLatency("reload", reloadLatency);
+    PrintLatency("key, while reloading", keyLatency);
+    printf("\n");
+
+    uint32_t published = publisher.GetPublishedCount();
+    uint32_t reclaimed = publisher.GetReclaimedCount();
+    printf("reloads %u (failed %u), keymaps published %u, reclaimed %u, still waiting %zu\n",
+        RELOADS, reloadFailures, published, reclaimed, waiting);
+    printf("keys %llu, keymap changes seen by the engine %u\n",
+        static_cast<unsigned long long>(typing.keys), engine.GetKeymapChangeCount());
+    if (reloadFailures || (waiting != 0) || (reclaimed + 1 != published)) {
+        printf("FAIL: keymaps weren't all reclaimed\n");
+        ++failures;
+    }
+    if (typing.mixed || typing.wrongActions || typing.versionsBackwards) {
+        printf("FAIL: %llu mixed keymaps, %llu wrong actions, %llu versions out of order\n",
+            static_cast<unsigned long long>(typing.mixed), static_cast<unsigned long long>(typing.wrongActions),
+            static_cast<unsigned long long>(typing.versionsBackwards));
+        ++failures;
+    }
+
+    RemoveFiles();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,294 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Checks CLatencyHistogram's buckets and percentiles against the recorded values themselves:
+
+     - every value sits between its bucket's lowest and highest, at and either side of every
+       power of two from 1 to 2^63, at 0 and at the largest 64-bit value, and the buckets
+       join up with no gaps or overlaps, with everything from 2^41 on in a bucket of its own
+     - the bucket found from the top bit agrees with shifting the value down one bit at a
+       time, for those edges and for 10 million random values of every length
+     - for known distributions (all zeros, every power-of-two edge, uniform, a long tail
+       and one that runs past the top bucket), p50, p99, p99.9 and p100 are never below
+       the exact value and are above it by less than 1/16 of it, as the header promises,
+       and the count, mean and maximum are exact
+
+   It reports the cost of finding a bucket and of recording a value. Built by the CMake build
+   as LatencyHistogramBench. */
+#include "LatencyHistogram.h"
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace {
+
+uint64_t const TOP = static_cast<uint64_t>(1) << CLatencyHistogram::MAX_VALUE_BITS;
+double const PERCENTILES[] = { 50.0, 99.0, 99.9, 100.0 };
+
+bool Check(bool condition, char const *what)
+{
+    if (!condition) {
+        printf("%s: wrong\n", what);
+    }
+    return condition;
+}
+
+// GetBucket() as it was, finding the top bit one shift at a time.
+unsigned ReferenceBucket(uint64_t value)
+{
+    unsigned const subBuckets = CLatencyHistogram::SUB_BUCKETS;
+    if (value < 2 * subBuckets) {
+        return static_cast<unsigned>(value);
+    }
+    unsigned top = 0;
+    for (uint64_t v = value; v >>= 1;) {
+        ++top;
+    }
+    if (top >= CLatencyHistogram::MAX_VALUE_BITS) {
+        return CLatencyHistogram::BUCKET_COUNT - 1;
+    }
+    unsigned shift = top - CLatencyHistogram::SUB_BUCKET_BITS;
+    return (shift + 1) * subBuckets + static_cast<unsigned>(value >> shift) - subBuckets;
+}
+
+// 0, and each power of two with its neighbours, up to the largest 64-bit value.
+std::vector<uint64_t> GetEdges()
+{
+    std::vector<uint64_t> edges(1, 0);
+    for (unsigned bit = 0; bit < 64; ++bit) {
+        uint64_t power = static_cast<uint64_t>(1) << bit;
+        edges.push_back(power - 1);
+        edges.push_back(power);
+        edges.push_back(power + 1);
+    }
+    edges.push_back(UINT64_MAX);
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    return edges;
+}
+
+// Whether reported is the value exact can be reported as: never below it and, within the
+// histogram's range, less than 1/16 of it above (and spot on below 32).
+bool IsWithinError(uint64_t exact, uint64_t reported)
+{
+    if (reported < exact) {
+        return false;
+    }
+    if (exact >= TOP) {
+        return true;
+    }
+    return (reported == exact) || ((exact >= 2 * CLatencyHistogram::SUB_BUCKETS) &&
+        ((reported - exact) * CLatencyHistogram::SUB_BUCKETS < exact));
+}
+
+bool RunBuckets()
+{
+    bool ok = true;
+    std::vector<uint64_t> edges = GetEdges();
+    unsigned wrong = 0;
+    for (size_t i = 0; i < edges.size(); ++i) {
+        uint64_t value = edges[i];
+        unsigned bucket = CLatencyHistogram::GetBucket(value);
+        uint64_t lowest = CLatencyHistogram::GetBucketLowest(bucket);
+        uint64_t highest = CLatencyHistogram::GetBucketHighest(bucket);
+        if ((bucket != ReferenceBucket(value)) || (value < lowest) || (value > highest) ||
+            ((value < TOP) && !IsWithinError(value, highest))) {
+            printf("  %llu: bucket %u, %llu to %llu\n", static_cast<unsigned long long>(value), bucket,
+                static_cast<unsigned long long>(lowest), static_cast<unsigned long long>(highest));
+            ++wrong;
+        }
+    }
+    ok = Check(wrong == 0, "power-of-two edges") && ok;
+    ok = Check(CLatencyHistogram::GetBucket(UINT64_MAX) == CLatencyHistogram::BUCKET_COUNT - 1, "the largest value") &&
+        ok;
+
+    wrong = 0;
+    for (unsigned bucket = 0; bucket < CLatencyHistogram::BUCKET_COUNT; ++bucket) {
+        uint64_t lowest = CLatencyHistogram::GetBucketLowest(bucket);
+        uint64_t highest = CLatencyHistogram::GetBucketHighest(bucket);
+        bool joined = (bucket == 0) ? (lowest == 0) : (lowest == CLatencyHistogram::GetBucketHighest(bucket - 1) + 1);
+        if (!joined || (lowest > highest) || (CLatencyHistogram::GetBucket(lowest) != bucket) ||
+            (CLatencyHistogram::GetBucket(highest) != bucket)) {
+            ++wrong;
+        }
+    }
+    ok = Check(wrong == 0, "bucket bounds") && ok;
+
+    std::mt19937_64 random(7);
+    wrong = 0;
+    for (unsigned i = 0; i < 10000000; ++i) {
+        uint64_t value = random() >> (random() % 64);
+        if (CLatencyHistogram::GetBucket(value) != ReferenceBucket(value)) {
+            ++wrong;
+        }
+    }
+    ok = Check(wrong == 0, "random values against the reference") && ok;
+    printf("buckets: %u, %u edges and 10,000,000 random values checked\n", CLatencyHistogram::BUCKET_COUNT,
+        static_cast<unsigned>(edges.size()));
+    return ok;
+}
+
+bool CheckDistribution(char const *name, std::vector<uint64_t> values)
+{
+    CLatencyHistogram histogram;
+    uint64_t total = 0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        histogram.Record(values[i]);
+        total += values[i];     // wraps just as the histogram's does
+    }
+    std::sort(values.begin(), values.end());
+
+    bool ok = Check((histogram.GetCount() == values.size()) && (histogram.GetMax() == values.back()) &&
+        (histogram.GetMean() == total / values.size()), name);
+    printf("%s: %u values", name, static_cast<unsigned>(values.size()));
+    for (size_t i = 0; i < sizeof(PERCENTILES) / sizeof(PERCENTILES[0]); ++i) {
+        // The same rank GetValueAtPercentile() looks for.
+        uint64_t rank = static_cast<uint64_t>(PERCENTILES[i] / 100.0 * static_cast<double>(values.size()) + 0.5);
+        uint64_t exact = values[static_cast<size_t>(std::max<uint64_t>(rank, 1) - 1)];
+        uint64_t reported = histogram.GetValueAtPercentile(PERCENTILES[i]);
+        if (!IsWithinError(exact, reported) || (reported > histogram.GetMax())) {
+            printf("\n  p%g: %llu for %llu", PERCENTILES[i], static_cast<unsigned long long>(reported),
+                static_cast<unsigned long long>(exact));
+            ok = false;
+        } else {
+            printf(", p%g %llu for %llu", PERCENTILES[i], static_cast<unsigned long long>(reported),
+                static_cast<unsigned long long>(exact));
+        }
+    }
+    ok = Check(histogram.GetValueAtPercentile(100.0) == values.back(), name) && ok;
+    printf("\n");
+    if (!ok) {
+        printf("%s: wrong\n", name);
+    }
+    return ok;
+}
+
+bool RunDistributions()
+{
+    bool ok = CheckDistribution("zeros", std::vector<uint64_t>(1000, 0));
+
+    std::vector<uint64_t> edges = GetEdges();
+    std::vector<uint64_t> inRange;
+    for (size_t i = 0; i < edges.size(); ++i) {
+        if (edges[i] < TOP) {
+            inRange.push_back(edges[i]);
+        }
+    }
+    ok = CheckDistribution("edges", inRange) && ok;
+    ok = CheckDistribution("edges past the top", edges) && ok;
+
+    std::mt19937_64 random(11);
+    std::vector<uint64_t> values;
+    std::uniform_int_distribution<uint64_t> uniform(0, 999999);
+    for (unsigned i = 0; i < 100000; ++i) {
+        values.push_back(uniform(random));
+    }
+    ok = CheckDistribution("uniform", values) && ok;
+
+    // Mostly a few microseconds, with the odd stall of milliseconds.
+    values.clear();
+    std::lognormal_distribution<double> tail(8.0, 1.5);
+    for (unsigned i = 0; i < 100000; ++i) {
+        values.push_back(static_cast<uint64_t>(tail(random)));
+    }
+    ok = CheckDistribution("long tail", values) && ok;
+
+    // A value at every edge beneath the top, and one right at the top's largest value.
+    values = inRange;
+    values.push_back(TOP - 1);
+    values.push_back(UINT64_MAX);
+    ok = CheckDistribution("up to the largest value", values) && ok;
+
+    CLatencyHistogram empty;
+    empty.Record(5);
+    empty.Reset();
+    ok = Check((empty.GetValueAtPercentile(50.0) == 0) && (empty.GetMax() == 0) && (empty.GetCount() == 0),
+        "reset") && ok;
+    return ok;
+}
+
+void RunTiming()
+{
+    std::mt19937_64 random(13);
+    std::vector<uint64_t> values(1 << 16);
+    for (size_t i = 0; i < values.size(); ++i) {
+        values[i] = random() >> (random() % 64);
+    }
+
+    unsigned const ROUNDS = 200;
+    unsigned sum = 0;
+    uint64_t start = LatencyClockNow();
+    for (unsigned round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < values.size(); ++i) {
+            sum += CLatencyHistogram::GetBucket(values[i]);
+        }
+    }
+    double bucketNs = static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) /
+        (static_cast<double>(ROUNDS) * values.size());
+
+    start = LatencyClockNow();
+    for (unsigned round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < values.size(); ++i) {
+            sum += ReferenceBucket(values[i]);
+        }
+    }
+    double referenceNs = static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) /
+        (static_cast<double>(ROUNDS) * values.size());
+
+    CLatencyHistogram histogram;
+    start = LatencyClockNow();
+    for (unsigned round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < values.size(); ++i) {
+            histogram.Record(values[i]);
+        }
+    }
+    double recordNs = static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) /
+        (static_cast<double>(ROUNDS) * values.size());
+
+    printf("timing: %.2f ns a bucket (%.2f ns a shift at a time), %.2f ns a record (%u)\n", bucketNs, referenceNs,
+        recordNs, sum & 1);
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = RunBuckets();
+    ok = RunDistributions() && ok;
+    RunTiming();
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,690 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Keyboard layout tables (see KeyboardLayout.h). It checks that:
+
+     - the built-in US table types exactly what CKeymap::CharacterFromStroke() does, with
+       Caps Lock on and off, in every state of the modifiers
+     - a German layout description parses, types what a German keyboard does (Y and Z
+       swapped, AltGr+Q for @, Caps Lock on umlauts but not on AltGr, ^ as a dead key),
+       and that bad descriptions fail on the right line
+     - abbreviations typed through the engine complete on the keys the current layout
+       types them with, and not on the US ones, a dead key followed by Space types its
+       accent and followed by a letter starts afresh
+     - bindings by character go to the key that types the character on the current
+       layout, follow it as it switches, win over bindings for the key itself, survive
+       the compiled image, and are rejected in a section, with a condition or malformed
+     - the hook reads only whole tables while another thread switches the layout and
+       builds tables again
+
+   and reports what a character lookup costs against CharacterFromStroke(), what the
+   engine pays per key with and without a layout, and what building a table and switching
+   layouts cost. Where the daemon's CFocusReader is built, it also times layout switches
+   written to its FIFO until the hook sees them. Built by the CMake build as
+   LayoutBench. */
+#include "BenchSupport.h"
+#include "KeyboardLayout.h"
+#include "KeyEngine.h"
+#include "LatencyHistogram.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef BENCH_FOCUS_READER
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "FocusReader.h"
+#endif
+
+namespace {
+
+size_t const LOOKUPS = 4000000;
+size_t const TYPED_KEYS = 2000000;
+size_t const SWITCHES = 1000000;
+size_t const FIFO_SWITCHES = 2000;
+
+/* Part of a German keyboard, by where its keys are on a US one. */
+char const s_germanLayout[] =
+    "# key           plain   shift   altgr\n"
+    "Backquote       dead:^  \xc2\xb0\n"
+    "1 1 !\n"
+    "2 2 \" \xc2\xb2\n"
+    "3 3 \xc2\xa7 \xc2\xb3\n"
+    "4 4 $\n"
+    "5 5 %\n"
+    "6 6 &\n"
+    "7 7 / {\n"
+    "8 8 ( [\n"
+    "9 9 ) ]\n"
+    "0 0 = }\n"
+    "Minus           \xc3\x9f  ?  \\\n"
+    "Equals          dead:\xc2\xb4 dead:`\n"
+    "Q q Q @\n"
+    "E e E \xe2\x82\xac\n"
+    "Y z Z\n"
+    "Z y Y\n"
+    "M m M \xc2\xb5\n"
+    "LBracket        \xc3\xbc \xc3\x9c\n"
+    "RBracket        + * ~\n"
+    "Semicolon       \xc3\xb6 \xc3\x96\n"
+    "Quote           \xc3\xa4 \xc3\x84\n"
+    "Backslash       hash '\n"
+    "Comma           , ;\n"
+    "Period          . :\n"
+    "Slash           dash _\n"
+    "IntlBackslash   < > |\n"
+    "Space           space space\n"
+    "Tab             tab\n"
+    "Enter           enter\n";
+
+std::string GermanLayoutText()
+{
+    // The letters that are where they are on a US keyboard.
+    std::string text = s_germanLayout;
+    for (char c = 'A'; c <= 'Z'; ++c) {
+        if (!strchr("QEYZM", c)) {
+            text += std::string(1, c) + " " + std::string(1, static_cast<char>(c - 'A' + 'a')) + " " + std::string(1, c) + "\n";
+        }
+    }
+    return text;
+}
+
+/* Every combination of the modifiers and locks that matter to characters. */
+std::vector<uint32_t> KeyStates()
+{
+    static uint32_t const bits[] = {
+        KEYSTATE_LSHIFT, KEYSTATE_RSHIFT, KEYSTATE_LCONTROL, KEYSTATE_LALT, KEYSTATE_RALT, KEYSTATE_LWIN, KEYSTATE_CAPSLOCK,
+    };
+    size_t count = sizeof(bits) / sizeof(bits[0]);
+    std::vector<uint32_t> states;
+    for (unsigned combination = 0; combination < (1u << count); ++combination) {
+        uint32_t state = 0;
+        for (size_t b = 0; b < count; ++b) {
+            state |= (combination & (1u << b)) ? bits[b] : 0;
+        }
+        states.push_back(state);
+    }
+    return states;
+}
+
+/* What the engine typed before there were layouts. */
+uint16_t UsCharacter(uint32_t keyState, uint8_t keycode)
+{
+    unsigned modifiers = (keyState | (keyState >> 4)) & 0x0F;
+    uint16_t c = static_cast<unsigned char>(CKeymap::CharacterFromStroke(MakeStroke(modifiers, keycode)));
+    if ((keyState & KEYSTATE_CAPSLOCK) && (((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')))) {
+        c = static_cast<uint16_t>(c ^ 0x20);
+    }
+    return c;
+}
+
+bool CheckUsLayout(LayoutTable const &us)
+{
+    std::vector<uint32_t> states = KeyStates();
+    size_t wrong = 0;
+    for (size_t s = 0; s < states.size(); ++s) {
+        unsigned state = LayoutShiftState(states[s]);
+        for (unsigned k = 0; k < 256; ++k) {
+            uint8_t keycode = static_cast<uint8_t>(k);
+            uint16_t want = UsCharacter(states[s], keycode);
+            if ((LayoutCharacter(us, state, keycode) != want) || IsLayoutDeadKey(us, state, keycode)) {
+                ++wrong;
+            }
+        }
+    }
+    printf("US table: %zu key states x 256 keys, %zu differ from CharacterFromStroke()\n", states.size(), wrong);
+    return wrong == 0;
+}
+
+struct Expected
+{
+    uint32_t keyState;
+    uint8_t keycode;
+    uint16_t character;
+    bool dead;
+};
+
+bool CheckGermanLayout(LayoutTable const &german)
+{
+    Expected const expected[] = {
+        { 0, 'Y', 'z', false },
+        { KEYSTATE_LSHIFT, 'Z', 'Y', false },
+        { KEYSTATE_RALT, 'Q', '@', false },
+        { KEYSTATE_LCONTROL | KEYSTATE_LALT, 'Q', '@', false },
+        { KEYSTATE_LCONTROL, 'Q', 0, false },
+        { KEYSTATE_LALT, 'Q', 0, false },
+        { KEYSTATE_RALT | KEYSTATE_CAPSLOCK, 'Q', '@', false },
+        { KEYSTATE_RALT, 'E', 0x20AC, false },
+        { KEYSTATE_LSHIFT, '2', '"', false },
+        { 0, VKEY_OEM_1, 0xF6, false },
+        { KEYSTATE_CAPSLOCK, VKEY_OEM_1, 0xD6, false },
+        { KEYSTATE_CAPSLOCK | KEYSTATE_RSHIFT, VKEY_OEM_1, 0xF6, false },
+        { KEYSTATE_CAPSLOCK, '2', '2', false },
+        { 0, VKEY_OEM_3, '^', true },
+        { KEYSTATE_LSHIFT, VKEY_OEM_3, 0xB0, false },
+        { KEYSTATE_LSHIFT, VKEY_OEM_PLUS, '`', true },
+        { 0, VKEY_OEM_5, '#', false },
+        { 0, VKEY_OEM_2, '-', false },
+        { KEYSTATE_RALT, VKEY_OEM_102, '|', false },
+        { KEYSTATE_RALT, VKEY_OEM_MINUS, '\\', false },
+        { 0, VKEY_RETURN, '\n', false },
+        { 0, VKEY_F1, 0, false },
+    };
+    size_t wrong = 0;
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+        Expected const &e = expected[i];
+        unsigned state = LayoutShiftState(e.keyState);
+        uint16_t c = LayoutCharacter(german, state, e.keycode);
+        bool dead = IsLayoutDeadKey(german, state, e.keycode);
+        if ((c != e.character) || (dead != e.dead)) {
+            printf("German: key %02X in state %03X types %04X%s, not %04X%s\n", e.keycode, e.keyState, c, dead ? " (dead)" : "",
+                e.character, e.dead ? " (dead)" : "");
+            ++wrong;
+        }
+    }
+
+    struct BadLayout
+    {
+        char const *text;
+        unsigned line;
+    };
+    BadLayout const bad[] = {
+        { "A a A\nNoSuchKey x\n", 2 },
+        { "A a A\nB b B\nC\n", 3 },
+        { "A a A x y z\n", 1 },
+        { "A \xff\n", 1 },
+        { "A dead:-\n", 1 },
+        { "A ab\n", 1 },
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        LayoutTable layout;
+        KeymapError error;
+        error.line = 0;
+        if (ParseLayout(bad[i].text, strlen(bad[i].text), layout, &error) || (error.line != bad[i].line)) {
+            printf("Bad layout %zu: accepted, or failed on line %u\n", i, error.line);
+            ++wrong;
+        }
+    }
+    printf("German table: %zu wrong\n", wrong);
+    return wrong == 0;
+}
+
+char const s_keymapText[] =
+    "::yz   text=\"1\"\n"
+    "::a@   text=\"2\"\n"
+    "::^a   text=\"3\"\n";
+
+/* Press and release keycode with the given modifier keys held; returns true if that
+   completed an abbreviation. */
+bool Type(CKeyEngine &engine, uint32_t &time, uint8_t keycode, uint8_t modifier1 = 0, uint8_t modifier2 = 0)
+{
+    uint8_t const keys[] = { modifier1, modifier2, keycode };
+    for (int i = 0; i < 3; ++i) {
+        if (keys[i]) {
+            KeyEvent press = { time++, 0, keys[i], KeyEvent::FLAG_DOWN };
+            engine.ProcessKey(press);
+        }
+    }
+    for (int i = 2; i >= 0; --i) {
+        if (keys[i]) {
+            KeyEvent release = { time++, 0, keys[i], 0 };
+            engine.ProcessKey(release);
+        }
+    }
+    bool completed = false;
+    engine.BeginDrain();
+    KeyEvent event;
+    while (engine.PopEvent(event)) {
+        completed = completed || ((event.keycode == 0) && (event.action != KEYMAP_ACTION_NONE));
+    }
+    return completed;
+}
+
+struct Typing
+{
+    char const *name;
+    char const *layout;         // NULL for none
+    uint8_t keys[3][3];         // keycode and modifiers for each key
+    bool completes;             // on the last key
+};
+
+bool CheckEngine(CKeymap const &keymap, CLayoutCache &cache)
+{
+    Typing const typings[] = {
+        { "US yz", "us", { { 'Y', 0, 0 }, { 'Z', 0, 0 } }, true },
+        { "German keys on US", "us", { { 'Z', 0, 0 }, { 'Y', 0, 0 } }, false },
+        { "German yz", "de", { { 'Z', 0, 0 }, { 'Y', 0, 0 } }, true },
+        { "US keys on German", "de", { { 'Y', 0, 0 }, { 'Z', 0, 0 } }, false },
+        { "no layout yz", nullptr, { { 'Y', 0, 0 }, { 'Z', 0, 0 } }, true },
+        { "US a@", "us", { { 'A', 0, 0 }, { '2', VKEY_LSHIFT, 0 } }, true },
+        { "German a@", "de", { { 'A', 0, 0 }, { 'Q', VKEY_RMENU, 0 } }, true },
+        { "German a@ by Ctrl+Alt", "de", { { 'A', 0, 0 }, { 'Q', VKEY_LCONTROL, VKEY_LMENU } }, true },
+        { "German dead ^ then Space", "de", { { VKEY_OEM_3, 0, 0 }, { VKEY_SPACE, 0, 0 }, { 'A', 0, 0 } }, true },
+        { "German dead ^ then a", "de", { { VKEY_OEM_3, 0, 0 }, { 'A', 0, 0 } }, false },
+    };
+    bool ok = true;
+    for (size_t t = 0; t < sizeof(typings) / sizeof(typings[0]); ++t) {
+        Typing const &typing = typings[t];
+        CKeyEngine engine;
+        engine.SetKeymap(&keymap);
+        engine.SetLayouts(&cache);
+        cache.SetCurrent(typing.layout ? cache.Find(LayoutIdFromName(typing.layout)) : nullptr);
+        uint32_t time = 0;
+        bool completed = false;
+        for (size_t k = 0; (k < 3) && typing.keys[k][0]; ++k) {
+            completed = Type(engine, time, typing.keys[k][0], typing.keys[k][1], typing.keys[k][2]);
+        }
+        if (completed != typing.completes) {
+            printf("%s: %s\n", typing.name, completed ? "completed" : "didn't complete");
+            ok = false;
+        }
+    }
+    printf("Abbreviations through the engine: %s\n", ok ? "ok" : "WRONG");
+    return ok;
+}
+
+enum
+{
+    ACTION_CTRL_Z = 1,
+    ACTION_O_UMLAUT,
+    ACTION_DASH,
+    ACTION_SHIFT_O_UMLAUT,
+    ACTION_CTRL_Z_KEY,
+};
+
+KeymapActionName const s_characterActions[] = {
+    { "ctrlz", ACTION_CTRL_Z },
+    { "oumlaut", ACTION_O_UMLAUT },
+    { "dash", ACTION_DASH },
+    { "shiftoumlaut", ACTION_SHIFT_O_UMLAUT },
+    { "ctrlzkey", ACTION_CTRL_Z_KEY },
+};
+
+/* Bindings by character, with one by key on the US Z key to lose to them. */
+char const s_characterKeymapText[] =
+    "Ctrl+Z             press=ctrlzkey\n"
+    "Ctrl+'z'           press=ctrlz\n"
+    "'\xc3\xb6'               press=oumlaut\n"
+    "*+'-'              press=dash pass\n"
+    "Shift+'\xc3\x96'         press=shiftoumlaut\n";
+
+struct CharacterTyping
+{
+    char const *layout;         // NULL for none
+    uint8_t keycode;
+    uint8_t modifier;
+    uint16_t action;            // on the key's press, or KEYMAP_ACTION_NONE
+    bool consumed;
+};
+
+/* Press and release keycode with modifier held, and what its press ran and whether it
+   was swallowed. */
+uint16_t Press(CKeyEngine &engine, uint32_t &time, uint8_t keycode, uint8_t modifier, bool &consumed)
+{
+    if (modifier) {
+        KeyEvent press = { time++, 0, modifier, KeyEvent::FLAG_DOWN };
+        engine.ProcessKey(press);
+    }
+    KeyEvent press = { time++, 0, keycode, KeyEvent::FLAG_DOWN };
+    consumed = (engine.ProcessKey(press) & CKeyEngine::RESULT_CONSUME) != 0;
+    KeyEvent release = { time++, 0, keycode, 0 };
+    engine.ProcessKey(release);
+    if (modifier) {
+        KeyEvent modifierRelease = { time++, 0, modifier, 0 };
+        engine.ProcessKey(modifierRelease);
+    }
+    uint16_t action = KEYMAP_ACTION_NONE;
+    engine.BeginDrain();
+    KeyEvent event;
+    while (engine.PopEvent(event)) {
+        if ((event.keycode == keycode) && (event.flags & KeyEvent::FLAG_DOWN)) {
+            action = event.action;
+        }
+    }
+    return action;
+}
+
+bool CheckCharacterTypings(CKeymap const &keymap, CLayoutCache &cache, char const *how)
+{
+    // One engine throughout, so that it has to follow the layout as it switches.
+    CharacterTyping const typings[] = {
+        { "us", 'Z', VKEY_LCONTROL, ACTION_CTRL_Z, true },
+        { "us", 'Y', VKEY_LCONTROL, KEYMAP_ACTION_NONE, false },
+        { "us", VKEY_OEM_1, 0, KEYMAP_ACTION_NONE, false },
+        { "us", VKEY_OEM_MINUS, 0, ACTION_DASH, false },
+        { "us", VKEY_OEM_MINUS, VKEY_RCONTROL, ACTION_DASH, false },
+        { "us", VKEY_OEM_2, 0, KEYMAP_ACTION_NONE, false },
+        { "de", 'Y', VKEY_LCONTROL, ACTION_CTRL_Z, true },
+        { "de", 'Z', VKEY_LCONTROL, ACTION_CTRL_Z_KEY, true },
+        { "de", VKEY_OEM_1, 0, ACTION_O_UMLAUT, true },
+        { "de", VKEY_OEM_1, VKEY_LSHIFT, ACTION_SHIFT_O_UMLAUT, true },
+        { "de", VKEY_OEM_1, VKEY_LCONTROL, KEYMAP_ACTION_NONE, false },
+        { "de", VKEY_OEM_2, 0, ACTION_DASH, false },
+        { "de", VKEY_OEM_MINUS, 0, KEYMAP_ACTION_NONE, false },
+        { nullptr, 'Z', VKEY_LCONTROL, ACTION_CTRL_Z, true },
+        { nullptr, 'Y', VKEY_LCONTROL, KEYMAP_ACTION_NONE, false },
+        { "de", 'Y', VKEY_LCONTROL, ACTION_CTRL_Z, true },
+    };
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    engine.SetLayouts(&cache);
+    uint32_t time = 0;
+    bool ok = true;
+    for (size_t t = 0; t < sizeof(typings) / sizeof(typings[0]); ++t) {
+        CharacterTyping const &typing = typings[t];
+        cache.SetCurrent(typing.layout ? cache.Find(LayoutIdFromName(typing.layout)) : nullptr);
+        bool consumed;
+        uint16_t action = Press(engine, time, typing.keycode, typing.modifier, consumed);
+        if ((action != typing.action) || (consumed != typing.consumed)) {
+            printf("Binding by character (%s), %s: key %02X with %02X ran %u%s, not %u%s\n", how,
+                typing.layout ? typing.layout : "no layout", typing.keycode, typing.modifier, action,
+                consumed ? " (swallowed)" : "", typing.action, typing.consumed ? " (swallowed)" : "");
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool CheckCharacterBindings(CLayoutCache &cache)
+{
+    CKeymap keymap;
+    KeymapError error;
+    size_t actionCount = sizeof(s_characterActions) / sizeof(s_characterActions[0]);
+    if (!keymap.Load(s_characterKeymapText, sizeof(s_characterKeymapText) - 1, s_characterActions, actionCount,
+            &error)) {
+        printf("Character keymap, line %u: %s\n", error.line, error.message);
+        return false;
+    }
+    bool ok = (keymap.GetCharacterCount() == 3);
+    ok = CheckCharacterTypings(keymap, cache, "compiled") && ok;
+
+    std::vector<uint8_t> image;
+    keymap.WriteImage(image);
+    std::vector<uint64_t> aligned((image.size() + 63) / 8 + 8);
+    uint8_t *start = reinterpret_cast<uint8_t *>(aligned.data());
+    start += (64 - reinterpret_cast<uintptr_t>(start) % 64) % 64;
+    memcpy(start, image.data(), image.size());
+    CKeymap attached;
+    if (!attached.AttachImage(start, image.size(), &error)) {
+        printf("Character keymap image: %s\n", error.message);
+        ok = false;
+    } else {
+        ok = CheckCharacterTypings(attached, cache, "image") && ok;
+    }
+
+    struct BadKeymap
+    {
+        char const *text;
+        unsigned line;
+    };
+    BadKeymap const bad[] = {
+        { "A press=ctrlz\n[notepad.exe]\n'x' press=ctrlz\n", 3 },
+        { "'x' press=ctrlz when=shift\n", 1 },
+        { "'ab' press=ctrlz\n", 1 },
+        { "Ctrl+'' press=ctrlz\n", 1 },
+        { "Hyper+'x' press=ctrlz\n", 1 },
+        { "'x',Y press=ctrlz\n", 1 },
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        CKeymap rejected;
+        error.line = 0;
+        if (rejected.Load(bad[i].text, strlen(bad[i].text), s_characterActions, actionCount, &error) ||
+            (error.line != bad[i].line)) {
+            printf("Bad character keymap %zu: accepted, or failed on line %u\n", i, error.line);
+            ok = false;
+        }
+    }
+    printf("Bindings by character: %s\n", ok ? "ok" : "WRONG");
+    return ok;
+}
+
+double TimeLookups(LayoutTable const &layout, std::vector<uint32_t> const &keyStates, std::vector<uint8_t> const &keycodes,
+    bool useTable, uint64_t &checksum)
+{
+    uint64_t start = LatencyClockNow();
+    uint64_t sum = 0;
+    for (size_t i = 0; i < keycodes.size(); ++i) {
+        if (useTable) {
+            sum += LayoutCharacter(layout, LayoutShiftState(keyStates[i]), keycodes[i]);
+        } else {
+            sum += UsCharacter(keyStates[i], keycodes[i]);
+        }
+    }
+    checksum += sum;
+    return static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / keycodes.size();
+}
+
+/* Type lower-case letters and spaces, one press and release each. */
+double TimeEngine(CKeymap const &keymap, CLayoutCache *cache, std::vector<uint8_t> const &keycodes)
+{
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    engine.SetLayouts(cache);
+    uint32_t time = 0;
+    uint64_t start = LatencyClockNow();
+    for (size_t i = 0; i < keycodes.size(); ++i) {
+        KeyEvent press = { time, 0, keycodes[i], KeyEvent::FLAG_DOWN };
+        KeyEvent release = { time + 1, 0, keycodes[i], 0 };
+        engine.ProcessKey(press);
+        engine.ProcessKey(release);
+        time += 2;
+        if ((i & 63) == 0) {
+            engine.BeginDrain();
+            KeyEvent event;
+            while (engine.PopEvent(event)) {
+            }
+        }
+    }
+    return static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / (2 * keycodes.size());
+}
+
+/* One thread switches between layouts, sometimes building them all again, while another
+   looks characters up through GetCurrent() and checks that every table it sees is whole. */
+bool CheckSwitching(LayoutTable const &us, LayoutTable const &german)
+{
+    CLayoutCache cache;
+    std::vector<LayoutTable const *> tables;
+    tables.push_back(cache.Add(std::unique_ptr<LayoutTable>(new LayoutTable(us))));
+    tables.push_back(cache.Add(std::unique_ptr<LayoutTable>(new LayoutTable(german))));
+    cache.SetCurrent(tables[0]);
+
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> reads(0);
+    std::atomic<uint64_t> torn(0);
+    std::thread reader([&]() {
+        uint64_t count = 0;
+        uint64_t bad = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            LayoutTable const *layout = cache.GetCurrent();
+            uint16_t y = LayoutCharacter(*layout, 0, 'Y');
+            bool german = (strcmp(layout->name, "de") == 0);
+            bad += (y != (german ? 'z' : 'y')) ? 1 : 0;
+            ++count;
+        }
+        reads.store(count);
+        torn.store(bad);
+    });
+
+    uint64_t start = LatencyClockNow();
+    for (size_t i = 0; i < SWITCHES; ++i) {
+        if ((i % 10000) == 9999) {
+            // Layouts redefined: build both again, as the app does on a settings change.
+            cache.Invalidate();
+            tables.push_back(cache.Add(std::unique_ptr<LayoutTable>(new LayoutTable(us))));
+            tables.push_back(cache.Add(std::unique_ptr<LayoutTable>(new LayoutTable(german))));
+        }
+        cache.SetCurrent(cache.Find(LayoutIdFromName((i & 1) ? "de" : "us")));
+    }
+    double switchNs = static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / SWITCHES;
+    stop.store(true);
+    reader.join();
+    bool ok = (torn.load() == 0) && (cache.GetSwitchCount() == SWITCHES) && (cache.GetBuildCount() == tables.size());
+    printf("Switching: %zu switches at %.1f ns, %u tables built; %llu reads on another thread, %llu wrong\n", SWITCHES,
+        switchNs, cache.GetBuildCount(), static_cast<unsigned long long>(reads.load()),
+        static_cast<unsigned long long>(torn.load()));
+    return ok;
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = true;
+    LayoutTable us;
+    uint64_t start = LatencyClockNow();
+    BuildUsLayout(us);
+    double usBuildUs = static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / 1e3;
+    ok = CheckUsLayout(us) && ok;
+
+    std::string germanText = GermanLayoutText();
+    LayoutTable german;
+    KeymapError error;
+    start = LatencyClockNow();
+    if (!ParseLayout(germanText.data(), germanText.size(), german, &error)) {
+        printf("German layout, line %u: %s\n", error.line, error.message);
+        return 1;
+    }
+    double germanBuildUs = static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / 1e3;
+    snprintf(german.name, sizeof(german.name), "de");
+    german.id = LayoutIdFromName(german.name);
+    ok = CheckGermanLayout(german) && ok;
+    printf("Building a table: %.1f us for US, %.1f us parsing the German description\n", usBuildUs, germanBuildUs);
+
+    CKeymap keymap;
+    if (!keymap.Load(s_keymapText, sizeof(s_keymapText) - 1, nullptr, 0, &error)) {
+        printf("Keymap, line %u: %s\n", error.line, error.message);
+        return 1;
+    }
+    CLayoutCache cache;
+    cache.Add(std::unique_ptr<LayoutTable>(new LayoutTable(us)));
+    cache.Add(std::unique_ptr<LayoutTable>(new LayoutTable(german)));
+    ok = CheckEngine(keymap, cache) && ok;
+    ok = CheckCharacterBindings(cache) && ok;
+
+    // Lookups for what's typed most (keys that type characters, a few of them shifted),
+    // then for any key in any state.
+    std::mt19937 random(23);
+    std::vector<uint8_t> characterKeys;
+    for (unsigned k = 0; k < 256; ++k) {
+        if (UsCharacter(0, static_cast<uint8_t>(k))) {
+            characterKeys.push_back(static_cast<uint8_t>(k));
+        }
+    }
+    std::vector<uint32_t> states = KeyStates();
+    std::vector<uint32_t> keyStates(LOOKUPS);
+    std::vector<uint8_t> keycodes(LOOKUPS);
+    uint64_t checksum = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t i = 0; i < LOOKUPS; ++i) {
+            if (pass == 0) {
+                keyStates[i] = ((random() % 8) == 0) ? KEYSTATE_LSHIFT : 0;
+                keycodes[i] = characterKeys[random() % characterKeys.size()];
+            } else {
+                keyStates[i] = states[random() % states.size()];
+                keycodes[i] = static_cast<uint8_t>(random());
+            }
+        }
+        TimeLookups(german, keyStates, keycodes, true, checksum);
+        double tableNs = TimeLookups(german, keyStates, keycodes, true, checksum);
+        double strokeNs = TimeLookups(german, keyStates, keycodes, false, checksum);
+        printf("Character lookup, %s: %.2f ns from a table, %.2f ns from CharacterFromStroke()\n",
+            (pass == 0) ? "typing" : "any key in any state", tableNs, strokeNs);
+    }
+    printf("(checksum %llu)\n", static_cast<unsigned long long>(checksum));
+
+    std::vector<uint8_t> typed(TYPED_KEYS);
+    for (size_t i = 0; i < TYPED_KEYS; ++i) {
+        unsigned pick = random() % 27;
+        typed[i] = (pick == 26) ? static_cast<uint8_t>(VKEY_SPACE) : static_cast<uint8_t>('A' + pick);
+    }
+    cache.SetCurrent(cache.Find(LayoutIdFromName("de")));
+    double withLayout = TimeEngine(keymap, &cache, typed);
+    double withoutLayout = TimeEngine(keymap, nullptr, typed);
+    printf("Engine, per key event: %.1f ns through a layout, %.1f ns without\n", withLayout, withoutLayout);
+
+    ok = CheckSwitching(us, german) && ok;
+
+#ifdef BENCH_FOCUS_READER
+    {
+        // The daemon's way in: "layout <name>" written to the focus FIFO, read on
+        // CFocusReader's thread, until the hook sees the other table.
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/LayoutBench.%d.fifo", static_cast<int>(getpid()));
+        unlink(path);
+        CAppFocus focus;
+        CFocusReader reader(focus);
+        reader.SetLayouts(&cache);
+        if ((mkfifo(path, 0600) < 0) || !reader.Start(path)) {
+            perror(path);
+            unlink(path);
+            return 1;
+        }
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+        unlink(path);
+        if (fd < 0) {
+            perror(path);
+            return 1;
+        }
+        CLatencyHistogram latency;
+        for (size_t i = 0; i < FIFO_SWITCHES; ++i) {
+            char const *name = (i & 1) ? "de" : "us";
+            std::string line = std::string("layout ") + name + "\n";
+            uint64_t ticks = LatencyClockNow();
+            if (write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+                perror("FIFO");
+                ok = false;
+                break;
+            }
+            while (strcmp(cache.GetCurrent()->name, name) != 0) {
+            }
+            latency.RecordTicks(ticks);
+        }
+        close(fd);
+        reader.Stop();
+        bool unchanged = (focus.GetApplication()->name[0] == '\0');
+        ok = unchanged && ok;
+        printf("Layout switches through the FIFO: p50 %.1f us, p99 %.1f us, max %.1f us%s\n",
+            latency.GetValueAtPercentile(50) / 1e3, latency.GetValueAtPercentile(99) / 1e3, latency.GetMax() / 1e3,
+            unchanged ? "" : "; the application changed");
+    }
+#endif
+
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
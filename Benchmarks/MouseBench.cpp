@@ -0,0 +1,583 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* The mouse path: buttons and wheel notches decided by the key engine as they come,
+   movement batched a frame at a time and reduced for flicks. It generates an 8 kHz
+   synthetic stream (fast straight strokes in each direction, long stretches of circling,
+   slow straight strokes, with clicks and wheel notches between and among them) and checks
+   that:
+
+     - the SIMD reduction agrees with a plain loop, for every batch length
+     - batching loses no movement: the frames add up to the stream's totals
+     - bound buttons and notches (XButton1, WheelUp) are swallowed and the rest passed,
+       and the bound ones run their actions
+     - every fast stroke flicks exactly once, in its direction, and circling and slow
+       strokes never do, batched or with every movement reduced as it comes
+     - on Linux, the same stream read through the daemon's CLinuxKeyboardHook comes out of
+       its uinput writer with all of its movement, only the unbound buttons and notches
+       (high-resolution wheel reports included), and the same flicks
+
+   and reports the CPU time each second of input costs, batched and with every movement
+   reduced as it comes. Built by the CMake build as MouseBench. */
+#include "KeyEngine.h"
+#include "MotionBatcher.h"
+#include "VirtualKeys.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#ifdef BENCH_LINUX_HOOK
+#include <unistd.h>
+#include "LinuxKeyboardHook.h"
+#include "UinputOutput.h"
+#endif
+
+namespace {
+
+size_t const CYCLES = 20;
+int const TIMING_RUNS = 5;
+uint64_t const REPORT_INTERVAL = 125;  // us, for 8 kHz
+
+enum {
+    ACTION_BACK = 1,
+    ACTION_ZOOM,
+    ACTION_FLICK_LEFT,
+    ACTION_FLICK_RIGHT,
+    ACTION_FLICK_UP,
+    ACTION_FLICK_DOWN,
+    ACTION_COUNT,
+};
+
+KeymapActionName const s_actions[] = {
+    { "back", ACTION_BACK },
+    { "zoom", ACTION_ZOOM },
+    { "flick_left", ACTION_FLICK_LEFT },
+    { "flick_right", ACTION_FLICK_RIGHT },
+    { "flick_up", ACTION_FLICK_UP },
+    { "flick_down", ACTION_FLICK_DOWN },
+};
+
+char const s_keymapText[] =
+    "XButton1    press=back\n"
+    "WheelUp     press=zoom\n"
+    "FlickLeft   press=flick_left\n"
+    "FlickRight  press=flick_right\n"
+    "FlickUp     press=flick_up\n"
+    "FlickDown   press=flick_down\n";
+
+struct MouseEvent
+{
+    enum { MOVE, BUTTON, WHEEL };
+
+    uint64_t time;      // us
+    int kind;
+    int32_t dx;         // MOVE
+    int32_t dy;
+    uint8_t keycode;    // BUTTON, or the WHEEL notch's tap
+    bool down;          // BUTTON
+    bool pass;          // what the hook should do with a BUTTON or WHEEL
+};
+
+struct Stream
+{
+    std::vector<MouseEvent> events;
+    uint64_t duration;          // us
+    int64_t dx;
+    int64_t dy;
+    unsigned flicks[4];         // expected, by direction: left, right, up, down
+    unsigned backs;
+    unsigned zooms;
+    unsigned passedButtons;     // presses and releases
+    unsigned passedNotches;
+};
+
+void AddMove(Stream &stream, uint64_t time, int32_t dx, int32_t dy)
+{
+    if (dx || dy) {
+        stream.events.push_back({ time, MouseEvent::MOVE, dx, dy, 0, false, true });
+        stream.dx += dx;
+        stream.dy += dy;
+    }
+}
+
+void AddClick(Stream &stream, uint64_t time, uint8_t keycode, bool pass)
+{
+    stream.events.push_back({ time, MouseEvent::BUTTON, 0, 0, keycode, true, pass });
+    stream.events.push_back({ time + 40000, MouseEvent::BUTTON, 0, 0, keycode, false, pass });
+    stream.passedButtons += pass ? 2 : 0;
+}
+
+void AddNotch(Stream &stream, uint64_t time, uint8_t keycode, bool pass)
+{
+    stream.events.push_back({ time, MouseEvent::WHEEL, 0, 0, keycode, true, pass });
+    stream.passedNotches += pass ? 1 : 0;
+}
+
+/* Each cycle: a 40 ms flick, a pause with clicks and notches, a second of circling at
+   full rate with a click in it, another pause, a slow straight stroke and a last pause.
+   The pauses are longer than CMotionBatcher::STROKE_GAP, so each stroke stands alone. */
+void GenerateStream(Stream &stream)
+{
+    stream.events.clear();
+    stream.dx = 0;
+    stream.dy = 0;
+    memset(stream.flicks, 0, sizeof(stream.flicks));
+    stream.backs = 0;
+    stream.zooms = 0;
+    stream.passedButtons = 0;
+    stream.passedNotches = 0;
+    std::mt19937 random(20);
+    std::uniform_int_distribution<int> jitterPick(-1, 1);
+    double const pi = 3.14159265358979;
+    uint64_t t = 1000000;
+    for (size_t cycle = 0; cycle < CYCLES; ++cycle) {
+        // A flick: 2 counts a report, 16,000 a second, with a little sideways jitter.
+        int direction = static_cast<int>(cycle % 4);
+        for (uint64_t end = t + 40000; t < end; t += REPORT_INTERVAL) {
+            int32_t along = (direction == 0) || (direction == 2) ? -2 : 2;
+            int32_t across = jitterPick(random);
+            if (direction < 2) {
+                AddMove(stream, t, along, across);
+            } else {
+                AddMove(stream, t, across, along);
+            }
+        }
+        ++stream.flicks[direction];
+
+        t += 20000;
+        AddClick(stream, t, VKEY_LBUTTON, true);
+        AddClick(stream, t + 10000, VKEY_XBUTTON1, false);
+        AddNotch(stream, t + 50000, VKEY_WHEEL_UP, false);
+        AddNotch(stream, t + 60000, VKEY_WHEEL_DOWN, true);
+        AddNotch(stream, t + 70000, VKEY_WHEEL_DOWN, true);
+        ++stream.backs;
+        ++stream.zooms;
+        t += 100000;
+
+        // Circling, a turn every 30 ms: plenty of path, nowhere near straight.
+        uint64_t start = t;
+        for (uint64_t end = t + 1000000; t < end; t += REPORT_INTERVAL) {
+            double angle = 2 * pi * static_cast<double>(t - start) / 30000.0;
+            AddMove(stream, t, static_cast<int32_t>(lround(3 * cos(angle))), static_cast<int32_t>(lround(3 * sin(angle))));
+        }
+        AddClick(stream, start + 500060, VKEY_RBUTTON, true);
+
+        // A slow straight stroke: 1,000 counts a second, 200 by the time a flick is over.
+        t += 100000;
+        for (uint64_t end = t + 400000; t < end; t += 1000) {
+            AddMove(stream, t, 1, 0);
+        }
+        t += 100000;
+    }
+    stream.duration = t - 1000000;
+
+    // The clicks in the circling belong among its movements.
+    std::stable_sort(stream.events.begin(), stream.events.end(), [](MouseEvent const &a, MouseEvent const &b) {
+        return a.time < b.time;
+    });
+}
+
+/* The mouse path on a virtual clock, as the Windows hook and its frame timer run it, with
+   everything the hook decided counted. perEvent reduces every movement as it comes. */
+struct PathResult
+{
+    double dx;
+    double dy;
+    uint64_t samples;
+    unsigned actions[ACTION_COUNT];
+    unsigned passedButtons;
+    unsigned passedNotches;
+};
+
+void CountActions(CKeyEngine &engine, unsigned result, PathResult &path)
+{
+    if (result & CKeyEngine::RESULT_WAKE) {
+        engine.BeginDrain();
+        KeyEvent event;
+        while (engine.PopEvent(event)) {
+            if (event.action < ACTION_COUNT) {
+                ++path.actions[event.action];
+            }
+        }
+    }
+}
+
+void FlushFrame(CKeyEngine &engine, CMotionBatcher &motion, PathResult &path)
+{
+    MotionFrame frame;
+    uint8_t flick = motion.Flush(frame);
+    path.dx += frame.dx;
+    path.dy += frame.dy;
+    path.samples += frame.samples;
+    if (flick) {
+        CountActions(engine, engine.ProcessTap(flick, frame.end), path);
+    }
+}
+
+void RunPath(CKeymap const &keymap, Stream const &stream, bool perEvent, PathResult &path)
+{
+    memset(&path, 0, sizeof(path));
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    CMotionBatcher motion;
+    uint64_t frameDue = 0;
+    for (size_t i = 0; i < stream.events.size(); ++i) {
+        MouseEvent const &event = stream.events[i];
+        if (motion.IsPending() && (event.time >= frameDue)) {
+            FlushFrame(engine, motion, path);
+        }
+        uint32_t time = static_cast<uint32_t>(event.time / 1000);
+        if (event.kind == MouseEvent::MOVE) {
+            if (motion.Add(event.dx, event.dy, time)) {
+                frameDue = event.time + CMotionBatcher::FRAME_INTERVAL * 1000;
+            }
+            if (perEvent) {
+                FlushFrame(engine, motion, path);
+            }
+            continue;
+        }
+        unsigned result;
+        if (event.kind == MouseEvent::BUTTON) {
+            KeyEvent input;
+            input.time = time;
+            input.action = KEYMAP_ACTION_NONE;
+            input.keycode = event.keycode;
+            input.flags = event.down ? KeyEvent::FLAG_DOWN : 0;
+            result = engine.ProcessButton(input);
+            path.passedButtons += (result & CKeyEngine::RESULT_CONSUME) ? 0 : 1;
+        } else {
+            result = engine.ProcessTap(event.keycode, time);
+            path.passedNotches += (result & CKeyEngine::RESULT_CONSUME) ? 0 : 1;
+        }
+        CountActions(engine, result, path);
+    }
+    if (motion.IsPending()) {
+        FlushFrame(engine, motion, path);
+    }
+}
+
+bool CheckPath(CKeymap const &keymap, Stream const &stream, bool perEvent)
+{
+    PathResult path;
+    RunPath(keymap, stream, perEvent, path);
+    char const *name = perEvent ? "per movement" : "batched";
+    bool moved = (path.dx == static_cast<double>(stream.dx)) && (path.dy == static_cast<double>(stream.dy));
+    bool flicked = true;
+    for (int direction = 0; direction < 4; ++direction) {
+        flicked = flicked && (path.actions[ACTION_FLICK_LEFT + direction] == stream.flicks[direction]);
+    }
+    bool decided = (path.passedButtons == stream.passedButtons) && (path.passedNotches == stream.passedNotches) &&
+        (path.actions[ACTION_BACK] == stream.backs) && (path.actions[ACTION_ZOOM] == stream.zooms);
+    printf("%s: %llu movements, net (%.0f, %.0f) of (%lld, %lld); flicks %u/%u/%u/%u of %u/%u/%u/%u; "
+        "%u buttons and %u notches passed of %u and %u; %u backs, %u zooms\n",
+        name, static_cast<unsigned long long>(path.samples), path.dx, path.dy,
+        static_cast<long long>(stream.dx), static_cast<long long>(stream.dy),
+        path.actions[ACTION_FLICK_LEFT], path.actions[ACTION_FLICK_RIGHT], path.actions[ACTION_FLICK_UP],
+        path.actions[ACTION_FLICK_DOWN], stream.flicks[0], stream.flicks[1], stream.flicks[2], stream.flicks[3],
+        path.passedButtons, path.passedNotches, stream.passedButtons, stream.passedNotches,
+        path.actions[ACTION_BACK], path.actions[ACTION_ZOOM]);
+    return moved && flicked && decided;
+}
+
+bool CheckReduction()
+{
+    std::mt19937 random(5);
+    std::uniform_int_distribution<int> valuePick(-40, 40);
+    std::vector<float> dx(CMotionBatcher::BATCH_SAMPLES + 1);
+    std::vector<float> dy(CMotionBatcher::BATCH_SAMPLES + 1);
+    size_t wrong = 0;
+    for (size_t count = 0; count <= CMotionBatcher::BATCH_SAMPLES; ++count) {
+        // Start one float in, so the loads aren't aligned.
+        for (size_t i = 0; i <= count; ++i) {
+            dx[i] = static_cast<float>(valuePick(random));
+            dy[i] = static_cast<float>(valuePick(random));
+        }
+        MotionSums simd;
+        MotionSums scalar;
+        CMotionBatcher::Reduce(dx.data() + 1, dy.data() + 1, count, simd);
+        CMotionBatcher::ReduceScalar(dx.data() + 1, dy.data() + 1, count, scalar);
+        // The movements are whole numbers, so their sums are exact either way; the
+        // distance is summed in a different order.
+        if ((simd.dx != scalar.dx) || (simd.dy != scalar.dy) ||
+            (fabsf(simd.distance - scalar.distance) > 1e-5f * (scalar.distance + 1))) {
+            ++wrong;
+        }
+    }
+    printf("reduction: %zu batch lengths, %zu disagree with the plain loop\n", CMotionBatcher::BATCH_SAMPLES + 1, wrong);
+    return wrong == 0;
+}
+
+double CpuSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) / 1e9;
+}
+
+/* CPU milliseconds per second of input. */
+double TimePath(CKeymap const &keymap, Stream const &stream, bool perEvent)
+{
+    PathResult path;
+    double start = CpuSeconds();
+    for (int run = 0; run < TIMING_RUNS; ++run) {
+        RunPath(keymap, stream, perEvent, path);
+    }
+    return (CpuSeconds() - start) * 1000 / (TIMING_RUNS * static_cast<double>(stream.duration) / 1e6);
+}
+
+#ifdef BENCH_LINUX_HOOK
+
+struct HookActions
+{
+    unsigned actions[ACTION_COUNT];
+};
+
+void RecordAction(void *context, KeyEvent const &event)
+{
+    HookActions *hookActions = static_cast<HookActions *>(context);
+    if (event.action < ACTION_COUNT) {
+        ++hookActions->actions[event.action];
+    }
+}
+
+uint16_t EvdevButton(uint8_t keycode)
+{
+    switch (keycode) {
+    case VKEY_LBUTTON:
+        return BTN_LEFT;
+    case VKEY_RBUTTON:
+        return BTN_RIGHT;
+    case VKEY_MBUTTON:
+        return BTN_MIDDLE;
+    case VKEY_XBUTTON1:
+        return BTN_SIDE;
+    default:
+        return BTN_EXTRA;
+    }
+}
+
+void PushEvent(std::vector<struct input_event> &events, uint64_t time, uint16_t type, uint16_t code, int32_t value)
+{
+    struct input_event event;
+    event.time.tv_sec = static_cast<time_t>(time / 1000000);
+    event.time.tv_usec = static_cast<suseconds_t>(time % 1000000);
+    event.type = type;
+    event.code = code;
+    event.value = value;
+    events.push_back(event);
+}
+
+uint64_t EventMilliseconds(struct input_event const &event)
+{
+    return static_cast<uint64_t>(event.time.tv_sec) * 1000 + static_cast<uint64_t>(event.time.tv_usec) / 1000;
+}
+
+/* The stream as a mouse reports it: one SYN_REPORT per report, with the wheel's
+   high-resolution report after its notch. */
+void MakeEvdevStream(Stream const &stream, std::vector<struct input_event> &events)
+{
+    events.clear();
+    for (size_t i = 0; i < stream.events.size(); ++i) {
+        MouseEvent const &event = stream.events[i];
+        if (event.kind == MouseEvent::MOVE) {
+            if (event.dx) {
+                PushEvent(events, event.time, EV_REL, REL_X, event.dx);
+            }
+            if (event.dy) {
+                PushEvent(events, event.time, EV_REL, REL_Y, event.dy);
+            }
+        } else if (event.kind == MouseEvent::BUTTON) {
+            PushEvent(events, event.time, EV_KEY, EvdevButton(event.keycode), event.down ? 1 : 0);
+        } else {
+            int32_t value = (event.keycode == VKEY_WHEEL_UP) ? 1 : -1;
+            PushEvent(events, event.time, EV_REL, REL_WHEEL, value);
+            PushEvent(events, event.time, EV_REL, REL_WHEEL_HI_RES, value * 120);
+        }
+        PushEvent(events, event.time, EV_SYN, SYN_REPORT, 0);
+    }
+}
+
+/* Feed the reports to the hook in reads of up to 64 events, as a daemon that keeps up
+   would read them (so no read spans more than a millisecond), running its frame timer on
+   the stream's clock as the daemon's main loop would, into output. */
+void RunLinuxHook(CKeymap const &keymap, std::vector<struct input_event> const &events, CUinputOutput &output,
+    HookActions &hookActions)
+{
+    memset(&hookActions, 0, sizeof(hookActions));
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    CLinuxKeyboardHook hook(engine, output);
+    hook.SetActionHandler(RecordAction, &hookActions);
+    uint64_t frameDue = 0;
+    for (size_t i = 0; i < events.size(); ) {
+        uint64_t now = EventMilliseconds(events[i]);
+        size_t count = 1;
+        while ((count < 64) && (i + count < events.size()) && (EventMilliseconds(events[i + count]) == now)) {
+            ++count;
+        }
+        if (hook.IsMotionPending() && (now >= frameDue)) {
+            hook.FlushMotion();
+            frameDue = 0;
+        }
+        hook.OnInputEvents(&events[i], count);
+        i += count;
+        if (hook.IsMotionPending() && (frameDue == 0)) {
+            frameDue = now + CMotionBatcher::FRAME_INTERVAL;
+        }
+    }
+    if (hook.IsMotionPending()) {
+        hook.FlushMotion();
+    }
+}
+
+bool CheckLinuxHook(CKeymap const &keymap, Stream const &stream, double &cpuPerSecond)
+{
+    std::vector<struct input_event> events;
+    MakeEvdevStream(stream, events);
+    CUinputOutput output;
+    FILE *file = tmpfile();
+    if (!file || !output.Attach(dup(fileno(file)))) {
+        printf("Can't make a temporary file\n");
+        return false;
+    }
+    HookActions hookActions;
+    RunLinuxHook(keymap, events, output, hookActions);
+
+    fflush(file);
+    rewind(file);
+    int64_t dx = 0;
+    int64_t dy = 0;
+    unsigned buttons = 0;
+    unsigned boundButtons = 0;
+    unsigned notches = 0;
+    unsigned hiResNotches = 0;
+    unsigned wrongWheel = 0;
+    struct input_event event;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        if (event.type == EV_REL) {
+            switch (event.code) {
+            case REL_X:
+                dx += event.value;
+                break;
+            case REL_Y:
+                dy += event.value;
+                break;
+            case REL_WHEEL:
+                notches += (event.value == -1) ? 1 : 0;
+                wrongWheel += (event.value == -1) ? 0 : 1;
+                break;
+            case REL_WHEEL_HI_RES:
+                hiResNotches += (event.value == -120) ? 1 : 0;
+                wrongWheel += (event.value == -120) ? 0 : 1;
+                break;
+            default:
+                break;
+            }
+        } else if (event.type == EV_KEY) {
+            ++buttons;
+            boundButtons += (event.code == BTN_SIDE) ? 1 : 0;
+        }
+    }
+    fclose(file);
+
+    bool flicked = true;
+    for (int direction = 0; direction < 4; ++direction) {
+        flicked = flicked && (hookActions.actions[ACTION_FLICK_LEFT + direction] == stream.flicks[direction]);
+    }
+    bool ok = (dx == stream.dx) && (dy == stream.dy) && (buttons == stream.passedButtons) && (boundButtons == 0) &&
+        (notches == stream.passedNotches) && (hiResNotches == stream.passedNotches) && (wrongWheel == 0) && flicked &&
+        (hookActions.actions[ACTION_BACK] == stream.backs) && (hookActions.actions[ACTION_ZOOM] == stream.zooms);
+    printf("linux hook: net (%lld, %lld) written; %u buttons, %u notches, %u high-resolution notches passed "
+        "(%u, %u expected), %u wrong wheel reports; flicks %u/%u/%u/%u\n",
+        static_cast<long long>(dx), static_cast<long long>(dy), buttons, notches, hiResNotches,
+        stream.passedButtons, stream.passedNotches, wrongWheel,
+        hookActions.actions[ACTION_FLICK_LEFT], hookActions.actions[ACTION_FLICK_RIGHT],
+        hookActions.actions[ACTION_FLICK_UP], hookActions.actions[ACTION_FLICK_DOWN]);
+
+    // Timed into /dev/null, so it's the hook and one write() per read that count.
+    cpuPerSecond = 0;
+    CUinputOutput sink;
+    FILE *null = fopen("/dev/null", "wb");
+    if (null && sink.Attach(dup(fileno(null)))) {
+        double start = CpuSeconds();
+        for (int run = 0; run < TIMING_RUNS; ++run) {
+            RunLinuxHook(keymap, events, sink, hookActions);
+        }
+        cpuPerSecond = (CpuSeconds() - start) * 1000 / (TIMING_RUNS * static_cast<double>(stream.duration) / 1e6);
+    }
+    if (null) {
+        fclose(null);
+    }
+    return ok;
+}
+
+#endif
+
+} // namespace
+
+int main()
+{
+    bool ok = CheckReduction();
+
+    Stream stream;
+    GenerateStream(stream);
+    CKeymap keymap;
+    KeymapError error;
+    if (!keymap.Load(s_keymapText, sizeof(s_keymapText) - 1, s_actions, sizeof(s_actions) / sizeof(s_actions[0]), &error)) {
+        printf("line %u: %s\n", error.line, error.message);
+        return 1;
+    }
+    size_t moves = 0;
+    for (size_t i = 0; i < stream.events.size(); ++i) {
+        moves += (stream.events[i].kind == MouseEvent::MOVE) ? 1 : 0;
+    }
+    printf("stream: %.1f s, %zu movements, %zu buttons and notches\n", static_cast<double>(stream.duration) / 1e6,
+        moves, stream.events.size() - moves);
+    ok = CheckPath(keymap, stream, false) && ok;
+    ok = CheckPath(keymap, stream, true) && ok;
+
+    double batched = TimePath(keymap, stream, false);
+    double perEvent = TimePath(keymap, stream, true);
+    printf("CPU per second of input: %.3f ms batched, %.3f ms reducing every movement\n", batched, perEvent);
+#ifdef BENCH_LINUX_HOOK
+    double hook = 0;
+    ok = CheckLinuxHook(keymap, stream, hook) && ok;
+    printf("CPU per second of input through the linux hook: %.3f ms\n", hook);
+#endif
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,411 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Macro output. Loads a keymap with text= and send= macros and types them through a
+   COutputEngine into fake sinks, checking that:
+
+     - what comes out types exactly the macro's text, with every key pressed and released
+       in turn and no modifier left down
+     - modifiers the user is holding are let go of for the macro and pressed again only if
+       they're still held afterwards
+     - when the system refuses keys part way through, the rest of the macro is dropped but
+       nothing it pressed is left down and the held modifiers are still pressed again
+     - a paced macro (rate=) keeps to its rate on a virtual clock, both when flushed at
+       exactly the times the engine asks for and on a coarse 16 ms timer like Windows'
+     - the macros survive a round trip through a keymap image
+     - typing allocates nothing
+
+   and reports throughput in characters a second: through the engine alone into a sink
+   that only counts, and, on Linux, on through the uinput writer into /dev/null. Built by
+   the CMake build as OutputBench. */
+#include "AppActions.h"
+#include "BenchSupport.h"
+#include "Keymap.h"
+#include "KeyState.h"
+#include "OutputEngine.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#ifdef BENCH_UINPUT
+#include <fcntl.h>
+#include "UinputOutput.h"
+#include "UinputSink.h"
+#endif
+
+namespace {
+
+unsigned const THROUGHPUT_REPEATS = 5000;
+unsigned const PACED_RATE = 200;
+
+/* Roughly 400 characters of everything text= can type. */
+std::string BuildText()
+{
+    std::string text;
+    while (text.size() < 400) {
+        text += "The quick brown fox jumps over the lazy dog! 0123456789 (Pack my box with five dozen liquor jugs.) "
+            "~`@#$%^&*_-+=[]{}|;:',.<>/? ";
+    }
+    text += "\t\n";
+    return text;
+}
+
+/* text as a keymap text= token. */
+std::string Quote(std::string const &text)
+{
+    std::string quoted = "\"";
+    for (size_t i = 0; i < text.size(); ++i) {
+        switch (text[i]) {
+        case '\n':
+            quoted += "\\n";
+            break;
+        case '\t':
+            quoted += "\\t";
+            break;
+        case '"':
+        case '\\':
+            quoted += '\\';
+            quoted += text[i];
+            break;
+        default:
+            quoted += text[i];
+            break;
+        }
+    }
+    return quoted + "\"";
+}
+
+/* Counts keys and nothing more. */
+class CCountingSink : public IOutputSink
+{
+public:
+    CCountingSink() : m_keys(0) {}
+
+    virtual size_t SendKeys(KeyEvent const *keys, size_t count)
+    {
+        (void)keys;
+        m_keys += count;
+        return count;
+    }
+
+    uint64_t m_keys;
+};
+
+/* Plays the keys onto a model keyboard, noting what they type and when, and any key that
+   goes up without having gone down or down when it already was. It can be told to refuse
+   keys once, from a given key on. */
+class CCheckingSink : public IOutputSink
+{
+public:
+    CCheckingSink()
+    {
+        memset(m_characters, 0, sizeof(m_characters));
+        for (int c = 1; c < 128; ++c) {
+            uint16_t stroke = CKeymap::StrokeFromCharacter(static_cast<char>(c));
+            if (stroke) {
+                m_characters[(stroke >> 8) & KEYMOD_SHIFT][stroke & 0xFF] = static_cast<char>(c);
+            }
+        }
+        Reset();
+    }
+
+    void Reset()
+    {
+        memset(m_down, 0, sizeof(m_down));
+        m_text.clear();
+        m_times.clear();
+        m_log.clear();
+        m_errors = 0;
+        m_calls = 0;
+        m_refuseAt = NO_REFUSAL;
+    }
+
+    virtual size_t SendKeys(KeyEvent const *keys, size_t count)
+    {
+        ++m_calls;
+        if (m_log.size() + count > m_refuseAt) {
+            count = m_refuseAt - m_log.size();
+            m_refuseAt = NO_REFUSAL;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            KeyEvent const &key = keys[i];
+            bool down = (key.flags & KeyEvent::FLAG_DOWN) != 0;
+            if (m_down[key.keycode] == down) {
+                ++m_errors;
+            }
+            m_down[key.keycode] = down;
+            m_log.push_back(key);
+
+            unsigned modifiers = (m_down[VKEY_LSHIFT] || m_down[VKEY_RSHIFT]) ? KEYMOD_SHIFT : 0;
+            bool others = m_down[VKEY_LCONTROL] || m_down[VKEY_RCONTROL] || m_down[VKEY_LMENU] ||
+                m_down[VKEY_RMENU] || m_down[VKEY_LWIN] || m_down[VKEY_RWIN];
+            char c = m_characters[modifiers][key.keycode];
+            if (down && c && !others) {
+                m_text += c;
+                m_times.push_back(key.time);
+            }
+        }
+        return count;
+    }
+
+    unsigned CountDown() const
+    {
+        unsigned count = 0;
+        for (size_t i = 0; i < 256; ++i) {
+            count += m_down[i] ? 1 : 0;
+        }
+        return count;
+    }
+
+    char m_characters[2][256];
+    bool m_down[256];
+    std::string m_text;
+    std::vector<uint32_t> m_times;
+    std::vector<KeyEvent> m_log;
+    unsigned m_errors;
+    unsigned m_calls;
+    size_t m_refuseAt;
+
+    static size_t const NO_REFUSAL = ~static_cast<size_t>(0);
+};
+
+/* Type a macro through engine, with the clock at 0 and never moving. */
+double MeasureThroughput(COutputEngine &engine, uint16_t action, size_t characters, uint64_t &allocations)
+{
+    uint64_t allocationsBefore = GetAllocationCount();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < THROUGHPUT_REPEATS; ++i) {
+        engine.QueueMacro(action);
+        engine.Flush(0);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    allocations = GetAllocationCount() - allocationsBefore;
+    return THROUGHPUT_REPEATS * characters / seconds;
+}
+
+/* Type the paced macro on a virtual clock, flushing at the times the engine asks for, or
+   every tick milliseconds. Returns how long it took. */
+uint64_t TypePaced(COutputEngine &engine, uint16_t action, uint64_t tick)
+{
+    uint64_t start = 100000;
+    engine.QueueMacro(action);
+    uint64_t now = start;
+    uint64_t next = engine.Flush(now);
+    while (next != COutputEngine::NO_DEADLINE) {
+        now = tick ? (now + tick) : next;
+        next = engine.Flush(now);
+    }
+    return now - start;
+}
+
+/* The most characters typed within any window milliseconds. */
+size_t GetBurst(std::vector<uint32_t> const &times, uint32_t window)
+{
+    size_t most = 0;
+    size_t first = 0;
+    for (size_t i = 0; i < times.size(); ++i) {
+        while (times[i] - times[first] >= window) {
+            ++first;
+        }
+        most = std::max(most, i - first + 1);
+    }
+    return most;
+}
+
+} // namespace
+
+int main()
+{
+    int failures = 0;
+    std::string text = BuildText();
+    std::string keymapText =
+        "F5 text=" + Quote(text) + "\n"
+        "F6 send=Ctrl+C,Tab,Ctrl+V,Shift+Home,Delete\n"
+        "F7 text=" + Quote(text) + " rate=" + std::to_string(PACED_RATE) + "\n"
+        "Ctrl+K,Ctrl+T text=\"sequence\"\n";
+    CKeymap keymap;
+    KeymapError error;
+    if (!keymap.Load(keymapText.data(), keymapText.size(), g_actionNames, g_actionNameCount, &error)) {
+        printf("Keymap line %u: %s\n", error.line, error.message);
+        return 1;
+    }
+    uint16_t textAction = KeymapPressAction(keymap.Lookup(0, VKEY_F1 + 4));
+    uint16_t sendAction = KeymapPressAction(keymap.Lookup(0, VKEY_F1 + 5));
+    uint16_t pacedAction = KeymapPressAction(keymap.Lookup(0, VKEY_F1 + 6));
+    if (!IsKeymapMacro(textAction) || !IsKeymapMacro(sendAction) || !IsKeymapMacro(pacedAction) ||
+        (keymap.GetMacro(pacedAction)->rate != PACED_RATE)) {
+        printf("FAIL: the macros weren't bound\n");
+        return 1;
+    }
+
+    // The macros come back the same from an image.
+    std::vector<uint8_t> image;
+    keymap.WriteImage(image);
+    void *imageCopy = CKeymap::operator new(image.size());
+    memcpy(imageCopy, image.data(), image.size());
+    {
+        CKeymap attached;
+        KeymapMacro const *original = keymap.GetMacro(textAction);
+        KeymapMacro const *copy = nullptr;
+        if (attached.AttachImage(imageCopy, image.size(), &error)) {
+            copy = attached.GetMacro(textAction);
+        }
+        if (!copy || (copy->length != original->length) ||
+            (memcmp(attached.GetMacroStrokes(*copy), keymap.GetMacroStrokes(*original), original->length * sizeof(uint16_t)) != 0) ||
+            !attached.GetMacro(pacedAction) || (attached.GetMacro(pacedAction)->rate != PACED_RATE)) {
+            printf("FAIL: the macros didn't survive the image\n");
+            ++failures;
+        }
+    }
+    CKeymap::operator delete(imageCopy);
+
+    // Correctness: the text comes out exactly, in as few batches as it fits in, with
+    // nothing left down.
+    CCheckingSink checking;
+    CKeyStateTracker keyState;
+    COutputEngine checked(checking);
+    checked.SetKeymap(&keymap);
+    checked.SetKeyState(&keyState);
+    checked.QueueMacro(textAction);
+    checked.Flush(0);
+    if ((checking.m_text != text) || checking.m_errors || (checking.CountDown() != 0) ||
+        (checking.m_calls != (checking.m_log.size() + COutputEngine::BATCH_KEYS - 1) / COutputEngine::BATCH_KEYS)) {
+        printf("FAIL: text macro typed %zu of %zu characters right, %u key errors, %u keys left down, %u batches\n",
+            checking.m_text.size(), text.size(), checking.m_errors, checking.CountDown(), checking.m_calls);
+        ++failures;
+    }
+
+    // Held modifiers: Right Ctrl is let go of and pressed again; Left Shift is let go of
+    // and, having been released meanwhile, left alone.
+    checking.Reset();
+    checking.m_down[VKEY_RCONTROL] = true;
+    checking.m_down[VKEY_LSHIFT] = true;
+    keyState.Update(VKEY_RCONTROL, true, 1);
+    keyState.Update(VKEY_LSHIFT, true, 2);
+    checked.QueueMacro(sendAction);
+    keyState.Update(VKEY_LSHIFT, false, 3);
+    checked.Flush(0);
+    std::vector<KeyEvent> const &log = checking.m_log;
+    bool letGo = (log.size() >= 2) && !(log[0].flags & KeyEvent::FLAG_DOWN) && !(log[1].flags & KeyEvent::FLAG_DOWN) &&
+        (((log[0].keycode == VKEY_LSHIFT) && (log[1].keycode == VKEY_RCONTROL)) ||
+         ((log[0].keycode == VKEY_RCONTROL) && (log[1].keycode == VKEY_LSHIFT)));
+    bool restored = !log.empty() && (log.back().keycode == VKEY_RCONTROL) && (log.back().flags & KeyEvent::FLAG_DOWN) &&
+        (log.back().flags & KeyEvent::FLAG_EXTENDED);
+    if (!letGo || !restored || checking.m_errors || (checking.CountDown() != 1)) {
+        printf("FAIL: held modifiers weren't let go of and restored (%zu keys, %u errors)\n", log.size(), checking.m_errors);
+        ++failures;
+    }
+
+    // Refused part way through, at every key of the macro in turn: whatever was pressed
+    // comes up and Right Ctrl, still held, ends up down.
+    size_t sendKeys = log.size();
+    unsigned refusalFailures = 0;
+    for (size_t refuseAt = 0; refuseAt < sendKeys; ++refuseAt) {
+        checking.Reset();
+        checking.m_down[VKEY_RCONTROL] = true;
+        checking.m_refuseAt = refuseAt;
+        checked.QueueMacro(sendAction);
+        checked.Flush(0);
+        if (checking.m_errors || (checking.CountDown() != 1) || !checking.m_down[VKEY_RCONTROL] ||
+            (checked.GetPendingCount() != 0)) {
+            ++refusalFailures;
+        }
+    }
+    if (refusalFailures) {
+        printf("FAIL: refused keys left the keyboard wrong %u times of %zu\n", refusalFailures, sendKeys);
+        ++failures;
+    }
+    keyState.Reset();
+
+    // Pacing, flushing when asked to and on a 16 ms timer.
+    double expected = (text.size() - 1) * 1000.0 / PACED_RATE;
+    uint64_t ticks[] = { 0, 16 };
+    for (size_t i = 0; i < sizeof(ticks) / sizeof(ticks[0]); ++i) {
+        checking.Reset();
+        uint64_t taken = TypePaced(checked, pacedAction, ticks[i]);
+        size_t burst = GetBurst(checking.m_times, 1000);
+        size_t tickBurst = GetBurst(checking.m_times, ticks[i] ? static_cast<uint32_t>(ticks[i]) : 1);
+        printf("paced at %u/s, flushed %-10s %8.1f ms for %zu characters (ideal %.1f), at most %zu in a second, %zu at once, %u batches\n",
+            PACED_RATE, ticks[i] ? "every 16ms" : "on demand", static_cast<double>(taken), checking.m_text.size(), expected,
+            burst, tickBurst, checking.m_calls);
+        if ((checking.m_text != text) || checking.m_errors || (taken < expected) || (taken > expected + 20) ||
+            (tickBurst > (ticks[i] * PACED_RATE + 999) / 1000 + 1) || (burst > PACED_RATE + tickBurst)) {
+            printf("FAIL: pacing\n");
+            ++failures;
+        }
+    }
+
+    // Throughput.
+    printf("\n%-34s %14s %12s %12s\n", "throughput", "chars/s", "ns/char", "keys/batch");
+    {
+        CCountingSink counting;
+        COutputEngine engine(counting);
+        engine.SetKeymap(&keymap);
+        uint64_t allocations;
+        double rate = MeasureThroughput(engine, textAction, text.size(), allocations);
+        printf("%-34s %14.0f %12.1f %12.1f\n", "engine into a counting sink", rate, 1e9 / rate,
+            static_cast<double>(engine.GetSentCount()) / engine.GetBatchCount());
+        if (allocations || engine.GetDroppedCount() || engine.GetFailedCount()) {
+            printf("FAIL: %llu allocations, %u macros dropped, %llu keys failed\n", static_cast<unsigned long long>(allocations),
+                engine.GetDroppedCount(), static_cast<unsigned long long>(engine.GetFailedCount()));
+            ++failures;
+        }
+    }
+#ifdef BENCH_UINPUT
+    {
+        CUinputOutput output;
+        int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if ((fd < 0) || !output.Attach(fd)) {
+            printf("Can't open /dev/null\n");
+            return 1;
+        }
+        CUinputSink sink(output);
+        COutputEngine engine(sink);
+        engine.SetKeymap(&keymap);
+        uint64_t allocations;
+        double rate = MeasureThroughput(engine, textAction, text.size(), allocations);
+        printf("%-34s %14.0f %12.1f %12.1f\n", "engine and uinput into /dev/null", rate, 1e9 / rate,
+            static_cast<double>(engine.GetSentCount()) / engine.GetBatchCount());
+        printf("%llu input_event records written in %llu batches\n",
+            static_cast<unsigned long long>(output.GetWrittenCount()), static_cast<unsigned long long>(engine.GetBatchCount()));
+        if (allocations || engine.GetFailedCount() || output.GetFailedCount()) {
+            printf("FAIL: %llu allocations, %llu keys failed\n", static_cast<unsigned long long>(allocations),
+                static_cast<unsigned long long>(engine.GetFailedCount()));
+            ++failures;
+        }
+    }
+#endif
+
+    return failures ? 1 : 0;
+}
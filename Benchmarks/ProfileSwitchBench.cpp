@@ -0,0 +1,310 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Per-application keymap profiles. For keymaps with more and more applications, each
+   binding F1 to an action of its own on top of a global binding, it checks that:
+
+     - every application gets its own F1, an application without a section gets the
+       global one, and keys a section doesn't bind fall through to the global bindings
+     - the same holds for the keymap saved as an image and attached
+     - switching between applications that have been seen before, and typing, allocate
+       nothing
+
+   and reports what the hook pays: nanoseconds per key with a steady focus, against an
+   engine that doesn't follow the focus at all, and the time from a focus change to the
+   first key looked up in the new profile. Where the daemon's CFocusReader is built, it
+   also times focus changes written to its FIFO until the hook sees them. Built by the
+   CMake build as ProfileSwitchBench. */
+#include "BenchSupport.h"
+#include "KeyEngine.h"
+#include "LatencyHistogram.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#ifdef BENCH_FOCUS_READER
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "FocusReader.h"
+#endif
+
+namespace {
+
+size_t const KEY_PRESSES = 2000000;
+size_t const SWITCHES = 200000;
+size_t const FIFO_SWITCHES = 2000;
+
+uint8_t const VKEY_F2 = VKEY_F1 + 1;
+uint8_t const VKEY_F3 = VKEY_F1 + 2;
+
+uint16_t const ACTION_GLOBAL_F1 = 1;
+uint16_t const ACTION_GLOBAL_F2 = 2;
+uint16_t const ACTION_FIRST_APP = 3;
+
+std::string AppName(size_t app)
+{
+    return "app" + std::to_string(app) + ".exe";
+}
+
+/* A global F1 and F2, then a section per application rebinding F1. */
+bool LoadKeymap(size_t appCount, CKeymap &keymap)
+{
+    std::vector<std::string> names;
+    names.push_back("global1");
+    names.push_back("global2");
+    for (size_t i = 0; i < appCount; ++i) {
+        names.push_back("app" + std::to_string(i));
+    }
+    std::vector<KeymapActionName> actions;
+    for (size_t i = 0; i < names.size(); ++i) {
+        KeymapActionName action = { names[i].c_str(), static_cast<uint16_t>(ACTION_GLOBAL_F1 + i) };
+        actions.push_back(action);
+    }
+
+    std::string text = "F1 press=global1\n";
+    for (size_t i = 0; i < appCount; ++i) {
+        text += "[" + AppName(i) + "]\nF1 press=app" + std::to_string(i) + "\n";
+    }
+    text += "[*]\nF2 press=global2\n";
+
+    KeymapError error;
+    if (!keymap.Load(text.data(), text.size(), actions.data(), actions.size(), &error)) {
+        printf("%zu applications: line %u: %s\n", appCount, error.line, error.message);
+        return false;
+    }
+    return true;
+}
+
+/* Press and release a key; returns the press's action, if it queued one. */
+uint16_t TapKey(CKeyEngine &engine, uint8_t keycode, uint32_t &time)
+{
+    KeyEvent press = { time, 0, keycode, KeyEvent::FLAG_DOWN };
+    KeyEvent release = { time + 5, 0, keycode, 0 };
+    time += 30;
+    uint16_t action = KEYMAP_ACTION_NONE;
+    if (engine.ProcessKey(press) & CKeyEngine::RESULT_WAKE) {
+        engine.BeginDrain();
+        KeyEvent event;
+        while (engine.PopEvent(event)) {
+            action = event.action;
+        }
+    }
+    engine.ProcessKey(release);
+    return action;
+}
+
+void SetApp(CAppFocus &focus, size_t app)
+{
+    std::string name = AppName(app);
+    focus.SetApplication(name.data(), name.size());
+}
+
+bool CheckProfiles(CKeymap const &keymap, size_t appCount, char const *what)
+{
+    CAppFocus focus;
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    engine.SetAppFocus(&focus);
+    uint32_t time = 0;
+    bool ok = true;
+    for (size_t i = 0; i <= appCount; ++i) {
+        // The last time round, an application without a section.
+        SetApp(focus, i);
+        uint16_t expected = (i < appCount) ? static_cast<uint16_t>(ACTION_FIRST_APP + i) : ACTION_GLOBAL_F1;
+        uint16_t f1 = TapKey(engine, VKEY_F1, time);
+        uint16_t f2 = TapKey(engine, VKEY_F2, time);
+        if ((f1 != expected) || (f2 != ACTION_GLOBAL_F2)) {
+            printf("%zu applications (%s): %s got F1 %u and F2 %u\n", appCount, what,
+                AppName(i).c_str(), f1, f2);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/* Nanoseconds per key for an unbound key, the common case. */
+double TimeKeys(CKeyEngine &engine)
+{
+    uint32_t time = 0;
+    uint64_t start = LatencyClockNow();
+    for (size_t i = 0; i < KEY_PRESSES; ++i) {
+        TapKey(engine, VKEY_F3, time);
+    }
+    return static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / (KEY_PRESSES * 2);
+}
+
+} // namespace
+
+int main()
+{
+    static size_t const appCounts[] = { 1, 10, 100, 1000 };
+
+    bool ok = true;
+    printf("%6s %8s %8s %10s %10s %10s %10s %8s\n",
+        "apps", "profiles", "KB", "plain ns", "focus ns", "switch p50", "switch p99", "allocs");
+    for (size_t c = 0; c < sizeof(appCounts) / sizeof(appCounts[0]); ++c) {
+        size_t appCount = appCounts[c];
+        CKeymap keymap;
+        if (!LoadKeymap(appCount, keymap)) {
+            return 1;
+        }
+        ok = CheckProfiles(keymap, appCount, "compiled") && ok;
+
+        std::vector<uint8_t> image;
+        keymap.WriteImage(image);
+        std::vector<uint64_t> aligned((image.size() + 63) / 8 + 8);
+        uint8_t *start = reinterpret_cast<uint8_t *>(aligned.data());
+        start += (64 - reinterpret_cast<uintptr_t>(start) % 64) % 64;
+        memcpy(start, image.data(), image.size());
+        CKeymap attached;
+        KeymapError error;
+        if (!attached.AttachImage(start, image.size(), &error)) {
+            printf("%zu applications: %s\n", appCount, error.message);
+            ok = false;
+        } else {
+            ok = CheckProfiles(attached, appCount, "image") && ok;
+        }
+
+        // What following the focus costs per key, when it isn't moving.
+        CKeyEngine plainEngine;
+        plainEngine.SetKeymap(&keymap);
+        double plainNs = TimeKeys(plainEngine);
+
+        CAppFocus focus;
+        CKeyEngine engine;
+        engine.SetKeymap(&keymap);
+        engine.SetAppFocus(&focus);
+        SetApp(focus, 0);
+        double focusNs = TimeKeys(engine);
+
+        // From a focus change to the first key in the new profile. Every name has been
+        // seen once already, so nothing should allocate.
+        std::vector<std::string> names;
+        for (size_t i = 0; i <= appCount; ++i) {
+            names.push_back(AppName(i));
+            SetApp(focus, i);
+        }
+        CLatencyHistogram switches;
+        uint32_t time = 0;
+        uint32_t switchCount = engine.GetProfileSwitchCount();
+        uint64_t allocations = GetAllocationCount();
+        for (size_t i = 0; i < SWITCHES; ++i) {
+            // Round the applications, with one that has no section among them, starting
+            // after the one the engine is on.
+            size_t app = (i + 1) % (appCount + 1);
+            uint16_t expected = (app < appCount) ? static_cast<uint16_t>(ACTION_FIRST_APP + app) : ACTION_GLOBAL_F1;
+            uint64_t ticks = LatencyClockNow();
+            focus.SetApplication(names[app].data(), names[app].size());
+            uint16_t action = TapKey(engine, VKEY_F1, time);
+            switches.RecordTicks(ticks);
+            if (action != expected) {
+                printf("%zu applications: switching to %s got F1 %u\n", appCount, names[app].c_str(), action);
+                ok = false;
+                break;
+            }
+        }
+        allocations = GetAllocationCount() - allocations;
+        switchCount = engine.GetProfileSwitchCount() - switchCount;
+        if ((allocations != 0) || (switchCount != SWITCHES)) {
+            printf("%zu applications: %llu allocations and %u profile switches for %zu focus changes\n", appCount,
+                static_cast<unsigned long long>(allocations), switchCount, SWITCHES);
+            ok = false;
+        }
+
+        printf("%6zu %8zu %8zu %10.1f %10.1f %10llu %10llu %8llu\n", appCount, keymap.GetProfileCount(),
+            image.size() / 1024, plainNs, focusNs,
+            static_cast<unsigned long long>(switches.GetValueAtPercentile(50)),
+            static_cast<unsigned long long>(switches.GetValueAtPercentile(99)),
+            static_cast<unsigned long long>(allocations));
+    }
+
+#ifdef BENCH_FOCUS_READER
+    {
+        // The daemon's way in: names written to a FIFO, read on CFocusReader's thread,
+        // until the hook's next key sees the new profile.
+        size_t const appCount = 10;
+        CKeymap keymap;
+        if (!LoadKeymap(appCount, keymap)) {
+            return 1;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/ProfileSwitchBench.%d.fifo", static_cast<int>(getpid()));
+        unlink(path);
+        CAppFocus focus;
+        CFocusReader reader(focus);
+        if ((mkfifo(path, 0600) < 0) || !reader.Start(path)) {
+            perror(path);
+            unlink(path);
+            return 1;
+        }
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+        unlink(path);
+        if (fd < 0) {
+            perror(path);
+            return 1;
+        }
+
+        CKeyEngine engine;
+        engine.SetKeymap(&keymap);
+        engine.SetAppFocus(&focus);
+        CLatencyHistogram latency;
+        uint32_t time = 0;
+        for (size_t i = 0; i < FIFO_SWITCHES; ++i) {
+            size_t app = i % appCount;
+            std::string line = AppName(app) + "\n";
+            uint32_t seen = focus.GetSwitchCount();
+            uint64_t ticks = LatencyClockNow();
+            if (write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+                perror("FIFO");
+                ok = false;
+                break;
+            }
+            while (focus.GetSwitchCount() == seen) {
+            }
+            uint16_t action = TapKey(engine, VKEY_F1, time);
+            latency.RecordTicks(ticks);
+            if (action != ACTION_FIRST_APP + app) {
+                printf("FIFO: switching to %s got F1 %u\n", AppName(app).c_str(), action);
+                ok = false;
+                break;
+            }
+        }
+        close(fd);
+        reader.Stop();
+        printf("\nFocus changes through the FIFO: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+            latency.GetValueAtPercentile(50) / 1e3, latency.GetValueAtPercentile(99) / 1e3, latency.GetMax() / 1e3);
+    }
+#endif
+
+    return ok ? 0 : 1;
+}
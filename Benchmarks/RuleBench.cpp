@@ -0,0 +1,329 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Conditional bindings (when=). For conditions of increasing size on PageDown, it checks
+   that:
+
+     - over a random stream of presses and releases of PageDown, Ctrl, Alt, Shift and the
+       locks, PageDown's binding applies exactly when a plain C++ version of its condition
+       says it should, and its release follows whatever its press decided
+     - the same holds for the keymap saved as an image and attached
+     - none of it allocates
+
+   and reports what a condition costs: nanoseconds per evaluation on its own, and per key
+   through the engine against a key bound without one. Then, with more and more
+   conditional bindings stacked on one key, it shows the instruction budget cutting the
+   chain off and the key getting its plain binding. Built by the CMake build as RuleBench. */
+#include "BenchSupport.h"
+#include "KeyEngine.h"
+#include "LatencyHistogram.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+size_t const RANDOM_EVENTS = 200000;
+size_t const EVALUATIONS = 5000000;
+size_t const KEY_PRESSES = 1000000;
+
+uint8_t const VKEY_F5 = VKEY_F1 + 4;
+
+uint16_t const ACTION_DOWN = 1;
+uint16_t const ACTION_UP = 2;
+uint16_t const ACTION_PLAIN = 3;
+uint16_t const ACTION_BASE = 4;
+uint16_t const ACTION_CHAIN_FIRST = 5;
+
+typedef bool (*Reference)(CKeyStateTracker const &keys, uint32_t time);
+
+int32_t Since(CKeyStateTracker const &keys, uint8_t keycode, uint32_t time)
+{
+    uint32_t edge = keys.GetEdgeTime(keycode);
+    return (edge == 0) ? INT32_MAX : static_cast<int32_t>(time - edge);
+}
+
+int32_t SinceCtrl(CKeyStateTracker const &keys, uint32_t time)
+{
+    int32_t left = Since(keys, VKEY_LCONTROL, time);
+    int32_t right = Since(keys, VKEY_RCONTROL, time);
+    return (left < right) ? left : right;
+}
+
+bool CapsLock(CKeyStateTracker const &keys, uint32_t)
+{
+    return (keys.GetModifierSnapshot() & KEYSTATE_CAPSLOCK) != 0;
+}
+
+bool CapsLockAndCtrl(CKeyStateTracker const &keys, uint32_t time)
+{
+    return CapsLock(keys, time) && (SinceCtrl(keys, time) < 200);
+}
+
+bool Everything(CKeyStateTracker const &keys, uint32_t time)
+{
+    bool locks = (keys.GetModifierSnapshot() & (KEYSTATE_CAPSLOCK | KEYSTATE_NUMLOCK)) != 0;
+    bool alt = keys.IsDown(VKEY_LMENU) || keys.IsDown(VKEY_RMENU);
+    return locks && (SinceCtrl(keys, time) < 200) && (keys.GetPressCount(VKEY_NEXT) % 3 != 0) &&
+        (keys.GetDownCount() <= 3) && !alt;
+}
+
+struct Condition
+{
+    char const *name;
+    char const *text;
+    Reference reference;
+};
+
+Condition const s_conditions[] = {
+    { "lock", "capslock", CapsLock },
+    { "lock+time", "capslock && since(Ctrl) < 200", CapsLockAndCtrl },
+    { "everything", "(capslock || numlock) && since(Ctrl) < 200 && presses(PageDown) % 3 != 0 && held <= 3 && !down(Alt)",
+        Everything },
+};
+
+KeymapActionName const s_actions[] = {
+    { "down", ACTION_DOWN },
+    { "up", ACTION_UP },
+    { "plain", ACTION_PLAIN },
+    { "base", ACTION_BASE },
+};
+
+bool LoadKeymap(std::string const &text, CKeymap &keymap, KeymapActionName const *actions, size_t actionCount)
+{
+    KeymapError error;
+    if (!keymap.Load(text.data(), text.size(), actions, actionCount, &error)) {
+        printf("line %u: %s\n", error.line, error.message);
+        return false;
+    }
+    return true;
+}
+
+/* Run a key through the engine; returns the action it queued, if any. */
+uint16_t SendKey(CKeyEngine &engine, uint8_t keycode, bool down, uint32_t time, unsigned &result)
+{
+    KeyEvent event = { time, 0, keycode, static_cast<uint8_t>(down ? KeyEvent::FLAG_DOWN : 0) };
+    result = engine.ProcessKey(event);
+    uint16_t action = KEYMAP_ACTION_NONE;
+    if (result & CKeyEngine::RESULT_WAKE) {
+        engine.BeginDrain();
+        KeyEvent queued;
+        while (engine.PopEvent(queued)) {
+            action = queued.action;
+        }
+    }
+    return action;
+}
+
+bool CheckRandomStream(CKeymap const &keymap, Condition const &condition, char const *what)
+{
+    static uint8_t const keys[] = {
+        VKEY_NEXT, VKEY_NEXT, VKEY_NEXT, VKEY_LCONTROL, VKEY_RCONTROL, VKEY_LMENU, VKEY_LSHIFT,
+        VKEY_CAPITAL, VKEY_NUMLOCK, VKEY_F5,
+    };
+    std::mt19937 random(12345);
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    uint32_t time = 1000;
+    bool decided = false;
+    size_t applied = 0;
+    size_t presses = 0;
+    uint64_t allocations = GetAllocationCount();
+    for (size_t i = 0; i < RANDOM_EVENTS; ++i) {
+        uint8_t keycode = keys[random() % (sizeof(keys) / sizeof(keys[0]))];
+        bool down = !engine.GetKeyState().IsDown(keycode) || ((random() % 4) == 0);
+        time += random() % 150;
+        bool wasDown = engine.GetKeyState().IsDown(keycode);
+        unsigned result;
+        uint16_t action = SendKey(engine, keycode, down, time, result);
+        if (keycode != VKEY_NEXT) {
+            continue;
+        }
+        // The engine's key state includes this key, as the condition saw it.
+        uint16_t expectedAction;
+        if (down && !wasDown) {
+            decided = condition.reference(engine.GetKeyState(), time);
+            expectedAction = decided ? ACTION_DOWN : KEYMAP_ACTION_NONE;
+            applied += decided;
+            ++presses;
+        } else {
+            expectedAction = (decided && !down) ? ACTION_UP : KEYMAP_ACTION_NONE;
+        }
+        if ((action != expectedAction) || (((result & CKeyEngine::RESULT_CONSUME) != 0) != decided)) {
+            printf("%s (%s): event %zu, PageDown %s, got action %u (consumed %d), expected %u (%d)\n",
+                condition.name, what, i, down ? "down" : "up", action, (result & CKeyEngine::RESULT_CONSUME) != 0,
+                expectedAction, decided);
+            return false;
+        }
+    }
+    allocations = GetAllocationCount() - allocations;
+    if (allocations != 0) {
+        printf("%s (%s): %llu allocations\n", condition.name, what, static_cast<unsigned long long>(allocations));
+        return false;
+    }
+    if ((applied == 0) || (applied == presses)) {
+        printf("%s (%s): the condition held for %zu of %zu presses\n", condition.name, what, applied, presses);
+        return false;
+    }
+    return true;
+}
+
+/* Nanoseconds per key, press and release, with the locks and Ctrl set up so that the
+   conditions run to the end. */
+double TimeKeys(CKeymap const &keymap, uint8_t keycode)
+{
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    engine.GetKeyState().SetLockState(KEYSTATE_CAPSLOCK);
+    uint32_t time = 1000;
+    unsigned result;
+    SendKey(engine, VKEY_LCONTROL, true, time, result);
+    SendKey(engine, VKEY_LCONTROL, false, time, result);
+    uint64_t start = LatencyClockNow();
+    for (size_t i = 0; i < KEY_PRESSES; ++i) {
+        SendKey(engine, keycode, true, time, result);
+        SendKey(engine, keycode, false, time, result);
+    }
+    return static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / (KEY_PRESSES * 2);
+}
+
+/* Nanoseconds to resolve PageDown's entry, on its own. */
+double TimeEvaluations(CKeymap const &keymap)
+{
+    CKeyStateTracker keys;
+    keys.SetLockState(KEYSTATE_CAPSLOCK);
+    keys.Update(VKEY_LCONTROL, true, 1000);
+    keys.Update(VKEY_LCONTROL, false, 1010);
+    keys.Update(VKEY_NEXT, true, 1050);
+    RuleContext context = { &keys, 1050, KEY_PRESS };
+    KeymapEntry entry = keymap.Lookup(0, VKEY_NEXT);
+    CRuleTable const &rules = keymap.GetRules();
+    uint32_t sum = 0;
+    uint64_t start = LatencyClockNow();
+    for (size_t i = 0; i < EVALUATIONS; ++i) {
+        bool exhausted;
+        context.time = 1050 + static_cast<uint32_t>(i & 63);
+        sum += rules.Resolve(entry, context, RULE_BUDGET, exhausted);
+    }
+    double ns = static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / EVALUATIONS;
+    volatile uint32_t sink = sum;
+    (void)sink;
+    return ns;
+}
+
+unsigned CountInstructions(char const *text)
+{
+    RuleCondition condition;
+    char const *where;
+    CompileRuleCondition(text, strlen(text), condition, where);
+    return condition.length;
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = true;
+    printf("%-12s %6s %10s %10s %10s\n", "condition", "instrs", "eval ns", "key ns", "plain ns");
+    for (size_t c = 0; c < sizeof(s_conditions) / sizeof(s_conditions[0]); ++c) {
+        Condition const &condition = s_conditions[c];
+        std::string text = "*+PageUp press=plain release=up\n*+PageDown press=down release=up when=\"";
+        text += condition.text;
+        text += "\"\n";
+        CKeymap keymap;
+        if (!LoadKeymap(text, keymap, s_actions, sizeof(s_actions) / sizeof(s_actions[0]))) {
+            return 1;
+        }
+        ok = CheckRandomStream(keymap, condition, "compiled") && ok;
+
+        std::vector<uint8_t> image;
+        keymap.WriteImage(image);
+        std::vector<uint64_t> aligned((image.size() + 63) / 8 + 8);
+        uint8_t *start = reinterpret_cast<uint8_t *>(aligned.data());
+        start += (64 - reinterpret_cast<uintptr_t>(start) % 64) % 64;
+        memcpy(start, image.data(), image.size());
+        CKeymap attached;
+        KeymapError error;
+        if (!attached.AttachImage(start, image.size(), &error)) {
+            printf("%s: %s\n", condition.name, error.message);
+            ok = false;
+        } else {
+            ok = CheckRandomStream(attached, condition, "image") && ok;
+        }
+
+        printf("%-12s %6u %10.1f %10.1f %10.1f\n", condition.name, CountInstructions(condition.text),
+            TimeEvaluations(keymap), TimeKeys(keymap, VKEY_NEXT), TimeKeys(keymap, VKEY_PRIOR));
+    }
+
+    // Conditional bindings stacked on F5, none of whose conditions hold, so each key runs
+    // all of them, until the budget runs out.
+    static char const chainCondition[] = "held > 100 || presses(F5) == 12345 || since(F5) < 0";
+    static size_t const chainLengths[] = { 1, 4, 16, 64 };
+    unsigned instructions = CountInstructions(chainCondition);
+    printf("\n%6s %8s %10s %10s %8s\n", "rules", "instrs", "key ns", "exhausted", "action");
+    for (size_t c = 0; c < sizeof(chainLengths) / sizeof(chainLengths[0]); ++c) {
+        size_t length = chainLengths[c];
+        std::vector<std::string> names;
+        std::vector<KeymapActionName> actions(s_actions, s_actions + sizeof(s_actions) / sizeof(s_actions[0]));
+        std::string text = "F5 press=base\n";
+        for (size_t i = 0; i < length; ++i) {
+            names.push_back("chain" + std::to_string(i));
+        }
+        for (size_t i = 0; i < length; ++i) {
+            KeymapActionName action = { names[i].c_str(), static_cast<uint16_t>(ACTION_CHAIN_FIRST + i) };
+            actions.push_back(action);
+            text += "F5 press=" + names[i] + " when=\"" + chainCondition + "\"\n";
+        }
+        CKeymap keymap;
+        if (!LoadKeymap(text, keymap, actions.data(), actions.size())) {
+            return 1;
+        }
+
+        CKeyEngine engine;
+        engine.SetKeymap(&keymap);
+        uint32_t time = 1000;
+        unsigned result;
+        uint16_t action = SendKey(engine, VKEY_F5, true, time, result);
+        SendKey(engine, VKEY_F5, false, time + 5, result);
+        bool exhausted = engine.GetRuleBudgetExceededCount() != 0;
+        if ((action != ACTION_BASE) || (exhausted != (length * instructions > RULE_BUDGET))) {
+            printf("%zu rules: F5 got %u, budget %s\n", length, action, exhausted ? "exhausted" : "not exhausted");
+            ok = false;
+        }
+        printf("%6zu %8zu %10.1f %10s %8u\n", length, length * instructions, TimeKeys(keymap, VKEY_F5),
+            exhausted ? "yes" : "no", action);
+    }
+
+    return ok ? 0 : 1;
+}
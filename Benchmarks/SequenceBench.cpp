@@ -0,0 +1,147 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Measures the per-key cost of the sequence matcher as the number of sequence bindings
+   grows. Built by the CMake build as SequenceBench.
+
+   Each run generates random two- and three-stroke sequences and chords, then types a
+   fixed random stream of keys through a CKeyEngine and reports nanoseconds per event.
+   Following a transition is a single hash probe however many bindings there are; what
+   growth there is comes from more of the input being held back and replayed as more of
+   it starts a sequence, which the matches and replayed columns show. */
+#include "KeyEngine.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+namespace {
+
+uint8_t RandomLetter(std::mt19937 &random)
+{
+    return static_cast<uint8_t>(VKEY_A + random() % 26);
+}
+
+void GenerateBindings(size_t count, std::mt19937 &random, std::vector<SequenceBinding> &bindings)
+{
+    bindings.clear();
+    for (size_t i = 0; i < count; ++i) {
+        SequenceBinding binding;
+        memset(&binding, 0, sizeof(binding));
+        binding.chord = (i % 8) == 0;
+        binding.length = static_cast<uint8_t>(binding.chord ? 2 : 2 + random() % 2);
+        unsigned modifiers = binding.chord ? 0 : (random() % 4 ? KEYMOD_CONTROL : KEYMOD_ALT);
+        for (unsigned n = 0; n < binding.length; ++n) {
+            binding.strokes[n] = MakeStroke(modifiers, RandomLetter(random));
+        }
+        binding.action = static_cast<uint16_t>(1 + i % (KEYMAP_MACRO_FIRST - 1));
+        bindings.push_back(binding);
+    }
+}
+
+/* A stream of presses and releases with Ctrl held for runs of keys, so that a good share
+   of keys start or continue sequences. */
+void GenerateInput(size_t count, std::mt19937 &random, std::vector<KeyEvent> &events)
+{
+    events.clear();
+    uint32_t time = 0;
+    bool control = false;
+    while (events.size() < count) {
+        if (random() % 6 == 0) {
+            control = !control;
+            KeyEvent event = { time, 0, VKEY_LCONTROL, static_cast<uint8_t>(control ? KeyEvent::FLAG_DOWN : 0) };
+            events.push_back(event);
+        }
+        uint8_t keycode = RandomLetter(random);
+        time += 20 + random() % 100;
+        KeyEvent press = { time, 0, keycode, KeyEvent::FLAG_DOWN };
+        events.push_back(press);
+        time += 10 + random() % 40;
+        KeyEvent release = { time, 0, keycode, 0 };
+        events.push_back(release);
+    }
+}
+
+} // namespace
+
+int main()
+{
+    static size_t const bindingCounts[] = { 0, 10, 100, 1000, 10000, 50000 };
+    static size_t const EVENTS = 1000000;
+
+    std::mt19937 random(12345);
+    std::vector<KeyEvent> input;
+    GenerateInput(EVENTS, random, input);
+
+    printf("%10s %10s %10s %10s %10s\n", "bindings", "states", "ns/event", "matches", "replayed");
+    for (size_t b = 0; b < sizeof(bindingCounts) / sizeof(bindingCounts[0]); ++b) {
+        std::vector<SequenceBinding> bindings;
+        GenerateBindings(bindingCounts[b], random, bindings);
+        CKeymap keymap;
+        KeymapSource source;
+        source.sequences = bindings.data();
+        source.sequenceCount = bindings.size();
+        if (!keymap.Compile(source)) {
+            printf("Failed to compile %zu bindings\n", bindingCounts[b]);
+            return 1;
+        }
+
+        CKeyEngine engine;
+        engine.SetKeymap(&keymap);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < input.size(); ++i) {
+            unsigned result = engine.ProcessKey(input[i]);
+
+            // Stand in for the consumer: drain the queue and feed replays straight back,
+            // as the injected keys would be.
+            if (result & CKeyEngine::RESULT_WAKE) {
+                engine.BeginDrain();
+                KeyEvent event;
+                while (engine.PopEvent(event)) {
+                    if (event.flags & KeyEvent::FLAG_REPLAY) {
+                        engine.ProcessKey(event);
+                    }
+                }
+                engine.BeginDrain();
+                while (engine.PopEvent(event)) {
+                }
+            }
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        printf("%10zu %10zu %10.1f %10u %10u\n", bindingCounts[b], keymap.GetSequences().GetStateCount(),
+            ns / static_cast<double>(input.size()), engine.GetSequenceMatchCount(), engine.GetReplayedCount());
+    }
+    return 0;
+}
@@ -0,0 +1,309 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Runs the app on the simulator's virtual clock (see Simulation/Simulator.h). It checks
+   that:
+
+     - a handful of scenarios for the default keymap hold to the millisecond: the bait
+       going back to the hook BAIT_DURATION after B, B again putting that off, the fish
+       while A is held, keys passed on or swallowed, a sequence replayed when it times
+       out, held keys replayed with the modifiers they were typed with (Ctrl let go of or
+       pressed while the sequence waited, on a timeout and on a break) and a paced macro
+       keeping to its rate
+     - over a long random stream of presses, autorepeats and releases of the default
+       keymap's keys and a few others, with pauses of every length, every key is passed or
+       swallowed as the keymap says and, once the icon has had a frame to catch up, the
+       one showing is the one a plain C++ model of the actions says it should be
+
+   and reports how much faster than real time the simulation runs, and what the hook's
+   decisions cost on the way. Built by the CMake build as SimulationBench. */
+#include "AppActions.h"
+#include "SimulationScript.h"
+#include "Simulator.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+
+namespace {
+
+size_t const RANDOM_EVENTS = 2000000;
+uint64_t const ICON_FRAME = 16;
+
+struct Scenario
+{
+    char const *name;
+    char const *script;
+};
+
+Scenario const s_scenarios[] = {
+    { "bait",
+        "1000 down B\n"
+        "     expect swallowed\n"
+        "+40  up B\n"
+        "     expect icon bait\n"
+        "+249 expect icon bait\n"
+        "+1   expect icon hook\n"
+        "     expect keys\n" },
+    { "bait again",
+        "1000 tap B\n"
+        "+200 tap B\n"
+        "+249 expect icon bait\n"
+        "+1   expect icon hook\n" },
+    { "fish",
+        "1000 down A\n"
+        "     expect icon fish\n"
+        "+500 down A\n"
+        "+33  down A\n"
+        "     expect icon fish\n"
+        "+100 up A\n"
+        "     expect icon hook\n"
+        "     expect keys\n"
+        "     expect action\n" },
+    { "fish flicker",
+        "1000 down A\n"
+        "+5   up A\n"
+        "+5   down A\n"
+        "     expect icon fish\n"
+        "+5   up A\n"
+        "     expect icon fish\n"
+        "+1   expect icon hook\n" },
+    { "pass and swallow",
+        "1000 tap C\n"
+        "     expect passed\n"
+        "+10  down PageUp\n"
+        "     expect swallowed\n"
+        "+10  up PageUp\n"
+        "     expect swallowed\n"
+        "+10  tap Space\n"
+        "     expect keys C Space\n"
+        "     expect icon hook\n" },
+    { "sequence",
+        "keymap\n"
+        "F1,F2  press=stats\n"
+        "end\n"
+        "1000 tap F1\n"
+        "     expect swallowed\n"
+        "+100 tap F2\n"
+        "     expect keys\n"
+        "     expect action stats\n"
+        "+100 tap F1\n"
+        "+999 expect keys\n"
+        "+1   expect keys F1\n"
+        "     expect action\n" },
+    { "sequence replayed with its modifiers, timed out",
+        "keymap\n"
+        "Ctrl+K,Ctrl+C  press=stats\n"
+        "end\n"
+        "1000 down LCtrl\n"
+        "     expect keys +LCtrl\n"
+        "+10  tap K\n"
+        "     expect swallowed\n"
+        "+10  up LCtrl\n"
+        "     expect keys -LCtrl\n"
+        "+989 expect keys\n"
+        "+1   expect keys +LCtrl K -LCtrl\n"
+        "     expect action\n" },
+    { "sequence replayed with its modifiers, broken off",
+        "keymap\n"
+        "Ctrl+K,Ctrl+C  press=stats\n"
+        "end\n"
+        "1000 down LCtrl\n"
+        "+10  tap K\n"
+        "+10  up LCtrl\n"
+        "+10  tap X\n"
+        "     expect keys +LCtrl -LCtrl +LCtrl K -LCtrl X\n"
+        "     expect action\n" },
+    { "sequence replayed without a modifier pressed since",
+        "keymap\n"
+        "K,C  press=stats\n"
+        "end\n"
+        "1000 tap K\n"
+        "+10  down LCtrl\n"
+        "+10  tap C\n"
+        "+10  up LCtrl\n"
+        "     expect keys +LCtrl -LCtrl K +LCtrl C -LCtrl\n"
+        "     expect action\n" },
+    { "sequence replayed, modifiers unchanged",
+        "keymap\n"
+        "Ctrl+K,Ctrl+C  press=stats\n"
+        "end\n"
+        "1000 down LCtrl\n"
+        "+10  tap K\n"
+        "+10  tap X\n"
+        "+10  up LCtrl\n"
+        "     expect keys +LCtrl K X -LCtrl\n"
+        "     expect action\n" },
+    { "paced macro",
+        "keymap\n"
+        "*+F5  send=X,Y,Z rate=10\n"
+        "end\n"
+        "1000 tap F5\n"
+        "     expect swallowed\n"
+        "     expect keys X\n"
+        "+99  expect keys\n"
+        "+1   expect keys Y\n"
+        "+100 expect keys Z\n" },
+};
+
+bool RunScenarios()
+{
+    bool ok = true;
+    unsigned checks = 0;
+    for (size_t i = 0; i < sizeof(s_scenarios) / sizeof(s_scenarios[0]); ++i) {
+        Scenario const &scenario = s_scenarios[i];
+        CSimulator simulator;
+        SimulationResult result;
+        if (!RunSimulationScript(scenario.name, scenario.script, strlen(scenario.script), simulator, stdout, result) ||
+            (result.failures != 0)) {
+            printf("Scenario \"%s\" failed\n", scenario.name);
+            ok = false;
+        }
+        checks += result.checks;
+    }
+    printf("%zu scenarios, %u checks\n\n", sizeof(s_scenarios) / sizeof(s_scenarios[0]), checks);
+    return ok;
+}
+
+/* The default keymap's actions, by hand. */
+struct IconModel
+{
+    unsigned icon;
+    uint64_t baitDeadline;  // 0 if the bait isn't showing on a timer
+    uint64_t lastChange;    // when the icon was last asked to change
+
+    void Expire(uint64_t now)
+    {
+        if (baitDeadline && (baitDeadline <= now)) {
+            icon = ICON_HOOK;
+            lastChange = baitDeadline;
+            baitDeadline = 0;
+        }
+    }
+
+    void Show(unsigned newIcon, uint64_t now)
+    {
+        icon = newIcon;
+        lastChange = now;
+    }
+};
+
+bool RunRandomStream()
+{
+    static uint8_t const keys[] = { 'A', 'B', VKEY_PRIOR, 'C', VKEY_SPACE, '7' };
+    static bool const swallowed[] = { true, true, true, false, false, false };
+    static size_t const KEY_COUNT = sizeof(keys) / sizeof(keys[0]);
+
+    CSimulator simulator;
+    IconModel model = { ICON_HOOK, 0, 0 };
+    bool held[KEY_COUNT] = {};
+    std::mt19937 random(11);
+    uint64_t time = 1000;
+    size_t decisionErrors = 0;
+    size_t iconErrors = 0;
+    size_t iconChecks = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < RANDOM_EVENTS; ++i) {
+        // Mostly typing speed, with bursts faster than a frame and pauses longer than the
+        // bait lasts.
+        unsigned kind = random() % 16;
+        uint64_t gap = (kind < 4) ? 1 + random() % 8 : (kind < 15) ? 20 + random() % 150 : 200 + random() % 400;
+        time += gap;
+
+        // Just before the key, check the icon if it's had a frame since it last changed.
+        uint64_t check = time - 1;
+        model.Expire(check);
+        if (check >= model.lastChange + ICON_FRAME) {
+            simulator.AdvanceTo(check);
+            ++iconChecks;
+            if (simulator.GetIcon() != model.icon) {
+                if (iconErrors++ < 10) {
+                    printf("At %llu ms the icon is %u, expected %u\n",
+                        static_cast<unsigned long long>(check), simulator.GetIcon(), model.icon);
+                }
+            }
+        }
+        model.Expire(time);
+
+        size_t k = random() % KEY_COUNT;
+        bool down = !held[k] || (random() % 4 == 0);
+        if (simulator.Key(time, keys[k], down) != swallowed[k]) {
+            if (decisionErrors++ < 10) {
+                printf("At %llu ms key 0x%02X was %s\n", static_cast<unsigned long long>(time), keys[k],
+                    swallowed[k] ? "passed" : "swallowed");
+            }
+        }
+        if ((keys[k] == 'A') && (down != held[k])) {
+            model.Show(down ? ICON_FISH : ICON_HOOK, time);
+        } else if ((keys[k] == 'B') && !down) {
+            model.Show(ICON_BAIT, time);
+            model.baitDeadline = time + BAIT_DURATION;
+        }
+        held[k] = down;
+
+        if (simulator.GetRecords().size() > 4096) {
+            simulator.ClearRecords();
+        }
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double simulated = static_cast<double>(simulator.GetTime()) / 1000.0;
+
+    CLatencyHistogram const &hook = simulator.GetHookLatency();
+    CLatencyHistogram const &dispatch = simulator.GetDispatchLatency();
+    printf("random stream        %10zu keys  %8zu icon checks  %3zu + %zu errors\n",
+        RANDOM_EVENTS, iconChecks, decisionErrors, iconErrors);
+    printf("virtual time         %10.0f s   in %.3f s of real time (%.0fx), %.0f ns per key\n",
+        simulated, wall, simulated / wall, wall * 1e9 / RANDOM_EVENTS);
+    printf("hook decision        p50 %6llu ns  p99 %6llu ns  max %8llu ns\n",
+        static_cast<unsigned long long>(hook.GetValueAtPercentile(50.0)),
+        static_cast<unsigned long long>(hook.GetValueAtPercentile(99.0)),
+        static_cast<unsigned long long>(hook.GetMax()));
+    printf("action dispatch      p50 %6llu ns  p99 %6llu ns  max %8llu ns\n",
+        static_cast<unsigned long long>(dispatch.GetValueAtPercentile(50.0)),
+        static_cast<unsigned long long>(dispatch.GetValueAtPercentile(99.0)),
+        static_cast<unsigned long long>(dispatch.GetMax()));
+    return (decisionErrors == 0) && (iconErrors == 0) && (iconChecks > RANDOM_EVENTS / 2);
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = RunScenarios();
+    ok = RunRandomStream() && ok;
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
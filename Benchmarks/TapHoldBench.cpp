@@ -0,0 +1,656 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Tap-hold keys and layers (taphold and layer in the keymap). For each of three keymaps,
+   a mod-tap key, a layer-tap key over a layer that maps one of the other keys, and two
+   mod-tap keys with different timeouts, it types every ordering of three keys' presses
+   and releases with every combination of gaps between them (0, 1, 50, 99 or 150 ms), and
+   checks that:
+
+     - the resolver's output matches a model that settles each dual-role key by looking
+       ahead at what comes after it (its release first: tap; its timeout first, or the
+       release of a key pressed after it: hold), rewrites presses accordingly, releases
+       keys as they were pressed and keeps everything in order
+     - every event goes on exactly when the model says: as it comes, or when the last
+       dual-role key holding it back is settled, so no key waits longer than the timeout
+     - on Linux, the same events read through the daemon's CLinuxKeyboardHook, with the
+       keymap saved as an image and attached, come out of its uinput writer as the
+       model's output, with no key left held
+
+   plus momentary and toggled layers, autorepeat, a full queue of held-back keys and
+   pausing. It reports the delay keys saw and what the resolver costs per event. Built by
+   the CMake build as TapHoldBench. */
+#include "KeyEngine.h"
+#include "LatencyHistogram.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#ifdef BENCH_LINUX_HOOK
+#include <unistd.h>
+#include "EvdevKeys.h"
+#include "LinuxKeyboardHook.h"
+#include "UinputOutput.h"
+#endif
+
+namespace {
+
+unsigned const KEYS = 3;
+uint32_t const GAPS[] = { 0, 1, 50, 99, 150 };
+size_t const GAP_CHOICES = sizeof(GAPS) / sizeof(GAPS[0]);
+uint32_t const SCENARIO_SPACING = 10000;   // ms between scenarios, well past any timeout
+
+/* A key as the model sees it. */
+struct ModelKey
+{
+    uint8_t keycode;
+    uint8_t role;       // TAPHOLD_NONE, _MOD_TAP or _LAYER_TAP
+    uint8_t tap;
+    uint8_t hold;
+    uint32_t timeout;
+    uint8_t layered;    // what it types while a layer-tap key is held (0 = itself)
+};
+
+struct KeymapCase
+{
+    char const *name;
+    char const *text;
+    ModelKey keys[KEYS];
+};
+
+KeymapCase const s_cases[] = {
+    { "mod-tap",
+        "taphold CapsLock tap=Escape hold=LCtrl\n",
+        { { VKEY_CAPITAL, TAPHOLD_MOD_TAP, VKEY_ESCAPE, VKEY_LCONTROL, 200, 0 },
+          { 'J', TAPHOLD_NONE, 0, 0, 0, 0 },
+          { 'K', TAPHOLD_NONE, 0, 0, 0, 0 } } },
+    { "layer-tap",
+        "taphold Space tap=Space layer=1\n"
+        "layer 1 J=Left\n",
+        { { VKEY_SPACE, TAPHOLD_LAYER_TAP, VKEY_SPACE, 0, 200, 0 },
+          { 'J', TAPHOLD_NONE, 0, 0, 0, VKEY_LEFT },
+          { 'L', TAPHOLD_NONE, 0, 0, 0, 0 } } },
+    { "two mod-taps",
+        "taphold CapsLock tap=Escape hold=LCtrl\n"
+        "taphold F tap=F hold=LShift timeout=150\n",
+        { { VKEY_CAPITAL, TAPHOLD_MOD_TAP, VKEY_ESCAPE, VKEY_LCONTROL, 200, 0 },
+          { 'J', TAPHOLD_NONE, 0, 0, 0, 0 },
+          { 'F', TAPHOLD_MOD_TAP, 'F', VKEY_LSHIFT, 150, 0 } } },
+};
+
+struct Edge
+{
+    uint32_t time;
+    uint8_t key;        // index into the case's keys
+    bool down;
+};
+
+struct Output
+{
+    uint8_t keycode;
+    bool down;
+    uint32_t when;      // the time it went on
+};
+
+/* Every order in which three keys can each be pressed and then released. */
+void GenerateOrders(std::vector<std::vector<Edge>> &orders)
+{
+    std::vector<Edge> order;
+    unsigned state[KEYS] = {};     // 0 up, 1 down, 2 done
+    struct Step
+    {
+        static void Next(std::vector<Edge> &order, unsigned *state, std::vector<std::vector<Edge>> &orders)
+        {
+            if (order.size() == 2 * KEYS) {
+                orders.push_back(order);
+                return;
+            }
+            for (unsigned k = 0; k < KEYS; ++k) {
+                if (state[k] == 2) {
+                    continue;
+                }
+                Edge edge = { 0, static_cast<uint8_t>(k), state[k] == 0 };
+                order.push_back(edge);
+                ++state[k];
+                Next(order, state, orders);
+                --state[k];
+                order.pop_back();
+            }
+        }
+    };
+    Step::Next(order, state, orders);
+}
+
+/* What should come out: each dual-role press is settled by whichever comes first after it
+   of its own release (tap), its timeout or the release of a key pressed after it (hold),
+   and everything from the press up to that point waits until then. */
+void Model(KeymapCase const &keymapCase, std::vector<Edge> const &edges, std::vector<Output> &outputs)
+{
+    size_t count = edges.size();
+    std::vector<uint32_t> when(count);
+    std::vector<uint8_t> sent(count, 0);
+    std::vector<bool> held(count, false);
+    for (size_t i = 0; i < count; ++i) {
+        when[i] = edges[i].time;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        ModelKey const &key = keymapCase.keys[edges[i].key];
+        if (!edges[i].down || (key.role == TAPHOLD_NONE)) {
+            continue;
+        }
+        uint32_t deadline = edges[i].time + key.timeout;
+        uint32_t settled = deadline;
+        size_t last = count;        // the events it holds back are [i, last)
+        bool hold = true;
+        for (size_t j = i + 1; j < count; ++j) {
+            if (edges[j].time >= deadline) {
+                last = j;
+                break;
+            }
+            if (edges[j].down) {
+                continue;
+            }
+            bool pressedSince = false;
+            for (size_t p = i + 1; p < j; ++p) {
+                pressedSince = pressedSince || ((edges[p].key == edges[j].key) && edges[p].down);
+            }
+            if ((edges[j].key == edges[i].key) || pressedSince) {
+                hold = (edges[j].key != edges[i].key);
+                settled = edges[j].time;
+                last = j + 1;
+                break;
+            }
+        }
+        for (size_t e = i; e < last; ++e) {
+            when[e] = std::max(when[e], settled);
+        }
+        held[i] = hold;
+        sent[i] = hold ? key.hold : key.tap;
+    }
+
+    // A layer-tap key that's held turns its layer on for the presses after it until its
+    // release.
+    for (size_t e = 0; e < count; ++e) {
+        ModelKey const &key = keymapCase.keys[edges[e].key];
+        if (!edges[e].down || (key.role != TAPHOLD_NONE)) {
+            continue;
+        }
+        sent[e] = key.keycode;
+        for (size_t q = 0; (q < e) && key.layered; ++q) {
+            ModelKey const &layerKey = keymapCase.keys[edges[q].key];
+            if (!edges[q].down || (layerKey.role != TAPHOLD_LAYER_TAP) || !held[q]) {
+                continue;
+            }
+            size_t release = q + 1;
+            while ((release < count) && (edges[release].key != edges[q].key)) {
+                ++release;
+            }
+            if (release > e) {
+                sent[e] = key.layered;
+            }
+        }
+    }
+
+    uint8_t pressedAs[KEYS] = {};
+    for (size_t e = 0; e < count; ++e) {
+        uint8_t keycode = edges[e].down ? sent[e] : pressedAs[edges[e].key];
+        if (edges[e].down) {
+            pressedAs[edges[e].key] = sent[e];
+        }
+        if (keycode) {
+            Output output = { keycode, edges[e].down, when[e] };
+            outputs.push_back(output);
+        }
+    }
+}
+
+KeyEvent MakeInput(KeymapCase const &keymapCase, Edge const &edge)
+{
+    KeyEvent input;
+    input.time = edge.time;
+    input.action = KEYMAP_ACTION_NONE;
+    input.keycode = keymapCase.keys[edge.key].keycode;
+    input.flags = edge.down ? KeyEvent::FLAG_DOWN : 0;
+    return input;
+}
+
+void Collect(CTapHoldResolver &resolver, uint32_t now, std::vector<Output> &outputs)
+{
+    for (unsigned i = 0; i < resolver.GetOutputCount(); ++i) {
+        KeyEvent const &event = resolver.GetOutput()[i];
+        Output output = { event.keycode, (event.flags & KeyEvent::FLAG_DOWN) != 0, now };
+        outputs.push_back(output);
+    }
+    resolver.ClearOutput();
+}
+
+/* Feed edges to the resolver, calling Expire() exactly at each deadline, as the engine's
+   timer would. */
+void Resolve(CTapHoldResolver &resolver, KeymapCase const &keymapCase, std::vector<Edge> const &edges,
+    std::vector<Output> &outputs)
+{
+    for (size_t i = 0; i < edges.size(); ++i) {
+        while (resolver.IsPending() && (static_cast<int32_t>(edges[i].time - resolver.GetDeadline()) >= 0)) {
+            uint32_t deadline = resolver.GetDeadline();
+            resolver.Expire(deadline, false);
+            Collect(resolver, deadline, outputs);
+        }
+        KeyEvent input = MakeInput(keymapCase, edges[i]);
+        if (resolver.ProcessKey(input, false)) {
+            Output output = { input.keycode, edges[i].down, edges[i].time };
+            outputs.push_back(output);
+        } else {
+            Collect(resolver, edges[i].time, outputs);
+        }
+    }
+    while (resolver.IsPending()) {
+        uint32_t deadline = resolver.GetDeadline();
+        resolver.Expire(deadline, false);
+        Collect(resolver, deadline, outputs);
+    }
+}
+
+bool SameOutput(std::vector<Output> const &a, std::vector<Output> const &b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if ((a[i].keycode != b[i].keycode) || (a[i].down != b[i].down) || (a[i].when != b[i].when)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void PrintOutput(char const *label, std::vector<Output> const &outputs)
+{
+    printf("  %s:", label);
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        printf(" %02X%c@%u", outputs[i].keycode, outputs[i].down ? 'v' : '^', outputs[i].when);
+    }
+    printf("\n");
+}
+
+/* Every ordering with every combination of gaps, one after another. */
+void GenerateScenarios(std::vector<std::vector<Edge>> const &orders, std::vector<std::vector<Edge>> &scenarios)
+{
+    size_t combinations = 1;
+    for (unsigned g = 0; g + 1 < 2 * KEYS; ++g) {
+        combinations *= GAP_CHOICES;
+    }
+    uint32_t start = 1000;
+    for (size_t o = 0; o < orders.size(); ++o) {
+        for (size_t c = 0; c < combinations; ++c) {
+            std::vector<Edge> edges = orders[o];
+            uint32_t t = start;
+            size_t pick = c;
+            for (size_t e = 0; e < edges.size(); ++e) {
+                if (e > 0) {
+                    t += GAPS[pick % GAP_CHOICES];
+                    pick /= GAP_CHOICES;
+                }
+                edges[e].time = t;
+            }
+            scenarios.push_back(edges);
+            start += SCENARIO_SPACING;
+        }
+    }
+}
+
+bool CheckResolver(KeymapCase const &keymapCase, CKeymap const &keymap, std::vector<std::vector<Edge>> const &scenarios,
+    std::vector<Output> &expected)
+{
+    CTapHoldResolver resolver;
+    resolver.SetTable(&keymap.GetTapHold());
+    size_t wrong = 0;
+    uint32_t maxTimeout = 0;
+    uint32_t dualPresses = 0;
+    for (unsigned k = 0; k < KEYS; ++k) {
+        maxTimeout = std::max(maxTimeout, keymapCase.keys[k].timeout);
+    }
+    std::vector<Output> want;
+    std::vector<Output> got;
+    for (size_t s = 0; s < scenarios.size(); ++s) {
+        want.clear();
+        got.clear();
+        Model(keymapCase, scenarios[s], want);
+        Resolve(resolver, keymapCase, scenarios[s], got);
+        if (!SameOutput(want, got) && (wrong++ == 0)) {
+            printf("%s: scenario %zu differs\n  typed:", keymapCase.name, s);
+            for (size_t e = 0; e < scenarios[s].size(); ++e) {
+                printf(" %02X%c@%u", keymapCase.keys[scenarios[s][e].key].keycode, scenarios[s][e].down ? 'v' : '^',
+                    scenarios[s][e].time);
+            }
+            printf("\n");
+            PrintOutput("model", want);
+            PrintOutput("resolver", got);
+        }
+        for (size_t e = 0; e < scenarios[s].size(); ++e) {
+            dualPresses += (scenarios[s][e].down && (keymapCase.keys[scenarios[s][e].key].role != TAPHOLD_NONE)) ? 1 : 0;
+        }
+        expected.insert(expected.end(), want.begin(), want.end());
+    }
+    uint32_t settled = resolver.GetTapCount() + resolver.GetHoldCount();
+    double mean = resolver.GetDelayedCount() ? static_cast<double>(resolver.GetTotalDelay()) / resolver.GetDelayedCount() : 0.0;
+    printf("%s: %zu scenarios, %zu wrong; %u taps, %u holds; %u events held back, %.1f ms on average, %u ms at most\n",
+        keymapCase.name, scenarios.size(), wrong, resolver.GetTapCount(), resolver.GetHoldCount(),
+        resolver.GetDelayedCount(), mean, resolver.GetMaxDelay());
+    return (wrong == 0) && (settled == dualPresses) && (resolver.GetMaxDelay() <= maxTimeout) &&
+        (resolver.GetActiveLayers() == 0) && (resolver.GetOverflowCount() == 0);
+}
+
+/* Directed cases, each typed on a fresh resolver. */
+struct DirectedCase
+{
+    char const *name;
+    char const *typed;      // <key><v|^|r>@<ms>, space separated; r is an autorepeat
+    char const *wanted;     // <key><v|^>
+    bool paused;            // from the second event on
+    uint32_t overflows;
+};
+
+char const s_directedKeymap[] =
+    "taphold CapsLock tap=Escape hold=LCtrl\n"
+    "taphold RAlt layer=2\n"
+    "taphold ScrollLock toggle=2\n"
+    "taphold Tab tap=Tab layer=3\n"
+    "layer 2 H=Left J=Down\n"
+    "layer 3 H=Home\n";
+
+DirectedCase const s_directed[] = {
+    { "momentary layer", "RAlt v@0 H v@10 H ^@20 K v@30 K ^@40 RAlt ^@50 H v@60 H ^@70",
+        "Left v Left ^ K v K ^ H v H ^", false, 0 },
+    { "toggled layer", "ScrollLock v@0 ScrollLock ^@10 J v@20 J ^@30 ScrollLock v@40 ScrollLock ^@50 J v@60 J ^@70",
+        "Down v Down ^ J v J ^", false, 0 },
+    { "higher layer wins", "RAlt v@0 Tab v@10 H v@300 H ^@310 J v@320 J ^@330 Tab ^@340 RAlt ^@350",
+        "Home v Home ^ Down v Down ^", false, 0 },
+    { "released as pressed", "H v@0 RAlt v@10 H ^@20 RAlt ^@30", "H v H ^", false, 0 },
+    { "held into autorepeat", "CapsLock v@0 CapsLock r@100 CapsLock r@300 CapsLock r@330 CapsLock ^@400",
+        "LCtrl v LCtrl v LCtrl v LCtrl ^", false, 0 },
+    { "full queue", "CapsLock v@0 A v@1 B v@2 C v@3 D v@4 E v@5 F v@6 G v@7 H v@8 I v@9 J v@10 K v@11 L v@12 "
+        "M v@13 N v@14 O v@15 P v@16 Q v@17",
+        "LCtrl v A v B v C v D v E v F v G v H v I v J v K v L v M v N v O v P v Q v", false, 1 },
+    { "paused", "CapsLock v@0 J v@10 J ^@20 CapsLock ^@30", "CapsLock v J v J ^ CapsLock ^", true, 0 },
+};
+
+bool ParseDirected(char const *text, std::vector<KeyEvent> &events, bool withTimes)
+{
+    char const *p = text;
+    while (*p) {
+        while (*p == ' ') {
+            ++p;
+        }
+        char const *name = p;
+        while (*p && (*p != ' ')) {
+            ++p;
+        }
+        uint8_t keycode = CKeymap::KeycodeFromName(name, static_cast<size_t>(p - name));
+        ++p;
+        char edge = *p++;
+        unsigned time = 0;
+        if (withTimes && ((*p != '@') || (sscanf(p + 1, "%u", &time) != 1))) {
+            return false;
+        }
+        while (*p && (*p != ' ')) {
+            ++p;
+        }
+        if (!keycode || ((edge != 'v') && (edge != '^') && (edge != 'r'))) {
+            return false;
+        }
+        KeyEvent event;
+        event.time = time;
+        event.action = KEYMAP_ACTION_NONE;
+        event.keycode = keycode;
+        event.flags = (edge == '^') ? 0 : KeyEvent::FLAG_DOWN;
+        events.push_back(event);
+    }
+    return true;
+}
+
+bool CheckDirected()
+{
+    CKeymap keymap;
+    KeymapError error;
+    if (!keymap.Load(s_directedKeymap, sizeof(s_directedKeymap) - 1, nullptr, 0, &error)) {
+        printf("directed keymap, line %u: %s\n", error.line, error.message);
+        return false;
+    }
+    bool ok = true;
+    for (size_t c = 0; c < sizeof(s_directed) / sizeof(s_directed[0]); ++c) {
+        DirectedCase const &directed = s_directed[c];
+        std::vector<KeyEvent> typed;
+        std::vector<KeyEvent> wanted;
+        if (!ParseDirected(directed.typed, typed, true) || !ParseDirected(directed.wanted, wanted, false)) {
+            printf("%s: can't parse the case\n", directed.name);
+            ok = false;
+            continue;
+        }
+        CTapHoldResolver resolver;
+        resolver.SetTable(&keymap.GetTapHold());
+        std::vector<Output> got;
+        for (size_t i = 0; i < typed.size(); ++i) {
+            while (resolver.IsPending() && (static_cast<int32_t>(typed[i].time - resolver.GetDeadline()) >= 0)) {
+                uint32_t deadline = resolver.GetDeadline();
+                resolver.Expire(deadline, false);
+                Collect(resolver, deadline, got);
+            }
+            if (resolver.ProcessKey(typed[i], directed.paused && (i > 0))) {
+                Output output = { typed[i].keycode, (typed[i].flags & KeyEvent::FLAG_DOWN) != 0, typed[i].time };
+                got.push_back(output);
+            } else {
+                Collect(resolver, typed[i].time, got);
+            }
+        }
+        bool same = (got.size() == wanted.size()) && (resolver.GetOverflowCount() == directed.overflows) &&
+            !resolver.IsPending() && (resolver.GetActiveLayers() == 0);
+        for (size_t i = 0; same && (i < got.size()); ++i) {
+            same = (got[i].keycode == wanted[i].keycode) && (got[i].down == ((wanted[i].flags & KeyEvent::FLAG_DOWN) != 0));
+        }
+        printf("%s: %s\n", directed.name, same ? "ok" : "WRONG");
+        if (!same) {
+            PrintOutput("got", got);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+double TimeResolver(KeymapCase const &keymapCase, CKeymap const &keymap, std::vector<std::vector<Edge>> const &scenarios)
+{
+    CTapHoldResolver resolver;
+    resolver.SetTable(&keymap.GetTapHold());
+    std::vector<Output> outputs;
+    outputs.reserve(2 * KEYS * 2);
+    size_t events = 0;
+    uint64_t start = LatencyClockNow();
+    for (size_t s = 0; s < scenarios.size(); ++s) {
+        outputs.clear();
+        Resolve(resolver, keymapCase, scenarios[s], outputs);
+        events += scenarios[s].size();
+    }
+    return static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / events;
+}
+
+double TimeEngine(KeymapCase const &keymapCase, CKeymap const &keymap, std::vector<std::vector<Edge>> const &scenarios)
+{
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    size_t events = 0;
+    uint64_t start = LatencyClockNow();
+    for (size_t s = 0; s < scenarios.size(); ++s) {
+        for (size_t e = 0; e < scenarios[s].size(); ++e) {
+            uint32_t deadline;
+            if (engine.GetSequenceDeadline(deadline) && (static_cast<int32_t>(scenarios[s][e].time - deadline) >= 0)) {
+                engine.ProcessTimeout(deadline);
+            }
+            engine.ProcessKey(MakeInput(keymapCase, scenarios[s][e]));
+        }
+        // Re-inject what the engine queued, as the hook would.
+        engine.BeginDrain();
+        KeyEvent event;
+        while (engine.PopEvent(event)) {
+            if (event.flags & KeyEvent::FLAG_REPLAY) {
+                event.flags |= KeyEvent::FLAG_INJECTED;
+                engine.ProcessKey(event);
+            }
+        }
+        events += scenarios[s].size();
+    }
+    return static_cast<double>(LatencyClockToNanoseconds(LatencyClockNow() - start)) / events;
+}
+
+#ifdef BENCH_LINUX_HOOK
+
+/* Type the scenarios through the daemon's hook, one read per event, with its timeouts
+   called when they fall due, into a temporary file in place of uinput. */
+bool CheckLinuxHook(KeymapCase const &keymapCase, CKeymap const &keymap, std::vector<std::vector<Edge>> const &scenarios,
+    std::vector<Output> const &expected)
+{
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    CUinputOutput output;
+    FILE *file = tmpfile();
+    if (!file || !output.Attach(dup(fileno(file)))) {
+        printf("Can't make a temporary file\n");
+        return false;
+    }
+    CLinuxKeyboardHook hook(engine, output);
+    for (size_t s = 0; s < scenarios.size(); ++s) {
+        for (size_t e = 0; e <= scenarios[s].size(); ++e) {
+            // After the last event, the time after it is the next scenario's start.
+            uint32_t time = (e < scenarios[s].size()) ? scenarios[s][e].time : scenarios[s][0].time + SCENARIO_SPACING - 1;
+            uint32_t deadline;
+            while (engine.GetSequenceDeadline(deadline) && (static_cast<int32_t>(time - deadline) >= 0)) {
+                hook.ProcessTimeout(deadline);
+            }
+            if (e == scenarios[s].size()) {
+                break;
+            }
+            struct input_event event;
+            memset(&event, 0, sizeof(event));
+            event.time.tv_sec = static_cast<time_t>(time / 1000);
+            event.time.tv_usec = static_cast<suseconds_t>(time % 1000 * 1000);
+            event.type = EV_KEY;
+            event.code = EvdevFromVirtualKey(keymapCase.keys[scenarios[s][e].key].keycode);
+            event.value = scenarios[s][e].down ? 1 : 0;
+            hook.OnInputEvents(&event, 1);
+        }
+    }
+
+    fflush(file);
+    rewind(file);
+    size_t next = 0;
+    size_t wrong = 0;
+    size_t written = 0;
+    struct input_event event;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        if (event.type != EV_KEY) {
+            continue;
+        }
+        ++written;
+        if ((next == expected.size()) ||
+            (event.code != EvdevFromVirtualKey(expected[next].keycode, IsExtendedKey(expected[next].keycode))) ||
+            (event.value != (expected[next].down ? 1 : 0))) {
+            ++wrong;
+        }
+        ++next;
+    }
+    fclose(file);
+    bool held = false;
+    for (unsigned k = 0; k < KEYMAP_KEYS; ++k) {
+        held = held || engine.GetKeyState().IsDown(static_cast<uint8_t>(k));
+    }
+    bool ok = (wrong == 0) && (written == expected.size()) && !held;
+    printf("%s, linux hook: %zu key events written of %zu, %zu wrong%s\n", keymapCase.name, written,
+        expected.size(), wrong, held ? ", a key left held" : "");
+    return ok;
+}
+
+#endif
+
+bool AttachCopy(CKeymap const &keymap, std::vector<uint64_t> &storage, CKeymap &attached)
+{
+    std::vector<uint8_t> image;
+    keymap.WriteImage(image);
+    storage.assign((image.size() + 63) / 8 + 8, 0);
+    uint8_t *start = reinterpret_cast<uint8_t *>(storage.data());
+    start += (64 - reinterpret_cast<uintptr_t>(start) % 64) % 64;
+    memcpy(start, image.data(), image.size());
+    KeymapError error;
+    if (!attached.AttachImage(start, image.size(), &error)) {
+        printf("image: %s\n", error.message);
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    std::vector<std::vector<Edge>> orders;
+    GenerateOrders(orders);
+    std::vector<std::vector<Edge>> scenarios;
+    GenerateScenarios(orders, scenarios);
+
+    bool ok = true;
+    CKeymap plain;
+    for (size_t c = 0; c < sizeof(s_cases) / sizeof(s_cases[0]); ++c) {
+        KeymapCase const &keymapCase = s_cases[c];
+        CKeymap keymap;
+        KeymapError error;
+        if (!keymap.Load(keymapCase.text, strlen(keymapCase.text), nullptr, 0, &error)) {
+            printf("%s, line %u: %s\n", keymapCase.name, error.line, error.message);
+            return 1;
+        }
+        std::vector<Output> expected;
+        ok = CheckResolver(keymapCase, keymap, scenarios, expected) && ok;
+
+        std::vector<uint64_t> storage;
+        CKeymap attached;
+        ok = AttachCopy(keymap, storage, attached) && ok;
+#ifdef BENCH_LINUX_HOOK
+        ok = CheckLinuxHook(keymapCase, attached, scenarios, expected) && ok;
+#endif
+
+        printf("%s, per event: resolver %.1f ns; engine %.1f ns with the keymap, %.1f ns without\n", keymapCase.name,
+            TimeResolver(keymapCase, keymap, scenarios), TimeEngine(keymapCase, keymap, scenarios),
+            TimeEngine(keymapCase, plain, scenarios));
+    }
+    ok = CheckDirected() && ok;
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
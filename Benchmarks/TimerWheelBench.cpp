@@ -0,0 +1,174 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Exercises CTimerWheel on a virtual clock with a large number of concurrent timers and
+   reports the cost of each operation. Built by the CMake build as TimerWheelBench.
+
+   The clock starts just short of a top-level boundary and some timers are set years out,
+   so every level (and the overflow list) gets used. Every callback checks that it ran at
+   exactly its deadline and in order; the program fails if any didn't. */
+#include "TimerWheel.h"
+#include <stdio.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+namespace {
+
+struct BenchState
+{
+    CTimerWheel *wheel;
+    std::vector<uint64_t> deadlines;
+    std::vector<TimerHandle> handles;
+    std::mt19937_64 random;
+    uint64_t lastFired;
+    size_t fired;
+    size_t errors;
+};
+
+BenchState g_state;
+
+void OnTimer(void *context, TimerHandle timer)
+{
+    size_t index = reinterpret_cast<uintptr_t>(context);
+    uint64_t now = g_state.wheel->GetTime();
+    if ((g_state.deadlines[index] != now) || (now < g_state.lastFired)) {
+        if (g_state.errors++ < 10) {
+            printf("Timer %zu due at %llu ran at %llu\n", index,
+                static_cast<unsigned long long>(g_state.deadlines[index]), static_cast<unsigned long long>(now));
+        }
+    }
+    g_state.lastFired = now;
+    ++g_state.fired;
+
+    // A quarter of the timers are periodic, and now and again one cancels another.
+    if (g_state.random() % 4 == 0) {
+        g_state.deadlines[index] = now + 1 + g_state.random() % 100000;
+        g_state.wheel->Rearm(timer, g_state.deadlines[index]);
+    } else {
+        g_state.handles[index] = INVALID_TIMER;
+    }
+    if (g_state.random() % 8 == 0) {
+        size_t victim = g_state.random() % g_state.handles.size();
+        if (g_state.wheel->Cancel(g_state.handles[victim])) {
+            g_state.handles[victim] = INVALID_TIMER;
+        }
+    }
+}
+
+double NanosecondsSince(std::chrono::steady_clock::time_point start, size_t count)
+{
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / static_cast<double>(count ? count : 1);
+}
+
+} // namespace
+
+int main()
+{
+    static size_t const TIMERS = 200000;
+    static uint64_t const START = (1ull << 36) - 5000;
+    static uint64_t const RUN_TIME = 400000;
+
+    CTimerWheel wheel(START);
+    wheel.Reserve(TIMERS);
+    g_state.wheel = &wheel;
+    g_state.deadlines.resize(TIMERS);
+    g_state.handles.resize(TIMERS);
+    g_state.random.seed(7);
+    g_state.lastFired = 0;
+    g_state.fired = 0;
+    g_state.errors = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < TIMERS; ++i) {
+        uint64_t delay = (i % 10 == 0) ? g_state.random() % (1ull << 40) : g_state.random() % 200000;
+        g_state.deadlines[i] = START + 1 + delay;
+        g_state.handles[i] = wheel.Arm(g_state.deadlines[i], OnTimer, reinterpret_cast<void *>(i));
+    }
+    double armTime = NanosecondsSince(start, TIMERS);
+
+    // Drive the wheel the way the app does: wake at the next deadline, sometimes late.
+    start = std::chrono::steady_clock::now();
+    size_t wakeups = 0;
+    while ((wheel.GetTimerCount() > 0) && (wheel.GetTime() < START + RUN_TIME)) {
+        uint64_t now = wheel.GetNextDeadline();
+        if (g_state.random() % 3 == 0) {
+            now += g_state.random() % 50;
+        }
+        wheel.Advance(now);
+        ++wakeups;
+    }
+    double fireTime = NanosecondsSince(start, g_state.fired);
+
+    size_t pending = 0;
+    for (size_t i = 0; i < TIMERS; ++i) {
+        if (wheel.IsArmed(g_state.handles[i])) {
+            ++pending;
+            if (g_state.deadlines[i] <= wheel.GetTime()) {
+                ++g_state.errors;
+            }
+        }
+    }
+    if (pending != wheel.GetTimerCount()) {
+        ++g_state.errors;
+    }
+
+    // Then jump years ahead in one go.
+    wheel.Advance(START + (1ull << 41));
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < TIMERS; ++i) {
+        g_state.handles[i] = wheel.Arm(wheel.GetTime() + 1 + g_state.random() % 1000000, OnTimer, reinterpret_cast<void *>(i));
+    }
+    for (size_t i = 0; i < TIMERS; ++i) {
+        wheel.Rearm(g_state.handles[i], wheel.GetTime() + 1 + g_state.random() % 1000000);
+    }
+    for (size_t i = 0; i < TIMERS; ++i) {
+        if (!wheel.Cancel(g_state.handles[i]) || wheel.Cancel(g_state.handles[i])) {
+            ++g_state.errors;
+        }
+    }
+    double churnTime = NanosecondsSince(start, TIMERS * 3);
+    if ((wheel.GetTimerCount() != 0) || (wheel.GetNextDeadline() != CTimerWheel::NO_DEADLINE)) {
+        ++g_state.errors;
+    }
+
+    printf("%zu timers, %zu fired over %llu virtual ms in %zu wakeups, %llu cascaded\n",
+        TIMERS, g_state.fired, static_cast<unsigned long long>(RUN_TIME), wakeups,
+        static_cast<unsigned long long>(wheel.GetCascadedCount()));
+    printf("arm %.1f ns, fire %.1f ns, arm/rearm/cancel %.1f ns\n", armTime, fireTime, churnTime);
+    if (g_state.errors) {
+        printf("%zu errors\n", g_state.errors);
+        return 1;
+    }
+    return 0;
+}
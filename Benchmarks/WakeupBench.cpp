@@ -0,0 +1,419 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Wakeups: how often the app's main loop wakes up when it has nothing to do, and how much
+   timer slack (see CTimerWheel) saves when it does. It checks that:
+
+     - CTimerWheel::CoalesceDeadline() always lands within the slack, on the roundest
+       time there is in it
+     - on a virtual clock, a handful of periodic timers with slack wake their owner at
+       most half as often as the same timers without, and none fires early or later than
+       its slack allows
+     - on Linux, in a loop built like the daemon's (an epoll set, with a timerfd set for
+       the timer wheel's next deadline) around a real control plane: publishing every
+       CONTROL_INTERVAL wakes it several times a second; tickless, it doesn't wake at all
+       once a publish finds nothing new; a client that posts a command and wakes it has
+       the command run straight away; and the periodic timers above, for real, need
+       fewer wakeups with slack than without
+
+   and reports wakeups per second throughout. Built by the CMake build as WakeupBench. */
+#include "ControlPlane.h"
+#include "TimerWheel.h"
+#include <stdio.h>
+#include <string.h>
+#include <random>
+#include <vector>
+#ifdef __linux__
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <chrono>
+#include <thread>
+#endif
+
+namespace {
+
+unsigned const PERIODIC_TIMERS = 8;
+uint64_t const PERIODIC_SLACK = 50;         // ms
+uint64_t const VIRTUAL_RUN_TIME = 600000;   // ms
+
+/* One of several unrelated periodic timers: an icon reset, a debounce, a hold. */
+struct Periodic
+{
+    CTimerWheel *timers;
+    uint64_t period;
+    uint64_t slack;
+    uint64_t due;       // when it asked to go off
+    size_t early;
+    size_t late;
+};
+
+void OnPeriodic(void *context, TimerHandle timer)
+{
+    Periodic &periodic = *static_cast<Periodic *>(context);
+    uint64_t now = periodic.timers->GetTime();
+    periodic.early += (now < periodic.due) ? 1 : 0;
+    periodic.late += (now > periodic.due + periodic.slack) ? 1 : 0;
+    periodic.due = now + periodic.period;
+    periodic.timers->Rearm(timer, periodic.due, periodic.slack);
+}
+
+void ArmPeriodic(CTimerWheel &timers, std::vector<Periodic> &periodics, uint64_t slack)
+{
+    periodics.resize(PERIODIC_TIMERS);
+    for (unsigned i = 0; i < PERIODIC_TIMERS; ++i) {
+        Periodic &periodic = periodics[i];
+        periodic.timers = &timers;
+        periodic.period = 90 + 13 * i;
+        periodic.slack = slack;
+        periodic.due = timers.GetTime() + 7 + 11 * i;
+        periodic.early = 0;
+        periodic.late = 0;
+        timers.Arm(periodic.due, OnPeriodic, &periodic, slack);
+    }
+}
+
+unsigned TrailingZeros(uint64_t value)
+{
+    unsigned zeros = 0;
+    while ((zeros < 64) && !((value >> zeros) & 1)) {
+        ++zeros;
+    }
+    return zeros;
+}
+
+bool RunCoalesce()
+{
+    std::mt19937_64 random(5);
+    size_t errors = 0;
+    for (unsigned i = 0; i < 200000; ++i) {
+        uint64_t deadline = 1 + random() % 100000000;
+        uint64_t slack = random() % ((i % 2) ? 100 : 5000);
+        uint64_t coalesced = CTimerWheel::CoalesceDeadline(deadline, slack);
+        if ((coalesced < deadline) || (coalesced > deadline + slack)) {
+            ++errors;
+            continue;
+        }
+        // Small slacks are searched whole; for big ones, a sample has to do.
+        unsigned zeros = TrailingZeros(coalesced);
+        for (uint64_t time = deadline; time <= deadline + slack; time += (slack < 200) ? 1 : 1 + random() % 50) {
+            if (TrailingZeros(time) > zeros) {
+                ++errors;
+                break;
+            }
+        }
+    }
+    printf("coalescing: 200000 deadlines with slack, %zu outside it or not the roundest\n", errors);
+    return errors == 0;
+}
+
+/* How many times the owner of a wheel with the periodic timers wakes up in
+   VIRTUAL_RUN_TIME, waking exactly at each next deadline. */
+bool RunVirtual(uint64_t slack, uint64_t &wakeups)
+{
+    CTimerWheel timers(1000);
+    std::vector<Periodic> periodics;
+    ArmPeriodic(timers, periodics, slack);
+    wakeups = 0;
+    for (;;) {
+        uint64_t next = timers.GetNextDeadline();
+        if (next >= 1000 + VIRTUAL_RUN_TIME) {
+            break;
+        }
+        timers.Advance(next);
+        ++wakeups;
+    }
+    size_t early = 0;
+    size_t late = 0;
+    for (size_t i = 0; i < periodics.size(); ++i) {
+        early += periodics[i].early;
+        late += periodics[i].late;
+    }
+    printf("virtual, %u periodic timers, slack %llu ms: %.1f wakeups a second, %zu early, %zu late\n",
+        PERIODIC_TIMERS, static_cast<unsigned long long>(slack), wakeups / (VIRTUAL_RUN_TIME / 1000.0), early, late);
+    return (early == 0) && (late == 0);
+}
+
+#ifdef __linux__
+
+uint64_t NowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + static_cast<uint64_t>(now.tv_nsec) / 1000000;
+}
+
+/* The daemon's main loop, cut down to its timers and the control plane: one epoll set,
+   with a timerfd that's always set for the wheel's next deadline (and only re-set when
+   that moves), and the control plane's wake. Every return from epoll_wait() is a
+   wakeup, but for the timeout that ends a run: a timer for that would be one more in the
+   wheel, and cascade. */
+class CBenchLoop
+{
+public:
+    CBenchLoop() :
+        m_timers(NowMs()),
+        m_epoll(epoll_create1(EPOLL_CLOEXEC)),
+        m_timer(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+        m_programmed(CTimerWheel::NO_DEADLINE),
+        m_ready(nullptr),
+        m_readyContext(nullptr)
+    {
+        Watch(m_timer, 0);
+    }
+
+    ~CBenchLoop()
+    {
+        close(m_timer);
+        close(m_epoll);
+    }
+
+    bool IsOpen() const { return (m_epoll >= 0) && (m_timer >= 0); }
+    CTimerWheel &GetTimers() { return m_timers; }
+
+    void WatchWake(int fd, void (*ready)(void *context), void *context)
+    {
+        m_ready = ready;
+        m_readyContext = context;
+        Watch(fd, 1);
+    }
+
+    /* Run for milliseconds and return the wakeups. */
+    uint64_t Run(uint64_t milliseconds)
+    {
+        uint64_t wakeups = 0;
+        uint64_t end = NowMs() + milliseconds;
+        m_timers.Advance(NowMs());
+        for (uint64_t now = NowMs(); now < end; now = NowMs()) {
+            Program();
+            struct epoll_event events[2];
+            int ready = epoll_wait(m_epoll, events, 2, static_cast<int>(end - now));
+            if (ready <= 0) {
+                continue;
+            }
+            for (int i = 0; i < ready; ++i) {
+                if (events[i].data.u64 == 0) {
+                    uint64_t expirations;
+                    while (read(m_timer, &expirations, sizeof(expirations)) > 0) {
+                    }
+                } else {
+                    m_ready(m_readyContext);
+                }
+            }
+            ++wakeups;
+            m_timers.Advance(NowMs());
+        }
+        return wakeups;
+    }
+
+private:
+    void Watch(int fd, uint64_t tag)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = tag;
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    void Program()
+    {
+        uint64_t deadline = m_timers.GetNextDeadline();
+        if (deadline == m_programmed) {
+            return;
+        }
+        m_programmed = deadline;
+        // All zeros disarms it.
+        struct itimerspec setting;
+        memset(&setting, 0, sizeof(setting));
+        if (deadline != CTimerWheel::NO_DEADLINE) {
+            setting.it_value.tv_sec = static_cast<time_t>(deadline / 1000);
+            setting.it_value.tv_nsec = static_cast<long>(deadline % 1000 * 1000000);
+        }
+        timerfd_settime(m_timer, TFD_TIMER_ABSTIME, &setting, nullptr);
+    }
+
+    CTimerWheel m_timers;
+    int m_epoll;
+    int m_timer;
+    uint64_t m_programmed;
+    void (*m_ready)(void *context);
+    void *m_readyContext;
+};
+
+/* The daemon's RunControlPlane(), without the app behind it. */
+struct ControlModel
+{
+    CBenchLoop *loop;
+    CControlPlane plane;
+    TimerHandle timer;
+    bool tickless;
+    uint64_t activity;  // stands in for the key counts
+    unsigned commands;
+};
+
+void OnControlTimer(void *context, TimerHandle timer);
+
+void RunControl(ControlModel &control, uint64_t now)
+{
+    unsigned command;
+    while (control.plane.PopCommand(command)) {
+        ++control.commands;
+    }
+    CTimerWheel &timers = control.loop->GetTimers();
+    ControlStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.time = now;
+    stats.passed = control.activity;
+    bool changed = control.plane.Publish(stats);
+    if (control.tickless && !changed && control.plane.GetWake().IsOpen()) {
+        timers.Cancel(control.timer);
+        control.timer = INVALID_TIMER;
+        return;
+    }
+    uint64_t deadline = now + CONTROL_INTERVAL;
+    if (!timers.Rearm(control.timer, deadline, CONTROL_SLACK)) {
+        control.timer = timers.Arm(deadline, OnControlTimer, &control, CONTROL_SLACK);
+    }
+}
+
+void OnControlTimer(void *context, TimerHandle)
+{
+    ControlModel &control = *static_cast<ControlModel *>(context);
+    RunControl(control, control.loop->GetTimers().GetTime());
+}
+
+void OnControlWake(void *context)
+{
+    ControlModel &control = *static_cast<ControlModel *>(context);
+    if (control.plane.GetWake().Clear() && (control.timer == INVALID_TIMER)) {
+        RunControl(control, NowMs());
+    }
+}
+
+bool RunLinux()
+{
+    CBenchLoop loop;
+    ControlModel control;
+    control.loop = &loop;
+    control.timer = INVALID_TIMER;
+    control.tickless = false;
+    control.activity = 0;
+    control.commands = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "/captainhook.wakebench.%u", static_cast<unsigned>(getpid()));
+    if (!loop.IsOpen() || !control.plane.Create(name, static_cast<uint64_t>(getpid())) ||
+        !control.plane.GetWake().IsOpen()) {
+        printf("Can't set up the loop or the control plane\n");
+        return false;
+    }
+    loop.WatchWake(control.plane.GetWake().GetFd(), OnControlWake, &control);
+    bool ok = true;
+
+    // Publishing all the time.
+    RunControl(control, NowMs());
+    uint64_t periodic = loop.Run(2000);
+    printf("linux, publishing every %llu ms: %.1f wakeups a second\n",
+        static_cast<unsigned long long>(CONTROL_INTERVAL), periodic / 2.0);
+    ok = ok && (periodic >= 2000 / (CONTROL_INTERVAL + CONTROL_SLACK));
+
+    // Tickless: one more publish that finds nothing new, then nothing at all.
+    control.tickless = true;
+    loop.Run(CONTROL_INTERVAL + CONTROL_SLACK + 50);
+    uint64_t idle = loop.Run(2000);
+    printf("linux, tickless and idle: %.1f wakeups a second\n", idle / 2.0);
+    ok = ok && (idle == 0) && (control.timer == INVALID_TIMER);
+
+    // A client posts a command while it's idle and waits for the app to act on it.
+    uint64_t commandLatency = ~0ull;
+    std::thread client([&name, &commandLatency]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        CControlClient client;
+        uint32_t ticket;
+        if (!client.Open(name) || !client.Post(CONTROL_PAUSE, ticket)) {
+            return;
+        }
+        uint64_t start = NowMs();
+        client.Wake();
+        ControlStats stats;
+        while (NowMs() < start + 1000) {
+            if (client.Read(stats) && (static_cast<int32_t>(static_cast<uint32_t>(stats.commandsDone) - ticket) >= 0)) {
+                commandLatency = NowMs() - start;
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    uint64_t commanded = loop.Run(1000);
+    client.join();
+    printf("linux, tickless, one command: run %llu ms after the client woke the app, %llu wakeups\n",
+        static_cast<unsigned long long>(commandLatency), static_cast<unsigned long long>(commanded));
+    // The wake, then one publish to find that nothing more has changed.
+    ok = ok && (control.commands == 1) && (commandLatency < CONTROL_INTERVAL) && (commanded == 2);
+
+    // Busy with timers of its own, without slack and then with it.
+    uint64_t busy[2];
+    for (unsigned i = 0; i < 2; ++i) {
+        CBenchLoop timerLoop;
+        std::vector<Periodic> periodics;
+        ArmPeriodic(timerLoop.GetTimers(), periodics, i ? PERIODIC_SLACK : 0);
+        busy[i] = timerLoop.Run(2000);
+        printf("linux, %u periodic timers, slack %llu ms: %.1f wakeups a second\n", PERIODIC_TIMERS,
+            static_cast<unsigned long long>(i ? PERIODIC_SLACK : 0), busy[i] / 2.0);
+    }
+    // Less clear-cut than on the virtual clock: each timer drifts by however late it ran.
+    ok = ok && (busy[1] * 3 <= busy[0] * 2);
+    control.plane.Close();
+    return ok;
+}
+
+#endif
+
+} // namespace
+
+int main()
+{
+    bool ok = RunCoalesce();
+    uint64_t exact;
+    uint64_t coalesced;
+    ok = RunVirtual(0, exact) && ok;
+    ok = RunVirtual(PERIODIC_SLACK, coalesced) && ok;
+    ok = ok && (coalesced * 2 <= exact);
+#ifdef __linux__
+    ok = RunLinux() && ok;
+#endif
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,328 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* The hook watchdog (CHookWatchdog). It checks that:
+
+     - on a virtual clock, with a model of Windows that takes the hook away whenever a
+       callback overruns LowLevelHooksTimeout (and now and again for no reason at all),
+       every loss is noticed by the heartbeat and the hook registered again, within a
+       probe timeout of an overrun and a probe interval plus a timeout of a silent loss,
+       and a hook that's still there is never taken for lost; and the same without idle
+       probing, where a silent loss while idle is only looked for when the user is back
+     - while the watchdog is shedding, CAppController holds icon changes back and shows
+       only the last of them once the hook has been clear of its budget for SHED_HOLD
+     - on Linux, through the daemon's CLinuxKeyboardHook with an action handler that is
+       really slow, the keys queued up behind it are counted near or over the budget
+       exactly when the handler's delay says they should be
+
+   and reports what the watchdog costs the hook per key. Built by the CMake build as
+   WatchdogBench. */
+#include "AppActions.h"
+#include "AppController.h"
+#include "BenchSupport.h"
+#include "HookWatchdog.h"
+#include "KeyEngine.h"
+#include "LatencyHistogram.h"
+#include "OutputEngine.h"
+#include "TimerWheel.h"
+#include <stdio.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#ifdef BENCH_LINUX_HOOK
+#include <fcntl.h>
+#include "LinuxKeyboardHook.h"
+#include "UinputOutput.h"
+#endif
+
+namespace {
+
+uint64_t const HEARTBEAT_RUN_TIME = 4 * 3600 * 1000;  // ms of virtual time
+size_t const OVERHEAD_CALLS = 10000000;
+
+/* Windows, as far as the hook is concerned. */
+struct HookModel
+{
+    bool installed;
+    uint64_t lostAt;        // when it was taken away
+    bool lostByOverrun;
+    bool probeInFlight;     // a probe the hook will see on the next millisecond
+};
+
+bool RunHeartbeat(bool idleProbing)
+{
+    CHookWatchdog watchdog;
+    watchdog.SetIdleProbing(idleProbing);
+    HookModel hook = { true, 0, false, false };
+    std::mt19937 random(17);
+    size_t removals = 0;
+    size_t silentRemovals = 0;
+    size_t errors = 0;
+    uint64_t worstOverrunDetection = 0;
+    uint64_t worstSilentDetection = 0;
+    bool pollNow = true;
+    bool typing = true;
+    uint64_t phaseEnd = 0;
+
+    for (uint64_t now = 1; now < HEARTBEAT_RUN_TIME; ++now) {
+        // Spells of typing, a key every 150 ms or so, between idle spells of up to a minute.
+        if (now >= phaseEnd) {
+            typing = !typing;
+            phaseEnd = now + (typing ? 2000 + random() % 20000 : 1000 + random() % 60000);
+            // The user coming back moves the focus, say; a loss while they were away can
+            // only be noticed from then on.
+            if (typing && !idleProbing) {
+                pollNow = watchdog.RequestProbe() || pollNow;
+                if (!hook.installed && !hook.lostByOverrun && (hook.lostAt < now)) {
+                    hook.lostAt = now;
+                }
+            }
+        }
+
+        if (hook.installed && hook.probeInFlight) {
+            hook.probeInFlight = false;
+            watchdog.ProbeReceived();
+        }
+        if (typing && (random() % 150 == 0) && hook.installed) {
+            // Mostly quick; now and then the thread was busy and the key waited.
+            unsigned kind = random() % 2000;
+            uint32_t wait = (kind < 4) ? 150 + random() % 140 : (kind < 5) ? 320 + random() % 200 : random() % 3;
+            uint64_t overruns = watchdog.GetOverrunCount();
+            pollNow = watchdog.RecordCallback(now, static_cast<uint32_t>(now - wait), 20000) || pollNow;
+            bool overrun = (watchdog.GetOverrunCount() != overruns);
+            if (overrun != (wait >= watchdog.GetBudget())) {
+                ++errors;
+            }
+            if (overrun) {
+                hook.installed = false;
+                hook.lostAt = now;
+                hook.lostByOverrun = true;
+                ++removals;
+            }
+        }
+        if (hook.installed && (random() % 1000000 == 0)) {
+            hook.installed = false;
+            hook.lostAt = now;
+            hook.lostByOverrun = false;
+            ++removals;
+            ++silentRemovals;
+        }
+
+        if (!pollNow && (now < watchdog.GetNextDeadline())) {
+            continue;
+        }
+        pollNow = false;
+        unsigned result;
+        while ((result = watchdog.Poll(now)) != CHookWatchdog::POLL_IDLE) {
+            if (result == CHookWatchdog::POLL_SEND_PROBE) {
+                hook.probeInFlight = true;
+                watchdog.ProbeSent(now, true);
+                continue;
+            }
+            if (hook.installed) {
+                if (errors++ < 10) {
+                    printf("At %llu ms the hook was taken for lost, but it's there\n", static_cast<unsigned long long>(now));
+                }
+            } else {
+                uint64_t delay = now - hook.lostAt;
+                uint64_t &worst = hook.lostByOverrun ? worstOverrunDetection : worstSilentDetection;
+                worst = (delay > worst) ? delay : worst;
+            }
+            hook.installed = true;
+            hook.probeInFlight = false;
+            watchdog.HookRegistered(now, true);
+        }
+    }
+
+    uint64_t overrunBound = watchdog.GetProbeTimeout() + 1;
+    uint64_t silentBound = CHookWatchdog::PROBE_INTERVAL + watchdog.GetProbeTimeout() + 1;
+    bool ok = (errors == 0) && hook.installed &&
+        (watchdog.GetHookLostCount() == removals) && (watchdog.GetRegistrationCount() == removals) &&
+        (worstOverrunDetection <= overrunBound) && (worstSilentDetection <= silentBound);
+    printf("heartbeat%s, %.0f h virtual: %llu callbacks, %llu near budget, %llu overruns, %zu silent losses\n",
+        idleProbing ? "" : " without idle probing",
+        HEARTBEAT_RUN_TIME / 3600000.0, static_cast<unsigned long long>(watchdog.GetCallbackCount()),
+        static_cast<unsigned long long>(watchdog.GetNearBudgetCount()),
+        static_cast<unsigned long long>(watchdog.GetOverrunCount()), silentRemovals);
+    printf("  %llu probes (%.1f a minute), %llu losses found of %zu, %llu re-registrations\n",
+        static_cast<unsigned long long>(watchdog.GetProbeCount()),
+        watchdog.GetProbeCount() / (HEARTBEAT_RUN_TIME / 60000.0),
+        static_cast<unsigned long long>(watchdog.GetHookLostCount()), removals,
+        static_cast<unsigned long long>(watchdog.GetRegistrationCount()));
+    printf("  worst time to notice: %llu ms after an overrun (bound %llu), %llu ms after a silent loss (bound %llu)\n",
+        static_cast<unsigned long long>(worstOverrunDetection), static_cast<unsigned long long>(overrunBound),
+        static_cast<unsigned long long>(worstSilentDetection), static_cast<unsigned long long>(silentBound));
+    return ok;
+}
+
+bool RunShedding()
+{
+    CKeyEngine engine;
+    CNullSink sink;
+    COutputEngine output(sink);
+    CTimerWheel timers(1000);
+    CRecordingFrontend frontend(&timers);
+    CAppController controller(engine, output, timers, frontend);
+    CHookWatchdog watchdog;
+    controller.SetWatchdog(&watchdog);
+
+    KeyEvent fish = { 0, ACTION_SHOW_FISH, 'A', KeyEvent::FLAG_DOWN };
+    KeyEvent hook = { 0, ACTION_SHOW_HOOK, 'A', 0 };
+
+    // Not shedding: straight through.
+    controller.HandleKeyEvent(fish, 1000);
+    // A key waited 200 ms of the 300: shed until 3100, then 4600 after another at 2600.
+    watchdog.RecordCallback(1100, 900, 0);
+    timers.Advance(1200);
+    controller.HandleKeyEvent(hook, 1200);
+    timers.Advance(1300);
+    controller.HandleKeyEvent(fish, 1300);
+    timers.Advance(2600);
+    watchdog.RecordCallback(2600, 2400, 0);
+    controller.HandleKeyEvent(hook, 2600);
+    timers.Advance(4599);
+    size_t heldBack = frontend.m_icons.size();
+    timers.Advance(5000);
+
+    bool ok = (heldBack == 1) && (frontend.m_icons.size() == 2) &&
+        (frontend.m_icons[1].time == 4600) && (frontend.m_icons[1].icon == ICON_HOOK) &&
+        (watchdog.GetShedCount() == 3) && (watchdog.GetShedEpisodeCount() == 1);
+    printf("shedding: %llu icon changes held back, the last shown at %llu ms (expected 4600)\n",
+        static_cast<unsigned long long>(watchdog.GetShedCount()),
+        static_cast<unsigned long long>((frontend.m_icons.size() > 1) ? frontend.m_icons[1].time : 0));
+    return ok;
+}
+
+double MeasureOverhead()
+{
+    CHookWatchdog watchdog;
+    uint64_t start = LatencyClockNow();
+    for (size_t i = 0; i < OVERHEAD_CALLS; ++i) {
+        watchdog.RecordCallback(1000 + i / 100, static_cast<uint32_t>(1000 + i / 100), 15000);
+    }
+    uint64_t elapsed = LatencyClockToNanoseconds(LatencyClockNow() - start);
+    return static_cast<double>(elapsed) / OVERHEAD_CALLS;
+}
+
+#ifdef BENCH_LINUX_HOOK
+
+unsigned g_handlerDelay;    // ms the next action spends, busy
+
+void SlowActionHandler(void *context, KeyEvent const &event)
+{
+    (void)context;
+    if (!(event.flags & KeyEvent::FLAG_DOWN)) {
+        return;
+    }
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(g_handlerDelay);
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+struct input_event MakeEvent(uint64_t time, uint16_t code, int32_t value)
+{
+    struct input_event event;
+    event.time.tv_sec = static_cast<time_t>(time / 1000);
+    event.time.tv_usec = static_cast<suseconds_t>(time % 1000 * 1000);
+    event.type = EV_KEY;
+    event.code = code;
+    event.value = value;
+    return event;
+}
+
+bool RunLinuxHook()
+{
+    static uint32_t const BUDGET = 20;
+    static unsigned const delays[] = { 0, 4, 13, 26 };  // fine, fine, near, over
+    static unsigned const ROUNDS = 40;
+
+    CKeymap keymap;
+    char const text[] = "*+F1 press=stats\n";
+    KeymapError error;
+    if (!keymap.Load(text, sizeof(text) - 1, g_actionNames, g_actionNameCount, &error)) {
+        printf("line %u: %s\n", error.line, error.message);
+        return false;
+    }
+    CKeyEngine engine;
+    engine.SetKeymap(&keymap);
+    CUinputOutput output;
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if ((fd < 0) || !output.Attach(fd)) {
+        printf("Can't open /dev/null\n");
+        return false;
+    }
+    CLinuxKeyboardHook hook(engine, output);
+    hook.SetActionHandler(SlowActionHandler, nullptr);
+    CHookWatchdog watchdog;
+    watchdog.SetBudget(BUDGET);
+    hook.SetWatchdog(&watchdog);
+
+    // F1 runs the slow action as it goes down; its release and the A typed straight after
+    // it wait behind it in the same batch.
+    unsigned expectedNear = 0;
+    unsigned expectedOver = 0;
+    for (unsigned round = 0; round < ROUNDS; ++round) {
+        g_handlerDelay = delays[round % 4];
+        expectedNear += (round % 4 == 2) ? 3 : 0;
+        expectedOver += (round % 4 == 3) ? 3 : 0;
+        uint64_t now = CLinuxKeyboardHook::GetTime();
+        struct input_event events[] = {
+            MakeEvent(now, KEY_F1, 1), MakeEvent(now, KEY_F1, 0), MakeEvent(now, KEY_A, 1), MakeEvent(now, KEY_A, 0),
+        };
+        hook.OnInputEvents(events, sizeof(events) / sizeof(events[0]));
+    }
+
+    bool ok = (watchdog.GetNearBudgetCount() == expectedNear) && (watchdog.GetOverrunCount() == expectedOver);
+    printf("linux hook, %u ms budget, slow handler: %llu near budget (expected %u), %llu over (expected %u), worst %.1f ms\n",
+        BUDGET, static_cast<unsigned long long>(watchdog.GetNearBudgetCount()), expectedNear,
+        static_cast<unsigned long long>(watchdog.GetOverrunCount()), expectedOver, watchdog.GetWorstCallback() / 1e6);
+    return ok;
+}
+
+#endif
+
+} // namespace
+
+int main()
+{
+    bool ok = RunHeartbeat(true);
+    ok = RunHeartbeat(false) && ok;
+    ok = RunShedding() && ok;
+#ifdef BENCH_LINUX_HOOK
+    ok = RunLinuxHook() && ok;
+#endif
+    printf("RecordCallback: %.1f ns a key\n", MeasureOverhead());
+    if (!ok) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,273 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "ActionExecutor.h"
+
+CActionExecutor::CActionExecutor() :
+    m_wake(nullptr),
+    m_wakeContext(nullptr),
+    m_running(false),
+    m_stopping(false),
+    m_readyHead(0),
+    m_readyCount(0),
+    m_completionHead(0),
+    m_completionCount(0),
+    m_wakePending(false),
+    m_submittedCount(0),
+    m_completedCount(0),
+    m_mergedCount(0),
+    m_droppedCount(0),
+    m_lostCompletionCount(0),
+    m_workerCount(0)
+{
+    for (size_t i = 0; i < MAX_ACTIONS; ++i) {
+        Action &action = m_actions[i];
+        action.worker = nullptr;
+        action.policy = POLICY_DROP_NEWEST;
+        action.limit = 0;
+        action.head = 0;
+        action.count = 0;
+        action.running = false;
+        action.ready = false;
+    }
+}
+
+CActionExecutor::~CActionExecutor()
+{
+    Stop();
+}
+
+bool CActionExecutor::SetWorker(uint16_t action, IActionWorker *worker, size_t queueLimit, unsigned policy)
+{
+    if (m_running || (action >= MAX_ACTIONS) || (queueLimit == 0)) {
+        return false;
+    }
+    Action &entry = m_actions[action];
+    entry.worker = worker;
+    entry.policy = policy;
+    // A coalescing action only ever has the one job waiting.
+    entry.limit = (policy & POLICY_COALESCE) ? 1 : queueLimit;
+    entry.jobs.assign(entry.limit, Job());
+    entry.head = 0;
+    entry.count = 0;
+    return true;
+}
+
+void CActionExecutor::SetWakeFunction(WakeFunction wake, void *context)
+{
+    m_wake = wake;
+    m_wakeContext = context;
+}
+
+bool CActionExecutor::Start(unsigned workerCount)
+{
+    if (m_running || (workerCount == 0) || (workerCount > MAX_WORKERS)) {
+        return false;
+    }
+    m_stopping = false;
+    m_running = true;
+    for (m_workerCount = 0; m_workerCount < workerCount; ++m_workerCount) {
+        m_workers[m_workerCount] = std::thread(&CActionExecutor::Run, this);
+    }
+    return true;
+}
+
+void CActionExecutor::Stop()
+{
+    if (!m_running) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stopping = true;
+    }
+    m_workAvailable.notify_all();
+    for (unsigned i = 0; i < m_workerCount; ++i) {
+        m_workers[i].join();
+    }
+    m_workerCount = 0;
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    for (size_t i = 0; i < MAX_ACTIONS; ++i) {
+        m_actions[i].count = 0;
+        m_actions[i].ready = false;
+    }
+    m_readyCount = 0;
+    m_running = false;
+}
+
+unsigned CActionExecutor::Submit(KeyEvent const &event)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (!m_running || m_stopping || !IsHandled(event.action)) {
+        return SUBMIT_NOT_HANDLED;
+    }
+    ++m_submittedCount;
+    Action &action = m_actions[event.action];
+
+    if ((action.policy & POLICY_COALESCE) && (action.count > 0)) {
+        Job &newest = action.jobs[(action.head + action.count - 1) % action.limit];
+        newest.event = event;
+        ++newest.merged;
+        ++m_mergedCount;
+        return SUBMIT_MERGED;
+    }
+
+    unsigned result = SUBMIT_QUEUED;
+    if (action.count == action.limit) {
+        ++m_droppedCount;
+        if (!(action.policy & POLICY_DROP_OLDEST)) {
+            return SUBMIT_DROPPED;
+        }
+        action.head = (action.head + 1) % action.limit;
+        --action.count;
+        result = SUBMIT_DROPPED;
+    }
+    Job &job = action.jobs[(action.head + action.count) % action.limit];
+    job.event = event;
+    job.merged = 0;
+    ++action.count;
+
+    if (!action.running && !action.ready) {
+        MakeReady(event.action);
+        lock.unlock();
+        m_workAvailable.notify_one();
+    }
+    return result;
+}
+
+bool CActionExecutor::PopCompletion(ActionCompletion &completion)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_completionCount == 0) {
+        m_wakePending = false;
+        return false;
+    }
+    completion = m_completions[m_completionHead];
+    m_completionHead = (m_completionHead + 1) % COMPLETION_CAPACITY;
+    --m_completionCount;
+    return true;
+}
+
+uint64_t CActionExecutor::GetSubmittedCount() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_submittedCount;
+}
+
+uint64_t CActionExecutor::GetCompletedCount() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_completedCount;
+}
+
+uint64_t CActionExecutor::GetMergedCount() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_mergedCount;
+}
+
+uint64_t CActionExecutor::GetDroppedCount() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_droppedCount;
+}
+
+uint64_t CActionExecutor::GetLostCompletionCount() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_lostCompletionCount;
+}
+
+void CActionExecutor::Run()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    for (;;) {
+        m_workAvailable.wait(lock, [this] { return m_stopping || (m_readyCount > 0); });
+        if (m_stopping) {
+            return;
+        }
+
+        uint16_t id = m_ready[m_readyHead];
+        m_readyHead = (m_readyHead + 1) % MAX_ACTIONS;
+        --m_readyCount;
+        Action &action = m_actions[id];
+        action.ready = false;
+        Job job = action.jobs[action.head];
+        action.head = (action.head + 1) % action.limit;
+        --action.count;
+        action.running = true;
+
+        lock.unlock();
+        int status = action.worker->RunAction(job.event);
+        lock.lock();
+
+        action.running = false;
+        if (action.count > 0) {
+            // This worker comes straight back for it unless another gets there first.
+            MakeReady(id);
+        }
+        Complete(job, status);
+        if (!m_wakePending && (m_completionCount > 0)) {
+            m_wakePending = true;
+            if (m_wake) {
+                lock.unlock();
+                bool woken = m_wake(m_wakeContext);
+                lock.lock();
+                if (!woken) {
+                    m_wakePending = false;
+                }
+            }
+        }
+    }
+}
+
+void CActionExecutor::MakeReady(uint16_t action)
+{
+    m_ready[(m_readyHead + m_readyCount) % MAX_ACTIONS] = action;
+    ++m_readyCount;
+    m_actions[action].ready = true;
+}
+
+void CActionExecutor::Complete(Job const &job, int status)
+{
+    ++m_completedCount;
+    if (m_completionCount == COMPLETION_CAPACITY) {
+        // Nobody's collecting them; the work is done regardless.
+        ++m_lostCompletionCount;
+        return;
+    }
+    ActionCompletion &completion = m_completions[(m_completionHead + m_completionCount) % COMPLETION_CAPACITY];
+    completion.event = job.event;
+    completion.status = status;
+    completion.merged = job.merged;
+    ++m_completionCount;
+}
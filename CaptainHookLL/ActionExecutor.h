@@ -0,0 +1,183 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "KeyEvent.h"
+
+/* Does the work for one kind of action, on one of the executor's worker threads. */
+class IActionWorker
+{
+public:
+    virtual ~IActionWorker() {}
+
+    /* Returns a status for the completion (0 for success; anything else is up to the
+       worker). May take as long as it likes, but the executor can't stop until it does. */
+    virtual int RunAction(KeyEvent const &event) = 0;
+};
+
+/* A job the executor has finished, handed back to the thread that submitted it. */
+struct ActionCompletion
+{
+    KeyEvent event;     // The (last, if merged) event that asked for the job
+    int status;         // From IActionWorker::RunAction
+    uint32_t merged;    // How many later requests were merged into this one
+};
+
+/* Runs the actions that do real work (starting a process, writing a file) on a small pool
+   of worker threads, so that the thread handling keys never waits for them.
+
+   Each action has its own bounded queue, and its jobs run one at a time and in order,
+   while different actions run side by side. A coalescing action never has more than one
+   job waiting: a request that arrives while one is waiting is merged into it (think of a
+   key held down asking for the same save over and over). When a queue is full, the new
+   request is dropped, or the oldest waiting one is, depending on the action's policy.
+
+   Submit() never waits for a worker; it only takes the executor's lock, which workers
+   hold just long enough to take a job or hand one back. Finished jobs queue up as
+   completions for the submitting thread to collect with PopCompletion(), and the wake
+   callback tells it when there are some (for example by posting a window message). */
+class CActionExecutor
+{
+public:
+    enum policies {
+        POLICY_DROP_NEWEST = 0,     // When full, drop the request being submitted
+        POLICY_DROP_OLDEST = 1,     // When full, drop the oldest waiting request
+        POLICY_COALESCE = 2,        // Merge into a waiting request (only ever one waits)
+    };
+
+    enum submit_results {
+        SUBMIT_QUEUED,
+        SUBMIT_MERGED,
+        SUBMIT_DROPPED,             // The request itself or, with POLICY_DROP_OLDEST, an older one
+        SUBMIT_NOT_HANDLED,         // No worker for the action, or not running
+    };
+
+    static size_t const MAX_ACTIONS = 64;
+    static size_t const MAX_WORKERS = 8;
+    static size_t const COMPLETION_CAPACITY = 256;
+
+    /* Returns false if the wake-up couldn't be delivered, so the next completion tries
+       again. */
+    typedef bool (*WakeFunction)(void *context);
+
+    CActionExecutor();
+    ~CActionExecutor();
+
+    /* Before Start() only. queueLimit is the most jobs that can wait for the action (not
+       counting one that's running). */
+    bool SetWorker(uint16_t action, IActionWorker *worker, size_t queueLimit, unsigned policy);
+
+    /* Called from a worker thread when completions become available after
+       PopCompletion() has found none. */
+    void SetWakeFunction(WakeFunction wake, void *context);
+
+    bool Start(unsigned workerCount);
+
+    /* Let running jobs finish, throw away waiting ones and join the workers. Completions
+       not yet collected stay collectable. */
+    void Stop();
+
+    bool IsHandled(uint16_t action) const { return (action < MAX_ACTIONS) && (m_actions[action].worker != nullptr); }
+
+    unsigned Submit(KeyEvent const &event);
+
+    /* Returns false once there are none left; the next completion calls the wake function
+       again. */
+    bool PopCompletion(ActionCompletion &completion);
+
+    /* Totals since Start(). Submitted counts every call for a handled action; each ends up
+       completed, merged or dropped (or still waiting). */
+    uint64_t GetSubmittedCount() const;
+    uint64_t GetCompletedCount() const;
+    uint64_t GetMergedCount() const;
+    uint64_t GetDroppedCount() const;
+    uint64_t GetLostCompletionCount() const;
+
+private:
+    CActionExecutor(CActionExecutor const &) = delete;
+    CActionExecutor &operator=(CActionExecutor const &) = delete;
+
+    struct Job
+    {
+        KeyEvent event;
+        uint32_t merged;
+    };
+
+    struct Action
+    {
+        IActionWorker *worker;
+        unsigned policy;
+        size_t limit;
+        std::vector<Job> jobs;      // Ring of limit entries, allocated by SetWorker()
+        size_t head;                // Oldest waiting job
+        size_t count;               // Waiting jobs
+        bool running;               // A worker has one of its jobs
+        bool ready;                 // On m_ready
+    };
+
+    void Run();
+    void MakeReady(uint16_t action);
+    void Complete(Job const &job, int status);
+
+    Action m_actions[MAX_ACTIONS];
+    WakeFunction m_wake;
+    void *m_wakeContext;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_workAvailable;
+    bool m_running;
+    bool m_stopping;
+
+    // Actions with waiting jobs and nothing running, in the order they became ready.
+    uint16_t m_ready[MAX_ACTIONS];
+    size_t m_readyHead;
+    size_t m_readyCount;
+
+    ActionCompletion m_completions[COMPLETION_CAPACITY];
+    size_t m_completionHead;
+    size_t m_completionCount;
+    bool m_wakePending;
+
+    uint64_t m_submittedCount;
+    uint64_t m_completedCount;
+    uint64_t m_mergedCount;
+    uint64_t m_droppedCount;
+    uint64_t m_lostCompletionCount;
+
+    std::thread m_workers[MAX_WORKERS];
+    unsigned m_workerCount;
+};
@@ -0,0 +1,54 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "AppActions.h"
+
+KeymapActionName const g_actionNames[] = {
+    { "hook", ACTION_SHOW_HOOK },
+    { "fish", ACTION_SHOW_FISH },
+    { "bait", ACTION_SHOW_BAIT },
+    { "stats", ACTION_SAVE_STATISTICS },
+    { "script", ACTION_RUN_SCRIPT },
+    { "plugin", ACTION_PLUGIN },
+};
+
+size_t const g_actionNameCount = sizeof(g_actionNames) / sizeof(g_actionNames[0]);
+
+char const g_defaultKeymap[] =
+    "# Show the fish while 'A' is held and the bare hook once it's released.\n"
+    "*+A        press=fish release=hook\n"
+    "# Show the bait when 'B' is released, then go back to the bare hook a little later.\n"
+    "*+B        release=bait\n"
+    "# Swallow Page Up and Page Down without doing anything else.\n"
+    "*+PageUp\n"
+    "*+PageDown\n";
+
+size_t const g_defaultKeymapLength = sizeof(g_defaultKeymap) - 1;
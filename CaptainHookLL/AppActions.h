@@ -0,0 +1,79 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "CaptainHookPlugin.h"
+#include "Keymap.h"
+
+/* Actions that keymap bindings can trigger. Every frontend (the Windows tray app and the
+   Linux daemon) understands the same actions and loads the same keymaps.
+
+   ACTION_SAVE_STATISTICS writes the statistics file and ACTION_RUN_SCRIPT runs the
+   frontend's script with the key code and "press" or "release" as its arguments. Both
+   run on a CActionExecutor worker, never on the thread handling keys. ACTION_PLUGIN is
+   left to handler plugins (see CaptainHookPlugin.h), which tell keys bound to it apart by
+   their key codes. */
+enum app_actions {
+    ACTION_NONE = KEYMAP_ACTION_NONE,
+    ACTION_SHOW_HOOK,
+    ACTION_SHOW_FISH,
+    ACTION_SHOW_BAIT,
+    ACTION_SAVE_STATISTICS,
+    ACTION_RUN_SCRIPT,
+    ACTION_PLUGIN,
+};
+
+static_assert(ACTION_PLUGIN == CAPTAINHOOK_ACTION_PLUGIN, "The plugin action is part of the plugin ABI");
+
+/* The icons the actions above show. Each frontend has its own way of showing them. */
+enum app_icons {
+    ICON_HOOK,
+    ICON_FISH,
+    ICON_BAIT,
+    ICON_COUNT
+};
+
+/* How long ACTION_SHOW_BAIT shows the bait before going back to the bare hook, in ms. */
+static uint64_t const BAIT_DURATION = 250;
+
+/* The executor queues for the actions above that do real work: statistics requests that
+   arrive while one is waiting are merged into it, and at most SCRIPT_QUEUE_LIMIT script
+   runs wait, after which further ones are dropped. */
+static size_t const SCRIPT_QUEUE_LIMIT = 8;
+
+extern KeymapActionName const g_actionNames[];
+extern size_t const g_actionNameCount;
+
+/* Used when there's no keymap file. See Keymap.h for the format. */
+extern char const g_defaultKeymap[];
+extern size_t const g_defaultKeymapLength;
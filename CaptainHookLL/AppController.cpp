@@ -0,0 +1,200 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "AppController.h"
+#include "AppActions.h"
+
+CAppController::CAppController(CKeyEngine &engine, COutputEngine &output, CTimerWheel &timers, IAppFrontend &frontend) :
+    m_engine(engine),
+    m_output(output),
+    m_timers(timers),
+    m_frontend(frontend),
+    m_watchdog(nullptr),
+    m_now(0),
+    m_sequenceTimer(INVALID_TIMER),
+    m_outputTimer(INVALID_TIMER),
+    m_baitTimer(INVALID_TIMER),
+    m_shedTimer(INVALID_TIMER),
+    m_heldIcon(0)
+{
+    uint64_t const everyKey[4] = { ~0ull, ~0ull, ~0ull, ~0ull };
+    m_bus.Add("app", CAPTAINHOOK_PRIORITY_APP, everyKey, OnAppEvent, this);
+}
+
+void CAppController::HandleKeyEvent(KeyEvent const &event, uint64_t now)
+{
+    m_now = now;
+    m_bus.Dispatch(event);
+}
+
+bool CAppController::HandleAction(KeyEvent const &event)
+{
+    uint64_t now = m_now;
+
+    /* This runs after the hook has already decided whether to swallow the key.
+       event.action says which keymap action the key (or sequence) triggered. If you care
+       whether ALT was held, check event.flags for KeyEvent::FLAG_SYSTEM. */
+    switch (event.action) {
+    case ACTION_SHOW_HOOK:
+        ShowIcon(ICON_HOOK, now);
+        break;
+
+    case ACTION_SHOW_FISH:
+        /* Press actions run only on the transition from released to held, not on every
+           autorepeat, unless the binding says "repeat" (and then event.flags includes
+           KeyEvent::FLAG_REPEAT for the repeats). */
+        ShowIcon(ICON_FISH, now);
+        break;
+
+    case ACTION_SHOW_BAIT: {
+        /* This demonstrates an action that sets a timer to clear itself a fixed time
+           later. The timer is extended every time the action runs. */
+        ShowIcon(ICON_BAIT, now);
+        uint64_t deadline = now + BAIT_DURATION;
+        if (!m_timers.Rearm(m_baitTimer, deadline)) {
+            m_baitTimer = m_timers.Arm(deadline, OnBaitTimer, this);
+        }
+        break;
+    }
+
+    case ACTION_NONE:
+    case ACTION_PLUGIN:
+        /* For the handlers after this one, if any. */
+        return false;
+
+    default:
+        /* Macros are typed from this thread; anything else that's bound does real work,
+           off it. */
+        if (IsKeymapMacro(event.action)) {
+            m_output.QueueMacro(event.action);
+            ScheduleOutput(now);
+        } else {
+            m_frontend.SubmitAction(event);
+        }
+        break;
+    }
+    return true;
+}
+
+void CAppController::ScheduleSequenceTimeout(uint64_t now)
+{
+    /* The engine works in the 32-bit millisecond timestamps of the key events. */
+    uint32_t deadline;
+    if (!m_engine.GetSequenceDeadline(deadline)) {
+        m_timers.Cancel(m_sequenceTimer);
+        m_sequenceTimer = INVALID_TIMER;
+        return;
+    }
+    int32_t delay = static_cast<int32_t>(deadline - static_cast<uint32_t>(now));
+    uint64_t when = now + ((delay > 0) ? delay : 0);
+    if (!m_timers.Rearm(m_sequenceTimer, when)) {
+        m_sequenceTimer = m_timers.Arm(when, OnSequenceTimer, this);
+    }
+}
+
+void CAppController::ScheduleOutput(uint64_t now)
+{
+    uint64_t next = m_output.Flush(now);
+    if (next == COutputEngine::NO_DEADLINE) {
+        m_timers.Cancel(m_outputTimer);
+        m_outputTimer = INVALID_TIMER;
+    } else if (!m_timers.Rearm(m_outputTimer, next)) {
+        m_outputTimer = m_timers.Arm(next, OnOutputTimer, this);
+    }
+}
+
+void CAppController::ShowIcon(unsigned icon, uint64_t now)
+{
+    /* The tray icon goes through Shell_NotifyIcon(), which waits on Explorer: not
+       something to do on the hook's thread while the hook is running out of time. */
+    if (m_watchdog && m_watchdog->IsShedding(now)) {
+        m_watchdog->CountShed();
+        m_heldIcon = icon;
+        if (m_shedTimer == INVALID_TIMER) {
+            m_shedTimer = m_timers.Arm(m_watchdog->GetShedEnd(), OnShedTimer, this);
+        }
+        return;
+    }
+    if (m_shedTimer != INVALID_TIMER) {
+        m_timers.Cancel(m_shedTimer);
+        m_shedTimer = INVALID_TIMER;
+    }
+    m_frontend.ShowIcon(icon);
+}
+
+int CAppController::OnAppEvent(void *context, CaptainHookEvent const *event)
+{
+    KeyEvent action;
+    action.time = event->time;
+    action.action = event->action;
+    action.keycode = event->keycode;
+    action.flags = event->flags;
+    return static_cast<CAppController *>(context)->HandleAction(action) ? 1 : 0;
+}
+
+void CAppController::OnSequenceTimer(void *context, TimerHandle timer)
+{
+    (void)timer;
+    CAppController *controller = static_cast<CAppController *>(context);
+    uint64_t now = controller->m_timers.GetTime();
+    controller->m_sequenceTimer = INVALID_TIMER;
+    controller->m_frontend.ProcessTimeout(static_cast<uint32_t>(now));
+    controller->ScheduleSequenceTimeout(now);
+}
+
+void CAppController::OnOutputTimer(void *context, TimerHandle timer)
+{
+    (void)timer;
+    CAppController *controller = static_cast<CAppController *>(context);
+    controller->m_outputTimer = INVALID_TIMER;
+    controller->ScheduleOutput(controller->m_timers.GetTime());
+}
+
+void CAppController::OnBaitTimer(void *context, TimerHandle timer)
+{
+    (void)timer;
+    CAppController *controller = static_cast<CAppController *>(context);
+    controller->m_baitTimer = INVALID_TIMER;
+    controller->ShowIcon(ICON_HOOK, controller->m_timers.GetTime());
+}
+
+void CAppController::OnShedTimer(void *context, TimerHandle timer)
+{
+    CAppController *controller = static_cast<CAppController *>(context);
+    uint64_t now = controller->m_timers.GetTime();
+    if (controller->m_watchdog->IsShedding(now)) {
+        // Another slow callback has put the end off.
+        controller->m_timers.Rearm(timer, controller->m_watchdog->GetShedEnd());
+        return;
+    }
+    controller->m_shedTimer = INVALID_TIMER;
+    controller->m_frontend.ShowIcon(controller->m_heldIcon);
+}
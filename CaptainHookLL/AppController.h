@@ -0,0 +1,115 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stdint.h>
+#include "EventBus.h"
+#include "HookWatchdog.h"
+#include "KeyEngine.h"
+#include "KeyEvent.h"
+#include "OutputEngine.h"
+#include "TimerWheel.h"
+
+/* What CAppController needs the frontend (the tray app, the daemon or a simulation) to
+   do for it. All called on the thread that runs the controller. */
+class IAppFrontend
+{
+public:
+    virtual ~IAppFrontend() {}
+
+    /* Show one of the app_icons icons. */
+    virtual void ShowIcon(unsigned icon) = 0;
+
+    /* Run an action that does real work (see AppActions.h), off this thread. */
+    virtual void SubmitAction(KeyEvent const &event) = 0;
+
+    /* The engine's sequence deadline has passed: call its ProcessTimeout() and handle
+       whatever it queues, as after a key. */
+    virtual void ProcessTimeout(uint32_t now) = 0;
+};
+
+/* The actions' side of the app, shared by every frontend: what each action does to the
+   icon, the timers that undo them later (the bait's BAIT_DURATION), pacing the output
+   engine's macros, and waking the key engine when a sequence times out. The frontend
+   hands it each action event the key engine queues, which go through an event bus to the
+   app's own actions and to whatever else the frontend adds there, and drives the timer
+   wheel from its own clock, calling Advance() when GetNextDeadline() comes round.
+
+   Times are milliseconds on the frontend's 64-bit steady clock, whose low 32 bits must be
+   the clock key events are stamped with. The controller never reads a clock itself, so
+   it runs the same on a virtual one. */
+class CAppController
+{
+public:
+    CAppController(CKeyEngine &engine, COutputEngine &output, CTimerWheel &timers, IAppFrontend &frontend);
+
+    /* While the watchdog says the hook is near its budget, icon changes are held back
+       (only the last one is kept) and shown once it's over. */
+    void SetWatchdog(CHookWatchdog *watchdog) { m_watchdog = watchdog; }
+
+    /* The handlers for action events. The app's own actions are one of them, interested
+       in every key at CAPTAINHOOK_PRIORITY_APP. */
+    CEventBus &GetEventBus() { return m_bus; }
+
+    /* Act on an event popped from the key engine (not a FLAG_REPLAY one). */
+    void HandleKeyEvent(KeyEvent const &event, uint64_t now);
+
+    /* Call after handling a batch of the engine's events, so that a sequence in progress
+       times out even if no more keys come. */
+    void ScheduleSequenceTimeout(uint64_t now);
+
+    /* Send whatever the output engine has due and set a timer for the rest. */
+    void ScheduleOutput(uint64_t now);
+
+private:
+    bool HandleAction(KeyEvent const &event);
+    void ShowIcon(unsigned icon, uint64_t now);
+
+    static int OnAppEvent(void *context, CaptainHookEvent const *event);
+
+    static void OnSequenceTimer(void *context, TimerHandle timer);
+    static void OnOutputTimer(void *context, TimerHandle timer);
+    static void OnBaitTimer(void *context, TimerHandle timer);
+    static void OnShedTimer(void *context, TimerHandle timer);
+
+    CKeyEngine &m_engine;
+    COutputEngine &m_output;
+    CTimerWheel &m_timers;
+    IAppFrontend &m_frontend;
+    CHookWatchdog *m_watchdog;
+    CEventBus m_bus;
+    uint64_t m_now;     // of the event being dispatched
+    TimerHandle m_sequenceTimer;
+    TimerHandle m_outputTimer;
+    TimerHandle m_baitTimer;
+    TimerHandle m_shedTimer;
+    unsigned m_heldIcon;    // held back while shedding, if m_shedTimer is set
+};
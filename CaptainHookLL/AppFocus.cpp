@@ -0,0 +1,66 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "AppFocus.h"
+#include <string.h>
+
+CAppFocus::CAppFocus() :
+    m_current(&m_none),
+    m_switchCount(0)
+{
+    memset(&m_none, 0, sizeof(m_none));
+}
+
+void CAppFocus::SetApplication(char const *name, size_t length)
+{
+    std::string key(name, (length < APP_NAME_LENGTH) ? length : APP_NAME_LENGTH - 1);
+    for (size_t i = 0; i < key.size(); ++i) {
+        if ((key[i] >= 'A') && (key[i] <= 'Z')) {
+            key[i] = static_cast<char>(key[i] - 'A' + 'a');
+        }
+    }
+
+    AppIdentity const *identity = &m_none;
+    if (!key.empty()) {
+        std::unique_ptr<AppIdentity> &interned = m_identities[key];
+        if (!interned) {
+            interned.reset(new AppIdentity);
+            memset(interned.get(), 0, sizeof(AppIdentity));
+            memcpy(interned->name, key.data(), key.size());
+        }
+        identity = interned.get();
+    }
+
+    // The identity is complete before it's published, and never changes afterwards.
+    if (m_current.exchange(identity, std::memory_order_acq_rel) != identity) {
+        m_switchCount.store(m_switchCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
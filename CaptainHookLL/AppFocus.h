@@ -0,0 +1,84 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+static size_t const APP_NAME_LENGTH = 64;
+
+/* Which application has the focus, as far as keymap profiles are concerned: its name
+   (e.g. "notepad.exe" on Windows, or a window class or app ID on Linux), in lower case. */
+struct AppIdentity
+{
+    char name[APP_NAME_LENGTH];
+};
+
+/* Tells the hook which application is in the foreground. Whatever watches the focus calls
+   SetApplication() when it moves, and the hook reads GetApplication() on every key: one
+   atomic load of a pointer that only changes when the focus does, so the hook can tell
+   in a single compare whether it needs to look for another profile.
+
+   Identities are interned, one per distinct name, and kept until the object is destroyed,
+   so a pointer the hook has read stays valid however often the focus moves on. The names
+   of the applications one person uses in a session are few enough for that not to
+   matter.
+
+   SetApplication() may be called from any one thread at a time; GetApplication() from any
+   thread. */
+class CAppFocus
+{
+public:
+    CAppFocus();
+
+    /* name needn't be NUL-terminated. It's folded to lower case and cut off at
+       APP_NAME_LENGTH - 1 characters. An empty name means no application in particular. */
+    void SetApplication(char const *name, size_t length);
+
+    AppIdentity const *GetApplication() const { return m_current.load(std::memory_order_acquire); }
+
+    /* Times the application changed, not counting a switch to the one already current. */
+    uint32_t GetSwitchCount() const { return m_switchCount.load(std::memory_order_relaxed); }
+
+private:
+    CAppFocus(CAppFocus const &) = delete;
+    CAppFocus &operator=(CAppFocus const &) = delete;
+
+    std::atomic<AppIdentity const *> m_current;
+    std::atomic<uint32_t> m_switchCount;
+
+    AppIdentity m_none;
+    std::unordered_map<std::string, std::unique_ptr<AppIdentity>> m_identities;
+};
@@ -33,6 +33,25 @@
 #include "CaptainHookLL.h"
 #include "stdio.h"
 #include "NotificationIcon.h"
+#include "IconAtlas.h"
+#include "ActionExecutor.h"
+#include "AppFocus.h"
+#include "AppActions.h"
+#include "AppController.h"
+#include "ControlPlane.h"
+#include "HookStatistics.h"
+#include "HookWatchdog.h"
+#include "KeyboardLayout.h"
+#include "KeyEngine.h"
+#include "Keymap.h"
+#include "KeymapPublisher.h"
+#include "KeymapReloader.h"
+#include "MotionBatcher.h"
+#include "OutputEngine.h"
+#include "PluginLibrary.h"
+#include "ProcessNameCache.h"
+#include "TimerWheel.h"
+#include "VirtualKeys.h"
 
 //
 // Constants
@@ -40,10 +59,92 @@
 
 enum wmapp_messages {
     WMAPP_NOTIFYCALLBACK = WM_APP + 1,
+    WMAPP_KEYEVENTS,
+    WMAPP_KEYMAPRELOADED,
+    WMAPP_ACTIONSDONE,
+    WMAPP_WATCHDOG,
+    WMAPP_LAYOUTCHECK,
+    WMAPP_CONTROLWAKE,
+    WMAPP_CONTROLRESUME,
+    WMAPP_MOTION,
 };
 
 static UINT const UID_CAPTAINHOOKLL = 1;
-static UINT const IDT_KEYSTROKETIMER = 1;
+static UINT const IDT_TIMERWHEEL = 1;
+static UINT const IDT_ICONFLUSHTIMER = 2;
+
+/* Editors often save a file in several steps, so wait for it to stop changing before
+   reloading it. */
+static DWORD const KEYMAP_SETTLE_TIME = 200;
+
+/* Workers for the actions that do real work (see CActionExecutor), and how long a script
+   may run before the worker stops waiting for it. */
+static unsigned const ACTION_WORKER_COUNT = 2;
+static DWORD const SCRIPT_TIMEOUT = 30000;
+static int const SCRIPT_NOT_STARTED = -1;
+static int const SCRIPT_TIMED_OUT = -2;
+
+/* Tags the keys we re-inject (via KEYBDINPUT::dwExtraInfo) so the hook can recognize them,
+   and the keys macros type, which the hook lets straight through. */
+static ULONG_PTR const REPLAY_MARKER = 0x43484B4C;
+static ULONG_PTR const OUTPUT_MARKER = 0x43484B4F;
+
+/* The watchdog's heartbeat: a release of an unassigned virtual key, tagged so that the
+   hook can swallow it before anything else sees it. */
+static ULONG_PTR const PROBE_MARKER = 0x43484B50;
+static WORD const PROBE_KEY = 0xE8;
+
+/* Notification icons (see app_icons), loaded once at startup. */
+static WORD const g_iconResources[ICON_COUNT] = {
+    IDI_NOTIFICATIONHOOK,
+    IDI_NOTIFICATIONHOOKFISH,
+    IDI_NOTIFICATIONHOOKBAIT,
+};
+
+static TCHAR const g_keymapFileName[] = _T("CaptainHookLL.keymap");
+static TCHAR const g_keymapImageFileName[] = _T("CaptainHookLL.keymap.bin");
+static TCHAR const g_statisticsFileName[] = _T("CaptainHookLL.stats.json");
+static TCHAR const g_scriptFileName[] = _T("CaptainHookLL.script.cmd");
+static TCHAR const g_pluginDirectoryName[] = _T("Plugins");
+
+//
+// Action workers
+//
+
+/* Writes the statistics file. Returns 0 if it was written. */
+class CStatisticsWorker : public IActionWorker
+{
+public:
+    virtual int RunAction(KeyEvent const &event);
+};
+
+/* Runs the script next to the executable, hidden, and returns its exit code (or
+   SCRIPT_NOT_STARTED or SCRIPT_TIMED_OUT). */
+class CScriptWorker : public IActionWorker
+{
+public:
+    virtual int RunAction(KeyEvent const &event);
+};
+
+/* Types macros with one SendInput() call per batch. */
+class CSendInputSink : public IOutputSink
+{
+public:
+    virtual size_t SendKeys(KeyEvent const *keys, size_t count);
+
+private:
+    INPUT m_inputs[COutputEngine::BATCH_KEYS];
+};
+
+/* What the actions do in the tray app: icons go to the notification area, actions that
+   do real work to the executor. */
+class CTrayFrontend : public IAppFrontend
+{
+public:
+    virtual void ShowIcon(unsigned icon);
+    virtual void SubmitAction(KeyEvent const &event);
+    virtual void ProcessTimeout(uint32_t now);
+};
 
 //
 // Function declarations
@@ -53,11 +154,47 @@ LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 static void RegisterWindowClass(HINSTANCE hInstance, LPCTSTR pszClassName, LPCTSTR pszMenuName, WNDPROC lpfnWndProc, WORD iconId);
 static void ShowContextMenu(HWND hWnd);
 static HWND CreateApplicationWindow(HINSTANCE hInstance);
+static HWND CreateMessageWindow(HINSTANCE hInstance);
+static BOOL HasOption(LPCSTR commandLine, char const *name);
+static void RegisterHooks();
+static void ShowMessage(LPCTSTR title, LPCTSTR message, DWORD flags);
 static INT_PTR CALLBACK About(HWND, UINT, WPARAM, LPARAM);
 static HHOOK RegisterKeyboardHook();
 static BOOL UnregisterKeyboardHook(HHOOK hhk);
 static LRESULT CALLBACK LowLevelKeyboardProc(int nCode, WPARAM wParam, LPARAM lParam);
-static BOOL HandleKeyEvent(HWND hWnd, DWORD keycode, BOOL keyIsDown, BOOL isSystemKey);
+static HHOOK RegisterMouseHook();
+static LRESULT CALLBACK LowLevelMouseProc(int nCode, WPARAM wParam, LPARAM lParam);
+static unsigned ProcessWheel(int axis, int delta, MSLLHOOKSTRUCT const *mshook);
+static void EndHookCallback(DWORD const *eventTime, uint64_t start);
+static UINT GetHookTimeout();
+static void SyncLockState();
+static void RunWatchdog(HWND hWnd);
+static BOOL SendProbe();
+static void OnWatchdogTimer(void *context, TimerHandle timer);
+static void OnMotionTimer(void *context, TimerHandle timer);
+static void CALLBACK ForegroundEventProc(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hwnd, LONG idObject, LONG idChild, DWORD idEventThread, DWORD dwmsEventTime);
+static void SetForegroundApp(HWND hWnd);
+static void BuildLayouts();
+static void SetForegroundLayout(HWND hWnd);
+static BOOL GetAppFilePath(TCHAR *path, size_t size, LPCTSTR fileName);
+static void LoadPlugins();
+static void UnloadPlugins();
+static BOOL StartKeymapWatcher();
+static void StopKeymapWatcher();
+static DWORD WINAPI KeymapWatcherThread(LPVOID parameter);
+static void ShowKeymapError(KeymapError const &error, LPCTSTR fallback);
+static bool WakeForCompletions(void *context);
+static void SubmitAction(uint16_t action);
+static void ProcessActionCompletions();
+static void ShowStatistics(BOOL saved);
+static void ProcessKeyEvents(HWND hWnd);
+static void ReplayKeys(KeyEvent const *events, UINT count);
+static void ScheduleSequenceTimeout(HWND hWnd);
+static void ScheduleTimers(HWND hWnd);
+static void RunControlPlane(HWND hWnd);
+static void OnControlTimer(void *context, TimerHandle timer);
+static void ResumeControlPlane(HWND hWnd);
+static void CALLBACK OnControlWake(PVOID context, BOOLEAN timedOut);
 
 //
 // Global variables
@@ -65,9 +202,107 @@ static BOOL HandleKeyEvent(HWND hWnd, DWORD keycode, BOOL keyIsDown, BOOL isSyst
 
 static HWND g_hWnd = NULL;
 static HINSTANCE g_hInstance = NULL;
+
+/* With /headless there's no notification icon and the window is message-only, for hosts
+   where nobody looks at the tray. Startup is timed from WinMain to the hook being in
+   place either way. */
+static BOOL g_headless = FALSE;
+
+/* With /tickless the app only wakes up for input and for deadlines that matter: the
+   watchdog parks once a quiet hook has answered a probe, and the control plane stops
+   publishing once nothing changes, until a client wakes it. */
+static BOOL g_tickless = FALSE;
+static uint64_t g_startTicks = 0;
 static HHOOK g_hLLHook = NULL;
+static HHOOK g_hLLMouseHook = NULL;
+static HWINEVENTHOOK g_hForegroundHook = NULL;
 static CNotificationIcon g_NotificationIcon;
 
+/* The foreground application, for keymap profiles. ForegroundEventProc finds its name
+   when the focus moves, and the hook reads it with one atomic load per key. */
+static CAppFocus g_AppFocus;
+static CProcessNameCache g_ProcessNames;
+
+/* The foreground window's keyboard layout, for what keys type towards abbreviations. A
+   table is built for each installed layout at startup (and for any other the moment it's
+   seen), so following the layout is a lookup. Windows says nothing when the layout
+   changes, so it's checked when the focus moves and after each modifier is released, as
+   every layout hotkey ends with one. */
+static CLayoutCache g_Layouts;
+static BOOL g_layoutCheckPending = FALSE;
+static CIconAtlas g_IconAtlas;
+
+/* The hook only looks keys up in the keymap and queues the result; the work associated
+   with a key happens later, in g_Controller on the message loop thread. The hook uses
+   whichever keymap was published last: a worker thread watches the keymap file and
+   compiles and publishes it again whenever it changes, without ever blocking the hook. */
+static CKeyEngine g_KeyEngine;
+static CKeymapPublisher g_KeymapPublisher;
+static CKeymapReloader g_KeymapReloader(g_KeymapPublisher, g_actionNames, g_actionNameCount);
+static TCHAR g_keymapPath[MAX_PATH];
+static TCHAR g_keymapImagePath[MAX_PATH];
+static BOOL g_keymapLoadFailed = FALSE;
+static KeymapError g_keymapError;
+static HANDLE g_hKeymapWatcher = NULL;
+static HANDLE g_hKeymapWatcherStop = NULL;
+static HANDLE g_hKeymapReload = NULL;
+
+/* Actions that do real work run on the executor's workers; g_Controller just submits
+   them, and their completions come back as WMAPP_ACTIONSDONE. */
+static CActionExecutor g_Executor;
+static CStatisticsWorker g_StatisticsWorker;
+static CScriptWorker g_ScriptWorker;
+
+/* Macros are typed from here, paced by g_Controller's timer. */
+static CSendInputSink g_OutputSink;
+static COutputEngine g_OutputEngine(g_OutputSink);
+
+/* Action and sequence timers all share one OS timer (IDT_TIMERWHEEL), which is always
+   set for the wheel's next deadline. Times are GetTickCount64() milliseconds. */
+static CTimerWheel g_Timers;
+static ULONGLONG g_timerWheelDeadline = CTimerWheel::NO_DEADLINE;
+
+/* What the actions do, shared with the Linux daemon. */
+static CTrayFrontend g_Frontend;
+static CAppController g_Controller(g_KeyEngine, g_OutputEngine, g_Timers, g_Frontend);
+
+/* Handler plugins: every DLL in the Plugins directory beside the executable, loaded at
+   startup and given the action events along with the app's own actions (see
+   CaptainHookPlugin.h). The last one that failed to load is reported once the window
+   is up. */
+static std::vector<std::unique_ptr<CPluginLibrary>> g_Plugins;
+static std::vector<EventHandlerId> g_pluginHandlers;
+static TCHAR g_pluginError[MAX_PATH + 64];
+
+/* Always on; see the Statistics menu item. */
+static CHookStatistics g_Statistics;
+
+/* Keeps the hook within LowLevelHooksTimeout, and puts it back if Windows takes it away
+   anyway. Polled from g_watchdogTimer, or straight away (WMAPP_WATCHDOG) after the hook
+   overruns. */
+static CHookWatchdog g_Watchdog;
+static TimerHandle g_watchdogTimer = INVALID_TIMER;
+
+/* The mouse hook decides buttons and the wheel there and then, but only stores movement
+   (in screen pixels) for g_motionTimer to reduce once a frame. The hook doesn't touch the
+   timers itself: it posts WMAPP_MOTION, once, for the message loop to arm g_motionTimer.
+   The wheel's remainders hold what has turned towards the next notch on each axis. */
+static CMotionBatcher g_Motion;
+static TimerHandle g_motionTimer = INVALID_TIMER;
+static BOOL g_motionPending = FALSE;
+static POINT g_lastPoint;
+static BOOL g_haveLastPoint = FALSE;
+static int g_wheelRemainder[2];
+
+/* The statistics, published in shared memory every CONTROL_INTERVAL ms (or, with
+   /tickless, while they're changing) for captainhook-ctl and other monitoring tools,
+   which post pause, resume and reload commands back and wake the app to run them through
+   g_hControlWait; see CControlPlane. */
+static CControlPlane g_ControlPlane;
+static TimerHandle g_controlTimer = INVALID_TIMER;
+static HANDLE g_hControlWait = NULL;
+static BOOL g_controlResumePending = FALSE;
+
 
 int APIENTRY WinMain(HINSTANCE hInstance,
     HINSTANCE hPrevInstance,
@@ -75,14 +310,46 @@ int APIENTRY WinMain(HINSTANCE hInstance,
     int nCmdShow)
 {
     UNREFERENCED_PARAMETER(hPrevInstance);
-    UNREFERENCED_PARAMETER(lpCmdLine);
     UNREFERENCED_PARAMETER(nCmdShow);
 
+    g_startTicks = LatencyClockNow();
     g_hInstance = hInstance;
-    g_hWnd = CreateApplicationWindow(g_hInstance);
+    g_headless = HasOption(lpCmdLine, "headless");
+    g_tickless = HasOption(lpCmdLine, "tickless");
+
+    g_KeymapReloader.SetDefaultKeymap(g_defaultKeymap, g_defaultKeymapLength);
+    if (GetAppFilePath(g_keymapPath, MAX_PATH, g_keymapFileName) &&
+        GetAppFilePath(g_keymapImagePath, MAX_PATH, g_keymapImageFileName)) {
+        g_KeymapReloader.SetPaths(g_keymapPath, g_keymapImagePath);
+    } else {
+        g_keymapPath[0] = _T('\0');
+    }
+    g_keymapLoadFailed = !g_KeymapReloader.Load(&g_keymapError);
+    g_KeyEngine.SetKeymapPublisher(&g_KeymapPublisher);
+    g_KeyEngine.SetAppFocus(&g_AppFocus);
+    g_KeyEngine.SetLayouts(&g_Layouts);
+    g_OutputEngine.SetKeymapPublisher(&g_KeymapPublisher);
+    g_OutputEngine.SetKeyState(&g_KeyEngine.GetKeyState());
+    g_Executor.SetWorker(ACTION_SAVE_STATISTICS, &g_StatisticsWorker, 1, CActionExecutor::POLICY_COALESCE);
+    g_Executor.SetWorker(ACTION_RUN_SCRIPT, &g_ScriptWorker, SCRIPT_QUEUE_LIMIT, CActionExecutor::POLICY_DROP_NEWEST);
+    g_Executor.SetWakeFunction(WakeForCompletions, NULL);
+    g_Watchdog.SetBudget(GetHookTimeout());
+    g_Watchdog.SetIdleProbing(!g_tickless);
+    g_Statistics.SetWatchdog(&g_Watchdog);
+    g_Controller.SetWatchdog(&g_Watchdog);
+    LoadPlugins();
+    SyncLockState();
+    if (g_headless) {
+        g_hWnd = CreateMessageWindow(g_hInstance);
+    } else {
+        g_hWnd = CreateApplicationWindow(g_hInstance);
+    }
 
     MSG msg;
     while (GetMessage(&msg, NULL, 0, 0)) {
+        if (msg.message != WMAPP_KEYEVENTS) {
+            g_Statistics.CountWakeup();
+        }
         TranslateMessage(&msg);
         DispatchMessage(&msg);
     }
@@ -94,13 +361,53 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 {
     switch (message) {
     case WM_CREATE:
-        /* Install the low level hook to trap keyboard input. */
-        g_hLLHook = RegisterKeyboardHook();
+        /* The hook posts to g_hWnd, so make sure it's valid before the first keystroke arrives. */
+        g_hWnd = hWnd;
+        g_Timers.Advance(::GetTickCount64());
+
+        /* Install the low level hooks to trap keyboard and mouse input. */
+        RegisterHooks();
 
-        /* Configure and enable the notification icon (the app's only UI) */
-        g_NotificationIcon.SetIcon(::LoadIcon(g_hInstance, MAKEINTRESOURCE(IDI_NOTIFICATIONHOOK)));
-        g_NotificationIcon.SetTooltipText(_T("Captain Hook"));
-        g_NotificationIcon.Enable(hWnd, WMAPP_NOTIFYCALLBACK, UID_CAPTAINHOOKLL);
+        /* Follow the foreground application, for profiles and abbreviations. Out-of-context
+           events arrive on this thread, the same one the hook runs on. */
+        g_hForegroundHook = ::SetWinEventHook(EVENT_SYSTEM_FOREGROUND, EVENT_SYSTEM_FOREGROUND,
+            NULL, ForegroundEventProc, 0, 0, WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
+        BuildLayouts();
+        SetForegroundApp(::GetForegroundWindow());
+        g_Executor.Start(ACTION_WORKER_COUNT);
+        RunWatchdog(hWnd);
+
+        /* Configure and enable the notification icon (the app's only UI). Headless, it's
+           never enabled, so everything sent to it goes nowhere, and no icons are loaded. */
+        if (!g_headless) {
+            g_IconAtlas.Load(g_hInstance, g_iconResources, ICON_COUNT);
+            g_NotificationIcon.SetIcon(g_IconAtlas.Get(ICON_HOOK));
+            g_NotificationIcon.SetFlushTimer(IDT_ICONFLUSHTIMER);
+            g_NotificationIcon.SetUpdateLatency(&g_Statistics.GetLatency(LATENCY_ICON));
+            g_NotificationIcon.SetTooltipText(_T("Captain Hook"));
+            g_NotificationIcon.Enable(hWnd, WMAPP_NOTIFYCALLBACK, UID_CAPTAINHOOKLL);
+        }
+
+        if (g_keymapLoadFailed) {
+            ShowKeymapError(g_keymapError, _T("Using the default keymap."));
+        }
+        if (g_pluginError[0]) {
+            ShowMessage(_T("Captain Hook plugin not loaded"), g_pluginError, CNotificationIcon::ICON_WARNING);
+        }
+        StartKeymapWatcher();
+
+        {
+            char controlName[64];
+            GetControlPlaneName(controlName, sizeof(controlName));
+            if (g_ControlPlane.Create(controlName, ::GetCurrentProcessId())) {
+                if (g_ControlPlane.GetWake().IsOpen() &&
+                    !::RegisterWaitForSingleObject(&g_hControlWait, g_ControlPlane.GetWake().GetEvent(),
+                        OnControlWake, NULL, INFINITE, WT_EXECUTEDEFAULT)) {
+                    g_hControlWait = NULL;
+                }
+                RunControlPlane(hWnd);
+            }
+        }
         break;
 
     case WM_CLOSE:
@@ -109,9 +416,16 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
     case WM_TIMER:
         switch (wParam) {
-        case IDT_KEYSTROKETIMER:
-            ::KillTimer(hWnd, IDT_KEYSTROKETIMER);
-            g_NotificationIcon.SetIcon(::LoadIcon(g_hInstance, MAKEINTRESOURCE(IDI_NOTIFICATIONHOOK)));
+        case IDT_TIMERWHEEL:
+            /* SetTimer() timers repeat, so stop this one until ScheduleTimers() sets it again. */
+            ::KillTimer(hWnd, IDT_TIMERWHEEL);
+            g_timerWheelDeadline = CTimerWheel::NO_DEADLINE;
+            g_Timers.Advance(::GetTickCount64());
+            ScheduleTimers(hWnd);
+            break;
+
+        case IDT_ICONFLUSHTIMER:
+            g_NotificationIcon.Flush();
             break;
 
         default:
@@ -119,6 +433,65 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         }
         break;
 
+    case WMAPP_KEYEVENTS:
+        ProcessKeyEvents(hWnd);
+        break;
+
+    case WMAPP_ACTIONSDONE:
+        ProcessActionCompletions();
+        break;
+
+    case WMAPP_WATCHDOG:
+        RunWatchdog(hWnd);
+        break;
+
+    case WMAPP_CONTROLWAKE:
+        /* While the control plane's timer is running, it'll get to the commands soon
+           enough. */
+        if (g_controlTimer == INVALID_TIMER) {
+            RunControlPlane(hWnd);
+        }
+        break;
+
+    case WMAPP_CONTROLRESUME:
+        g_controlResumePending = FALSE;
+        if (g_controlTimer == INVALID_TIMER) {
+            ResumeControlPlane(hWnd);
+        }
+        break;
+
+    case WMAPP_MOTION:
+        g_motionPending = FALSE;
+        if (g_motionTimer == INVALID_TIMER) {
+            g_motionTimer = g_Timers.Arm(::GetTickCount64() + CMotionBatcher::FRAME_INTERVAL, OnMotionTimer, NULL);
+            ScheduleTimers(hWnd);
+        }
+        break;
+
+    case WMAPP_LAYOUTCHECK:
+        g_layoutCheckPending = FALSE;
+        SetForegroundLayout(::GetForegroundWindow());
+        break;
+
+    case WM_SETTINGCHANGE:
+        /* Layouts added, removed or redefined: build them all again. */
+        if ((wParam == SPI_SETDEFAULTINPUTLANG) ||
+            (lParam && (_tcscmp(reinterpret_cast<LPCTSTR>(lParam), _T("intl")) == 0))) {
+            g_Layouts.Invalidate();
+            BuildLayouts();
+            SetForegroundLayout(::GetForegroundWindow());
+        }
+        break;
+
+    case WMAPP_KEYMAPRELOADED:
+        /* lParam is a KeymapError from the watcher thread if the reload failed. */
+        if (lParam) {
+            KeymapError *error = reinterpret_cast<KeymapError *>(lParam);
+            ShowKeymapError(*error, _T("Keeping the current keymap."));
+            delete error;
+        }
+        break;
+
     case WMAPP_NOTIFYCALLBACK:
         switch (LOWORD(lParam)) {
         case NIN_SELECT:
@@ -143,6 +516,10 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             DialogBox(g_hInstance, MAKEINTRESOURCE(IDD_ABOUTBOX), hWnd, About);
             break;
 
+        case IDM_STATISTICS:
+            SubmitAction(ACTION_SAVE_STATISTICS);
+            break;
+
         default:
             return DefWindowProc(hWnd, message, wParam, lParam);
         }
@@ -150,8 +527,23 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
     case WM_DESTROY:
     case WM_ENDSESSION:
-        /* Remove the low-level keyboard hook */
+        /* Remove the low-level hooks */
         UnregisterKeyboardHook(g_hLLHook);
+        UnregisterKeyboardHook(g_hLLMouseHook);
+        if (g_hForegroundHook) {
+            ::UnhookWinEvent(g_hForegroundHook);
+            g_hForegroundHook = NULL;
+        }
+        StopKeymapWatcher();
+        if (g_hControlWait) {
+            ::UnregisterWaitEx(g_hControlWait, INVALID_HANDLE_VALUE);
+            g_hControlWait = NULL;
+        }
+        g_ControlPlane.Close();
+
+        /* Waits for any action that's running (a script, at worst SCRIPT_TIMEOUT). */
+        g_Executor.Stop();
+        UnloadPlugins();
 
         /* Remove the notification icon */
         g_NotificationIcon.Disable();
@@ -223,6 +615,39 @@ static HWND CreateApplicationWindow(HINSTANCE hInstance)
         0);
 }
 
+static HWND CreateMessageWindow(HINSTANCE hInstance)
+{
+    /* No icon, cursor or menu to load. A message-only window can't be seen or found by
+       enumerating windows, and gets no broadcasts such as WM_ENDSESSION; Windows removes
+       the hooks with the process. */
+    WNDCLASSEX wcex = { sizeof(wcex) };
+    wcex.lpfnWndProc = WndProc;
+    wcex.hInstance = hInstance;
+    wcex.lpszClassName = _T("__CaptainHookHeadless");
+    RegisterClassEx(&wcex);
+
+    return ::CreateWindowEx(0, _T("__CaptainHookHeadless"), _T("Captain Hook"), 0, 0, 0, 0, 0,
+        HWND_MESSAGE, NULL, hInstance, 0);
+}
+
+/* Whether the command line has /name (or --name). */
+static BOOL HasOption(LPCSTR commandLine, char const *name)
+{
+    char const *separators = " \t";
+    char arguments[256];
+    strncpy_s(arguments, commandLine ? commandLine : "", _TRUNCATE);
+    char *context = NULL;
+    for (char *argument = strtok_s(arguments, separators, &context); argument;
+        argument = strtok_s(NULL, separators, &context)) {
+        char const *option = (argument[0] == '/') ? argument + 1 :
+            ((argument[0] == '-') && (argument[1] == '-')) ? argument + 2 : NULL;
+        if (option && (_stricmp(option, name) == 0)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
 static INT_PTR CALLBACK About(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 {
     // Message handler for about box.
@@ -241,6 +666,18 @@ static INT_PTR CALLBACK About(HWND hDlg, UINT message, WPARAM wParam, LPARAM lPa
     return (INT_PTR)FALSE;
 }
 
+static void RegisterHooks()
+{
+    uint64_t start = LatencyClockNow();
+    g_hLLHook = RegisterKeyboardHook();
+    g_hLLMouseHook = RegisterMouseHook();
+    if (g_hLLHook && (g_Statistics.GetStartupTime() == 0)) {
+        uint64_t now = LatencyClockNow();
+        g_Statistics.SetHookTime(LatencyClockToNanoseconds(now - start));
+        g_Statistics.SetStartupTime(LatencyClockToNanoseconds(now - g_startTicks));
+    }
+}
+
 static HHOOK RegisterKeyboardHook()
 {
     return ::SetWindowsHookEx(WH_KEYBOARD_LL, LowLevelKeyboardProc, g_hInstance, 0);
@@ -256,66 +693,807 @@ static BOOL UnregisterKeyboardHook(HHOOK hhk)
 
 static LRESULT CALLBACK LowLevelKeyboardProc(int nCode, WPARAM wParam, LPARAM lParam)
 {
+    /* Everything in here delays every keystroke on the system, and Windows will silently
+       remove the hook if it takes longer than LowLevelHooksTimeout. Only decide whether
+       to swallow the key and queue it; handlers run later from ProcessKeyEvents(). */
+    uint64_t start = LatencyClockNow();
+    DWORD const *eventTime = NULL;
     if (nCode == HC_ACTION) {
-        if ((wParam == WM_KEYDOWN) || (wParam == WM_KEYUP) ||
-            (wParam == WM_SYSKEYDOWN) || (wParam == WM_SYSKEYUP)) {
-            KBDLLHOOKSTRUCT *kbhook = reinterpret_cast<KBDLLHOOKSTRUCT *>(lParam);
-            BOOL keyIsDown = ((wParam == WM_KEYDOWN) || (wParam == WM_SYSKEYDOWN));
-            BOOL keyIsSystemKey = ((wParam == WM_SYSKEYDOWN) || (wParam == WM_SYSKEYUP));
-            BOOL shouldKeepProcessing = HandleKeyEvent(g_hWnd, kbhook->vkCode, keyIsDown, keyIsSystemKey);
-            if (!shouldKeepProcessing) {
+        KBDLLHOOKSTRUCT const *kbhook = reinterpret_cast<KBDLLHOOKSTRUCT const *>(lParam);
+        eventTime = &kbhook->time;
+        if ((kbhook->flags & LLKHF_INJECTED) && (kbhook->dwExtraInfo == PROBE_MARKER)) {
+            g_Watchdog.ProbeReceived();
+            EndHookCallback(eventTime, start);
+            return 1;
+        }
+
+        /* Keys that macros type go straight through: the keymap isn't for them, and they
+           mustn't disturb the key state that the output engine restores modifiers from. */
+        BOOL isOutput = (kbhook->flags & LLKHF_INJECTED) && (kbhook->dwExtraInfo == OUTPUT_MARKER);
+        if (((wParam == WM_KEYDOWN) || (wParam == WM_KEYUP) ||
+            (wParam == WM_SYSKEYDOWN) || (wParam == WM_SYSKEYUP)) && !isOutput) {
+            KeyEvent input;
+            input.time = kbhook->time;
+            input.action = ACTION_NONE;
+            input.keycode = static_cast<uint8_t>(kbhook->vkCode);
+            input.flags = 0;
+            if ((wParam == WM_KEYDOWN) || (wParam == WM_SYSKEYDOWN)) {
+                input.flags |= KeyEvent::FLAG_DOWN;
+            }
+            if ((wParam == WM_SYSKEYDOWN) || (wParam == WM_SYSKEYUP)) {
+                input.flags |= KeyEvent::FLAG_SYSTEM;
+            }
+            if (kbhook->flags & LLKHF_EXTENDED) {
+                input.flags |= KeyEvent::FLAG_EXTENDED;
+            }
+            if (kbhook->flags & LLKHF_INJECTED) {
+                input.flags |= KeyEvent::FLAG_INJECTED;
+                if (kbhook->dwExtraInfo == REPLAY_MARKER) {
+                    input.flags |= KeyEvent::FLAG_REPLAY;
+                }
+            }
+            unsigned result = g_KeyEngine.ProcessKey(input);
+            if (result & CKeyEngine::RESULT_WAKE) {
+                if (!::PostMessage(g_hWnd, WMAPP_KEYEVENTS, 0, 0)) {
+                    g_KeyEngine.CancelWake();
+                }
+            }
+            if (!(input.flags & KeyEvent::FLAG_DOWN) && CKeyStateTracker::GetKeyModifier(input.keycode) &&
+                !g_layoutCheckPending) {
+                g_layoutCheckPending = ::PostMessage(g_hWnd, WMAPP_LAYOUTCHECK, 0, 0);
+            }
+            g_Statistics.CountKey((result & CKeyEngine::RESULT_CONSUME) != 0);
+            if (result & CKeyEngine::RESULT_CONSUME) {
                 // Prevent this keystroke from making it further in the hook chain or to the application.
+                EndHookCallback(eventTime, start);
                 return 1;
             }
         }
     }
 
-    return ::CallNextHookEx(NULL, nCode, wParam, lParam);
+    LRESULT next = ::CallNextHookEx(NULL, nCode, wParam, lParam);
+    EndHookCallback(eventTime, start);
+    return next;
 }
 
-static BOOL HandleKeyEvent(HWND hWnd, DWORD keycode, BOOL keyIsDown, BOOL keyIsSystemKey)
+static HHOOK RegisterMouseHook()
 {
-    /* keyIsSystemKey is TRUE if ALT is held. If you don't care about the different between
-       KEY vs ALT-KEY, then you don't need this. */
-    UNREFERENCED_PARAMETER(keyIsSystemKey);
+    return ::SetWindowsHookEx(WH_MOUSE_LL, LowLevelMouseProc, g_hInstance, 0);
+}
 
-    static int count = 0;
-    switch (keycode) {
-    case 'A':
-        /* This demonstrates a key event handler that performs one action when a key is pressed
-        and another when the key is released. */
-        if (keyIsDown) {
-            /* Note that this will occurr repeatedly while a key is held. If you care about
-                catching only the transition from released to held, you'll need to track that
-                state yourself. */
-            // Key pressed or held.
-            g_NotificationIcon.SetIcon(::LoadIcon(g_hInstance, MAKEINTRESOURCE(IDI_NOTIFICATIONHOOKFISH)));
+static LRESULT CALLBACK LowLevelMouseProc(int nCode, WPARAM wParam, LPARAM lParam)
+{
+    /* A gaming mouse calls this up to 8000 times a second, nearly all of them for
+       movement, which is only stored. Buttons and the wheel go through the keymap like
+       keys, under the same LowLevelHooksTimeout. */
+    uint64_t start = LatencyClockNow();
+    DWORD const *eventTime = NULL;
+    if (nCode == HC_ACTION) {
+        MSLLHOOKSTRUCT const *mshook = reinterpret_cast<MSLLHOOKSTRUCT const *>(lParam);
+        eventTime = &mshook->time;
+        if (wParam == WM_MOUSEMOVE) {
+            if (g_haveLastPoint) {
+                g_Motion.Add(mshook->pt.x - g_lastPoint.x, mshook->pt.y - g_lastPoint.y, mshook->time);
+                /* Until the frame timer is armed, keep asking; a failed post is tried
+                   again on the next movement. */
+                if ((g_motionTimer == INVALID_TIMER) && !g_motionPending) {
+                    g_motionPending = ::PostMessage(g_hWnd, WMAPP_MOTION, 0, 0);
+                }
+            }
+            g_lastPoint = mshook->pt;
+            g_haveLastPoint = TRUE;
+        } else {
+            unsigned result = 0;
+            uint8_t keycode = 0;
+            switch (wParam) {
+            case WM_LBUTTONDOWN:
+            case WM_LBUTTONUP:
+                keycode = VK_LBUTTON;
+                break;
+            case WM_RBUTTONDOWN:
+            case WM_RBUTTONUP:
+                keycode = VK_RBUTTON;
+                break;
+            case WM_MBUTTONDOWN:
+            case WM_MBUTTONUP:
+                keycode = VK_MBUTTON;
+                break;
+            case WM_XBUTTONDOWN:
+            case WM_XBUTTONUP:
+                keycode = (HIWORD(mshook->mouseData) == XBUTTON1) ? VK_XBUTTON1 : VK_XBUTTON2;
+                break;
+            case WM_MOUSEWHEEL:
+                result = ProcessWheel(0, static_cast<short>(HIWORD(mshook->mouseData)), mshook);
+                break;
+            case WM_MOUSEHWHEEL:
+                result = ProcessWheel(1, static_cast<short>(HIWORD(mshook->mouseData)), mshook);
+                break;
+            default:
+                break;
+            }
+            if (keycode) {
+                KeyEvent input;
+                input.time = mshook->time;
+                input.action = ACTION_NONE;
+                input.keycode = keycode;
+                input.flags = 0;
+                if ((wParam == WM_LBUTTONDOWN) || (wParam == WM_RBUTTONDOWN) ||
+                    (wParam == WM_MBUTTONDOWN) || (wParam == WM_XBUTTONDOWN)) {
+                    input.flags |= KeyEvent::FLAG_DOWN;
+                }
+                if (mshook->flags & LLMHF_INJECTED) {
+                    input.flags |= KeyEvent::FLAG_INJECTED;
+                }
+                result = g_KeyEngine.ProcessButton(input);
+                g_Statistics.CountKey((result & CKeyEngine::RESULT_CONSUME) != 0);
+            }
+            if (result & CKeyEngine::RESULT_WAKE) {
+                if (!::PostMessage(g_hWnd, WMAPP_KEYEVENTS, 0, 0)) {
+                    g_KeyEngine.CancelWake();
+                }
+            }
+            if (result & CKeyEngine::RESULT_CONSUME) {
+                EndHookCallback(eventTime, start);
+                return 1;
+            }
         }
-        else {
-            // Key released
-            g_NotificationIcon.SetIcon(::LoadIcon(g_hInstance, MAKEINTRESOURCE(IDI_NOTIFICATIONHOOK)));
+    }
+
+    LRESULT next = ::CallNextHookEx(NULL, nCode, wParam, lParam);
+    EndHookCallback(eventTime, start);
+    return next;
+}
+
+static unsigned ProcessWheel(int axis, int delta, MSLLHOOKSTRUCT const *mshook)
+{
+    /* Precise wheels and touchpads turn a notch (WHEEL_DELTA) a little at a time. A turn
+       that doesn't complete one goes through untouched; a turn back starts again. Positive
+       deltas are away from the user, or to the right. */
+    if ((g_wheelRemainder[axis] < 0) != (delta < 0)) {
+        g_wheelRemainder[axis] = 0;
+    }
+    g_wheelRemainder[axis] += delta;
+    int notches = g_wheelRemainder[axis] / WHEEL_DELTA;
+    g_wheelRemainder[axis] -= notches * WHEEL_DELTA;
+    if (notches == 0) {
+        return 0;
+    }
+    uint8_t keycode;
+    if (axis == 0) {
+        keycode = (notches > 0) ? VKEY_WHEEL_UP : VKEY_WHEEL_DOWN;
+    } else {
+        keycode = (notches > 0) ? VKEY_WHEEL_RIGHT : VKEY_WHEEL_LEFT;
+    }
+    uint8_t flags = (mshook->flags & LLMHF_INJECTED) ? KeyEvent::FLAG_INJECTED : 0;
+    unsigned result = 0;
+    for (int notch = (notches < 0) ? -notches : notches; notch > 0; --notch) {
+        result |= g_KeyEngine.ProcessTap(keycode, mshook->time, flags);
+    }
+    g_Statistics.CountKey((result & CKeyEngine::RESULT_CONSUME) != 0);
+    return result;
+}
+
+static void EndHookCallback(DWORD const *eventTime, uint64_t start)
+{
+    uint64_t elapsed = LatencyClockToNanoseconds(LatencyClockNow() - start);
+    g_Statistics.GetLatency(LATENCY_HOOK).Record(elapsed);
+    if (eventTime && g_Watchdog.RecordCallback(::GetTickCount64(), *eventTime, elapsed)) {
+        ::PostMessage(g_hWnd, WMAPP_WATCHDOG, 0, 0);
+    }
+    /* Tickless, a stopped control plane starts again on input. The message loop arms its
+       timer, not the hook. */
+    if ((g_controlTimer == INVALID_TIMER) && !g_controlResumePending && g_ControlPlane.IsOpen()) {
+        g_controlResumePending = ::PostMessage(g_hWnd, WMAPP_CONTROLRESUME, 0, 0);
+    }
+}
+
+static UINT GetHookTimeout()
+{
+    /* Windows 7 and later remove a hook that takes longer than this, and cap it at one
+       second. */
+    DWORD timeout = 0;
+    DWORD size = sizeof(timeout);
+    if (::RegGetValue(HKEY_CURRENT_USER, _T("Control Panel\\Desktop"), _T("LowLevelHooksTimeout"),
+        RRF_RT_REG_DWORD, NULL, &timeout, &size) != ERROR_SUCCESS) {
+        return CHookWatchdog::DEFAULT_BUDGET;
+    }
+    return (timeout > 1000) ? 1000 : timeout;
+}
+
+static void SyncLockState()
+{
+    g_KeyEngine.GetKeyState().SetLockState(
+        ((::GetKeyState(VK_CAPITAL) & 1) ? KEYSTATE_CAPSLOCK : 0) |
+        ((::GetKeyState(VK_NUMLOCK) & 1) ? KEYSTATE_NUMLOCK : 0) |
+        ((::GetKeyState(VK_SCROLL) & 1) ? KEYSTATE_SCROLLLOCK : 0));
+}
+
+static void RunWatchdog(HWND hWnd)
+{
+    ULONGLONG now = ::GetTickCount64();
+    unsigned result;
+    while ((result = g_Watchdog.Poll(now)) != CHookWatchdog::POLL_IDLE) {
+        if (result == CHookWatchdog::POLL_SEND_PROBE) {
+            g_Watchdog.ProbeSent(now, SendProbe() != FALSE);
+        } else {
+            /* Windows took the hook away. Whatever was typed in the meantime went past it,
+               releases included, so start again from what the system says is held. */
+            UnregisterKeyboardHook(g_hLLHook);
+            UnregisterKeyboardHook(g_hLLMouseHook);
+            g_hLLHook = RegisterKeyboardHook();
+            g_hLLMouseHook = RegisterMouseHook();
+            g_KeyEngine.GetKeyState().Reset();
+            g_KeyEngine.ResetExpansions();
+            SyncLockState();
+            g_Watchdog.HookRegistered(now, g_hLLHook != NULL);
         }
-        break;
+    }
+
+    /* Parked (see /tickless), it waits for the next callback with no timer at all. */
+    ULONGLONG deadline = g_Watchdog.GetNextDeadline();
+    if (deadline == CHookWatchdog::NO_DEADLINE) {
+        g_Timers.Cancel(g_watchdogTimer);
+        g_watchdogTimer = INVALID_TIMER;
+    } else if (!g_Timers.Rearm(g_watchdogTimer, deadline)) {
+        g_watchdogTimer = g_Timers.Arm(deadline, OnWatchdogTimer, NULL);
+    }
+    ScheduleTimers(hWnd);
+}
 
-    case 'B':
-        /* This demonstrates a key event handler that performs an action when a key is released
-        and sets a timer to clear the action a fixed time later. This timer is extended every time
-        the key is released. */
-        if (!keyIsDown) {
-            g_NotificationIcon.SetIcon(::LoadIcon(g_hInstance, MAKEINTRESOURCE(IDI_NOTIFICATIONHOOKBAIT)));
-            ::SetTimer(hWnd, IDT_KEYSTROKETIMER, 250, NULL);
+static BOOL SendProbe()
+{
+    INPUT input;
+    ZeroMemory(&input, sizeof(input));
+    input.type = INPUT_KEYBOARD;
+    input.ki.wVk = PROBE_KEY;
+    input.ki.dwFlags = KEYEVENTF_KEYUP;
+    input.ki.dwExtraInfo = PROBE_MARKER;
+    return ::SendInput(1, &input, sizeof(INPUT)) == 1;
+}
+
+static void OnWatchdogTimer(void *context, TimerHandle timer)
+{
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(timer);
+    g_watchdogTimer = INVALID_TIMER;
+    RunWatchdog(g_hWnd);
+}
+
+static void OnMotionTimer(void *context, TimerHandle timer)
+{
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(timer);
+    g_motionTimer = INVALID_TIMER;
+    MotionFrame frame;
+    uint8_t flick = g_Motion.Flush(frame);
+    if (flick && (g_KeyEngine.ProcessTap(flick, frame.end) & CKeyEngine::RESULT_WAKE)) {
+        ProcessKeyEvents(g_hWnd);
+    }
+}
+
+static void CALLBACK ForegroundEventProc(HWINEVENTHOOK hWinEventHook, DWORD event, HWND hwnd, LONG idObject, LONG idChild, DWORD idEventThread, DWORD dwmsEventTime)
+{
+    UNREFERENCED_PARAMETER(hWinEventHook);
+    UNREFERENCED_PARAMETER(event);
+    UNREFERENCED_PARAMETER(idObject);
+    UNREFERENCED_PARAMETER(idChild);
+    UNREFERENCED_PARAMETER(idEventThread);
+    UNREFERENCED_PARAMETER(dwmsEventTime);
+
+    /* Text typed towards an abbreviation in one window mustn't complete it in another. */
+    g_KeyEngine.ResetExpansions();
+    SetForegroundApp(hwnd);
+
+    /* Someone's about, so a parked watchdog should make sure the hook still is. */
+    if (g_Watchdog.RequestProbe()) {
+        ::PostMessage(g_hWnd, WMAPP_WATCHDOG, 0, 0);
+    }
+}
+
+static void SetForegroundApp(HWND hWnd)
+{
+    /* The process is looked up once per switch (and usually found in the cache); the
+       hook just sees the identity change. */
+    char name[APP_NAME_LENGTH];
+    size_t length = g_ProcessNames.GetWindowProcessName(hWnd, name);
+    g_AppFocus.SetApplication(name, length);
+    SetForegroundLayout(hWnd);
+}
+
+static void BuildLayouts()
+{
+    int count = ::GetKeyboardLayoutList(0, NULL);
+    if (count <= 0) {
+        return;
+    }
+    std::vector<HKL> layouts(static_cast<size_t>(count));
+    count = ::GetKeyboardLayoutList(count, layouts.data());
+    for (int i = 0; i < count; ++i) {
+        uint64_t id = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(layouts[i]));
+        if (!g_Layouts.Find(id)) {
+            std::unique_ptr<LayoutTable> layout(new LayoutTable);
+            BuildLayout(layouts[i], *layout);
+            g_Layouts.Add(std::move(layout));
         }
-        break;
+    }
+}
 
-    case VK_PRIOR: /* Page Up Key */
-        break;
+static void SetForegroundLayout(HWND hWnd)
+{
+    /* Layouts belong to threads: the one that owns the window. */
+    HKL hkl = ::GetKeyboardLayout(hWnd ? ::GetWindowThreadProcessId(hWnd, NULL) : 0);
+    uint64_t id = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(hkl));
+    LayoutTable const *layout = g_Layouts.Find(id);
+    if (!layout) {
+        std::unique_ptr<LayoutTable> built(new LayoutTable);
+        BuildLayout(hkl, *built);
+        layout = g_Layouts.Add(std::move(built));
+    }
+    g_Layouts.SetCurrent(layout);
+}
 
-    case VK_NEXT: /* Page Down Key */
-        break;
-    default:
-        // If we're not processing the key, return TRUE to allow it to be passed to the application.
-        return TRUE;
+static BOOL GetAppFilePath(TCHAR *path, size_t size, LPCTSTR fileName)
+{
+    /* The app keeps its files next to the executable. */
+    DWORD length = ::GetModuleFileName(NULL, path, static_cast<DWORD>(size));
+    if ((length == 0) || (length >= size)) {
+        return FALSE;
     }
-    // If we processed the key, return FALSE to prevent it from reaching the application.
-    return FALSE;
+    TCHAR *name = _tcsrchr(path, _T('\\'));
+    name = name ? name + 1 : path;
+    return _tcscpy_s(name, size - (name - path), fileName) == 0;
+}
+
+static void LoadPlugins()
+{
+    TCHAR pattern[MAX_PATH];
+    TCHAR name[MAX_PATH];
+    _stprintf_s(name, _T("%s\\*.dll"), g_pluginDirectoryName);
+    WIN32_FIND_DATA found;
+    HANDLE hFind = GetAppFilePath(pattern, MAX_PATH, name) ? ::FindFirstFile(pattern, &found) : INVALID_HANDLE_VALUE;
+    if (hFind == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    do {
+        TCHAR path[MAX_PATH];
+        _stprintf_s(name, _T("%s\\%s"), g_pluginDirectoryName, found.cFileName);
+        std::unique_ptr<CPluginLibrary> library(new CPluginLibrary);
+        char const *error = "Path too long";
+        EventHandlerId id = INVALID_EVENT_HANDLER;
+        if (GetAppFilePath(path, MAX_PATH, name) && library->Load(path, &error)) {
+            CaptainHookPlugin const *plugin = library->GetPlugin();
+            id = g_Controller.GetEventBus().Add(plugin->name, plugin->priority, plugin->interest,
+                plugin->handleEvent, plugin->context);
+            error = "Too many plugins";
+        }
+        if (id == INVALID_EVENT_HANDLER) {
+            _stprintf_s(g_pluginError, _T("%s: %hs."), found.cFileName, error);
+            continue;
+        }
+        g_Plugins.push_back(std::move(library));
+        g_pluginHandlers.push_back(id);
+    } while (::FindNextFile(hFind, &found));
+    ::FindClose(hFind);
+}
+
+static void UnloadPlugins()
+{
+    for (size_t i = 0; i < g_pluginHandlers.size(); ++i) {
+        g_Controller.GetEventBus().Remove(g_pluginHandlers[i]);
+    }
+    g_pluginHandlers.clear();
+    g_Plugins.clear();
+}
+
+static BOOL StartKeymapWatcher()
+{
+    if (!g_keymapPath[0]) {
+        return FALSE;
+    }
+    g_hKeymapWatcherStop = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_hKeymapReload = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (g_hKeymapWatcherStop && g_hKeymapReload) {
+        g_hKeymapWatcher = ::CreateThread(NULL, 0, KeymapWatcherThread, NULL, 0, NULL);
+    }
+    if (!g_hKeymapWatcher) {
+        if (g_hKeymapWatcherStop) {
+            ::CloseHandle(g_hKeymapWatcherStop);
+        }
+        if (g_hKeymapReload) {
+            ::CloseHandle(g_hKeymapReload);
+        }
+        g_hKeymapWatcherStop = NULL;
+        g_hKeymapReload = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void StopKeymapWatcher()
+{
+    if (g_hKeymapWatcher) {
+        ::SetEvent(g_hKeymapWatcherStop);
+        ::WaitForSingleObject(g_hKeymapWatcher, INFINITE);
+        ::CloseHandle(g_hKeymapWatcher);
+        ::CloseHandle(g_hKeymapWatcherStop);
+        ::CloseHandle(g_hKeymapReload);
+        g_hKeymapWatcher = NULL;
+        g_hKeymapWatcherStop = NULL;
+        g_hKeymapReload = NULL;
+    }
+}
+
+static DWORD WINAPI KeymapWatcherThread(LPVOID parameter)
+{
+    UNREFERENCED_PARAMETER(parameter);
+
+    /* Watch the directory rather than the file, since many editors save by replacing it. */
+    TCHAR directory[MAX_PATH];
+    if (_tcscpy_s(directory, MAX_PATH, g_keymapPath) != 0) {
+        return 1;
+    }
+    TCHAR *name = _tcsrchr(directory, _T('\\'));
+    if (!name) {
+        return 1;
+    }
+    *name = _T('\0');
+    HANDLE hChange = ::FindFirstChangeNotification(directory, FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE);
+    if (hChange == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+
+    /* g_hKeymapReload asks for a reload straight away, changed or not. */
+    uint64_t lastModified = 0;
+    GetFileModificationTime(g_keymapPath, lastModified);
+    HANDLE handles[] = { g_hKeymapWatcherStop, hChange, g_hKeymapReload };
+    DWORD wake;
+    while ((wake = ::WaitForMultipleObjects(3, handles, FALSE, INFINITE)) != WAIT_OBJECT_0) {
+        if (wake == WAIT_FAILED) {
+            break;
+        }
+        BOOL requested = (wake == WAIT_OBJECT_0 + 2);
+
+        /* Let the change settle; a stop request still wins. */
+        BOOL stopping = FALSE;
+        while (!requested) {
+            ::FindNextChangeNotification(hChange);
+            DWORD wait = ::WaitForMultipleObjects(2, handles, FALSE, KEYMAP_SETTLE_TIME);
+            if (wait == WAIT_OBJECT_0) {
+                stopping = TRUE;
+            }
+            if (wait != WAIT_OBJECT_0 + 1) {
+                break;
+            }
+        }
+        if (stopping) {
+            break;
+        }
+
+        /* The directory changes for other reasons too (the image being saved, for one). */
+        uint64_t modified;
+        if (!GetFileModificationTime(g_keymapPath, modified) || ((modified == lastModified) && !requested)) {
+            continue;
+        }
+        lastModified = modified;
+
+        KeymapError error = {};
+        if (g_KeymapReloader.Reload(&error)) {
+            ::PostMessage(g_hWnd, WMAPP_KEYMAPRELOADED, 0, 0);
+        } else {
+            KeymapError *copy = new KeymapError(error);
+            if (!::PostMessage(g_hWnd, WMAPP_KEYMAPRELOADED, 0, reinterpret_cast<LPARAM>(copy))) {
+                delete copy;
+            }
+        }
+
+        /* The hook holds on to the old keymap for at most one keystroke. */
+        while ((g_KeymapPublisher.Reclaim() > 0) && (::WaitForSingleObject(g_hKeymapWatcherStop, 10) == WAIT_TIMEOUT)) {
+        }
+    }
+
+    ::FindCloseChangeNotification(hChange);
+    return 0;
+}
+
+static void ShowKeymapError(KeymapError const &error, LPCTSTR fallback)
+{
+    TCHAR message[160];
+    if (error.line) {
+        _stprintf_s(message, _T("Line %u: %hs. %s"), error.line, error.message, fallback);
+    } else {
+        _stprintf_s(message, _T("%hs. %s"), error.message, fallback);
+    }
+    ShowMessage(_T("Keymap error"), message, CNotificationIcon::ICON_WARNING | CNotificationIcon::RESPECT_QUIET_TIME);
+}
+
+static bool WakeForCompletions(void *context)
+{
+    /* On a worker thread. */
+    UNREFERENCED_PARAMETER(context);
+    return ::PostMessage(g_hWnd, WMAPP_ACTIONSDONE, 0, 0) != FALSE;
+}
+
+static void SubmitAction(uint16_t action)
+{
+    KeyEvent event = { ::GetTickCount(), action, 0, 0 };
+    g_Executor.Submit(event);
+}
+
+static void ProcessActionCompletions()
+{
+    ActionCompletion completion;
+    while (g_Executor.PopCompletion(completion)) {
+        switch (completion.event.action) {
+        case ACTION_SAVE_STATISTICS:
+            ShowStatistics(completion.status == 0);
+            break;
+
+        case ACTION_RUN_SCRIPT:
+            if (completion.status == SCRIPT_NOT_STARTED) {
+                ShowMessage(_T("Script error"), _T("Couldn't run CaptainHookLL.script.cmd."), CNotificationIcon::ICON_WARNING | CNotificationIcon::RESPECT_QUIET_TIME);
+            } else if (completion.status == SCRIPT_TIMED_OUT) {
+                ShowMessage(_T("Script error"), _T("CaptainHookLL.script.cmd is taking too long; no longer waiting for it."), CNotificationIcon::ICON_WARNING | CNotificationIcon::RESPECT_QUIET_TIME);
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+static void ShowStatistics(BOOL saved)
+{
+    /* A summary in a balloon; the statistics worker has already written everything to a
+       JSON file next to the executable for anything that wants the numbers. */
+    char summary[256];
+    g_Statistics.FormatSummary(summary, sizeof(summary));
+
+    TCHAR message[256];
+    _stprintf_s(message, _T("%hs"), summary);
+    if (!saved) {
+        _tcscat_s(message, _T("\n(Couldn't write the statistics file.)"));
+    }
+    ShowMessage(_T("Captain Hook statistics"), message, CNotificationIcon::ICON_INFO | CNotificationIcon::NO_SOUND);
+}
+
+static void ShowMessage(LPCTSTR title, LPCTSTR message, DWORD flags)
+{
+    /* A balloon, or headless, the debugger output (which DebugView and the like show). */
+    if (!g_headless) {
+        g_NotificationIcon.SetInfo(title, message, flags);
+        return;
+    }
+    TCHAR line[320];
+    _stprintf_s(line, _T("Captain Hook: %s: %s\n"), title, message);
+    ::OutputDebugString(line);
+}
+
+int CStatisticsWorker::RunAction(KeyEvent const &event)
+{
+    UNREFERENCED_PARAMETER(event);
+
+    /* The histograms are safe to read while the hook writes them. */
+    TCHAR path[MAX_PATH];
+    FILE *file = NULL;
+    if (!GetAppFilePath(path, MAX_PATH, g_statisticsFileName) || (_tfopen_s(&file, path, _T("w")) != 0)) {
+        return 1;
+    }
+    BOOL written = g_Statistics.WriteDump(file);
+    fclose(file);
+    return written ? 0 : 1;
+}
+
+int CScriptWorker::RunAction(KeyEvent const &event)
+{
+    TCHAR script[MAX_PATH];
+    if (!GetAppFilePath(script, MAX_PATH, g_scriptFileName)) {
+        return SCRIPT_NOT_STARTED;
+    }
+    TCHAR commandLine[MAX_PATH + 64];
+    _stprintf_s(commandLine, _T("cmd.exe /c \"\"%s\" %u %s\""), script, event.keycode,
+        (event.flags & KeyEvent::FLAG_DOWN) ? _T("press") : _T("release"));
+
+    STARTUPINFO startup = { sizeof(startup) };
+    startup.dwFlags = STARTF_USESHOWWINDOW;
+    startup.wShowWindow = SW_HIDE;
+    PROCESS_INFORMATION process;
+    if (!::CreateProcess(NULL, commandLine, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &startup, &process)) {
+        return SCRIPT_NOT_STARTED;
+    }
+    ::CloseHandle(process.hThread);
+
+    int status = SCRIPT_TIMED_OUT;
+    if (::WaitForSingleObject(process.hProcess, SCRIPT_TIMEOUT) == WAIT_OBJECT_0) {
+        DWORD exitCode = 0;
+        ::GetExitCodeProcess(process.hProcess, &exitCode);
+        status = static_cast<int>(exitCode);
+    }
+    ::CloseHandle(process.hProcess);
+    return status;
+}
+
+static void ProcessKeyEvents(HWND hWnd)
+{
+    g_KeyEngine.BeginDrain();
+
+    /* Keys the hook held back and then gave up on come out of the queue in the order they
+       were typed. Runs of them are re-injected with a single SendInput() call, so nothing
+       the user types in the meantime can land in the middle. */
+    KeyEvent replay[64];
+    UINT replayCount = 0;
+    KeyEvent event;
+    while (g_KeyEngine.PopEvent(event)) {
+        if (event.flags & KeyEvent::FLAG_REPLAY) {
+            if (replayCount == _countof(replay)) {
+                ReplayKeys(replay, replayCount);
+                replayCount = 0;
+            }
+            replay[replayCount++] = event;
+            continue;
+        }
+        ReplayKeys(replay, replayCount);
+        replayCount = 0;
+        uint64_t start = LatencyClockNow();
+        g_Controller.HandleKeyEvent(event, ::GetTickCount64());
+        g_Statistics.GetLatency(LATENCY_DISPATCH).RecordTicks(start);
+    }
+    ReplayKeys(replay, replayCount);
+
+    ScheduleSequenceTimeout(hWnd);
+}
+
+static void ReplayKeys(KeyEvent const *events, UINT count)
+{
+    if (count == 0) {
+        return;
+    }
+    INPUT inputs[64];
+    for (UINT i = 0; i < count; ++i) {
+        ZeroMemory(&inputs[i], sizeof(inputs[i]));
+        inputs[i].type = INPUT_KEYBOARD;
+        inputs[i].ki.wVk = events[i].keycode;
+        inputs[i].ki.dwFlags =
+            ((events[i].flags & KeyEvent::FLAG_DOWN) ? 0 : KEYEVENTF_KEYUP) |
+            ((events[i].flags & KeyEvent::FLAG_EXTENDED) ? KEYEVENTF_EXTENDEDKEY : 0);
+        /* Modifiers put back around the held keys go straight through the hook, like a
+           macro's, and aren't waited for. */
+        inputs[i].ki.dwExtraInfo = (events[i].flags & KeyEvent::FLAG_CONTEXT) ? OUTPUT_MARKER : REPLAY_MARKER;
+    }
+    UINT sent = ::SendInput(count, inputs, sizeof(INPUT));
+    if (sent < count) {
+        /* Context modifiers weren't counted as outstanding, so they aren't failed either. */
+        UINT failed = 0;
+        for (UINT i = sent; i < count; ++i) {
+            failed += (events[i].flags & KeyEvent::FLAG_CONTEXT) ? 0 : 1;
+        }
+        g_KeyEngine.ReplayFailed(failed);
+    }
+}
+
+size_t CSendInputSink::SendKeys(KeyEvent const *keys, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        ZeroMemory(&m_inputs[i], sizeof(m_inputs[i]));
+        m_inputs[i].type = INPUT_KEYBOARD;
+        m_inputs[i].ki.wVk = keys[i].keycode;
+        m_inputs[i].ki.dwFlags =
+            ((keys[i].flags & KeyEvent::FLAG_DOWN) ? 0 : KEYEVENTF_KEYUP) |
+            ((keys[i].flags & KeyEvent::FLAG_EXTENDED) ? KEYEVENTF_EXTENDEDKEY : 0);
+        m_inputs[i].ki.dwExtraInfo = OUTPUT_MARKER;
+    }
+    return ::SendInput(static_cast<UINT>(count), m_inputs, sizeof(INPUT));
+}
+
+static void ScheduleSequenceTimeout(HWND hWnd)
+{
+    /* While a sequence is in progress, make sure the engine hears about its deadline even
+       if no more keys arrive. This also covers any timers the actions have just set. */
+    g_Controller.ScheduleSequenceTimeout(::GetTickCount64());
+    ScheduleTimers(hWnd);
+}
+
+static void ScheduleTimers(HWND hWnd)
+{
+    /* Call after arming or cancelling timers. The OS timer is only touched when the next
+       deadline actually moves. */
+    ULONGLONG deadline = g_Timers.GetNextDeadline();
+    if (deadline == g_timerWheelDeadline) {
+        return;
+    }
+    g_timerWheelDeadline = deadline;
+    if (deadline == CTimerWheel::NO_DEADLINE) {
+        ::KillTimer(hWnd, IDT_TIMERWHEEL);
+        return;
+    }
+    ULONGLONG now = ::GetTickCount64();
+    ULONGLONG delay = (deadline > now) ? deadline - now : 0;
+    if (delay < USER_TIMER_MINIMUM) {
+        delay = USER_TIMER_MINIMUM;
+    } else if (delay > USER_TIMER_MAXIMUM) {
+        delay = USER_TIMER_MAXIMUM;
+    }
+    ::SetTimer(hWnd, IDT_TIMERWHEEL, static_cast<UINT>(delay), NULL);
+}
+
+static void RunControlPlane(HWND hWnd)
+{
+    unsigned command;
+    while (g_ControlPlane.PopCommand(command)) {
+        switch (command) {
+        case CONTROL_PAUSE:
+        case CONTROL_RESUME:
+            g_KeyEngine.SetPaused(command == CONTROL_PAUSE);
+            g_NotificationIcon.SetTooltipText((command == CONTROL_PAUSE) ? _T("Captain Hook (paused)") : _T("Captain Hook"));
+            break;
+
+        case CONTROL_RELOAD:
+            /* The watcher thread does the reloading, so that reloads never overlap. */
+            if (g_hKeymapReload) {
+                ::SetEvent(g_hKeymapReload);
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    ULONGLONG now = ::GetTickCount64();
+    ControlStats stats;
+    CControlPlane::Collect(stats, now, g_Statistics, g_KeyEngine, g_KeymapPublisher, &g_AppFocus);
+    bool changed = g_ControlPlane.Publish(stats);
+
+    /* Tickless, stop once there's nothing new; the hook or a client starts it again.
+       Without a wake for clients to signal, keep going regardless. */
+    if (g_tickless && !changed && g_hControlWait) {
+        g_Timers.Cancel(g_controlTimer);
+        g_controlTimer = INVALID_TIMER;
+    } else {
+        ULONGLONG deadline = now + CONTROL_INTERVAL;
+        if (!g_Timers.Rearm(g_controlTimer, deadline, CONTROL_SLACK)) {
+            g_controlTimer = g_Timers.Arm(deadline, OnControlTimer, NULL, CONTROL_SLACK);
+        }
+    }
+    ScheduleTimers(hWnd);
+}
+
+static void OnControlTimer(void *context, TimerHandle timer)
+{
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(timer);
+    RunControlPlane(g_hWnd);
+}
+
+static void ResumeControlPlane(HWND hWnd)
+{
+    if (g_ControlPlane.IsOpen()) {
+        g_controlTimer = g_Timers.Arm(::GetTickCount64() + CONTROL_INTERVAL, OnControlTimer, NULL, CONTROL_SLACK);
+        ScheduleTimers(hWnd);
+    }
+}
+
+static void CALLBACK OnControlWake(PVOID context, BOOLEAN timedOut)
+{
+    /* On a thread pool thread. */
+    UNREFERENCED_PARAMETER(context);
+    UNREFERENCED_PARAMETER(timedOut);
+    ::PostMessage(g_hWnd, WMAPP_CONTROLWAKE, 0, 0);
+}
+
+void CTrayFrontend::ShowIcon(unsigned icon)
+{
+    g_NotificationIcon.SetIcon(g_IconAtlas.Get(icon));
+}
+
+void CTrayFrontend::SubmitAction(KeyEvent const &event)
+{
+    g_Executor.Submit(event);
+}
+
+void CTrayFrontend::ProcessTimeout(uint32_t now)
+{
+    /* The hook runs on this thread too, so it's safe to drive the engine from here. */
+    g_KeyEngine.ProcessTimeout(now);
+    ProcessKeyEvents(g_hWnd);
 }
\ No newline at end of file
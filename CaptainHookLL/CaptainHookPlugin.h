@@ -0,0 +1,134 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stdint.h>
+
+/* The interface between Captain Hook and handler plugins: shared libraries (DLLs on
+   Windows) that handle the key events the key engine queues, alongside the app's own
+   actions. It's plain C so that a plugin can be built with any compiler, or in any
+   language with a C FFI, and keep working with later versions of the app.
+
+   A plugin exports CaptainHookPluginInit(), which the app calls once after loading it and
+   which describes the plugin: the keys it wants events for, where it comes relative to
+   other handlers, and the function that handles them. A minimal one, in C:
+
+       static int HandleEvent(void *context, CaptainHookEvent const *event)
+       {
+           // Consume F12, bound in the keymap to press=plugin.
+           return event->action == CAPTAINHOOK_ACTION_PLUGIN;
+       }
+
+       CAPTAINHOOK_PLUGIN_EXPORT CaptainHookPlugin const *CaptainHookPluginInit(uint32_t abiVersion)
+       {
+           static CaptainHookPlugin plugin = {
+               sizeof(CaptainHookPlugin), CAPTAINHOOK_PLUGIN_ABI_VERSION, "example", 10,
+               { 0 }, NULL, HandleEvent, NULL
+           };
+           CaptainHookPluginSetInterest(&plugin, 0x7B);
+           return (abiVersion >= CAPTAINHOOK_PLUGIN_ABI_VERSION) ? &plugin : NULL;
+       }
+
+   Events go to handlers in order of priority, highest first, and only to those interested
+   in the event's key. The app's own actions are a handler too, at
+   CAPTAINHOOK_PRIORITY_APP. The first handler to return non-zero consumes the event, and
+   no one after it sees it. Handlers run one event at a time on the thread that handles
+   the app's actions, so they must return promptly: work that takes a while belongs on a
+   thread of the plugin's own.
+
+   Structures only ever grow at the end, and size says how much of one there is. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CAPTAINHOOK_PLUGIN_ABI_VERSION 1
+
+/* Above the app's own priority, a plugin sees events before the app acts on them, and can
+   consume them so that it doesn't; below it, it sees only those the app leaves alone. */
+#define CAPTAINHOOK_PRIORITY_APP 0
+
+/* What keys bound to press=plugin (or release=plugin) send. The app leaves it alone. */
+#define CAPTAINHOOK_ACTION_PLUGIN 6
+
+/* CaptainHookEvent flags. */
+#define CAPTAINHOOK_EVENT_DOWN 0x01     /* pressed, not released */
+#define CAPTAINHOOK_EVENT_ALT 0x02      /* with Alt held */
+#define CAPTAINHOOK_EVENT_REPEAT 0x10   /* autorepeated */
+
+#ifdef _WIN32
+#define CAPTAINHOOK_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define CAPTAINHOOK_PLUGIN_EXPORT __attribute__((visibility("default")))
+#endif
+
+/* The name of the function every plugin exports, as a CaptainHookPluginInitFunction. */
+#define CAPTAINHOOK_PLUGIN_INIT "CaptainHookPluginInit"
+
+/* keycode is 0 for an event that no one key caused: an abbreviation typed, or a sequence
+   or chord matched. Only plugins interested in keycode 0 (bit 0 of interest[0]) see
+   those. */
+typedef struct CaptainHookEvent
+{
+    uint32_t time;      /* milliseconds */
+    uint16_t action;    /* keymap action */
+    uint8_t keycode;    /* Windows virtual key code; 0 for an abbreviation, sequence or chord */
+    uint8_t flags;      /* CAPTAINHOOK_EVENT_* */
+} CaptainHookEvent;
+
+/* Returns non-zero to consume the event. */
+typedef int (*CaptainHookHandler)(void *context, CaptainHookEvent const *event);
+
+typedef struct CaptainHookPlugin
+{
+    uint32_t size;              /* sizeof(CaptainHookPlugin) */
+    uint32_t abiVersion;        /* CAPTAINHOOK_PLUGIN_ABI_VERSION */
+    char const *name;
+    int32_t priority;
+    uint64_t interest[4];       /* bit (keycode & 63) of word (keycode >> 6) for each key */
+    void *context;              /* passed to the functions below */
+    CaptainHookHandler handleEvent;
+    void (*unload)(void *context);  /* called before the library is unloaded; may be NULL */
+} CaptainHookPlugin;
+
+/* Called once, right after loading, with the app's CAPTAINHOOK_PLUGIN_ABI_VERSION.
+   Returns the plugin, which must stay as it is until its unload is called, or NULL to be
+   unloaded again. */
+typedef CaptainHookPlugin const *(*CaptainHookPluginInitFunction)(uint32_t abiVersion);
+
+static inline void CaptainHookPluginSetInterest(CaptainHookPlugin *plugin, uint8_t keycode)
+{
+    plugin->interest[keycode >> 6] |= (uint64_t)1 << (keycode & 63);
+}
+
+#ifdef __cplusplus
+}
+#endif
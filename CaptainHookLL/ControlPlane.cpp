@@ -0,0 +1,289 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "ControlPlane.h"
+#include "KeyEngine.h"
+#include "KeymapPublisher.h"
+#include "ProcessMemory.h"
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include <thread>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+static_assert((ATOMIC_INT_LOCK_FREE == 2) && (ATOMIC_LLONG_LOCK_FREE == 2),
+    "The control plane shares atomics between processes, so they have to be lock-free");
+static_assert((CONTROL_RING_SIZE & (CONTROL_RING_SIZE - 1)) == 0, "CONTROL_RING_SIZE must be a power of two");
+
+void GetControlPlaneName(char *name, size_t size)
+{
+#ifdef _WIN32
+    snprintf(name, size, "Local\\CaptainHookLL.control");
+#else
+    snprintf(name, size, "/captainhook.%u.control", static_cast<unsigned>(getuid()));
+#endif
+}
+
+void GetControlWakeName(char const *name, char *wakeName, size_t size)
+{
+    snprintf(wakeName, size, "%s.wake", name);
+}
+
+CControlPlane::CControlPlane() :
+    m_segment(nullptr),
+    m_publishCount(0)
+{
+    memset(&m_published, 0, sizeof(m_published));
+}
+
+bool CControlPlane::Create(char const *name, uint64_t processId)
+{
+    Close();
+    if (!m_memory.Create(name, sizeof(ControlSegment))) {
+        return false;
+    }
+    // The memory is zero-filled, which is every field's starting value but the slots'.
+    ControlSegment *segment = new (m_memory.GetData()) ControlSegment;
+    segment->layoutVersion = CONTROL_LAYOUT_VERSION;
+    segment->segmentSize = sizeof(ControlSegment);
+    segment->statsSize = sizeof(ControlStats);
+    segment->processId = processId;
+    segment->statsSequence.store(0, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < CONTROL_STATS_WORDS; ++i) {
+        segment->stats[i].store(0, std::memory_order_relaxed);
+    }
+    segment->commandHead.store(0, std::memory_order_relaxed);
+    segment->commandTail.store(0, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < CONTROL_RING_SIZE; ++i) {
+        segment->commands[i].sequence.store(i, std::memory_order_relaxed);
+        segment->commands[i].command.store(CONTROL_NONE, std::memory_order_relaxed);
+    }
+    segment->magic.store(CONTROL_MAGIC, std::memory_order_release);
+    m_segment = segment;
+    m_publishCount = 0;
+    memset(&m_published, 0, sizeof(m_published));
+
+    char wakeName[80];
+    GetControlWakeName(name, wakeName, sizeof(wakeName));
+    m_wake.Create(wakeName);
+    return true;
+}
+
+void CControlPlane::Close()
+{
+    m_wake.Close();
+    m_segment = nullptr;
+    m_memory.Close();
+}
+
+bool CControlPlane::Publish(ControlStats &stats)
+{
+    if (!m_segment) {
+        return false;
+    }
+    stats.publishCount = ++m_publishCount;
+    stats.commandsDone = m_segment->commandTail.load(std::memory_order_relaxed);
+    uint64_t words[CONTROL_STATS_WORDS];
+    memcpy(words, &stats, sizeof(words));
+
+    // The release fence keeps the odd sequence number ahead of every word written after
+    // it, so a reader that sees any of the new words also sees that it was mid-publish.
+    uint32_t sequence = m_segment->statsSequence.load(std::memory_order_relaxed);
+    m_segment->statsSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < CONTROL_STATS_WORDS; ++i) {
+        m_segment->stats[i].store(words[i], std::memory_order_relaxed);
+    }
+    m_segment->statsSequence.store(sequence + 2, std::memory_order_release);
+
+    // Memory moves a little all the time, whatever the app is doing.
+    ControlStats previous = m_published;
+    m_published = stats;
+    previous.time = stats.time;
+    previous.publishCount = stats.publishCount;
+    previous.resident = stats.resident;
+    previous.privateBytes = stats.privateBytes;
+    previous.wakeups = stats.wakeups;
+    return memcmp(&previous, &stats, sizeof(stats)) != 0;
+}
+
+bool CControlPlane::PopCommand(unsigned &command)
+{
+    if (!m_segment) {
+        return false;
+    }
+    uint32_t tail = m_segment->commandTail.load(std::memory_order_relaxed);
+    ControlCommandSlot &slot = m_segment->commands[tail & (CONTROL_RING_SIZE - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != tail + 1) {
+        return false;
+    }
+    command = slot.command.load(std::memory_order_relaxed);
+    slot.sequence.store(tail + CONTROL_RING_SIZE, std::memory_order_release);
+    m_segment->commandTail.store(tail + 1, std::memory_order_relaxed);
+    return true;
+}
+
+void CControlPlane::Collect(ControlStats &stats, uint64_t now, CHookStatistics const &statistics,
+    CKeyEngine const &engine, CKeymapPublisher const &publisher, CAppFocus const *focus)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.time = now;
+    stats.paused = engine.IsPaused() ? 1 : 0;
+    stats.passed = statistics.GetPassedCount();
+    stats.swallowed = statistics.GetSwallowedCount();
+    stats.keymapVersion = publisher.GetVersion();
+    stats.keymapChanges = engine.GetKeymapChangeCount();
+    stats.profileSwitches = engine.GetProfileSwitchCount();
+    stats.sequences = engine.GetSequenceMatchCount();
+    stats.expansions = engine.GetExpansionCount();
+    stats.dropped = engine.GetDroppedCount();
+    stats.debounced = engine.GetDebouncedCount();
+    CTapHoldResolver const &tapHold = engine.GetTapHold();
+    stats.taps = tapHold.GetTapCount();
+    stats.holds = tapHold.GetHoldCount();
+    stats.heldBack = tapHold.GetDelayedCount();
+    stats.heldBackTotal = tapHold.GetTotalDelay();
+    stats.heldBackMax = tapHold.GetMaxDelay();
+    stats.startup = statistics.GetStartupTime();
+    stats.hookTime = statistics.GetHookTime();
+    ProcessMemory memory;
+    GetProcessMemory(memory);
+    stats.resident = memory.resident;
+    stats.privateBytes = memory.privateBytes;
+    stats.wakeups = statistics.GetWakeupCount();
+    CHookWatchdog const *watchdog = statistics.GetWatchdog();
+    if (watchdog) {
+        stats.nearBudget = watchdog->GetNearBudgetCount();
+        stats.overBudget = watchdog->GetOverrunCount();
+        stats.hookLost = watchdog->GetHookLostCount();
+    }
+    for (unsigned i = 0; i < LATENCY_COUNT; ++i) {
+        CLatencyHistogram const &histogram = statistics.GetLatency(i);
+        ControlLatency &latency = stats.latencies[i];
+        latency.count = histogram.GetCount();
+        latency.p50 = histogram.GetValueAtPercentile(50.0);
+        latency.p99 = histogram.GetValueAtPercentile(99.0);
+        latency.p999 = histogram.GetValueAtPercentile(99.9);
+        latency.max = histogram.GetMax();
+    }
+    AppIdentity const *app = focus ? focus->GetApplication() : nullptr;
+    if (app) {
+        memcpy(stats.application, app->name, sizeof(stats.application));
+    }
+}
+
+CControlClient::CControlClient() :
+    m_segment(nullptr)
+{
+    m_wakeName[0] = '\0';
+}
+
+bool CControlClient::Open(char const *name)
+{
+    Close();
+    if (!m_memory.Open(name, sizeof(ControlSegment))) {
+        return false;
+    }
+    ControlSegment *segment = static_cast<ControlSegment *>(m_memory.GetData());
+    if ((segment->magic.load(std::memory_order_acquire) != CONTROL_MAGIC) ||
+        (segment->layoutVersion != CONTROL_LAYOUT_VERSION) ||
+        (segment->segmentSize != sizeof(ControlSegment)) ||
+        (segment->statsSize != sizeof(ControlStats))) {
+        m_memory.Close();
+        return false;
+    }
+    m_segment = segment;
+    GetControlWakeName(name, m_wakeName, sizeof(m_wakeName));
+    return true;
+}
+
+void CControlClient::Close()
+{
+    m_segment = nullptr;
+    m_memory.Close();
+}
+
+bool CControlClient::Read(ControlStats &stats, unsigned *attempts) const
+{
+    uint64_t words[CONTROL_STATS_WORDS];
+    for (unsigned attempt = 1; attempt <= READ_ATTEMPTS; ++attempt) {
+        if (attempt > SPIN_ATTEMPTS) {
+            std::this_thread::yield();
+        }
+        uint32_t before = m_segment->statsSequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        for (size_t i = 0; i < CONTROL_STATS_WORDS; ++i) {
+            words[i] = m_segment->stats[i].load(std::memory_order_relaxed);
+        }
+        // Keeps the words read ahead of the second look at the sequence number.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_segment->statsSequence.load(std::memory_order_relaxed) == before) {
+            memcpy(&stats, words, sizeof(stats));
+            stats.application[sizeof(stats.application) - 1] = '\0';
+            if (attempts) {
+                *attempts = attempt;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CControlClient::Post(unsigned command, uint32_t &ticket)
+{
+    uint32_t head = m_segment->commandHead.load(std::memory_order_relaxed);
+    for (;;) {
+        ControlCommandSlot &slot = m_segment->commands[head & (CONTROL_RING_SIZE - 1)];
+        int32_t lag = static_cast<int32_t>(slot.sequence.load(std::memory_order_acquire) - head);
+        if (lag < 0) {
+            // The app hasn't taken the command a lap ago yet.
+            return false;
+        }
+        if (lag > 0) {
+            // Another client got this slot first.
+            head = m_segment->commandHead.load(std::memory_order_relaxed);
+        } else if (m_segment->commandHead.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) {
+            slot.command.store(command, std::memory_order_relaxed);
+            slot.sequence.store(head + 1, std::memory_order_release);
+            ticket = head + 1;
+            return true;
+        }
+    }
+}
+
+bool CControlClient::Wake()
+{
+    return CNamedWake::Signal(m_wakeName);
+}
@@ -0,0 +1,246 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "AppFocus.h"
+#include "HookStatistics.h"
+#include "NamedWake.h"
+#include "SharedMemory.h"
+
+class CKeyEngine;
+class CKeymapPublisher;
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable: 4324) // Structure was padded due to alignment specifier
+#endif
+
+/* The app's statistics and state, published in shared memory for monitoring tools, and
+   a way to send it commands, without going through its window (or signals).
+
+   The segment (ControlSegment) starts with a header that says which layout it has. The
+   app writes the header, and finally the magic number, before anything else is used;
+   readers check all of it and give up on any layout they don't know. Anything that
+   changes the layout changes CONTROL_LAYOUT_VERSION.
+
+   The statistics (ControlStats) are published under a seqlock: the app makes the
+   sequence number odd, writes the block and makes it even again, and a reader copies
+   the block and keeps the copy only if the sequence was the same even number before and
+   after. Readers never write to the segment, so any number of them can poll it without
+   slowing the app or each other; a read only has to be retried if it overlapped a
+   publish, which takes a fraction of a microsecond every CONTROL_INTERVAL ms.
+
+   An app that's been told to keep idle wakeups down (its tickless mode) only publishes
+   every CONTROL_INTERVAL while something is changing, and stops as soon as a publish
+   finds nothing new. Clients wake it with CControlClient::Wake() (through a CNamedWake
+   beside the segment) when they want fresh statistics or have posted a command, and it
+   runs the commands and publishes straight away.
+
+   Commands go the other way through a bounded ring (CONTROL_RING_SIZE slots, each with
+   its own sequence number) that any number of clients can post to without a lock and
+   the app drains. Each command gets a ticket, and ControlStats::commandsDone reaches it
+   once the app has acted on the command. A client that dies between claiming a slot and
+   filling it in holds up the commands behind it until the app restarts.
+
+   All of this relies on 32 and 64-bit atomics being lock-free, which they are on every
+   platform the app runs on. */
+static uint32_t const CONTROL_MAGIC = 0x4C4B4843;   // "CHKL"
+static uint32_t const CONTROL_LAYOUT_VERSION = 6;
+static uint32_t const CONTROL_RING_SIZE = 16;
+static uint64_t const CONTROL_INTERVAL = 100;      // ms between publishes
+static uint64_t const CONTROL_SLACK = 50;          // ms a publish may wait for other timers
+
+enum control_commands {
+    CONTROL_NONE,
+    CONTROL_PAUSE,      // Pass every key through untouched (see CKeyEngine::SetPaused()).
+    CONTROL_RESUME,
+    CONTROL_RELOAD,     // Reload the keymap file now.
+    CONTROL_COMMAND_COUNT
+};
+
+/* One of CHookStatistics's latencies, in nanoseconds. */
+struct ControlLatency
+{
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+/* What the app publishes. Only whole 64-bit words, so that it can be copied in and out
+   of the segment a word at a time. */
+struct ControlStats
+{
+    uint64_t time;              // The app's milliseconds when this was published.
+    uint64_t publishCount;
+    uint64_t paused;            // 1 while paused.
+    uint64_t commandsDone;      // Commands taken off the ring, i.e. the last ticket done.
+    uint64_t passed;            // Keys passed on to the system.
+    uint64_t swallowed;         // Keys swallowed.
+    uint64_t keymapVersion;     // Changes whenever a keymap is published.
+    uint64_t keymapChanges;     // Keymaps the hook has switched to.
+    uint64_t profileSwitches;   // Focus changes the hook has picked up.
+    uint64_t sequences;         // Sequences and chords completed.
+    uint64_t expansions;        // Abbreviations expanded.
+    uint64_t dropped;           // Key events lost to a full queue.
+    uint64_t nearBudget;        // Keys near and over the hook's budget (see
+    uint64_t overBudget;        // CHookWatchdog), and times the hook was lost.
+    uint64_t hookLost;
+    uint64_t debounced;         // Chattered presses swallowed by the debounce filter.
+    uint64_t taps;              // Dual-role keys settled as tapped and as held (see
+    uint64_t holds;             // CTapHoldResolver), key events they held back, and
+    uint64_t heldBack;          // how long those waited in all and at most (ms).
+    uint64_t heldBackTotal;
+    uint64_t heldBackMax;
+    uint64_t startup;           // ns from starting to the hook being in place,
+    uint64_t hookTime;          // and ns of that spent putting the hook in.
+    uint64_t resident;          // The app's memory in bytes (see GetProcessMemory()).
+    uint64_t privateBytes;
+    uint64_t wakeups;           // Times the app woke for anything but input.
+    ControlLatency latencies[LATENCY_COUNT];
+    char application[APP_NAME_LENGTH];  // The focused application, for its profile.
+};
+
+static size_t const CONTROL_STATS_WORDS = sizeof(ControlStats) / sizeof(uint64_t);
+static_assert(sizeof(ControlStats) % sizeof(uint64_t) == 0, "ControlStats must be whole words");
+
+struct ControlCommandSlot
+{
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> command;
+};
+
+/* The shared memory, as laid out for CONTROL_LAYOUT_VERSION. */
+struct ControlSegment
+{
+    std::atomic<uint32_t> magic;            // CONTROL_MAGIC, once the rest is ready
+    uint32_t layoutVersion;
+    uint32_t segmentSize;                   // sizeof(ControlSegment)
+    uint32_t statsSize;                     // sizeof(ControlStats)
+    uint64_t processId;                     // the app's
+
+    alignas(64) std::atomic<uint32_t> statsSequence;
+    std::atomic<uint64_t> stats[CONTROL_STATS_WORDS];
+
+    alignas(64) std::atomic<uint32_t> commandHead;  // commands claimed by clients
+    alignas(64) std::atomic<uint32_t> commandTail;  // commands taken by the app
+    ControlCommandSlot commands[CONTROL_RING_SIZE];
+};
+
+/* The segment's name for this user (and, on Windows, session). */
+void GetControlPlaneName(char *name, size_t size);
+
+/* The name of the wake beside the segment called name. */
+void GetControlWakeName(char const *name, char *wakeName, size_t size);
+
+/* The app's side: publishes the statistics and takes commands. Only one thread may use
+   it. */
+class CControlPlane
+{
+public:
+    CControlPlane();
+
+    /* The wake is optional: without one, clients can't wake the app, so it has to keep
+       publishing. */
+    bool Create(char const *name, uint64_t processId);
+    void Close();
+    bool IsOpen() const { return m_segment != nullptr; }
+
+    /* What clients signal with CControlClient::Wake(). The app waits on it and, when it
+       fires, pops the commands and publishes. */
+    CNamedWake &GetWake() { return m_wake; }
+
+    /* stats.publishCount and stats.commandsDone are filled in here. Returns true if
+       anything but the time, the memory figures and the wakeups differ from the last
+       publish. */
+    bool Publish(ControlStats &stats);
+
+    /* The next command posted, if any. It counts as done from the next Publish(). */
+    bool PopCommand(unsigned &command);
+
+    /* Everything but the commands, from the app's parts. The watchdog (see
+       CHookStatistics::SetWatchdog()) and focus are optional. */
+    static void Collect(ControlStats &stats, uint64_t now, CHookStatistics const &statistics,
+        CKeyEngine const &engine, CKeymapPublisher const &publisher, CAppFocus const *focus);
+
+private:
+    CSharedMemory m_memory;
+    CNamedWake m_wake;
+    ControlSegment *m_segment;
+    uint64_t m_publishCount;
+    ControlStats m_published;
+};
+
+/* A monitoring tool's side. Any number of clients, in any number of processes, may use
+   the same segment. */
+class CControlClient
+{
+public:
+    /* How often Read() tries before concluding that the app died mid-publish. After the
+       first SPIN_ATTEMPTS it yields between tries, in case the app was preempted
+       mid-publish. */
+    static unsigned const READ_ATTEMPTS = 10000;
+    static unsigned const SPIN_ATTEMPTS = 64;
+
+    CControlClient();
+
+    /* Fails if there's no such segment or it has a layout this client doesn't know. */
+    bool Open(char const *name);
+    void Close();
+    bool IsOpen() const { return m_segment != nullptr; }
+
+    uint64_t GetProcessId() const { return m_segment->processId; }
+
+    /* A consistent copy of the latest statistics. attempts, if given, gets how many
+       tries it took. */
+    bool Read(ControlStats &stats, unsigned *attempts = nullptr) const;
+
+    /* Returns false if the ring is full. */
+    bool Post(unsigned command, uint32_t &ticket);
+
+    /* Have the app run its commands and publish now, rather than at its next
+       CONTROL_INTERVAL, which an idle app may never have. Returns false if the app can't
+       be woken, and so publishes on its own. */
+    bool Wake();
+
+private:
+    CSharedMemory m_memory;
+    ControlSegment *m_segment;
+    char m_wakeName[80];
+};
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
@@ -0,0 +1,128 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "EventBus.h"
+#include <string.h>
+#include <algorithm>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static_assert(KeyEvent::FLAG_DOWN == CAPTAINHOOK_EVENT_DOWN, "KeyEvent flags are part of the plugin ABI");
+static_assert(KeyEvent::FLAG_SYSTEM == CAPTAINHOOK_EVENT_ALT, "KeyEvent flags are part of the plugin ABI");
+static_assert(KeyEvent::FLAG_REPEAT == CAPTAINHOOK_EVENT_REPEAT, "KeyEvent flags are part of the plugin ABI");
+
+namespace {
+
+unsigned LowestBit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctzll(value));
+#endif
+}
+
+} // namespace
+
+CEventBus::CEventBus() :
+    m_nextId(INVALID_EVENT_HANDLER + 1),
+    m_eventCount(0),
+    m_consumedCount(0)
+{
+    memset(m_keyHandlers, 0, sizeof(m_keyHandlers));
+    m_handlers.reserve(EVENTBUS_MAX_HANDLERS);
+}
+
+EventHandlerId CEventBus::Add(char const *name, int32_t priority, uint64_t const interest[4],
+    CaptainHookHandler handler, void *context)
+{
+    if (!handler || (m_handlers.size() >= EVENTBUS_MAX_HANDLERS)) {
+        return INVALID_EVENT_HANDLER;
+    }
+    Handler added;
+    added.id = m_nextId++;
+    added.name = name;
+    added.priority = priority;
+    memcpy(added.interest, interest, sizeof(added.interest));
+    added.handle = handler;
+    added.context = context;
+
+    // After every handler of the same priority or higher.
+    std::vector<Handler>::iterator position = std::find_if(m_handlers.begin(), m_handlers.end(),
+        [priority](Handler const &handler) { return handler.priority < priority; });
+    m_handlers.insert(position, added);
+    Rebuild();
+    return added.id;
+}
+
+void CEventBus::Remove(EventHandlerId id)
+{
+    std::vector<Handler>::iterator position = std::find_if(m_handlers.begin(), m_handlers.end(),
+        [id](Handler const &handler) { return handler.id == id; });
+    if (position != m_handlers.end()) {
+        m_handlers.erase(position);
+        Rebuild();
+    }
+}
+
+bool CEventBus::Deliver(KeyEvent const &event, uint64_t handlers)
+{
+    CaptainHookEvent delivered;
+    delivered.time = event.time;
+    delivered.action = event.action;
+    delivered.keycode = event.keycode;
+    delivered.flags = event.flags;
+    Handler const *table = m_handlers.data();
+    do {
+        Handler const &handler = table[LowestBit(handlers)];
+        if (handler.handle(handler.context, &delivered)) {
+            ++m_consumedCount;
+            return true;
+        }
+        handlers &= handlers - 1;
+    } while (handlers);
+    return false;
+}
+
+void CEventBus::Rebuild()
+{
+    memset(m_keyHandlers, 0, sizeof(m_keyHandlers));
+    for (size_t i = 0; i < m_handlers.size(); ++i) {
+        for (unsigned k = 0; k < 256; ++k) {
+            if ((m_handlers[i].interest[k >> 6] >> (k & 63)) & 1) {
+                m_keyHandlers[k] |= 1ull << i;
+            }
+        }
+    }
+}
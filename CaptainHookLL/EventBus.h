@@ -0,0 +1,107 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "CaptainHookPlugin.h"
+#include "KeyEvent.h"
+
+/* The most handlers a bus takes. */
+static unsigned const EVENTBUS_MAX_HANDLERS = 64;
+
+typedef unsigned EventHandlerId;
+static EventHandlerId const INVALID_EVENT_HANDLER = 0;
+
+/* Hands the key engine's action events to independent handlers: the app's own actions,
+   and built-in or plugin modules (see CaptainHookPlugin.h). Each handler has a priority
+   and the keys it's interested in, as a 256-bit mask of key codes. An event goes to the
+   interested handlers, highest priority first (in the order they were added, among equal
+   priorities), until one of them consumes it.
+
+   The masks are turned, whenever a handler comes or goes, into a word per key code with
+   a bit for each interested handler in priority order, so dispatching an event is one
+   load and then a call for each handler that wants it: handlers that don't care about a
+   key cost nothing on it.
+
+   Not thread safe: handlers are added, removed and dispatched to on the one thread that
+   handles the actions. A handler may not add or remove handlers while it's being called. */
+class CEventBus
+{
+public:
+    CEventBus();
+
+    /* Returns INVALID_EVENT_HANDLER if the bus is full. The name isn't copied. */
+    EventHandlerId Add(char const *name, int32_t priority, uint64_t const interest[4],
+        CaptainHookHandler handler, void *context);
+    void Remove(EventHandlerId id);
+
+    /* Returns true if a handler consumed the event. */
+    bool Dispatch(KeyEvent const &event)
+    {
+        ++m_eventCount;
+        uint64_t handlers = m_keyHandlers[event.keycode];
+        if (!handlers) {
+            return false;
+        }
+        return Deliver(event, handlers);
+    }
+
+    size_t GetHandlerCount() const { return m_handlers.size(); }
+
+    /* Events dispatched, and how many of them a handler consumed. */
+    uint64_t GetEventCount() const { return m_eventCount; }
+    uint64_t GetConsumedCount() const { return m_consumedCount; }
+
+private:
+    CEventBus(CEventBus const &) = delete;
+    CEventBus &operator=(CEventBus const &) = delete;
+
+    struct Handler
+    {
+        EventHandlerId id;
+        char const *name;
+        int32_t priority;
+        uint64_t interest[4];
+        CaptainHookHandler handle;
+        void *context;
+    };
+
+    bool Deliver(KeyEvent const &event, uint64_t handlers);
+    void Rebuild();
+
+    std::vector<Handler> m_handlers;    // highest priority first
+    uint64_t m_keyHandlers[256];        // bit n: m_handlers[n] wants the key
+    EventHandlerId m_nextId;
+    uint64_t m_eventCount;
+    uint64_t m_consumedCount;
+};
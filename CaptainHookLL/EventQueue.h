@@ -0,0 +1,138 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable: 4324) // Structure was padded due to alignment specifier
+#endif
+
+/* Bounded, lock-free, single-producer/single-consumer ring buffer.
+
+   The producer is the keyboard hook, which must never block, so Push() fails rather
+   than waits when the ring is full and the event is counted as dropped. The consumer
+   is the message loop thread. Each side caches the other side's index so that the
+   common case touches only its own cache line.
+
+   Capacity must be a power of two. */
+template <typename T, size_t Capacity>
+class CEventQueue
+{
+    static_assert((Capacity >= 2) && ((Capacity & (Capacity - 1)) == 0), "Capacity must be a power of two");
+
+public:
+    CEventQueue() :
+        m_head(0),
+        m_cachedTail(0),
+        m_pushedCount(0),
+        m_droppedCount(0),
+        m_highWaterMark(0),
+        m_tail(0),
+        m_cachedHead(0)
+    {
+    }
+
+    /* Producer only. Returns false, and counts the event as dropped, if the queue is full. */
+    bool Push(T const &item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t used = head - m_cachedTail;
+        if (used >= Capacity) {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            used = head - m_cachedTail;
+            if (used >= Capacity) {
+                m_droppedCount.store(m_droppedCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        m_items[head & (Capacity - 1)] = item;
+        m_head.store(head + 1, std::memory_order_release);
+
+        m_pushedCount.store(m_pushedCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (used + 1 > m_highWaterMark.load(std::memory_order_relaxed)) {
+            m_highWaterMark.store(static_cast<uint32_t>(used + 1), std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    /* Consumer only. Returns false if the queue is empty. */
+    bool Pop(T &item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_cachedHead) {
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+            if (tail == m_cachedHead) {
+                return false;
+            }
+        }
+        item = m_items[tail & (Capacity - 1)];
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Safe to call from either side; the answer may be stale by the time it is used. */
+    bool IsEmpty() const
+    {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+
+    size_t GetCapacity() const { return Capacity; }
+
+    /* Overflow counters. Written only by the producer, readable from any thread. */
+    uint32_t GetPushedCount() const { return m_pushedCount.load(std::memory_order_relaxed); }
+    uint32_t GetDroppedCount() const { return m_droppedCount.load(std::memory_order_relaxed); }
+    uint32_t GetHighWaterMark() const { return m_highWaterMark.load(std::memory_order_relaxed); }
+
+    CEventQueue(CEventQueue const &) = delete;
+    CEventQueue &operator=(CEventQueue const &) = delete;
+
+private:
+    // Producer side
+    alignas(64) std::atomic<size_t> m_head;
+    size_t m_cachedTail;
+    std::atomic<uint32_t> m_pushedCount;
+    std::atomic<uint32_t> m_droppedCount;
+    std::atomic<uint32_t> m_highWaterMark;
+
+    // Consumer side
+    alignas(64) std::atomic<size_t> m_tail;
+    size_t m_cachedHead;
+
+    alignas(64) T m_items[Capacity];
+};
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
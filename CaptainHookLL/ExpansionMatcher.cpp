@@ -0,0 +1,369 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "ExpansionMatcher.h"
+#include <string.h>
+#include <algorithm>
+
+namespace {
+
+struct Edge
+{
+    uint32_t from;
+    uint32_t to;
+    unsigned symbol;
+};
+
+} // namespace
+
+CExpansionTable::CExpansionTable()
+{
+    Clear();
+}
+
+void CExpansionTable::Clear()
+{
+    State root = { ROOT, 0, 0, 0 };
+    m_states.assign(1, root);
+    m_transitions.clear();
+    m_hashShift = 32;
+    for (unsigned i = 0; i < SYMBOLS; ++i) {
+        m_rootNext[i] = ROOT;
+    }
+    UseOwnData();
+}
+
+unsigned CExpansionTable::SymbolFromCharacter(char c)
+{
+    if ((c >= ' ') && (c <= '~')) {
+        return static_cast<unsigned>(c - ' ');
+    }
+    if (c == '\t') {
+        return SYMBOLS - 2;
+    }
+    if (c == '\n') {
+        return SYMBOLS - 1;
+    }
+    return NO_SYMBOL;
+}
+
+bool CExpansionTable::Compile(ExpansionBinding const *bindings, size_t count)
+{
+    Clear();
+
+    // Build the trie with an ordinary map first.
+    EdgeMap edges;
+    for (size_t i = 0; i < count; ++i) {
+        ExpansionBinding const &binding = bindings[i];
+        if ((binding.length == 0) || (binding.length > EXPANSION_MAX_LENGTH)) {
+            Clear();
+            return false;
+        }
+        uint32_t state = ROOT;
+        for (unsigned n = 0; n < binding.length; ++n) {
+            unsigned symbol = SymbolFromCharacter(binding.text[n]);
+            if (symbol == NO_SYMBOL) {
+                Clear();
+                return false;
+            }
+            uint32_t key = ((state << 7) | symbol) + 1;
+            EdgeMap::const_iterator edge = edges.find(key);
+            if (edge != edges.end()) {
+                state = edge->second;
+                continue;
+            }
+            // State numbers have to fit alongside a symbol in a 32-bit transition key.
+            if (m_states.size() >= (1u << 24)) {
+                Clear();
+                return false;
+            }
+            State newState = { ROOT, 0, static_cast<uint8_t>(n + 1), 0 };
+            m_states.push_back(newState);
+            state = static_cast<uint32_t>(m_states.size() - 1);
+            edges[key] = state;
+        }
+        m_states[state].action = binding.action;
+    }
+
+    // Work out the failure links breadth first, so that every state shallower than the
+    // one being linked is already done: the link from a state reached by symbol is where
+    // symbol leads from its parent's link, following links further back until it leads
+    // somewhere. Matches are inherited along the links at the same time.
+    std::vector<Edge> order;
+    order.reserve(edges.size());
+    for (EdgeMap::const_iterator edge = edges.begin(); edge != edges.end(); ++edge) {
+        Edge e = { (edge->first - 1) >> 7, edge->second, (edge->first - 1) & 127 };
+        order.push_back(e);
+    }
+    std::sort(order.begin(), order.end(), [this](Edge const &a, Edge const &b) {
+        return (m_states[a.to].depth != m_states[b.to].depth) ? (m_states[a.to].depth < m_states[b.to].depth) : (a.to < b.to);
+    });
+    for (size_t i = 0; i < order.size(); ++i) {
+        Edge const &e = order[i];
+        State &state = m_states[e.to];
+        if (e.from == ROOT) {
+            m_rootNext[e.symbol] = e.to;
+            state.fail = ROOT;
+        } else {
+            uint32_t fail = m_states[e.from].fail;
+            for (;;) {
+                EdgeMap::const_iterator edge = edges.find(((fail << 7) | e.symbol) + 1);
+                if (edge != edges.end()) {
+                    fail = edge->second;
+                    break;
+                }
+                if (fail == ROOT) {
+                    break;
+                }
+                fail = m_states[fail].fail;
+            }
+            state.fail = fail;
+        }
+        if (state.action == 0) {
+            state.action = m_states[state.fail].action;
+        }
+    }
+
+    // Lay the edges out in the flat table that lookups use. The root's are in m_rootNext.
+    size_t size = 16;
+    unsigned bits = 4;
+    while (size < edges.size() * 2) {
+        size *= 2;
+        ++bits;
+    }
+    m_hashShift = 32 - bits;
+    Transition empty = { 0, NO_STATE };
+    m_transitions.assign(size, empty);
+    for (EdgeMap::const_iterator edge = edges.begin(); edge != edges.end(); ++edge) {
+        if (((edge->first - 1) >> 7) == ROOT) {
+            continue;
+        }
+        uint32_t slot = Hash(edge->first, m_hashShift);
+        while (m_transitions[slot].key != 0) {
+            slot = (slot + 1) & static_cast<uint32_t>(size - 1);
+        }
+        m_transitions[slot].key = edge->first;
+        m_transitions[slot].next = edge->second;
+    }
+    UseOwnData();
+    return true;
+}
+
+void CExpansionTable::WriteImage(std::vector<uint8_t> &image) const
+{
+    image.resize((image.size() + 63) & ~static_cast<size_t>(63));
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.stateCount = m_stateCount;
+    header.transitionCount = m_transitionCount;
+    header.hashShift = m_hashShift;
+    memcpy(header.rootNext, m_rootNext, sizeof(header.rootNext));
+    uint8_t const *bytes = reinterpret_cast<uint8_t const *>(&header);
+    image.insert(image.end(), bytes, bytes + sizeof(header));
+    image.resize((image.size() + 7) & ~static_cast<size_t>(7));
+
+    bytes = reinterpret_cast<uint8_t const *>(m_stateData);
+    image.insert(image.end(), bytes, bytes + m_stateCount * sizeof(State));
+    image.resize((image.size() + 7) & ~static_cast<size_t>(7));
+    bytes = reinterpret_cast<uint8_t const *>(m_transitionData);
+    image.insert(image.end(), bytes, bytes + m_transitionCount * sizeof(Transition));
+}
+
+bool CExpansionTable::AttachImage(void const *data, size_t size)
+{
+    Clear();
+    if ((size < sizeof(ImageHeader)) || (reinterpret_cast<uintptr_t>(data) & 7)) {
+        return false;
+    }
+    ImageHeader const *header = static_cast<ImageHeader const *>(data);
+    uint8_t const *bytes = static_cast<uint8_t const *>(data);
+    size_t stateOffset = (sizeof(ImageHeader) + 7) & ~static_cast<size_t>(7);
+    size_t transitionOffset = (stateOffset + static_cast<size_t>(header->stateCount) * sizeof(State) + 7) & ~static_cast<size_t>(7);
+    if ((header->stateCount == 0) || (header->stateCount > (1u << 24)) || (transitionOffset > size) ||
+        (header->transitionCount > (size - transitionOffset) / sizeof(Transition))) {
+        return false;
+    }
+
+    // Lookups trust the table completely, so check everything they rely on: the hash
+    // table is a power of two in size with at least one empty slot (or absent), every
+    // transition goes one character deeper between real states, and every failure link
+    // leads to a shallower state, so that following them always ends at the root.
+    uint32_t transitionCount = header->transitionCount;
+    if (transitionCount != 0) {
+        unsigned bits = 0;
+        while ((1u << bits) < transitionCount) {
+            ++bits;
+        }
+        if (((1u << bits) != transitionCount) || (header->hashShift != 32 - bits)) {
+            return false;
+        }
+    }
+    State const *states = reinterpret_cast<State const *>(bytes + stateOffset);
+    if ((states[ROOT].depth != 0) || (states[ROOT].fail != ROOT)) {
+        return false;
+    }
+    for (uint32_t i = 1; i < header->stateCount; ++i) {
+        if ((states[i].depth == 0) || (states[i].depth > EXPANSION_MAX_LENGTH) ||
+            (states[i].fail >= header->stateCount) || (states[states[i].fail].depth >= states[i].depth)) {
+            return false;
+        }
+    }
+    for (unsigned i = 0; i < SYMBOLS; ++i) {
+        uint32_t next = header->rootNext[i];
+        if ((next >= header->stateCount) || ((next != ROOT) && (states[next].depth != 1))) {
+            return false;
+        }
+    }
+    Transition const *transitions = reinterpret_cast<Transition const *>(bytes + transitionOffset);
+    bool haveEmptySlot = false;
+    for (uint32_t i = 0; i < transitionCount; ++i) {
+        if (transitions[i].key == 0) {
+            haveEmptySlot = true;
+            continue;
+        }
+        uint32_t from = (transitions[i].key - 1) >> 7;
+        if ((from >= header->stateCount) || (((transitions[i].key - 1) & 127) >= SYMBOLS) ||
+            (transitions[i].next >= header->stateCount) || (states[transitions[i].next].depth != states[from].depth + 1)) {
+            return false;
+        }
+    }
+    if ((transitionCount != 0) && !haveEmptySlot) {
+        return false;
+    }
+
+    m_states.clear();
+    m_stateData = states;
+    m_stateCount = header->stateCount;
+    m_transitionData = transitions;
+    m_transitionCount = transitionCount;
+    m_hashShift = header->hashShift;
+    memcpy(m_rootNext, header->rootNext, sizeof(m_rootNext));
+    return true;
+}
+
+void CExpansionTable::UseOwnData()
+{
+    m_stateData = m_states.data();
+    m_stateCount = static_cast<uint32_t>(m_states.size());
+    m_transitionData = m_transitions.data();
+    m_transitionCount = static_cast<uint32_t>(m_transitions.size());
+}
+
+uint32_t CExpansionTable::Hash(uint32_t key, unsigned shift)
+{
+    return (key * 2654435761u) >> shift;
+}
+
+uint32_t CExpansionTable::Lookup(uint32_t state, unsigned symbol) const
+{
+    if (m_transitionCount == 0) {
+        return NO_STATE;
+    }
+    uint32_t key = ((state << 7) | symbol) + 1;
+    uint32_t mask = m_transitionCount - 1;
+    for (uint32_t slot = Hash(key, m_hashShift);; slot = (slot + 1) & mask) {
+        Transition const &transition = m_transitionData[slot];
+        if (transition.key == key) {
+            return transition.next;
+        }
+        if (transition.key == 0) {
+            return NO_STATE;
+        }
+    }
+}
+
+uint32_t CExpansionTable::Next(uint32_t state, char c) const
+{
+    unsigned symbol = SymbolFromCharacter(c);
+    if (symbol == NO_SYMBOL) {
+        return ROOT;
+    }
+    while (state != ROOT) {
+        uint32_t next = Lookup(state, symbol);
+        if (next != NO_STATE) {
+            return next;
+        }
+        state = m_stateData[state].fail;
+    }
+    return m_rootNext[symbol];
+}
+
+CExpansionMatcher::CExpansionMatcher() :
+    m_table(nullptr)
+{
+    Reset();
+}
+
+void CExpansionMatcher::SetTable(CExpansionTable const *table)
+{
+    m_table = (table && !table->IsEmpty()) ? table : nullptr;
+    Reset();
+}
+
+uint16_t CExpansionMatcher::Type(char c)
+{
+    if (!m_table) {
+        return 0;
+    }
+    m_history[m_historyEnd] = m_state;
+    m_historyEnd = (m_historyEnd + 1) % HISTORY;
+    if (m_historyCount < HISTORY) {
+        ++m_historyCount;
+    }
+
+    m_state = m_table->Next(m_state, c);
+    uint16_t action = m_table->GetAction(m_state);
+    if (action != 0) {
+        Reset();
+    }
+    return action;
+}
+
+void CExpansionMatcher::Erase()
+{
+    // Past the oldest state remembered, what's left of the text is unknown, and starting
+    // afresh can only miss a match, never make a wrong one.
+    if (m_historyCount == 0) {
+        m_state = CExpansionTable::ROOT;
+        return;
+    }
+    m_historyEnd = (m_historyEnd + HISTORY - 1) % HISTORY;
+    --m_historyCount;
+    m_state = m_history[m_historyEnd];
+}
+
+void CExpansionMatcher::Reset()
+{
+    m_state = CExpansionTable::ROOT;
+    m_historyEnd = 0;
+    m_historyCount = 0;
+}
@@ -0,0 +1,185 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+static unsigned const EXPANSION_MAX_LENGTH = 32;
+
+/* An abbreviation that, once typed, is replaced by what its action (a macro) types. The
+   abbreviation is printable ASCII, as typed on a US keyboard. */
+struct ExpansionBinding
+{
+    char text[EXPANSION_MAX_LENGTH];
+    uint8_t length;
+    uint16_t action;
+};
+
+/* All of a keymap's abbreviations compiled into an Aho-Corasick automaton: the trie of the
+   abbreviations, plus for each state a failure link to the state for the longest suffix
+   of its text that is also in the trie. Following the failure links on a miss means the
+   automaton never backs up in the input, so each typed character costs a hash probe or
+   two (amortized; never more than the longest abbreviation) whether there are ten
+   abbreviations or a hundred thousand. Each state also records the action of the longest
+   abbreviation that ends there, directly or along its failure links, so finding a match
+   is one more load.
+
+   As with CSequenceTable, transitions live in one open-addressed hash table keyed on
+   (state, character), the root's are a dense array, and the compiled table is plain data
+   that can be saved in a keymap image and used straight from it. Immutable once
+   compiled. */
+class CExpansionTable
+{
+public:
+    static uint32_t const ROOT = 0;
+    static uint32_t const NO_STATE = 0xFFFFFFFF;
+
+    // Tab, newline and the printable characters from ' ' to '~'.
+    static unsigned const SYMBOLS = 97;
+    static unsigned const NO_SYMBOL = 0xFF;
+
+    CExpansionTable();
+
+    // Moving keeps the vectors' buffers, so the data pointers stay valid.
+    CExpansionTable(CExpansionTable &&) = default;
+    CExpansionTable &operator=(CExpansionTable &&) = default;
+
+    void Clear();
+
+    /* Returns false if an abbreviation is empty, too long or has a character that can't be
+       typed, or if there are too many states. Where two abbreviations are the same, the
+       later one wins. */
+    bool Compile(ExpansionBinding const *bindings, size_t count);
+
+    /* Append the table to a keymap image, starting at a 64-byte boundary. */
+    void WriteImage(std::vector<uint8_t> &image) const;
+
+    /* Use a table written by WriteImage() in place, as CSequenceTable::AttachImage(). */
+    bool AttachImage(void const *data, size_t size);
+
+    bool IsEmpty() const { return m_stateCount <= 1; }
+    size_t GetStateCount() const { return m_stateCount; }
+
+    static unsigned SymbolFromCharacter(char c);
+
+    /* The state after typing c in state. */
+    uint32_t Next(uint32_t state, char c) const;
+
+    /* The action of the longest abbreviation that has just been typed in state, or 0. */
+    uint16_t GetAction(uint32_t state) const { return m_stateData[state].action; }
+
+private:
+    struct State
+    {
+        uint32_t fail;
+        uint16_t action;
+        uint8_t depth;
+        uint8_t reserved;
+    };
+
+    struct Transition
+    {
+        uint32_t key;   // (state << 7 | symbol) + 1, or 0 if the slot is empty
+        uint32_t next;
+    };
+
+    /* How the table starts in an image. The states follow, then (8-byte aligned) the
+       transitions. */
+    struct ImageHeader
+    {
+        uint32_t stateCount;
+        uint32_t transitionCount;
+        uint32_t hashShift;
+        uint32_t reserved;
+        uint32_t rootNext[SYMBOLS];
+    };
+
+    typedef std::unordered_map<uint32_t, uint32_t> EdgeMap;
+
+    CExpansionTable(CExpansionTable const &) = delete;
+    CExpansionTable &operator=(CExpansionTable const &) = delete;
+
+    static uint32_t Hash(uint32_t key, unsigned shift);
+    uint32_t Lookup(uint32_t state, unsigned symbol) const;
+    void UseOwnData();
+
+    // Lookups go through the data pointers, which point either at the vectors (for a
+    // table compiled here) or into an attached image.
+    State const *m_stateData;
+    uint32_t m_stateCount;
+    Transition const *m_transitionData;
+    uint32_t m_transitionCount;
+    unsigned m_hashShift;
+    uint32_t m_rootNext[SYMBOLS];
+
+    std::vector<State> m_states;
+    std::vector<Transition> m_transitions;
+};
+
+/* Runs a CExpansionTable over the characters the user types. Backspace steps back through
+   the last few states, so that fixing a typo mid-abbreviation still expands it; anything
+   that moves the caret or the focus should Reset() it. Not thread safe: it belongs to
+   whichever thread runs the hook. */
+class CExpansionMatcher
+{
+public:
+    static unsigned const HISTORY = 64;
+
+    CExpansionMatcher();
+
+    /* Switch tables (say, to a reloaded keymap's), forgetting what was typed. */
+    void SetTable(CExpansionTable const *table);
+
+    /* Feed a typed character. Returns the action of the abbreviation it completes, or 0.
+       After a match the matcher starts afresh, since the abbreviation is about to be
+       replaced. */
+    uint16_t Type(char c);
+
+    /* Undo the last character typed. */
+    void Erase();
+
+    /* Forget what was typed. */
+    void Reset();
+
+    bool IsPending() const { return m_state != CExpansionTable::ROOT; }
+
+private:
+    CExpansionTable const *m_table;
+    uint32_t m_state;
+
+    // The states before the last few characters, as a ring.
+    uint32_t m_history[HISTORY];
+    unsigned m_historyEnd;
+    unsigned m_historyCount;
+};
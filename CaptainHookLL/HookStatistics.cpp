@@ -0,0 +1,173 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "HookStatistics.h"
+#include "ProcessMemory.h"
+
+static char const *const s_latencyNames[LATENCY_COUNT] = {
+    "hook",
+    "dispatch",
+    "icon",
+};
+
+/* Formats a duration for people, e.g. "850ns", "12.4us" or "3.1ms". */
+static void FormatDuration(char *buffer, size_t size, uint64_t nanoseconds)
+{
+    if (nanoseconds < 1000) {
+        snprintf(buffer, size, "%uns", static_cast<unsigned>(nanoseconds));
+    } else if (nanoseconds < 1000000) {
+        snprintf(buffer, size, "%.1fus", static_cast<double>(nanoseconds) / 1e3);
+    } else {
+        snprintf(buffer, size, "%.1fms", static_cast<double>(nanoseconds) / 1e6);
+    }
+}
+
+CHookStatistics::CHookStatistics() :
+    m_watchdog(nullptr),
+    m_passedCount(0),
+    m_swallowedCount(0),
+    m_wakeupCount(0),
+    m_startupTime(0),
+    m_hookTime(0)
+{
+}
+
+char const *CHookStatistics::GetLatencyName(unsigned latency)
+{
+    return (latency < LATENCY_COUNT) ? s_latencyNames[latency] : "";
+}
+
+void CHookStatistics::CountKey(bool swallowed)
+{
+    std::atomic<uint64_t> &counter = swallowed ? m_swallowedCount : m_passedCount;
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void CHookStatistics::CountWakeup()
+{
+    m_wakeupCount.store(m_wakeupCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+bool CHookStatistics::FormatSummary(char *buffer, size_t size) const
+{
+    if (size == 0) {
+        return false;
+    }
+    size_t used = 0;
+    int written = snprintf(buffer, size, "Keys passed %llu, swallowed %llu\n",
+        static_cast<unsigned long long>(GetPassedCount()), static_cast<unsigned long long>(GetSwallowedCount()));
+    for (unsigned i = 0; (i < LATENCY_COUNT) && (written >= 0) && (used + written < size); ++i) {
+        used += written;
+        CLatencyHistogram const &latency = m_latencies[i];
+        char p50[16], p99[16], p999[16], max[16];
+        FormatDuration(p50, sizeof(p50), latency.GetValueAtPercentile(50.0));
+        FormatDuration(p99, sizeof(p99), latency.GetValueAtPercentile(99.0));
+        FormatDuration(p999, sizeof(p999), latency.GetValueAtPercentile(99.9));
+        FormatDuration(max, sizeof(max), latency.GetMax());
+        written = snprintf(buffer + used, size - used, "%s: p50 %s, p99 %s, p99.9 %s, max %s\n",
+            s_latencyNames[i], p50, p99, p999, max);
+    }
+    // Only worth the space in a balloon once the watchdog has had something to do.
+    if (m_watchdog && (written >= 0) && (used + written < size) &&
+        (m_watchdog->GetShedEpisodeCount() || m_watchdog->GetHookLostCount())) {
+        used += written;
+        written = snprintf(buffer + used, size - used, "Near budget %llu, over %llu, hook lost %llu\n",
+            static_cast<unsigned long long>(m_watchdog->GetNearBudgetCount()),
+            static_cast<unsigned long long>(m_watchdog->GetOverrunCount()),
+            static_cast<unsigned long long>(m_watchdog->GetHookLostCount()));
+    }
+    if ((written < 0) || (used + written >= size)) {
+        return false;
+    }
+
+    // No trailing newline.
+    used += written;
+    if (used > 0) {
+        buffer[used - 1] = '\0';
+    }
+    return true;
+}
+
+bool CHookStatistics::WriteDump(FILE *file) const
+{
+    ProcessMemory memory;
+    GetProcessMemory(memory);
+    fprintf(file, "{\"passed\":%llu,\"swallowed\":%llu,\"wakeups\":%llu,\"startup_ns\":%llu,\"hook_ns\":%llu,\"memory\":{\"resident\":%llu,\"private\":%llu},",
+        static_cast<unsigned long long>(GetPassedCount()), static_cast<unsigned long long>(GetSwallowedCount()),
+        static_cast<unsigned long long>(GetWakeupCount()), static_cast<unsigned long long>(GetStartupTime()),
+        static_cast<unsigned long long>(GetHookTime()), static_cast<unsigned long long>(memory.resident),
+        static_cast<unsigned long long>(memory.privateBytes));
+    if (m_watchdog) {
+        CHookWatchdog const &watchdog = *m_watchdog;
+        fprintf(file, "\"watchdog\":{\"budget_ms\":%u,\"callbacks\":%llu,\"worst_ns\":%llu,\"near_budget\":%llu,"
+            "\"overruns\":%llu,\"shed_episodes\":%llu,\"shed\":%llu,\"probes\":%llu,\"probes_failed\":%llu,"
+            "\"hook_lost\":%llu,\"registrations\":%llu,\"registrations_failed\":%llu},",
+            static_cast<unsigned>(watchdog.GetBudget()),
+            static_cast<unsigned long long>(watchdog.GetCallbackCount()),
+            static_cast<unsigned long long>(watchdog.GetWorstCallback()),
+            static_cast<unsigned long long>(watchdog.GetNearBudgetCount()),
+            static_cast<unsigned long long>(watchdog.GetOverrunCount()),
+            static_cast<unsigned long long>(watchdog.GetShedEpisodeCount()),
+            static_cast<unsigned long long>(watchdog.GetShedCount()),
+            static_cast<unsigned long long>(watchdog.GetProbeCount()),
+            static_cast<unsigned long long>(watchdog.GetProbeFailedCount()),
+            static_cast<unsigned long long>(watchdog.GetHookLostCount()),
+            static_cast<unsigned long long>(watchdog.GetRegistrationCount()),
+            static_cast<unsigned long long>(watchdog.GetRegistrationFailedCount()));
+    }
+    fprintf(file, "\"latency_ns\":{");
+    for (unsigned i = 0; i < LATENCY_COUNT; ++i) {
+        CLatencyHistogram const &latency = m_latencies[i];
+        fprintf(file, "%s\"%s\":{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,\"p99\":%llu,\"p99.9\":%llu,\"max\":%llu,\"buckets\":[",
+            (i > 0) ? "," : "", s_latencyNames[i],
+            static_cast<unsigned long long>(latency.GetCount()),
+            static_cast<unsigned long long>(latency.GetMean()),
+            static_cast<unsigned long long>(latency.GetValueAtPercentile(50.0)),
+            static_cast<unsigned long long>(latency.GetValueAtPercentile(99.0)),
+            static_cast<unsigned long long>(latency.GetValueAtPercentile(99.9)),
+            static_cast<unsigned long long>(latency.GetMax()));
+        bool first = true;
+        for (unsigned bucket = 0; bucket < CLatencyHistogram::BUCKET_COUNT; ++bucket) {
+            uint32_t count = latency.GetBucketCount(bucket);
+            if (count == 0) {
+                continue;
+            }
+            fprintf(file, "%s[%llu,%llu,%u]", first ? "" : ",",
+                static_cast<unsigned long long>(CLatencyHistogram::GetBucketLowest(bucket)),
+                static_cast<unsigned long long>(CLatencyHistogram::GetBucketHighest(bucket)),
+                static_cast<unsigned>(count));
+            first = false;
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "}}\n");
+    return (fflush(file) == 0) && !ferror(file);
+}
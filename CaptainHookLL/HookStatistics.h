@@ -0,0 +1,101 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include "HookWatchdog.h"
+#include "LatencyHistogram.h"
+
+/* The timings the app keeps, all in nanoseconds. */
+enum hook_latencies {
+    LATENCY_HOOK,       // The OS hook callback, from entry to return: how long each key is held up.
+    LATENCY_DISPATCH,   // Running one queued key event's action.
+    LATENCY_ICON,       // Each notification icon update that reaches the shell.
+    LATENCY_COUNT
+};
+
+/* Always-on statistics for the keyboard hook: latency histograms plus counts of the keys
+   passed on and swallowed. The hook's thread records; anything may read. */
+class CHookStatistics
+{
+public:
+    CHookStatistics();
+
+    /* Report the watchdog's counts along with everything else. */
+    void SetWatchdog(CHookWatchdog const *watchdog) { m_watchdog = watchdog; }
+    CHookWatchdog const *GetWatchdog() const { return m_watchdog; }
+
+    CLatencyHistogram &GetLatency(unsigned latency) { return m_latencies[latency]; }
+    CLatencyHistogram const &GetLatency(unsigned latency) const { return m_latencies[latency]; }
+    static char const *GetLatencyName(unsigned latency);
+
+    /* Only from the hook's thread. */
+    void CountKey(bool swallowed);
+
+    uint64_t GetPassedCount() const { return m_passedCount.load(std::memory_order_relaxed); }
+    uint64_t GetSwallowedCount() const { return m_swallowedCount.load(std::memory_order_relaxed); }
+
+    /* Only from the app's main loop, each time it wakes for anything but input: a timer, a
+       completion, a command. An idle app shouldn't count any. */
+    void CountWakeup();
+    uint64_t GetWakeupCount() const { return m_wakeupCount.load(std::memory_order_relaxed); }
+
+    /* How long the app took from starting to having its hook in place (0 until it has),
+       and how much of that went on putting the hook in itself. The hook goes in last, so
+       the rest is loading the keymap, the plugins and the window. */
+    void SetStartupTime(uint64_t nanoseconds) { m_startupTime.store(nanoseconds, std::memory_order_relaxed); }
+    uint64_t GetStartupTime() const { return m_startupTime.load(std::memory_order_relaxed); }
+    void SetHookTime(uint64_t nanoseconds) { m_hookTime.store(nanoseconds, std::memory_order_relaxed); }
+    uint64_t GetHookTime() const { return m_hookTime.load(std::memory_order_relaxed); }
+
+    /* A few lines for people (e.g. a notification balloon, which holds 255 characters).
+       Returns false if it was truncated. */
+    bool FormatSummary(char *buffer, size_t size) const;
+
+    /* Everything, as a single JSON object, for tools: the counts, the startup and hook
+       times, the process's memory (see GetProcessMemory()), the watchdog's counts (if
+       there's one) and, for each latency, its count, mean, p50, p99, p99.9 and max, and
+       the non-empty buckets of its histogram as [lowest, highest, count] triples. Returns
+       false if the write failed. */
+    bool WriteDump(FILE *file) const;
+
+private:
+    CHookWatchdog const *m_watchdog;
+    CLatencyHistogram m_latencies[LATENCY_COUNT];
+    std::atomic<uint64_t> m_passedCount;
+    std::atomic<uint64_t> m_swallowedCount;
+    std::atomic<uint64_t> m_wakeupCount;
+    std::atomic<uint64_t> m_startupTime;
+    std::atomic<uint64_t> m_hookTime;
+};
@@ -0,0 +1,192 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "HookWatchdog.h"
+
+// Waits longer than this mean the key's timestamp isn't on our clock after all.
+static uint32_t const MAX_PLAUSIBLE_WAIT = 60000;
+
+CHookWatchdog::CHookWatchdog() :
+    m_shedUntil(0),
+    m_lastCallback(0),
+    m_probeWanted(false),
+    m_probeArrived(false),
+    m_parked(false),
+    m_probeSent(NO_DEADLINE),
+    m_lastProbe(0),
+    m_lastAnswered(0),
+    m_idleProbing(true),
+    m_callbackCount(0),
+    m_nearBudgetCount(0),
+    m_overrunCount(0),
+    m_shedEpisodeCount(0),
+    m_shedCount(0),
+    m_probeCount(0),
+    m_probeFailedCount(0),
+    m_hookLostCount(0),
+    m_registrationCount(0),
+    m_registrationFailedCount(0),
+    m_worstCallback(0)
+{
+    SetBudget(DEFAULT_BUDGET);
+}
+
+void CHookWatchdog::SetBudget(uint32_t milliseconds)
+{
+    m_budget = milliseconds ? milliseconds : DEFAULT_BUDGET;
+    m_budgetNanoseconds = static_cast<uint64_t>(m_budget) * 1000000;
+    m_shedNanoseconds = m_budgetNanoseconds * SHED_PERCENT / 100;
+}
+
+bool CHookWatchdog::RecordCallback(uint64_t now, uint32_t eventTime, uint64_t handlerNanoseconds)
+{
+    uint32_t wait = static_cast<uint32_t>(now) - eventTime;
+    if (wait > MAX_PLAUSIBLE_WAIT) {
+        wait = 0;
+    }
+    uint64_t cost = static_cast<uint64_t>(wait) * 1000000 + handlerNanoseconds;
+
+    Increment(m_callbackCount);
+    m_lastCallback.store(now, std::memory_order_relaxed);
+    if (cost > m_worstCallback.load(std::memory_order_relaxed)) {
+        m_worstCallback.store(cost, std::memory_order_relaxed);
+    }
+    bool unpark = m_parked.load(std::memory_order_relaxed);
+    if (unpark) {
+        m_parked.store(false, std::memory_order_relaxed);
+    }
+    if (cost < m_shedNanoseconds) {
+        return unpark;
+    }
+
+    bool overrun = (cost >= m_budgetNanoseconds);
+    if (!overrun) {
+        Increment(m_nearBudgetCount);
+    } else {
+        // Windows may have taken the hook away already; find out now rather than after
+        // PROBE_INTERVAL of missed keys.
+        Increment(m_overrunCount);
+        m_probeWanted.store(true, std::memory_order_relaxed);
+    }
+    if (!IsShedding(now)) {
+        Increment(m_shedEpisodeCount);
+    }
+    m_shedUntil.store(now + SHED_HOLD, std::memory_order_relaxed);
+    return overrun || unpark;
+}
+
+void CHookWatchdog::ProbeReceived()
+{
+    m_probeArrived.store(true, std::memory_order_release);
+}
+
+bool CHookWatchdog::RequestProbe()
+{
+    if (!m_parked.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    m_parked.store(false, std::memory_order_relaxed);
+    m_probeWanted.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+unsigned CHookWatchdog::Poll(uint64_t now)
+{
+    if (m_probeSent != NO_DEADLINE) {
+        if (m_probeArrived.exchange(false, std::memory_order_acquire)) {
+            m_probeSent = NO_DEADLINE;
+            m_lastAnswered = now;
+        } else if (now >= m_probeSent + GetProbeTimeout()) {
+            m_probeSent = NO_DEADLINE;
+            Increment(m_hookLostCount);
+            return POLL_HOOK_LOST;
+        } else {
+            return POLL_IDLE;
+        }
+    }
+
+    uint64_t lastCallback = m_lastCallback.load(std::memory_order_relaxed);
+    uint64_t quietSince = (lastCallback > m_lastProbe) ? lastCallback : m_lastProbe;
+    bool answered = !m_idleProbing && (lastCallback <= m_lastAnswered);
+    if (m_probeWanted.load(std::memory_order_relaxed) || (!answered && (now >= quietSince + PROBE_INTERVAL))) {
+        m_probeArrived.store(false, std::memory_order_relaxed);
+        return POLL_SEND_PROBE;
+    }
+    // The probe has been answered since the last callback, so only another callback (or
+    // RequestProbe()) can make a probe worth sending.
+    m_parked.store(answered, std::memory_order_relaxed);
+    return POLL_IDLE;
+}
+
+void CHookWatchdog::ProbeSent(uint64_t now, bool sent)
+{
+    m_probeWanted.store(false, std::memory_order_relaxed);
+    m_lastProbe = now;
+    if (sent) {
+        m_probeSent = now;
+        Increment(m_probeCount);
+    } else {
+        // Typically UIPI: the focus is on a window that outranks us. That says nothing
+        // about the hook, so just try again after the next interval.
+        Increment(m_probeFailedCount);
+    }
+}
+
+void CHookWatchdog::HookRegistered(uint64_t now, bool registered)
+{
+    Increment(registered ? m_registrationCount : m_registrationFailedCount);
+    // Check straight away that the new hook is getting keys.
+    m_lastProbe = now;
+    m_probeWanted.store(true, std::memory_order_relaxed);
+}
+
+uint64_t CHookWatchdog::GetNextDeadline() const
+{
+    if (m_probeSent != NO_DEADLINE) {
+        return m_probeSent + GetProbeTimeout();
+    }
+    if (m_probeWanted.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+    uint64_t lastCallback = m_lastCallback.load(std::memory_order_relaxed);
+    if (!m_idleProbing && (lastCallback <= m_lastAnswered)) {
+        return NO_DEADLINE;
+    }
+    uint64_t quietSince = (lastCallback > m_lastProbe) ? lastCallback : m_lastProbe;
+    return quietSince + PROBE_INTERVAL;
+}
+
+uint64_t CHookWatchdog::GetProbeTimeout() const
+{
+    // Long enough for a hook that's merely slow (and so still there) to get to the probe.
+    uint64_t timeout = static_cast<uint64_t>(m_budget) * 2;
+    return (timeout < 1000) ? 1000 : timeout;
+}
@@ -0,0 +1,176 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+/* Keeps the keyboard hook inside its time budget and notices when it's gone.
+
+   Windows silently removes a WH_KEYBOARD_LL hook whose callback takes longer than
+   LowLevelHooksTimeout, and the time it counts starts when the key is typed, not when the
+   callback is entered: a message loop busy with something else uses up the budget before
+   the hook has even started. So the hook reports each callback with the key's own
+   timestamp and how long the callback itself took, and the two together are checked
+   against the budget:
+
+     - past SHED_PERCENT of it, the app sheds non-essential work on the hook's thread (icon
+       updates, say) until no callback has come near the budget for SHED_HOLD ms
+     - past all of it, the hook may well have been removed, so a probe is due at once
+
+   The heartbeat is a probe: a key event injected with a marker of its own, which the hook
+   swallows and reports with ProbeReceived(). Probes are only sent once the hook has been
+   quiet for PROBE_INTERVAL ms (or straight after an overrun), since a hook that's getting
+   keys is evidently still there. If one hasn't come back after GetProbeTimeout() ms, the
+   hook is taken to be lost and the app registers it again.
+
+   Probing a hook that stays quiet every PROBE_INTERVAL wakes an idle app for nothing but
+   the probe, so with SetIdleProbing(false) the watchdog probes once after each spell of
+   callbacks and then parks, with no deadline at all, until the next callback. Windows
+   only takes a hook away over a callback that's too slow, and a slow callback still runs,
+   late, and is reported as an overrun, so that single probe only misses losses with no
+   callback behind them at all; RequestProbe() catches those at the next sign of life from
+   the user that doesn't come through the hook (the focus moving, say).
+
+   Nothing here reads a clock or touches an OS API: times are the app's milliseconds, whose
+   low 32 bits must be the clock key events are stamped with. RecordCallback() and
+   ProbeReceived() are called by the hook; Poll() and the rest by the thread that sends
+   probes and re-registers the hook, which on Windows is the same one. Only the counters
+   (and IsShedding()) may be read from other threads. */
+class CHookWatchdog
+{
+public:
+    static uint32_t const DEFAULT_BUDGET = 300;     // ms, where the OS doesn't say
+    static uint32_t const SHED_PERCENT = 50;
+    static uint64_t const SHED_HOLD = 2000;         // ms
+    static uint64_t const PROBE_INTERVAL = 5000;    // ms
+    static uint64_t const NO_DEADLINE = ~0ull;
+
+    enum PollResult {
+        POLL_IDLE,          // Nothing to do until GetNextDeadline().
+        POLL_SEND_PROBE,    // Inject a probe now, then call ProbeSent().
+        POLL_HOOK_LOST,     // The last probe never arrived: register the hook again, then
+                            // call HookRegistered().
+    };
+
+    CHookWatchdog();
+
+    /* The hook's budget in milliseconds (LowLevelHooksTimeout). */
+    void SetBudget(uint32_t milliseconds);
+    uint32_t GetBudget() const { return m_budget; }
+
+    /* From the hook, for every callback: now on the app's clock, eventTime the key's own
+       timestamp and handlerNanoseconds the time spent in the callback. Returns true if
+       Poll() should be called as soon as possible: the callback overran, or it's the first
+       since the watchdog parked, which has no deadline to call Poll() at otherwise. */
+    bool RecordCallback(uint64_t now, uint32_t eventTime, uint64_t handlerNanoseconds);
+
+    /* From the hook, when it sees a probe. */
+    void ProbeReceived();
+
+    /* Whether to skip non-essential work at now. */
+    bool IsShedding(uint64_t now) const { return now < m_shedUntil.load(std::memory_order_relaxed); }
+    uint64_t GetShedEnd() const { return m_shedUntil.load(std::memory_order_relaxed); }
+
+    /* Count a piece of work skipped because of IsShedding(). */
+    void CountShed() { Increment(m_shedCount); }
+
+    /* Whether to keep probing a hook that stays quiet, every PROBE_INTERVAL (the default),
+       or park once a probe has found it after the last callback. */
+    void SetIdleProbing(bool probing) { m_idleProbing = probing; }
+    bool IsParked() const { return m_parked.load(std::memory_order_relaxed); }
+
+    /* From Poll()'s thread, when something says the user is about: if the watchdog is
+       parked, probe at the next Poll(). Returns true if Poll() should be called now. */
+    bool RequestProbe();
+
+    /* Returns a PollResult: what to do about the hook at now. */
+    unsigned Poll(uint64_t now);
+
+    /* After POLL_SEND_PROBE, with whether the probe could be injected at all. */
+    void ProbeSent(uint64_t now, bool sent);
+
+    /* After POLL_HOOK_LOST, once the hook has been registered again (or not). */
+    void HookRegistered(uint64_t now, bool registered);
+
+    /* When Poll() next needs calling, or NO_DEADLINE. */
+    uint64_t GetNextDeadline() const;
+    uint64_t GetProbeTimeout() const;
+
+    uint64_t GetCallbackCount() const { return m_callbackCount.load(std::memory_order_relaxed); }
+    uint64_t GetNearBudgetCount() const { return m_nearBudgetCount.load(std::memory_order_relaxed); }
+    uint64_t GetOverrunCount() const { return m_overrunCount.load(std::memory_order_relaxed); }
+    uint64_t GetShedEpisodeCount() const { return m_shedEpisodeCount.load(std::memory_order_relaxed); }
+    uint64_t GetShedCount() const { return m_shedCount.load(std::memory_order_relaxed); }
+    uint64_t GetProbeCount() const { return m_probeCount.load(std::memory_order_relaxed); }
+    uint64_t GetProbeFailedCount() const { return m_probeFailedCount.load(std::memory_order_relaxed); }
+    uint64_t GetHookLostCount() const { return m_hookLostCount.load(std::memory_order_relaxed); }
+    uint64_t GetRegistrationCount() const { return m_registrationCount.load(std::memory_order_relaxed); }
+    uint64_t GetRegistrationFailedCount() const { return m_registrationFailedCount.load(std::memory_order_relaxed); }
+    /* The worst callback so far, in nanoseconds, counting the wait before it. */
+    uint64_t GetWorstCallback() const { return m_worstCallback.load(std::memory_order_relaxed); }
+
+private:
+    // Each counter has one writer; see CHookStatistics::CountKey().
+    static void Increment(std::atomic<uint64_t> &counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    uint32_t m_budget;
+    uint64_t m_budgetNanoseconds;
+    uint64_t m_shedNanoseconds;
+
+    // Written by the hook (m_probeWanted and m_probeArrived by Poll()'s thread too).
+    std::atomic<uint64_t> m_shedUntil;
+    std::atomic<uint64_t> m_lastCallback;
+    std::atomic<bool> m_probeWanted;
+    std::atomic<bool> m_probeArrived;
+    std::atomic<bool> m_parked;         // set by Poll(), cleared by the next callback
+
+    // Written by Poll()'s thread.
+    uint64_t m_probeSent;   // NO_DEADLINE if no probe is out
+    uint64_t m_lastProbe;
+    uint64_t m_lastAnswered;    // when a probe was last seen to have arrived
+    bool m_idleProbing;
+
+    std::atomic<uint64_t> m_callbackCount;
+    std::atomic<uint64_t> m_nearBudgetCount;
+    std::atomic<uint64_t> m_overrunCount;
+    std::atomic<uint64_t> m_shedEpisodeCount;
+    std::atomic<uint64_t> m_shedCount;
+    std::atomic<uint64_t> m_probeCount;
+    std::atomic<uint64_t> m_probeFailedCount;
+    std::atomic<uint64_t> m_hookLostCount;
+    std::atomic<uint64_t> m_registrationCount;
+    std::atomic<uint64_t> m_registrationFailedCount;
+    std::atomic<uint64_t> m_worstCallback;
+};
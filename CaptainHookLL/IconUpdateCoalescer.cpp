@@ -0,0 +1,110 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "IconUpdateCoalescer.h"
+
+CIconUpdateCoalescer::CIconUpdateCoalescer(IIconBackend &backend, uint32_t frameInterval) :
+    m_backend(backend),
+    m_frameInterval(frameInterval),
+    m_shownIcon(0),
+    m_pendingIcon(0),
+    m_lastUpdateTime(0),
+    m_haveUpdated(false),
+    m_requestCount(0),
+    m_redundantCount(0),
+    m_coalescedCount(0),
+    m_updateCount(0)
+{
+}
+
+bool CIconUpdateCoalescer::SetIcon(uintptr_t icon, uint32_t now)
+{
+    ++m_requestCount;
+    if (icon == m_pendingIcon) {
+        ++m_redundantCount;
+        return IsPending();
+    }
+
+    // Anything still waiting is replaced, even if this request cancels it out entirely by
+    // asking for the icon that's already shown.
+    if (IsPending()) {
+        ++m_coalescedCount;
+    }
+    m_pendingIcon = icon;
+    if (!IsPending()) {
+        return false;
+    }
+
+    if (GetFlushDelay(now) == 0) {
+        Apply(now);
+    }
+    return IsPending();
+}
+
+bool CIconUpdateCoalescer::Flush(uint32_t now)
+{
+    if (IsPending() && (GetFlushDelay(now) == 0)) {
+        Apply(now);
+    }
+    return IsPending();
+}
+
+uint32_t CIconUpdateCoalescer::GetFlushDelay(uint32_t now) const
+{
+    if (!IsPending()) {
+        return NO_FLUSH_PENDING;
+    }
+    if (!m_haveUpdated) {
+        return 0;
+    }
+    uint32_t elapsed = now - m_lastUpdateTime;
+    return (elapsed >= m_frameInterval) ? 0 : m_frameInterval - elapsed;
+}
+
+void CIconUpdateCoalescer::SetShownIcon(uintptr_t icon)
+{
+    m_shownIcon = icon;
+    m_pendingIcon = icon;
+}
+
+bool CIconUpdateCoalescer::Apply(uint32_t now)
+{
+    // Start a new frame even if the backend fails, so a failing backend is retried at the
+    // frame rate rather than on every request.
+    m_lastUpdateTime = now;
+    m_haveUpdated = true;
+    ++m_updateCount;
+    if (!m_backend.ShowIcon(m_pendingIcon)) {
+        return false;
+    }
+    m_shownIcon = m_pendingIcon;
+    return true;
+}
@@ -0,0 +1,104 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stdint.h>
+
+/* Whatever actually puts an icon on screen. The icon is an opaque handle; the coalescer
+   only ever compares handles for equality. */
+class IIconBackend
+{
+public:
+    virtual ~IIconBackend() {}
+
+    /* Show the icon. Return false if it couldn't be shown; the update stays pending and is
+       retried on the next flush. */
+    virtual bool ShowIcon(uintptr_t icon) = 0;
+};
+
+/* Sits between callers that change the icon and the backend that shows it. Requests for
+   the icon that's already on screen are dropped, and requests that arrive less than a
+   frame after the last update are held back and merged, so a burst of changes costs at
+   most one backend call per frame. The first change after a quiet period goes straight
+   through, so isolated updates see no added latency.
+
+   Times are in milliseconds and may wrap. */
+class CIconUpdateCoalescer
+{
+public:
+    static uint32_t const DEFAULT_FRAME_INTERVAL = 16;
+    static uint32_t const NO_FLUSH_PENDING = 0xFFFFFFFF;
+
+    explicit CIconUpdateCoalescer(IIconBackend &backend, uint32_t frameInterval = DEFAULT_FRAME_INTERVAL);
+
+    /* Request an icon. Returns true if the request is being held back, in which case the
+       caller must call Flush() after GetFlushDelay() milliseconds. */
+    bool SetIcon(uintptr_t icon, uint32_t now);
+
+    /* Push a held-back request to the backend if a frame has passed since the last update.
+       Returns true if a request is still pending. */
+    bool Flush(uint32_t now);
+
+    /* Milliseconds until a pending request can be flushed (0 if it can go now), or
+       NO_FLUSH_PENDING. */
+    uint32_t GetFlushDelay(uint32_t now) const;
+
+    /* Tell the coalescer what the backend is showing, e.g. after the icon was (re)added
+       by other means. */
+    void SetShownIcon(uintptr_t icon);
+
+    uintptr_t GetShownIcon() const { return m_shownIcon; }
+    bool IsPending() const { return m_pendingIcon != m_shownIcon; }
+
+    /* Every SetIcon() call. */
+    uint32_t GetRequestCount() const { return m_requestCount; }
+    /* Requests for the icon that was already on screen (or already pending). */
+    uint32_t GetRedundantCount() const { return m_redundantCount; }
+    /* Requests that were superseded by a later one before reaching the backend. */
+    uint32_t GetCoalescedCount() const { return m_coalescedCount; }
+    /* Calls made to the backend. */
+    uint32_t GetUpdateCount() const { return m_updateCount; }
+
+private:
+    bool Apply(uint32_t now);
+
+    IIconBackend &m_backend;
+    uint32_t m_frameInterval;
+    uintptr_t m_shownIcon;
+    uintptr_t m_pendingIcon;
+    uint32_t m_lastUpdateTime;
+    bool m_haveUpdated;
+
+    uint32_t m_requestCount;
+    uint32_t m_redundantCount;
+    uint32_t m_coalescedCount;
+    uint32_t m_updateCount;
+};
@@ -0,0 +1,666 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "KeyEngine.h"
+#include "VirtualKeys.h"
+#include <string.h>
+
+namespace {
+
+/* The key for each held modifier (KEYSTATE_* bits), for replaying keys with the modifiers
+   they were typed with. */
+struct ModifierKey
+{
+    uint32_t bit;
+    uint8_t keycode;
+};
+
+ModifierKey const s_modifierKeys[] = {
+    { KEYSTATE_LSHIFT, VKEY_LSHIFT },
+    { KEYSTATE_LCONTROL, VKEY_LCONTROL },
+    { KEYSTATE_LALT, VKEY_LMENU },
+    { KEYSTATE_LWIN, VKEY_LWIN },
+    { KEYSTATE_RSHIFT, VKEY_RSHIFT },
+    { KEYSTATE_RCONTROL, VKEY_RCONTROL },
+    { KEYSTATE_RALT, VKEY_RMENU },
+    { KEYSTATE_RWIN, VKEY_RWIN },
+};
+
+} // namespace
+
+CKeyEngine::CKeyEngine() :
+    m_keymap(nullptr),
+    m_publisher(nullptr),
+    m_reader(0),
+    m_keymapVersion(0),
+    m_focus(nullptr),
+    m_app(nullptr),
+    m_table(nullptr),
+    m_layouts(nullptr),
+    m_deadKey(0),
+    m_characterLayout(nullptr),
+    m_characterKeysStale(true),
+    m_suppressedRepeatCount(0),
+    m_sequenceMatchCount(0),
+    m_replayedCount(0),
+    m_expansionCount(0),
+    m_keymapChangeCount(0),
+    m_profileSwitchCount(0),
+    m_ruleBudgetExceededCount(0),
+    m_debouncedCount(0),
+    m_replayOutstanding(0),
+    m_wakePending(false),
+    m_paused(false)
+{
+    memset(m_ruleHeld, 0, sizeof(m_ruleHeld));
+    memset(m_debounceReleased, 0, sizeof(m_debounceReleased));
+    memset(m_debounceHeld, 0, sizeof(m_debounceHeld));
+    memset(m_pausedHeld, 0, sizeof(m_pausedHeld));
+}
+
+void CKeyEngine::SetKeymap(CKeymap const *keymap)
+{
+    m_publisher = nullptr;
+    m_keymap = keymap;
+    memset(m_ruleHeld, 0, sizeof(m_ruleHeld));
+    m_characterKeysStale = true;
+    SelectTable(m_app);
+    m_sequences.SetTable(keymap ? &keymap->GetSequences() : nullptr);
+    m_expansions.SetTable(keymap ? &keymap->GetExpansions() : nullptr);
+    if (m_tapHold.SetTable(keymap ? &keymap->GetTapHold() : nullptr)) {
+        HandleTapHoldOutput();
+    }
+}
+
+bool CKeyEngine::SetKeymapPublisher(CKeymapPublisher *publisher)
+{
+    if (!publisher->AddReader(m_reader)) {
+        return false;
+    }
+    SetKeymap(nullptr);
+    m_publisher = publisher;
+    m_keymapVersion = 0;
+    return true;
+}
+
+void CKeyEngine::SetAppFocus(CAppFocus const *focus)
+{
+    m_focus = focus;
+    SelectTable(focus ? focus->GetApplication() : nullptr);
+}
+
+void CKeyEngine::SelectTable(AppIdentity const *app)
+{
+    m_app = app;
+    if (!m_keymap) {
+        m_table = nullptr;
+    } else {
+        m_table = app ? &m_keymap->GetProfileTable(*app) : &m_keymap->GetTable();
+    }
+}
+
+unsigned CKeyEngine::ProcessKey(KeyEvent const &input)
+{
+    if (!m_publisher) {
+        return HandleKey(input);
+    }
+    unsigned result = EnterKeymap(input.time);
+    result |= HandleKey(input);
+    ExitKeymap();
+    return result;
+}
+
+unsigned CKeyEngine::ProcessButton(KeyEvent const &input)
+{
+    if (!m_publisher) {
+        return HandleButton(input);
+    }
+    unsigned result = EnterKeymap(input.time);
+    result |= HandleButton(input);
+    ExitKeymap();
+    return result;
+}
+
+unsigned CKeyEngine::ProcessTap(uint8_t keycode, uint32_t time, uint8_t flags)
+{
+    KeyEvent input;
+    input.time = time;
+    input.action = KEYMAP_ACTION_NONE;
+    input.keycode = keycode;
+    input.flags = static_cast<uint8_t>(flags | KeyEvent::FLAG_DOWN);
+    unsigned result = ProcessButton(input);
+    input.flags = flags;
+    return result | (ProcessButton(input) & RESULT_WAKE);
+}
+
+unsigned CKeyEngine::EnterKeymap(uint32_t time)
+{
+    uint64_t version;
+    m_keymap = m_publisher->Enter(m_reader, version);
+    if (version == m_keymapVersion) {
+        return 0;
+    }
+
+    // The old keymap may already be gone, so the sequence in progress (if any) is dropped
+    // without looking at it again, and its keys replayed.
+    m_keymapVersion = version;
+    Increment(m_keymapChangeCount);
+    memset(m_ruleHeld, 0, sizeof(m_ruleHeld));
+    m_characterKeysStale = true;
+    SelectTable(m_app);
+    m_expansions.SetTable(m_keymap ? &m_keymap->GetExpansions() : nullptr);
+    CSequenceMatcher::Result sequenceResult = m_sequences.SwitchTable(m_keymap ? &m_keymap->GetSequences() : nullptr);
+    unsigned result = HandleSequenceResult(sequenceResult, time);
+    if (m_tapHold.SetTable(m_keymap ? &m_keymap->GetTapHold() : nullptr)) {
+        result |= HandleTapHoldOutput();
+    }
+    return result;
+}
+
+void CKeyEngine::ExitKeymap()
+{
+    // Nothing may touch the keymap from here until the next EnterKeymap().
+    m_keymap = nullptr;
+    m_publisher->Exit(m_reader);
+}
+
+unsigned CKeyEngine::HandleKey(KeyEvent const &input)
+{
+    bool keyIsDown = (input.flags & KeyEvent::FLAG_DOWN) != 0;
+
+    // A modifier replayed around held keys isn't the user's, and wasn't counted.
+    if ((input.flags & (KeyEvent::FLAG_REPLAY | KeyEvent::FLAG_CONTEXT)) == (KeyEvent::FLAG_REPLAY | KeyEvent::FLAG_CONTEXT)) {
+        return 0;
+    }
+
+    // One of our replayed keys coming back. The key state saw it the first time round and
+    // it mustn't restart a sequence, so all that's left is its keymap lookup.
+    if (input.flags & KeyEvent::FLAG_REPLAY) {
+        uint32_t outstanding = m_replayOutstanding.load();
+        while ((outstanding > 0) && !m_replayOutstanding.compare_exchange_weak(outstanding, outstanding - 1)) {
+        }
+        if (!m_keymap) {
+            return 0;
+        }
+        KeyTransition replayTransition = keyIsDown ? KEY_PRESS : KEY_RELEASE;
+        unsigned replayResult = LookupKey(input, replayTransition);
+        return replayResult | TrackText(input, replayTransition, replayResult);
+    }
+
+    unsigned result = 0;
+    if (m_sequences.IsPending() && (static_cast<int32_t>(input.time - m_sequences.GetDeadline()) >= 0)) {
+        result |= HandleSequenceResult(m_sequences.Expire(), input.time);
+    }
+    if (!(input.flags & KeyEvent::FLAG_INJECTED)) {
+        if (Debounce(input, keyIsDown)) {
+            return result | RESULT_CONSUME;
+        }
+        // Tap-hold keys and layers decide what was typed before anything else sees it.
+        if (!m_tapHold.ProcessKey(input, m_paused.load(std::memory_order_relaxed))) {
+            result |= RESULT_CONSUME | HandleTapHoldOutput();
+            // As with a sequence, the consumer times a pending key out.
+            return result | (m_tapHold.IsPending() ? Wake() : 0);
+        }
+    }
+    return result | HandleResolvedKey(input, false);
+}
+
+unsigned CKeyEngine::HandleResolvedKey(KeyEvent const &input, bool rewritten)
+{
+    bool keyIsDown = (input.flags & KeyEvent::FLAG_DOWN) != 0;
+    unsigned result = 0;
+    KeyTransition transition = m_keyState.Update(input.keycode, keyIsDown, input.time);
+    uint64_t &pausedWord = m_pausedHeld[input.keycode >> 6];
+    uint64_t pausedBit = 1ull << (input.keycode & 63);
+    if (m_paused.load(std::memory_order_relaxed)) {
+        if (m_sequences.IsPending()) {
+            result |= HandleSequenceResult(m_sequences.Expire(), input.time);
+        }
+        m_expansions.Reset();
+        pausedWord = keyIsDown ? (pausedWord | pausedBit) : (pausedWord & ~pausedBit);
+        return PassKey(input, rewritten || (m_replayOutstanding.load() != 0), result);
+    }
+    if (pausedWord & pausedBit) {
+        // The system saw this key go down, so it sees it go up too.
+        if (transition == KEY_RELEASE) {
+            pausedWord &= ~pausedBit;
+        }
+        return PassKey(input, rewritten, result);
+    }
+    if (!m_keymap) {
+        return PassKey(input, rewritten, result);
+    }
+
+    // Modifier keys are never held back; they're part of the strokes of other keys.
+    if (!CKeyStateTracker::GetKeyModifier(input.keycode)) {
+        CSequenceMatcher::Result sequenceResult = m_sequences.ProcessKey(input, transition, m_keyState);
+        if (sequenceResult == CSequenceMatcher::RESULT_ABORT) {
+            // Replay what was held, then see whether this key starts a sequence of its own.
+            // The matcher is back at its root now, so this can't abort again.
+            result |= HandleSequenceResult(sequenceResult, input.time);
+            sequenceResult = m_sequences.ProcessKey(input, transition, m_keyState);
+        }
+        if (sequenceResult == CSequenceMatcher::RESULT_HOLD) {
+            // The consumer times the pending sequence out, so it needs to see every new deadline.
+            return result | RESULT_CONSUME | (m_sequences.IsPending() ? Wake() : 0);
+        }
+        if (sequenceResult == CSequenceMatcher::RESULT_MATCH) {
+            return result | HandleSequenceResult(sequenceResult, input.time);
+        }
+    }
+
+    // Earlier keys are still waiting to be replayed, and this one has to follow them. If
+    // it can't be queued, letting it through out of order beats losing it.
+    if (rewritten || (m_replayOutstanding.load() != 0)) {
+        return PassKey(input, true, result);
+    }
+    unsigned lookupResult = LookupKey(input, transition);
+    return result | lookupResult | TrackText(input, transition, lookupResult);
+}
+
+unsigned CKeyEngine::HandleButton(KeyEvent const &input)
+{
+    bool keyIsDown = (input.flags & KeyEvent::FLAG_DOWN) != 0;
+    if (!(input.flags & KeyEvent::FLAG_INJECTED) && Debounce(input, keyIsDown)) {
+        return RESULT_CONSUME;
+    }
+
+    KeyTransition transition = m_keyState.Update(input.keycode, keyIsDown, input.time);
+    uint64_t &pausedWord = m_pausedHeld[input.keycode >> 6];
+    uint64_t pausedBit = 1ull << (input.keycode & 63);
+    if (m_paused.load(std::memory_order_relaxed)) {
+        pausedWord = keyIsDown ? (pausedWord | pausedBit) : (pausedWord & ~pausedBit);
+        return 0;
+    }
+    if (pausedWord & pausedBit) {
+        if (transition == KEY_RELEASE) {
+            pausedWord &= ~pausedBit;
+        }
+        return 0;
+    }
+    if (!m_keymap) {
+        return 0;
+    }
+    if (transition == KEY_PRESS) {
+        m_expansions.Reset();
+    }
+    return LookupKey(input, transition);
+}
+
+bool CKeyEngine::Debounce(KeyEvent const &input, bool keyIsDown)
+{
+    uint8_t keycode = input.keycode;
+    uint64_t bit = 1ull << (keycode & 63);
+    uint64_t &heldWord = m_debounceHeld[keycode >> 6];
+    uint64_t &releasedWord = m_debounceReleased[keycode >> 6];
+
+    // The rest of a chattered press: its autorepeats, then its release.
+    if (heldWord & bit) {
+        if (!keyIsDown) {
+            heldWord &= ~bit;
+        }
+        return true;
+    }
+    if (!keyIsDown) {
+        if (m_keyState.IsDown(keycode)) {
+            m_releaseTimes[keycode] = input.time;
+            releasedWord |= bit;
+        }
+        return false;
+    }
+    if (m_keyState.IsDown(keycode) || !(releasedWord & bit)) {
+        return false;
+    }
+
+    // A press. Nothing new is filtered while paused.
+    uint16_t threshold = m_keymap ? m_keymap->GetDebounceTime(keycode) : 0;
+    if ((input.time - m_releaseTimes[keycode] >= threshold) || m_paused.load(std::memory_order_relaxed)) {
+        releasedWord &= ~bit;
+        return false;
+    }
+    heldWord |= bit;
+    Increment(m_debouncedCount);
+    return true;
+}
+
+unsigned CKeyEngine::ProcessTimeout(uint32_t now)
+{
+    uint32_t deadline;
+    if (!GetSequenceDeadline(deadline) || (static_cast<int32_t>(now - deadline) < 0)) {
+        return 0;
+    }
+    if (!m_publisher) {
+        return HandleTimeout(now) & ~RESULT_CONSUME;
+    }
+    // If the keymap has changed, switching to it settles the sequence instead.
+    unsigned result = EnterKeymap(now);
+    result |= HandleTimeout(now);
+    ExitKeymap();
+    return result & ~RESULT_CONSUME;
+}
+
+unsigned CKeyEngine::HandleTimeout(uint32_t now)
+{
+    unsigned result = 0;
+    if (m_tapHold.IsPending() && (static_cast<int32_t>(now - m_tapHold.GetDeadline()) >= 0) &&
+        m_tapHold.Expire(now, m_paused.load(std::memory_order_relaxed))) {
+        result |= HandleTapHoldOutput();
+    }
+    if (m_sequences.IsPending() && (static_cast<int32_t>(now - m_sequences.GetDeadline()) >= 0)) {
+        result |= HandleSequenceResult(m_sequences.Expire(), now);
+    }
+    return result;
+}
+
+bool CKeyEngine::GetSequenceDeadline(uint32_t &deadline) const
+{
+    if (!m_sequences.IsPending() && !m_tapHold.IsPending()) {
+        return false;
+    }
+    deadline = m_sequences.IsPending() ? m_sequences.GetDeadline() : m_tapHold.GetDeadline();
+    if (m_tapHold.IsPending() && (static_cast<int32_t>(m_tapHold.GetDeadline() - deadline) < 0)) {
+        deadline = m_tapHold.GetDeadline();
+    }
+    return true;
+}
+
+void CKeyEngine::ReplayFailed(uint32_t count)
+{
+    uint32_t outstanding = m_replayOutstanding.load();
+    uint32_t remaining;
+    do {
+        remaining = (outstanding > count) ? outstanding - count : 0;
+    } while (!m_replayOutstanding.compare_exchange_weak(outstanding, remaining));
+}
+
+unsigned CKeyEngine::LookupKey(KeyEvent const &input, KeyTransition transition)
+{
+    uint8_t keycode = input.keycode;
+
+    // A modifier key is looked up without its own modifier, so that its press and release
+    // are both found under the same entry (e.g. "LCtrl" rather than "Ctrl+LCtrl").
+    unsigned modifiers = m_keyState.GetModifiers() & ~CKeyStateTracker::GetKeyModifier(keycode);
+
+    // The focus has moved: look for the new application's profile, once.
+    if (m_focus) {
+        AppIdentity const *app = m_focus->GetApplication();
+        if (app != m_app) {
+            SelectTable(app);
+            m_expansions.Reset();
+            Increment(m_profileSwitchCount);
+        }
+    }
+    KeymapEntry entry = KeymapTableLookup(*m_table, modifiers, keycode);
+
+    // A binding for the character the key types on the current layout wins over one for
+    // the key itself.
+    if (m_keymap->GetCharacterCount()) {
+        LayoutTable const *layout = m_layouts ? m_layouts->GetCurrent() : nullptr;
+        if (m_characterKeysStale || (layout != m_characterLayout)) {
+            m_keymap->MapCharacterKeys(layout, m_characterKeys);
+            m_characterLayout = layout;
+            m_characterKeysStale = false;
+        }
+        uint8_t character = m_characterKeys[keycode];
+        KeymapEntry characterEntry = character ? m_keymap->LookupCharacter(modifiers, character - 1) : 0;
+        if (characterEntry) {
+            entry = characterEntry;
+        }
+    }
+
+    // A conditional binding is decided as its key goes down, and the decision holds until
+    // the key comes up, whatever the condition says in the meantime.
+    uint64_t &heldWord = m_ruleHeld[keycode >> 6];
+    uint64_t heldBit = 1ull << (keycode & 63);
+    if (transition == KEY_PRESS) {
+        heldWord &= ~heldBit;
+    } else if (heldWord & heldBit) {
+        entry = m_ruleEntries[keycode];
+        if (transition == KEY_RELEASE) {
+            heldWord &= ~heldBit;
+        }
+    }
+    if (KeymapIsRule(entry)) {
+        RuleContext context = { &m_keyState, input.time, transition };
+        bool exhausted;
+        entry = m_keymap->GetRules().Resolve(entry, context, RULE_BUDGET, exhausted);
+        if (exhausted) {
+            Increment(m_ruleBudgetExceededCount);
+        }
+        if (transition == KEY_PRESS) {
+            m_ruleEntries[keycode] = entry;
+            heldWord |= heldBit;
+        }
+    }
+    unsigned result = KeymapIsConsumed(entry) ? RESULT_CONSUME : 0;
+
+    uint16_t action;
+    switch (transition) {
+    case KEY_PRESS:
+        action = KeymapPressAction(entry);
+        break;
+    case KEY_REPEAT:
+        action = KeymapWantsRepeat(entry) ? KeymapPressAction(entry) : KEYMAP_ACTION_NONE;
+        if ((action == KEYMAP_ACTION_NONE) && (KeymapPressAction(entry) != KEYMAP_ACTION_NONE)) {
+            Increment(m_suppressedRepeatCount);
+        }
+        break;
+    default:
+        action = KeymapReleaseAction(entry);
+        break;
+    }
+    if (action == KEYMAP_ACTION_NONE) {
+        return result;
+    }
+
+    KeyEvent event;
+    event.time = input.time;
+    event.action = action;
+    event.keycode = keycode;
+    event.flags = input.flags & (KeyEvent::FLAG_DOWN | KeyEvent::FLAG_SYSTEM | KeyEvent::FLAG_INJECTED | KeyEvent::FLAG_EXTENDED);
+    if (result & RESULT_CONSUME) {
+        event.flags |= KeyEvent::FLAG_CONSUMED;
+    }
+    if (transition == KEY_REPEAT) {
+        event.flags |= KeyEvent::FLAG_REPEAT;
+    }
+
+    // If the queue is full, the event is dropped (and counted by the queue). The swallow
+    // decision has already been made, so input to the system is unaffected.
+    return result | QueueEvent(event);
+}
+
+unsigned CKeyEngine::TrackText(KeyEvent const &input, KeyTransition transition, unsigned lookupResult)
+{
+    // Modifiers on their own type nothing, and neither do releases.
+    uint8_t keycode = input.keycode;
+    if ((transition == KEY_RELEASE) || CKeyStateTracker::GetKeyModifier(keycode)) {
+        return 0;
+    }
+    if (lookupResult & RESULT_CONSUME) {
+        m_expansions.Reset();
+        return 0;
+    }
+    unsigned modifiers = m_keyState.GetModifiers();
+    uint16_t deadKey = m_deadKey;
+    m_deadKey = 0;
+    if ((keycode == VKEY_BACK) && (modifiers == 0)) {
+        m_expansions.Erase();
+        return 0;
+    }
+    uint16_t c;
+    LayoutTable const *layout = m_layouts ? m_layouts->GetCurrent() : nullptr;
+    if (layout) {
+        unsigned state = LayoutShiftState(m_keyState.GetModifierSnapshot());
+        c = LayoutCharacter(*layout, state, keycode);
+        if (!deadKey && IsLayoutDeadKey(*layout, state, keycode)) {
+            m_deadKey = c;
+            return 0;
+        }
+        // After a dead key, Space types its accent; anything else an accented letter,
+        // which abbreviations don't have.
+        if (deadKey) {
+            c = (c == ' ') ? deadKey : 0;
+        }
+    } else {
+        c = static_cast<unsigned char>(CKeymap::CharacterFromStroke(MakeStroke(modifiers, keycode)));
+        if ((m_keyState.GetModifierSnapshot() & KEYSTATE_CAPSLOCK) && (((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')))) {
+            c = static_cast<uint16_t>(c ^ 0x20);
+        }
+    }
+    if (!c || (c >= 0x80)) {
+        m_expansions.Reset();
+        return 0;
+    }
+
+    uint16_t action = m_expansions.Type(static_cast<char>(c));
+    if (action == KEYMAP_ACTION_NONE) {
+        return 0;
+    }
+    Increment(m_expansionCount);
+    KeyEvent event;
+    event.time = input.time;
+    event.action = action;
+    event.keycode = 0;
+    event.flags = KeyEvent::FLAG_DOWN;
+    return QueueEvent(event);
+}
+
+unsigned CKeyEngine::HandleSequenceResult(CSequenceMatcher::Result sequenceResult, uint32_t time)
+{
+    unsigned result = 0;
+    if (sequenceResult == CSequenceMatcher::RESULT_MATCH) {
+        Increment(m_sequenceMatchCount);
+        m_expansions.Reset();
+        KeyEvent event;
+        event.time = time;
+        event.action = m_sequences.GetMatchedAction();
+        event.keycode = 0;
+        event.flags = KeyEvent::FLAG_DOWN | KeyEvent::FLAG_CONSUMED;
+        result |= RESULT_CONSUME | QueueEvent(event);
+    } else if (sequenceResult == CSequenceMatcher::RESULT_ABORT) {
+        // Modifiers are never held back, so they may have changed since the held keys were
+        // typed (Ctrl let go of after Ctrl+K, say). Each key is replayed with the modifiers
+        // it was typed with, and those the system has now are put back afterwards.
+        KeyEvent const *held = m_sequences.GetHeldEvents();
+        uint8_t const *heldModifiers = m_sequences.GetHeldModifiers();
+        uint32_t current = m_keyState.GetModifierSnapshot() & KEYSTATE_HELD_MODIFIERS;
+        uint32_t modifiers = current;
+        for (unsigned i = 0; i < m_sequences.GetHeldCount(); ++i) {
+            QueueModifierChange(modifiers, heldModifiers[i], held[i].time, result);
+            modifiers = heldModifiers[i];
+            if (QueueReplay(held[i], result)) {
+                Increment(m_replayedCount);
+            }
+        }
+        QueueModifierChange(modifiers, current, time, result);
+        m_sequences.ClearHeldEvents();
+    }
+    return result;
+}
+
+unsigned CKeyEngine::HandleTapHoldOutput()
+{
+    // The keys the resolver let out in place of those it swallowed, in order. Whether
+    // they're swallowed in turn is no longer up to the hook, which has had its answer.
+    unsigned result = 0;
+    KeyEvent const *output = m_tapHold.GetOutput();
+    for (unsigned i = 0; i < m_tapHold.GetOutputCount(); ++i) {
+        result |= HandleResolvedKey(output[i], true);
+    }
+    m_tapHold.ClearOutput();
+    return result & ~RESULT_CONSUME;
+}
+
+unsigned CKeyEngine::PassKey(KeyEvent const &input, bool replay, unsigned result)
+{
+    // A key goes round again as a replay if it has to wait behind others that are, or if
+    // its own event is gone, as it is for every key the resolver let out.
+    if (!replay) {
+        return result;
+    }
+    return result | (QueueReplay(input, result) ? RESULT_CONSUME : 0);
+}
+
+bool CKeyEngine::QueueReplay(KeyEvent const &input, unsigned &result)
+{
+    KeyEvent event = input;
+    event.action = KEYMAP_ACTION_NONE;
+    event.flags = static_cast<uint8_t>((input.flags & ~KeyEvent::FLAG_CONSUMED) | KeyEvent::FLAG_REPLAY);
+
+    // Count it before it's visible to the consumer, which may fail it straight away.
+    m_replayOutstanding.fetch_add(1);
+    if (!m_queue.Push(event)) {
+        ReplayFailed(1);
+        return false;
+    }
+    result |= Wake();
+    return true;
+}
+
+void CKeyEngine::QueueModifierChange(uint32_t from, uint32_t to, uint32_t time, unsigned &result)
+{
+    // Releases first, so that Left Ctrl to Right Ctrl never has both down. These aren't
+    // counted as outstanding replays: nothing waits for them to come back.
+    for (unsigned pass = 0; pass < 2; ++pass) {
+        uint32_t change = (pass == 0) ? (from & ~to) : (to & ~from);
+        for (size_t i = 0; i < sizeof(s_modifierKeys) / sizeof(s_modifierKeys[0]); ++i) {
+            if (!(change & s_modifierKeys[i].bit)) {
+                continue;
+            }
+            KeyEvent event;
+            event.time = time;
+            event.action = KEYMAP_ACTION_NONE;
+            event.keycode = s_modifierKeys[i].keycode;
+            event.flags = static_cast<uint8_t>(KeyEvent::FLAG_REPLAY | KeyEvent::FLAG_CONTEXT |
+                ((pass == 1) ? KeyEvent::FLAG_DOWN : 0) | (IsExtendedKey(event.keycode) ? KeyEvent::FLAG_EXTENDED : 0));
+            result |= QueueEvent(event);
+        }
+    }
+}
+
+unsigned CKeyEngine::QueueEvent(KeyEvent const &event)
+{
+    return m_queue.Push(event) ? Wake() : 0;
+}
+
+unsigned CKeyEngine::Wake()
+{
+    // Wake the consumer only once per batch. BeginDrain() clears the flag before the
+    // consumer drains, so an event pushed mid-drain causes at most one extra wakeup.
+    return m_wakePending.exchange(true) ? 0 : RESULT_WAKE;
+}
+
+void CKeyEngine::Increment(std::atomic<uint32_t> &counter)
+{
+    // Only the hook's thread writes the counters, so this needn't be a locked add.
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
@@ -0,0 +1,267 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include "EventQueue.h"
+#include "ExpansionMatcher.h"
+#include "KeyboardLayout.h"
+#include "KeyEvent.h"
+#include "Keymap.h"
+#include "KeymapPublisher.h"
+#include "KeyState.h"
+#include "SequenceMatcher.h"
+#include "TapHold.h"
+
+/* The platform-neutral half of the keyboard hook. The OS-specific hook hands every key
+   event to ProcessKey(), which classifies it as a press, repeat or release, decides
+   whether to swallow it with a single keymap lookup and, if the key has an action bound
+   for that edge, queues a KeyEvent for the message loop thread. Autorepeats are only
+   queued for bindings that ask for them, so a held key can't flood the queue.
+
+   A key with conditional bindings (see CRuleTable) has them evaluated as it's pressed,
+   within a fixed instruction budget, and keeps the resulting entry until it's released.
+
+   Keys that could start one of the keymap's sequences or chords are swallowed while the
+   sequence is in progress. If it completes, its action is queued and the keys are gone
+   for good; if it fails (a key that doesn't continue it, or its timeout), the held keys
+   are queued with FLAG_REPLAY for the consumer to re-inject. Until those injected keys
+   come back through the hook, later keys are queued for replay behind them rather than
+   passed, so the system always sees keys in the order they were typed. Replayed keys
+   get their keymap lookup when they come back.
+
+   The characters that keys going through to the system type are run through the keymap's
+   abbreviations (see CExpansionMatcher). When one is completed, its macro is queued like
+   any other action; the macro erases the abbreviation and types its replacement. Other
+   keys that move the caret or act as shortcuts start the matching afresh. What a key
+   types comes from the focused window's keyboard layout (see CLayoutCache), looked up in
+   a table built for it beforehand, or from a US keyboard without one. The same layout
+   decides which keys the keymap's bindings by character are for; that's worked out again
+   on the first key after the layout or the keymap changes.
+
+   Keys with a debounce time in the keymap are filtered for chatter before anything else
+   sees them, the key state included. A press that comes within the debounce time of the
+   key's last release is swallowed, along with its autorepeats and its release; every
+   other edge goes straight through, so filtering adds no latency. A key that chatters as
+   it's pressed and is then held reads as a tap. Injected keys aren't filtered.
+
+   Keys that get past the filter go through the keymap's tap-hold keys and layers (see
+   CTapHoldResolver) before anything else, the key state included, so everything after
+   sees keys as they were resolved: a dual-role key held with C reads as Ctrl+C. A key
+   that's rewritten, or that comes out after being held back, is swallowed and queued
+   for replay like a failed sequence's keys, and gets the rest of its handling (the
+   key state, sequences) straight away. A pending dual-role key's deadline is the
+   engine's to time out, like a sequence's.
+
+   ProcessKey() and ProcessTimeout() are called only from the hook's thread (the
+   producer); BeginDrain(), PopEvent() and ReplayFailed() only from the thread that runs
+   actions (the consumer). */
+class CKeyEngine
+{
+public:
+    enum {
+        RESULT_CONSUME = 0x01,  // Swallow the key.
+        RESULT_WAKE = 0x02,     // An event was queued, or the sequence deadline moved, and
+                                // the consumer needs waking.
+    };
+
+    static size_t const QUEUE_SIZE = 1024;
+
+    CKeyEngine();
+
+    /* The keymap must outlive the engine, or at least its use by the hook. */
+    void SetKeymap(CKeymap const *keymap);
+
+    /* Take the keymap from a publisher instead, picking up whatever it publishes from the
+       next key on. The engine registers as one of its readers. A new keymap abandons any
+       sequence in progress (its keys are replayed). Returns false if the publisher has no
+       reader slots left. */
+    bool SetKeymapPublisher(CKeymapPublisher *publisher);
+
+    /* Follow the application in the foreground, using its profile's bindings (if the
+       keymap has one) in place of the keymap's own. The hook checks the focus on every
+       key, but only looks for a profile when the application or the keymap changes. The
+       focus must outlive the engine's use of it; NULL stops following it. */
+    void SetAppFocus(CAppFocus const *focus);
+
+    /* Type abbreviations, and find the keys bound by character, through the current layout
+       of a cache, read on every key that types something or has a keymap entry to look
+       up. The cache must outlive the engine's use of it; NULL goes back to a US
+       keyboard. */
+    void SetLayouts(CLayoutCache const *layouts) { m_layouts = layouts; }
+
+    /* input carries the key code, timestamp and the FLAG_DOWN, FLAG_SYSTEM, FLAG_INJECTED
+       and FLAG_EXTENDED bits. The OS-specific hook sets FLAG_REPLAY on keys it recognizes
+       as its own re-injected ones. Returns a combination of RESULT_* flags. */
+    unsigned ProcessKey(KeyEvent const &input);
+
+    /* The same for a mouse button (VKEY_LBUTTON and so on), or one half of a tap of the
+       wheel or a flick (see IsVirtualTap()). These are looked up, debounced and tracked in
+       the key state like keys, but never held for a sequence or replayed, since they can't
+       be injected as keys: one that comes while replays are outstanding goes ahead of
+       them. A press starts the abbreviations afresh, as a click may move the caret. */
+    unsigned ProcessButton(KeyEvent const &input);
+
+    /* A press and release of keycode through ProcessButton(), for a wheel notch or a
+       flick. Whether the tap is swallowed is up to the press. */
+    unsigned ProcessTap(uint8_t keycode, uint32_t time, uint8_t flags = 0);
+
+    /* Forget what has been typed towards an abbreviation, say because the focus has moved.
+       Only from the hook's thread. */
+    void ResetExpansions()
+    {
+        m_expansions.Reset();
+        m_deadKey = 0;
+    }
+
+    /* While paused, every key goes through to the system untouched (a sequence in progress
+       is let go of and its keys replayed first) and no actions run. The key state keeps
+       up, and a key pressed while paused is still passed when it's released afterwards.
+       From any thread. */
+    void SetPaused(bool paused) { m_paused.store(paused, std::memory_order_relaxed); }
+    bool IsPaused() const { return m_paused.load(std::memory_order_relaxed); }
+
+    /* Call when the sequence deadline passes with no key pressed. Returns RESULT_* flags. */
+    unsigned ProcessTimeout(uint32_t now);
+
+    /* The time at which ProcessTimeout() should be called, if a sequence or a dual-role
+       key is pending. */
+    bool GetSequenceDeadline(uint32_t &deadline) const;
+
+    /* Call if the RESULT_WAKE notification could not be delivered, so the next queued
+       event tries again. */
+    void CancelWake() { m_wakePending.store(false); }
+
+    /* Call once per wakeup, before popping events. */
+    void BeginDrain() { m_wakePending.store(false); }
+    bool PopEvent(KeyEvent &event) { return m_queue.Pop(event); }
+
+    /* Call with the number of FLAG_REPLAY events that were popped but couldn't be
+       injected, so the hook stops waiting for them. */
+    void ReplayFailed(uint32_t count);
+
+    /* Key state as tracked by the hook. Only safe to use from the hook's thread. */
+    CKeyStateTracker &GetKeyState() { return m_keyState; }
+    CKeyStateTracker const &GetKeyState() const { return m_keyState; }
+
+    /* Autorepeats of bound keys that were not queued because the binding doesn't want them. */
+    uint32_t GetSuppressedRepeatCount() const { return m_suppressedRepeatCount.load(std::memory_order_relaxed); }
+    /* Sequences and chords that completed. Their action events have a keycode of 0. */
+    uint32_t GetSequenceMatchCount() const { return m_sequenceMatchCount.load(std::memory_order_relaxed); }
+    /* Held keys queued for replay because their sequence failed. */
+    uint32_t GetReplayedCount() const { return m_replayedCount.load(std::memory_order_relaxed); }
+    /* Abbreviations typed, whose macros were queued. */
+    uint32_t GetExpansionCount() const { return m_expansionCount.load(std::memory_order_relaxed); }
+    /* Published keymaps the engine has switched to. */
+    uint32_t GetKeymapChangeCount() const { return m_keymapChangeCount.load(std::memory_order_relaxed); }
+    /* Focus changes the hook has picked up, each costing one profile lookup. */
+    uint32_t GetProfileSwitchCount() const { return m_profileSwitchCount.load(std::memory_order_relaxed); }
+    /* Chattered presses swallowed by the debounce filter, each with its release. */
+    uint32_t GetDebouncedCount() const { return m_debouncedCount.load(std::memory_order_relaxed); }
+    /* Keys whose conditions ran out of instruction budget, and so got their plain binding. */
+    uint32_t GetRuleBudgetExceededCount() const { return m_ruleBudgetExceededCount.load(std::memory_order_relaxed); }
+    /* Taps and holds of dual-role keys, and how long keys were held back for them. The
+       counters can be read from any thread. */
+    CTapHoldResolver const &GetTapHold() const { return m_tapHold; }
+
+    uint32_t GetQueuedCount() const { return m_queue.GetPushedCount(); }
+    uint32_t GetDroppedCount() const { return m_queue.GetDroppedCount(); }
+    uint32_t GetQueueHighWaterMark() const { return m_queue.GetHighWaterMark(); }
+
+private:
+    unsigned HandleKey(KeyEvent const &input);
+    unsigned HandleResolvedKey(KeyEvent const &input, bool rewritten);
+    unsigned HandleTapHoldOutput();
+    unsigned HandleTimeout(uint32_t now);
+    unsigned HandleButton(KeyEvent const &input);
+    bool Debounce(KeyEvent const &input, bool keyIsDown);
+    unsigned EnterKeymap(uint32_t time);
+    void ExitKeymap();
+    void SelectTable(AppIdentity const *app);
+    unsigned LookupKey(KeyEvent const &input, KeyTransition transition);
+    unsigned TrackText(KeyEvent const &input, KeyTransition transition, unsigned lookupResult);
+    unsigned HandleSequenceResult(CSequenceMatcher::Result sequenceResult, uint32_t time);
+    unsigned PassKey(KeyEvent const &input, bool replay, unsigned result);
+    bool QueueReplay(KeyEvent const &input, unsigned &result);
+    void QueueModifierChange(uint32_t from, uint32_t to, uint32_t time, unsigned &result);
+    unsigned QueueEvent(KeyEvent const &event);
+    unsigned Wake();
+    static void Increment(std::atomic<uint32_t> &counter);
+
+    CKeymap const *m_keymap;
+    CKeymapPublisher *m_publisher;
+    unsigned m_reader;
+    uint64_t m_keymapVersion;
+    CAppFocus const *m_focus;
+    AppIdentity const *m_app;
+    KeymapTable const *m_table;     // the keymap's, or m_app's profile's
+    CLayoutCache const *m_layouts;
+    uint16_t m_deadKey;             // the accent of a dead key just typed, if any
+
+    // Which of the keymap's bound characters each key types, as CKeymap::MapCharacterKeys()
+    // has it, on m_characterLayout; stale once the keymap changes.
+    uint8_t m_characterKeys[KEYMAP_KEYS];
+    LayoutTable const *m_characterLayout;
+    bool m_characterKeysStale;
+    CKeyStateTracker m_keyState;
+    CSequenceMatcher m_sequences;
+    CTapHoldResolver m_tapHold;
+    CExpansionMatcher m_expansions;
+    std::atomic<uint32_t> m_suppressedRepeatCount;
+    std::atomic<uint32_t> m_sequenceMatchCount;
+    std::atomic<uint32_t> m_replayedCount;
+    std::atomic<uint32_t> m_expansionCount;
+    std::atomic<uint32_t> m_keymapChangeCount;
+    std::atomic<uint32_t> m_profileSwitchCount;
+    std::atomic<uint32_t> m_ruleBudgetExceededCount;
+    std::atomic<uint32_t> m_debouncedCount;
+
+    // The keys held whose conditional bindings have been decided, and what was decided.
+    uint64_t m_ruleHeld[4];
+    KeymapEntry m_ruleEntries[256];
+
+    // When each key was last released, for the keys in m_debounceReleased (those released
+    // since they last went down), and the keys whose chattered press is being swallowed.
+    uint32_t m_releaseTimes[256];
+    uint64_t m_debounceReleased[4];
+    uint64_t m_debounceHeld[4];
+
+    // Keys pressed while paused and not yet released.
+    uint64_t m_pausedHeld[4];
+
+    // Replay events queued but not yet seen coming back through the hook.
+    std::atomic<uint32_t> m_replayOutstanding;
+
+    CEventQueue<KeyEvent, QUEUE_SIZE> m_queue;
+    std::atomic<bool> m_wakePending;
+    std::atomic<bool> m_paused;
+};
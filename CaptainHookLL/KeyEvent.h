@@ -0,0 +1,62 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stdint.h>
+
+/* Compact record of a single keyboard event. The low-level hook fills one of these in
+   for every key it cares about and pushes it onto the event queue; the handlers that
+   act on it run later on the message loop thread. Keep this small: it is copied by
+   value through the queue.
+
+   Events with FLAG_REPLAY carry no action. They are keys the hook held back (e.g. the
+   first key of a sequence that didn't complete) and must be re-injected, in queue order,
+   by the consumer. Those that also have FLAG_CONTEXT are modifiers pressed or released
+   around the others to replay them with the modifiers they were typed with; they aren't
+   the user's keys, so they must not come back through the keymap. */
+struct KeyEvent
+{
+    enum {
+        FLAG_DOWN = 0x01,     // Key pressed (or autorepeated). Clear for a release.
+        FLAG_SYSTEM = 0x02,   // WM_SYSKEYDOWN/WM_SYSKEYUP, i.e. ALT is held.
+        FLAG_CONSUMED = 0x04, // The hook swallowed the key.
+        FLAG_INJECTED = 0x08, // The event was synthesized (LLKHF_INJECTED).
+        FLAG_REPEAT = 0x10,   // Autorepeat of a key that was already down.
+        FLAG_EXTENDED = 0x20, // Extended key (LLKHF_EXTENDED), needed to replay it faithfully.
+        FLAG_REPLAY = 0x40,   // A swallowed key that must be sent on to the system, in order.
+        FLAG_CONTEXT = 0x80,  // A replayed modifier that puts back the state a held key was typed in.
+    };
+
+    uint32_t time;      // Event timestamp in milliseconds, as reported by the OS.
+    uint16_t action;    // Action ID from the keymap.
+    uint8_t keycode;    // Virtual key code.
+    uint8_t flags;      // FLAG_* bits.
+};
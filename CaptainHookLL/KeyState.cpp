@@ -0,0 +1,138 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "KeyState.h"
+#include "VirtualKeys.h"
+#include <string.h>
+
+namespace {
+
+/* For each key, the snapshot bit it holds while down (low 16 bits) and the lock bit it
+   toggles when pressed (high 16 bits). */
+struct ModifierTable
+{
+    uint32_t bits[256];
+
+    ModifierTable()
+    {
+        memset(bits, 0, sizeof(bits));
+        bits[VKEY_LSHIFT] = KEYSTATE_LSHIFT;
+        bits[VKEY_RSHIFT] = KEYSTATE_RSHIFT;
+        bits[VKEY_SHIFT] = KEYSTATE_LSHIFT;
+        bits[VKEY_LCONTROL] = KEYSTATE_LCONTROL;
+        bits[VKEY_RCONTROL] = KEYSTATE_RCONTROL;
+        bits[VKEY_CONTROL] = KEYSTATE_LCONTROL;
+        bits[VKEY_LMENU] = KEYSTATE_LALT;
+        bits[VKEY_RMENU] = KEYSTATE_RALT;
+        bits[VKEY_MENU] = KEYSTATE_LALT;
+        bits[VKEY_LWIN] = KEYSTATE_LWIN;
+        bits[VKEY_RWIN] = KEYSTATE_RWIN;
+        bits[VKEY_CAPITAL] = static_cast<uint32_t>(KEYSTATE_CAPSLOCK) << 16;
+        bits[VKEY_NUMLOCK] = static_cast<uint32_t>(KEYSTATE_NUMLOCK) << 16;
+        bits[VKEY_SCROLL] = static_cast<uint32_t>(KEYSTATE_SCROLLLOCK) << 16;
+    }
+};
+
+ModifierTable const s_modifierTable;
+
+/* Indexed by (keyIsDown << 1) | wasDown. A release of a key we never saw go down (e.g. it
+   was held when the hook was installed) is still a release. */
+KeyTransition const s_transitions[4] = { KEY_RELEASE, KEY_RELEASE, KEY_PRESS, KEY_REPEAT };
+
+} // namespace
+
+CKeyStateTracker::CKeyStateTracker() :
+    m_modifiers(0)
+{
+    Reset();
+}
+
+void CKeyStateTracker::Reset()
+{
+    memset(m_down, 0, sizeof(m_down));
+    memset(m_pressTime, 0, sizeof(m_pressTime));
+    memset(m_edgeTime, 0, sizeof(m_edgeTime));
+    memset(m_pressCount, 0, sizeof(m_pressCount));
+    m_modifiers &= KEYSTATE_LOCKS;
+    m_lastEventTime = 0;
+}
+
+KeyTransition CKeyStateTracker::Update(uint8_t keycode, bool keyIsDown, uint32_t time)
+{
+    // Everything below is straight-line arithmetic on masks, so the cost is the same for
+    // every kind of event and there are no data-dependent branches to mispredict.
+    unsigned word = keycode >> 6;
+    unsigned shift = keycode & 63;
+    uint64_t down = static_cast<uint64_t>(keyIsDown);
+    uint64_t wasDown = (m_down[word] >> shift) & 1;
+    KeyTransition transition = s_transitions[(down << 1) | wasDown];
+    m_down[word] = (m_down[word] & ~(1ull << shift)) | (down << shift);
+
+    uint32_t isPress = static_cast<uint32_t>(transition == KEY_PRESS);
+    uint32_t isEdge = static_cast<uint32_t>(transition != KEY_REPEAT);
+    uint32_t pressMask = 0u - isPress;
+    uint32_t edgeMask = 0u - isEdge;
+    m_pressTime[keycode] = (time & pressMask) | (m_pressTime[keycode] & ~pressMask);
+    m_edgeTime[keycode] = (time & edgeMask) | (m_edgeTime[keycode] & ~edgeMask);
+    m_pressCount[keycode] += isPress;
+    m_lastEventTime = time;
+
+    uint32_t bits = s_modifierTable.bits[keycode];
+    uint32_t heldBit = bits & 0xFFFF;
+    uint32_t lockBit = bits >> 16;
+    uint32_t downMask = 0u - static_cast<uint32_t>(down);
+    m_modifiers = (m_modifiers & ~heldBit) | (heldBit & downMask);
+    m_modifiers ^= lockBit & pressMask;
+
+    return transition;
+}
+
+void CKeyStateTracker::SetLockState(uint32_t locks)
+{
+    m_modifiers = (m_modifiers & ~KEYSTATE_LOCKS) | (locks & KEYSTATE_LOCKS);
+}
+
+unsigned CKeyStateTracker::GetKeyModifier(uint8_t keycode)
+{
+    uint32_t heldBit = s_modifierTable.bits[keycode] & KEYSTATE_HELD_MODIFIERS;
+    return (heldBit | (heldBit >> 4)) & 0x0F;
+}
+
+unsigned CKeyStateTracker::GetDownCount() const
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < 4; ++i) {
+        for (uint64_t word = m_down[i]; word; word &= word - 1) {
+            ++count;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,119 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stdint.h>
+
+/* How a key event relates to the key's previous state. */
+enum KeyTransition {
+    KEY_RELEASE = 0,    // The key went up.
+    KEY_PRESS = 1,      // The key went down, and wasn't down before.
+    KEY_REPEAT = 2,     // The key went down again while already down (OS autorepeat).
+};
+
+/* Bits in the modifier snapshot word. Left and right modifiers are tracked separately;
+   GetModifiers() folds them together into the KEYMOD_* bits the keymap is indexed by. The
+   lock bits track toggle state rather than whether the key is held. */
+enum KeyStateModifier {
+    KEYSTATE_LSHIFT = 0x0001,
+    KEYSTATE_LCONTROL = 0x0002,
+    KEYSTATE_LALT = 0x0004,
+    KEYSTATE_LWIN = 0x0008,
+    KEYSTATE_RSHIFT = 0x0010,
+    KEYSTATE_RCONTROL = 0x0020,
+    KEYSTATE_RALT = 0x0040,
+    KEYSTATE_RWIN = 0x0080,
+    KEYSTATE_CAPSLOCK = 0x0100,
+    KEYSTATE_NUMLOCK = 0x0200,
+    KEYSTATE_SCROLLLOCK = 0x0400,
+
+    KEYSTATE_HELD_MODIFIERS = 0x00FF,
+    KEYSTATE_LOCKS = 0x0700,
+};
+
+/* Tracks which of the 256 virtual keys are held, as a 256-bit bitmap, along with when
+   each key was last pressed and a snapshot of the modifiers. Update() classifies each
+   event as a press, repeat or release, which is what lets handlers see only the edges
+   of a key that's being autorepeated.
+
+   Times are the OS event timestamps in milliseconds (KBDLLHOOKSTRUCT::time on Windows)
+   and may wrap. Not thread safe: it belongs to whichever thread runs the hook. */
+class CKeyStateTracker
+{
+public:
+    CKeyStateTracker();
+
+    /* Forget everything, e.g. after the hook has been reinstalled and may have missed
+       releases. Lock state is kept. */
+    void Reset();
+
+    KeyTransition Update(uint8_t keycode, bool keyIsDown, uint32_t time);
+
+    bool IsDown(uint8_t keycode) const
+    {
+        return ((m_down[keycode >> 6] >> (keycode & 63)) & 1) != 0;
+    }
+
+    /* When the key last went down. Only meaningful while IsDown(). */
+    uint32_t GetPressTime(uint8_t keycode) const { return m_pressTime[keycode]; }
+
+    /* When the key last changed state (pressed or released). 0 if it never has. */
+    uint32_t GetEdgeTime(uint8_t keycode) const { return m_edgeTime[keycode]; }
+
+    /* How many times the key has been pressed (not counting autorepeats). Wraps. */
+    uint32_t GetPressCount(uint8_t keycode) const { return m_pressCount[keycode]; }
+
+    uint32_t GetLastEventTime() const { return m_lastEventTime; }
+
+    /* KEYSTATE_* bits. */
+    uint32_t GetModifierSnapshot() const { return m_modifiers; }
+
+    /* KEYMOD_* bits, as used to index a keymap. */
+    unsigned GetModifiers() const { return (m_modifiers | (m_modifiers >> 4)) & 0x0F; }
+
+    /* Set the lock toggles (KEYSTATE_CAPSLOCK etc.) from the OS at startup; after that
+       they're tracked from key presses. */
+    void SetLockState(uint32_t locks);
+
+    /* Number of keys currently held. */
+    unsigned GetDownCount() const;
+
+    /* The KEYMOD_* bit a key controls, or 0 if it isn't a modifier. */
+    static unsigned GetKeyModifier(uint8_t keycode);
+
+private:
+    uint64_t m_down[4];
+    uint32_t m_modifiers;
+    uint32_t m_lastEventTime;
+    uint32_t m_pressTime[256];
+    uint32_t m_edgeTime[256];
+    uint32_t m_pressCount[256];
+};
@@ -0,0 +1,340 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "KeyboardLayout.h"
+#include "Keymap.h"
+#include "SequenceMatcher.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+void SetError(KeymapError *error, unsigned line, char const *message, char const *token, size_t tokenLength)
+{
+    if (!error) {
+        return;
+    }
+    error->line = line;
+    if (tokenLength == 0) {
+        snprintf(error->message, sizeof(error->message), "%s", message);
+    } else {
+        snprintf(error->message, sizeof(error->message), "%s '%.*s'", message, static_cast<int>(tokenLength), token);
+    }
+}
+
+bool IsSpace(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+void SetDead(LayoutTable &layout, unsigned state, uint8_t keycode)
+{
+    layout.deadKeys[state][keycode >> 6] |= 1ull << (keycode & 63);
+}
+
+/* Letters with a case, as far as Caps Lock goes: Latin, Greek and Cyrillic. */
+bool IsCapsLetter(uint16_t c)
+{
+    return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) ||
+        ((c >= 0xC0) && (c < 0x250) && (c != 0xD7) && (c != 0xF7)) ||
+        ((c >= 0x370) && (c < 0x530));
+}
+
+/* Fill in the Caps Lock states from the others. */
+void ApplyCapsLock(LayoutTable &layout)
+{
+    for (unsigned k = 0; k < 256; ++k) {
+        uint8_t keycode = static_cast<uint8_t>(k);
+        bool swap = IsCapsLetter(layout.characters[0][k]);
+        for (unsigned state = 0; state < LAYOUT_CAPSLOCK; ++state) {
+            unsigned from = (swap && !(state & LAYOUT_ALTGR)) ? (state ^ LAYOUT_SHIFT) : state;
+            layout.characters[state | LAYOUT_CAPSLOCK][k] = layout.characters[from][k];
+            if (IsLayoutDeadKey(layout, from, keycode)) {
+                SetDead(layout, state | LAYOUT_CAPSLOCK, keycode);
+            }
+        }
+    }
+}
+
+/* One character of a layout description. Returns false if it isn't one. */
+bool ParseCharacter(char const *token, size_t length, uint16_t &character, bool &dead)
+{
+    dead = (length > 5) && (strncmp(token, "dead:", 5) == 0);
+    if (dead) {
+        token += 5;
+        length -= 5;
+    }
+    static struct { char const *name; uint16_t character; } const names[] = {
+        { "-", 0 },
+        { "space", ' ' },
+        { "hash", '#' },
+        { "dash", '-' },
+        { "tab", '\t' },
+        { "enter", '\n' },
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if ((strlen(names[i].name) == length) && (memcmp(names[i].name, token, length) == 0)) {
+            character = names[i].character;
+            return !dead || (character != 0);
+        }
+    }
+
+    return DecodeLayoutCharacter(token, length, character);
+}
+
+} // namespace
+
+bool DecodeLayoutCharacter(char const *text, size_t length, uint16_t &character)
+{
+    unsigned char const *bytes = reinterpret_cast<unsigned char const *>(text);
+    uint32_t code;
+    size_t size;
+    if (length == 0) {
+        return false;
+    } else if (bytes[0] < 0x80) {
+        code = bytes[0];
+        size = 1;
+    } else if ((bytes[0] & 0xE0) == 0xC0) {
+        code = bytes[0] & 0x1F;
+        size = 2;
+    } else if ((bytes[0] & 0xF0) == 0xE0) {
+        code = bytes[0] & 0x0F;
+        size = 3;
+    } else {
+        return false;
+    }
+    if (length != size) {
+        return false;
+    }
+    for (size_t i = 1; i < size; ++i) {
+        if ((bytes[i] & 0xC0) != 0x80) {
+            return false;
+        }
+        code = (code << 6) | (bytes[i] & 0x3F);
+    }
+    if ((code < 0x20) || ((size == 2) && (code < 0x80)) || ((size == 3) && (code < 0x800)) ||
+        ((code >= 0xD800) && (code < 0xE000))) {
+        return false;
+    }
+    character = static_cast<uint16_t>(code);
+    return true;
+}
+
+void BuildUsLayout(LayoutTable &layout)
+{
+    memset(&layout, 0, sizeof(layout));
+    layout.id = LayoutIdFromName("us");
+    snprintf(layout.name, sizeof(layout.name), "us");
+    for (unsigned k = 0; k < 256; ++k) {
+        uint8_t keycode = static_cast<uint8_t>(k);
+        layout.characters[0][k] = static_cast<unsigned char>(CKeymap::CharacterFromStroke(MakeStroke(0, keycode)));
+        layout.characters[LAYOUT_SHIFT][k] =
+            static_cast<unsigned char>(CKeymap::CharacterFromStroke(MakeStroke(KEYMOD_SHIFT, keycode)));
+    }
+    ApplyCapsLock(layout);
+}
+
+bool ParseLayout(char const *text, size_t length, LayoutTable &layout, KeymapError *error)
+{
+    memset(&layout, 0, sizeof(layout));
+    unsigned line = 1;
+    size_t pos = 0;
+    while (pos < length) {
+        size_t lineEnd = pos;
+        while ((lineEnd < length) && (text[lineEnd] != '\n')) {
+            ++lineEnd;
+        }
+        uint8_t keycode = 0;
+        unsigned state = 0;
+        size_t i = pos;
+        while (i < lineEnd) {
+            while ((i < lineEnd) && IsSpace(text[i])) {
+                ++i;
+            }
+            if ((i == lineEnd) || (text[i] == '#')) {
+                break;
+            }
+            char const *token = text + i;
+            while ((i < lineEnd) && !IsSpace(text[i])) {
+                ++i;
+            }
+            size_t tokenLength = static_cast<size_t>(text + i - token);
+            if (!keycode) {
+                keycode = CKeymap::KeycodeFromName(token, tokenLength);
+                if (!keycode) {
+                    SetError(error, line, "Unknown key", token, tokenLength);
+                    return false;
+                }
+                continue;
+            }
+            if (state == LAYOUT_CAPSLOCK) {
+                SetError(error, line, "Too many characters", token, tokenLength);
+                return false;
+            }
+            uint16_t character = 0;
+            bool dead = false;
+            if (!ParseCharacter(token, tokenLength, character, dead)) {
+                SetError(error, line, "Bad character", token, tokenLength);
+                return false;
+            }
+            layout.characters[state][keycode] = character;
+            if (dead) {
+                SetDead(layout, state, keycode);
+            }
+            ++state;
+        }
+        if (keycode && (state == 0)) {
+            SetError(error, line, "A key needs a character", "", 0);
+            return false;
+        }
+        pos = lineEnd + 1;
+        ++line;
+    }
+    ApplyCapsLock(layout);
+    return true;
+}
+
+uint64_t LayoutIdFromName(char const *name)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (; *name; ++name) {
+        hash = (hash ^ static_cast<unsigned char>(*name)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+#ifdef _WIN32
+
+void BuildLayout(HKL hkl, LayoutTable &layout)
+{
+    memset(&layout, 0, sizeof(layout));
+    layout.id = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(hkl));
+    snprintf(layout.name, sizeof(layout.name), "%08llX", static_cast<unsigned long long>(layout.id));
+
+    // Flag 4 keeps ToUnicodeEx() from changing the keyboard state (Windows 10 1607 on).
+    UINT const KEEP_STATE = 4;
+    BYTE const noKeys[256] = {};
+    UINT spaceScan = ::MapVirtualKeyEx(VK_SPACE, MAPVK_VK_TO_VSC, hkl);
+    for (unsigned state = 0; state < LAYOUT_SHIFT_STATES; ++state) {
+        BYTE keys[256] = {};
+        if (state & LAYOUT_SHIFT) {
+            keys[VK_SHIFT] = keys[VK_LSHIFT] = 0x80;
+        }
+        if (state & LAYOUT_ALTGR) {
+            keys[VK_CONTROL] = keys[VK_LCONTROL] = keys[VK_MENU] = keys[VK_RMENU] = 0x80;
+        }
+        if (state & LAYOUT_CAPSLOCK) {
+            keys[VK_CAPITAL] = 0x01;
+        }
+        for (unsigned vk = 0; vk < 256; ++vk) {
+            uint8_t keycode = static_cast<uint8_t>(vk);
+            if (IsMouseButton(vk) || IsVirtualTap(vk)) {
+                continue;
+            }
+            UINT scan = ::MapVirtualKeyEx(vk, MAPVK_VK_TO_VSC, hkl);
+            if (!scan) {
+                continue;
+            }
+            WCHAR buffer[8];
+            int count = ::ToUnicodeEx(vk, scan, keys, buffer, 8, KEEP_STATE, hkl);
+            if (count < 0) {
+                // A dead key. Older Windows ignores the flag and leaves it pending, so
+                // finish it off with a space before it spoils the next key.
+                SetDead(layout, state, keycode);
+                WCHAR flush[8];
+                for (unsigned tries = 0; (tries < 4) &&
+                    (::ToUnicodeEx(VK_SPACE, spaceScan, noKeys, flush, 8, KEEP_STATE, hkl) < 0); ++tries) {
+                }
+                count = 1;
+            }
+            if (count != 1) {
+                continue;
+            }
+            WCHAR c = buffer[0];
+            if (c == L'\r') {
+                c = L'\n';
+            } else if (((c < 0x20) && (c != L'\t')) || (c == 0x7F)) {
+                c = 0;
+            }
+            layout.characters[state][keycode] = static_cast<uint16_t>(c);
+        }
+    }
+}
+
+#endif
+
+CLayoutCache::CLayoutCache() :
+    m_current(nullptr),
+    m_buildCount(0),
+    m_switchCount(0)
+{
+}
+
+LayoutTable const *CLayoutCache::Find(uint64_t id) const
+{
+    for (size_t i = 0; i < m_valid.size(); ++i) {
+        if (m_valid[i]->id == id) {
+            return m_valid[i];
+        }
+    }
+    return nullptr;
+}
+
+LayoutTable const *CLayoutCache::Add(std::unique_ptr<LayoutTable> layout)
+{
+    LayoutTable const *added = layout.get();
+    m_tables.push_back(std::move(layout));
+    size_t i = 0;
+    while ((i < m_valid.size()) && (m_valid[i]->id != added->id)) {
+        ++i;
+    }
+    if (i == m_valid.size()) {
+        m_valid.push_back(added);
+    } else {
+        m_valid[i] = added;
+    }
+    m_buildCount.store(m_buildCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return added;
+}
+
+void CLayoutCache::Invalidate()
+{
+    m_valid.clear();
+}
+
+void CLayoutCache::SetCurrent(LayoutTable const *layout)
+{
+    // The table is complete before it's published, and never changes afterwards.
+    if (m_current.exchange(layout, std::memory_order_acq_rel) != layout) {
+        m_switchCount.store(m_switchCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
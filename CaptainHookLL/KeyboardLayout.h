@@ -0,0 +1,169 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "KeyState.h"
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+struct KeymapError;
+
+/* The shift states a layout's characters depend on, as LAYOUT_* bits: 8 in all. AltGr is
+   right Alt, or Ctrl and Alt together, as Windows has it. */
+enum
+{
+    LAYOUT_SHIFT = 0x01,
+    LAYOUT_ALTGR = 0x02,
+    LAYOUT_CAPSLOCK = 0x04,
+};
+static unsigned const LAYOUT_SHIFT_STATES = 8;
+
+/* What LayoutShiftState() returns while Ctrl, Alt or Win is held on its own: keys type no
+   characters then, only shortcuts. */
+static unsigned const LAYOUT_NO_CHARACTERS = LAYOUT_SHIFT_STATES;
+
+static size_t const LAYOUT_NAME_LENGTH = 32;
+
+/* What every key types in every shift state on one keyboard layout, worked out once so
+   that looking a character up is one load. Characters are UTF-16 code units (0 for none;
+   characters beyond the BMP are left out), with Enter typing '\n'. A dead key types
+   nothing itself but changes what the next key types; its character is the accent it
+   types when followed by Space. */
+struct LayoutTable
+{
+    uint64_t id;        // the HKL on Windows; LayoutIdFromName() on Linux
+    char name[LAYOUT_NAME_LENGTH];
+    uint16_t characters[LAYOUT_SHIFT_STATES][256];
+    uint64_t deadKeys[LAYOUT_SHIFT_STATES][4];
+};
+
+/* The shift state for CKeyStateTracker::GetModifierSnapshot() bits, or
+   LAYOUT_NO_CHARACTERS. */
+inline unsigned LayoutShiftState(uint32_t keyState)
+{
+    bool control = (keyState & (KEYSTATE_LCONTROL | KEYSTATE_RCONTROL)) != 0;
+    bool alt = (keyState & (KEYSTATE_LALT | KEYSTATE_RALT)) != 0;
+    bool altGr = ((keyState & KEYSTATE_RALT) != 0) || (control && alt);
+    if ((keyState & (KEYSTATE_LWIN | KEYSTATE_RWIN)) || ((control || alt) && !altGr)) {
+        return LAYOUT_NO_CHARACTERS;
+    }
+    return ((keyState & (KEYSTATE_LSHIFT | KEYSTATE_RSHIFT)) ? LAYOUT_SHIFT : 0) |
+        (altGr ? LAYOUT_ALTGR : 0) |
+        ((keyState & KEYSTATE_CAPSLOCK) ? LAYOUT_CAPSLOCK : 0);
+}
+
+inline uint16_t LayoutCharacter(LayoutTable const &layout, unsigned shiftState, uint8_t keycode)
+{
+    return (shiftState < LAYOUT_SHIFT_STATES) ? layout.characters[shiftState][keycode] : 0;
+}
+
+inline bool IsLayoutDeadKey(LayoutTable const &layout, unsigned shiftState, uint8_t keycode)
+{
+    return (shiftState < LAYOUT_SHIFT_STATES) && ((layout.deadKeys[shiftState][keycode >> 6] >> (keycode & 63)) & 1);
+}
+
+/* A US keyboard, as CKeymap::CharacterFromStroke() has it. */
+void BuildUsLayout(LayoutTable &layout);
+
+/* Build a layout from a description, one key per line:
+
+     <key> <plain> [<shift> [<altgr> [<shift+altgr>]]]
+
+   Keys are named as in the keymap, which on Linux means by where they are on a US
+   keyboard. Characters are UTF-8, one to a state, "-" for none and "dead:<c>" for a dead
+   key; "space", "hash", "dash", "tab" and "enter" stand for those characters. Keys not
+   described type nothing. Caps Lock swaps the plain and shifted characters of keys whose plain
+   character is a letter (and leaves AltGr alone). The id and name are left for the
+   caller. */
+bool ParseLayout(char const *text, size_t length, LayoutTable &layout, KeymapError *error);
+
+/* One UTF-8 character in the BMP, as layout descriptions and keymaps give them. False if
+   text is anything more or less, or a control character. */
+bool DecodeLayoutCharacter(char const *text, size_t length, uint16_t &character);
+
+/* A stable id for a layout known by name. */
+uint64_t LayoutIdFromName(char const *name);
+
+#ifdef _WIN32
+/* Ask Windows what each key types on the layout, with ToUnicodeEx() told not to change
+   the keyboard state, so dead keys typed meanwhile aren't disturbed. Not for the hook: it
+   makes about 2,000 calls. */
+void BuildLayout(HKL hkl, LayoutTable &layout);
+#endif
+
+/* The layouts in use, each built once, and which one the focused window has. Whatever
+   watches for layout changes calls SetCurrent(); the hook reads GetCurrent() on every
+   key it needs a character for: one atomic load.
+
+   Tables are kept until the cache is destroyed, even once invalidated, so a pointer the
+   hook has read stays valid. Invalidate() only makes Find() miss, so that a layout whose
+   definition may have changed is built again; that, and the handful of layouts anyone
+   uses, keep the total small.
+
+   Add(), Find() and Invalidate() from any one thread at a time; GetCurrent() and
+   SetCurrent() from any thread. */
+class CLayoutCache
+{
+public:
+    CLayoutCache();
+
+    /* The table with this id, or NULL if there isn't a valid one. */
+    LayoutTable const *Find(uint64_t id) const;
+
+    /* Take a table that's been filled in, in place of any valid one with the same id. */
+    LayoutTable const *Add(std::unique_ptr<LayoutTable> layout);
+
+    void Invalidate();
+
+    /* NULL for none, in which case keys type what they would on a US keyboard. */
+    void SetCurrent(LayoutTable const *layout);
+    LayoutTable const *GetCurrent() const { return m_current.load(std::memory_order_acquire); }
+
+    uint32_t GetBuildCount() const { return m_buildCount.load(std::memory_order_relaxed); }
+    /* Times the current layout changed, not counting a switch to the one already current. */
+    uint32_t GetSwitchCount() const { return m_switchCount.load(std::memory_order_relaxed); }
+
+private:
+    CLayoutCache(CLayoutCache const &) = delete;
+    CLayoutCache &operator=(CLayoutCache const &) = delete;
+
+    std::vector<std::unique_ptr<LayoutTable>> m_tables;     // every one built
+    std::vector<LayoutTable const *> m_valid;
+    std::atomic<LayoutTable const *> m_current;
+    std::atomic<uint32_t> m_buildCount;
+    std::atomic<uint32_t> m_switchCount;
+};
@@ -0,0 +1,1669 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "Keymap.h"
+#include "KeyboardLayout.h"
+#include "VirtualKeys.h"
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace {
+
+struct KeyName
+{
+    char const *name;
+    uint8_t keycode;
+};
+
+KeyName const s_keyNames[] = {
+    { "Backspace", VKEY_BACK },
+    { "Tab", VKEY_TAB },
+    { "Enter", VKEY_RETURN },
+    { "Return", VKEY_RETURN },
+    { "Shift", VKEY_SHIFT },
+    { "Ctrl", VKEY_CONTROL },
+    { "Alt", VKEY_MENU },
+    { "Pause", VKEY_PAUSE },
+    { "CapsLock", VKEY_CAPITAL },
+    { "Escape", VKEY_ESCAPE },
+    { "Esc", VKEY_ESCAPE },
+    { "Space", VKEY_SPACE },
+    { "PageUp", VKEY_PRIOR },
+    { "PageDown", VKEY_NEXT },
+    { "End", VKEY_END },
+    { "Home", VKEY_HOME },
+    { "Left", VKEY_LEFT },
+    { "Up", VKEY_UP },
+    { "Right", VKEY_RIGHT },
+    { "Down", VKEY_DOWN },
+    { "PrintScreen", VKEY_SNAPSHOT },
+    { "Insert", VKEY_INSERT },
+    { "Delete", VKEY_DELETE },
+    { "LWin", VKEY_LWIN },
+    { "RWin", VKEY_RWIN },
+    { "Apps", VKEY_APPS },
+    { "Multiply", VKEY_MULTIPLY },
+    { "Add", VKEY_ADD },
+    { "Subtract", VKEY_SUBTRACT },
+    { "Decimal", VKEY_DECIMAL },
+    { "Divide", VKEY_DIVIDE },
+    { "NumLock", VKEY_NUMLOCK },
+    { "ScrollLock", VKEY_SCROLL },
+    { "LShift", VKEY_LSHIFT },
+    { "RShift", VKEY_RSHIFT },
+    { "LCtrl", VKEY_LCONTROL },
+    { "RCtrl", VKEY_RCONTROL },
+    { "LAlt", VKEY_LMENU },
+    { "RAlt", VKEY_RMENU },
+    { "Semicolon", VKEY_OEM_1 },
+    { "Equals", VKEY_OEM_PLUS },
+    { "Comma", VKEY_OEM_COMMA },
+    { "Minus", VKEY_OEM_MINUS },
+    { "Period", VKEY_OEM_PERIOD },
+    { "Slash", VKEY_OEM_2 },
+    { "Backquote", VKEY_OEM_3 },
+    { "LBracket", VKEY_OEM_4 },
+    { "Backslash", VKEY_OEM_5 },
+    { "RBracket", VKEY_OEM_6 },
+    { "Quote", VKEY_OEM_7 },
+    { "IntlBackslash", VKEY_OEM_102 },
+    { "LButton", VKEY_LBUTTON },
+    { "RButton", VKEY_RBUTTON },
+    { "MButton", VKEY_MBUTTON },
+    { "XButton1", VKEY_XBUTTON1 },
+    { "XButton2", VKEY_XBUTTON2 },
+    { "WheelUp", VKEY_WHEEL_UP },
+    { "WheelDown", VKEY_WHEEL_DOWN },
+    { "WheelLeft", VKEY_WHEEL_LEFT },
+    { "WheelRight", VKEY_WHEEL_RIGHT },
+    { "FlickLeft", VKEY_FLICK_LEFT },
+    { "FlickRight", VKEY_FLICK_RIGHT },
+    { "FlickUp", VKEY_FLICK_UP },
+    { "FlickDown", VKEY_FLICK_DOWN },
+};
+
+/* The keys of a US keyboard that type punctuation or digits: what each types on its own
+   and with Shift. */
+struct CharacterKey
+{
+    char plain;
+    char shifted;
+    uint8_t keycode;
+};
+
+CharacterKey const s_characterKeys[] = {
+    { '1', '!', '1' },
+    { '2', '@', '2' },
+    { '3', '#', '3' },
+    { '4', '$', '4' },
+    { '5', '%', '5' },
+    { '6', '^', '6' },
+    { '7', '&', '7' },
+    { '8', '*', '8' },
+    { '9', '(', '9' },
+    { '0', ')', '0' },
+    { ';', ':', VKEY_OEM_1 },
+    { '=', '+', VKEY_OEM_PLUS },
+    { ',', '<', VKEY_OEM_COMMA },
+    { '-', '_', VKEY_OEM_MINUS },
+    { '.', '>', VKEY_OEM_PERIOD },
+    { '/', '?', VKEY_OEM_2 },
+    { '`', '~', VKEY_OEM_3 },
+    { '[', '{', VKEY_OEM_4 },
+    { '\\', '|', VKEY_OEM_5 },
+    { ']', '}', VKEY_OEM_6 },
+    { '\'', '"', VKEY_OEM_7 },
+};
+
+KeyName const s_modifierNames[] = {
+    { "Shift", KEYMOD_SHIFT },
+    { "Ctrl", KEYMOD_CONTROL },
+    { "Control", KEYMOD_CONTROL },
+    { "Alt", KEYMOD_ALT },
+    { "Win", KEYMOD_WIN },
+};
+
+bool EqualsIgnoreCase(char const *a, size_t aLength, char const *b)
+{
+    size_t bLength = strlen(b);
+    if (aLength != bLength) {
+        return false;
+    }
+    for (size_t i = 0; i < aLength; ++i) {
+        char ca = a[i];
+        char cb = b[i];
+        if ((ca >= 'A') && (ca <= 'Z')) {
+            ca = static_cast<char>(ca - 'A' + 'a');
+        }
+        if ((cb >= 'A') && (cb <= 'Z')) {
+            cb = static_cast<char>(cb - 'A' + 'a');
+        }
+        if (ca != cb) {
+            return false;
+        }
+    }
+    return true;
+}
+
+unsigned CountBits(unsigned value)
+{
+    unsigned count = 0;
+    for (; value; value &= value - 1) {
+        ++count;
+    }
+    return count;
+}
+
+void SetError(KeymapError *error, unsigned line, char const *message, char const *token, size_t tokenLength)
+{
+    if (!error) {
+        return;
+    }
+    error->line = line;
+    if (tokenLength == 0) {
+        snprintf(error->message, sizeof(error->message), "%s", message);
+    } else {
+        snprintf(error->message, sizeof(error->message), "%s '%.*s'", message, static_cast<int>(tokenLength), token);
+    }
+}
+
+uint32_t Checksum(uint8_t const *data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Parse a keyspec's modifiers, spec[0, length) being each of them followed by '+'. */
+bool ParseModifiers(char const *spec, size_t length, KeyBinding &binding)
+{
+    binding.modifiers = 0;
+    binding.modifierMask = KEYMOD_SHIFT | KEYMOD_CONTROL | KEYMOD_ALT | KEYMOD_WIN;
+    size_t start = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (spec[i] != '+') {
+            continue;
+        }
+        char const *modifier = spec + start;
+        size_t modifierLength = i - start;
+        if ((modifierLength == 1) && (modifier[0] == '*')) {
+            binding.modifierMask = 0;
+        } else {
+            uint8_t bit = 0;
+            for (size_t n = 0; n < sizeof(s_modifierNames) / sizeof(s_modifierNames[0]); ++n) {
+                if (EqualsIgnoreCase(modifier, modifierLength, s_modifierNames[n].name)) {
+                    bit = s_modifierNames[n].keycode;
+                    break;
+                }
+            }
+            if (!bit) {
+                return false;
+            }
+            binding.modifiers |= bit;
+        }
+        start = i + 1;
+    }
+
+    // Explicitly named modifiers are always significant, even after a '*'.
+    binding.modifierMask |= binding.modifiers;
+    return true;
+}
+
+bool ParseKeySpec(char const *spec, size_t length, KeyBinding &binding)
+{
+    // Everything up to the last '+' is a modifier; the remainder is the key.
+    size_t keyStart = length;
+    while ((keyStart > 0) && (spec[keyStart - 1] != '+')) {
+        --keyStart;
+    }
+    if (!ParseModifiers(spec, keyStart, binding)) {
+        return false;
+    }
+    binding.keycode = CKeymap::KeycodeFromName(spec + keyStart, length - keyStart);
+    return binding.keycode != 0;
+}
+
+/* The lower case of a letter with one, for matching characters whatever their case:
+   Latin-1, Greek and Cyrillic, like the letters Caps Lock works on. */
+uint16_t LowerCase(uint16_t c)
+{
+    if (((c >= 'A') && (c <= 'Z')) || ((c >= 0xC0) && (c <= 0xDE) && (c != 0xD7)) ||
+        ((c >= 0x391) && (c <= 0x3AB) && (c != 0x3A2)) || ((c >= 0x410) && (c <= 0x42F))) {
+        return static_cast<uint16_t>(c + 0x20);
+    }
+    if ((c >= 0x400) && (c <= 0x40F)) {
+        return static_cast<uint16_t>(c + 0x50);
+    }
+    return c;
+}
+
+/* Parse a keyspec whose key is a character in single quotes, such as "Ctrl+'z'" or
+   "'+'". Returns false if spec isn't one at all; returns true with character == 0 if it
+   is one but is malformed. */
+bool ParseCharacterSpec(char const *spec, size_t length, KeyBinding &binding, uint16_t &character)
+{
+    char const *quote = static_cast<char const *>(memchr(spec, '\'', length));
+    size_t keyStart = quote ? static_cast<size_t>(quote - spec) : length;
+    if ((length < 3) || (keyStart + 2 > length) || (spec[length - 1] != '\'') ||
+        ((keyStart > 0) && (spec[keyStart - 1] != '+'))) {
+        return false;
+    }
+    character = 0;
+    if (ParseModifiers(spec, keyStart, binding) &&
+        DecodeLayoutCharacter(spec + keyStart + 1, length - keyStart - 2, character)) {
+        character = LowerCase(character);
+        binding.keycode = 0;
+    }
+    return true;
+}
+
+/* Parse "Ctrl+K,Ctrl+C" or "Ctrl+J&K". Returns false if spec isn't a sequence or chord at
+   all; returns true with sequence.length == 0 if it is one but is malformed. */
+bool ParseSequenceSpec(char const *spec, size_t length, SequenceBinding &sequence)
+{
+    char separator = 0;
+    for (size_t i = 0; (i < length) && !separator; ++i) {
+        if ((spec[i] == ',') || (spec[i] == '&')) {
+            separator = spec[i];
+        }
+    }
+    if (!separator) {
+        return false;
+    }
+
+    sequence.length = 0;
+    sequence.chord = (separator == '&');
+    unsigned chordModifiers = 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= length; ++i) {
+        if ((i < length) && (spec[i] != separator)) {
+            continue;
+        }
+        if (sequence.length >= SEQUENCE_MAX_LENGTH) {
+            sequence.length = 0;
+            return true;
+        }
+        KeyBinding stroke;
+        if (!ParseKeySpec(spec + start, i - start, stroke) ||
+            (stroke.modifierMask != (KEYMOD_SHIFT | KEYMOD_CONTROL | KEYMOD_ALT | KEYMOD_WIN)) ||
+            (sequence.chord && (sequence.length > 0) && (stroke.modifiers != 0))) {
+            sequence.length = 0;
+            return true;
+        }
+        if (sequence.length == 0) {
+            chordModifiers = stroke.modifiers;
+        }
+        unsigned modifiers = sequence.chord ? chordModifiers : stroke.modifiers;
+        sequence.strokes[sequence.length++] = MakeStroke(modifiers, stroke.keycode);
+        start = i + 1;
+    }
+    if (sequence.length < 2) {
+        sequence.length = 0;
+    }
+    return true;
+}
+
+/* Parse "Ctrl+C,Tab,Ctrl+V" onto the end of strokes. */
+bool ParseSendSpec(char const *spec, size_t length, std::vector<uint16_t> &strokes)
+{
+    size_t start = 0;
+    for (size_t i = 0; i <= length; ++i) {
+        if ((i < length) && (spec[i] != ',')) {
+            continue;
+        }
+        KeyBinding stroke;
+        if (!ParseKeySpec(spec + start, i - start, stroke) ||
+            (stroke.modifierMask != (KEYMOD_SHIFT | KEYMOD_CONTROL | KEYMOD_ALT | KEYMOD_WIN))) {
+            return false;
+        }
+        strokes.push_back(MakeStroke(stroke.modifiers, stroke.keycode));
+        start = i + 1;
+    }
+    return true;
+}
+
+/* Turn the text between a text="..." token's quotes into strokes on the end of strokes.
+   Returns NULL, or the character (or escape) that can't be typed. */
+char const *ParseText(char const *text, size_t length, std::vector<uint16_t> &strokes)
+{
+    for (size_t i = 0; i < length; ++i) {
+        char c = text[i];
+        if (c == '\\') {
+            if (++i >= length) {
+                return text + i - 1;
+            }
+            switch (text[i]) {
+            case 'n':
+                c = '\n';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case '\\':
+            case '"':
+                c = text[i];
+                break;
+            default:
+                return text + i - 1;
+            }
+        }
+        uint16_t stroke = CKeymap::StrokeFromCharacter(c);
+        if (!stroke) {
+            return text + i;
+        }
+        strokes.push_back(stroke);
+    }
+    return nullptr;
+}
+
+/* Parse the "::btw" that starts an abbreviation's line. Returns false if spec isn't an
+   abbreviation at all; returns true with expansion.length == 0 if it is one but can't be
+   typed. */
+bool ParseAbbreviation(char const *spec, size_t length, ExpansionBinding &expansion)
+{
+    if ((length < 2) || (spec[0] != ':') || (spec[1] != ':')) {
+        return false;
+    }
+    expansion.length = 0;
+    if ((length == 2) || (length - 2 > EXPANSION_MAX_LENGTH)) {
+        return true;
+    }
+    for (size_t i = 2; i < length; ++i) {
+        if ((CExpansionTable::SymbolFromCharacter(spec[i]) == CExpansionTable::NO_SYMBOL) || !CKeymap::StrokeFromCharacter(spec[i])) {
+            return true;
+        }
+        expansion.text[i - 2] = spec[i];
+    }
+    expansion.length = static_cast<uint8_t>(length - 2);
+    return true;
+}
+
+/* Make the strokes from first on into a new macro and return its action. */
+char const *AddMacro(std::vector<KeymapMacro> &macros, std::vector<uint16_t> const &strokes, size_t first, uint16_t &action)
+{
+    size_t length = strokes.size() - first;
+    if (length == 0) {
+        return "Nothing to send";
+    }
+    if (length > KEYMAP_MACRO_MAX_STROKES) {
+        return "Too many keys to send";
+    }
+    if (macros.size() > static_cast<size_t>(KEYMAP_ACTION_MAX - KEYMAP_MACRO_FIRST)) {
+        return "Too many macros";
+    }
+    action = static_cast<uint16_t>(KEYMAP_MACRO_FIRST + macros.size());
+    KeymapMacro macro = { static_cast<uint32_t>(first), static_cast<uint16_t>(length), 0 };
+    macros.push_back(macro);
+    return nullptr;
+}
+
+bool MacrosAreValid(KeymapMacro const *macros, size_t count, size_t strokeCount)
+{
+    if (count > static_cast<size_t>(KEYMAP_ACTION_MAX - KEYMAP_MACRO_FIRST + 1)) {
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if ((macros[i].length == 0) || (macros[i].length > KEYMAP_MACRO_MAX_STROKES) ||
+            (macros[i].first > strokeCount) || (strokeCount - macros[i].first < macros[i].length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IsValidAction(uint16_t action, size_t macroCount)
+{
+    if (action > KEYMAP_ACTION_MAX) {
+        return false;
+    }
+    return !IsKeymapMacro(action) || (static_cast<size_t>(action - KEYMAP_MACRO_FIRST) < macroCount);
+}
+
+/* The hook counts layers by a key's layer and sends its tap and hold keys as they are. */
+bool IsValidTapHold(TapHoldTable const &table)
+{
+    for (unsigned k = 0; k < KEYMAP_KEYS; ++k) {
+        TapHoldKey const &key = table.keys[k];
+        bool dual = (key.role == TAPHOLD_MOD_TAP) || (key.role == TAPHOLD_LAYER_TAP);
+        bool layered = (key.role != TAPHOLD_NONE) && (key.role != TAPHOLD_MOD_TAP);
+        if ((key.role > TAPHOLD_TOGGLE) || (key.layer >= TAPHOLD_LAYERS) || (layered && (key.layer == 0)) ||
+            (dual && ((key.tap == 0) || (key.timeout > TAPHOLD_MAX_TIMEOUT))) ||
+            ((key.role == TAPHOLD_MOD_TAP) && (key.hold == 0))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t CountTapHoldKeys(TapHoldTable const &table)
+{
+    uint32_t count = 0;
+    for (unsigned k = 0; k < KEYMAP_KEYS; ++k) {
+        bool used = (table.keys[k].role != TAPHOLD_NONE);
+        for (unsigned layer = 1; !used && (layer < TAPHOLD_LAYERS); ++layer) {
+            used = (table.layers[layer][k] != 0);
+        }
+        count += used ? 1 : 0;
+    }
+    return count;
+}
+
+bool ParseNumber(char const *text, size_t length, unsigned maximum, uint16_t &value)
+{
+    unsigned number = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if ((text[i] < '0') || (text[i] > '9')) {
+            return false;
+        }
+        number = number * 10 + static_cast<unsigned>(text[i] - '0');
+        if (number > maximum) {
+            return false;
+        }
+    }
+    value = static_cast<uint16_t>(number);
+    return length > 0;
+}
+
+bool ParseAction(char const *name, size_t length, KeymapActionName const *actions, size_t actionCount, uint16_t &action)
+{
+    for (size_t i = 0; i < actionCount; ++i) {
+        if (EqualsIgnoreCase(name, length, actions[i].name)) {
+            action = actions[i].action;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool IsSpace(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+/* Parse a section header, "[notepad.exe wordpad.exe]" or "[*]", adding a profile for each
+   application named, starting at binding first. Returns NULL, or what's wrong with it. */
+char const *ParseSection(char const *text, size_t length, uint32_t first, std::vector<KeymapProfile> &profiles, bool &everyApplication)
+{
+    size_t end = 1;
+    while ((end < length) && (text[end] != ']')) {
+        ++end;
+    }
+    if (end >= length) {
+        return "Unterminated section";
+    }
+    for (size_t i = end + 1; (i < length) && (text[i] != '#'); ++i) {
+        if (!IsSpace(text[i])) {
+            return "Unexpected text after section";
+        }
+    }
+
+    everyApplication = false;
+    size_t added = 0;
+    size_t i = 1;
+    for (;;) {
+        while ((i < end) && (IsSpace(text[i]) || (text[i] == ','))) {
+            ++i;
+        }
+        if (i >= end) {
+            break;
+        }
+        size_t start = i;
+        while ((i < end) && !IsSpace(text[i]) && (text[i] != ',')) {
+            ++i;
+        }
+        if ((i - start == 1) && (text[start] == '*')) {
+            everyApplication = true;
+            continue;
+        }
+        if (i - start >= APP_NAME_LENGTH) {
+            return "Application name too long";
+        }
+        KeymapProfile profile;
+        memset(&profile, 0, sizeof(profile));
+        for (size_t n = start; n < i; ++n) {
+            char c = text[n];
+            profile.app[n - start] = ((c >= 'A') && (c <= 'Z')) ? static_cast<char>(c - 'A' + 'a') : c;
+        }
+        profile.first = first;
+        for (size_t n = 0; n < profiles.size(); ++n) {
+            if (strcmp(profiles[n].app, profile.app) == 0) {
+                return "Application already has a section";
+            }
+        }
+        profiles.push_back(profile);
+        ++added;
+    }
+    // Either [*] or applications, not both or neither.
+    if (everyApplication == (added > 0)) {
+        return "Bad section";
+    }
+    return nullptr;
+}
+
+/* The bindings up to end belong to the profiles from first on. */
+void EndSection(std::vector<KeymapProfile> &profiles, size_t &first, size_t end)
+{
+    for (size_t i = first; i < profiles.size(); ++i) {
+        profiles[i].count = static_cast<uint32_t>(end - profiles[i].first);
+    }
+    first = profiles.size();
+}
+
+/* Apply bindings order[] to table, least specific first so that more specific ones
+   overwrite them. A conditional binding doesn't overwrite an entry but wraps it in a rule
+   (added to rules) that picks between the binding and the entry. */
+bool ApplyBindings(KeyBinding const *bindings, std::vector<size_t> &order, size_t macroCount,
+    CRuleTable &rules, size_t conditionCount, KeymapTable &table)
+{
+    std::stable_sort(order.begin(), order.end(), [bindings](size_t a, size_t b) {
+        return CountBits(bindings[a].modifierMask) < CountBits(bindings[b].modifierMask);
+    });
+    for (size_t i = 0; i < order.size(); ++i) {
+        KeyBinding const &binding = bindings[order[i]];
+        if (!IsValidAction(binding.pressAction, macroCount) || !IsValidAction(binding.releaseAction, macroCount)) {
+            return false;
+        }
+        KeymapEntry entry = static_cast<KeymapEntry>(binding.pressAction) |
+            (static_cast<KeymapEntry>(binding.releaseAction) << 16) |
+            (binding.repeat ? KEYMAP_ENTRY_REPEAT : 0) |
+            (binding.consume ? KEYMAP_ENTRY_CONSUME : 0);
+        if (binding.condition > conditionCount) {
+            return false;
+        }
+        for (unsigned modifiers = 0; modifiers < KEYMAP_MODIFIER_STATES; ++modifiers) {
+            if ((modifiers & binding.modifierMask) != (binding.modifiers & binding.modifierMask)) {
+                continue;
+            }
+            KeymapEntry &slot = table.entries[modifiers][binding.keycode];
+            if (binding.condition == 0) {
+                slot = entry;
+                continue;
+            }
+            uint32_t rule = rules.AddRule(binding.condition - 1u, entry, slot);
+            if (rule == CRuleTable::NO_RULE) {
+                return false;
+            }
+            slot = MakeKeymapRuleEntry(rule);
+        }
+    }
+    return true;
+}
+
+/* Keymap tables are cache-line aligned, which plain new doesn't promise before C++17. */
+void *AlignedAllocate(size_t size)
+{
+#ifdef _WIN32
+    void *p = _aligned_malloc(size, alignof(KeymapTable));
+#else
+    void *p = nullptr;
+    if (posix_memalign(&p, alignof(KeymapTable), size) != 0) {
+        p = nullptr;
+    }
+#endif
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void AlignedFree(void *p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+} // namespace
+
+CKeymap::CKeymap() :
+    m_table(&m_ownTable),
+    m_profileTables(nullptr),
+    m_profileTableCount(0),
+    m_profiles(nullptr),
+    m_profileCount(0),
+    m_ownProfileTables(nullptr),
+    m_characters(nullptr),
+    m_characterCount(0),
+    m_characterTable(nullptr),
+    m_ownCharacterTable(nullptr),
+    m_macros(nullptr),
+    m_macroCount(0),
+    m_macroStrokes(nullptr),
+    m_debounce(m_ownDebounce),
+    m_tapHold(&m_ownTapHold)
+{
+    Clear();
+}
+
+CKeymap::~CKeymap()
+{
+    FreeTables();
+}
+
+void CKeymap::Clear()
+{
+    memset(&m_ownTable, 0, sizeof(m_ownTable));
+    m_table = &m_ownTable;
+    FreeTables();
+    m_ownProfiles.clear();
+    m_profiles = nullptr;
+    m_profileCount = 0;
+    m_ownCharacters.clear();
+    m_sequences.Clear();
+    m_expansions.Clear();
+    m_rules.Clear();
+    m_ownMacros.clear();
+    m_ownMacroStrokes.clear();
+    m_macros = nullptr;
+    m_macroCount = 0;
+    m_macroStrokes = nullptr;
+    memset(m_ownDebounce, 0, sizeof(m_ownDebounce));
+    m_debounce = m_ownDebounce;
+    memset(&m_ownTapHold, 0, sizeof(m_ownTapHold));
+    m_tapHold = &m_ownTapHold;
+    m_image.Close();
+}
+
+bool CKeymap::Compile(KeymapSource const &source)
+{
+    CRuleTable rules;
+    if (!MacrosAreValid(source.macros, source.macroCount, source.macroStrokeCount) ||
+        !rules.SetConditions(source.conditions, source.conditionCount) ||
+        (source.tapHold && !IsValidTapHold(*source.tapHold))) {
+        return false;
+    }
+
+    // Sort out which bindings belong to profiles, and which distinct sets of bindings the
+    // profiles have between them; each set gets a table.
+    std::vector<bool> inProfile(source.bindingCount, false);
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    std::vector<ProfileEntry> profileEntries;
+    for (size_t i = 0; i < source.profileCount; ++i) {
+        KeymapProfile const &profile = source.profiles[i];
+        size_t nameLength = 0;
+        while ((nameLength < APP_NAME_LENGTH) && profile.app[nameLength]) {
+            ++nameLength;
+        }
+        if ((nameLength == 0) || (nameLength == APP_NAME_LENGTH) ||
+            (profile.first > source.bindingCount) || (source.bindingCount - profile.first < profile.count)) {
+            return false;
+        }
+        std::pair<uint32_t, uint32_t> range(profile.first, profile.count);
+        size_t table = std::find(ranges.begin(), ranges.end(), range) - ranges.begin();
+        if (table == ranges.size()) {
+            ranges.push_back(range);
+        }
+        ProfileEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        for (size_t n = 0; n < nameLength; ++n) {
+            char c = profile.app[n];
+            entry.app[n] = ((c >= 'A') && (c <= 'Z')) ? static_cast<char>(c - 'A' + 'a') : c;
+        }
+        entry.table = static_cast<uint32_t>(table);
+        profileEntries.push_back(entry);
+        for (size_t n = profile.first; n < profile.first + profile.count; ++n) {
+            inProfile[n] = true;
+        }
+    }
+    std::sort(profileEntries.begin(), profileEntries.end(), [](ProfileEntry const &a, ProfileEntry const &b) {
+        return strcmp(a.app, b.app) < 0;
+    });
+    for (size_t i = 1; i < profileEntries.size(); ++i) {
+        if (strcmp(profileEntries[i - 1].app, profileEntries[i].app) == 0) {
+            return false;
+        }
+    }
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < source.bindingCount; ++i) {
+        if (!inProfile[i]) {
+            order.push_back(i);
+        }
+    }
+    KeymapTable table;
+    memset(&table, 0, sizeof(table));
+    if (!ApplyBindings(source.bindings, order, source.macroCount, rules, source.conditionCount, table)) {
+        return false;
+    }
+
+    // A profile's table is the keymap's, with whatever the profile binds taking over (or,
+    // for its conditional bindings, falling back on the keymap's).
+    std::unique_ptr<KeymapTable, void (*)(void *)> profileTables(nullptr, AlignedFree);
+    if (!ranges.empty()) {
+        profileTables.reset(static_cast<KeymapTable *>(AlignedAllocate(ranges.size() * sizeof(KeymapTable))));
+    }
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        order.clear();
+        for (uint32_t i = ranges[r].first; i < ranges[r].first + ranges[r].second; ++i) {
+            order.push_back(i);
+        }
+        KeymapTable &profileTable = profileTables.get()[r];
+        profileTable = table;
+        if (!ApplyBindings(source.bindings, order, source.macroCount, rules, source.conditionCount, profileTable)) {
+            return false;
+        }
+    }
+
+    // Bound characters get a table of their own, indexed by where they come in order.
+    // Which key types each one is up to the layout of the moment (see MapCharacterKeys()).
+    std::vector<uint16_t> characters;
+    for (size_t i = 0; i < source.characterBindingCount; ++i) {
+        CharacterBinding const &binding = source.characterBindings[i];
+        if ((binding.character == 0) || (binding.binding.condition != 0)) {
+            return false;
+        }
+        characters.push_back(LowerCase(binding.character));
+    }
+    std::sort(characters.begin(), characters.end());
+    characters.erase(std::unique(characters.begin(), characters.end()), characters.end());
+    if (characters.size() > KEYMAP_MAX_CHARACTERS) {
+        return false;
+    }
+    std::unique_ptr<KeymapTable, void (*)(void *)> characterTable(nullptr, AlignedFree);
+    if (!characters.empty()) {
+        characterTable.reset(static_cast<KeymapTable *>(AlignedAllocate(sizeof(KeymapTable))));
+        memset(characterTable.get(), 0, sizeof(KeymapTable));
+        std::vector<KeyBinding> characterBindings;
+        order.clear();
+        for (size_t i = 0; i < source.characterBindingCount; ++i) {
+            KeyBinding binding = source.characterBindings[i].binding;
+            uint16_t character = LowerCase(source.characterBindings[i].character);
+            binding.keycode = static_cast<uint8_t>(
+                std::lower_bound(characters.begin(), characters.end(), character) - characters.begin());
+            characterBindings.push_back(binding);
+            order.push_back(i);
+        }
+        if (!ApplyBindings(characterBindings.data(), order, source.macroCount, rules, 0, *characterTable)) {
+            return false;
+        }
+    }
+
+    CSequenceTable sequenceTable;
+    for (size_t i = 0; i < source.sequenceCount; ++i) {
+        if (!IsValidAction(source.sequences[i].action, source.macroCount)) {
+            return false;
+        }
+    }
+    if (!sequenceTable.Compile(source.sequences, source.sequenceCount)) {
+        return false;
+    }
+
+    CExpansionTable expansionTable;
+    for (size_t i = 0; i < source.expansionCount; ++i) {
+        uint16_t action = source.expansions[i].action;
+        if (!IsKeymapMacro(action) || !IsValidAction(action, source.macroCount)) {
+            return false;
+        }
+    }
+    if (!expansionTable.Compile(source.expansions, source.expansionCount)) {
+        return false;
+    }
+
+    m_ownTable = table;
+    m_table = &m_ownTable;
+    FreeTables();
+    m_ownProfileTables = profileTables.release();
+    m_profileTables = m_ownProfileTables;
+    m_profileTableCount = ranges.size();
+    m_ownProfiles = std::move(profileEntries);
+    m_profiles = m_ownProfiles.data();
+    m_profileCount = m_ownProfiles.size();
+    m_ownCharacterTable = characterTable.release();
+    m_characterTable = m_ownCharacterTable;
+    m_ownCharacters = std::move(characters);
+    m_characters = m_ownCharacters.data();
+    m_characterCount = m_ownCharacters.size();
+    m_sequences = std::move(sequenceTable);
+    m_expansions = std::move(expansionTable);
+    m_rules = std::move(rules);
+    m_ownMacros.assign(source.macros, source.macros + source.macroCount);
+    m_ownMacroStrokes.assign(source.macroStrokes, source.macroStrokes + source.macroStrokeCount);
+    m_macros = m_ownMacros.data();
+    m_macroCount = source.macroCount;
+    m_macroStrokes = m_ownMacroStrokes.data();
+    if (source.debounceTimes) {
+        memcpy(m_ownDebounce, source.debounceTimes, sizeof(m_ownDebounce));
+    } else {
+        memset(m_ownDebounce, 0, sizeof(m_ownDebounce));
+    }
+    m_debounce = m_ownDebounce;
+    if (source.tapHold) {
+        m_ownTapHold = *source.tapHold;
+        m_ownTapHold.keyCount = CountTapHoldKeys(m_ownTapHold);
+    } else {
+        memset(&m_ownTapHold, 0, sizeof(m_ownTapHold));
+    }
+    m_tapHold = &m_ownTapHold;
+    m_image.Close();
+    return true;
+}
+
+void CKeymap::WriteImage(std::vector<uint8_t> &image) const
+{
+    KeymapImageHeader header;
+    memset(&header, 0, sizeof(header));
+    image.assign(sizeof(header), 0);
+
+    image.resize((image.size() + 63) & ~static_cast<size_t>(63));
+    header.tableOffset = static_cast<uint32_t>(image.size());
+    uint8_t const *table = reinterpret_cast<uint8_t const *>(m_table);
+    image.insert(image.end(), table, table + sizeof(KeymapTable));
+
+    image.resize((image.size() + 63) & ~static_cast<size_t>(63));
+    header.sequenceOffset = static_cast<uint32_t>(image.size());
+    m_sequences.WriteImage(image);
+    header.sequenceSize = static_cast<uint32_t>(image.size() - header.sequenceOffset);
+
+    image.resize((image.size() + 3) & ~static_cast<size_t>(3));
+    header.macroOffset = static_cast<uint32_t>(image.size());
+    header.macroCount = static_cast<uint32_t>(m_macroCount);
+    uint8_t const *macros = reinterpret_cast<uint8_t const *>(m_macros);
+    image.insert(image.end(), macros, macros + m_macroCount * sizeof(KeymapMacro));
+
+    size_t strokeCount = 0;
+    for (size_t i = 0; i < m_macroCount; ++i) {
+        strokeCount = std::max<size_t>(strokeCount, m_macros[i].first + m_macros[i].length);
+    }
+    header.macroStrokeOffset = static_cast<uint32_t>(image.size());
+    header.macroStrokeCount = static_cast<uint32_t>(strokeCount);
+    uint8_t const *strokes = reinterpret_cast<uint8_t const *>(m_macroStrokes);
+    image.insert(image.end(), strokes, strokes + strokeCount * sizeof(uint16_t));
+
+    image.resize((image.size() + 63) & ~static_cast<size_t>(63));
+    header.expansionOffset = static_cast<uint32_t>(image.size());
+    m_expansions.WriteImage(image);
+    header.expansionSize = static_cast<uint32_t>(image.size() - header.expansionOffset);
+
+    image.resize((image.size() + 63) & ~static_cast<size_t>(63));
+    header.profileTableOffset = static_cast<uint32_t>(image.size());
+    header.profileTableCount = static_cast<uint32_t>(m_profileTableCount);
+    uint8_t const *profileTables = reinterpret_cast<uint8_t const *>(m_profileTables);
+    image.insert(image.end(), profileTables, profileTables + m_profileTableCount * sizeof(KeymapTable));
+    header.profileOffset = static_cast<uint32_t>(image.size());
+    header.profileCount = static_cast<uint32_t>(m_profileCount);
+    uint8_t const *profiles = reinterpret_cast<uint8_t const *>(m_profiles);
+    image.insert(image.end(), profiles, profiles + m_profileCount * sizeof(ProfileEntry));
+
+    image.resize((image.size() + 63) & ~static_cast<size_t>(63));
+    header.ruleOffset = static_cast<uint32_t>(image.size());
+    m_rules.WriteImage(image);
+    header.ruleSize = static_cast<uint32_t>(image.size() - header.ruleOffset);
+
+    image.resize((image.size() + 1) & ~static_cast<size_t>(1));
+    header.debounceOffset = static_cast<uint32_t>(image.size());
+    uint8_t const *debounce = reinterpret_cast<uint8_t const *>(m_debounce);
+    image.insert(image.end(), debounce, debounce + KEYMAP_KEYS * sizeof(uint16_t));
+
+    image.resize((image.size() + 3) & ~static_cast<size_t>(3));
+    header.tapHoldOffset = static_cast<uint32_t>(image.size());
+    uint8_t const *tapHold = reinterpret_cast<uint8_t const *>(m_tapHold);
+    image.insert(image.end(), tapHold, tapHold + sizeof(TapHoldTable));
+
+    image.resize((image.size() + 1) & ~static_cast<size_t>(1));
+    header.characterOffset = static_cast<uint32_t>(image.size());
+    header.characterCount = static_cast<uint32_t>(m_characterCount);
+    uint8_t const *characters = reinterpret_cast<uint8_t const *>(m_characters);
+    image.insert(image.end(), characters, characters + m_characterCount * sizeof(uint16_t));
+    if (m_characterCount) {
+        image.resize((image.size() + 63) & ~static_cast<size_t>(63));
+        header.characterTableOffset = static_cast<uint32_t>(image.size());
+        uint8_t const *characterTable = reinterpret_cast<uint8_t const *>(m_characterTable);
+        image.insert(image.end(), characterTable, characterTable + sizeof(KeymapTable));
+    }
+
+    header.magic = KEYMAP_IMAGE_MAGIC;
+    header.version = KEYMAP_IMAGE_VERSION;
+    header.size = static_cast<uint32_t>(image.size());
+    header.checksum = Checksum(image.data() + sizeof(header), image.size() - sizeof(header));
+    memcpy(image.data(), &header, sizeof(header));
+}
+
+bool CKeymap::AttachImage(void const *image, size_t size, KeymapError *error)
+{
+    KeymapImageHeader const *header = static_cast<KeymapImageHeader const *>(image);
+    uint8_t const *bytes = static_cast<uint8_t const *>(image);
+    if ((reinterpret_cast<uintptr_t>(image) & 63) || (size < sizeof(KeymapImageHeader)) ||
+        (header->magic != KEYMAP_IMAGE_MAGIC) || (header->version != KEYMAP_IMAGE_VERSION) || (header->size != size)) {
+        SetError(error, 0, "Not a keymap image", "", 0);
+        return false;
+    }
+    if ((header->tableOffset & 63) || (header->tableOffset > size) || (size - header->tableOffset < sizeof(KeymapTable)) ||
+        (header->sequenceOffset & 63) || (header->sequenceOffset > size) || (size - header->sequenceOffset < header->sequenceSize) ||
+        (header->macroOffset & 3) || (header->macroOffset > size) ||
+        ((size - header->macroOffset) / sizeof(KeymapMacro) < header->macroCount) ||
+        (header->macroStrokeOffset & 1) || (header->macroStrokeOffset > size) ||
+        ((size - header->macroStrokeOffset) / sizeof(uint16_t) < header->macroStrokeCount) ||
+        (header->expansionOffset & 63) || (header->expansionOffset > size) || (size - header->expansionOffset < header->expansionSize) ||
+        (header->profileTableOffset & 63) || (header->profileTableOffset > size) ||
+        ((size - header->profileTableOffset) / sizeof(KeymapTable) < header->profileTableCount) ||
+        (header->profileOffset & 3) || (header->profileOffset > size) ||
+        ((size - header->profileOffset) / sizeof(ProfileEntry) < header->profileCount) ||
+        (header->ruleOffset & 63) || (header->ruleOffset > size) || (size - header->ruleOffset < header->ruleSize) ||
+        (header->debounceOffset & 1) || (header->debounceOffset > size) ||
+        ((size - header->debounceOffset) / sizeof(uint16_t) < KEYMAP_KEYS) ||
+        (header->tapHoldOffset & 3) || (header->tapHoldOffset > size) || (size - header->tapHoldOffset < sizeof(TapHoldTable)) ||
+        (header->characterOffset & 1) || (header->characterOffset > size) ||
+        ((size - header->characterOffset) / sizeof(uint16_t) < header->characterCount) ||
+        (header->characterCount > KEYMAP_MAX_CHARACTERS) || ((header->characterCount != 0) &&
+            ((header->characterTableOffset & 63) || (header->characterTableOffset > size) ||
+            (size - header->characterTableOffset < sizeof(KeymapTable)))) ||
+        (Checksum(bytes + sizeof(KeymapImageHeader), size - sizeof(KeymapImageHeader)) != header->checksum)) {
+        SetError(error, 0, "Corrupt keymap image", "", 0);
+        return false;
+    }
+
+    KeymapMacro const *macros = reinterpret_cast<KeymapMacro const *>(bytes + header->macroOffset);
+    TapHoldTable const *tapHold = reinterpret_cast<TapHoldTable const *>(bytes + header->tapHoldOffset);
+    CSequenceTable sequences;
+    CExpansionTable expansions;
+    CRuleTable rules;
+    if (!MacrosAreValid(macros, header->macroCount, header->macroStrokeCount) || !IsValidTapHold(*tapHold) ||
+        !sequences.AttachImage(bytes + header->sequenceOffset, header->sequenceSize) ||
+        !expansions.AttachImage(bytes + header->expansionOffset, header->expansionSize) ||
+        !rules.AttachImage(bytes + header->ruleOffset, header->ruleSize)) {
+        SetError(error, 0, "Corrupt keymap image", "", 0);
+        return false;
+    }
+    // The hook follows rule entries without checking them.
+    KeymapTable const *tables[3] = {
+        reinterpret_cast<KeymapTable const *>(bytes + header->tableOffset),
+        reinterpret_cast<KeymapTable const *>(bytes + header->profileTableOffset),
+        header->characterCount ? reinterpret_cast<KeymapTable const *>(bytes + header->characterTableOffset) : nullptr
+    };
+    size_t tableCounts[3] = { 1, header->profileTableCount, header->characterCount ? 1u : 0u };
+    for (size_t t = 0; t < 3; ++t) {
+        KeymapEntry const *entries = &tables[t]->entries[0][0];
+        for (size_t i = 0; i < tableCounts[t] * KEYMAP_MODIFIER_STATES * KEYMAP_KEYS; ++i) {
+            if (KeymapIsRule(entries[i]) && (KeymapRuleIndex(entries[i]) >= rules.GetRuleCount())) {
+                SetError(error, 0, "Corrupt keymap image", "", 0);
+                return false;
+            }
+        }
+    }
+    // Profiles are found by binary search, so they must be in order, and each must name
+    // a table.
+    ProfileEntry const *profiles = reinterpret_cast<ProfileEntry const *>(bytes + header->profileOffset);
+    for (size_t i = 0; i < header->profileCount; ++i) {
+        if ((profiles[i].table >= header->profileTableCount) || !memchr(profiles[i].app, 0, APP_NAME_LENGTH) ||
+            ((i > 0) && (strcmp(profiles[i - 1].app, profiles[i].app) >= 0))) {
+            SetError(error, 0, "Corrupt keymap image", "", 0);
+            return false;
+        }
+    }
+    // Characters are found by binary search too.
+    uint16_t const *characters = reinterpret_cast<uint16_t const *>(bytes + header->characterOffset);
+    for (size_t i = 1; i < header->characterCount; ++i) {
+        if (characters[i - 1] >= characters[i]) {
+            SetError(error, 0, "Corrupt keymap image", "", 0);
+            return false;
+        }
+    }
+    // An abbreviation's action goes straight to the output engine, so it has to be a macro.
+    for (size_t i = 0; i < expansions.GetStateCount(); ++i) {
+        uint16_t action = expansions.GetAction(static_cast<uint32_t>(i));
+        if ((action != KEYMAP_ACTION_NONE) && (!IsKeymapMacro(action) || !IsValidAction(action, header->macroCount))) {
+            SetError(error, 0, "Corrupt keymap image", "", 0);
+            return false;
+        }
+    }
+    m_table = reinterpret_cast<KeymapTable const *>(bytes + header->tableOffset);
+    FreeTables();
+    m_profileTables = reinterpret_cast<KeymapTable const *>(bytes + header->profileTableOffset);
+    m_profileTableCount = header->profileTableCount;
+    m_ownProfiles.clear();
+    m_profiles = profiles;
+    m_profileCount = header->profileCount;
+    m_ownCharacters.clear();
+    m_characters = characters;
+    m_characterCount = header->characterCount;
+    m_characterTable = tables[2];
+    m_sequences = std::move(sequences);
+    m_expansions = std::move(expansions);
+    m_rules = std::move(rules);
+    m_macros = macros;
+    m_macroCount = header->macroCount;
+    m_macroStrokes = reinterpret_cast<uint16_t const *>(bytes + header->macroStrokeOffset);
+    m_ownMacros.clear();
+    m_ownMacroStrokes.clear();
+    m_debounce = reinterpret_cast<uint16_t const *>(bytes + header->debounceOffset);
+    m_tapHold = tapHold;
+    return true;
+}
+
+KeymapTable const &CKeymap::GetProfileTable(AppIdentity const &app) const
+{
+    size_t low = 0;
+    size_t high = m_profileCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int order = strncmp(m_profiles[middle].app, app.name, APP_NAME_LENGTH);
+        if (order == 0) {
+            return m_profileTables[m_profiles[middle].table];
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return *m_table;
+}
+
+void CKeymap::MapCharacterKeys(LayoutTable const *layout, uint8_t keys[KEYMAP_KEYS]) const
+{
+    uint16_t const *end = m_characters + m_characterCount;
+    for (unsigned k = 0; k < KEYMAP_KEYS; ++k) {
+        uint8_t keycode = static_cast<uint8_t>(k);
+        uint16_t c = layout ? LayoutCharacter(*layout, 0, keycode) :
+            static_cast<unsigned char>(CharacterFromStroke(MakeStroke(0, keycode)));
+        c = LowerCase(c);
+        uint16_t const *found = std::lower_bound(m_characters, end, c);
+        keys[k] = ((c != 0) && (found != end) && (*found == c)) ? static_cast<uint8_t>(found - m_characters + 1) : 0;
+    }
+}
+
+void CKeymap::FreeTables()
+{
+    AlignedFree(m_ownProfileTables);
+    m_ownProfileTables = nullptr;
+    m_profileTables = nullptr;
+    m_profileTableCount = 0;
+    AlignedFree(m_ownCharacterTable);
+    m_ownCharacterTable = nullptr;
+    m_characterTable = nullptr;
+    m_characters = nullptr;
+    m_characterCount = 0;
+}
+
+bool CKeymap::MapImage(FileNameChar const *path, KeymapError *error)
+{
+    CMappedFile file;
+    if (!file.Open(path)) {
+        SetError(error, 0, "Can't open the keymap image", "", 0);
+        return false;
+    }
+    if (!AttachImage(file.GetData(), file.GetSize(), error)) {
+        return false;
+    }
+    // The keymap now lives in the new mapping; take it over, dropping any old one.
+    m_image.Swap(file);
+    return true;
+}
+
+bool CKeymap::Load(char const *text, size_t length,
+    KeymapActionName const *actions, size_t actionCount,
+    KeymapError *error)
+{
+    std::vector<KeyBinding> bindings;
+    std::vector<CharacterBinding> characterBindings;
+    std::vector<SequenceBinding> sequences;
+    std::vector<KeymapMacro> macros;
+    std::vector<uint16_t> macroStrokes;
+    std::vector<ExpansionBinding> expansions;
+    std::vector<KeymapProfile> profiles;
+    std::vector<RuleCondition> conditions;
+    uint16_t debounceTimes[KEYMAP_KEYS] = {};
+    TapHoldTable tapHold;
+    memset(&tapHold, 0, sizeof(tapHold));
+    size_t sectionStart = 0;    // the current section's first profile
+    bool inSection = false;
+    unsigned line = 1;
+    size_t pos = 0;
+    while (pos < length) {
+        size_t lineEnd = pos;
+        while ((lineEnd < length) && (text[lineEnd] != '\n')) {
+            ++lineEnd;
+        }
+
+        // A section header ends the section before it.
+        size_t start = pos;
+        while ((start < lineEnd) && IsSpace(text[start])) {
+            ++start;
+        }
+        if ((start < lineEnd) && (text[start] == '[')) {
+            EndSection(profiles, sectionStart, bindings.size());
+            size_t headerLength = lineEnd - start;
+            while ((headerLength > 0) && IsSpace(text[start + headerLength - 1])) {
+                --headerLength;
+            }
+            bool everyApplication = false;
+            char const *problem = ParseSection(text + start, headerLength,
+                static_cast<uint32_t>(bindings.size()), profiles, everyApplication);
+            if (problem) {
+                SetError(error, line, problem, text + start, headerLength);
+                return false;
+            }
+            inSection = !everyApplication;
+            pos = lineEnd + 1;
+            ++line;
+            continue;
+        }
+
+        KeyBinding binding = { 0, 0, 0, true, false, KEYMAP_ACTION_NONE, KEYMAP_ACTION_NONE, 0 };
+        SequenceBinding sequence;
+        memset(&sequence, 0, sizeof(sequence));
+        ExpansionBinding expansion;
+        memset(&expansion, 0, sizeof(expansion));
+        bool haveKey = false;
+        bool isCharacter = false;
+        uint16_t character = 0;
+        bool isSequence = false;
+        bool isExpansion = false;
+        bool haveMacro = false;
+        uint16_t rate = 0;
+        bool isDebounce = false;
+        bool haveDebounceTime = false;
+        uint16_t debounceTime = 0;
+        std::vector<uint8_t> debounceKeys;
+        bool isTapHold = false;
+        bool isLayer = false;
+        uint8_t tapHoldKeycode = 0;
+        TapHoldKey tapHoldKey = { TAPHOLD_NONE, 0, 0, 0, 0 };
+        uint16_t toggleLayer = 0;
+        uint16_t layer = 0;
+        std::vector<std::pair<uint8_t, uint8_t>> layerKeys;
+        size_t i = pos;
+        while (i < lineEnd) {
+            while ((i < lineEnd) && IsSpace(text[i])) {
+                ++i;
+            }
+            if ((i >= lineEnd) || (text[i] == '#')) {
+                break;
+            }
+            char const *token = text + i;
+            while ((i < lineEnd) && !IsSpace(text[i])) {
+                // Quoted text runs to the closing quote, spaces and all.
+                if (text[i] == '"') {
+                    for (++i; (i < lineEnd) && (text[i] != '"'); ++i) {
+                        if ((text[i] == '\\') && (i + 1 < lineEnd)) {
+                            ++i;
+                        }
+                    }
+                    if (i >= lineEnd) {
+                        SetError(error, line, "Unterminated text", token, static_cast<size_t>(text + i - token));
+                        return false;
+                    }
+                }
+                ++i;
+            }
+            size_t tokenLength = static_cast<size_t>(text + i - token);
+
+            // Whatever the line's first token is, this is where its macro's action goes.
+            uint16_t &macroAction = isExpansion ? expansion.action : (isSequence ? sequence.action : binding.pressAction);
+            if (!haveKey && EqualsIgnoreCase(token, tokenLength, "debounce")) {
+                isDebounce = true;
+                haveKey = true;
+            } else if (isDebounce) {
+                if (!haveDebounceTime) {
+                    if (!ParseNumber(token, tokenLength, KEYMAP_MAX_DEBOUNCE, debounceTime)) {
+                        SetError(error, line, "Bad debounce time", token, tokenLength);
+                        return false;
+                    }
+                    haveDebounceTime = true;
+                } else {
+                    uint8_t keycode = KeycodeFromName(token, tokenLength);
+                    if (!keycode) {
+                        SetError(error, line, "Unknown key", token, tokenLength);
+                        return false;
+                    }
+                    debounceKeys.push_back(keycode);
+                }
+            } else if (!haveKey && EqualsIgnoreCase(token, tokenLength, "taphold")) {
+                isTapHold = true;
+                haveKey = true;
+            } else if (isTapHold) {
+                char const *problem = nullptr;
+                if (!tapHoldKeycode) {
+                    tapHoldKeycode = KeycodeFromName(token, tokenLength);
+                    problem = tapHoldKeycode ? nullptr : "Unknown key";
+                } else if ((tokenLength > 4) && (strncmp(token, "tap=", 4) == 0)) {
+                    tapHoldKey.tap = KeycodeFromName(token + 4, tokenLength - 4);
+                    problem = tapHoldKey.tap ? nullptr : "Unknown key";
+                } else if ((tokenLength > 5) && (strncmp(token, "hold=", 5) == 0)) {
+                    tapHoldKey.hold = KeycodeFromName(token + 5, tokenLength - 5);
+                    problem = tapHoldKey.hold ? nullptr : "Unknown key";
+                } else if ((tokenLength > 6) && (strncmp(token, "layer=", 6) == 0)) {
+                    problem = (!ParseNumber(token + 6, tokenLength - 6, TAPHOLD_LAYERS - 1, layer) || (layer == 0)) ?
+                        "Bad layer" : nullptr;
+                } else if ((tokenLength > 7) && (strncmp(token, "toggle=", 7) == 0)) {
+                    problem = (!ParseNumber(token + 7, tokenLength - 7, TAPHOLD_LAYERS - 1, toggleLayer) || (toggleLayer == 0)) ?
+                        "Bad layer" : nullptr;
+                } else if ((tokenLength > 8) && (strncmp(token, "timeout=", 8) == 0)) {
+                    problem = (!ParseNumber(token + 8, tokenLength - 8, TAPHOLD_MAX_TIMEOUT, tapHoldKey.timeout) ||
+                        (tapHoldKey.timeout == 0)) ? "Bad timeout" : nullptr;
+                } else {
+                    problem = "Unexpected";
+                }
+                if (problem) {
+                    SetError(error, line, problem, token, tokenLength);
+                    return false;
+                }
+            } else if (!haveKey && EqualsIgnoreCase(token, tokenLength, "layer")) {
+                isLayer = true;
+                haveKey = true;
+            } else if (isLayer) {
+                if (layer == 0) {
+                    if (!ParseNumber(token, tokenLength, TAPHOLD_LAYERS - 1, layer) || (layer == 0)) {
+                        SetError(error, line, "Bad layer", token, tokenLength);
+                        return false;
+                    }
+                    continue;
+                }
+                char const *equals = static_cast<char const *>(memchr(token, '=', tokenLength));
+                size_t fromLength = equals ? static_cast<size_t>(equals - token) : 0;
+                uint8_t from = equals ? KeycodeFromName(token, fromLength) : 0;
+                uint8_t to = equals ? KeycodeFromName(equals + 1, tokenLength - fromLength - 1) : 0;
+                if (!from || !to) {
+                    SetError(error, line, "Bad mapping", token, tokenLength);
+                    return false;
+                }
+                layerKeys.push_back(std::make_pair(from, to));
+            } else if (!haveKey) {
+                isExpansion = ParseAbbreviation(token, tokenLength, expansion);
+                if (isExpansion) {
+                    if (expansion.length == 0) {
+                        SetError(error, line, "Bad abbreviation", token, tokenLength);
+                        return false;
+                    }
+                    haveKey = true;
+                    continue;
+                }
+                isCharacter = ParseCharacterSpec(token, tokenLength, binding, character);
+                if (isCharacter) {
+                    if (character == 0) {
+                        SetError(error, line, "Bad character", token, tokenLength);
+                        return false;
+                    }
+                    haveKey = true;
+                    continue;
+                }
+                isSequence = ParseSequenceSpec(token, tokenLength, sequence);
+                if (isSequence ? (sequence.length == 0) : !ParseKeySpec(token, tokenLength, binding)) {
+                    SetError(error, line, isSequence ? "Bad sequence" : "Unknown key", token, tokenLength);
+                    return false;
+                }
+                haveKey = true;
+            } else if (isExpansion && haveMacro && (tokenLength > 5) &&
+                ((strncmp(token, "send=", 5) == 0) || (strncmp(token, "text=", 5) == 0))) {
+                SetError(error, line, "Unexpected", token, tokenLength);
+                return false;
+            } else if (!isExpansion && (tokenLength > 6) && (strncmp(token, "press=", 6) == 0)) {
+                uint16_t &action = isSequence ? sequence.action : binding.pressAction;
+                if (!ParseAction(token + 6, tokenLength - 6, actions, actionCount, action)) {
+                    SetError(error, line, "Unknown action", token + 6, tokenLength - 6);
+                    return false;
+                }
+            } else if (isSequence && (tokenLength > 8) && (strncmp(token, "timeout=", 8) == 0)) {
+                if (!ParseNumber(token + 8, tokenLength - 8, 0xFFFF, sequence.timeout) || (sequence.timeout == 0)) {
+                    SetError(error, line, "Bad timeout", token + 8, tokenLength - 8);
+                    return false;
+                }
+            } else if ((tokenLength > 5) && (strncmp(token, "send=", 5) == 0)) {
+                // An abbreviation's macro starts by erasing it.
+                size_t first = macroStrokes.size();
+                macroStrokes.insert(macroStrokes.end(), expansion.length, MakeStroke(0, VKEY_BACK));
+                if (!ParseSendSpec(token + 5, tokenLength - 5, macroStrokes)) {
+                    SetError(error, line, "Bad keys", token + 5, tokenLength - 5);
+                    return false;
+                }
+                char const *problem = AddMacro(macros, macroStrokes, first, macroAction);
+                if (problem) {
+                    SetError(error, line, problem, token, tokenLength);
+                    return false;
+                }
+                haveMacro = true;
+            } else if ((tokenLength >= 7) && (strncmp(token, "text=\"", 6) == 0) && (token[tokenLength - 1] == '"')) {
+                size_t first = macroStrokes.size();
+                macroStrokes.insert(macroStrokes.end(), expansion.length, MakeStroke(0, VKEY_BACK));
+                char const *bad = ParseText(token + 6, tokenLength - 7, macroStrokes);
+                if (bad) {
+                    SetError(error, line, "Can't type", bad, (*bad == '\\') ? 2 : 1);
+                    return false;
+                }
+                char const *problem = AddMacro(macros, macroStrokes, first, macroAction);
+                if (problem) {
+                    SetError(error, line, problem, token, tokenLength);
+                    return false;
+                }
+                haveMacro = true;
+            } else if ((tokenLength > 5) && (strncmp(token, "rate=", 5) == 0)) {
+                if (!ParseNumber(token + 5, tokenLength - 5, 0xFFFF, rate) || (rate == 0)) {
+                    SetError(error, line, "Bad rate", token + 5, tokenLength - 5);
+                    return false;
+                }
+            } else if (isSequence || isExpansion) {
+                SetError(error, line, "Unexpected", token, tokenLength);
+                return false;
+            } else if ((tokenLength > 8) && (strncmp(token, "release=", 8) == 0)) {
+                if (!ParseAction(token + 8, tokenLength - 8, actions, actionCount, binding.releaseAction)) {
+                    SetError(error, line, "Unknown action", token + 8, tokenLength - 8);
+                    return false;
+                }
+            } else if ((tokenLength > 5) && (strncmp(token, "when=", 5) == 0)) {
+                char const *expression = token + 5;
+                size_t expressionLength = tokenLength - 5;
+                if ((expressionLength >= 2) && (expression[0] == '"') && (expression[expressionLength - 1] == '"')) {
+                    ++expression;
+                    expressionLength -= 2;
+                }
+                RuleCondition condition;
+                char const *where = nullptr;
+                char const *problem = CompileRuleCondition(expression, expressionLength, condition, where);
+                if (problem) {
+                    SetError(error, line, problem, where, static_cast<size_t>(expression + expressionLength - where));
+                    return false;
+                }
+                // Lines with the same condition share it.
+                size_t index = 0;
+                while ((index < conditions.size()) && ((conditions[index].length != condition.length) ||
+                    (memcmp(conditions[index].code, condition.code, condition.length * sizeof(uint32_t)) != 0))) {
+                    ++index;
+                }
+                if (index == 0xFFFF) {
+                    SetError(error, line, "Too many conditions", token, tokenLength);
+                    return false;
+                }
+                if (index == conditions.size()) {
+                    conditions.push_back(condition);
+                }
+                binding.condition = static_cast<uint16_t>(index + 1);
+            } else if (EqualsIgnoreCase(token, tokenLength, "pass")) {
+                binding.consume = false;
+            } else if (EqualsIgnoreCase(token, tokenLength, "repeat")) {
+                binding.repeat = true;
+            } else {
+                SetError(error, line, "Unexpected", token, tokenLength);
+                return false;
+            }
+        }
+        if (rate && !haveMacro) {
+            SetError(error, line, "rate= needs send= or text=", "", 0);
+            return false;
+        }
+        if (haveMacro) {
+            macros.back().rate = rate;
+        }
+        if (isDebounce) {
+            if (!haveDebounceTime) {
+                SetError(error, line, "debounce needs a time in milliseconds", "", 0);
+                return false;
+            }
+            if (inSection) {
+                SetError(error, line, "Debounce times apply to every application", "", 0);
+                return false;
+            }
+            // The wheel turns faster than any key chatters, so it's left out of "every key".
+            for (unsigned k = 0; debounceKeys.empty() && (k < KEYMAP_KEYS); ++k) {
+                debounceTimes[k] = IsVirtualTap(k) ? 0 : debounceTime;
+            }
+            for (size_t k = 0; k < debounceKeys.size(); ++k) {
+                debounceTimes[debounceKeys[k]] = debounceTime;
+            }
+        }
+        if (isTapHold) {
+            if (!tapHoldKeycode) {
+                SetError(error, line, "taphold needs a key", "", 0);
+                return false;
+            }
+            if (inSection) {
+                SetError(error, line, "Tap-hold keys apply to every application", "", 0);
+                return false;
+            }
+            bool hasTap = (tapHoldKey.tap != 0);
+            bool hasHold = (tapHoldKey.hold != 0);
+            if (hasTap && hasHold && !layer && !toggleLayer) {
+                tapHoldKey.role = TAPHOLD_MOD_TAP;
+            } else if (hasTap && !hasHold && layer && !toggleLayer) {
+                tapHoldKey.role = TAPHOLD_LAYER_TAP;
+            } else if (!hasTap && !hasHold && !tapHoldKey.timeout && (!layer != !toggleLayer)) {
+                tapHoldKey.role = layer ? TAPHOLD_MOMENTARY : TAPHOLD_TOGGLE;
+            } else {
+                SetError(error, line, "taphold needs tap= with hold= or layer=, or else layer= or toggle=", "", 0);
+                return false;
+            }
+            tapHoldKey.layer = static_cast<uint8_t>(layer ? layer : toggleLayer);
+            if (!tapHoldKey.timeout) {
+                tapHoldKey.timeout = TAPHOLD_DEFAULT_TIMEOUT;
+            }
+            tapHold.keys[tapHoldKeycode] = tapHoldKey;
+        }
+        if (isLayer) {
+            if (layer == 0) {
+                SetError(error, line, "layer needs a number", "", 0);
+                return false;
+            }
+            if (inSection) {
+                SetError(error, line, "Layers apply to every application", "", 0);
+                return false;
+            }
+            for (size_t k = 0; k < layerKeys.size(); ++k) {
+                tapHold.layers[layer][layerKeys[k].first] = layerKeys[k].second;
+            }
+        }
+        if (inSection && (isSequence || isExpansion)) {
+            SetError(error, line, "Only keys can be bound per application", "", 0);
+            return false;
+        }
+        if (isCharacter && inSection) {
+            SetError(error, line, "Keys named by character apply to every application", "", 0);
+            return false;
+        }
+        if (isCharacter && binding.condition) {
+            SetError(error, line, "Keys named by character can't have a condition", "", 0);
+            return false;
+        }
+        if (isExpansion) {
+            if (!haveMacro) {
+                SetError(error, line, "Abbreviation needs send= or text=", "", 0);
+                return false;
+            }
+            expansions.push_back(expansion);
+        } else if (haveKey && isSequence) {
+            if (sequence.action == KEYMAP_ACTION_NONE) {
+                SetError(error, line, "Sequence needs an action", "press=", 6);
+                return false;
+            }
+            sequences.push_back(sequence);
+        } else if (isCharacter) {
+            CharacterBinding characterBinding = { character, binding };
+            characterBindings.push_back(characterBinding);
+        } else if (haveKey) {
+            bindings.push_back(binding);
+        }
+
+        pos = lineEnd + 1;
+        ++line;
+    }
+
+    EndSection(profiles, sectionStart, bindings.size());
+
+    KeymapSource source;
+    source.bindings = bindings.data();
+    source.bindingCount = bindings.size();
+    source.characterBindings = characterBindings.data();
+    source.characterBindingCount = characterBindings.size();
+    source.sequences = sequences.data();
+    source.sequenceCount = sequences.size();
+    source.macros = macros.data();
+    source.macroCount = macros.size();
+    source.macroStrokes = macroStrokes.data();
+    source.macroStrokeCount = macroStrokes.size();
+    source.expansions = expansions.data();
+    source.expansionCount = expansions.size();
+    source.profiles = profiles.data();
+    source.profileCount = profiles.size();
+    source.conditions = conditions.data();
+    source.conditionCount = conditions.size();
+    source.debounceTimes = debounceTimes;
+    source.tapHold = &tapHold;
+    if (!Compile(source)) {
+        SetError(error, 0, "Too many actions or states", "", 0);
+        return false;
+    }
+    return true;
+}
+
+uint16_t CKeymap::StrokeFromCharacter(char c)
+{
+    if ((c >= 'a') && (c <= 'z')) {
+        return MakeStroke(0, static_cast<uint8_t>(c - 'a' + 'A'));
+    }
+    if ((c >= 'A') && (c <= 'Z')) {
+        return MakeStroke(KEYMOD_SHIFT, static_cast<uint8_t>(c));
+    }
+    if (c == ' ') {
+        return MakeStroke(0, VKEY_SPACE);
+    }
+    if (c == '\n') {
+        return MakeStroke(0, VKEY_RETURN);
+    }
+    if (c == '\t') {
+        return MakeStroke(0, VKEY_TAB);
+    }
+    for (size_t i = 0; i < sizeof(s_characterKeys) / sizeof(s_characterKeys[0]); ++i) {
+        if (c == s_characterKeys[i].plain) {
+            return MakeStroke(0, s_characterKeys[i].keycode);
+        }
+        if (c == s_characterKeys[i].shifted) {
+            return MakeStroke(KEYMOD_SHIFT, s_characterKeys[i].keycode);
+        }
+    }
+    return 0;
+}
+
+char CKeymap::CharacterFromStroke(uint16_t stroke)
+{
+    unsigned modifiers = (stroke >> 8) & 0x0F;
+    uint8_t keycode = static_cast<uint8_t>(stroke);
+    if (modifiers & ~KEYMOD_SHIFT) {
+        return 0;
+    }
+    bool shift = (modifiers & KEYMOD_SHIFT) != 0;
+    if ((keycode >= 'A') && (keycode <= 'Z')) {
+        return static_cast<char>(shift ? keycode : keycode - 'A' + 'a');
+    }
+    switch (keycode) {
+    case VKEY_SPACE:
+        return ' ';
+    case VKEY_RETURN:
+        return shift ? 0 : '\n';
+    case VKEY_TAB:
+        return shift ? 0 : '\t';
+    default:
+        break;
+    }
+    for (size_t i = 0; i < sizeof(s_characterKeys) / sizeof(s_characterKeys[0]); ++i) {
+        if (keycode == s_characterKeys[i].keycode) {
+            return shift ? s_characterKeys[i].shifted : s_characterKeys[i].plain;
+        }
+    }
+    return 0;
+}
+
+uint8_t CKeymap::KeycodeFromName(char const *name, size_t length)
+{
+    if (length == 1) {
+        char c = name[0];
+        if ((c >= 'a') && (c <= 'z')) {
+            return static_cast<uint8_t>(c - 'a' + 'A');
+        }
+        if (((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9'))) {
+            return static_cast<uint8_t>(c);
+        }
+    }
+
+    // F1-F24
+    if ((length >= 2) && (length <= 3) && ((name[0] == 'F') || (name[0] == 'f'))) {
+        unsigned number = 0;
+        size_t i = 1;
+        for (; (i < length) && (name[i] >= '0') && (name[i] <= '9'); ++i) {
+            number = number * 10 + static_cast<unsigned>(name[i] - '0');
+        }
+        if ((i == length) && (number >= 1) && (number <= 24)) {
+            return static_cast<uint8_t>(VKEY_F1 + number - 1);
+        }
+    }
+
+    // Numpad0-Numpad9
+    if ((length == 7) && EqualsIgnoreCase(name, 6, "Numpad") && (name[6] >= '0') && (name[6] <= '9')) {
+        return static_cast<uint8_t>(VKEY_NUMPAD0 + (name[6] - '0'));
+    }
+
+    // Raw virtual key codes, e.g. 0x21
+    if ((length > 2) && (length <= 4) && (name[0] == '0') && ((name[1] == 'x') || (name[1] == 'X'))) {
+        unsigned value = 0;
+        for (size_t i = 2; i < length; ++i) {
+            char c = name[i];
+            unsigned digit;
+            if ((c >= '0') && (c <= '9')) {
+                digit = static_cast<unsigned>(c - '0');
+            } else if ((c >= 'a') && (c <= 'f')) {
+                digit = static_cast<unsigned>(c - 'a' + 10);
+            } else if ((c >= 'A') && (c <= 'F')) {
+                digit = static_cast<unsigned>(c - 'A' + 10);
+            } else {
+                return 0;
+            }
+            value = value * 16 + digit;
+        }
+        return (value < KEYMAP_KEYS) ? static_cast<uint8_t>(value) : 0;
+    }
+
+    for (size_t i = 0; i < sizeof(s_keyNames) / sizeof(s_keyNames[0]); ++i) {
+        if (EqualsIgnoreCase(name, length, s_keyNames[i].name)) {
+            return s_keyNames[i].keycode;
+        }
+    }
+    return 0;
+}
+
+
+void *CKeymap::operator new(size_t size)
+{
+    return AlignedAllocate(size);
+}
+
+void CKeymap::operator delete(void *p)
+{
+    AlignedFree(p);
+}
@@ -0,0 +1,485 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "AppFocus.h"
+#include "ExpansionMatcher.h"
+#include "MappedFile.h"
+#include "RuleMachine.h"
+#include "SequenceMatcher.h"
+#include "TapHold.h"
+
+struct LayoutTable;
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable: 4324) // Structure was padded due to alignment specifier
+#endif
+
+/* Modifier bits. A keymap holds one 256-entry table for every combination of these. */
+enum KeyModifier {
+    KEYMOD_SHIFT = 0x01,
+    KEYMOD_CONTROL = 0x02,
+    KEYMOD_ALT = 0x04,
+    KEYMOD_WIN = 0x08,
+};
+
+static unsigned const KEYMAP_MODIFIER_STATES = 16;
+static unsigned const KEYMAP_KEYS = 256;
+
+/* The longest debounce time a keymap takes (see CKeymap::Load()), in milliseconds. */
+static unsigned const KEYMAP_MAX_DEBOUNCE = 1000;
+
+/* A keymap entry packs everything the hook needs to know about one key in one modifier
+   state into 32 bits, so sixteen keys share a cache line:
+
+     bits  0-14  action to run when the key is pressed (0 = none)
+     bit     15  also run the press action on autorepeat
+     bits 16-30  action to run when the key is released (0 = none)
+     bit     31  swallow the key rather than passing it on
+
+   An entry whose press action is KEYMAP_ACTION_RULE is a conditional binding instead: bits
+   16-30 are then the index of a rule in the keymap's CRuleTable, which decides the real
+   entry when the key is pressed. */
+typedef uint32_t KeymapEntry;
+
+static uint16_t const KEYMAP_ACTION_NONE = 0;
+static uint16_t const KEYMAP_ACTION_MAX = 0x7FFE;
+static uint16_t const KEYMAP_ACTION_RULE = 0x7FFF;
+static KeymapEntry const KEYMAP_ENTRY_REPEAT = 0x00008000u;
+static KeymapEntry const KEYMAP_ENTRY_CONSUME = 0x80000000u;
+
+inline uint16_t KeymapPressAction(KeymapEntry entry) { return static_cast<uint16_t>(entry & 0x7FFF); }
+inline uint16_t KeymapReleaseAction(KeymapEntry entry) { return static_cast<uint16_t>((entry >> 16) & 0x7FFF); }
+inline bool KeymapIsConsumed(KeymapEntry entry) { return (entry & KEYMAP_ENTRY_CONSUME) != 0; }
+inline bool KeymapWantsRepeat(KeymapEntry entry) { return (entry & KEYMAP_ENTRY_REPEAT) != 0; }
+inline bool KeymapIsRule(KeymapEntry entry) { return (entry & 0x7FFF) == KEYMAP_ACTION_RULE; }
+inline uint32_t KeymapRuleIndex(KeymapEntry entry) { return (entry >> 16) & 0x7FFF; }
+inline KeymapEntry MakeKeymapRuleEntry(uint32_t rule) { return KEYMAP_ACTION_RULE | (rule << 16); }
+
+/* Bindings can type keys rather than run an action (see "send=" and "text=" in
+   CKeymap::Load()). Each of these macros gets an action ID of its own, from
+   KEYMAP_MACRO_FIRST up, and travels through the hook and the event queue like any other
+   action, so the application's own actions must stay below KEYMAP_MACRO_FIRST. */
+static uint16_t const KEYMAP_MACRO_FIRST = 0x4000;
+static size_t const KEYMAP_MACRO_MAX_STROKES = 512;
+
+inline bool IsKeymapMacro(uint16_t action) { return (action >= KEYMAP_MACRO_FIRST) && (action <= KEYMAP_ACTION_MAX); }
+
+/* A macro types strokes (see MakeStroke()) [first, first + length) of its keymap's macro
+   strokes, at up to rate strokes a second (0 = as fast as the system takes them). */
+struct KeymapMacro
+{
+    uint32_t first;
+    uint16_t length;
+    uint16_t rate;
+};
+
+/* The compiled lookup table. Plain data with no pointers, indexed [modifiers][keycode]. */
+struct KeymapTable
+{
+    alignas(64) KeymapEntry entries[KEYMAP_MODIFIER_STATES][KEYMAP_KEYS];
+};
+
+inline KeymapEntry KeymapTableLookup(KeymapTable const &table, unsigned modifiers, uint8_t keycode)
+{
+    return table.entries[modifiers & (KEYMAP_MODIFIER_STATES - 1)][keycode];
+}
+
+/* One declarative binding. The binding applies in every modifier state where the
+   modifiers in modifierMask match those in modifiers; modifiers outside the mask are
+   "don't care". A binding with a condition (1 + an index into the conditions given to
+   CKeymap::Compile(), or 0 for none) applies only when the condition holds as the key is
+   pressed; otherwise the key does whatever it would have done without the binding. */
+struct KeyBinding
+{
+    uint8_t keycode;
+    uint8_t modifiers;
+    uint8_t modifierMask;
+    bool consume;
+    bool repeat;
+    uint16_t pressAction;
+    uint16_t releaseAction;
+    uint16_t condition;
+};
+
+/* A binding for whichever key types character on the current keyboard layout with no
+   modifiers (see CKeymap::Load()). binding.keycode is ignored, and the binding can't have
+   a condition. Letters are matched whatever their case. A keymap binds at most
+   KEYMAP_MAX_CHARACTERS characters. */
+struct CharacterBinding
+{
+    uint16_t character;
+    KeyBinding binding;
+};
+
+static size_t const KEYMAP_MAX_CHARACTERS = 255;
+
+/* Bindings [first, first + count) of those given to CKeymap::Compile() apply only while
+   app (see AppIdentity) has the focus, where they take the place of the keymap's other
+   bindings for the same keys. Several profiles may share the same bindings. */
+struct KeymapProfile
+{
+    char app[APP_NAME_LENGTH];
+    uint32_t first;
+    uint32_t count;
+};
+
+/* Everything CKeymap::Compile() builds a keymap from. Each array comes with its count, and
+   anything left out is empty: no debounce times and no tap-hold keys. Fill in only what's
+   wanted, by name:
+
+       KeymapSource source;
+       source.bindings = bindings.data();
+       source.bindingCount = bindings.size(); */
+struct KeymapSource
+{
+    KeyBinding const *bindings = nullptr;
+    size_t bindingCount = 0;
+    CharacterBinding const *characterBindings = nullptr;
+    size_t characterBindingCount = 0;
+    SequenceBinding const *sequences = nullptr;
+    size_t sequenceCount = 0;
+    KeymapMacro const *macros = nullptr;    // macro n is action KEYMAP_MACRO_FIRST + n
+    size_t macroCount = 0;
+    uint16_t const *macroStrokes = nullptr;
+    size_t macroStrokeCount = 0;
+    ExpansionBinding const *expansions = nullptr;
+    size_t expansionCount = 0;
+    KeymapProfile const *profiles = nullptr;
+    size_t profileCount = 0;
+    RuleCondition const *conditions = nullptr;
+    size_t conditionCount = 0;
+    uint16_t const *debounceTimes = nullptr;    // KEYMAP_KEYS of them, if given
+    TapHoldTable const *tapHold = nullptr;
+};
+
+/* Maps the action names used in keymap text onto the application's action IDs. */
+struct KeymapActionName
+{
+    char const *name;
+    uint16_t action;
+};
+
+/* A compiled keymap saved as a binary image: this header, then (at tableOffset) the
+   KeymapTable, then (at sequenceOffset) the sequence table, then (at macroOffset and
+   macroStrokeOffset) the macros and their strokes, then (at expansionOffset) the
+   abbreviations' automaton, then (at profileTableOffset) a KeymapTable for each set of
+   per-application bindings and (at profileOffset) the applications, sorted by name, that
+   each one is for, then (at ruleOffset) the conditional bindings' rules, then (at
+   debounceOffset) the keys' debounce times, then (at tapHoldOffset) the TapHoldTable, then
+   (at characterOffset) the characters that keys are bound by, in order, and (at
+   characterTableOffset, if there are any) their KeymapTable. All in the byte order and
+   layout of the machine that wrote it; an image from anywhere else fails its checks and
+   is simply recompiled from the text. */
+struct KeymapImageHeader
+{
+    uint32_t magic;         // KEYMAP_IMAGE_MAGIC
+    uint32_t version;       // KEYMAP_IMAGE_VERSION
+    uint32_t size;          // Of the whole image
+    uint32_t checksum;      // FNV-1a of everything after the header
+    uint32_t tableOffset;
+    uint32_t sequenceOffset;
+    uint32_t sequenceSize;
+    uint32_t macroOffset;
+    uint32_t macroCount;
+    uint32_t macroStrokeOffset;
+    uint32_t macroStrokeCount;
+    uint32_t expansionOffset;
+    uint32_t expansionSize;
+    uint32_t profileTableOffset;
+    uint32_t profileTableCount;
+    uint32_t profileOffset;
+    uint32_t profileCount;
+    uint32_t ruleOffset;
+    uint32_t ruleSize;
+    uint32_t debounceOffset;    // KEYMAP_KEYS uint16_t milliseconds
+    uint32_t tapHoldOffset;
+    uint32_t characterOffset;
+    uint32_t characterCount;
+    uint32_t characterTableOffset;
+};
+
+static uint32_t const KEYMAP_IMAGE_MAGIC = 0x4D4B4843;  // "CHKM"
+static uint32_t const KEYMAP_IMAGE_VERSION = 8;
+
+struct KeymapError
+{
+    unsigned line;
+    char message[96];
+};
+
+class CKeymap
+{
+public:
+    CKeymap();
+    ~CKeymap();
+
+    /* Reset to an empty keymap in which every key passes through untouched. */
+    void Clear();
+
+    /* Compile a keymap's bindings, sequences, macros and the rest into the table, replacing
+       whatever was there. Where bindings overlap, the one that specifies more modifiers
+       wins; between equally specific bindings, the later one wins. */
+    bool Compile(KeymapSource const &source);
+
+    /* Parse keymap text and compile it. On failure the keymap is left unchanged and, if
+       error is non-NULL, it describes the first problem found. The format is line based:
+
+           # comment
+           <keyspec> [press=<action>] [release=<action>] [repeat] [pass] [when=<condition>]
+
+       <keyspec> is zero or more modifiers (Shift, Ctrl, Alt, Win, or * meaning "ignore
+       any other modifiers") followed by a key name, all joined with '+', for example
+       "Ctrl+Shift+K" or "*+PageUp". Keys are swallowed unless "pass" is given. The press
+       action runs only when the key goes down, not on autorepeat, unless "repeat" is
+       given.
+
+       when=<condition> makes the binding apply only if the condition holds when the key is
+       pressed (the decision stands until it's released); otherwise the key does what it
+       would have without this line. Conditions are C-like expressions with no spaces
+       unless quoted, e.g. when="capslock && since(Ctrl) < 200", made of:
+
+           numbers (0 to 65535), ( ), ! * % + - < <= > >= == != && ||
+           capslock numlock scrolllock     lock toggled on
+           shift ctrl alt win              modifier held (either side)
+           repeat                          the key is autorepeating
+           held                            the number of keys held, this one included
+           down(<key>)                     key held
+           since(<key>)                    milliseconds since the key went down or up
+           presses(<key>)                  times the key has been pressed
+
+       where a key can also be Shift, Ctrl, Alt or Win, meaning either side. Each is
+       compiled to at most 32 instructions, and a key gets at most RULE_BUDGET of them
+       across all its conditions; if it runs out, the key does what it would with none.
+
+       A sequence is several keyspecs joined with ',' (e.g. "Ctrl+K,Ctrl+C") and a chord
+       is several keys joined with '&' (e.g. "Ctrl+J&K", where the modifiers apply to
+       every key). Neither accepts '*'. They take only press=<action> and, optionally,
+       timeout=<milliseconds> to wait for each following key:
+
+           <sequence|chord> press=<action> [timeout=<ms>]
+
+       In place of press=<action>, any of these can type something itself:
+
+           send=<keyspec>,<keyspec>...     e.g. send=Ctrl+C,Tab,Ctrl+V
+           text="<text>"                   e.g. text="Kind regards,\n"
+
+       The keyspecs are tapped in turn, with their modifiers held. Text is typed as it would
+       be on a US keyboard and may use \" \\ \n and \t. Either may be followed by
+       rate=<strokes per second> for applications that can't keep up.
+
+       A key can also be named by the character it types, in single quotes, as in
+       Ctrl+'z' or Alt+'-'. That's whichever key types the character with no modifiers on
+       the focused window's keyboard layout (see CLayoutCache), or on a US keyboard
+       without one, so on a German keyboard Ctrl+'z' is Ctrl+Y; it follows the layout as
+       it changes, and letters match whatever their case. On a layout with no such key the
+       binding does nothing. In the modifier states it covers, it wins over a binding that
+       names the key itself. It applies in every application, can't have a condition and
+       can't be part of a sequence or chord.
+
+       An abbreviation, marked with "::", is replaced as soon as it's typed: it's erased
+       with Backspace and the text or keys typed in its place.
+
+           ::<abbreviation> text="<text>"|send=<keyspec>,... [rate=<n>]
+
+       for example ::;btw text="by the way". Abbreviations are up to 32
+       characters and are matched wherever they're typed, even mid-word, so a prefix
+       that words don't start with (like ';') keeps them out of the way.
+
+       A line such as [notepad.exe wordpad.exe] starts a section of bindings that apply
+       only in those applications (named as AppIdentity names them, case-insensitively),
+       where they win over bindings for the same keys elsewhere in the keymap. [*] goes
+       back to bindings for every application. Sections can only bind keys, not sequences
+       or abbreviations.
+
+           debounce <milliseconds> [<key> ...]
+
+       sets the debounce time of the keys named (all of them if none are) for switches
+       that chatter: a press that comes within that long of the key's last release is
+       taken to be a bounce, and it's swallowed, along with its release. The first press
+       and release always go straight through. Later lines win, so "debounce 0 Space"
+       after "debounce 40" leaves Space alone. Debounce times apply in every application,
+       so they can't go in a section.
+
+           taphold <key> tap=<key> hold=<key> [timeout=<milliseconds>]
+           taphold <key> tap=<key> layer=<n> [timeout=<milliseconds>]
+           taphold <key> layer=<n>|toggle=<n>
+           layer <n> <key>=<key> ...
+
+       give a key a second role. With tap= it's a dual-role key: tapped, it types the tap
+       key; held, it holds the hold key (typically a modifier) or turns layer n (1 to 7)
+       on. It counts as held once it's been down for the timeout (200 ms unless given),
+       or as soon as a key pressed after it is released while it's still down, so that
+       "CapsLock tap=Escape hold=LCtrl" gives Ctrl+C from a quick CapsLock+C but Escape
+       and C from a roll across the two. Until it's decided, it and the keys after it are
+       held back (see CTapHoldResolver). Without tap=, layer= turns the layer on while
+       the key is held and toggle= turns it on or off with each press. A "layer" line
+       says what keys type while their layer is on, e.g. "layer 1 H=Left J=Down"; the
+       highest layer that's on and maps a key wins, and other keys type themselves. A key
+       keeps its tap-hold role on every layer. Neither line can go in a section. */
+    bool Load(char const *text, size_t length,
+        KeymapActionName const *actions, size_t actionCount,
+        KeymapError *error);
+
+    /* Save the compiled keymap as an image (see KeymapImageHeader). */
+    void WriteImage(std::vector<uint8_t> &image) const;
+
+    /* Use an image in place, with no parsing or copying; the memory must stay valid and
+       unchanged for as long as the keymap uses it, and be 64-byte aligned. On failure the
+       keymap is left unchanged. */
+    bool AttachImage(void const *image, size_t size, KeymapError *error);
+
+    /* Map an image file and attach it. The keymap keeps the file mapped until it's
+       compiled, loaded or mapped again, or destroyed. */
+    bool MapImage(FileNameChar const *path, KeymapError *error);
+
+    KeymapEntry Lookup(unsigned modifiers, uint8_t keycode) const
+    {
+        return KeymapTableLookup(*m_table, modifiers, keycode);
+    }
+
+    /* Keys bound by the character they type. MapCharacterKeys() fills keys[] with, for
+       each key, 1 + the index of the character it types on layout (NULL for a US
+       keyboard) if that's one of the GetCharacterCount() bound characters, or 0 if not.
+       It goes through the whole layout, so it's for when the layout changes, not for every
+       key. LookupCharacter() then takes the index. */
+    size_t GetCharacterCount() const { return m_characterCount; }
+    void MapCharacterKeys(LayoutTable const *layout, uint8_t keys[KEYMAP_KEYS]) const;
+    KeymapEntry LookupCharacter(unsigned modifiers, uint8_t index) const
+    {
+        return KeymapTableLookup(*m_characterTable, modifiers, index);
+    }
+
+    KeymapTable const &GetTable() const { return *m_table; }
+
+    /* The table for when app has the focus: its profile's, or GetTable() if it hasn't got
+       one. A binary search of the profiles, so it's best looked up once per focus change
+       rather than once per key. */
+    KeymapTable const &GetProfileTable(AppIdentity const &app) const;
+    size_t GetProfileCount() const { return m_profileCount; }
+
+    CSequenceTable const &GetSequences() const { return m_sequences; }
+    CExpansionTable const &GetExpansions() const { return m_expansions; }
+    CRuleTable const &GetRules() const { return m_rules; }
+
+    /* How long after a key's release a press of it is taken to be chatter, in
+       milliseconds (0 = never). */
+    uint16_t GetDebounceTime(uint8_t keycode) const { return m_debounce[keycode]; }
+
+    TapHoldTable const &GetTapHold() const { return *m_tapHold; }
+
+    /* The macro an action types, or NULL if it isn't one of this keymap's macros. */
+    KeymapMacro const *GetMacro(uint16_t action) const
+    {
+        size_t index = static_cast<size_t>(action) - KEYMAP_MACRO_FIRST;
+        return (IsKeymapMacro(action) && (index < m_macroCount)) ? &m_macros[index] : nullptr;
+    }
+    uint16_t const *GetMacroStrokes(KeymapMacro const &macro) const { return m_macroStrokes + macro.first; }
+
+    /* The stroke that types an ASCII character on a US keyboard, or 0 if there isn't one. */
+    static uint16_t StrokeFromCharacter(char c);
+
+    /* The reverse: the ASCII character a stroke types on a US keyboard, or 0 if it doesn't
+       type one. */
+    static char CharacterFromStroke(uint16_t stroke);
+
+    /* Translate a key name such as "A", "F5" or "PageUp" (case-insensitive) into a
+       virtual key code. Returns 0 if the name is not recognized. */
+    static uint8_t KeycodeFromName(char const *name, size_t length);
+
+    /* Keymaps are cache-line aligned, which plain new doesn't promise before C++17. */
+    static void *operator new(size_t size);
+    static void operator delete(void *p);
+
+private:
+    CKeymap(CKeymap const &) = delete;
+    CKeymap &operator=(CKeymap const &) = delete;
+
+    /* How profiles are kept: the applications, sorted by name, and their tables. */
+    struct ProfileEntry
+    {
+        char app[APP_NAME_LENGTH];
+        uint32_t table;
+    };
+
+    void FreeTables();
+
+    // m_table points at m_ownTable, or into an attached image.
+    KeymapTable const *m_table;
+    KeymapTable m_ownTable;
+
+    // Likewise, the profile tables are m_ownProfileTables (allocated aligned, since
+    // std::vector won't be) or in an attached image.
+    KeymapTable const *m_profileTables;
+    size_t m_profileTableCount;
+    ProfileEntry const *m_profiles;
+    size_t m_profileCount;
+    KeymapTable *m_ownProfileTables;
+    std::vector<ProfileEntry> m_ownProfiles;
+
+    // Likewise the bound characters, in order, and their table, which is indexed by
+    // character rather than key: m_ownCharacters and m_ownCharacterTable, or in an
+    // attached image.
+    uint16_t const *m_characters;
+    size_t m_characterCount;
+    KeymapTable const *m_characterTable;
+    std::vector<uint16_t> m_ownCharacters;
+    KeymapTable *m_ownCharacterTable;
+
+    CSequenceTable m_sequences;
+    CExpansionTable m_expansions;
+    CRuleTable m_rules;
+
+    // Like m_table, these point at the vectors or into an attached image.
+    KeymapMacro const *m_macros;
+    size_t m_macroCount;
+    uint16_t const *m_macroStrokes;
+    std::vector<KeymapMacro> m_ownMacros;
+    std::vector<uint16_t> m_ownMacroStrokes;
+
+    // And this at m_ownDebounce or into an attached image.
+    uint16_t const *m_debounce;
+    uint16_t m_ownDebounce[KEYMAP_KEYS];
+
+    // And this at m_ownTapHold or into an attached image.
+    TapHoldTable const *m_tapHold;
+    TapHoldTable m_ownTapHold;
+
+    CMappedFile m_image;
+};
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
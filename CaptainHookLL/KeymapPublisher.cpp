@@ -0,0 +1,139 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "KeymapPublisher.h"
+
+CKeymapPublisher::CKeymapPublisher() :
+    m_current(nullptr),
+    m_version(1),
+    m_publishedCount(0),
+    m_reclaimedCount(0)
+{
+    for (unsigned i = 0; i < MAX_READERS; ++i) {
+        m_readers[i].active.store(0);
+        m_readers[i].used.store(false);
+    }
+}
+
+CKeymapPublisher::~CKeymapPublisher()
+{
+    // By now there mustn't be any readers left.
+    for (size_t i = 0; i < m_retired.size(); ++i) {
+        delete m_retired[i].published->keymap;
+        delete m_retired[i].published;
+    }
+    Published *current = m_current.load();
+    if (current) {
+        delete current->keymap;
+        delete current;
+    }
+}
+
+bool CKeymapPublisher::AddReader(unsigned &reader)
+{
+    for (unsigned i = 0; i < MAX_READERS; ++i) {
+        bool used = false;
+        if (m_readers[i].used.compare_exchange_strong(used, true)) {
+            reader = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+CKeymap const *CKeymapPublisher::Enter(unsigned reader, uint64_t &version)
+{
+    // Announce the version before loading the pointer. Publish() swaps the pointer before
+    // it bumps the version, so a keymap swapped out after our load is retired at a version
+    // newer than the one we announced, and waits for our Exit(). (All of this has to be
+    // sequentially consistent for that to hold.)
+    m_readers[reader].active.store(m_version.load());
+    Published const *current = m_current.load();
+    if (!current) {
+        version = 0;
+        return nullptr;
+    }
+    version = current->version;
+    return current->keymap;
+}
+
+void CKeymapPublisher::Exit(unsigned reader)
+{
+    m_readers[reader].active.store(0, std::memory_order_release);
+}
+
+void CKeymapPublisher::Publish(CKeymap *keymap)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Published *published = new Published;
+        published->keymap = keymap;
+        published->version = m_version.load() + 1;
+        Published *old = m_current.exchange(published);
+        uint64_t version = m_version.fetch_add(1) + 1;
+        if (old) {
+            Retired retired = { old, version };
+            m_retired.push_back(retired);
+        }
+        m_publishedCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    Reclaim();
+}
+
+size_t CKeymapPublisher::Reclaim()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_retired.empty()) {
+        return 0;
+    }
+
+    // The oldest version any reader could still be looking at.
+    uint64_t oldest = m_version.load();
+    for (unsigned i = 0; i < MAX_READERS; ++i) {
+        uint64_t active = m_readers[i].active.load();
+        if ((active != 0) && (active < oldest)) {
+            oldest = active;
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < m_retired.size(); ++i) {
+        if (m_retired[i].version <= oldest) {
+            delete m_retired[i].published->keymap;
+            delete m_retired[i].published;
+            m_reclaimedCount.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            m_retired[kept++] = m_retired[i];
+        }
+    }
+    m_retired.resize(kept);
+    return kept;
+}
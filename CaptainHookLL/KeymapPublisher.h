@@ -0,0 +1,120 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "Keymap.h"
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable: 4324) // Structure was padded due to alignment specifier
+#endif
+
+/* Publishes the current keymap to the hook, RCU style, so that a new keymap can be
+   swapped in at any time while the hook never takes a lock or sees one half built.
+
+   A reader (the hook's thread) brackets each use with Enter() and Exit(). Enter() is two
+   atomic stores and a load; Exit() one store. Publish() swaps a pointer and retires the
+   old keymap, which Reclaim() deletes once no reader can still be using it: that is,
+   once every reader has been outside Enter()/Exit() at some point since the swap.
+   Readers keep nothing between uses except, if they like, the keymap's version number,
+   which is how they notice a change (comparing pointers isn't safe, since a new keymap
+   can be allocated where a deleted one was).
+
+   Publish() and Reclaim() may be called from any thread and serialize with each other. */
+class CKeymapPublisher
+{
+public:
+    static unsigned const MAX_READERS = 4;
+
+    CKeymapPublisher();
+    ~CKeymapPublisher();
+
+    /* Returns false if all the reader slots are taken. */
+    bool AddReader(unsigned &reader);
+
+    /* Only from the reader's own thread. The keymap (possibly NULL) stays valid until the
+       matching Exit(); version identifies it (0 for none). */
+    CKeymap const *Enter(unsigned reader, uint64_t &version);
+    void Exit(unsigned reader);
+
+    /* Make keymap (allocated with new; the publisher takes ownership) the current one. */
+    void Publish(CKeymap *keymap);
+
+    /* Delete the retired keymaps that no reader can be using. Returns how many are still
+       waiting. */
+    size_t Reclaim();
+
+    uint64_t GetVersion() const { return m_version.load(); }
+    uint32_t GetPublishedCount() const { return m_publishedCount.load(std::memory_order_relaxed); }
+    uint32_t GetReclaimedCount() const { return m_reclaimedCount.load(std::memory_order_relaxed); }
+
+private:
+    CKeymapPublisher(CKeymapPublisher const &) = delete;
+    CKeymapPublisher &operator=(CKeymapPublisher const &) = delete;
+
+    struct Published
+    {
+        CKeymap *keymap;
+        uint64_t version;
+    };
+
+    struct Retired
+    {
+        Published *published;
+        uint64_t version;   // Readers that entered at this version or later can't see it.
+    };
+
+    // One cache line per reader, so readers don't slow each other down.
+    struct alignas(64) Reader
+    {
+        // The version the reader saw on entry, or 0 while it's outside Enter()/Exit().
+        std::atomic<uint64_t> active;
+        std::atomic<bool> used;
+    };
+
+    Reader m_readers[MAX_READERS];
+    std::atomic<Published *> m_current;
+    std::atomic<uint64_t> m_version;
+
+    std::mutex m_mutex;
+    std::vector<Retired> m_retired;
+    std::atomic<uint32_t> m_publishedCount;
+    std::atomic<uint32_t> m_reclaimedCount;
+};
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
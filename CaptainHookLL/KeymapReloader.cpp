@@ -0,0 +1,149 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "KeymapReloader.h"
+#include "LatencyHistogram.h"
+#include <stdio.h>
+#include <vector>
+
+CKeymapReloader::CKeymapReloader(CKeymapPublisher &publisher, KeymapActionName const *actions, size_t actionCount) :
+    m_publisher(publisher),
+    m_actions(actions),
+    m_actionCount(actionCount),
+    m_defaultText(""),
+    m_defaultLength(0),
+    m_textPath(nullptr),
+    m_imagePath(nullptr),
+    m_lastLoadDuration(0)
+{
+}
+
+void CKeymapReloader::SetDefaultKeymap(char const *text, size_t length)
+{
+    m_defaultText = text;
+    m_defaultLength = length;
+}
+
+void CKeymapReloader::SetPaths(FileNameChar const *textPath, FileNameChar const *imagePath)
+{
+    m_textPath = textPath;
+    m_imagePath = imagePath;
+}
+
+bool CKeymapReloader::Load(KeymapError *error)
+{
+    uint64_t textTime;
+    if (!m_textPath || !GetFileModificationTime(m_textPath, textTime)) {
+        // No keymap file is not an error; it just means the default.
+        PublishDefault();
+        return true;
+    }
+
+    if (IsImageUpToDate()) {
+        uint64_t start = LatencyClockNow();
+        CKeymap *keymap = new CKeymap;
+        if (keymap->MapImage(m_imagePath, nullptr)) {
+            m_publisher.Publish(keymap);
+            m_lastLoadDuration = LatencyClockToNanoseconds(LatencyClockNow() - start);
+            return true;
+        }
+        // A broken or foreign image is only a cache; fall back on the text.
+        delete keymap;
+    }
+
+    if (Compile(error)) {
+        return true;
+    }
+    if (m_publisher.GetPublishedCount() == 0) {
+        PublishDefault();
+    }
+    return false;
+}
+
+bool CKeymapReloader::Reload(KeymapError *error)
+{
+    return Compile(error);
+}
+
+bool CKeymapReloader::IsImageUpToDate() const
+{
+    uint64_t textTime;
+    uint64_t imageTime;
+    return m_textPath && m_imagePath &&
+        GetFileModificationTime(m_textPath, textTime) &&
+        GetFileModificationTime(m_imagePath, imageTime) &&
+        (imageTime > textTime);
+}
+
+bool CKeymapReloader::Compile(KeymapError *error)
+{
+    uint64_t start = LatencyClockNow();
+    CMappedFile text;
+    if (!m_textPath || !text.Open(m_textPath)) {
+        if (error) {
+            error->line = 0;
+            snprintf(error->message, sizeof(error->message), "Can't read the keymap file");
+        }
+        return false;
+    }
+
+    CKeymap *keymap = new CKeymap;
+    if (!keymap->Load(static_cast<char const *>(text.GetData()), text.GetSize(), m_actions, m_actionCount, error)) {
+        delete keymap;
+        return false;
+    }
+    text.Close();
+
+    // Publish the keymap from its image, so that it's the same whether it was compiled just
+    // now or mapped at startup. If the image can't be saved (a read-only directory, say),
+    // the keymap just compiled will do.
+    if (m_imagePath) {
+        std::vector<uint8_t> image;
+        keymap->WriteImage(image);
+        CKeymap *mapped = new CKeymap;
+        if (WriteFileAtomically(m_imagePath, image.data(), image.size()) && mapped->MapImage(m_imagePath, nullptr)) {
+            delete keymap;
+            keymap = mapped;
+        } else {
+            delete mapped;
+        }
+    }
+    m_publisher.Publish(keymap);
+    m_lastLoadDuration = LatencyClockToNanoseconds(LatencyClockNow() - start);
+    return true;
+}
+
+void CKeymapReloader::PublishDefault()
+{
+    CKeymap *keymap = new CKeymap;
+    keymap->Load(m_defaultText, m_defaultLength, m_actions, m_actionCount, nullptr);
+    m_publisher.Publish(keymap);
+}
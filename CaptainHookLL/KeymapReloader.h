@@ -0,0 +1,81 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "Keymap.h"
+#include "KeymapPublisher.h"
+#include "MappedFile.h"
+
+/* Turns the keymap text file into the keymap the hook uses. The text is compiled into a
+   binary image saved beside it, and the image is memory-mapped and published; next time,
+   if the image is newer than the text, it's mapped straight away with no parsing at all.
+
+   Load() is for startup and Reload() for when the text file changes. Neither is meant to
+   run on the hook's thread (compiling a big keymap takes a while), and they mustn't run
+   concurrently with each other. */
+class CKeymapReloader
+{
+public:
+    CKeymapReloader(CKeymapPublisher &publisher, KeymapActionName const *actions, size_t actionCount);
+
+    /* Used when there's no keymap file or the first one loaded is broken. */
+    void SetDefaultKeymap(char const *text, size_t length);
+
+    void SetPaths(FileNameChar const *textPath, FileNameChar const *imagePath);
+
+    /* Publish the image if it's up to date, or else compile the text. If that fails, and
+       nothing has been published yet, the default keymap is. Returns false (with error
+       filled in, if given) if the text file was there but couldn't be used. */
+    bool Load(KeymapError *error);
+
+    /* Compile the text and publish it. If that fails, the current keymap stays. */
+    bool Reload(KeymapError *error);
+
+    /* The last successful Load() or Reload(), from reading the text (or image) to the
+       hook being able to see it, in nanoseconds. */
+    uint64_t GetLastLoadDuration() const { return m_lastLoadDuration; }
+    bool IsImageUpToDate() const;
+
+private:
+    bool Compile(KeymapError *error);
+    void PublishDefault();
+
+    CKeymapPublisher &m_publisher;
+    KeymapActionName const *m_actions;
+    size_t m_actionCount;
+    char const *m_defaultText;
+    size_t m_defaultLength;
+    FileNameChar const *m_textPath;
+    FileNameChar const *m_imagePath;
+    uint64_t m_lastLoadDuration;
+};
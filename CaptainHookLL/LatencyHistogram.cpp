@@ -0,0 +1,189 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "LatencyHistogram.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// The index of value's highest set bit; value mustn't be 0.
+static unsigned HighestBit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<unsigned>(index);
+#else
+    return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#endif
+}
+
+#ifdef _WIN32
+static double GetNanosecondsPerTick()
+{
+    LARGE_INTEGER frequency;
+    if (!::QueryPerformanceFrequency(&frequency) || (frequency.QuadPart == 0)) {
+        return 0.0;
+    }
+    return 1e9 / static_cast<double>(frequency.QuadPart);
+}
+
+static double const s_nanosecondsPerTick = GetNanosecondsPerTick();
+
+uint64_t LatencyClockNow()
+{
+    LARGE_INTEGER counter;
+    ::QueryPerformanceCounter(&counter);
+    return static_cast<uint64_t>(counter.QuadPart);
+}
+
+uint64_t LatencyClockToNanoseconds(uint64_t ticks)
+{
+    return static_cast<uint64_t>(static_cast<double>(ticks) * s_nanosecondsPerTick);
+}
+#else
+uint64_t LatencyClockNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000u + static_cast<uint64_t>(now.tv_nsec);
+}
+
+uint64_t LatencyClockToNanoseconds(uint64_t ticks)
+{
+    return ticks;
+}
+#endif
+
+CLatencyHistogram::CLatencyHistogram()
+{
+    Reset();
+}
+
+void CLatencyHistogram::Record(uint64_t nanoseconds)
+{
+    std::atomic<uint32_t> &bucket = m_buckets[GetBucket(nanoseconds)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    Add(m_count, 1);
+    Add(m_total, nanoseconds);
+    if (nanoseconds > m_max.load(std::memory_order_relaxed)) {
+        m_max.store(nanoseconds, std::memory_order_relaxed);
+    }
+}
+
+void CLatencyHistogram::Reset()
+{
+    for (unsigned i = 0; i < BUCKET_COUNT; ++i) {
+        m_buckets[i].store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_total.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t CLatencyHistogram::GetMean() const
+{
+    uint64_t count = GetCount();
+    return count ? m_total.load(std::memory_order_relaxed) / count : 0;
+}
+
+uint64_t CLatencyHistogram::GetValueAtPercentile(double percentile) const
+{
+    uint64_t count = GetCount();
+    if (count == 0) {
+        return 0;
+    }
+    if (percentile > 100.0) {
+        percentile = 100.0;
+    }
+
+    // The rank of the value we're after, counting from 1.
+    uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(count) + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t max = GetMax();
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < BUCKET_COUNT; ++i) {
+        seen += GetBucketCount(i);
+        if (seen >= rank) {
+            uint64_t value = GetBucketHighest(i);
+            return (value < max) ? value : max;
+        }
+    }
+    // A Record() raced us and bumped the count before its bucket.
+    return max;
+}
+
+uint64_t CLatencyHistogram::GetBucketLowest(unsigned bucket)
+{
+    if (bucket < 2 * SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned shift = bucket / SUB_BUCKETS - 1;
+    return static_cast<uint64_t>(bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+}
+
+uint64_t CLatencyHistogram::GetBucketHighest(unsigned bucket)
+{
+    if (bucket + 1 >= BUCKET_COUNT) {
+        return UINT64_MAX;
+    }
+    return GetBucketLowest(bucket + 1) - 1;
+}
+
+unsigned CLatencyHistogram::GetBucket(uint64_t nanoseconds)
+{
+    if (nanoseconds < 2 * SUB_BUCKETS) {
+        return static_cast<unsigned>(nanoseconds);
+    }
+
+    // Keep the top SUB_BUCKET_BITS + 1 bits of the value; the leading 1 says which power of
+    // two it's in and the rest which of that power's sub-buckets.
+    unsigned top = HighestBit(nanoseconds);
+    if (top >= MAX_VALUE_BITS) {
+        return BUCKET_COUNT - 1;
+    }
+    unsigned shift = top - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + static_cast<unsigned>(nanoseconds >> shift) - SUB_BUCKETS;
+}
+
+void CLatencyHistogram::Add(std::atomic<uint64_t> &counter, uint64_t value)
+{
+    // Only the recording thread writes, so this needn't be a locked add.
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
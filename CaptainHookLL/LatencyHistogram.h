@@ -0,0 +1,89 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/* A monotonic high-resolution clock for timing short stretches of code: QueryPerformanceCounter
+   on Windows, CLOCK_MONOTONIC elsewhere. Reading it is cheap; converting to nanoseconds is
+   one multiply, so do that only for the interval. */
+uint64_t LatencyClockNow();
+uint64_t LatencyClockToNanoseconds(uint64_t ticks);
+
+/* An HDR-style histogram of durations in nanoseconds. Values below 32 ns get a bucket each;
+   above that, every power of two is split into 16 buckets, so any recorded value is known
+   to within 1/16 (about 6%) however large it is. The buckets cover up to 2^41 ns (about
+   36 minutes); anything longer lands in one more bucket of its own, where only the maximum
+   says how long. There are no allocations, and recording is a handful of instructions.
+
+   One thread records (it's meant for the hook's thread); any thread may read at any time.
+   Readers see each counter atomically, but a read that races a Record() may see the new
+   count before the new maximum, say. That's fine for statistics. */
+class CLatencyHistogram
+{
+public:
+    static unsigned const SUB_BUCKET_BITS = 4;
+    static unsigned const SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static unsigned const MAX_VALUE_BITS = 41;
+    static unsigned const BUCKET_COUNT = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + 1;
+
+    CLatencyHistogram();
+
+    /* Only from the recording thread. */
+    void Record(uint64_t nanoseconds);
+    void RecordTicks(uint64_t startTicks) { Record(LatencyClockToNanoseconds(LatencyClockNow() - startTicks)); }
+    void Reset();
+
+    uint64_t GetCount() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t GetMax() const { return m_max.load(std::memory_order_relaxed); }
+    uint64_t GetMean() const;
+
+    /* The smallest value that percentile% of the recorded values are at or below, to the
+       histogram's precision (and never above the maximum). 0 if nothing's been recorded. */
+    uint64_t GetValueAtPercentile(double percentile) const;
+
+    /* For dumping the raw distribution. Bucket i holds values from GetBucketLowest(i) to
+       GetBucketHighest(i), inclusive. */
+    uint32_t GetBucketCount(unsigned bucket) const { return m_buckets[bucket].load(std::memory_order_relaxed); }
+    static uint64_t GetBucketLowest(unsigned bucket);
+    static uint64_t GetBucketHighest(unsigned bucket);
+    static unsigned GetBucket(uint64_t nanoseconds);
+
+private:
+    static void Add(std::atomic<uint64_t> &counter, uint64_t value);
+
+    std::atomic<uint32_t> m_buckets[BUCKET_COUNT];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_total;
+    std::atomic<uint64_t> m_max;
+};
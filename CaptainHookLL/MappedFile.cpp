@@ -0,0 +1,193 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "MappedFile.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <wchar.h>
+#else
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#endif
+
+CMappedFile::CMappedFile() :
+    m_data(nullptr),
+    m_size(0)
+{
+}
+
+CMappedFile::~CMappedFile()
+{
+    Close();
+}
+
+void CMappedFile::Swap(CMappedFile &other)
+{
+    void *data = m_data;
+    size_t size = m_size;
+    m_data = other.m_data;
+    m_size = other.m_size;
+    other.m_data = data;
+    other.m_size = size;
+}
+
+#ifdef _WIN32
+bool CMappedFile::Open(FileNameChar const *path)
+{
+    Close();
+    HANDLE hFile = ::CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (::GetFileSizeEx(hFile, &size) && (size.QuadPart > 0) && (static_cast<uint64_t>(size.QuadPart) <= SIZE_MAX)) {
+        // The view keeps the mapping alive, and the mapping the file, so neither handle
+        // is needed once the view exists.
+        HANDLE hMapping = ::CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping) {
+            m_data = ::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            m_size = m_data ? static_cast<size_t>(size.QuadPart) : 0;
+            ::CloseHandle(hMapping);
+        }
+    }
+    ::CloseHandle(hFile);
+    return m_data != nullptr;
+}
+
+void CMappedFile::Close()
+{
+    if (m_data) {
+        ::UnmapViewOfFile(m_data);
+        m_data = nullptr;
+        m_size = 0;
+    }
+}
+
+bool WriteFileAtomically(FileNameChar const *path, void const *data, size_t size)
+{
+    wchar_t temporary[MAX_PATH];
+    if (swprintf(temporary, MAX_PATH, L"%ls.%lu.tmp", path, ::GetCurrentProcessId()) < 0) {
+        return false;
+    }
+    HANDLE hFile = ::CreateFileW(temporary, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    DWORD written = 0;
+    BOOL success = (size <= MAXDWORD) && ::WriteFile(hFile, data, static_cast<DWORD>(size), &written, NULL) && (written == size);
+    ::CloseHandle(hFile);
+    if (success) {
+        success = ::MoveFileExW(temporary, path, MOVEFILE_REPLACE_EXISTING);
+    }
+    if (!success) {
+        ::DeleteFileW(temporary);
+    }
+    return success != FALSE;
+}
+
+bool GetFileModificationTime(FileNameChar const *path, uint64_t &time)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!::GetFileAttributesExW(path, GetFileExInfoStandard, &attributes)) {
+        return false;
+    }
+    time = (static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+#else
+bool CMappedFile::Open(FileNameChar const *path)
+{
+    Close();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat status;
+    if ((fstat(fd, &status) == 0) && (status.st_size > 0)) {
+        void *data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            m_data = data;
+            m_size = static_cast<size_t>(status.st_size);
+        }
+    }
+    close(fd);
+    return m_data != nullptr;
+}
+
+void CMappedFile::Close()
+{
+    if (m_data) {
+        munmap(m_data, m_size);
+        m_data = nullptr;
+        m_size = 0;
+    }
+}
+
+bool WriteFileAtomically(FileNameChar const *path, void const *data, size_t size)
+{
+    // Replacing rather than rewriting also matters for anyone who has the old file
+    // mapped: their pages stay as they were.
+    std::string temporary = std::string(path) + "." + std::to_string(getpid()) + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    char const *bytes = static_cast<char const *>(data);
+    size_t remaining = size;
+    while (remaining > 0) {
+        ssize_t written = write(fd, bytes, remaining);
+        if (written <= 0) {
+            break;
+        }
+        bytes += written;
+        remaining -= static_cast<size_t>(written);
+    }
+    bool success = (close(fd) == 0) && (remaining == 0) && (rename(temporary.c_str(), path) == 0);
+    if (!success) {
+        unlink(temporary.c_str());
+    }
+    return success;
+}
+
+bool GetFileModificationTime(FileNameChar const *path, uint64_t &time)
+{
+    struct stat status;
+    if (stat(path, &status) != 0) {
+        return false;
+    }
+    time = static_cast<uint64_t>(status.st_mtim.tv_sec) * 1000000000u + static_cast<uint64_t>(status.st_mtim.tv_nsec);
+    return true;
+}
+#endif
@@ -0,0 +1,74 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* File names are the platform's native kind: UTF-16 on Windows, bytes elsewhere. */
+#ifdef _WIN32
+typedef wchar_t FileNameChar;
+#else
+typedef char FileNameChar;
+#endif
+
+/* A whole file mapped read-only into memory. The mapping starts on a page boundary. */
+class CMappedFile
+{
+public:
+    CMappedFile();
+    ~CMappedFile();
+
+    /* Empty files can't be mapped, so they fail too. */
+    bool Open(FileNameChar const *path);
+    void Close();
+    void Swap(CMappedFile &other);
+
+    bool IsOpen() const { return m_data != nullptr; }
+    void const *GetData() const { return m_data; }
+    size_t GetSize() const { return m_size; }
+
+private:
+    CMappedFile(CMappedFile const &) = delete;
+    CMappedFile &operator=(CMappedFile const &) = delete;
+
+    void *m_data;
+    size_t m_size;
+};
+
+/* Replace a file's contents all at once: the data is written to a temporary file beside
+   it, which is then renamed over it, so anyone opening the file sees either the old
+   contents or the new, never a mixture. */
+bool WriteFileAtomically(FileNameChar const *path, void const *data, size_t size);
+
+/* The file's last modification time, in the platform's own units (only good for
+   comparing with other such times). Returns false if the file doesn't exist. */
+bool GetFileModificationTime(FileNameChar const *path, uint64_t &time);
@@ -0,0 +1,158 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "MotionBatcher.h"
+#include "VirtualKeys.h"
+#include <math.h>
+#include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define MOTION_SSE2
+#endif
+
+float const CMotionBatcher::FLICK_DISTANCE = 300.0f;
+float const CMotionBatcher::FLICK_STRAIGHTNESS = 0.9f;
+
+CMotionBatcher::CMotionBatcher() :
+    m_count(0),
+    m_start(0),
+    m_end(0),
+    m_inStroke(false),
+    m_flicked(false),
+    m_strokeStart(0),
+    m_strokeEnd(0),
+    m_sampleCount(0),
+    m_frameCount(0),
+    m_flickCount(0)
+{
+    memset(&m_stroke, 0, sizeof(m_stroke));
+}
+
+bool CMotionBatcher::Add(int32_t dx, int32_t dy, uint32_t time)
+{
+    Increment(m_sampleCount);
+    bool first = (m_count == 0);
+    if (first) {
+        m_start = time;
+    }
+    m_end = time;
+    if (m_count == BATCH_SAMPLES) {
+        m_dx[m_count - 1] += static_cast<float>(dx);
+        m_dy[m_count - 1] += static_cast<float>(dy);
+    } else {
+        m_dx[m_count] = static_cast<float>(dx);
+        m_dy[m_count] = static_cast<float>(dy);
+        ++m_count;
+    }
+    return first;
+}
+
+uint8_t CMotionBatcher::Flush(MotionFrame &frame)
+{
+    memset(&frame, 0, sizeof(frame));
+    if (m_count == 0) {
+        return 0;
+    }
+    MotionSums sums;
+    Reduce(m_dx, m_dy, m_count, sums);
+    frame.start = m_start;
+    frame.end = m_end;
+    frame.samples = static_cast<uint32_t>(m_count);
+    frame.dx = sums.dx;
+    frame.dy = sums.dy;
+    frame.distance = sums.distance;
+    m_count = 0;
+    Increment(m_frameCount);
+
+    if (!m_inStroke || (frame.start - m_strokeEnd > STROKE_GAP)) {
+        m_inStroke = true;
+        m_flicked = false;
+        m_strokeStart = frame.start;
+        memset(&m_stroke, 0, sizeof(m_stroke));
+    }
+    m_strokeEnd = frame.end;
+    m_stroke.dx += sums.dx;
+    m_stroke.dy += sums.dy;
+    m_stroke.distance += sums.distance;
+    if (m_flicked || (m_strokeEnd - m_strokeStart > FLICK_TIME) || (m_stroke.distance < FLICK_DISTANCE)) {
+        return 0;
+    }
+    float net = sqrtf(m_stroke.dx * m_stroke.dx + m_stroke.dy * m_stroke.dy);
+    if (net < FLICK_STRAIGHTNESS * m_stroke.distance) {
+        return 0;
+    }
+    m_flicked = true;
+    Increment(m_flickCount);
+    if (fabsf(m_stroke.dx) >= fabsf(m_stroke.dy)) {
+        return (m_stroke.dx < 0) ? VKEY_FLICK_LEFT : VKEY_FLICK_RIGHT;
+    }
+    return (m_stroke.dy < 0) ? VKEY_FLICK_UP : VKEY_FLICK_DOWN;
+}
+
+void CMotionBatcher::Reduce(float const *dx, float const *dy, size_t count, MotionSums &sums)
+{
+#ifdef MOTION_SSE2
+    __m128 sumX = _mm_setzero_ps();
+    __m128 sumY = _mm_setzero_ps();
+    __m128 sumDistance = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(dx + i);
+        __m128 y = _mm_loadu_ps(dy + i);
+        sumX = _mm_add_ps(sumX, x);
+        sumY = _mm_add_ps(sumY, y);
+        sumDistance = _mm_add_ps(sumDistance, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y))));
+    }
+    alignas(16) float lanes[3][4];
+    _mm_store_ps(lanes[0], sumX);
+    _mm_store_ps(lanes[1], sumY);
+    _mm_store_ps(lanes[2], sumDistance);
+    MotionSums tail;
+    ReduceScalar(dx + i, dy + i, count - i, tail);
+    sums.dx = (lanes[0][0] + lanes[0][1]) + (lanes[0][2] + lanes[0][3]) + tail.dx;
+    sums.dy = (lanes[1][0] + lanes[1][1]) + (lanes[1][2] + lanes[1][3]) + tail.dy;
+    sums.distance = (lanes[2][0] + lanes[2][1]) + (lanes[2][2] + lanes[2][3]) + tail.distance;
+#else
+    ReduceScalar(dx, dy, count, sums);
+#endif
+}
+
+void CMotionBatcher::ReduceScalar(float const *dx, float const *dy, size_t count, MotionSums &sums)
+{
+    sums.dx = 0;
+    sums.dy = 0;
+    sums.distance = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sums.dx += dx[i];
+        sums.dy += dy[i];
+        sums.distance += sqrtf(dx[i] * dx[i] + dy[i] * dy[i]);
+    }
+}
@@ -0,0 +1,123 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/* A frame's worth of mouse movement, reduced. Distances are in whatever the hook reports
+   movement in: pixels on Windows, the mouse's own counts on Linux. */
+struct MotionFrame
+{
+    uint32_t start;     // when the first movement came
+    uint32_t end;       // and the last
+    uint32_t samples;
+    float dx;           // net movement; y grows downwards
+    float dy;
+    float distance;     // along the path
+};
+
+/* Sums over a batch of movements. */
+struct MotionSums
+{
+    float dx;
+    float dy;
+    float distance;
+};
+
+/* Batches mouse movement so that a mouse reporting at up to 8 kHz costs the hook no more
+   than storing two numbers per report. The hook passes every movement on straight away
+   and Add()s it here; once a frame (FRAME_INTERVAL ms after a batch starts), Flush()
+   reduces the batch to a MotionFrame in one pass over structure-of-arrays storage, four
+   movements at a time with SSE2 where there is SSE2.
+
+   Consecutive frames with no more than STROKE_GAP ms between them make up a stroke, and a
+   stroke that covers FLICK_DISTANCE within FLICK_TIME ms in a nearly straight line is a
+   flick: Flush() returns VKEY_FLICK_LEFT, _RIGHT, _UP or _DOWN for the frame that
+   completes it, once per stroke, for the hook to put through the keymap as a tap.
+
+   Add() and Flush() are for the hook's thread only (on both platforms, that's also the
+   thread that runs the frame timer). The counters can be read from anywhere. */
+class CMotionBatcher
+{
+public:
+    static size_t const BATCH_SAMPLES = 512;    // 64 ms at 8 kHz
+    static uint32_t const FRAME_INTERVAL = 16;  // ms
+    static uint32_t const STROKE_GAP = 50;      // ms
+    static uint32_t const FLICK_TIME = 200;     // ms
+    static float const FLICK_DISTANCE;
+    static float const FLICK_STRAIGHTNESS;      // net movement over distance
+
+    CMotionBatcher();
+
+    /* Add a movement. Returns true if it starts a batch, in which case Flush() is due
+       FRAME_INTERVAL ms later. If the batch is full, the movement is folded into its last
+       one, so no movement is lost, only a little of the path's detail. */
+    bool Add(int32_t dx, int32_t dy, uint32_t time);
+
+    bool IsPending() const { return m_count > 0; }
+
+    /* Reduce the batch into frame and start a new one. Returns the flick the frame
+       completes, or 0. */
+    uint8_t Flush(MotionFrame &frame);
+
+    /* The reduction Flush() uses, and a plain loop to check it against. */
+    static void Reduce(float const *dx, float const *dy, size_t count, MotionSums &sums);
+    static void ReduceScalar(float const *dx, float const *dy, size_t count, MotionSums &sums);
+
+    uint64_t GetSampleCount() const { return m_sampleCount.load(std::memory_order_relaxed); }
+    uint64_t GetFrameCount() const { return m_frameCount.load(std::memory_order_relaxed); }
+    uint64_t GetFlickCount() const { return m_flickCount.load(std::memory_order_relaxed); }
+
+private:
+    static void Increment(std::atomic<uint64_t> &counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    alignas(16) float m_dx[BATCH_SAMPLES];
+    alignas(16) float m_dy[BATCH_SAMPLES];
+    size_t m_count;
+    uint32_t m_start;
+    uint32_t m_end;
+
+    // The stroke so far.
+    bool m_inStroke;
+    bool m_flicked;
+    uint32_t m_strokeStart;
+    uint32_t m_strokeEnd;
+    MotionSums m_stroke;
+
+    std::atomic<uint64_t> m_sampleCount;
+    std::atomic<uint64_t> m_frameCount;
+    std::atomic<uint64_t> m_flickCount;
+};
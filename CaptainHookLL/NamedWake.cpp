@@ -0,0 +1,185 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "NamedWake.h"
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+namespace {
+
+/* The abstract address for name: a NUL and then the name, not NUL-terminated. */
+bool MakeAddress(char const *name, struct sockaddr_un &address, socklen_t &length)
+{
+    size_t nameLength = strlen(name);
+    if (nameLength + 1 > sizeof(address.sun_path)) {
+        return false;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path + 1, name, nameLength);
+    length = static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + 1 + nameLength);
+    return true;
+}
+
+} // namespace
+#endif
+
+CNamedWake::CNamedWake() :
+#ifdef _WIN32
+    m_event(nullptr)
+#else
+    m_fd(-1)
+#endif
+{
+}
+
+CNamedWake::~CNamedWake()
+{
+    Close();
+}
+
+#ifdef _WIN32
+bool CNamedWake::Create(char const *name)
+{
+    Close();
+    // The default security descriptor already keeps other users out.
+    HANDLE hEvent = ::CreateEventA(NULL, FALSE, FALSE, name);
+    if (!hEvent) {
+        return false;
+    }
+    if (::GetLastError() == ERROR_ALREADY_EXISTS) {
+        ::CloseHandle(hEvent);
+        return false;
+    }
+    m_event = hEvent;
+    return true;
+}
+
+void CNamedWake::Close()
+{
+    if (m_event) {
+        ::CloseHandle(m_event);
+        m_event = nullptr;
+    }
+}
+
+bool CNamedWake::IsOpen() const
+{
+    return m_event != nullptr;
+}
+
+bool CNamedWake::Clear()
+{
+    return m_event != nullptr;
+}
+
+bool CNamedWake::Signal(char const *name)
+{
+    HANDLE hEvent = ::OpenEventA(EVENT_MODIFY_STATE, FALSE, name);
+    if (!hEvent) {
+        return false;
+    }
+    BOOL signalled = ::SetEvent(hEvent);
+    ::CloseHandle(hEvent);
+    return signalled != FALSE;
+}
+#else
+bool CNamedWake::Create(char const *name)
+{
+    Close();
+    struct sockaddr_un address;
+    socklen_t length;
+    if (!MakeAddress(name, address, length)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (bind(fd, reinterpret_cast<struct sockaddr const *>(&address), length) < 0) {
+        close(fd);
+        return false;
+    }
+    m_fd = fd;
+    return true;
+}
+
+void CNamedWake::Close()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+bool CNamedWake::IsOpen() const
+{
+    return m_fd >= 0;
+}
+
+bool CNamedWake::Clear()
+{
+    bool woken = false;
+    char datagram;
+    while (recv(m_fd, &datagram, sizeof(datagram), MSG_DONTWAIT) >= 0) {
+        woken = true;
+    }
+    return woken;
+}
+
+bool CNamedWake::Signal(char const *name)
+{
+    struct sockaddr_un address;
+    socklen_t length;
+    if (!MakeAddress(name, address, length)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    // A full queue means the owner has wakes waiting already, which is as good.
+    char datagram = 0;
+    bool sent = (sendto(fd, &datagram, sizeof(datagram), MSG_DONTWAIT,
+        reinterpret_cast<struct sockaddr const *>(&address), length) == sizeof(datagram)) || (errno == EAGAIN);
+    close(fd);
+    return sent;
+}
+#endif
@@ -0,0 +1,78 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+
+/* Lets another process wake this one by name, without polling on either side: a named
+   auto-reset event in the session's Local\ namespace on Windows, a datagram socket in
+   the abstract namespace on Linux (which goes away with the process, so a crashed app
+   can't leave one behind). Names are plain ASCII; see CControlPlane for the one in use.
+
+   A wake carries nothing but itself, and wakes that arrive before the owner gets round to
+   them count as one. Anyone who can see the name can send one, so owners must treat it as
+   a hint to look for work, never as work in itself. */
+class CNamedWake
+{
+public:
+    CNamedWake();
+    ~CNamedWake();
+
+    /* Fails if another process already owns the name. */
+    bool Create(char const *name);
+    void Close();
+    bool IsOpen() const;
+
+    /* What to wait on: on Windows the event (a HANDLE), signalled by a wake; elsewhere a
+       descriptor that's readable until Clear(). */
+#ifdef _WIN32
+    void *GetEvent() const { return m_event; }
+#else
+    int GetFd() const { return m_fd; }
+#endif
+
+    /* Take any wakes that have arrived. Returns true if there were some. On Windows,
+       waiting on the event has already taken them, so this always returns true. */
+    bool Clear();
+
+    /* Wake the owner of name, from any process. Returns false if there's no owner. */
+    static bool Signal(char const *name);
+
+private:
+    CNamedWake(CNamedWake const &) = delete;
+    CNamedWake &operator=(CNamedWake const &) = delete;
+
+#ifdef _WIN32
+    void *m_event;
+#else
+    int m_fd;
+#endif
+};
@@ -34,33 +34,72 @@
 
 CNotificationIcon::CNotificationIcon() :
     m_enabled(FALSE),
-    m_nid({ sizeof(m_nid) })
+    m_nid({ sizeof(m_nid) }),
+    m_iconUpdates(*this),
+    m_flushTimerId(0),
+    m_updateLatency(NULL)
 {
 }
 
 CNotificationIcon::~CNotificationIcon()
 {
     Disable();
-    if (m_nid.hIcon) {
-        ::DestroyIcon(m_nid.hIcon);
-        m_nid.hIcon = NULL;
-    }
 }
 
 BOOL CNotificationIcon::SetIcon(HICON hIcon)
 {
-    if (m_nid.hIcon) {
-        ::DestroyIcon(m_nid.hIcon);
-        m_nid.hIcon = NULL;
+    if (m_iconUpdates.SetIcon(reinterpret_cast<uintptr_t>(hIcon), ::GetTickCount())) {
+        ScheduleFlush();
     }
-    m_nid.hIcon = ::DuplicateIcon(NULL, hIcon);
+    return TRUE;
+}
+
+bool CNotificationIcon::ShowIcon(uintptr_t icon)
+{
+    uint64_t start = m_updateLatency ? LatencyClockNow() : 0;
+    m_nid.hIcon = reinterpret_cast<HICON>(icon);
     m_nid.uFlags |= NIF_ICON;
-    return Update(NIM_MODIFY);
+    BOOL success = Update(NIM_MODIFY);
+    if (m_updateLatency) {
+        m_updateLatency->RecordTicks(start);
+    }
+    return success != FALSE;
+}
+
+void CNotificationIcon::SetFlushTimer(UINT_PTR timerId)
+{
+    m_flushTimerId = timerId;
+}
+
+BOOL CNotificationIcon::Flush()
+{
+    if (m_enabled && m_flushTimerId) {
+        ::KillTimer(m_nid.hWnd, m_flushTimerId);
+    }
+    if (m_iconUpdates.Flush(::GetTickCount())) {
+        ScheduleFlush();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void CNotificationIcon::ScheduleFlush()
+{
+    if (!m_enabled || !m_flushTimerId) {
+        return;
+    }
+    UINT delay = m_iconUpdates.GetFlushDelay(::GetTickCount());
+    if (delay != CIconUpdateCoalescer::NO_FLUSH_PENDING) {
+        ::SetCoalescableTimer(m_nid.hWnd, m_flushTimerId, delay, NULL, FLUSH_TOLERANCE);
+    }
 }
 
 BOOL CNotificationIcon::SetTooltipText(LPCTSTR pszTooltipText)
 {
     static size_t const max_tip_size = sizeof(m_nid.szTip) / sizeof(m_nid.szTip[0]);
+    if (_tcsncmp(m_nid.szTip, pszTooltipText, max_tip_size) == 0) {
+        return TRUE;
+    }
     _tcsncpy_s(m_nid.szTip, pszTooltipText, _TRUNCATE);
     m_nid.uFlags |= NIF_TIP;
     return Update(NIM_MODIFY);
@@ -74,6 +113,7 @@ BOOL CNotificationIcon::SetInfo(LPCTSTR pszInfoTitle, LPCTSTR pszInfo, DWORD dwI
     _tcsncpy_s(m_nid.szInfo, pszInfo, _TRUNCATE);
     m_nid.dwInfoFlags = dwInfoFlags;
     m_nid.hBalloonIcon = hBalloonIcon;
+    m_nid.uFlags |= NIF_INFO;
     return Update(NIM_MODIFY);
 }
 
@@ -95,6 +135,11 @@ BOOL CNotificationIcon::Update(DWORD dwMessage)
     if (!m_enabled) {
         return TRUE;
     }
+    if ((dwMessage == NIM_MODIFY) &&
+        !(m_nid.uFlags & (NIF_MESSAGE | NIF_ICON | NIF_TIP | NIF_INFO | NIF_REALTIME))) {
+        // Nothing has changed since the last update, so there's no need to bother the shell.
+        return TRUE;
+    }
     BOOL success = ::Shell_NotifyIcon(dwMessage, &m_nid);
     if (success) {
         m_nid.uFlags &= ~(NIF_MESSAGE | NIF_ICON | NIF_TIP | NIF_INFO | NIF_REALTIME);
@@ -122,6 +167,7 @@ BOOL CNotificationIcon::Enable(HWND hWnd, UINT uCallbackMessage, UINT uID)
     m_nid.uID = uID;
     m_nid.uVersion = NOTIFYICON_VERSION_4;
     m_enabled = TRUE;
+    m_iconUpdates.SetShownIcon(reinterpret_cast<uintptr_t>(m_nid.hIcon));
 
     return Update(NIM_ADD) && SetVersion();
 }
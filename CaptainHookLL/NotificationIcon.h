@@ -31,13 +31,18 @@
 ------------------------------------------------------------------------- */
 #pragma once
 #include <shellapi.h>
+#include "IconUpdateCoalescer.h"
+#include "LatencyHistogram.h"
 
-class CNotificationIcon
+class CNotificationIcon : private IIconBackend
 {
 public:
     CNotificationIcon();
     virtual ~CNotificationIcon();
 
+    /* The icon is not copied, so it must stay valid for as long as it's shown (icons from
+       LoadIcon or CIconAtlas always are). Changes that come faster than once a frame are
+       merged and shown when the flush timer fires; see SetFlushTimer(). */
     BOOL SetIcon(HICON hIcon);
     BOOL SetTooltipText(LPCTSTR pszTooltipText);
 
@@ -63,12 +68,32 @@ public:
     BOOL Enable(HWND hWnd, UINT uCallbackMessage, UINT uID);
     BOOL Disable();
 
+    /* Timer ID (on the window passed to Enable) used to show held-back icon changes. The
+       window must call Flush() when it receives WM_TIMER for this ID. Nobody minds an icon
+       a little late, so the timer lets Windows put it off by up to FLUSH_TOLERANCE ms to
+       share a wakeup with other timers. */
+    static ULONG const FLUSH_TOLERANCE = 50;
+    void SetFlushTimer(UINT_PTR timerId);
+    BOOL Flush();
+
+    CIconUpdateCoalescer const &GetIconUpdateStats() const { return m_iconUpdates; }
+
+    /* If set, every icon change that reaches the shell is timed into this histogram. */
+    void SetUpdateLatency(CLatencyHistogram *latency) { m_updateLatency = latency; }
+
 protected:
     BOOL Update(DWORD dwMessage);
     BOOL SetVersion();
     BOOL Remove();
+    void ScheduleFlush();
+
+private:
+    virtual bool ShowIcon(uintptr_t icon);
 
 protected:
-    BOOL            m_enabled;
-    NOTIFYICONDATA  m_nid;
+    BOOL                    m_enabled;
+    NOTIFYICONDATA          m_nid;
+    CIconUpdateCoalescer    m_iconUpdates;
+    UINT_PTR                m_flushTimerId;
+    CLatencyHistogram      *m_updateLatency;
 };
@@ -0,0 +1,311 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "OutputEngine.h"
+#include "VirtualKeys.h"
+#include <string.h>
+
+namespace {
+
+/* An unassigned virtual key, tapped before letting go of Alt or Win so that the system
+   doesn't take their release as a request for the menu bar or the Start menu. */
+uint8_t const MASK_KEY = 0xE8;
+
+struct ModifierKey
+{
+    uint32_t bit;
+    uint8_t keycode;
+};
+
+/* Held modifiers (KEYSTATE_* bits), for letting go of them and pressing them again. */
+ModifierKey const s_heldModifiers[] = {
+    { KEYSTATE_LSHIFT, VKEY_LSHIFT },
+    { KEYSTATE_LCONTROL, VKEY_LCONTROL },
+    { KEYSTATE_LALT, VKEY_LMENU },
+    { KEYSTATE_LWIN, VKEY_LWIN },
+    { KEYSTATE_RSHIFT, VKEY_RSHIFT },
+    { KEYSTATE_RCONTROL, VKEY_RCONTROL },
+    { KEYSTATE_RALT, VKEY_RMENU },
+    { KEYSTATE_RWIN, VKEY_RWIN },
+};
+
+/* The keys a macro's strokes hold down (KEYMOD_* bits). */
+ModifierKey const s_strokeModifiers[] = {
+    { KEYMOD_SHIFT, VKEY_LSHIFT },
+    { KEYMOD_CONTROL, VKEY_LCONTROL },
+    { KEYMOD_ALT, VKEY_LMENU },
+    { KEYMOD_WIN, VKEY_LWIN },
+};
+
+} // namespace
+
+COutputEngine::COutputEngine(IOutputSink &sink) :
+    m_sink(sink),
+    m_keymap(nullptr),
+    m_publisher(nullptr),
+    m_reader(0),
+    m_keyState(nullptr),
+    m_head(0),
+    m_tail(0),
+    m_lastSend(NO_DEADLINE),
+    m_macroCount(0),
+    m_droppedCount(0),
+    m_sentCount(0),
+    m_batchCount(0),
+    m_failedCount(0)
+{
+    memset(m_pressed, 0, sizeof(m_pressed));
+    memset(m_letGo, 0, sizeof(m_letGo));
+}
+
+void COutputEngine::SetKeymap(CKeymap const *keymap)
+{
+    m_publisher = nullptr;
+    m_keymap = keymap;
+}
+
+bool COutputEngine::SetKeymapPublisher(CKeymapPublisher *publisher)
+{
+    if (!publisher->AddReader(m_reader)) {
+        return false;
+    }
+    m_keymap = nullptr;
+    m_publisher = publisher;
+    return true;
+}
+
+bool COutputEngine::QueueMacro(uint16_t action)
+{
+    // The action was looked up in whichever keymap the hook had at the time. Should a new
+    // keymap have been published since, its macro with the same number is the one typed.
+    CKeymap const *keymap = m_keymap;
+    if (m_publisher) {
+        uint64_t version;
+        keymap = m_publisher->Enter(m_reader, version);
+    }
+    KeymapMacro const *macro = keymap ? keymap->GetMacro(action) : nullptr;
+    bool queued = macro && QueueStrokes(keymap->GetMacroStrokes(*macro), macro->length, macro->rate);
+    if (m_publisher) {
+        m_publisher->Exit(m_reader);
+    }
+    return queued;
+}
+
+bool COutputEngine::QueueStrokes(uint16_t const *strokes, size_t count, unsigned rate)
+{
+    // At worst: two mask keys and eight held modifiers let go of, four modifiers pressed
+    // and released around every stroke, and the eight pressed again.
+    if ((count > ARENA_KEYS) || (ARENA_KEYS - GetPendingCount() < 10 + count * 10 + 8)) {
+        ++m_droppedCount;
+        return false;
+    }
+    if (count == 0) {
+        return true;
+    }
+    if (m_head == m_tail) {
+        m_lastSend = NO_DEADLINE;
+    }
+    ++m_macroCount;
+
+    uint32_t held = m_keyState ? (m_keyState->GetModifierSnapshot() & KEYSTATE_HELD_MODIFIERS) : 0;
+    if (held & (KEYSTATE_LALT | KEYSTATE_RALT | KEYSTATE_LWIN | KEYSTATE_RWIN)) {
+        Push(MASK_KEY, KeyEvent::FLAG_DOWN, 0);
+        Push(MASK_KEY, 0, 0);
+    }
+    for (size_t i = 0; i < sizeof(s_heldModifiers) / sizeof(s_heldModifiers[0]); ++i) {
+        if (held & s_heldModifiers[i].bit) {
+            Push(s_heldModifiers[i].keycode, 0, 0);
+        }
+    }
+
+    // Each stroke's delay goes on its first key, so a paced stroke goes out whole.
+    // Modifiers stay down from one stroke to the next if both want them.
+    uint32_t interval = rate ? 1000000 / rate : 0;
+    unsigned modifiers = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t delay = (i == 0) ? 0 : interval;
+        unsigned strokeModifiers = (strokes[i] >> 8) & 0x0F;
+        uint8_t keycode = static_cast<uint8_t>(strokes[i]);
+        if (ChangeModifiers(modifiers, strokeModifiers, delay) > 0) {
+            delay = 0;
+        }
+        modifiers = strokeModifiers;
+        Push(keycode, KeyEvent::FLAG_DOWN, delay);
+        Push(keycode, 0, 0);
+    }
+    ChangeModifiers(modifiers, 0, 0);
+
+    for (size_t i = 0; i < sizeof(s_heldModifiers) / sizeof(s_heldModifiers[0]); ++i) {
+        if (held & s_heldModifiers[i].bit) {
+            Push(s_heldModifiers[i].keycode, KeyEvent::FLAG_DOWN | FLAG_RESTORE, 0);
+        }
+    }
+    return true;
+}
+
+uint64_t COutputEngine::Flush(uint64_t now)
+{
+    if (m_head == m_tail) {
+        return NO_DEADLINE;
+    }
+    uint64_t nowMicroseconds = now * 1000;
+    if (m_lastSend == NO_DEADLINE) {
+        m_lastSend = nowMicroseconds;
+    }
+
+    size_t count = 0;
+    bool failed = false;
+    while ((m_head != m_tail) && !failed) {
+        Entry const &entry = m_arena[m_head % ARENA_KEYS];
+        uint64_t due = m_lastSend + entry.delay;
+        if (due > nowMicroseconds) {
+            break;
+        }
+        if (due + MAX_CATCH_UP < nowMicroseconds) {
+            due = nowMicroseconds - MAX_CATCH_UP;
+        }
+        m_lastSend = due;
+        ++m_head;
+        if ((entry.flags & FLAG_RESTORE) && !(m_keyState && m_keyState->IsDown(entry.keycode))) {
+            m_letGo[entry.keycode >> 6] &= ~(1ull << (entry.keycode & 63));
+            continue;
+        }
+
+        KeyEvent &key = m_batch[count++];
+        key.time = static_cast<uint32_t>(now);
+        key.action = KEYMAP_ACTION_NONE;
+        key.keycode = entry.keycode;
+        key.flags = static_cast<uint8_t>(entry.flags & ~FLAG_RESTORE);
+        if (count == BATCH_KEYS) {
+            failed = !SendBatch(count);
+            count = 0;
+        }
+    }
+    if ((count > 0) && !failed) {
+        failed = !SendBatch(count);
+    }
+
+    // Once the system has refused keys, typing the rest of the macro with pieces missing
+    // would do more harm than good, but what it left down has to come up.
+    if (failed) {
+        Abandon(static_cast<uint32_t>(now));
+    }
+    if (m_head == m_tail) {
+        return NO_DEADLINE;
+    }
+    return (m_lastSend + m_arena[m_head % ARENA_KEYS].delay + 999) / 1000;
+}
+
+bool COutputEngine::SendBatch(size_t count)
+{
+    ++m_batchCount;
+    size_t sent = m_sink.SendKeys(m_batch, count);
+    m_sentCount += sent;
+    m_failedCount += count - sent;
+
+    // Follow what's down: a release of a key the engine didn't press is a held modifier
+    // being let go of, and the press that puts it back ends that.
+    for (size_t i = 0; i < sent; ++i) {
+        uint8_t keycode = m_batch[i].keycode;
+        uint64_t bit = 1ull << (keycode & 63);
+        if (m_batch[i].flags & KeyEvent::FLAG_DOWN) {
+            if (m_letGo[keycode >> 6] & bit) {
+                m_letGo[keycode >> 6] &= ~bit;
+            } else {
+                m_pressed[keycode >> 6] |= bit;
+            }
+        } else if (m_pressed[keycode >> 6] & bit) {
+            m_pressed[keycode >> 6] &= ~bit;
+        } else {
+            m_letGo[keycode >> 6] |= bit;
+        }
+    }
+    return sent == count;
+}
+
+void COutputEngine::Abandon(uint32_t now)
+{
+    m_failedCount += m_tail - m_head;
+    m_head = m_tail;
+
+    // Release everything the engine pressed, then press again the modifiers it let go of
+    // that the user is still holding. One attempt: if the sink still refuses, there's
+    // nothing more to be done.
+    size_t count = 0;
+    for (unsigned pass = 0; pass < 2; ++pass) {
+        uint64_t const *keys = (pass == 0) ? m_pressed : m_letGo;
+        for (unsigned keycode = 0; keycode < 256; ++keycode) {
+            if (!(keys[keycode >> 6] & (1ull << (keycode & 63)))) {
+                continue;
+            }
+            if ((pass == 1) && !(m_keyState && m_keyState->IsDown(static_cast<uint8_t>(keycode)))) {
+                continue;
+            }
+            KeyEvent &key = m_batch[count++];
+            key.time = now;
+            key.action = KEYMAP_ACTION_NONE;
+            key.keycode = static_cast<uint8_t>(keycode);
+            key.flags = static_cast<uint8_t>(((pass == 1) ? KeyEvent::FLAG_DOWN : 0) |
+                (IsExtendedKey(key.keycode) ? KeyEvent::FLAG_EXTENDED : 0));
+        }
+    }
+    if (count > 0) {
+        SendBatch(count);
+    }
+    memset(m_pressed, 0, sizeof(m_pressed));
+    memset(m_letGo, 0, sizeof(m_letGo));
+}
+
+void COutputEngine::Push(uint8_t keycode, uint8_t flags, uint32_t delay)
+{
+    Entry &entry = m_arena[m_tail++ % ARENA_KEYS];
+    entry.delay = delay;
+    entry.keycode = keycode;
+    entry.flags = static_cast<uint8_t>(flags | (IsExtendedKey(keycode) ? KeyEvent::FLAG_EXTENDED : 0));
+}
+
+unsigned COutputEngine::ChangeModifiers(unsigned from, unsigned to, uint32_t delay)
+{
+    unsigned pushed = 0;
+    for (size_t i = 0; i < sizeof(s_strokeModifiers) / sizeof(s_strokeModifiers[0]); ++i) {
+        if ((from & ~to) & s_strokeModifiers[i].bit) {
+            Push(s_strokeModifiers[i].keycode, 0, pushed ? 0 : delay);
+            ++pushed;
+        }
+    }
+    for (size_t i = 0; i < sizeof(s_strokeModifiers) / sizeof(s_strokeModifiers[0]); ++i) {
+        if ((to & ~from) & s_strokeModifiers[i].bit) {
+            Push(s_strokeModifiers[i].keycode, KeyEvent::FLAG_DOWN, pushed ? 0 : delay);
+            ++pushed;
+        }
+    }
+    return pushed;
+}
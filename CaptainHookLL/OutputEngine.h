@@ -0,0 +1,153 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "KeyEvent.h"
+#include "Keymap.h"
+#include "KeymapPublisher.h"
+#include "KeyState.h"
+
+/* Where COutputEngine's keys go: SendInput() on Windows, the uinput device on Linux. */
+class IOutputSink
+{
+public:
+    virtual ~IOutputSink() {}
+
+    /* Send keys (keycode, FLAG_DOWN and FLAG_EXTENDED) on to the system, in order and as
+       one batch that nothing typed meanwhile can land in the middle of. Returns how many
+       were sent. */
+    virtual size_t SendKeys(KeyEvent const *keys, size_t count) = 0;
+};
+
+/* Types the keymap's macros (see KeymapMacro). A macro is expanded into key events in a
+   preallocated ring, the arena, when it's queued, and Flush() hands whatever is due to
+   the sink in as few calls as possible: all of it at once, for a macro with no rate, or
+   the strokes whose time has come, for one that's paced.
+
+   Modifiers the user is holding are let go of for the macro, so that Ctrl+F5 typing
+   "hello" doesn't type Ctrl+H, Ctrl+E..., and pressed again afterwards if they're still
+   held. Alt and Win are masked with a key that does nothing first, so that letting them
+   go doesn't open a menu.
+
+   Should the sink refuse keys, the rest of what's queued is dropped, but anything the
+   engine has pressed is still released and the user's modifiers are pressed again, so
+   that a failure never leaves a key stuck down.
+
+   Not thread safe: it belongs to the thread that runs the hook, since it reads the
+   hook's key state. */
+class COutputEngine
+{
+public:
+    static size_t const ARENA_KEYS = 8192;
+    static size_t const BATCH_KEYS = 1024;
+    static uint64_t const NO_DEADLINE = ~0ull;
+
+    explicit COutputEngine(IOutputSink &sink);
+
+    /* The keymap must outlive its use here. */
+    void SetKeymap(CKeymap const *keymap);
+
+    /* Take the macros from a publisher's current keymap instead, as one of its readers.
+       Returns false if it has no reader slots left. */
+    bool SetKeymapPublisher(CKeymapPublisher *publisher);
+
+    /* The hook's key state, for the modifiers the user is holding. */
+    void SetKeyState(CKeyStateTracker const *keyState) { m_keyState = keyState; }
+
+    /* Queue the macro bound to action in the current keymap. Returns false, having queued
+       nothing, if it isn't a macro or there isn't room for all of it. */
+    bool QueueMacro(uint16_t action);
+
+    /* Queue strokes (see MakeStroke()) to be typed at rate strokes a second, or as fast
+       as possible if rate is 0. All or nothing, like QueueMacro(). */
+    bool QueueStrokes(uint16_t const *strokes, size_t count, unsigned rate);
+
+    /* Send everything that's due at now (milliseconds, on any steady clock). Returns the
+       time to call again, or NO_DEADLINE if everything has been sent. */
+    uint64_t Flush(uint64_t now);
+
+    size_t GetPendingCount() const { return m_tail - m_head; }
+
+    /* Macros queued, and refused for lack of room. */
+    uint32_t GetMacroCount() const { return m_macroCount; }
+    uint32_t GetDroppedCount() const { return m_droppedCount; }
+    /* Keys sent, the SendKeys() calls they took, and keys the sink failed to send. */
+    uint64_t GetSentCount() const { return m_sentCount; }
+    uint64_t GetBatchCount() const { return m_batchCount; }
+    uint64_t GetFailedCount() const { return m_failedCount; }
+
+private:
+    COutputEngine(COutputEngine const &) = delete;
+    COutputEngine &operator=(COutputEngine const &) = delete;
+
+    // A modifier the macro let go of, to be pressed again only if it's still held.
+    static uint8_t const FLAG_RESTORE = 0x80;
+
+    // Sends are scheduled on the previous key's scheduled time, so a late Flush() catches
+    // up, but not by more than this, so that a stall doesn't come out as one burst.
+    static uint64_t const MAX_CATCH_UP = 50000;
+
+    struct Entry
+    {
+        uint32_t delay;     // Microseconds after the key before it.
+        uint8_t keycode;
+        uint8_t flags;      // KeyEvent::FLAG_DOWN, FLAG_EXTENDED and FLAG_RESTORE.
+    };
+
+    bool SendBatch(size_t count);
+    void Abandon(uint32_t now);
+    void Push(uint8_t keycode, uint8_t flags, uint32_t delay);
+    unsigned ChangeModifiers(unsigned from, unsigned to, uint32_t delay);
+
+    IOutputSink &m_sink;
+    CKeymap const *m_keymap;
+    CKeymapPublisher *m_publisher;
+    unsigned m_reader;
+    CKeyStateTracker const *m_keyState;
+
+    Entry m_arena[ARENA_KEYS];
+    size_t m_head;
+    size_t m_tail;
+    uint64_t m_lastSend;    // When the last key was (scheduled to be) sent, in microseconds.
+    KeyEvent m_batch[BATCH_KEYS];
+    // Keys sent down and not yet up, and held modifiers let go of and not yet pressed
+    // again, one bit per keycode.
+    uint64_t m_pressed[4];
+    uint64_t m_letGo[4];
+
+    uint32_t m_macroCount;
+    uint32_t m_droppedCount;
+    uint64_t m_sentCount;
+    uint64_t m_batchCount;
+    uint64_t m_failedCount;
+};
@@ -0,0 +1,134 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "PluginLibrary.h"
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+CPluginLibrary::CPluginLibrary() :
+    m_library(nullptr),
+    m_plugin(nullptr)
+{
+}
+
+CPluginLibrary::~CPluginLibrary()
+{
+    Unload();
+}
+
+bool CPluginLibrary::Load(FileNameChar const *path, char const **error)
+{
+    char const *ignored;
+    error = error ? error : &ignored;
+    Unload();
+    m_library = OpenLibrary(path);
+    if (!m_library) {
+        *error = "Can't load the library";
+        return false;
+    }
+    CaptainHookPluginInitFunction init = reinterpret_cast<CaptainHookPluginInitFunction>(FindInit());
+    if (!init) {
+        *error = "Not a plugin: no " CAPTAINHOOK_PLUGIN_INIT "()";
+        CloseLibrary();
+        return false;
+    }
+    CaptainHookPlugin const *plugin = init(CAPTAINHOOK_PLUGIN_ABI_VERSION);
+    if (!plugin) {
+        *error = "The plugin declined to load";
+        CloseLibrary();
+        return false;
+    }
+    // Version 1 is everything up to and including unload; later versions only add to the
+    // end. A description that's short of that can't be trusted even to unload.
+    size_t const version1Size = offsetof(CaptainHookPlugin, unload) + sizeof(plugin->unload);
+    if ((plugin->size < version1Size) || (plugin->abiVersion < 1) || !plugin->handleEvent) {
+        *error = "The plugin is for another version";
+        CloseLibrary();
+        return false;
+    }
+    m_plugin = plugin;
+    return true;
+}
+
+void CPluginLibrary::Unload()
+{
+    if (m_plugin && m_plugin->unload) {
+        m_plugin->unload(m_plugin->context);
+    }
+    m_plugin = nullptr;
+    CloseLibrary();
+}
+
+#ifdef _WIN32
+
+void *CPluginLibrary::OpenLibrary(FileNameChar const *path)
+{
+    return ::LoadLibraryW(path);
+}
+
+void *CPluginLibrary::FindInit()
+{
+    return reinterpret_cast<void *>(::GetProcAddress(static_cast<HMODULE>(m_library), CAPTAINHOOK_PLUGIN_INIT));
+}
+
+void CPluginLibrary::CloseLibrary()
+{
+    if (m_library) {
+        ::FreeLibrary(static_cast<HMODULE>(m_library));
+        m_library = nullptr;
+    }
+}
+
+#else
+
+void *CPluginLibrary::OpenLibrary(FileNameChar const *path)
+{
+    return dlopen(path, RTLD_NOW | RTLD_LOCAL);
+}
+
+void *CPluginLibrary::FindInit()
+{
+    return dlsym(m_library, CAPTAINHOOK_PLUGIN_INIT);
+}
+
+void CPluginLibrary::CloseLibrary()
+{
+    if (m_library) {
+        dlclose(m_library);
+        m_library = nullptr;
+    }
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include "CaptainHookPlugin.h"
+#include "MappedFile.h"
+
+/* A handler plugin (see CaptainHookPlugin.h) loaded from a shared library: LoadLibrary()
+   on Windows, dlopen() elsewhere, where a path without a slash is looked for the way the
+   dynamic linker looks for libraries. Unloading calls the plugin's unload first, so take
+   it off any CEventBus before then. */
+class CPluginLibrary
+{
+public:
+    CPluginLibrary();
+    ~CPluginLibrary();
+
+    /* On failure, error (if not NULL) says why. */
+    bool Load(FileNameChar const *path, char const **error);
+    void Unload();
+
+    /* NULL until loaded. */
+    CaptainHookPlugin const *GetPlugin() const { return m_plugin; }
+
+private:
+    CPluginLibrary(CPluginLibrary const &) = delete;
+    CPluginLibrary &operator=(CPluginLibrary const &) = delete;
+
+    void *OpenLibrary(FileNameChar const *path);
+    void *FindInit();
+    void CloseLibrary();
+
+    void *m_library;
+    CaptainHookPlugin const *m_plugin;
+};
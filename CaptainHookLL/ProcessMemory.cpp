@@ -0,0 +1,82 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "ProcessMemory.h"
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+bool GetProcessMemory(ProcessMemory &memory)
+{
+    PROCESS_MEMORY_COUNTERS_EX counters;
+    if (!::GetProcessMemoryInfo(::GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS *>(&counters), sizeof(counters))) {
+        memory.resident = 0;
+        memory.privateBytes = 0;
+        return false;
+    }
+    memory.resident = counters.WorkingSetSize;
+    memory.privateBytes = counters.PrivateUsage;
+    return true;
+}
+
+#else
+
+bool GetProcessMemory(ProcessMemory &memory)
+{
+    memory.resident = 0;
+    memory.privateBytes = 0;
+
+    // statm is in pages: size, resident, shared (file-backed resident), ...
+    FILE *file = fopen("/proc/self/statm", "re");
+    if (!file) {
+        return false;
+    }
+    unsigned long long size;
+    unsigned long long resident;
+    unsigned long long shared;
+    int fields = fscanf(file, "%llu %llu %llu", &size, &resident, &shared);
+    fclose(file);
+    if (fields != 3) {
+        return false;
+    }
+    uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    memory.resident = resident * pageSize;
+    memory.privateBytes = (resident - shared) * pageSize;
+    return true;
+}
+
+#endif
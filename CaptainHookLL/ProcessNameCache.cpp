@@ -0,0 +1,134 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "stdafx.h"
+#include "ProcessNameCache.h"
+
+CProcessNameCache::CProcessNameCache() :
+    m_entries(),
+    m_clock(0),
+    m_hitCount(0),
+    m_missCount(0)
+{
+}
+
+CProcessNameCache::~CProcessNameCache()
+{
+    Clear();
+}
+
+void CProcessNameCache::Clear()
+{
+    for (size_t i = 0; i < CACHE_SIZE; ++i) {
+        Release(m_entries[i]);
+    }
+}
+
+size_t CProcessNameCache::GetWindowProcessName(HWND hWnd, char *name)
+{
+    DWORD processId = 0;
+    if (!hWnd || !::GetWindowThreadProcessId(hWnd, &processId) || !processId) {
+        return 0;
+    }
+
+    ++m_clock;
+    for (size_t i = 0; i < CACHE_SIZE; ++i) {
+        Entry &entry = m_entries[i];
+        if (entry.hProcess && (entry.processId == processId)) {
+            /* Once the cached process has exited, its ID may belong to another. */
+            if (::WaitForSingleObject(entry.hProcess, 0) == WAIT_TIMEOUT) {
+                entry.lastUsed = m_clock;
+                ++m_hitCount;
+                memcpy(name, entry.name, entry.length + 1);
+                return entry.length;
+            }
+            Release(entry);
+        }
+    }
+
+    ++m_missCount;
+    HANDLE hProcess = ::OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE, FALSE, processId);
+    if (!hProcess) {
+        return 0;
+    }
+    WCHAR path[MAX_PATH];
+    DWORD pathLength = MAX_PATH;
+    if (!::QueryFullProcessImageNameW(hProcess, 0, path, &pathLength)) {
+        ::CloseHandle(hProcess);
+        return 0;
+    }
+    WCHAR const *baseName = path;
+    for (DWORD i = 0; i < pathLength; ++i) {
+        if (path[i] == L'\\') {
+            baseName = path + i + 1;
+        }
+    }
+
+    /* Names too long for a profile fail to convert, and aren't cached. */
+    Entry &entry = *FindVictim();
+    Release(entry);
+    int length = ::WideCharToMultiByte(CP_UTF8, 0, baseName, static_cast<int>(path + pathLength - baseName),
+        entry.name, static_cast<int>(APP_NAME_LENGTH - 1), NULL, NULL);
+    if (length <= 0) {
+        ::CloseHandle(hProcess);
+        return 0;
+    }
+    entry.name[length] = '\0';
+    entry.length = static_cast<size_t>(length);
+    entry.hProcess = hProcess;
+    entry.processId = processId;
+    entry.lastUsed = m_clock;
+    memcpy(name, entry.name, entry.length + 1);
+    return entry.length;
+}
+
+void CProcessNameCache::Release(Entry &entry)
+{
+    if (entry.hProcess) {
+        ::CloseHandle(entry.hProcess);
+        entry.hProcess = NULL;
+    }
+}
+
+CProcessNameCache::Entry *CProcessNameCache::FindVictim()
+{
+    /* A free entry if there is one, or else the least recently used. */
+    Entry *victim = &m_entries[0];
+    for (size_t i = 0; i < CACHE_SIZE; ++i) {
+        if (!m_entries[i].hProcess) {
+            return &m_entries[i];
+        }
+        if (static_cast<int32_t>(m_entries[i].lastUsed - victim->lastUsed) < 0) {
+            victim = &m_entries[i];
+        }
+    }
+    return victim;
+}
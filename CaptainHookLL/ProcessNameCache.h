@@ -0,0 +1,76 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include "AppFocus.h"
+
+/* Finds the name of the program a window belongs to (e.g. "notepad.exe"), for keymap
+   profiles. Opening a process and asking for its image name takes far longer than a key
+   should, and the focus mostly moves back and forth between the same few programs, so
+   the names are cached by process ID. Each entry keeps its process handle open, which
+   stops the ID being reused while the entry exists; an entry whose process has exited is
+   dropped the next time its ID comes up. Not thread safe. */
+class CProcessNameCache
+{
+public:
+    static size_t const CACHE_SIZE = 16;
+
+    CProcessNameCache();
+    virtual ~CProcessNameCache();
+
+    /* Copy the file name of hWnd's program (without its path, in UTF-8) into name, which
+       holds APP_NAME_LENGTH characters. Returns its length, or 0 if it can't be found
+       out: the window has gone, say, or belongs to a process we may not query. */
+    size_t GetWindowProcessName(HWND hWnd, char *name);
+
+    void Clear();
+
+    UINT GetHitCount() const { return m_hitCount; }
+    UINT GetMissCount() const { return m_missCount; }
+
+protected:
+    struct Entry
+    {
+        HANDLE  hProcess;   // NULL if the entry is free
+        DWORD   processId;
+        DWORD   lastUsed;
+        size_t  length;
+        char    name[APP_NAME_LENGTH];
+    };
+
+    static void Release(Entry &entry);
+    Entry *FindVictim();
+
+    Entry   m_entries[CACHE_SIZE];
+    DWORD   m_clock;
+    UINT    m_hitCount;
+    UINT    m_missCount;
+};
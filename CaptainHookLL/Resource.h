@@ -15,6 +15,7 @@
 #define IDI_NOTIFICATIONHOOKBAIT        131
 #define IDI_NOTIFICATIONHOOKFISH        132
 #define ID_FILE_ABOUT                   32771
+#define IDM_STATISTICS                  32772
 #define IDC_STATIC                      -1
 
 // Next default values for new objects
@@ -23,7 +24,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NO_MFC                     1
 #define _APS_NEXT_RESOURCE_VALUE        131
-#define _APS_NEXT_COMMAND_VALUE         32772
+#define _APS_NEXT_COMMAND_VALUE         32773
 #define _APS_NEXT_CONTROL_VALUE         1000
 #define _APS_NEXT_SYMED_VALUE           110
 #endif
@@ -0,0 +1,683 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "RuleMachine.h"
+#include "Keymap.h"
+#include "VirtualKeys.h"
+#include <string.h>
+
+namespace {
+
+/* Names that read the modifier snapshot. */
+struct FlagName
+{
+    char const *name;
+    uint32_t mask;
+};
+
+FlagName const s_flagNames[] = {
+    { "capslock", KEYSTATE_CAPSLOCK },
+    { "numlock", KEYSTATE_NUMLOCK },
+    { "scrolllock", KEYSTATE_SCROLLLOCK },
+    { "shift", KEYSTATE_LSHIFT | KEYSTATE_RSHIFT },
+    { "ctrl", KEYSTATE_LCONTROL | KEYSTATE_RCONTROL },
+    { "control", KEYSTATE_LCONTROL | KEYSTATE_RCONTROL },
+    { "alt", KEYSTATE_LALT | KEYSTATE_RALT },
+    { "win", KEYSTATE_LWIN | KEYSTATE_RWIN },
+};
+
+struct FunctionName
+{
+    char const *name;
+    unsigned opcode;
+};
+
+FunctionName const s_functionNames[] = {
+    { "down", RULE_OP_DOWN },
+    { "since", RULE_OP_SINCE },
+    { "presses", RULE_OP_PRESSES },
+};
+
+bool EqualsIgnoreCase(char const *a, size_t aLength, char const *b)
+{
+    size_t bLength = strlen(b);
+    if (aLength != bLength) {
+        return false;
+    }
+    for (size_t i = 0; i < aLength; ++i) {
+        char ca = a[i];
+        char cb = b[i];
+        if ((ca >= 'A') && (ca <= 'Z')) {
+            ca = static_cast<char>(ca - 'A' + 'a');
+        }
+        if ((cb >= 'A') && (cb <= 'Z')) {
+            cb = static_cast<char>(cb - 'A' + 'a');
+        }
+        if (ca != cb) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IsNameCharacter(char c)
+{
+    return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) || (c == '_');
+}
+
+/* A recursive descent parser that writes code as it goes. Each level leaves its value in
+   register r and may use the registers above it; && and || jump over their right-hand
+   side once the answer is known. */
+class CConditionCompiler
+{
+public:
+    CConditionCompiler(char const *text, size_t length, RuleCondition &condition) :
+        m_text(text),
+        m_length(length),
+        m_pos(0),
+        m_condition(condition),
+        m_error(nullptr),
+        m_where(text)
+    {
+        memset(&m_condition, 0, sizeof(m_condition));
+    }
+
+    char const *Compile(char const *&where)
+    {
+        if (Or(0)) {
+            SkipSpace();
+            if (m_pos < m_length) {
+                Fail("Unexpected");
+            } else {
+                Emit(MakeRuleInstruction(RULE_OP_RET, 0, 0, 0));
+            }
+        }
+        where = m_where;
+        return m_error;
+    }
+
+private:
+    bool Or(unsigned r) { return Chain(r, "||", RULE_OP_JNZ, &CConditionCompiler::And); }
+    bool And(unsigned r) { return Chain(r, "&&", RULE_OP_JZ, &CConditionCompiler::Comparison); }
+
+    /* left op right op ..., stopping at the first operand that settles it. The result is
+       made 0 or 1 at the end, where the jumps land. */
+    bool Chain(unsigned r, char const *op, unsigned jump, bool (CConditionCompiler::*operand)(unsigned))
+    {
+        if (!(this->*operand)(r)) {
+            return false;
+        }
+        size_t jumps[RULE_MAX_INSTRUCTIONS];
+        size_t jumpCount = 0;
+        while (Match(op)) {
+            jumps[jumpCount++] = m_condition.length;
+            if (!Emit(MakeRuleImmediate(jump, r, 0)) || !(this->*operand)(r)) {
+                return false;
+            }
+        }
+        if (jumpCount == 0) {
+            return true;
+        }
+        for (size_t i = 0; i < jumpCount; ++i) {
+            unsigned skip = static_cast<unsigned>(m_condition.length - jumps[i] - 1);
+            m_condition.code[jumps[i]] = MakeRuleImmediate(jump, r, skip);
+        }
+        return Emit(MakeRuleInstruction(RULE_OP_NOT, r, r, 0)) && Emit(MakeRuleInstruction(RULE_OP_NOT, r, r, 0));
+    }
+
+    bool Comparison(unsigned r)
+    {
+        if (!Sum(r)) {
+            return false;
+        }
+        // a > b is b < a, and so on.
+        static struct {
+            char const *op;
+            unsigned opcode;
+            bool swap;
+        } const comparisons[] = {
+            { "<=", RULE_OP_LE, false },
+            { ">=", RULE_OP_LE, true },
+            { "==", RULE_OP_EQ, false },
+            { "!=", RULE_OP_NE, false },
+            { "<", RULE_OP_LT, false },
+            { ">", RULE_OP_LT, true },
+        };
+        for (size_t i = 0; i < sizeof(comparisons) / sizeof(comparisons[0]); ++i) {
+            if (Match(comparisons[i].op)) {
+                if (!Register(r + 1) || !Sum(r + 1)) {
+                    return false;
+                }
+                unsigned left = comparisons[i].swap ? r + 1 : r;
+                unsigned right = comparisons[i].swap ? r : r + 1;
+                return Emit(MakeRuleInstruction(comparisons[i].opcode, r, left, right));
+            }
+        }
+        return true;
+    }
+
+    bool Sum(unsigned r)
+    {
+        if (!Product(r)) {
+            return false;
+        }
+        for (;;) {
+            unsigned opcode;
+            if (Match("+")) {
+                opcode = RULE_OP_ADD;
+            } else if (Match("-")) {
+                opcode = RULE_OP_SUB;
+            } else {
+                return true;
+            }
+            if (!Register(r + 1) || !Product(r + 1) || !Emit(MakeRuleInstruction(opcode, r, r, r + 1))) {
+                return false;
+            }
+        }
+    }
+
+    bool Product(unsigned r)
+    {
+        if (!Unary(r)) {
+            return false;
+        }
+        for (;;) {
+            unsigned opcode;
+            if (Match("*")) {
+                opcode = RULE_OP_MUL;
+            } else if (Match("%")) {
+                opcode = RULE_OP_MOD;
+            } else {
+                return true;
+            }
+            if (!Register(r + 1) || !Unary(r + 1) || !Emit(MakeRuleInstruction(opcode, r, r, r + 1))) {
+                return false;
+            }
+        }
+    }
+
+    bool Unary(unsigned r)
+    {
+        // "!=" is a comparison, not a negation.
+        SkipSpace();
+        if ((m_pos < m_length) && (m_text[m_pos] == '!') && !((m_pos + 1 < m_length) && (m_text[m_pos + 1] == '='))) {
+            ++m_pos;
+            return Unary(r) && Emit(MakeRuleInstruction(RULE_OP_NOT, r, r, 0));
+        }
+        return Primary(r);
+    }
+
+    bool Primary(unsigned r)
+    {
+        SkipSpace();
+        if (m_pos >= m_length) {
+            return Fail("Condition ends too soon");
+        }
+        if (Match("(")) {
+            if (!Or(r)) {
+                return false;
+            }
+            return Match(")") || Fail("Expected )");
+        }
+
+        size_t start = m_pos;
+        if ((m_text[m_pos] >= '0') && (m_text[m_pos] <= '9')) {
+            unsigned value = 0;
+            while ((m_pos < m_length) && (m_text[m_pos] >= '0') && (m_text[m_pos] <= '9')) {
+                value = value * 10 + static_cast<unsigned>(m_text[m_pos++] - '0');
+                if (value > 0xFFFF) {
+                    m_pos = start;
+                    return Fail("Number too big");
+                }
+            }
+            return Emit(MakeRuleImmediate(RULE_OP_LOAD, r, value));
+        }
+
+        while ((m_pos < m_length) && IsNameCharacter(m_text[m_pos])) {
+            ++m_pos;
+        }
+        char const *name = m_text + start;
+        size_t nameLength = m_pos - start;
+        if (nameLength == 0) {
+            return Fail("Unexpected");
+        }
+        for (size_t i = 0; i < sizeof(s_flagNames) / sizeof(s_flagNames[0]); ++i) {
+            if (EqualsIgnoreCase(name, nameLength, s_flagNames[i].name)) {
+                return Emit(MakeRuleImmediate(RULE_OP_FLAGS, r, s_flagNames[i].mask));
+            }
+        }
+        if (EqualsIgnoreCase(name, nameLength, "repeat")) {
+            return Emit(MakeRuleInstruction(RULE_OP_STATE, r, RULE_STATE_REPEAT, 0));
+        }
+        if (EqualsIgnoreCase(name, nameLength, "held")) {
+            return Emit(MakeRuleInstruction(RULE_OP_STATE, r, RULE_STATE_HELD, 0));
+        }
+        for (size_t i = 0; i < sizeof(s_functionNames) / sizeof(s_functionNames[0]); ++i) {
+            if (EqualsIgnoreCase(name, nameLength, s_functionNames[i].name)) {
+                return Function(r, s_functionNames[i].opcode);
+            }
+        }
+        m_pos = start;
+        return Fail("Unknown name");
+    }
+
+    /* down(Key), since(Key) or presses(Key). Shift, Ctrl, Alt and Win mean either side. */
+    bool Function(unsigned r, unsigned opcode)
+    {
+        if (!Match("(")) {
+            return Fail("Expected (");
+        }
+        SkipSpace();
+        size_t start = m_pos;
+        while ((m_pos < m_length) && (m_text[m_pos] != ')') && (m_text[m_pos] != ' ')) {
+            ++m_pos;
+        }
+        char const *name = m_text + start;
+        size_t nameLength = m_pos - start;
+        uint8_t left = 0;
+        uint8_t right = 0;
+        uint32_t flags = 0;
+        if (EqualsIgnoreCase(name, nameLength, "Win")) {
+            left = VKEY_LWIN;
+            right = VKEY_RWIN;
+            flags = KEYSTATE_LWIN | KEYSTATE_RWIN;
+        } else {
+            left = CKeymap::KeycodeFromName(name, nameLength);
+            switch (left) {
+            case VKEY_SHIFT:
+                left = VKEY_LSHIFT;
+                right = VKEY_RSHIFT;
+                flags = KEYSTATE_LSHIFT | KEYSTATE_RSHIFT;
+                break;
+            case VKEY_CONTROL:
+                left = VKEY_LCONTROL;
+                right = VKEY_RCONTROL;
+                flags = KEYSTATE_LCONTROL | KEYSTATE_RCONTROL;
+                break;
+            case VKEY_MENU:
+                left = VKEY_LMENU;
+                right = VKEY_RMENU;
+                flags = KEYSTATE_LALT | KEYSTATE_RALT;
+                break;
+            default:
+                break;
+            }
+        }
+        if (left == 0) {
+            m_pos = start;
+            return Fail("Unknown key");
+        }
+        if (!Match(")")) {
+            return Fail("Expected )");
+        }
+        // Either side: held if either is (which the modifier snapshot knows), the more recent
+        // of the two, or both counted.
+        if (right == 0) {
+            return Emit(MakeRuleInstruction(opcode, r, left, 0));
+        }
+        if (opcode == RULE_OP_DOWN) {
+            return Emit(MakeRuleImmediate(RULE_OP_FLAGS, r, flags));
+        }
+        unsigned combine = (opcode == RULE_OP_SINCE) ? RULE_OP_MIN : RULE_OP_ADD;
+        return Emit(MakeRuleInstruction(opcode, r, left, 0)) && Register(r + 1) &&
+            Emit(MakeRuleInstruction(opcode, r + 1, right, 0)) && Emit(MakeRuleInstruction(combine, r, r, r + 1));
+    }
+
+    void SkipSpace()
+    {
+        while ((m_pos < m_length) && ((m_text[m_pos] == ' ') || (m_text[m_pos] == '\t'))) {
+            ++m_pos;
+        }
+    }
+
+    bool Match(char const *op)
+    {
+        SkipSpace();
+        size_t length = strlen(op);
+        if ((m_length - m_pos >= length) && (memcmp(m_text + m_pos, op, length) == 0)) {
+            m_pos += length;
+            return true;
+        }
+        return false;
+    }
+
+    bool Register(unsigned r)
+    {
+        return (r < RULE_REGISTERS) || Fail("Condition too complex");
+    }
+
+    bool Emit(uint32_t instruction)
+    {
+        if (m_condition.length >= RULE_MAX_INSTRUCTIONS) {
+            return Fail("Condition too long");
+        }
+        m_condition.code[m_condition.length++] = instruction;
+        return true;
+    }
+
+    bool Fail(char const *error)
+    {
+        if (!m_error) {
+            m_error = error;
+            m_where = m_text + m_pos;
+        }
+        return false;
+    }
+
+    char const *m_text;
+    size_t m_length;
+    size_t m_pos;
+    RuleCondition &m_condition;
+    char const *m_error;
+    char const *m_where;
+};
+
+} // namespace
+
+char const *CompileRuleCondition(char const *text, size_t length, RuleCondition &condition, char const *&where)
+{
+    CConditionCompiler compiler(text, length, condition);
+    return compiler.Compile(where);
+}
+
+CRuleTable::CRuleTable()
+{
+    Clear();
+}
+
+void CRuleTable::Clear()
+{
+    m_conditions.clear();
+    m_rules.clear();
+    m_ruleIndex.clear();
+    UseOwnData();
+}
+
+bool CRuleTable::SetConditions(RuleCondition const *conditions, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        if (!IsValidCondition(conditions[i])) {
+            return false;
+        }
+    }
+    Clear();
+    m_conditions.assign(conditions, conditions + count);
+    UseOwnData();
+    return true;
+}
+
+uint32_t CRuleTable::AddRule(uint32_t condition, uint32_t then, uint32_t otherwise)
+{
+    if ((condition >= m_conditions.size()) || KeymapIsRule(then) ||
+        (KeymapIsRule(otherwise) && (KeymapRuleIndex(otherwise) >= m_rules.size()))) {
+        return NO_RULE;
+    }
+    std::tuple<uint32_t, uint32_t, uint32_t> key(condition, then, otherwise);
+    std::map<std::tuple<uint32_t, uint32_t, uint32_t>, uint32_t>::const_iterator found = m_ruleIndex.find(key);
+    if (found != m_ruleIndex.end()) {
+        return found->second;
+    }
+    if (m_rules.size() >= MAX_RULES) {
+        return NO_RULE;
+    }
+    Rule rule;
+    rule.condition = condition;
+    rule.then = then;
+    rule.otherwise = otherwise;
+    rule.fallback = KeymapIsRule(otherwise) ? m_rules[KeymapRuleIndex(otherwise)].fallback : otherwise;
+    uint32_t index = static_cast<uint32_t>(m_rules.size());
+    m_rules.push_back(rule);
+    m_ruleIndex[key] = index;
+    UseOwnData();
+    return index;
+}
+
+void CRuleTable::WriteImage(std::vector<uint8_t> &image) const
+{
+    image.resize((image.size() + 63) & ~static_cast<size_t>(63));
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.conditionCount = m_conditionCount;
+    header.ruleCount = m_ruleCount;
+    uint8_t const *bytes = reinterpret_cast<uint8_t const *>(&header);
+    image.insert(image.end(), bytes, bytes + sizeof(header));
+
+    bytes = reinterpret_cast<uint8_t const *>(m_conditionData);
+    image.insert(image.end(), bytes, bytes + m_conditionCount * sizeof(RuleCondition));
+    bytes = reinterpret_cast<uint8_t const *>(m_ruleData);
+    image.insert(image.end(), bytes, bytes + m_ruleCount * sizeof(Rule));
+}
+
+bool CRuleTable::AttachImage(void const *data, size_t size)
+{
+    Clear();
+    if ((size < sizeof(ImageHeader)) || (reinterpret_cast<uintptr_t>(data) & 3)) {
+        return false;
+    }
+    ImageHeader const *header = static_cast<ImageHeader const *>(data);
+    uint8_t const *bytes = static_cast<uint8_t const *>(data);
+    size_t conditionOffset = sizeof(ImageHeader);
+    if ((header->conditionCount > (size - conditionOffset) / sizeof(RuleCondition)) || (header->ruleCount > MAX_RULES)) {
+        return false;
+    }
+    size_t ruleOffset = conditionOffset + header->conditionCount * sizeof(RuleCondition);
+    if (header->ruleCount > (size - ruleOffset) / sizeof(Rule)) {
+        return false;
+    }
+
+    // Resolve() trusts the rules completely: every condition must be valid bytecode, and
+    // every chain must end, which it does if rules only ever fall back on earlier ones.
+    RuleCondition const *conditions = reinterpret_cast<RuleCondition const *>(bytes + conditionOffset);
+    for (uint32_t i = 0; i < header->conditionCount; ++i) {
+        if (!IsValidCondition(conditions[i])) {
+            return false;
+        }
+    }
+    Rule const *rules = reinterpret_cast<Rule const *>(bytes + ruleOffset);
+    for (uint32_t i = 0; i < header->ruleCount; ++i) {
+        Rule const &rule = rules[i];
+        if ((rule.condition >= header->conditionCount) || KeymapIsRule(rule.then) || KeymapIsRule(rule.fallback) ||
+            (KeymapIsRule(rule.otherwise) && (KeymapRuleIndex(rule.otherwise) >= i))) {
+            return false;
+        }
+    }
+
+    m_conditionData = conditions;
+    m_conditionCount = header->conditionCount;
+    m_ruleData = rules;
+    m_ruleCount = header->ruleCount;
+    return true;
+}
+
+uint32_t CRuleTable::Resolve(uint32_t entry, RuleContext const &context, unsigned budget, bool &exhausted) const
+{
+    exhausted = false;
+    while (KeymapIsRule(entry)) {
+        Rule const &rule = m_ruleData[KeymapRuleIndex(entry)];
+        int result = Run(rule.condition, context, budget);
+        if (result < 0) {
+            exhausted = true;
+            return rule.fallback;
+        }
+        entry = result ? rule.then : rule.otherwise;
+    }
+    return entry;
+}
+
+int CRuleTable::Run(uint32_t condition, RuleContext const &context, unsigned &budget) const
+{
+    RuleCondition const &program = m_conditionData[condition];
+    int32_t registers[RULE_REGISTERS] = {};
+    CKeyStateTracker const &keys = *context.keys;
+
+    // Registers are masked rather than checked, which costs nothing and keeps even a
+    // corrupt program inside the array; IsValidCondition() has vouched for the rest.
+    unsigned const mask = RULE_REGISTERS - 1;
+    for (unsigned pc = 0; pc < program.length; ) {
+        if (budget == 0) {
+            return -1;
+        }
+        --budget;
+        uint32_t instruction = program.code[pc++];
+        int32_t &a = registers[(instruction >> 8) & mask];
+        unsigned b = (instruction >> 16) & 0xFF;
+        unsigned c = instruction >> 24;
+        unsigned immediate = instruction >> 16;
+        int32_t vb = registers[b & mask];
+        int32_t vc = registers[c & mask];
+        switch (instruction & 0xFF) {
+        case RULE_OP_RET:
+            return (a != 0) ? 1 : 0;
+        case RULE_OP_LOAD:
+            a = static_cast<int32_t>(immediate);
+            break;
+        case RULE_OP_FLAGS:
+            a = (keys.GetModifierSnapshot() & immediate) ? 1 : 0;
+            break;
+        case RULE_OP_STATE:
+            a = (b == RULE_STATE_REPEAT) ? ((context.transition == KEY_REPEAT) ? 1 : 0) : static_cast<int32_t>(keys.GetDownCount());
+            break;
+        case RULE_OP_DOWN:
+            a = keys.IsDown(static_cast<uint8_t>(b)) ? 1 : 0;
+            break;
+        case RULE_OP_SINCE: {
+            uint32_t edge = keys.GetEdgeTime(static_cast<uint8_t>(b));
+            int32_t since = static_cast<int32_t>(context.time - edge);
+            a = ((edge == 0) || (since < 0)) ? INT32_MAX : since;
+            break;
+        }
+        case RULE_OP_PRESSES:
+            a = static_cast<int32_t>(keys.GetPressCount(static_cast<uint8_t>(b)) & 0x7FFFFFFF);
+            break;
+        // Arithmetic wraps rather than overflowing.
+        case RULE_OP_ADD:
+            a = static_cast<int32_t>(static_cast<uint32_t>(vb) + static_cast<uint32_t>(vc));
+            break;
+        case RULE_OP_SUB:
+            a = static_cast<int32_t>(static_cast<uint32_t>(vb) - static_cast<uint32_t>(vc));
+            break;
+        case RULE_OP_MUL:
+            a = static_cast<int32_t>(static_cast<uint32_t>(vb) * static_cast<uint32_t>(vc));
+            break;
+        case RULE_OP_MOD:
+            a = ((vc == 0) || (vc == -1)) ? 0 : vb % vc;
+            break;
+        case RULE_OP_MIN:
+            a = (vb < vc) ? vb : vc;
+            break;
+        case RULE_OP_LT:
+            a = (vb < vc) ? 1 : 0;
+            break;
+        case RULE_OP_LE:
+            a = (vb <= vc) ? 1 : 0;
+            break;
+        case RULE_OP_EQ:
+            a = (vb == vc) ? 1 : 0;
+            break;
+        case RULE_OP_NE:
+            a = (vb != vc) ? 1 : 0;
+            break;
+        case RULE_OP_NOT:
+            a = (vb == 0) ? 1 : 0;
+            break;
+        case RULE_OP_JZ:
+            pc += (a == 0) ? immediate : 0;
+            break;
+        case RULE_OP_JNZ:
+            pc += (a != 0) ? immediate : 0;
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+bool CRuleTable::IsValidCondition(RuleCondition const &condition)
+{
+    if (condition.length > RULE_MAX_INSTRUCTIONS) {
+        return false;
+    }
+    for (unsigned pc = 0; pc < condition.length; ++pc) {
+        uint32_t instruction = condition.code[pc];
+        unsigned opcode = instruction & 0xFF;
+        unsigned a = (instruction >> 8) & 0xFF;
+        unsigned b = (instruction >> 16) & 0xFF;
+        unsigned c = instruction >> 24;
+        unsigned immediate = instruction >> 16;
+        if ((opcode >= RULE_OP_COUNT) || (a >= RULE_REGISTERS)) {
+            return false;
+        }
+        switch (opcode) {
+        case RULE_OP_STATE:
+            if (b >= RULE_STATE_COUNT) {
+                return false;
+            }
+            break;
+        case RULE_OP_ADD:
+        case RULE_OP_SUB:
+        case RULE_OP_MUL:
+        case RULE_OP_MOD:
+        case RULE_OP_MIN:
+        case RULE_OP_LT:
+        case RULE_OP_LE:
+        case RULE_OP_EQ:
+        case RULE_OP_NE:
+            if ((b >= RULE_REGISTERS) || (c >= RULE_REGISTERS)) {
+                return false;
+            }
+            break;
+        case RULE_OP_NOT:
+            if (b >= RULE_REGISTERS) {
+                return false;
+            }
+            break;
+        case RULE_OP_JZ:
+        case RULE_OP_JNZ:
+            if (immediate > condition.length - pc - 1) {
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+void CRuleTable::UseOwnData()
+{
+    m_conditionData = m_conditions.data();
+    m_conditionCount = static_cast<uint32_t>(m_conditions.size());
+    m_ruleData = m_rules.data();
+    m_ruleCount = static_cast<uint32_t>(m_rules.size());
+}
@@ -0,0 +1,193 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <tuple>
+#include <vector>
+#include "KeyState.h"
+
+static unsigned const RULE_MAX_INSTRUCTIONS = 32;
+static unsigned const RULE_REGISTERS = 8;
+
+/* The instructions one key may spend on conditions, across all the rules it goes
+   through. Enough for a dozen or so conditions of the usual size on the same key. */
+static unsigned const RULE_BUDGET = 256;
+
+/* A binding's condition (its when=), compiled to bytecode for CRuleTable. */
+struct RuleCondition
+{
+    uint32_t code[RULE_MAX_INSTRUCTIONS];
+    uint8_t length;
+};
+
+/* The machine has RULE_REGISTERS signed 32-bit registers, all 0 to begin with, and runs a
+   condition's instructions in order until RET; running off the end means false. Each
+   instruction is one word, opcode | a << 8 | b << 16 | c << 24, or opcode | a << 8 |
+   imm << 16 for those with a 16-bit immediate. Jumps only go forward, so a condition can
+   never take more steps than it has instructions. */
+enum RuleOpcode {
+    RULE_OP_RET,        // return a != 0
+    RULE_OP_LOAD,       // a = imm
+    RULE_OP_FLAGS,      // a = (modifier snapshot & imm) != 0, imm being KEYSTATE_* bits
+    RULE_OP_STATE,      // a = RULE_STATE_* field b
+    RULE_OP_DOWN,       // a = whether key b is held
+    RULE_OP_SINCE,      // a = milliseconds since key b last went down or up (INT32_MAX if never)
+    RULE_OP_PRESSES,    // a = times key b has been pressed
+    RULE_OP_ADD,        // a = b + c
+    RULE_OP_SUB,        // a = b - c
+    RULE_OP_MUL,        // a = b * c
+    RULE_OP_MOD,        // a = b % c (0 if c is 0)
+    RULE_OP_MIN,        // a = min(b, c)
+    RULE_OP_LT,         // a = b < c
+    RULE_OP_LE,         // a = b <= c
+    RULE_OP_EQ,         // a = b == c
+    RULE_OP_NE,         // a = b != c
+    RULE_OP_NOT,        // a = !b
+    RULE_OP_JZ,         // if a == 0, skip the next imm instructions
+    RULE_OP_JNZ,        // if a != 0, skip the next imm instructions
+    RULE_OP_COUNT
+};
+
+enum RuleStateField {
+    RULE_STATE_REPEAT,  // 1 if the key is autorepeating
+    RULE_STATE_HELD,    // the number of keys held, this one included
+    RULE_STATE_COUNT
+};
+
+inline uint32_t MakeRuleInstruction(unsigned opcode, unsigned a, unsigned b, unsigned c)
+{
+    return (opcode & 0xFF) | ((a & 0xFF) << 8) | ((b & 0xFF) << 16) | ((c & 0xFF) << 24);
+}
+
+inline uint32_t MakeRuleImmediate(unsigned opcode, unsigned a, unsigned immediate)
+{
+    return (opcode & 0xFF) | ((a & 0xFF) << 8) | ((immediate & 0xFFFF) << 16);
+}
+
+/* Compile a condition, such as "capslock && since(Ctrl) < 200" (see CKeymap::Load() for
+   the language). Returns NULL, or what's wrong with it, with where pointing at the
+   problem. */
+char const *CompileRuleCondition(char const *text, size_t length, RuleCondition &condition, char const *&where);
+
+/* What conditions see: the key state as of the key being looked up (so including that
+   key's own press or release), and that key's event. */
+struct RuleContext
+{
+    CKeyStateTracker const *keys;
+    uint32_t time;
+    KeyTransition transition;
+};
+
+/* A keymap's conditional bindings. A rule is a condition and two keymap entries: the
+   binding's own, taken if the condition holds, and whatever the key would have done
+   without the binding, which may be another rule's entry (see KeymapIsRule()) where
+   several conditional bindings stack up on the same key. Each rule also knows the
+   ordinary entry at the end of that chain, which is what the key gets if the budget runs
+   out.
+
+   As with the keymap's other tables, the compiled rules are plain data that can be saved
+   in a keymap image and used straight from it. Resolving never allocates. */
+class CRuleTable
+{
+public:
+    static uint32_t const MAX_RULES = 0x8000;
+    static uint32_t const NO_RULE = 0xFFFFFFFF;
+
+    CRuleTable();
+
+    // Moving keeps the vectors' buffers, so the data pointers stay valid.
+    CRuleTable(CRuleTable &&) = default;
+    CRuleTable &operator=(CRuleTable &&) = default;
+
+    void Clear();
+
+    /* Check and take the conditions that rules will refer to by index, dropping any rules.
+       Returns false if a condition isn't valid bytecode. */
+    bool SetConditions(RuleCondition const *conditions, size_t count);
+
+    /* Add a rule, or find the identical one already added. otherwise must be an ordinary
+       entry or one of an earlier rule. Returns the rule's index, or NO_RULE if there are
+       too many or the arguments are bad. */
+    uint32_t AddRule(uint32_t condition, uint32_t then, uint32_t otherwise);
+
+    /* Append the table to a keymap image, starting at a 64-byte boundary. */
+    void WriteImage(std::vector<uint8_t> &image) const;
+
+    /* Use a table written by WriteImage() in place, as CSequenceTable::AttachImage(). */
+    bool AttachImage(void const *data, size_t size);
+
+    bool IsEmpty() const { return m_ruleCount == 0; }
+    size_t GetRuleCount() const { return m_ruleCount; }
+    size_t GetConditionCount() const { return m_conditionCount; }
+
+    /* Follow a keymap entry through its rules to an ordinary entry. Sets exhausted if the
+       budget ran out before the conditions did. */
+    uint32_t Resolve(uint32_t entry, RuleContext const &context, unsigned budget, bool &exhausted) const;
+
+    /* Run a single condition: 1 if it holds, 0 if not, or -1 if it ran out of budget. */
+    int Run(uint32_t condition, RuleContext const &context, unsigned &budget) const;
+
+    static bool IsValidCondition(RuleCondition const &condition);
+
+private:
+    struct Rule
+    {
+        uint32_t condition;
+        uint32_t then;
+        uint32_t otherwise;
+        uint32_t fallback;
+    };
+
+    /* How the table starts in an image. The conditions follow, then the rules. */
+    struct ImageHeader
+    {
+        uint32_t conditionCount;
+        uint32_t ruleCount;
+    };
+
+    CRuleTable(CRuleTable const &) = delete;
+    CRuleTable &operator=(CRuleTable const &) = delete;
+
+    void UseOwnData();
+
+    // Either the vectors (for a table compiled here) or an attached image.
+    RuleCondition const *m_conditionData;
+    uint32_t m_conditionCount;
+    Rule const *m_ruleData;
+    uint32_t m_ruleCount;
+
+    std::vector<RuleCondition> m_conditions;
+    std::vector<Rule> m_rules;
+    std::map<std::tuple<uint32_t, uint32_t, uint32_t>, uint32_t> m_ruleIndex;
+};
@@ -0,0 +1,392 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "SequenceMatcher.h"
+#include <string.h>
+#include <algorithm>
+
+CSequenceTable::CSequenceTable()
+{
+    Clear();
+}
+
+void CSequenceTable::Clear()
+{
+    State root = { 0, 0, 0 };
+    m_states.assign(1, root);
+    m_transitions.clear();
+    m_hashShift = 32;
+    memset(m_firstStrokes, 0, sizeof(m_firstStrokes));
+    UseOwnData();
+}
+
+void CSequenceTable::WriteImage(std::vector<uint8_t> &image) const
+{
+    image.resize((image.size() + 63) & ~static_cast<size_t>(63));
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.stateCount = m_stateCount;
+    header.transitionCount = m_transitionCount;
+    header.hashShift = m_hashShift;
+    memcpy(header.firstStrokes, m_firstStrokes, sizeof(header.firstStrokes));
+    uint8_t const *bytes = reinterpret_cast<uint8_t const *>(&header);
+    image.insert(image.end(), bytes, bytes + sizeof(header));
+
+    bytes = reinterpret_cast<uint8_t const *>(m_stateData);
+    image.insert(image.end(), bytes, bytes + m_stateCount * sizeof(State));
+    image.resize((image.size() + 7) & ~static_cast<size_t>(7));
+    bytes = reinterpret_cast<uint8_t const *>(m_transitionData);
+    image.insert(image.end(), bytes, bytes + m_transitionCount * sizeof(Transition));
+}
+
+bool CSequenceTable::AttachImage(void const *data, size_t size)
+{
+    Clear();
+    if ((size < sizeof(ImageHeader)) || (reinterpret_cast<uintptr_t>(data) & 7)) {
+        return false;
+    }
+    ImageHeader const *header = static_cast<ImageHeader const *>(data);
+    uint8_t const *bytes = static_cast<uint8_t const *>(data);
+    size_t stateOffset = sizeof(ImageHeader);
+    size_t transitionOffset = (stateOffset + static_cast<size_t>(header->stateCount) * sizeof(State) + 7) & ~static_cast<size_t>(7);
+    if ((header->stateCount == 0) || (header->stateCount > (1u << 20)) || (transitionOffset > size) ||
+        (header->transitionCount > (size - transitionOffset) / sizeof(Transition))) {
+        return false;
+    }
+
+    // Lookups trust the table completely, so check everything they rely on: the hash
+    // table is a power of two in size with at least one empty slot (or absent), and every
+    // transition leads from and to a real state.
+    uint32_t transitionCount = header->transitionCount;
+    if (transitionCount != 0) {
+        unsigned bits = 0;
+        while ((1u << bits) < transitionCount) {
+            ++bits;
+        }
+        if (((1u << bits) != transitionCount) || (header->hashShift != 32 - bits)) {
+            return false;
+        }
+    }
+    State const *states = reinterpret_cast<State const *>(bytes + stateOffset);
+    Transition const *transitions = reinterpret_cast<Transition const *>(bytes + transitionOffset);
+    bool haveEmptySlot = false;
+    for (uint32_t i = 0; i < transitionCount; ++i) {
+        if (transitions[i].key == 0) {
+            haveEmptySlot = true;
+        } else if ((((transitions[i].key - 1) >> 12) >= header->stateCount) || (transitions[i].next >= header->stateCount)) {
+            return false;
+        }
+    }
+    if ((transitionCount != 0) && !haveEmptySlot) {
+        return false;
+    }
+
+    m_states.clear();
+    m_stateData = states;
+    m_stateCount = header->stateCount;
+    m_transitionData = transitions;
+    m_transitionCount = transitionCount;
+    m_hashShift = header->hashShift;
+    memcpy(m_firstStrokes, header->firstStrokes, sizeof(m_firstStrokes));
+    return true;
+}
+
+void CSequenceTable::UseOwnData()
+{
+    m_stateData = m_states.data();
+    m_stateCount = static_cast<uint32_t>(m_states.size());
+    m_transitionData = m_transitions.data();
+    m_transitionCount = static_cast<uint32_t>(m_transitions.size());
+}
+
+uint32_t CSequenceTable::Hash(uint32_t key, unsigned shift)
+{
+    return (key * 2654435761u) >> shift;
+}
+
+uint32_t CSequenceTable::AddPath(uint16_t const *strokes, unsigned length, uint16_t timeout, uint8_t flags, EdgeMap &edges)
+{
+    uint32_t state = ROOT;
+    for (unsigned n = 0; n < length; ++n) {
+        uint16_t stroke = strokes[n] & (SEQUENCE_STROKES - 1);
+        if (state == ROOT) {
+            m_firstStrokes[stroke >> 6] |= 1ull << (stroke & 63);
+        }
+        m_states[state].flags |= STATE_HAS_CHILDREN;
+
+        uint32_t key = ((state << 12) | stroke) + 1;
+        EdgeMap::const_iterator edge = edges.find(key);
+        if (edge != edges.end()) {
+            state = edge->second;
+        } else {
+            // State numbers have to fit alongside a stroke in a 32-bit transition key.
+            if (m_states.size() >= (1u << 20)) {
+                return NO_STATE;
+            }
+            State newState = { 0, timeout, 0 };
+            m_states.push_back(newState);
+            state = static_cast<uint32_t>(m_states.size() - 1);
+            edges[key] = state;
+        }
+        m_states[state].timeout = timeout;
+        m_states[state].flags |= flags;
+    }
+    return state;
+}
+
+bool CSequenceTable::Compile(SequenceBinding const *bindings, size_t count)
+{
+    Clear();
+
+    // Build the trie with an ordinary map first, then lay the edges out in the flat table
+    // that lookups use.
+    EdgeMap edges;
+    for (size_t i = 0; i < count; ++i) {
+        SequenceBinding const &binding = bindings[i];
+        if ((binding.length == 0) || (binding.length > SEQUENCE_MAX_LENGTH)) {
+            Clear();
+            return false;
+        }
+
+        if (!binding.chord) {
+            uint16_t timeout = binding.timeout ? binding.timeout : DEFAULT_TIMEOUT;
+            uint32_t state = AddPath(binding.strokes, binding.length, timeout, 0, edges);
+            if (state == NO_STATE) {
+                Clear();
+                return false;
+            }
+            m_states[state].action = binding.action;
+            continue;
+        }
+
+        // A chord is every ordering of its keys, with a short timeout between them. The
+        // number of orderings grows factorially, so chords are kept small.
+        if ((binding.length < 2) || (binding.length > 4)) {
+            Clear();
+            return false;
+        }
+        uint16_t timeout = binding.timeout ? binding.timeout : DEFAULT_CHORD_TIMEOUT;
+        uint16_t strokes[SEQUENCE_MAX_LENGTH];
+        memcpy(strokes, binding.strokes, sizeof(strokes));
+        std::sort(strokes, strokes + binding.length);
+        do {
+            uint32_t state = AddPath(strokes, binding.length, timeout, STATE_CHORD, edges);
+            if (state == NO_STATE) {
+                Clear();
+                return false;
+            }
+            m_states[state].action = binding.action;
+        } while (std::next_permutation(strokes, strokes + binding.length));
+    }
+
+    size_t size = 16;
+    unsigned bits = 4;
+    while (size < edges.size() * 2) {
+        size *= 2;
+        ++bits;
+    }
+    m_hashShift = 32 - bits;
+    Transition empty = { 0, NO_STATE };
+    m_transitions.assign(size, empty);
+    for (EdgeMap::const_iterator edge = edges.begin(); edge != edges.end(); ++edge) {
+        uint32_t slot = Hash(edge->first, m_hashShift);
+        while (m_transitions[slot].key != 0) {
+            slot = (slot + 1) & static_cast<uint32_t>(size - 1);
+        }
+        m_transitions[slot].key = edge->first;
+        m_transitions[slot].next = edge->second;
+    }
+    UseOwnData();
+    return true;
+}
+
+uint32_t CSequenceTable::Next(uint32_t state, uint16_t stroke) const
+{
+    if (m_transitionCount == 0) {
+        return NO_STATE;
+    }
+    uint32_t key = ((state << 12) | (stroke & (SEQUENCE_STROKES - 1))) + 1;
+    uint32_t mask = m_transitionCount - 1;
+    for (uint32_t slot = Hash(key, m_hashShift);; slot = (slot + 1) & mask) {
+        Transition const &transition = m_transitionData[slot];
+        if (transition.key == key) {
+            return transition.next;
+        }
+        if (transition.key == 0) {
+            return NO_STATE;
+        }
+    }
+}
+
+CSequenceMatcher::CSequenceMatcher() :
+    m_table(nullptr)
+{
+    Reset();
+}
+
+void CSequenceMatcher::SetTable(CSequenceTable const *table)
+{
+    m_table = table;
+    Reset();
+}
+
+CSequenceMatcher::Result CSequenceMatcher::SwitchTable(CSequenceTable const *table)
+{
+    Result result = (m_heldCount > 0) ? RESULT_ABORT : RESULT_PASS;
+    m_table = table;
+    m_state = CSequenceTable::ROOT;
+    m_deadline = 0;
+    return result;
+}
+
+void CSequenceMatcher::Reset()
+{
+    m_state = CSequenceTable::ROOT;
+    m_deadline = 0;
+    m_matchedAction = 0;
+    m_heldCount = 0;
+    memset(m_swallowRelease, 0, sizeof(m_swallowRelease));
+}
+
+CSequenceMatcher::Result CSequenceMatcher::ProcessKey(KeyEvent const &event, KeyTransition transition, CKeyStateTracker const &keyState)
+{
+    uint8_t keycode = event.keycode;
+    if (transition == KEY_RELEASE) {
+        uint64_t bit = 1ull << (keycode & 63);
+        if (m_swallowRelease[keycode >> 6] & bit) {
+            m_swallowRelease[keycode >> 6] &= ~bit;
+            return RESULT_HOLD;
+        }
+    }
+
+    if (!m_table) {
+        return RESULT_PASS;
+    }
+
+    uint16_t stroke = MakeStroke(keyState.GetModifiers(), keycode);
+    uint8_t modifiers = static_cast<uint8_t>(keyState.GetModifierSnapshot() & KEYSTATE_HELD_MODIFIERS);
+    if (!IsPending()) {
+        if ((transition != KEY_PRESS) || !m_table->StartsSequence(stroke)) {
+            return RESULT_PASS;
+        }
+        return Advance(m_table->Next(CSequenceTable::ROOT, stroke), event, modifiers);
+    }
+
+    switch (transition) {
+    case KEY_PRESS: {
+        uint32_t next = m_table->Next(m_state, stroke);
+        if (next == CSequenceTable::NO_STATE) {
+            return Abort();
+        }
+        return Advance(next, event, modifiers);
+    }
+
+    case KEY_REPEAT:
+        // Autorepeat of a held-back key carries no information; drop it.
+        return IsHeldDown(keycode) ? RESULT_HOLD : RESULT_PASS;
+
+    default:
+        if (!IsHeldDown(keycode)) {
+            return RESULT_PASS;
+        }
+        // Releasing any key of a chord before it's complete means it wasn't a chord. The
+        // release isn't held: the caller replays the presses, then hands it back to us.
+        if (m_table->IsChord(m_state) || (m_heldCount >= MAX_HELD_EVENTS)) {
+            return Abort();
+        }
+        Hold(event, modifiers);
+        return RESULT_HOLD;
+    }
+}
+
+CSequenceMatcher::Result CSequenceMatcher::Expire()
+{
+    if (!IsPending()) {
+        return RESULT_PASS;
+    }
+    uint16_t action = m_table->GetAction(m_state);
+    return action ? Complete(action) : Abort();
+}
+
+CSequenceMatcher::Result CSequenceMatcher::Advance(uint32_t next, KeyEvent const &event, uint8_t modifiers)
+{
+    if (m_heldCount >= MAX_HELD_EVENTS) {
+        return Abort();
+    }
+    Hold(event, modifiers);
+
+    if (m_table->HasChildren(next)) {
+        m_state = next;
+        m_deadline = event.time + m_table->GetTimeout(next);
+        return RESULT_HOLD;
+    }
+    return Complete(m_table->GetAction(next));
+}
+
+void CSequenceMatcher::Hold(KeyEvent const &event, uint8_t modifiers)
+{
+    m_held[m_heldCount] = event;
+    m_heldModifiers[m_heldCount] = modifiers;
+    ++m_heldCount;
+}
+
+CSequenceMatcher::Result CSequenceMatcher::Complete(uint16_t action)
+{
+    // The held presses are being swallowed for good, so swallow their releases too.
+    for (unsigned i = 0; i < m_heldCount; ++i) {
+        uint8_t keycode = m_held[i].keycode;
+        if (IsHeldDown(keycode)) {
+            m_swallowRelease[keycode >> 6] |= 1ull << (keycode & 63);
+        }
+    }
+    m_matchedAction = action;
+    m_heldCount = 0;
+    m_state = CSequenceTable::ROOT;
+    return RESULT_MATCH;
+}
+
+CSequenceMatcher::Result CSequenceMatcher::Abort()
+{
+    m_state = CSequenceTable::ROOT;
+    return RESULT_ABORT;
+}
+
+bool CSequenceMatcher::IsHeldDown(uint8_t keycode) const
+{
+    // The most recent held event for the key says whether it's down.
+    for (unsigned i = m_heldCount; i > 0; --i) {
+        if (m_held[i - 1].keycode == keycode) {
+            return (m_held[i - 1].flags & KeyEvent::FLAG_DOWN) != 0;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,235 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+#include "KeyEvent.h"
+#include "KeyState.h"
+
+/* A stroke is one key press together with the modifiers held at the time:
+   (KEYMOD_* bits << 8) | virtual key code. */
+inline uint16_t MakeStroke(unsigned modifiers, uint8_t keycode)
+{
+    return static_cast<uint16_t>(((modifiers & 0x0F) << 8) | keycode);
+}
+
+static unsigned const SEQUENCE_MAX_LENGTH = 8;
+static unsigned const SEQUENCE_STROKES = 1 << 12;
+
+/* A multi-stroke binding such as "Ctrl+K, Ctrl+C", or a chord such as "J&K" (keys pressed
+   together, in any order, within the chord timeout). */
+struct SequenceBinding
+{
+    uint16_t strokes[SEQUENCE_MAX_LENGTH];
+    uint8_t length;
+    bool chord;
+    uint16_t action;
+    uint16_t timeout;   // Milliseconds to wait for each following stroke. 0 = default.
+};
+
+/* All of a keymap's sequence bindings compiled into a trie (which, since there are no
+   wildcards, is also the DFA). Transitions live in one open-addressed hash table keyed
+   on (state, stroke), so following one costs the same however many bindings there are,
+   and a bitmap of first strokes lets the common "not the start of any sequence" case be
+   answered with a single load. Immutable once compiled.
+
+   The compiled table is plain data, so it can be saved as part of a keymap image and used
+   later straight from the image's memory (see CKeymap::AttachImage()). */
+class CSequenceTable
+{
+public:
+    static uint32_t const ROOT = 0;
+    static uint32_t const NO_STATE = 0xFFFFFFFF;
+    static uint16_t const DEFAULT_TIMEOUT = 1000;
+    static uint16_t const DEFAULT_CHORD_TIMEOUT = 50;
+
+    CSequenceTable();
+
+    // Moving keeps the vectors' buffers, so the data pointers stay valid.
+    CSequenceTable(CSequenceTable &&) = default;
+    CSequenceTable &operator=(CSequenceTable &&) = default;
+
+    void Clear();
+
+    /* Returns false if a binding is empty, too long, or a chord has too many keys. Where
+       one binding is a prefix of another, the shorter one runs if nothing follows within
+       the timeout. */
+    bool Compile(SequenceBinding const *bindings, size_t count);
+
+    /* Append the table to a keymap image, starting at a 64-byte boundary. */
+    void WriteImage(std::vector<uint8_t> &image) const;
+
+    /* Use a table written by WriteImage() in place. The data must stay valid (and
+       unchanged) for as long as the table uses it, and be at least 8-byte aligned. Returns
+       false, leaving the table empty, if the data isn't a consistent table. */
+    bool AttachImage(void const *data, size_t size);
+
+    bool IsEmpty() const { return m_stateCount <= 1; }
+    size_t GetStateCount() const { return m_stateCount; }
+
+    bool StartsSequence(uint16_t stroke) const
+    {
+        return ((m_firstStrokes[(stroke >> 6) & 63] >> (stroke & 63)) & 1) != 0;
+    }
+
+    uint32_t Next(uint32_t state, uint16_t stroke) const;
+
+    uint16_t GetAction(uint32_t state) const { return m_stateData[state].action; }
+    uint16_t GetTimeout(uint32_t state) const { return m_stateData[state].timeout; }
+    bool HasChildren(uint32_t state) const { return (m_stateData[state].flags & STATE_HAS_CHILDREN) != 0; }
+    bool IsChord(uint32_t state) const { return (m_stateData[state].flags & STATE_CHORD) != 0; }
+
+private:
+    enum {
+        STATE_HAS_CHILDREN = 0x01,
+        STATE_CHORD = 0x02,
+    };
+
+    struct State
+    {
+        uint16_t action;
+        uint16_t timeout;
+        uint8_t flags;
+    };
+
+    struct Transition
+    {
+        uint32_t key;   // (state << 12 | stroke) + 1, or 0 if the slot is empty
+        uint32_t next;
+    };
+
+    /* How the table starts in an image. The states follow, then (8-byte aligned) the
+       transitions. */
+    struct ImageHeader
+    {
+        uint32_t stateCount;
+        uint32_t transitionCount;
+        uint32_t hashShift;
+        uint32_t reserved;
+        uint64_t firstStrokes[SEQUENCE_STROKES / 64];
+    };
+
+    typedef std::unordered_map<uint32_t, uint32_t> EdgeMap;
+
+    CSequenceTable(CSequenceTable const &) = delete;
+    CSequenceTable &operator=(CSequenceTable const &) = delete;
+
+    static uint32_t Hash(uint32_t key, unsigned shift);
+    uint32_t AddPath(uint16_t const *strokes, unsigned length, uint16_t timeout, uint8_t flags, EdgeMap &edges);
+    void UseOwnData();
+
+    // Lookups go through the data pointers, which point either at the vectors (for a
+    // table compiled here) or into an attached image.
+    State const *m_stateData;
+    uint32_t m_stateCount;
+    Transition const *m_transitionData;
+    uint32_t m_transitionCount;
+    unsigned m_hashShift;
+    uint64_t m_firstStrokes[SEQUENCE_STROKES / 64];
+
+    std::vector<State> m_states;
+    std::vector<Transition> m_transitions;
+};
+
+/* Runs a CSequenceTable against live key events. Keys that might be part of a sequence
+   are held back (swallowed) until the sequence either completes, in which case its action
+   runs and the held keys are discarded, or fails, in which case the held keys must be
+   replayed in order. Not thread safe: it belongs to whichever thread runs the hook. */
+class CSequenceMatcher
+{
+public:
+    enum Result {
+        RESULT_PASS,    // Not part of a sequence; handle the key normally.
+        RESULT_HOLD,    // Swallow the key; a sequence is in progress.
+        RESULT_MATCH,   // Swallow the key; GetMatchedAction() completed.
+        RESULT_ABORT,   // The sequence failed. Replay GetHeldEvents(), then handle the key normally.
+    };
+
+    static unsigned const MAX_HELD_EVENTS = 32;
+
+    CSequenceMatcher();
+
+    void SetTable(CSequenceTable const *table);
+
+    /* Switch to another table (say, a reloaded keymap's) without touching the old one,
+       which may already be gone. Any pending sequence is abandoned: returns RESULT_ABORT if
+       there are held keys to replay, otherwise RESULT_PASS. Releases still to be
+       swallowed stay that way. */
+    Result SwitchTable(CSequenceTable const *table);
+
+    /* Feed an event. keyState must already include it. If a sequence is pending and its
+       deadline has passed, call Expire() first. */
+    Result ProcessKey(KeyEvent const &event, KeyTransition transition, CKeyStateTracker const &keyState);
+
+    /* Give up on a pending sequence whose deadline has passed. Returns RESULT_MATCH if the
+       keys so far form a complete (shorter) binding, RESULT_ABORT if they must be replayed,
+       or RESULT_PASS if nothing was pending. */
+    Result Expire();
+
+    /* Forget any pending sequence and held keys without replaying them. */
+    void Reset();
+
+    bool IsPending() const { return m_state != CSequenceTable::ROOT; }
+    uint32_t GetDeadline() const { return m_deadline; }
+
+    uint16_t GetMatchedAction() const { return m_matchedAction; }
+
+    /* After RESULT_ABORT: the events to replay. Call ClearHeldEvents() once they've been dealt with. */
+    KeyEvent const *GetHeldEvents() const { return m_held; }
+    /* The modifiers (KEYSTATE_HELD_MODIFIERS bits) that were down with each held event,
+       for replaying it as it was typed. */
+    uint8_t const *GetHeldModifiers() const { return m_heldModifiers; }
+    unsigned GetHeldCount() const { return m_heldCount; }
+    void ClearHeldEvents() { m_heldCount = 0; }
+
+private:
+    Result Advance(uint32_t next, KeyEvent const &event, uint8_t modifiers);
+    void Hold(KeyEvent const &event, uint8_t modifiers);
+    Result Complete(uint16_t action);
+    Result Abort();
+    bool IsHeldDown(uint8_t keycode) const;
+
+    CSequenceTable const *m_table;
+    uint32_t m_state;
+    uint32_t m_deadline;
+    uint16_t m_matchedAction;
+
+    KeyEvent m_held[MAX_HELD_EVENTS];
+    uint8_t m_heldModifiers[MAX_HELD_EVENTS];
+    unsigned m_heldCount;
+
+    // Keys whose press completed a sequence (and so was swallowed) but which haven't been
+    // released yet. Their releases are swallowed too.
+    uint64_t m_swallowRelease[4];
+};
@@ -0,0 +1,180 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "SharedMemory.h"
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CSharedMemory::CSharedMemory() :
+    m_data(nullptr),
+    m_size(0)
+#ifdef _WIN32
+    , m_mapping(nullptr)
+#endif
+{
+#ifndef _WIN32
+    m_name[0] = '\0';
+#endif
+}
+
+CSharedMemory::~CSharedMemory()
+{
+    Close();
+}
+
+#ifdef _WIN32
+bool CSharedMemory::Create(char const *name, size_t size)
+{
+    Close();
+    // The default security descriptor already keeps other users out.
+    ULARGE_INTEGER mappingSize;
+    mappingSize.QuadPart = size;
+    HANDLE hMapping = ::CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        mappingSize.HighPart, mappingSize.LowPart, name);
+    if (!hMapping) {
+        return false;
+    }
+    if (::GetLastError() == ERROR_ALREADY_EXISTS) {
+        ::CloseHandle(hMapping);
+        return false;
+    }
+    m_data = ::MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!m_data) {
+        ::CloseHandle(hMapping);
+        return false;
+    }
+    m_mapping = hMapping;
+    m_size = size;
+    return true;
+}
+
+bool CSharedMemory::Open(char const *name, size_t size)
+{
+    Close();
+    HANDLE hMapping = ::OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (!hMapping) {
+        return false;
+    }
+    void *data = ::MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    MEMORY_BASIC_INFORMATION information;
+    if (!data || (::VirtualQuery(data, &information, sizeof(information)) == 0) || (information.RegionSize < size)) {
+        if (data) {
+            ::UnmapViewOfFile(data);
+        }
+        ::CloseHandle(hMapping);
+        return false;
+    }
+    m_data = data;
+    m_mapping = hMapping;
+    m_size = size;
+    return true;
+}
+
+void CSharedMemory::Close()
+{
+    if (m_data) {
+        ::UnmapViewOfFile(m_data);
+        ::CloseHandle(m_mapping);
+        m_data = nullptr;
+        m_mapping = nullptr;
+        m_size = 0;
+    }
+}
+#else
+bool CSharedMemory::Create(char const *name, size_t size)
+{
+    Close();
+    if (strlen(name) >= sizeof(m_name)) {
+        return false;
+    }
+    // Whoever had the name last is gone (or about to be replaced); readers that still
+    // have it mapped keep their copy until they open the name again.
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    void *data = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        shm_unlink(name);
+        return false;
+    }
+    strcpy(m_name, name);
+    m_data = data;
+    m_size = size;
+    return true;
+}
+
+bool CSharedMemory::Open(char const *name, size_t size)
+{
+    Close();
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat status;
+    void *data = MAP_FAILED;
+    if ((fstat(fd, &status) == 0) && (static_cast<size_t>(status.st_size) >= size)) {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    m_data = data;
+    m_size = size;
+    return true;
+}
+
+void CSharedMemory::Close()
+{
+    if (m_data) {
+        munmap(m_data, m_size);
+        m_data = nullptr;
+        m_size = 0;
+    }
+    if (m_name[0]) {
+        shm_unlink(m_name);
+        m_name[0] = '\0';
+    }
+}
+#endif
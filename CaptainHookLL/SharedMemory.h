@@ -0,0 +1,71 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+
+/* A named block of memory that other processes can map too: a pagefile-backed file
+   mapping in the session's Local\ namespace on Windows, a POSIX shared memory object
+   elsewhere. Names are plain ASCII; see GetControlPlaneName() for the ones in use.
+
+   A Windows mapping goes away with the last process that has it open, so Create() fails
+   while another instance has the name. A POSIX object outlives a process that crashes,
+   so there Create() replaces whatever has the name, and Close() removes it again. */
+class CSharedMemory
+{
+public:
+    CSharedMemory();
+    ~CSharedMemory();
+
+    /* Make new memory of size bytes, zero-filled, that only this user can open. */
+    bool Create(char const *name, size_t size);
+
+    /* Map existing memory for reading and writing. Fails if it's smaller than size. */
+    bool Open(char const *name, size_t size);
+
+    void Close();
+
+    bool IsOpen() const { return m_data != nullptr; }
+    void *GetData() const { return m_data; }
+    size_t GetSize() const { return m_size; }
+
+private:
+    CSharedMemory(CSharedMemory const &) = delete;
+    CSharedMemory &operator=(CSharedMemory const &) = delete;
+
+    void *m_data;
+    size_t m_size;
+#ifdef _WIN32
+    void *m_mapping;
+#else
+    char m_name[64];    // set while we own the name
+#endif
+};
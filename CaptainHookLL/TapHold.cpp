@@ -0,0 +1,317 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "TapHold.h"
+#include "VirtualKeys.h"
+#include <string.h>
+
+CTapHoldResolver::CTapHoldResolver() :
+    m_table(nullptr),
+    m_now(0),
+    m_pending(false),
+    m_deadline(0),
+    m_heldCount(0),
+    m_trackedCount(0),
+    m_toggledLayers(0),
+    m_activeLayers(0),
+    m_outputCount(0),
+    m_tapCount(0),
+    m_holdCount(0),
+    m_overflowCount(0),
+    m_delayedCount(0),
+    m_totalDelay(0),
+    m_maxDelay(0)
+{
+    memset(&m_pendingPress, 0, sizeof(m_pendingPress));
+    memset(&m_pendingKey, 0, sizeof(m_pendingKey));
+    memset(m_heldDown, 0, sizeof(m_heldDown));
+    memset(m_down, 0, sizeof(m_down));
+    memset(m_tracked, 0, sizeof(m_tracked));
+    memset(m_sentAs, 0, sizeof(m_sentAs));
+    memset(m_heldLayer, 0, sizeof(m_heldLayer));
+    memset(m_layerHolds, 0, sizeof(m_layerHolds));
+}
+
+bool CTapHoldResolver::SetTable(TapHoldTable const *table)
+{
+    m_table = table;
+    if (!m_pending) {
+        return false;
+    }
+    LetGo();
+    return m_outputCount > 0;
+}
+
+bool CTapHoldResolver::ProcessKey(KeyEvent const &event, bool paused)
+{
+    uint8_t keycode = event.keycode;
+    bool down = (event.flags & KeyEvent::FLAG_DOWN) != 0;
+    bool repeat = down && IsSet(m_down, keycode);
+    if (down) {
+        Set(m_down, keycode);
+    } else {
+        Reset(m_down, keycode);
+    }
+
+    // The usual case: nothing to rewrite and nothing going on.
+    if ((!m_table || (m_table->keyCount == 0)) && (m_trackedCount == 0) && !m_pending) {
+        return true;
+    }
+
+    m_now = event.time;
+    if (!Handle(event, repeat, paused)) {
+        return false;
+    }
+    if (m_outputCount == 0) {
+        return true;
+    }
+    // Something before it has just been let out, so it has to follow that.
+    Emit(event, keycode);
+    return false;
+}
+
+bool CTapHoldResolver::Expire(uint32_t now, bool paused)
+{
+    m_now = now;
+    while (m_pending && (static_cast<int32_t>(now - m_deadline) >= 0)) {
+        if (paused) {
+            LetGo();
+        } else {
+            Resolve(true, false);
+        }
+    }
+    return m_outputCount > 0;
+}
+
+bool CTapHoldResolver::Handle(KeyEvent const &event, bool repeat, bool paused)
+{
+    if (m_pending && (static_cast<int32_t>(event.time - m_deadline) >= 0)) {
+        Resolve(true, false);
+    }
+    if (m_pending && paused) {
+        LetGo();
+    }
+    if (!m_pending) {
+        return Feed(event, repeat, paused);
+    }
+
+    uint8_t keycode = event.keycode;
+    bool down = (event.flags & KeyEvent::FLAG_DOWN) != 0;
+    if (repeat) {
+        // Autorepeats say nothing about what the pending key is, and would crowd out what does.
+        return false;
+    }
+    if (keycode == m_pendingPress.keycode) {
+        Resolve(false, false);
+        return Handle(event, false, paused);
+    }
+    bool full = (m_heldCount == MAX_PENDING);
+    if ((!down && IsSet(m_heldDown, keycode)) || full) {
+        Resolve(true, full);
+        return Handle(event, false, paused);
+    }
+    m_held[m_heldCount++] = event;
+    if (down) {
+        Set(m_heldDown, keycode);
+    }
+    return false;
+}
+
+bool CTapHoldResolver::Feed(KeyEvent const &event, bool repeat, bool paused)
+{
+    uint8_t keycode = event.keycode;
+    bool down = (event.flags & KeyEvent::FLAG_DOWN) != 0;
+
+    // A key that went on as something else stays that way until it's released.
+    if (IsSet(m_tracked, keycode)) {
+        uint8_t sentAs = m_sentAs[keycode];
+        if (!down) {
+            Untrack(keycode);
+        }
+        if (sentAs) {
+            Emit(event, sentAs);
+        }
+        return false;
+    }
+    if (!down || repeat || paused || !m_table) {
+        return true;
+    }
+
+    TapHoldKey const &key = m_table->keys[keycode];
+    switch (key.role) {
+    case TAPHOLD_MOD_TAP:
+    case TAPHOLD_LAYER_TAP:
+        m_pending = true;
+        m_pendingPress = event;
+        m_pendingKey = key;
+        m_deadline = event.time + key.timeout;
+        m_heldCount = 0;
+        memset(m_heldDown, 0, sizeof(m_heldDown));
+        return false;
+    case TAPHOLD_MOMENTARY:
+        Track(keycode, 0, key.layer);
+        return false;
+    case TAPHOLD_TOGGLE:
+        m_toggledLayers ^= 1u << key.layer;
+        UpdateLayers();
+        Track(keycode, 0, 0);
+        return false;
+    default:
+        break;
+    }
+    uint8_t mapped = Remap(keycode);
+    if (!mapped) {
+        return true;
+    }
+    Track(keycode, mapped, 0);
+    Emit(event, mapped);
+    return false;
+}
+
+void CTapHoldResolver::Resolve(bool hold, bool overflow)
+{
+    // Take the held events out first: going through them again may start another key
+    // pending, which holds events of its own.
+    KeyEvent held[MAX_PENDING];
+    unsigned heldCount = m_heldCount;
+    memcpy(held, m_held, heldCount * sizeof(KeyEvent));
+    m_heldCount = 0;
+    m_pending = false;
+
+    uint8_t keycode = m_pendingPress.keycode;
+    if (!hold) {
+        Increment(m_tapCount);
+        Track(keycode, m_pendingKey.tap, 0);
+        Emit(m_pendingPress, m_pendingKey.tap);
+    } else if (m_pendingKey.role == TAPHOLD_MOD_TAP) {
+        Increment(m_holdCount);
+        Track(keycode, m_pendingKey.hold, 0);
+        Emit(m_pendingPress, m_pendingKey.hold);
+    } else {
+        Increment(m_holdCount);
+        Track(keycode, 0, m_pendingKey.layer);
+    }
+    if (overflow) {
+        Increment(m_overflowCount);
+    }
+    for (unsigned i = 0; i < heldCount; ++i) {
+        if (Handle(held[i], false, false)) {
+            Emit(held[i], held[i].keycode);
+        }
+    }
+}
+
+void CTapHoldResolver::LetGo()
+{
+    KeyEvent held[MAX_PENDING];
+    unsigned heldCount = m_heldCount;
+    memcpy(held, m_held, heldCount * sizeof(KeyEvent));
+    m_heldCount = 0;
+    m_pending = false;
+
+    Emit(m_pendingPress, m_pendingPress.keycode);
+    for (unsigned i = 0; i < heldCount; ++i) {
+        if (Feed(held[i], false, true)) {
+            Emit(held[i], held[i].keycode);
+        }
+    }
+}
+
+void CTapHoldResolver::Track(uint8_t keycode, uint8_t sentAs, uint8_t layer)
+{
+    if (!IsSet(m_tracked, keycode)) {
+        Set(m_tracked, keycode);
+        ++m_trackedCount;
+    }
+    m_sentAs[keycode] = sentAs;
+    m_heldLayer[keycode] = layer;
+    if (layer) {
+        ++m_layerHolds[layer];
+        UpdateLayers();
+    }
+}
+
+void CTapHoldResolver::Untrack(uint8_t keycode)
+{
+    Reset(m_tracked, keycode);
+    --m_trackedCount;
+    uint8_t layer = m_heldLayer[keycode];
+    if (layer) {
+        --m_layerHolds[layer];
+        UpdateLayers();
+    }
+}
+
+void CTapHoldResolver::UpdateLayers()
+{
+    unsigned active = m_toggledLayers;
+    for (unsigned layer = 1; layer < TAPHOLD_LAYERS; ++layer) {
+        if (m_layerHolds[layer]) {
+            active |= 1u << layer;
+        }
+    }
+    m_activeLayers = active;
+}
+
+uint8_t CTapHoldResolver::Remap(uint8_t keycode) const
+{
+    // The highest layer that's on and maps the key wins.
+    for (unsigned layer = TAPHOLD_LAYERS - 1; (layer > 0) && (m_activeLayers & ((2u << layer) - 2)); --layer) {
+        if ((m_activeLayers & (1u << layer)) && m_table->layers[layer][keycode]) {
+            return m_table->layers[layer][keycode];
+        }
+    }
+    return 0;
+}
+
+void CTapHoldResolver::Emit(KeyEvent const &event, uint8_t keycode)
+{
+    if (m_outputCount == MAX_OUTPUT) {
+        // Can't happen: each event held back or fed comes out at most once.
+        return;
+    }
+    KeyEvent &output = m_output[m_outputCount++];
+    output = event;
+    output.action = 0;
+    if (keycode != event.keycode) {
+        output.keycode = keycode;
+        output.flags = static_cast<uint8_t>((event.flags & ~KeyEvent::FLAG_EXTENDED) |
+            (IsExtendedKey(keycode) ? KeyEvent::FLAG_EXTENDED : 0));
+    }
+    uint32_t delay = m_now - event.time;
+    if (delay) {
+        Increment(m_delayedCount);
+        Increment(m_totalDelay, static_cast<uint64_t>(delay));
+        if (delay > m_maxDelay.load(std::memory_order_relaxed)) {
+            m_maxDelay.store(delay, std::memory_order_relaxed);
+        }
+    }
+}
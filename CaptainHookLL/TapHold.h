@@ -0,0 +1,194 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include "KeyEvent.h"
+
+/* Layers a keymap can have. Layer 0 is the keys as they are; 1 to TAPHOLD_LAYERS - 1 remap
+   them while they're on. */
+static unsigned const TAPHOLD_LAYERS = 8;
+
+/* How long a dual-role key must be held before it counts as held, in milliseconds. */
+static uint16_t const TAPHOLD_DEFAULT_TIMEOUT = 200;
+static uint16_t const TAPHOLD_MAX_TIMEOUT = 1000;
+
+/* What a key does other than being itself (see "taphold" in CKeymap::Load()). */
+enum TapHoldRole {
+    TAPHOLD_NONE,
+    TAPHOLD_MOD_TAP,    // tapped, types tap; held, holds hold
+    TAPHOLD_LAYER_TAP,  // tapped, types tap; held, turns layer on
+    TAPHOLD_MOMENTARY,  // turns layer on while held
+    TAPHOLD_TOGGLE,     // turns layer on or off when pressed
+};
+
+struct TapHoldKey
+{
+    uint8_t role;       // TAPHOLD_*
+    uint8_t tap;
+    uint8_t hold;
+    uint8_t layer;
+    uint16_t timeout;   // ms before a dual-role key counts as held
+};
+
+/* A keymap's tap-hold keys and layers. Plain data with no pointers, so it goes into keymap
+   images as it is. */
+struct TapHoldTable
+{
+    uint32_t keyCount;  // keys with a role or a mapping on some layer; 0 = nothing to do
+    TapHoldKey keys[256];
+    uint8_t layers[TAPHOLD_LAYERS][256];  // what each key types on each layer (0 = itself)
+};
+
+/* Decides whether dual-role keys are tapped or held, the way keyboard firmware does, and
+   remaps keys on the layers that are on.
+
+   A dual-role key's press is held back, along with every key event after it, until one
+   of these settles it:
+
+     - it's released: it was tapped
+     - its timeout passes: it's held
+     - a key pressed after it is released while it's still down ("permissive hold"): it's
+       held, so that rolling quickly over a dual-role key and the next one types both,
+       but a deliberate chord like Ctrl+C works well within the timeout
+     - MAX_PENDING events have been held back behind it: it's held
+
+   Then the held-back events come out in order behind the key's tap or hold key, as
+   though they'd only just been typed, so the key's layer applies to them and any of
+   them can be a dual-role key in turn. Nothing is held longer than the timeout (more
+   only if the timer that calls Expire() is late). Keys whose press was rewritten are
+   released as they were pressed, whatever has changed in between.
+
+   Events are rewritten or held back only; the output has the same order and timestamps as
+   the input. Injected keys don't belong here. Not thread safe: it belongs to whichever
+   thread runs the hook, though the counters can be read from anywhere. */
+class CTapHoldResolver
+{
+public:
+    static unsigned const MAX_PENDING = 16;
+    static unsigned const MAX_OUTPUT = MAX_PENDING + 2;
+
+    CTapHoldResolver();
+
+    /* Switch to another table, say a reloaded keymap's, or none. The old one isn't looked
+       at again, so it may already be gone. A pending key is let go along with the keys
+       held behind it, as they were typed; returns true if that left output. */
+    bool SetTable(TapHoldTable const *table);
+
+    /* Feed a key event. Returns true if it goes on as it is, in which case there's no
+       output. Otherwise it's been swallowed, and GetOutput() has whatever is to go on in
+       its place (maybe nothing yet). While paused, nothing new is rewritten or held back,
+       and a pending key is let go as typed. */
+    bool ProcessKey(KeyEvent const &event, bool paused);
+
+    /* Settle a pending key whose timeout has passed at now: it's held (or, while paused,
+       let go as typed). Returns true if that left output. */
+    bool Expire(uint32_t now, bool paused);
+
+    bool IsPending() const { return m_pending; }
+    uint32_t GetDeadline() const { return m_deadline; }
+
+    /* Events to handle, in order, in place of those swallowed. Call ClearOutput() once
+       they've been dealt with. */
+    KeyEvent const *GetOutput() const { return m_output; }
+    unsigned GetOutputCount() const { return m_outputCount; }
+    void ClearOutput() { m_outputCount = 0; }
+
+    /* Bit n set if layer n is on. */
+    unsigned GetActiveLayers() const { return m_activeLayers; }
+
+    uint32_t GetTapCount() const { return m_tapCount.load(std::memory_order_relaxed); }
+    uint32_t GetHoldCount() const { return m_holdCount.load(std::memory_order_relaxed); }
+    /* Keys settled as held because MAX_PENDING events were waiting behind them. */
+    uint32_t GetOverflowCount() const { return m_overflowCount.load(std::memory_order_relaxed); }
+    /* Events that went on later than they came, and by how much in all and at most (ms). */
+    uint32_t GetDelayedCount() const { return m_delayedCount.load(std::memory_order_relaxed); }
+    uint64_t GetTotalDelay() const { return m_totalDelay.load(std::memory_order_relaxed); }
+    uint32_t GetMaxDelay() const { return m_maxDelay.load(std::memory_order_relaxed); }
+
+private:
+    bool Handle(KeyEvent const &event, bool repeat, bool paused);
+    bool Feed(KeyEvent const &event, bool repeat, bool paused);
+    void Resolve(bool hold, bool overflow);
+    void LetGo();
+    void Track(uint8_t keycode, uint8_t sentAs, uint8_t layer);
+    void Untrack(uint8_t keycode);
+    void UpdateLayers();
+    uint8_t Remap(uint8_t keycode) const;
+    void Emit(KeyEvent const &event, uint8_t keycode);
+
+    template <typename T>
+    static void Increment(std::atomic<T> &counter, T amount = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    static bool IsSet(uint64_t const *bits, uint8_t keycode) { return ((bits[keycode >> 6] >> (keycode & 63)) & 1) != 0; }
+    static void Set(uint64_t *bits, uint8_t keycode) { bits[keycode >> 6] |= 1ull << (keycode & 63); }
+    static void Reset(uint64_t *bits, uint8_t keycode) { bits[keycode >> 6] &= ~(1ull << (keycode & 63)); }
+
+    TapHoldTable const *m_table;
+    uint32_t m_now;     // the time of the event or timeout being handled
+
+    // The dual-role key waiting to be settled, and the events held back behind it.
+    bool m_pending;
+    KeyEvent m_pendingPress;
+    TapHoldKey m_pendingKey;
+    uint32_t m_deadline;
+    KeyEvent m_held[MAX_PENDING];
+    unsigned m_heldCount;
+    uint64_t m_heldDown[4];     // keys whose press is among them
+
+    // Keys down as typed, to tell autorepeats from presses.
+    uint64_t m_down[4];
+
+    // Keys whose press was rewritten (or swallowed for a role), what it was sent as (0 for
+    // nothing) and the layer it turned on (0 for none).
+    uint64_t m_tracked[4];
+    unsigned m_trackedCount;
+    uint8_t m_sentAs[256];
+    uint8_t m_heldLayer[256];
+
+    uint8_t m_layerHolds[TAPHOLD_LAYERS];
+    unsigned m_toggledLayers;
+    unsigned m_activeLayers;
+
+    KeyEvent m_output[MAX_OUTPUT];
+    unsigned m_outputCount;
+
+    std::atomic<uint32_t> m_tapCount;
+    std::atomic<uint32_t> m_holdCount;
+    std::atomic<uint32_t> m_overflowCount;
+    std::atomic<uint32_t> m_delayedCount;
+    std::atomic<uint64_t> m_totalDelay;
+    std::atomic<uint32_t> m_maxDelay;
+};
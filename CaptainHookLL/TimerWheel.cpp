@@ -0,0 +1,363 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "TimerWheel.h"
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+
+unsigned LowestBit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctzll(value));
+#endif
+}
+
+unsigned HighestBit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<unsigned>(index);
+#else
+    return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#endif
+}
+
+unsigned const TOP_BITS = CTimerWheel::LEVEL_BITS * CTimerWheel::LEVELS;
+unsigned const HANDLE_INDEX_BITS = 20;
+uint16_t const GENERATION_MASK = (1 << (32 - HANDLE_INDEX_BITS)) - 1;
+
+// A far-off slot with no more timers than this is searched for its earliest deadline, so
+// that GetNextDeadline() needn't report the slot's start and cost its owner a wakeup just
+// to move them down a level.
+unsigned const EXACT_SCAN_LIMIT = 8;
+
+} // namespace
+
+CTimerWheel::CTimerWheel(uint64_t now) :
+    m_freeList(NIL),
+    m_timerCount(0),
+    m_now(now),
+    m_firedCount(0),
+    m_cascadedCount(0)
+{
+    for (size_t i = 0; i < sizeof(m_lists) / sizeof(m_lists[0]); ++i) {
+        m_lists[i] = NIL;
+    }
+    memset(m_occupied, 0, sizeof(m_occupied));
+}
+
+void CTimerWheel::Reserve(size_t count)
+{
+    if (count > MAX_TIMERS) {
+        count = MAX_TIMERS;
+    }
+    // Grow the free list by hand, so reserved timers are handed out lowest first.
+    size_t first = m_timers.size();
+    if (count <= first) {
+        return;
+    }
+    Timer unused = { 0, nullptr, nullptr, NIL, NIL, NOT_LINKED, 0 };
+    m_timers.resize(count, unused);
+    for (size_t i = count; i > first; --i) {
+        m_timers[i - 1].next = m_freeList;
+        m_freeList = static_cast<uint32_t>(i - 1);
+    }
+}
+
+TimerHandle CTimerWheel::Arm(uint64_t deadline, TimerCallback callback, void *context, uint64_t slack)
+{
+    if (!callback) {
+        return INVALID_TIMER;
+    }
+    if (m_freeList == NIL) {
+        if (m_timers.size() >= MAX_TIMERS) {
+            return INVALID_TIMER;
+        }
+        Timer unused = { 0, nullptr, nullptr, NIL, NIL, NOT_LINKED, 0 };
+        m_timers.push_back(unused);
+        m_freeList = static_cast<uint32_t>(m_timers.size() - 1);
+    }
+
+    uint32_t index = m_freeList;
+    Timer &timer = m_timers[index];
+    m_freeList = timer.next;
+    timer.callback = callback;
+    timer.context = context;
+    timer.deadline = ClampDeadline(CoalesceDeadline(deadline, slack));
+    ++m_timerCount;
+    Insert(index);
+    return MakeHandle(index);
+}
+
+bool CTimerWheel::Rearm(TimerHandle timer, uint64_t deadline, uint64_t slack)
+{
+    uint32_t index = Find(timer);
+    if (index == NIL) {
+        return false;
+    }
+    Unlink(index);
+    m_timers[index].deadline = ClampDeadline(CoalesceDeadline(deadline, slack));
+    Insert(index);
+    return true;
+}
+
+bool CTimerWheel::Cancel(TimerHandle timer)
+{
+    uint32_t index = Find(timer);
+    if (index == NIL) {
+        return false;
+    }
+    Unlink(index);
+    Free(index);
+    return true;
+}
+
+bool CTimerWheel::IsArmed(TimerHandle timer) const
+{
+    return Find(timer) != NIL;
+}
+
+void CTimerWheel::Advance(uint64_t now)
+{
+    for (;;) {
+        uint16_t list;
+        uint64_t next = GetNextStep(list);
+        if ((next == NO_DEADLINE) || (next > now)) {
+            break;
+        }
+        Step(next);
+    }
+    // Nothing is due, and no slot needs moving down, before the next step, so the wheel
+    // can catch up to now without disturbing any timer's position.
+    if (now > m_now) {
+        m_now = now;
+    }
+}
+
+uint64_t CTimerWheel::GetNextDeadline() const
+{
+    uint16_t list;
+    uint64_t next = GetNextStep(list);
+    if ((list < LEVEL_SLOTS) || (list >= OVERFLOW_LIST)) {
+        return next;
+    }
+    // The step only moves the slot's timers down a level. With few enough of them, the
+    // owner can sleep through it: Advance() makes the step on the way to the earliest.
+    uint64_t earliest = NO_DEADLINE;
+    unsigned scanned = 0;
+    for (uint32_t index = m_lists[list]; index != NIL; index = m_timers[index].next) {
+        if (++scanned > EXACT_SCAN_LIMIT) {
+            return next;
+        }
+        if (m_timers[index].deadline < earliest) {
+            earliest = m_timers[index].deadline;
+        }
+    }
+    return earliest;
+}
+
+uint64_t CTimerWheel::GetNextStep(uint16_t &list) const
+{
+    // Every timer at a level is due later than the current time's digit for that level,
+    // and earlier than every timer at the levels above, so the first occupied slot past
+    // the current one at the lowest occupied level holds the next timer.
+    for (unsigned level = 0; level < LEVELS; ++level) {
+        unsigned shift = level * LEVEL_BITS;
+        unsigned digit = static_cast<unsigned>(m_now >> shift) & (LEVEL_SLOTS - 1);
+        uint64_t later = (digit == LEVEL_SLOTS - 1) ? 0 : (m_occupied[level] & (~0ull << (digit + 1)));
+        if (later) {
+            unsigned slot = LowestBit(later);
+            uint64_t base = (m_now >> (shift + LEVEL_BITS)) << (shift + LEVEL_BITS);
+            list = static_cast<uint16_t>(level * LEVEL_SLOTS + slot);
+            return base | (static_cast<uint64_t>(slot) << shift);
+        }
+    }
+    list = OVERFLOW_LIST;
+    if (m_lists[OVERFLOW_LIST] != NIL) {
+        return ((m_now >> TOP_BITS) + 1) << TOP_BITS;
+    }
+    return NO_DEADLINE;
+}
+
+uint64_t CTimerWheel::CoalesceDeadline(uint64_t deadline, uint64_t slack)
+{
+    if ((slack == 0) || (deadline == 0)) {
+        return deadline;
+    }
+    uint64_t latest = (deadline > NO_DEADLINE - slack) ? NO_DEADLINE : deadline + slack;
+    // Below the highest bit in which deadline - 1 and latest differ, latest can be cleared
+    // and still be no earlier than deadline.
+    uint64_t low = (1ull << HighestBit((deadline - 1) ^ latest)) - 1;
+    return latest & ~low;
+}
+
+uint32_t CTimerWheel::Find(TimerHandle timer) const
+{
+    uint32_t index = (timer & ((1u << HANDLE_INDEX_BITS) - 1)) - 1;
+    if ((timer == INVALID_TIMER) || (index >= m_timers.size())) {
+        return NIL;
+    }
+    Timer const &entry = m_timers[index];
+    if (!entry.callback || (entry.generation != (timer >> HANDLE_INDEX_BITS))) {
+        return NIL;
+    }
+    return index;
+}
+
+TimerHandle CTimerWheel::MakeHandle(uint32_t index) const
+{
+    return (static_cast<TimerHandle>(m_timers[index].generation) << HANDLE_INDEX_BITS) | (index + 1);
+}
+
+uint64_t CTimerWheel::ClampDeadline(uint64_t deadline) const
+{
+    // The current tick has already been run, so a deadline that's already passed fires on
+    // the next one.
+    return (deadline > m_now) ? deadline : m_now + 1;
+}
+
+void CTimerWheel::Insert(uint32_t index)
+{
+    Timer const &timer = m_timers[index];
+    uint64_t difference = timer.deadline ^ m_now;
+    if (difference >> TOP_BITS) {
+        Link(index, OVERFLOW_LIST);
+        return;
+    }
+    unsigned level = (difference < LEVEL_SLOTS) ? 0 : HighestBit(difference) / LEVEL_BITS;
+    unsigned slot = static_cast<unsigned>(timer.deadline >> (level * LEVEL_BITS)) & (LEVEL_SLOTS - 1);
+    Link(index, static_cast<uint16_t>(level * LEVEL_SLOTS + slot));
+}
+
+void CTimerWheel::Link(uint32_t index, uint16_t list)
+{
+    Timer &timer = m_timers[index];
+    timer.list = list;
+    timer.prev = NIL;
+    timer.next = m_lists[list];
+    if (timer.next != NIL) {
+        m_timers[timer.next].prev = index;
+    }
+    m_lists[list] = index;
+    if (list < OVERFLOW_LIST) {
+        m_occupied[list / LEVEL_SLOTS] |= 1ull << (list % LEVEL_SLOTS);
+    }
+}
+
+void CTimerWheel::Unlink(uint32_t index)
+{
+    Timer &timer = m_timers[index];
+    if (timer.list == NOT_LINKED) {
+        return;
+    }
+    if (timer.prev != NIL) {
+        m_timers[timer.prev].next = timer.next;
+    } else {
+        m_lists[timer.list] = timer.next;
+        if ((timer.next == NIL) && (timer.list < OVERFLOW_LIST)) {
+            m_occupied[timer.list / LEVEL_SLOTS] &= ~(1ull << (timer.list % LEVEL_SLOTS));
+        }
+    }
+    if (timer.next != NIL) {
+        m_timers[timer.next].prev = timer.prev;
+    }
+    timer.list = NOT_LINKED;
+}
+
+void CTimerWheel::Free(uint32_t index)
+{
+    Timer &timer = m_timers[index];
+    timer.callback = nullptr;
+    timer.context = nullptr;
+    timer.generation = (timer.generation + 1) & GENERATION_MASK;
+    timer.next = m_freeList;
+    m_freeList = index;
+    --m_timerCount;
+}
+
+void CTimerWheel::Step(uint64_t time)
+{
+    uint64_t previous = m_now;
+    m_now = time;
+
+    if ((time >> TOP_BITS) != (previous >> TOP_BITS)) {
+        Cascade(OVERFLOW_LIST);
+    }
+    // Timers in the slot the clock has just reached now share that digit with it, so they
+    // belong lower down. Working from the top lets them fall as far as they need to.
+    for (unsigned level = LEVELS - 1; level > 0; --level) {
+        unsigned digit = static_cast<unsigned>(time >> (level * LEVEL_BITS)) & (LEVEL_SLOTS - 1);
+        Cascade(static_cast<uint16_t>(level * LEVEL_SLOTS + digit));
+    }
+
+    // Callbacks run with the clock at this tick, so anything they arm lands in a later
+    // slot and this loop ends.
+    uint16_t slot = static_cast<uint16_t>(time & (LEVEL_SLOTS - 1));
+    while (m_lists[slot] != NIL) {
+        uint32_t index = m_lists[slot];
+        Unlink(index);
+        TimerHandle handle = MakeHandle(index);
+        ++m_firedCount;
+        m_timers[index].callback(m_timers[index].context, handle);
+
+        // Unless the callback re-armed or cancelled it, the timer is done.
+        if ((Find(handle) == index) && (m_timers[index].list == NOT_LINKED)) {
+            Free(index);
+        }
+    }
+}
+
+void CTimerWheel::Cascade(uint16_t list)
+{
+    // Detach the whole list first: overflow timers that are still too far out go straight
+    // back onto it.
+    uint32_t index = m_lists[list];
+    m_lists[list] = NIL;
+    if (list < OVERFLOW_LIST) {
+        m_occupied[list / LEVEL_SLOTS] &= ~(1ull << (list % LEVEL_SLOTS));
+    }
+    while (index != NIL) {
+        uint32_t next = m_timers[index].next;
+        m_timers[index].list = NOT_LINKED;
+        Insert(index);
+        ++m_cascadedCount;
+        index = next;
+    }
+}
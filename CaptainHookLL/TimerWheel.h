@@ -0,0 +1,157 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Identifies an armed timer. Handles carry a generation count, so a stale handle (for a
+   timer that has fired or been cancelled) is harmlessly rejected rather than touching
+   whichever timer reused its slot. */
+typedef uint32_t TimerHandle;
+
+static TimerHandle const INVALID_TIMER = 0;
+
+typedef void (*TimerCallback)(void *context, TimerHandle timer);
+
+/* A hierarchical timer wheel: six levels of 64 slots, each level's slots 64 times wider
+   than the one below. A timer sits in the lowest level at which its deadline and the
+   current time differ, in the slot for its deadline's digit at that level. When the
+   clock reaches a slot at a higher level, that slot's timers move down to finer slots,
+   and timers in a bottom-level slot expire. Arming, cancelling and re-arming a timer are all O(1)
+   whatever the number of timers, and Advance() costs time proportional to the number of
+   timers that expire (plus, occasionally, moving a slot's worth of far-off timers down a
+   level). The owner drives it from a single OS timer: after every Advance() or Arm(),
+   program the OS timer for GetNextDeadline().
+
+   Timers that needn't fire on the dot can be given slack: how much later than the
+   deadline they may fire. The deadline is moved to the roundest time (the one with the
+   most low bits clear) within the slack, so timers with slack gather on the same few
+   milliseconds and go off in one Advance(), and the owner's OS timer wakes it once for
+   all of them rather than once for each.
+
+   Times are milliseconds on any monotonic 64-bit clock the owner likes; the wheel never
+   reads a clock itself, so tests can run it on a virtual one. Not thread safe. */
+class CTimerWheel
+{
+public:
+    static uint64_t const NO_DEADLINE = ~0ull;
+
+    static unsigned const LEVEL_BITS = 6;
+    static unsigned const LEVEL_SLOTS = 1 << LEVEL_BITS;
+    static unsigned const LEVELS = 6;
+
+    /* Handles have room for this many timers at once. */
+    static size_t const MAX_TIMERS = (1 << 20) - 1;
+
+    explicit CTimerWheel(uint64_t now = 0);
+
+    /* Pre-allocate room for this many timers, so arming never allocates. */
+    void Reserve(size_t count);
+
+    /* Call callback(context, handle) from Advance() once the clock reaches deadline. A
+       deadline that has already passed fires on the next Advance(). It may fire up to
+       slack ms late, to share a wakeup with other timers. Returns INVALID_TIMER if there's
+       no room for another timer. */
+    TimerHandle Arm(uint64_t deadline, TimerCallback callback, void *context, uint64_t slack = 0);
+
+    /* Move an armed timer to a new deadline, with new slack. A callback may re-arm its
+       own timer to make it periodic. Returns false if the handle is stale. */
+    bool Rearm(TimerHandle timer, uint64_t deadline, uint64_t slack = 0);
+
+    /* Returns false if the handle is stale. */
+    bool Cancel(TimerHandle timer);
+
+    bool IsArmed(TimerHandle timer) const;
+
+    /* Run the callbacks for every timer whose deadline is at or before now, in deadline
+       order. Callbacks may arm, re-arm and cancel any timer. */
+    void Advance(uint64_t now);
+
+    /* When Advance() next needs calling, or NO_DEADLINE if no timers are armed. This is
+       exact unless the next timer is beyond the current 64 ms block and shares its slot
+       with more than a few others; then it may be early (never late), since far-off
+       timers are only sorted to the millisecond once they get close. An early call just
+       moves timers down a level. */
+    uint64_t GetNextDeadline() const;
+
+    uint64_t GetTime() const { return m_now; }
+    size_t GetTimerCount() const { return m_timerCount; }
+
+    /* Callbacks run, and timers moved down a level, since construction. */
+    uint64_t GetFiredCount() const { return m_firedCount; }
+    uint64_t GetCascadedCount() const { return m_cascadedCount; }
+
+    /* Where a deadline with slack ends up: the latest time within the slack with the
+       most low bits clear. */
+    static uint64_t CoalesceDeadline(uint64_t deadline, uint64_t slack);
+
+private:
+    static uint32_t const NIL = 0xFFFFFFFF;
+    static uint16_t const NOT_LINKED = 0xFFFF;
+    static uint16_t const OVERFLOW_LIST = LEVELS * LEVEL_SLOTS;
+
+    struct Timer
+    {
+        uint64_t deadline;
+        TimerCallback callback;
+        void *context;
+        uint32_t next;      // Next timer in the same list, or next free timer.
+        uint32_t prev;
+        uint16_t list;      // Slot (level * LEVEL_SLOTS + index), OVERFLOW_LIST or NOT_LINKED.
+        uint16_t generation;
+    };
+
+    uint32_t Find(TimerHandle timer) const;
+    TimerHandle MakeHandle(uint32_t index) const;
+    uint64_t ClampDeadline(uint64_t deadline) const;
+    uint64_t GetNextStep(uint16_t &list) const;
+    void Insert(uint32_t index);
+    void Link(uint32_t index, uint16_t list);
+    void Unlink(uint32_t index);
+    void Free(uint32_t index);
+    void Step(uint64_t time);
+    void Cascade(uint16_t list);
+
+    std::vector<Timer> m_timers;
+    uint32_t m_freeList;
+    size_t m_timerCount;
+    uint64_t m_now;
+
+    // One list head per slot, plus one for timers beyond the top level (over two years
+    // out, or across a 2^36 ms boundary), which are re-sorted when that boundary passes.
+    uint32_t m_lists[LEVELS * LEVEL_SLOTS + 1];
+    uint64_t m_occupied[LEVELS];
+
+    uint64_t m_firedCount;
+    uint64_t m_cascadedCount;
+};
@@ -0,0 +1,161 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+
+/* Windows virtual key codes, for the platform-neutral parts of the app. Everything that
+   handles keys works in terms of these values; other input backends translate into them.
+   The names mirror the VK_* constants in winuser.h (which can't be used here because
+   they'd collide when both are included). Letters and digits are their ASCII values. */
+enum VirtualKey {
+    VKEY_NONE = 0x00,
+    VKEY_LBUTTON = 0x01,
+    VKEY_RBUTTON = 0x02,
+    VKEY_CANCEL = 0x03,
+    VKEY_MBUTTON = 0x04,
+    VKEY_XBUTTON1 = 0x05,
+    VKEY_XBUTTON2 = 0x06,
+    VKEY_BACK = 0x08,
+    VKEY_TAB = 0x09,
+    VKEY_CLEAR = 0x0C,
+    VKEY_RETURN = 0x0D,
+    VKEY_SHIFT = 0x10,
+    VKEY_CONTROL = 0x11,
+    VKEY_MENU = 0x12,
+    VKEY_PAUSE = 0x13,
+    VKEY_CAPITAL = 0x14,
+    VKEY_ESCAPE = 0x1B,
+    VKEY_SPACE = 0x20,
+    VKEY_PRIOR = 0x21,
+    VKEY_NEXT = 0x22,
+    VKEY_END = 0x23,
+    VKEY_HOME = 0x24,
+    VKEY_LEFT = 0x25,
+    VKEY_UP = 0x26,
+    VKEY_RIGHT = 0x27,
+    VKEY_DOWN = 0x28,
+    VKEY_SNAPSHOT = 0x2C,
+    VKEY_INSERT = 0x2D,
+    VKEY_DELETE = 0x2E,
+    VKEY_0 = 0x30,
+    VKEY_9 = 0x39,
+    VKEY_A = 0x41,
+    VKEY_Z = 0x5A,
+    VKEY_LWIN = 0x5B,
+    VKEY_RWIN = 0x5C,
+    VKEY_APPS = 0x5D,
+    VKEY_NUMPAD0 = 0x60,
+    VKEY_NUMPAD9 = 0x69,
+    VKEY_MULTIPLY = 0x6A,
+    VKEY_ADD = 0x6B,
+    VKEY_SEPARATOR = 0x6C,
+    VKEY_SUBTRACT = 0x6D,
+    VKEY_DECIMAL = 0x6E,
+    VKEY_DIVIDE = 0x6F,
+    VKEY_F1 = 0x70,
+    VKEY_F24 = 0x87,
+    VKEY_NUMLOCK = 0x90,
+    VKEY_SCROLL = 0x91,
+
+    // Not Windows' own: codes it leaves unassigned, which the mouse hooks use for a notch
+    // of the wheel (a press and release together) and for flicks (see CMotionBatcher).
+    VKEY_WHEEL_UP = 0x97,
+    VKEY_WHEEL_DOWN = 0x98,
+    VKEY_WHEEL_LEFT = 0x99,
+    VKEY_WHEEL_RIGHT = 0x9A,
+    VKEY_FLICK_LEFT = 0x9B,
+    VKEY_FLICK_RIGHT = 0x9C,
+    VKEY_FLICK_UP = 0x9D,
+    VKEY_FLICK_DOWN = 0x9E,
+
+    VKEY_LSHIFT = 0xA0,
+    VKEY_RSHIFT = 0xA1,
+    VKEY_LCONTROL = 0xA2,
+    VKEY_RCONTROL = 0xA3,
+    VKEY_LMENU = 0xA4,
+    VKEY_RMENU = 0xA5,
+    VKEY_VOLUME_MUTE = 0xAD,
+    VKEY_VOLUME_DOWN = 0xAE,
+    VKEY_VOLUME_UP = 0xAF,
+    VKEY_MEDIA_NEXT_TRACK = 0xB0,
+    VKEY_MEDIA_PREV_TRACK = 0xB1,
+    VKEY_MEDIA_STOP = 0xB2,
+    VKEY_MEDIA_PLAY_PAUSE = 0xB3,
+    VKEY_OEM_1 = 0xBA,      // ;:
+    VKEY_OEM_PLUS = 0xBB,   // =+
+    VKEY_OEM_COMMA = 0xBC,  // ,<
+    VKEY_OEM_MINUS = 0xBD,  // -_
+    VKEY_OEM_PERIOD = 0xBE, // .>
+    VKEY_OEM_2 = 0xBF,      // /?
+    VKEY_OEM_3 = 0xC0,      // `~
+    VKEY_OEM_4 = 0xDB,      // [{
+    VKEY_OEM_5 = 0xDC,      // \|
+    VKEY_OEM_6 = 0xDD,      // ]}
+    VKEY_OEM_7 = 0xDE,      // '"
+    VKEY_OEM_102 = 0xE2,    // <> on ISO keyboards
+};
+
+/* Mouse buttons, which go through CKeyEngine::ProcessButton() rather than ProcessKey(). */
+inline bool IsMouseButton(unsigned keycode)
+{
+    return ((keycode >= VKEY_LBUTTON) && (keycode <= VKEY_XBUTTON2) && (keycode != VKEY_CANCEL));
+}
+
+/* The wheel's notches and flicks are taps, not keys that are held. */
+inline bool IsVirtualTap(unsigned keycode) { return (keycode >= VKEY_WHEEL_UP) && (keycode <= VKEY_FLICK_DOWN); }
+
+/* The keys that Windows reports as extended, which SendInput() needs told so. */
+inline bool IsExtendedKey(unsigned keycode)
+{
+    switch (keycode) {
+    case VKEY_RCONTROL:
+    case VKEY_RMENU:
+    case VKEY_LWIN:
+    case VKEY_RWIN:
+    case VKEY_APPS:
+    case VKEY_INSERT:
+    case VKEY_DELETE:
+    case VKEY_HOME:
+    case VKEY_END:
+    case VKEY_PRIOR:
+    case VKEY_NEXT:
+    case VKEY_LEFT:
+    case VKEY_UP:
+    case VKEY_RIGHT:
+    case VKEY_DOWN:
+    case VKEY_DIVIDE:
+    case VKEY_NUMLOCK:
+    case VKEY_SNAPSHOT:
+        return true;
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,763 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* The Linux daemon: the same keymaps and actions as the Windows tray app, driven by
+   evdev. Built by the CMake build (at the top of the repository) as captainhook.
+
+   It needs read access to /dev/input/event* and write access to /dev/uinput. With
+   --fake-input and --fake-output it needs neither, and reads and writes raw
+   input_event records instead, which is how it can be tried out without hardware.
+
+   The keymap is reloaded whenever its file changes (see CKeymapWatcher), and cached,
+   compiled, in the same place with ".bin" added to the name.
+
+   The actions that do real work (see AppActions.h) run on a CActionExecutor's workers:
+   "stats" writes CaptainHookLL.stats.json in the current directory and "script" runs
+   ./CaptainHookLL.script (or the --script file) with the key code and "press" or
+   "release" as its arguments. Macros (send= and text=) are typed on the virtual keyboard
+   by a COutputEngine.
+
+   With --focus, the daemon follows the focused application (for the keymap's
+   per-application sections) as reported, one name per line, through a FIFO; see
+   CFocusReader.
+
+   Abbreviations are typed on a US keyboard unless --layout describes another (see
+   ParseLayout()). Given more than once, the first is current and the focus FIFO
+   switches between them by file name, without its extension: "layout de". The daemon
+   sits below xkb, which belongs to the desktop, so the description says what the
+   desktop's layout types.
+
+   Each --plugin is a handler plugin (see CaptainHookPlugin.h), loaded at startup and
+   given the action events along with the app's own actions.
+
+   SIGUSR1 writes the hook statistics to stderr as JSON (see CHookStatistics::WriteDump).
+   They're also published, along with the focused application and whether the daemon is
+   paused, in POSIX shared memory (see CControlPlane), where captainhook-ctl reads them
+   and sends pause, resume and reload commands.
+
+   With --tickless the daemon sleeps until input or a deadline that matters: the control
+   plane only publishes while something is changing, and otherwise waits for
+   captainhook-ctl to wake it. Idle, it doesn't wake at all. */
+#include "ActionExecutor.h"
+#include "AppActions.h"
+#include "AppController.h"
+#include "AppFocus.h"
+#include "ControlPlane.h"
+#include "EvdevInput.h"
+#include "FocusReader.h"
+#include "HookStatistics.h"
+#include "HookWatchdog.h"
+#include "KeyEngine.h"
+#include "Keymap.h"
+#include "KeymapPublisher.h"
+#include "KeymapReloader.h"
+#include "KeymapWatcher.h"
+#include "KeyboardLayout.h"
+#include "LinuxKeyboardHook.h"
+#include "MappedFile.h"
+#include "OutputEngine.h"
+#include "PluginLibrary.h"
+#include "TimerWheel.h"
+#include "UinputOutput.h"
+#include "UinputSink.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+//
+// Constants
+//
+
+static char const DEVICE_NAME[] = "CaptainHook virtual keyboard";
+static char const INPUT_DIRECTORY[] = "/dev/input";
+static char const g_keymapFileName[] = "CaptainHookLL.keymap";
+static char const g_scriptFileName[] = "./CaptainHookLL.script";
+static char const g_statisticsFileName[] = "CaptainHookLL.stats.json";
+
+/* As in the tray app: workers for the actions that do real work, and how long a script
+   may run before the worker stops waiting for it. */
+static unsigned const ACTION_WORKER_COUNT = 2;
+static int const SCRIPT_TIMEOUT = 30000;
+static int const SCRIPT_NOT_STARTED = -1;
+static int const SCRIPT_TIMED_OUT = -2;
+
+/* Changing icon here just reports the new one. */
+static char const *const g_iconNames[ICON_COUNT] = {
+    "hook",
+    "fish",
+    "bait",
+};
+
+//
+// Function declarations
+//
+
+static void Usage(char const *program);
+static int OpenFake(char const *path, int flags, int standardFd);
+static bool LoadLayout(char const *path);
+static bool LoadPlugin(char const *path);
+static void UnloadPlugins();
+static void OnSignal(int signal);
+static void OnStatisticsSignal(int signal);
+static int GetWaitTimeout();
+static void HandleKeyEvent(void *context, KeyEvent const &event);
+static bool WakeForCompletions(void *context);
+static void ProcessActionCompletions();
+static void RunControlPlane(uint64_t now);
+static void OnControlTimer(void *context, TimerHandle timer);
+static void ResumeControlPlane(uint64_t now);
+static void OnControlWake(void *context);
+static void ScheduleMotionFrame(uint64_t now);
+static void OnMotionTimer(void *context, TimerHandle timer);
+
+//
+// Action workers
+//
+
+/* Writes the statistics file. Returns 0 if it was written. */
+class CStatisticsWorker : public IActionWorker
+{
+public:
+    virtual int RunAction(KeyEvent const &event);
+};
+
+/* Runs the script and returns its exit status (or SCRIPT_NOT_STARTED or
+   SCRIPT_TIMED_OUT). */
+class CScriptWorker : public IActionWorker
+{
+public:
+    CScriptWorker() : m_path(g_scriptFileName) {}
+    void SetPath(char const *path) { m_path = path; }
+    virtual int RunAction(KeyEvent const &event);
+
+private:
+    char const *m_path;
+};
+
+/* What the actions do, daemon style: icons are printed, and actions that do real work
+   go to the executor. */
+class CDaemonFrontend : public IAppFrontend
+{
+public:
+    CDaemonFrontend() : m_icon(-1) {}
+    virtual void ShowIcon(unsigned icon);
+    virtual void SubmitAction(KeyEvent const &event);
+    virtual void ProcessTimeout(uint32_t now);
+
+private:
+    int m_icon;
+};
+
+//
+// Global variables
+//
+
+static CKeyEngine g_KeyEngine;
+static CKeymapPublisher g_KeymapPublisher;
+static CKeymapReloader g_KeymapReloader(g_KeymapPublisher, g_actionNames, g_actionNameCount);
+static CKeymapWatcher g_KeymapWatcher(g_KeymapReloader, g_KeymapPublisher);
+static CAppFocus g_AppFocus;
+static CFocusReader g_FocusReader(g_AppFocus);
+static CLayoutCache g_Layouts;
+static CEvdevInput g_Input;
+static CUinputOutput g_Output;
+static CLinuxKeyboardHook g_Hook(g_KeyEngine, g_Output);
+static CUinputSink g_OutputSink(g_Output);
+static COutputEngine g_OutputEngine(g_OutputSink);
+
+/* Times are CLinuxKeyboardHook::GetTime() milliseconds. The wheel's next deadline is the
+   main loop's epoll timeout. */
+static CTimerWheel g_Timers;
+static CDaemonFrontend g_Frontend;
+static CAppController g_Controller(g_KeyEngine, g_OutputEngine, g_Timers, g_Frontend);
+
+static volatile sig_atomic_t g_quit = 0;
+
+static CHookStatistics g_Statistics;
+static CHookWatchdog g_Watchdog;
+static volatile sig_atomic_t g_dumpStatistics = 0;
+
+/* Published every CONTROL_INTERVAL ms (or, with --tickless, while anything's changing),
+   when the commands posted since are run too. Clients wake the main loop through the
+   control plane's wake to have them run sooner. */
+static CControlPlane g_ControlPlane;
+static TimerHandle g_controlTimer = INVALID_TIMER;
+static bool g_tickless = false;
+
+/* Armed while the hook has a batch of mouse movement to reduce. */
+static TimerHandle g_motionTimer = INVALID_TIMER;
+
+static CActionExecutor g_Executor;
+static CStatisticsWorker g_StatisticsWorker;
+static CScriptWorker g_ScriptWorker;
+
+/* Handler plugins, and their handlers on g_Controller's event bus. */
+static std::vector<std::unique_ptr<CPluginLibrary>> g_Plugins;
+static std::vector<EventHandlerId> g_pluginHandlers;
+
+
+int main(int argc, char *argv[])
+{
+    uint64_t startTicks = LatencyClockNow();
+    static struct option const options[] = {
+        { "keymap", required_argument, NULL, 'k' },
+        { "device", required_argument, NULL, 'd' },
+        { "fake-input", required_argument, NULL, 'i' },
+        { "fake-output", required_argument, NULL, 'o' },
+        { "script", required_argument, NULL, 's' },
+        { "focus", required_argument, NULL, 'f' },
+        { "mice", no_argument, NULL, 'm' },
+        { "layout", required_argument, NULL, 'l' },
+        { "plugin", required_argument, NULL, 'p' },
+        { "tickless", no_argument, NULL, 't' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    char const *keymapPath = g_keymapFileName;
+    char const *fakeInput = NULL;
+    char const *fakeOutput = NULL;
+    char const *focusPath = NULL;
+    bool mice = false;
+    std::vector<char const *> devices;
+    std::vector<char const *> layouts;
+    std::vector<char const *> plugins;
+    int option;
+    while ((option = getopt_long(argc, argv, "k:d:i:o:s:f:ml:p:th", options, NULL)) != -1) {
+        switch (option) {
+        case 'k':
+            keymapPath = optarg;
+            break;
+        case 'd':
+            devices.push_back(optarg);
+            break;
+        case 'i':
+            fakeInput = optarg;
+            break;
+        case 'o':
+            fakeOutput = optarg;
+            break;
+        case 's':
+            g_ScriptWorker.SetPath(optarg);
+            break;
+        case 'f':
+            focusPath = optarg;
+            break;
+        case 'm':
+            mice = true;
+            break;
+        case 'l':
+            layouts.push_back(optarg);
+            break;
+        case 'p':
+            plugins.push_back(optarg);
+            break;
+        case 't':
+            g_tickless = true;
+            break;
+        default:
+            Usage(argv[0]);
+            return (option == 'h') ? 0 : 2;
+        }
+    }
+
+    std::string imagePath = std::string(keymapPath) + ".bin";
+    KeymapError error;
+    g_KeymapReloader.SetDefaultKeymap(g_defaultKeymap, g_defaultKeymapLength);
+    g_KeymapReloader.SetPaths(keymapPath, imagePath.c_str());
+    if (!g_KeymapReloader.Load(&error)) {
+        if (error.line) {
+            fprintf(stderr, "%s: line %u: %s. Using the default keymap.\n", keymapPath, error.line, error.message);
+        } else {
+            fprintf(stderr, "%s: %s. Using the default keymap.\n", keymapPath, error.message);
+        }
+    }
+    g_KeyEngine.SetKeymapPublisher(&g_KeymapPublisher);
+    g_KeyEngine.SetAppFocus(&g_AppFocus);
+    for (size_t i = 0; i < layouts.size(); ++i) {
+        if (!LoadLayout(layouts[i])) {
+            return 1;
+        }
+    }
+    g_KeyEngine.SetLayouts(&g_Layouts);
+    g_FocusReader.SetLayouts(&g_Layouts);
+    g_OutputEngine.SetKeymapPublisher(&g_KeymapPublisher);
+    g_OutputEngine.SetKeyState(&g_KeyEngine.GetKeyState());
+    if (!g_KeymapWatcher.Start(keymapPath)) {
+        perror("Can't watch the keymap for changes");
+    }
+    if (focusPath && !g_FocusReader.Start(focusPath)) {
+        perror(focusPath);
+        return 1;
+    }
+    g_Hook.SetActionHandler(HandleKeyEvent, NULL);
+    g_Hook.SetStatistics(&g_Statistics);
+    g_Hook.SetWatchdog(&g_Watchdog);
+    g_Statistics.SetWatchdog(&g_Watchdog);
+    g_Controller.SetWatchdog(&g_Watchdog);
+    for (size_t i = 0; i < plugins.size(); ++i) {
+        if (!LoadPlugin(plugins[i])) {
+            UnloadPlugins();
+            return 1;
+        }
+    }
+    g_Timers.Advance(CLinuxKeyboardHook::GetTime());
+
+    /* Without explicit devices, take every keyboard (and mouse, if asked), including ones
+       plugged in later. */
+    bool watch = !fakeInput && devices.empty();
+    uint64_t hookTicks = LatencyClockNow();
+    g_Input.SetMice(mice);
+    if (!g_Input.Open(watch ? INPUT_DIRECTORY : NULL)) {
+        perror("Can't watch for input devices");
+        return 1;
+    }
+
+    /* The output has to exist before the keyboards are added, so that our own virtual
+       keyboard can be recognized and left alone. */
+    if (fakeOutput) {
+        int fd = OpenFake(fakeOutput, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO);
+        if ((fd < 0) || !g_Output.Attach(fd)) {
+            perror(fakeOutput);
+            return 1;
+        }
+    } else {
+        if (!g_Output.Open(DEVICE_NAME, mice)) {
+            perror("Can't create the uinput device");
+            return 1;
+        }
+        g_Input.SetIgnoredName(DEVICE_NAME);
+    }
+
+    if (fakeInput) {
+        /* Opening a FIFO waits here until something opens the other end to write. */
+        int fd = OpenFake(fakeInput, O_RDONLY, STDIN_FILENO);
+        if ((fd < 0) || !g_Input.AddFakeDevice(fd, fakeInput)) {
+            perror(fakeInput);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < devices.size(); ++i) {
+        if (!g_Input.AddDevice(devices[i])) {
+            fprintf(stderr, "%s: not a keyboard%s, or not accessible\n", devices[i], mice ? " or mouse" : "");
+            return 1;
+        }
+    }
+    if (watch && (g_Input.AddAllDevices(INPUT_DIRECTORY) == 0)) {
+        fprintf(stderr, "No keyboards yet; waiting for one to be plugged in.\n");
+    }
+    g_KeyEngine.GetKeyState().SetLockState(g_Input.GetLockState());
+
+    /* Keys typed from here on wait in the grabbed keyboards for the main loop. Opening and
+       grabbing the devices is this daemon's hook, so that's the hook time. */
+    uint64_t hookedTicks = LatencyClockNow();
+    g_Statistics.SetHookTime(LatencyClockToNanoseconds(hookedTicks - hookTicks));
+    g_Statistics.SetStartupTime(LatencyClockToNanoseconds(hookedTicks - startTicks));
+
+    /* Completions wake the main loop, so this has to wait until g_Input is open. */
+    g_Executor.SetWorker(ACTION_SAVE_STATISTICS, &g_StatisticsWorker, 1, CActionExecutor::POLICY_COALESCE);
+    g_Executor.SetWorker(ACTION_RUN_SCRIPT, &g_ScriptWorker, SCRIPT_QUEUE_LIMIT, CActionExecutor::POLICY_DROP_NEWEST);
+    g_Executor.SetWakeFunction(WakeForCompletions, NULL);
+    g_Executor.Start(ACTION_WORKER_COUNT);
+
+    char controlName[64];
+    GetControlPlaneName(controlName, sizeof(controlName));
+    if (g_ControlPlane.Create(controlName, static_cast<uint64_t>(getpid()))) {
+        CNamedWake &wake = g_ControlPlane.GetWake();
+        if (wake.IsOpen() && !g_Input.WatchFd(wake.GetFd(), OnControlWake, NULL)) {
+            wake.Close();
+        }
+        RunControlPlane(CLinuxKeyboardHook::GetTime());
+    } else {
+        perror("Can't create the control plane's shared memory");
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = OnSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+    action.sa_handler = OnStatisticsSignal;
+    sigaction(SIGUSR1, &action, NULL);
+
+    g_Frontend.ShowIcon(ICON_HOOK);
+    while (!g_quit) {
+        int delivered = g_Input.Wait(GetWaitTimeout(), g_Hook);
+        if (delivered < 0) {
+            perror("epoll_wait");
+            break;
+        }
+        uint64_t now = CLinuxKeyboardHook::GetTime();
+        if (delivered == 0) {
+            g_Statistics.CountWakeup();
+        } else if (g_controlTimer == INVALID_TIMER) {
+            ResumeControlPlane(now);
+        }
+        g_Timers.Advance(now);
+        g_Controller.ScheduleSequenceTimeout(now);
+        ScheduleMotionFrame(now);
+        ProcessActionCompletions();
+
+        if (g_dumpStatistics) {
+            g_dumpStatistics = 0;
+            g_Statistics.WriteDump(stderr);
+        }
+
+        /* A fake keyboard that's been closed isn't coming back. */
+        if (fakeInput && (g_Input.GetDeviceCount() == 0)) {
+            break;
+        }
+    }
+
+    /* Waits for any action that's running (a script, at worst SCRIPT_TIMEOUT). */
+    g_Executor.Stop();
+    ProcessActionCompletions();
+    UnloadPlugins();
+    g_KeymapWatcher.Stop();
+    g_FocusReader.Stop();
+    g_ControlPlane.Close();
+    g_Output.Close();
+    g_Input.Close();
+    return 0;
+}
+
+static void Usage(char const *program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -k, --keymap FILE       keymap to load (default: ./%s)\n"
+        "  -d, --device PATH       grab this keyboard rather than all of them (repeatable)\n"
+        "  -i, --fake-input PATH   read raw input_event records from PATH (- for stdin)\n"
+        "  -o, --fake-output PATH  write passed-on events to PATH (- for stdout) rather\n"
+        "                          than a uinput device\n"
+        "  -s, --script FILE       script for the \"script\" action (default: %s)\n"
+        "  -f, --focus FIFO        read the focused application's name from FIFO, one\n"
+        "                          per line, for the keymap's per-application sections\n"
+        "  -m, --mice              grab mice too, for button, wheel and flick bindings\n"
+        "  -l, --layout FILE       what keys type, for abbreviations, if not a US layout\n"
+        "                          (repeatable; the focus FIFO's \"layout NAME\" switches)\n"
+        "  -p, --plugin FILE       load a handler plugin (repeatable)\n"
+        "  -t, --tickless          don't wake up while idle, even to publish statistics\n"
+        "                          (captainhook-ctl wakes the daemon when it needs them)\n",
+        program, g_keymapFileName, g_scriptFileName);
+}
+
+static int OpenFake(char const *path, int flags, int standardFd)
+{
+    if (strcmp(path, "-") == 0) {
+        return dup(standardFd);
+    }
+    return open(path, flags | O_CLOEXEC, 0644);
+}
+
+/* The layout is named for its file, without the directory or extension. */
+static bool LoadLayout(char const *path)
+{
+    CMappedFile text;
+    std::unique_ptr<LayoutTable> layout(new LayoutTable);
+    KeymapError error;
+    if (!text.Open(path)) {
+        perror(path);
+        return false;
+    }
+    if (!ParseLayout(static_cast<char const *>(text.GetData()), text.GetSize(), *layout, &error)) {
+        fprintf(stderr, "%s: line %u: %s\n", path, error.line, error.message);
+        return false;
+    }
+    char const *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    char const *extension = strchr(name, '.');
+    size_t length = extension ? static_cast<size_t>(extension - name) : strlen(name);
+    snprintf(layout->name, sizeof(layout->name), "%.*s", static_cast<int>(length), name);
+    layout->id = LayoutIdFromName(layout->name);
+    LayoutTable const *added = g_Layouts.Add(std::move(layout));
+    if (!g_Layouts.GetCurrent()) {
+        g_Layouts.SetCurrent(added);
+    }
+    return true;
+}
+
+static bool LoadPlugin(char const *path)
+{
+    std::unique_ptr<CPluginLibrary> library(new CPluginLibrary);
+    char const *error;
+    if (!library->Load(path, &error)) {
+        fprintf(stderr, "%s: %s\n", path, error);
+        return false;
+    }
+    CaptainHookPlugin const *plugin = library->GetPlugin();
+    EventHandlerId id = g_Controller.GetEventBus().Add(plugin->name, plugin->priority, plugin->interest,
+        plugin->handleEvent, plugin->context);
+    if (id == INVALID_EVENT_HANDLER) {
+        fprintf(stderr, "%s: too many plugins\n", path);
+        return false;
+    }
+    g_Plugins.push_back(std::move(library));
+    g_pluginHandlers.push_back(id);
+    return true;
+}
+
+static void UnloadPlugins()
+{
+    for (size_t i = 0; i < g_pluginHandlers.size(); ++i) {
+        g_Controller.GetEventBus().Remove(g_pluginHandlers[i]);
+    }
+    g_pluginHandlers.clear();
+    g_Plugins.clear();
+}
+
+static void OnSignal(int signal)
+{
+    (void)signal;
+    g_quit = 1;
+}
+
+static void OnStatisticsSignal(int signal)
+{
+    (void)signal;
+    g_dumpStatistics = 1;
+}
+
+static int GetWaitTimeout()
+{
+    uint64_t deadline = g_Timers.GetNextDeadline();
+    if (deadline == CTimerWheel::NO_DEADLINE) {
+        return -1;
+    }
+    uint64_t now = CLinuxKeyboardHook::GetTime();
+    if (deadline <= now) {
+        return 0;
+    }
+    return (deadline - now > 0x7FFFFFFF) ? 0x7FFFFFFF : static_cast<int>(deadline - now);
+}
+
+static void HandleKeyEvent(void *context, KeyEvent const &event)
+{
+    (void)context;
+    g_Controller.HandleKeyEvent(event, CLinuxKeyboardHook::GetTime());
+}
+
+static bool WakeForCompletions(void *context)
+{
+    /* On a worker thread. */
+    (void)context;
+    return g_Input.Wake();
+}
+
+static void ProcessActionCompletions()
+{
+    ActionCompletion completion;
+    while (g_Executor.PopCompletion(completion)) {
+        switch (completion.event.action) {
+        case ACTION_SAVE_STATISTICS:
+            if (completion.status == 0) {
+                fprintf(stderr, "Statistics written to %s\n", g_statisticsFileName);
+            } else {
+                fprintf(stderr, "Couldn't write %s\n", g_statisticsFileName);
+            }
+            break;
+
+        case ACTION_RUN_SCRIPT:
+            if (completion.status == SCRIPT_NOT_STARTED) {
+                fprintf(stderr, "Couldn't run the script\n");
+            } else if (completion.status == SCRIPT_TIMED_OUT) {
+                fprintf(stderr, "The script is taking too long; no longer waiting for it\n");
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+static void RunControlPlane(uint64_t now)
+{
+    unsigned command;
+    while (g_ControlPlane.PopCommand(command)) {
+        switch (command) {
+        case CONTROL_PAUSE:
+        case CONTROL_RESUME:
+            if (g_KeyEngine.IsPaused() != (command == CONTROL_PAUSE)) {
+                g_KeyEngine.SetPaused(command == CONTROL_PAUSE);
+                fprintf(stderr, "Captain Hook: %s\n", (command == CONTROL_PAUSE) ? "paused" : "resumed");
+            }
+            break;
+
+        case CONTROL_RELOAD:
+            /* Reloads mustn't overlap, so the watcher does them if it's there. */
+            if (!g_KeymapWatcher.RequestReload()) {
+                KeymapError error;
+                if (!g_KeymapReloader.Reload(&error)) {
+                    fprintf(stderr, "Keymap: %s. Keeping the current keymap.\n", error.message);
+                }
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    ControlStats stats;
+    CControlPlane::Collect(stats, now, g_Statistics, g_KeyEngine, g_KeymapPublisher, &g_AppFocus);
+    bool changed = g_ControlPlane.Publish(stats);
+
+    /* Tickless, stop once there's nothing new; input or a client starts it again.
+       Without a wake for clients to signal, keep going regardless. */
+    if (g_tickless && !changed && g_ControlPlane.GetWake().IsOpen()) {
+        g_Timers.Cancel(g_controlTimer);
+        g_controlTimer = INVALID_TIMER;
+        return;
+    }
+    uint64_t deadline = now + CONTROL_INTERVAL;
+    if (!g_Timers.Rearm(g_controlTimer, deadline, CONTROL_SLACK)) {
+        g_controlTimer = g_Timers.Arm(deadline, OnControlTimer, NULL, CONTROL_SLACK);
+    }
+}
+
+static void OnControlTimer(void *context, TimerHandle timer)
+{
+    (void)context;
+    (void)timer;
+    RunControlPlane(g_Timers.GetTime());
+}
+
+static void ResumeControlPlane(uint64_t now)
+{
+    if (g_ControlPlane.IsOpen()) {
+        g_controlTimer = g_Timers.Arm(now + CONTROL_INTERVAL, OnControlTimer, NULL, CONTROL_SLACK);
+    }
+}
+
+static void OnControlWake(void *context)
+{
+    /* While the control plane's timer is running, it'll get to the commands soon enough. */
+    (void)context;
+    if (g_ControlPlane.GetWake().Clear() && (g_controlTimer == INVALID_TIMER)) {
+        RunControlPlane(CLinuxKeyboardHook::GetTime());
+    }
+}
+
+static void ScheduleMotionFrame(uint64_t now)
+{
+    if (g_Hook.IsMotionPending() && (g_motionTimer == INVALID_TIMER)) {
+        g_motionTimer = g_Timers.Arm(now + CMotionBatcher::FRAME_INTERVAL, OnMotionTimer, NULL);
+    }
+}
+
+static void OnMotionTimer(void *context, TimerHandle timer)
+{
+    (void)context;
+    (void)timer;
+    g_motionTimer = INVALID_TIMER;
+    g_Hook.FlushMotion();
+}
+
+void CDaemonFrontend::ShowIcon(unsigned icon)
+{
+    if (static_cast<int>(icon) != m_icon) {
+        uint64_t start = LatencyClockNow();
+        m_icon = static_cast<int>(icon);
+        fprintf(stderr, "Captain Hook: %s\n", g_iconNames[icon]);
+        g_Statistics.GetLatency(LATENCY_ICON).RecordTicks(start);
+    }
+}
+
+void CDaemonFrontend::SubmitAction(KeyEvent const &event)
+{
+    g_Executor.Submit(event);
+}
+
+void CDaemonFrontend::ProcessTimeout(uint32_t now)
+{
+    g_Hook.ProcessTimeout(now);
+}
+
+int CStatisticsWorker::RunAction(KeyEvent const &event)
+{
+    (void)event;
+
+    /* The histograms are safe to read while the hook writes them. */
+    FILE *file = fopen(g_statisticsFileName, "w");
+    if (!file) {
+        return 1;
+    }
+    bool written = g_Statistics.WriteDump(file);
+    return ((fclose(file) == 0) && written) ? 0 : 1;
+}
+
+int CScriptWorker::RunAction(KeyEvent const &event)
+{
+    char keycode[8];
+    snprintf(keycode, sizeof(keycode), "%u", event.keycode);
+    char *const argv[] = {
+        const_cast<char *>(m_path),
+        keycode,
+        const_cast<char *>((event.flags & KeyEvent::FLAG_DOWN) ? "press" : "release"),
+        NULL,
+    };
+    pid_t pid;
+    if (posix_spawn(&pid, m_path, NULL, NULL, argv, environ) != 0) {
+        return SCRIPT_NOT_STARTED;
+    }
+
+    /* There's no waitpid() with a timeout, so poll for it. */
+    struct timespec const pause = { 0, 10 * 1000 * 1000 };
+    for (int waited = 0; waited < SCRIPT_TIMEOUT; waited += 10) {
+        int status;
+        pid_t result = waitpid(pid, &status, WNOHANG);
+        if (result == pid) {
+            // posix_spawn reports a missing script as exit status 127 from the child.
+            if (WIFEXITED(status)) {
+                return (WEXITSTATUS(status) == 127) ? SCRIPT_NOT_STARTED : WEXITSTATUS(status);
+            }
+            return 128 + WTERMSIG(status);
+        }
+        if ((result < 0) && (errno != EINTR)) {
+            return SCRIPT_NOT_STARTED;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return SCRIPT_TIMED_OUT;
+}
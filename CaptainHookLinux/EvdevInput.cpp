@@ -0,0 +1,420 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "EvdevInput.h"
+#include "KeyState.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+
+namespace {
+
+// epoll data for the inotify, Wake() and WatchFd() descriptors; device slots use their
+// index.
+uint64_t const HOTPLUG_TAG = ~0ull;
+uint64_t const WAKE_TAG = ~1ull;
+uint64_t const WATCH_TAG = ~2ull;
+
+bool TestBit(unsigned long const *bits, unsigned bit)
+{
+    size_t const BITS_PER_LONG = sizeof(unsigned long) * 8;
+    return ((bits[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1) != 0;
+}
+
+} // namespace
+
+CEvdevInput::CEvdevInput() :
+    m_epoll(-1),
+    m_inotify(-1),
+    m_wake(-1),
+    m_ready(nullptr),
+    m_readyContext(nullptr),
+    m_mice(false),
+    m_deviceCount(0)
+{
+    m_watchDirectory[0] = '\0';
+    m_ignoredName[0] = '\0';
+    for (size_t i = 0; i < MAX_DEVICES; ++i) {
+        m_devices[i].fd = -1;
+    }
+}
+
+CEvdevInput::~CEvdevInput()
+{
+    Close();
+}
+
+bool CEvdevInput::Open(char const *watchDirectory)
+{
+    Close();
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll < 0) {
+        return false;
+    }
+    m_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = WAKE_TAG;
+    if ((m_wake < 0) || (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &event) < 0)) {
+        Close();
+        return false;
+    }
+    if (!watchDirectory) {
+        return true;
+    }
+
+    snprintf(m_watchDirectory, sizeof(m_watchDirectory), "%s", watchDirectory);
+    m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    // Devices appear with IN_CREATE, but often only become readable by us when udev
+    // fixes their permissions a moment later (IN_ATTRIB).
+    if ((m_inotify < 0) || (inotify_add_watch(m_inotify, watchDirectory, IN_CREATE | IN_ATTRIB) < 0)) {
+        Close();
+        return false;
+    }
+    event.data.u64 = HOTPLUG_TAG;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_inotify, &event) < 0) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void CEvdevInput::Close()
+{
+    for (size_t i = 0; i < MAX_DEVICES; ++i) {
+        if (m_devices[i].fd >= 0) {
+            RemoveDevice(i);
+        }
+    }
+    if (m_inotify >= 0) {
+        close(m_inotify);
+        m_inotify = -1;
+    }
+    if (m_wake >= 0) {
+        close(m_wake);
+        m_wake = -1;
+    }
+    if (m_epoll >= 0) {
+        close(m_epoll);
+        m_epoll = -1;
+    }
+    m_ready = nullptr;
+    m_watchDirectory[0] = '\0';
+}
+
+bool CEvdevInput::Wake()
+{
+    uint64_t one = 1;
+    // EAGAIN means the counter is already about as high as it goes, which wakes it too.
+    return (m_wake >= 0) && ((write(m_wake, &one, sizeof(one)) == sizeof(one)) || (errno == EAGAIN));
+}
+
+bool CEvdevInput::WatchFd(int fd, ReadyFunction ready, void *context)
+{
+    if ((m_epoll < 0) || m_ready || !ready) {
+        return false;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = WATCH_TAG;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        return false;
+    }
+    m_ready = ready;
+    m_readyContext = context;
+    return true;
+}
+
+void CEvdevInput::SetIgnoredName(char const *name)
+{
+    snprintf(m_ignoredName, sizeof(m_ignoredName), "%s", name ? name : "");
+}
+
+bool CEvdevInput::AddDevice(char const *path)
+{
+    for (size_t i = 0; i < MAX_DEVICES; ++i) {
+        if ((m_devices[i].fd >= 0) && (strcmp(m_devices[i].path, path) == 0)) {
+            return true;
+        }
+    }
+
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    if (!IsWanted(fd)) {
+        close(fd);
+        return false;
+    }
+    // Timestamp events on the same clock as the daemon's timers.
+    int clock = CLOCK_MONOTONIC;
+    ioctl(fd, EVIOCSCLOCKID, &clock);
+    return AddFd(fd, path, false);
+}
+
+size_t CEvdevInput::AddAllDevices(char const *directory)
+{
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        return 0;
+    }
+    size_t added = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "event", 5) != 0) {
+            continue;
+        }
+        char path[sizeof(m_devices[0].path)];
+        int length = snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        if ((length > 0) && (static_cast<size_t>(length) < sizeof(path)) && AddDevice(path)) {
+            ++added;
+        }
+    }
+    closedir(dir);
+    return added;
+}
+
+bool CEvdevInput::AddFakeDevice(int fd, char const *name)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        close(fd);
+        return false;
+    }
+    return AddFd(fd, name, true);
+}
+
+int CEvdevInput::Wait(int timeoutMs, IEvdevHandler &handler)
+{
+    struct epoll_event events[MAX_DEVICES + 1];
+    int ready = epoll_wait(m_epoll, events, MAX_DEVICES + 1, timeoutMs);
+    if (ready < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    int delivered = 0;
+    for (int i = 0; i < ready; ++i) {
+        if (events[i].data.u64 == HOTPLUG_TAG) {
+            ReadHotplugEvents();
+            continue;
+        }
+        if (events[i].data.u64 == WAKE_TAG) {
+            uint64_t count;
+            while (read(m_wake, &count, sizeof(count)) > 0) {
+            }
+            continue;
+        }
+        if (events[i].data.u64 == WATCH_TAG) {
+            m_ready(m_readyContext);
+            continue;
+        }
+        size_t slot = static_cast<size_t>(events[i].data.u64);
+        if (m_devices[slot].fd < 0) {
+            continue;
+        }
+        // Read even on EPOLLHUP, so that whatever a fake device wrote before closing
+        // isn't lost; the read then reports the end.
+        int count = ReadDevice(slot, handler);
+        if (count < 0) {
+            RemoveDevice(slot);
+        } else {
+            delivered += count;
+        }
+    }
+    return delivered;
+}
+
+uint32_t CEvdevInput::GetLockState() const
+{
+    for (size_t i = 0; i < MAX_DEVICES; ++i) {
+        Device const &device = m_devices[i];
+        if ((device.fd < 0) || device.fake) {
+            continue;
+        }
+        unsigned long leds[(LED_CNT + sizeof(unsigned long) * 8 - 1) / (sizeof(unsigned long) * 8)];
+        memset(leds, 0, sizeof(leds));
+        if (ioctl(device.fd, EVIOCGLED(sizeof(leds)), leds) < 0) {
+            continue;
+        }
+        return (TestBit(leds, LED_CAPSL) ? KEYSTATE_CAPSLOCK : 0) |
+            (TestBit(leds, LED_NUML) ? KEYSTATE_NUMLOCK : 0) |
+            (TestBit(leds, LED_SCROLLL) ? KEYSTATE_SCROLLLOCK : 0);
+    }
+    return 0;
+}
+
+bool CEvdevInput::AddFd(int fd, char const *path, bool fake)
+{
+    size_t slot = 0;
+    while ((slot < MAX_DEVICES) && (m_devices[slot].fd >= 0)) {
+        ++slot;
+    }
+    if (slot == MAX_DEVICES) {
+        close(fd);
+        return false;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = slot;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        close(fd);
+        return false;
+    }
+
+    Device &device = m_devices[slot];
+    device.fd = fd;
+    device.fake = fake;
+    device.grabbed = fake;
+    device.partialBytes = 0;
+    snprintf(device.path, sizeof(device.path), "%s", path);
+    ++m_deviceCount;
+    if (!fake) {
+        TryGrab(device);
+    }
+    return true;
+}
+
+bool CEvdevInput::IsWanted(int fd) const
+{
+    if (m_ignoredName[0]) {
+        char name[256];
+        if ((ioctl(fd, EVIOCGNAME(sizeof(name)), name) >= 0) && (strncmp(name, m_ignoredName, sizeof(name)) == 0)) {
+            return false;
+        }
+    }
+
+    // Anything with letter keys and Enter counts. That rules out mice, power buttons and
+    // the like, which also report EV_KEY.
+    unsigned long keys[(KEY_CNT + sizeof(unsigned long) * 8 - 1) / (sizeof(unsigned long) * 8)];
+    memset(keys, 0, sizeof(keys));
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0) {
+        return false;
+    }
+    if (TestBit(keys, KEY_A) && TestBit(keys, KEY_Z) && TestBit(keys, KEY_ENTER)) {
+        return true;
+    }
+
+    // Touchpads and tablets report absolute positions, so they're left alone.
+    unsigned long axes[(REL_CNT + sizeof(unsigned long) * 8 - 1) / (sizeof(unsigned long) * 8)];
+    memset(axes, 0, sizeof(axes));
+    return m_mice && TestBit(keys, BTN_LEFT) && (ioctl(fd, EVIOCGBIT(EV_REL, sizeof(axes)), axes) >= 0) &&
+        TestBit(axes, REL_X) && TestBit(axes, REL_Y);
+}
+
+void CEvdevInput::TryGrab(Device &device)
+{
+    unsigned long keys[(KEY_CNT + sizeof(unsigned long) * 8 - 1) / (sizeof(unsigned long) * 8)];
+    memset(keys, 0, sizeof(keys));
+    if (ioctl(device.fd, EVIOCGKEY(sizeof(keys)), keys) < 0) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+        if (keys[i]) {
+            return;
+        }
+    }
+    device.grabbed = (ioctl(device.fd, EVIOCGRAB, 1) == 0);
+}
+
+void CEvdevInput::RemoveDevice(size_t slot)
+{
+    Device &device = m_devices[slot];
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, device.fd, NULL);
+    close(device.fd);
+    device.fd = -1;
+    --m_deviceCount;
+}
+
+int CEvdevInput::ReadDevice(size_t slot, IEvdevHandler &handler)
+{
+    Device &device = m_devices[slot];
+    struct input_event events[READ_BATCH];
+    unsigned char *buffer = reinterpret_cast<unsigned char *>(events);
+
+    // Only fake devices can deliver part of a record; carry it over to the next read.
+    memcpy(buffer, device.partial, device.partialBytes);
+    ssize_t bytes = read(device.fd, buffer + device.partialBytes, sizeof(events) - device.partialBytes);
+    if (bytes < 0) {
+        return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+    }
+    if (bytes == 0) {
+        return -1;
+    }
+
+    size_t total = device.partialBytes + static_cast<size_t>(bytes);
+    size_t count = total / sizeof(struct input_event);
+    device.partialBytes = total % sizeof(struct input_event);
+    memcpy(device.partial, buffer + count * sizeof(struct input_event), device.partialBytes);
+
+    // Until the keyboard is grabbed its keys are going straight to the system anyway.
+    if (!device.grabbed) {
+        TryGrab(device);
+        return 0;
+    }
+    if (count > 0) {
+        handler.OnInputEvents(events, count);
+    }
+    return static_cast<int>(count);
+}
+
+void CEvdevInput::ReadHotplugEvents()
+{
+    alignas(struct inotify_event) char buffer[4096];
+    for (;;) {
+        ssize_t bytes = read(m_inotify, buffer, sizeof(buffer));
+        if (bytes <= 0) {
+            return;
+        }
+        for (ssize_t offset = 0; offset < bytes;) {
+            struct inotify_event const *event = reinterpret_cast<struct inotify_event const *>(buffer + offset);
+            if ((event->len > 0) && (strncmp(event->name, "event", 5) == 0)) {
+                char path[sizeof(m_devices[0].path)];
+                int length = snprintf(path, sizeof(path), "%s/%s", m_watchDirectory, event->name);
+                if ((length > 0) && (static_cast<size_t>(length) < sizeof(path))) {
+                    AddDevice(path);
+                }
+            }
+            offset += static_cast<ssize_t>(sizeof(struct inotify_event) + event->len);
+        }
+    }
+}
@@ -0,0 +1,136 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+/* Receives raw input events, a batch at a time. */
+class IEvdevHandler
+{
+public:
+    virtual ~IEvdevHandler() {}
+    virtual void OnInputEvents(struct input_event const *events, size_t count) = 0;
+};
+
+/* Reads keyboards under /dev/input through one epoll set. Each keyboard is grabbed
+   (EVIOCGRAB) so that nothing else sees its keys; whoever handles the events is
+   responsible for passing on the ones it doesn't want (see CUinputOutput). A keyboard
+   isn't grabbed until all of its keys are up, so a key held while the daemon starts (or
+   while a keyboard is plugged in) can't end up stuck down. New keyboards are picked up
+   with inotify as they appear, and unplugged ones are dropped. With SetMice(), mice are
+   taken the same way.
+
+   A "fake device" is a file descriptor (typically a pipe) that carries raw input_event
+   records, for running without real hardware. Their timestamps should be CLOCK_MONOTONIC,
+   like a real device's, or zero. */
+class CEvdevInput
+{
+public:
+    static size_t const MAX_DEVICES = 32;
+    static size_t const READ_BATCH = 64;
+
+    typedef void (*ReadyFunction)(void *context);
+
+    CEvdevInput();
+    ~CEvdevInput();
+
+    /* Set up the epoll set. If watchDirectory isn't NULL (normally "/dev/input"),
+       keyboards that appear there later are added automatically. */
+    bool Open(char const *watchDirectory);
+    void Close();
+
+    /* Devices with this name are never added; used to skip our own uinput device. */
+    void SetIgnoredName(char const *name);
+
+    /* Take mice too: anything with relative X and Y axes and a left button. Only affects
+       devices added afterwards. */
+    void SetMice(bool mice) { m_mice = mice; }
+
+    /* Returns false if the device can't be opened or isn't a keyboard (or a mouse, with
+       SetMice()). */
+    bool AddDevice(char const *path);
+
+    /* Add every keyboard (and mouse) in directory. Returns the number added. */
+    size_t AddAllDevices(char const *directory);
+
+    /* Takes ownership of fd. */
+    bool AddFakeDevice(int fd, char const *name);
+
+    /* Wait up to timeoutMs (-1 for ever) for input and hand each device's events to
+       handler, one read() worth at a time. Returns the number of events delivered, 0 if
+       interrupted by a signal or by Wake(), or timed out, or -1 on error. */
+    int Wait(int timeoutMs, IEvdevHandler &handler);
+
+    /* Make Wait() return soon, from any thread. Returns false if that isn't possible. */
+    bool Wake();
+
+    /* Have Wait() call ready(context) whenever fd (which stays the caller's) has something
+       to read. ready must read it, or Wait() calls it again straight away. Only one at a
+       time. */
+    bool WatchFd(int fd, ReadyFunction ready, void *context);
+
+    size_t GetDeviceCount() const { return m_deviceCount; }
+
+    /* KEYSTATE_CAPSLOCK etc. from the LEDs of the first real keyboard, or 0. */
+    uint32_t GetLockState() const;
+
+private:
+    struct Device
+    {
+        int fd;
+        bool fake;
+        bool grabbed;
+        size_t partialBytes;
+        char path[128];
+        unsigned char partial[sizeof(struct input_event)];
+    };
+
+    bool AddFd(int fd, char const *path, bool fake);
+    bool IsWanted(int fd) const;
+    void TryGrab(Device &device);
+    void RemoveDevice(size_t slot);
+    int ReadDevice(size_t slot, IEvdevHandler &handler);
+    void ReadHotplugEvents();
+
+    int m_epoll;
+    int m_inotify;
+    int m_wake;
+    ReadyFunction m_ready;
+    void *m_readyContext;
+    char m_watchDirectory[96];
+    char m_ignoredName[64];
+    bool m_mice;
+
+    Device m_devices[MAX_DEVICES];
+    size_t m_deviceCount;
+};
@@ -0,0 +1,238 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "EvdevKeys.h"
+#include "VirtualKeys.h"
+#include <string.h>
+#include <linux/input-event-codes.h>
+
+namespace {
+
+struct KeyTranslation
+{
+    uint16_t code;
+    uint8_t keycode;
+    bool extended;
+};
+
+KeyTranslation const s_translations[] = {
+    { KEY_ESC, VKEY_ESCAPE, false },
+    { KEY_1, '1', false },
+    { KEY_2, '2', false },
+    { KEY_3, '3', false },
+    { KEY_4, '4', false },
+    { KEY_5, '5', false },
+    { KEY_6, '6', false },
+    { KEY_7, '7', false },
+    { KEY_8, '8', false },
+    { KEY_9, '9', false },
+    { KEY_0, '0', false },
+    { KEY_MINUS, VKEY_OEM_MINUS, false },
+    { KEY_EQUAL, VKEY_OEM_PLUS, false },
+    { KEY_BACKSPACE, VKEY_BACK, false },
+    { KEY_TAB, VKEY_TAB, false },
+    { KEY_Q, 'Q', false },
+    { KEY_W, 'W', false },
+    { KEY_E, 'E', false },
+    { KEY_R, 'R', false },
+    { KEY_T, 'T', false },
+    { KEY_Y, 'Y', false },
+    { KEY_U, 'U', false },
+    { KEY_I, 'I', false },
+    { KEY_O, 'O', false },
+    { KEY_P, 'P', false },
+    { KEY_LEFTBRACE, VKEY_OEM_4, false },
+    { KEY_RIGHTBRACE, VKEY_OEM_6, false },
+    { KEY_ENTER, VKEY_RETURN, false },
+    { KEY_LEFTCTRL, VKEY_LCONTROL, false },
+    { KEY_A, 'A', false },
+    { KEY_S, 'S', false },
+    { KEY_D, 'D', false },
+    { KEY_F, 'F', false },
+    { KEY_G, 'G', false },
+    { KEY_H, 'H', false },
+    { KEY_J, 'J', false },
+    { KEY_K, 'K', false },
+    { KEY_L, 'L', false },
+    { KEY_SEMICOLON, VKEY_OEM_1, false },
+    { KEY_APOSTROPHE, VKEY_OEM_7, false },
+    { KEY_GRAVE, VKEY_OEM_3, false },
+    { KEY_LEFTSHIFT, VKEY_LSHIFT, false },
+    { KEY_BACKSLASH, VKEY_OEM_5, false },
+    { KEY_Z, 'Z', false },
+    { KEY_X, 'X', false },
+    { KEY_C, 'C', false },
+    { KEY_V, 'V', false },
+    { KEY_B, 'B', false },
+    { KEY_N, 'N', false },
+    { KEY_M, 'M', false },
+    { KEY_COMMA, VKEY_OEM_COMMA, false },
+    { KEY_DOT, VKEY_OEM_PERIOD, false },
+    { KEY_SLASH, VKEY_OEM_2, false },
+    { KEY_RIGHTSHIFT, VKEY_RSHIFT, false },
+    { KEY_KPASTERISK, VKEY_MULTIPLY, false },
+    { KEY_LEFTALT, VKEY_LMENU, false },
+    { KEY_SPACE, VKEY_SPACE, false },
+    { KEY_CAPSLOCK, VKEY_CAPITAL, false },
+    { KEY_F1, VKEY_F1 + 0, false },
+    { KEY_F2, VKEY_F1 + 1, false },
+    { KEY_F3, VKEY_F1 + 2, false },
+    { KEY_F4, VKEY_F1 + 3, false },
+    { KEY_F5, VKEY_F1 + 4, false },
+    { KEY_F6, VKEY_F1 + 5, false },
+    { KEY_F7, VKEY_F1 + 6, false },
+    { KEY_F8, VKEY_F1 + 7, false },
+    { KEY_F9, VKEY_F1 + 8, false },
+    { KEY_F10, VKEY_F1 + 9, false },
+    { KEY_NUMLOCK, VKEY_NUMLOCK, true },
+    { KEY_SCROLLLOCK, VKEY_SCROLL, false },
+    { KEY_KP7, VKEY_NUMPAD0 + 7, false },
+    { KEY_KP8, VKEY_NUMPAD0 + 8, false },
+    { KEY_KP9, VKEY_NUMPAD0 + 9, false },
+    { KEY_KPMINUS, VKEY_SUBTRACT, false },
+    { KEY_KP4, VKEY_NUMPAD0 + 4, false },
+    { KEY_KP5, VKEY_NUMPAD0 + 5, false },
+    { KEY_KP6, VKEY_NUMPAD0 + 6, false },
+    { KEY_KPPLUS, VKEY_ADD, false },
+    { KEY_KP1, VKEY_NUMPAD0 + 1, false },
+    { KEY_KP2, VKEY_NUMPAD0 + 2, false },
+    { KEY_KP3, VKEY_NUMPAD0 + 3, false },
+    { KEY_KP0, VKEY_NUMPAD0 + 0, false },
+    { KEY_KPDOT, VKEY_DECIMAL, false },
+    { KEY_102ND, VKEY_OEM_102, false },
+    { KEY_F11, VKEY_F1 + 10, false },
+    { KEY_F12, VKEY_F1 + 11, false },
+    { KEY_KPENTER, VKEY_RETURN, true },
+    { KEY_RIGHTCTRL, VKEY_RCONTROL, true },
+    { KEY_KPSLASH, VKEY_DIVIDE, true },
+    { KEY_SYSRQ, VKEY_SNAPSHOT, true },
+    { KEY_RIGHTALT, VKEY_RMENU, true },
+    { KEY_HOME, VKEY_HOME, true },
+    { KEY_UP, VKEY_UP, true },
+    { KEY_PAGEUP, VKEY_PRIOR, true },
+    { KEY_LEFT, VKEY_LEFT, true },
+    { KEY_RIGHT, VKEY_RIGHT, true },
+    { KEY_END, VKEY_END, true },
+    { KEY_DOWN, VKEY_DOWN, true },
+    { KEY_PAGEDOWN, VKEY_NEXT, true },
+    { KEY_INSERT, VKEY_INSERT, true },
+    { KEY_DELETE, VKEY_DELETE, true },
+    { KEY_MUTE, VKEY_VOLUME_MUTE, true },
+    { KEY_VOLUMEDOWN, VKEY_VOLUME_DOWN, true },
+    { KEY_VOLUMEUP, VKEY_VOLUME_UP, true },
+    { KEY_PAUSE, VKEY_PAUSE, false },
+    { KEY_LEFTMETA, VKEY_LWIN, true },
+    { KEY_RIGHTMETA, VKEY_RWIN, true },
+    { KEY_COMPOSE, VKEY_APPS, true },
+    { KEY_NEXTSONG, VKEY_MEDIA_NEXT_TRACK, true },
+    { KEY_PLAYPAUSE, VKEY_MEDIA_PLAY_PAUSE, true },
+    { KEY_PREVIOUSSONG, VKEY_MEDIA_PREV_TRACK, true },
+    { KEY_STOPCD, VKEY_MEDIA_STOP, true },
+    { KEY_F13, VKEY_F1 + 12, false },
+    { KEY_F14, VKEY_F1 + 13, false },
+    { KEY_F15, VKEY_F1 + 14, false },
+    { KEY_F16, VKEY_F1 + 15, false },
+    { KEY_F17, VKEY_F1 + 16, false },
+    { KEY_F18, VKEY_F1 + 17, false },
+    { KEY_F19, VKEY_F1 + 18, false },
+    { KEY_F20, VKEY_F1 + 19, false },
+    { KEY_F21, VKEY_F1 + 20, false },
+    { KEY_F22, VKEY_F1 + 21, false },
+    { KEY_F23, VKEY_F1 + 22, false },
+    { KEY_F24, VKEY_F1 + 23, false },
+    { BTN_LEFT, VKEY_LBUTTON, false },
+    { BTN_RIGHT, VKEY_RBUTTON, false },
+    { BTN_MIDDLE, VKEY_MBUTTON, false },
+    { BTN_SIDE, VKEY_XBUTTON1, false },
+    { BTN_EXTRA, VKEY_XBUTTON2, false },
+};
+
+// Codes from here up have no virtual key.
+uint16_t const CODE_COUNT = BTN_EXTRA + 1;
+
+/* Direct lookup tables in both directions, built from s_translations on first use. Key
+   codes above 255 are media and special-purpose keys that have no virtual key, apart from
+   the mouse buttons. */
+struct TranslationTables
+{
+    uint8_t keycodes[CODE_COUNT];
+    uint8_t extended[(CODE_COUNT + 7) / 8];
+    uint16_t codes[256];
+    uint16_t extendedCodes[256];
+
+    TranslationTables()
+    {
+        memset(this, 0, sizeof(*this));
+        for (size_t i = 0; i < sizeof(s_translations) / sizeof(s_translations[0]); ++i) {
+            KeyTranslation const &translation = s_translations[i];
+            keycodes[translation.code] = translation.keycode;
+            if (translation.extended) {
+                extended[translation.code / 8] |= static_cast<uint8_t>(1 << (translation.code % 8));
+            }
+            // The first entry for a virtual key is the canonical one; an extended variant
+            // is only recorded separately.
+            uint16_t &code = translation.extended ? extendedCodes[translation.keycode] : codes[translation.keycode];
+            if (!code) {
+                code = translation.code;
+            }
+        }
+    }
+};
+
+TranslationTables const &GetTables()
+{
+    static TranslationTables const tables;
+    return tables;
+}
+
+} // namespace
+
+uint8_t VirtualKeyFromEvdev(uint16_t code, bool *extended)
+{
+    TranslationTables const &tables = GetTables();
+    if (code >= CODE_COUNT) {
+        if (extended) {
+            *extended = false;
+        }
+        return 0;
+    }
+    if (extended) {
+        *extended = ((tables.extended[code / 8] >> (code % 8)) & 1) != 0;
+    }
+    return tables.keycodes[code];
+}
+
+uint16_t EvdevFromVirtualKey(uint8_t keycode, bool extended)
+{
+    TranslationTables const &tables = GetTables();
+    uint16_t code = extended ? tables.extendedCodes[keycode] : tables.codes[keycode];
+    return code ? code : (extended ? tables.codes[keycode] : tables.extendedCodes[keycode]);
+}
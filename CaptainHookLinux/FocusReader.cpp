@@ -0,0 +1,152 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "FocusReader.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+CFocusReader::CFocusReader(CAppFocus &focus) :
+    m_focus(focus),
+    m_layouts(nullptr),
+    m_fd(-1),
+    m_lineLength(0)
+{
+    m_stop[0] = -1;
+    m_stop[1] = -1;
+}
+
+CFocusReader::~CFocusReader()
+{
+    Stop();
+}
+
+bool CFocusReader::Start(char const *path)
+{
+    if (m_thread.joinable()) {
+        return false;
+    }
+    m_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if ((m_fd < 0) || (pipe2(m_stop, O_CLOEXEC) < 0)) {
+        Stop();
+        return false;
+    }
+    m_lineLength = 0;
+    m_thread = std::thread(&CFocusReader::Run, this);
+    return true;
+}
+
+void CFocusReader::Stop()
+{
+    if (m_thread.joinable()) {
+        char stop = 0;
+        while ((write(m_stop[1], &stop, 1) < 0) && (errno == EINTR)) {
+        }
+        m_thread.join();
+    }
+    for (int fd : { m_fd, m_stop[0], m_stop[1] }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    m_fd = -1;
+    m_stop[0] = -1;
+    m_stop[1] = -1;
+}
+
+void CFocusReader::Run()
+{
+    struct pollfd fds[2] = {
+        { m_stop[0], POLLIN, 0 },
+        { m_fd, POLLIN, 0 },
+    };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Focus reader");
+            return;
+        }
+        if (fds[0].revents) {
+            return;
+        }
+        if (fds[1].revents && !ReadNames()) {
+            perror("Focus reader");
+            return;
+        }
+    }
+}
+
+bool CFocusReader::ReadNames()
+{
+    char buffer[4096];
+    ssize_t bytes;
+    while ((bytes = read(m_fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < bytes; ++i) {
+            if (buffer[i] == '\n') {
+                size_t length = m_lineLength;
+                if ((length > 0) && (m_line[length - 1] == '\r')) {
+                    --length;
+                }
+                HandleLine(m_line, length);
+                m_lineLength = 0;
+            } else if (m_lineLength < sizeof(m_line)) {
+                m_line[m_lineLength++] = buffer[i];
+            }
+        }
+    }
+    return (bytes == 0) || (errno == EAGAIN) || (errno == EINTR);
+}
+
+void CFocusReader::HandleLine(char const *line, size_t length)
+{
+    static char const LAYOUT_PREFIX[] = "layout ";
+    size_t prefixLength = sizeof(LAYOUT_PREFIX) - 1;
+    if (!m_layouts || (length <= prefixLength) || (memcmp(line, LAYOUT_PREFIX, prefixLength) != 0)) {
+        m_focus.SetApplication(line, length);
+        return;
+    }
+    char name[LAYOUT_NAME_LENGTH];
+    size_t nameLength = length - prefixLength;
+    if (nameLength >= sizeof(name)) {
+        return;
+    }
+    memcpy(name, line + prefixLength, nameLength);
+    name[nameLength] = '\0';
+    LayoutTable const *layout = m_layouts->Find(LayoutIdFromName(name));
+    if (layout) {
+        m_layouts->SetCurrent(layout);
+    }
+}
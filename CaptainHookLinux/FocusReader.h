@@ -0,0 +1,76 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include "AppFocus.h"
+#include "KeyboardLayout.h"
+#include <thread>
+
+/* Follows the focused application as something else reports it: a script that listens to
+   the desktop (there's no one way to ask across X11 and the Wayland compositors), or a
+   test. Application names are read one per line from a FIFO, on a thread of its own, and
+   each is handed to a CAppFocus; an empty line means no application in particular. The
+   FIFO is opened for writing as well as reading, so that it stays open as writers come
+   and go.
+
+   With a layout cache, a line "layout <name>" says the focused window's keyboard layout
+   is now the one of that name (see LayoutIdFromName()) rather than naming an
+   application. Layouts it doesn't have are ignored. The cache's layouts must all be added
+   before Start(). */
+class CFocusReader
+{
+public:
+    explicit CFocusReader(CAppFocus &focus);
+    ~CFocusReader();
+
+    void SetLayouts(CLayoutCache *layouts) { m_layouts = layouts; }
+
+    bool Start(char const *path);
+    void Stop();
+
+private:
+    CFocusReader(CFocusReader const &) = delete;
+    CFocusReader &operator=(CFocusReader const &) = delete;
+
+    void Run();
+    bool ReadNames();
+    void HandleLine(char const *line, size_t length);
+
+    CAppFocus &m_focus;
+    CLayoutCache *m_layouts;
+    int m_fd;
+    int m_stop[2];
+    std::thread m_thread;
+
+    // The line read so far. Names longer than an AppIdentity holds are cut short.
+    char m_line[APP_NAME_LENGTH];
+    size_t m_lineLength;
+};
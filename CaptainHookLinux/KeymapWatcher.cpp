@@ -0,0 +1,187 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "KeymapWatcher.h"
+#include "KeymapReloader.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+static char const STOP = 0;
+static char const RELOAD = 1;
+
+CKeymapWatcher::CKeymapWatcher(CKeymapReloader &reloader, CKeymapPublisher &publisher) :
+    m_reloader(reloader),
+    m_publisher(publisher),
+    m_inotify(-1),
+    m_name(nullptr)
+{
+    m_stop[0] = -1;
+    m_stop[1] = -1;
+    m_path[0] = '\0';
+}
+
+CKeymapWatcher::~CKeymapWatcher()
+{
+    Stop();
+}
+
+bool CKeymapWatcher::Start(char const *path)
+{
+    if (m_thread.joinable() || (strlen(path) >= sizeof(m_path))) {
+        return false;
+    }
+    strcpy(m_path, path);
+
+    char directory[sizeof(m_path)];
+    strcpy(directory, m_path);
+    char *slash = strrchr(directory, '/');
+    if (slash) {
+        *(slash == directory ? slash + 1 : slash) = '\0';
+        m_name = m_path + (slash - directory) + 1;
+    } else {
+        strcpy(directory, ".");
+        m_name = m_path;
+    }
+
+    m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ((m_inotify < 0) ||
+        (inotify_add_watch(m_inotify, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) ||
+        (pipe2(m_stop, O_CLOEXEC) < 0)) {
+        Stop();
+        return false;
+    }
+    m_thread = std::thread(&CKeymapWatcher::Run, this);
+    return true;
+}
+
+void CKeymapWatcher::Stop()
+{
+    if (m_thread.joinable()) {
+        while ((write(m_stop[1], &STOP, 1) < 0) && (errno == EINTR)) {
+        }
+        m_thread.join();
+    }
+    for (int fd : { m_inotify, m_stop[0], m_stop[1] }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    m_inotify = -1;
+    m_stop[0] = -1;
+    m_stop[1] = -1;
+}
+
+bool CKeymapWatcher::RequestReload()
+{
+    if (!m_thread.joinable()) {
+        return false;
+    }
+    ssize_t written;
+    while (((written = write(m_stop[1], &RELOAD, 1)) < 0) && (errno == EINTR)) {
+    }
+    return written == 1;
+}
+
+void CKeymapWatcher::Run()
+{
+    struct pollfd fds[2] = {
+        { m_stop[0], POLLIN, 0 },
+        { m_inotify, POLLIN, 0 },
+    };
+    bool changed = false;
+    for (;;) {
+        // Once the file has changed, wait for it to settle before reloading.
+        int ready = poll(fds, 2, changed ? SETTLE_TIME_MS : -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Keymap watcher");
+            return;
+        }
+        if (fds[0].revents) {
+            char request = STOP;
+            while ((read(m_stop[0], &request, 1) < 0) && (errno == EINTR)) {
+            }
+            if (request != RELOAD) {
+                return;
+            }
+            changed = false;
+            Reload();
+            continue;
+        }
+        if (ready == 0) {
+            changed = false;
+            Reload();
+        } else if (ReadChanges()) {
+            changed = true;
+        }
+    }
+}
+
+bool CKeymapWatcher::ReadChanges()
+{
+    bool changed = false;
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t bytes;
+    while ((bytes = read(m_inotify, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + bytes; ) {
+            struct inotify_event const *event = reinterpret_cast<struct inotify_event const *>(p);
+            if ((event->len > 0) && (strcmp(event->name, m_name) == 0)) {
+                changed = true;
+            }
+            p += sizeof(*event) + event->len;
+        }
+    }
+    return changed;
+}
+
+void CKeymapWatcher::Reload()
+{
+    KeymapError error;
+    if (m_reloader.Reload(&error)) {
+        fprintf(stderr, "%s: reloaded in %.2f ms\n", m_path, m_reloader.GetLastLoadDuration() / 1e6);
+    } else if (error.line) {
+        fprintf(stderr, "%s: line %u: %s. Keeping the current keymap.\n", m_path, error.line, error.message);
+    } else {
+        fprintf(stderr, "%s: %s. Keeping the current keymap.\n", m_path, error.message);
+    }
+
+    // The hook holds on to the old keymap for at most one batch of keys.
+    struct pollfd stop = { m_stop[0], POLLIN, 0 };
+    while ((m_publisher.Reclaim() > 0) && (poll(&stop, 1, 10) == 0)) {
+    }
+}
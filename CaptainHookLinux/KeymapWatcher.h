@@ -0,0 +1,74 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <thread>
+
+class CKeymapReloader;
+class CKeymapPublisher;
+
+/* Reloads the keymap whenever its file changes, on a thread of its own, using inotify
+   on the file's directory (editors often save by writing a new file and renaming it over
+   the old one). Problems are reported on stderr; a keymap that doesn't compile leaves
+   the current one in place. */
+class CKeymapWatcher
+{
+public:
+    /* Editors often save a file in several steps, so wait this long for it to stop
+       changing before reloading it. */
+    static int const SETTLE_TIME_MS = 200;
+
+    CKeymapWatcher(CKeymapReloader &reloader, CKeymapPublisher &publisher);
+    ~CKeymapWatcher();
+
+    bool Start(char const *path);
+    void Stop();
+
+    /* Reload the keymap now, on the watcher's thread, whether or not it has changed.
+       From any thread. Returns false if the watcher isn't running. */
+    bool RequestReload();
+
+private:
+    CKeymapWatcher(CKeymapWatcher const &) = delete;
+    CKeymapWatcher &operator=(CKeymapWatcher const &) = delete;
+
+    void Run();
+    bool ReadChanges();
+    void Reload();
+
+    CKeymapReloader &m_reloader;
+    CKeymapPublisher &m_publisher;
+    int m_inotify;
+    int m_stop[2];          // a byte of STOP or RELOAD wakes the thread
+    char m_path[256];
+    char const *m_name;
+    std::thread m_thread;
+};
@@ -0,0 +1,278 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "LinuxKeyboardHook.h"
+#include "EvdevKeys.h"
+#include "VirtualKeys.h"
+#include <time.h>
+
+CLinuxKeyboardHook::CLinuxKeyboardHook(CKeyEngine &engine, CUinputOutput &output) :
+    m_engine(engine),
+    m_output(output),
+    m_actionHandler(nullptr),
+    m_actionContext(nullptr),
+    m_statistics(nullptr),
+    m_watchdog(nullptr),
+    m_reportDx(0),
+    m_reportDy(0),
+    m_reportTime(0)
+{
+    for (int axis = 0; axis < 2; ++axis) {
+        m_wheelSwallowed[axis] = false;
+        m_hiResHeld[axis] = false;
+        m_hiRes[axis] = 0;
+    }
+}
+
+void CLinuxKeyboardHook::SetActionHandler(ActionHandler handler, void *context)
+{
+    m_actionHandler = handler;
+    m_actionContext = context;
+}
+
+void CLinuxKeyboardHook::OnInputEvents(struct input_event const *events, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        struct input_event const &event = events[i];
+        if (event.type == EV_REL) {
+            OnRelative(event, GetEventTime(event));
+            continue;
+        }
+        // The batch's own SYN_REPORTs (and scan code reports) are replaced by the one
+        // the output adds when it's flushed.
+        if (event.type != EV_KEY) {
+            if ((event.type == EV_SYN) && (event.code == SYN_REPORT)) {
+                EndReport();
+            }
+            continue;
+        }
+
+        bool extended;
+        uint8_t keycode = VirtualKeyFromEvdev(event.code, &extended);
+        if (!keycode) {
+            m_output.Emit(EV_KEY, event.code, event.value);
+            continue;
+        }
+
+        KeyEvent input;
+        input.time = GetEventTime(event);
+        input.action = KEYMAP_ACTION_NONE;
+        input.keycode = keycode;
+        input.flags = 0;
+        if (event.value != 0) {
+            input.flags |= KeyEvent::FLAG_DOWN;
+        }
+        if (extended) {
+            input.flags |= KeyEvent::FLAG_EXTENDED;
+        }
+        // As Windows does with WM_SYSKEYDOWN/UP: keys while Alt is held are system keys.
+        if (m_engine.GetKeyState().GetModifiers() & KEYMOD_ALT) {
+            input.flags |= KeyEvent::FLAG_SYSTEM;
+        }
+
+        bool timed = m_statistics || m_watchdog;
+        uint64_t start = timed ? LatencyClockNow() : 0;
+        unsigned result = IsMouseButton(keycode) ? m_engine.ProcessButton(input) : m_engine.ProcessKey(input);
+        if (!(result & CKeyEngine::RESULT_CONSUME)) {
+            m_output.Emit(EV_KEY, event.code, event.value);
+        }
+        EndCallback(input.time, start, result);
+    }
+    // A batch can stop partway through a report; don't hold its wheel past the batch.
+    EndReport();
+    m_output.Flush();
+}
+
+void CLinuxKeyboardHook::OnRelative(struct input_event const &event, uint32_t time)
+{
+    switch (event.code) {
+    case REL_X:
+    case REL_Y:
+        // Movement is never held back. It's only summed here for the batch.
+        if (event.code == REL_X) {
+            m_reportDx += event.value;
+        } else {
+            m_reportDy += event.value;
+        }
+        m_reportTime = time;
+        m_output.Emit(EV_REL, event.code, event.value);
+        break;
+
+    case REL_WHEEL:
+    case REL_HWHEEL: {
+        // REL_WHEEL counts up away from the user, REL_HWHEEL to the right.
+        int axis = (event.code == REL_WHEEL) ? 0 : 1;
+        uint8_t keycode;
+        if (axis == 0) {
+            keycode = (event.value > 0) ? VKEY_WHEEL_UP : VKEY_WHEEL_DOWN;
+        } else {
+            keycode = (event.value > 0) ? VKEY_WHEEL_RIGHT : VKEY_WHEEL_LEFT;
+        }
+        bool timed = m_statistics || m_watchdog;
+        uint64_t start = timed ? LatencyClockNow() : 0;
+        unsigned result = 0;
+        int32_t notches = (event.value < 0) ? -event.value : event.value;
+        for (int32_t notch = 0; notch < notches; ++notch) {
+            result |= m_engine.ProcessTap(keycode, time);
+        }
+        if (result & CKeyEngine::RESULT_CONSUME) {
+            m_wheelSwallowed[axis] = true;
+        } else {
+            m_output.Emit(EV_REL, event.code, event.value);
+        }
+        EndCallback(time, start, result);
+        break;
+    }
+
+    case REL_WHEEL_HI_RES:
+    case REL_HWHEEL_HI_RES: {
+        // These can come before or after the notch they shadow, so they wait for the end
+        // of the report to see whether it was swallowed.
+        int axis = (event.code == REL_WHEEL_HI_RES) ? 0 : 1;
+        m_hiResHeld[axis] = true;
+        m_hiRes[axis] += event.value;
+        break;
+    }
+
+    default:
+        m_output.Emit(EV_REL, event.code, event.value);
+        break;
+    }
+}
+
+void CLinuxKeyboardHook::EndReport()
+{
+    static uint16_t const HI_RES_CODES[2] = { REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES };
+    for (int axis = 0; axis < 2; ++axis) {
+        if (m_hiResHeld[axis] && !m_wheelSwallowed[axis]) {
+            m_output.Emit(EV_REL, HI_RES_CODES[axis], m_hiRes[axis]);
+        }
+        m_wheelSwallowed[axis] = false;
+        m_hiResHeld[axis] = false;
+        m_hiRes[axis] = 0;
+    }
+    if (m_reportDx || m_reportDy) {
+        m_motion.Add(m_reportDx, m_reportDy, m_reportTime);
+        m_reportDx = 0;
+        m_reportDy = 0;
+    }
+}
+
+void CLinuxKeyboardHook::FlushMotion()
+{
+    MotionFrame frame;
+    uint8_t flick = m_motion.Flush(frame);
+    if (flick && (m_engine.ProcessTap(flick, frame.end) & CKeyEngine::RESULT_WAKE)) {
+        ProcessKeyEvents();
+    }
+    m_output.Flush();
+}
+
+void CLinuxKeyboardHook::EndCallback(uint32_t time, uint64_t start, unsigned result)
+{
+    if (m_statistics || m_watchdog) {
+        uint64_t elapsed = LatencyClockToNanoseconds(LatencyClockNow() - start);
+        if (m_statistics) {
+            m_statistics->CountKey((result & CKeyEngine::RESULT_CONSUME) != 0);
+            m_statistics->GetLatency(LATENCY_HOOK).Record(elapsed);
+        }
+        if (m_watchdog) {
+            m_watchdog->RecordCallback(GetTime(), time, elapsed);
+        }
+    }
+    if (result & CKeyEngine::RESULT_WAKE) {
+        ProcessKeyEvents();
+    }
+}
+
+void CLinuxKeyboardHook::ProcessTimeout(uint32_t now)
+{
+    if (m_engine.ProcessTimeout(now) & CKeyEngine::RESULT_WAKE) {
+        ProcessKeyEvents();
+    }
+    m_output.Flush();
+}
+
+uint32_t CLinuxKeyboardHook::GetEventTime(struct input_event const &event)
+{
+    // Devices stamp events with CLOCK_MONOTONIC. A fake device may leave the time out
+    // (zero), in which case the event happens when it arrives.
+    if ((event.time.tv_sec == 0) && (event.time.tv_usec == 0)) {
+        return static_cast<uint32_t>(GetTime());
+    }
+    return static_cast<uint32_t>(event.time.tv_sec * 1000 + event.time.tv_usec / 1000);
+}
+
+uint64_t CLinuxKeyboardHook::GetTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + static_cast<uint64_t>(now.tv_nsec) / 1000000;
+}
+
+void CLinuxKeyboardHook::ProcessKeyEvents()
+{
+    // Re-injected keys don't come back through a grabbed keyboard the way SendInput()
+    // keys come back through the Windows hook, so they're handed straight back to the
+    // engine here. That can queue more events (their actions), which this same loop
+    // picks up; if it asks for another wakeup, go round again rather than wait for one.
+    bool wake;
+    do {
+        m_engine.BeginDrain();
+        wake = false;
+        KeyEvent event;
+        while (m_engine.PopEvent(event)) {
+            if (event.flags & KeyEvent::FLAG_REPLAY) {
+                KeyEvent replay = event;
+                replay.flags |= KeyEvent::FLAG_INJECTED;
+                unsigned result = m_engine.ProcessKey(replay);
+                if (!(result & CKeyEngine::RESULT_CONSUME)) {
+                    EmitKey(event);
+                }
+                wake = wake || ((result & CKeyEngine::RESULT_WAKE) != 0);
+            } else if (m_actionHandler) {
+                uint64_t start = m_statistics ? LatencyClockNow() : 0;
+                m_actionHandler(m_actionContext, event);
+                if (m_statistics) {
+                    m_statistics->GetLatency(LATENCY_DISPATCH).RecordTicks(start);
+                }
+            }
+        }
+    } while (wake);
+}
+
+void CLinuxKeyboardHook::EmitKey(KeyEvent const &event)
+{
+    uint16_t code = EvdevFromVirtualKey(event.keycode, (event.flags & KeyEvent::FLAG_EXTENDED) != 0);
+    if (code) {
+        m_output.Emit(EV_KEY, code, (event.flags & KeyEvent::FLAG_DOWN) ? 1 : 0);
+    }
+}
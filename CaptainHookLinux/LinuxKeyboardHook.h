@@ -0,0 +1,109 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stdint.h>
+#include "EvdevInput.h"
+#include "HookStatistics.h"
+#include "HookWatchdog.h"
+#include "KeyEngine.h"
+#include "MotionBatcher.h"
+#include "UinputOutput.h"
+
+/* The Linux counterpart of the Windows LowLevelKeyboardProc: feeds every key from the
+   grabbed keyboards through the same CKeyEngine and passes on whatever it doesn't
+   swallow. Keys are translated to virtual key codes on the way in and back on the way
+   out. Everything, including the actions, runs on the daemon's one thread, so the
+   engine's queue is drained straight after each key that queues something.
+
+   Mouse buttons go through the engine the same way. Each wheel notch is put through it as
+   a tap of VKEY_WHEEL_UP, _DOWN, _LEFT or _RIGHT, and the wheel report is swallowed if a
+   notch is (along with the high-resolution wheel report that shadows it). Movement is
+   passed on as it comes, summed per SYN_REPORT and batched in a CMotionBatcher; call
+   FlushMotion() a frame after the batch starts. */
+class CLinuxKeyboardHook : public IEvdevHandler
+{
+public:
+    typedef void (*ActionHandler)(void *context, KeyEvent const &event);
+
+    CLinuxKeyboardHook(CKeyEngine &engine, CUinputOutput &output);
+
+    void SetActionHandler(ActionHandler handler, void *context);
+
+    /* If set, keys are counted and timed into these statistics. LATENCY_HOOK covers the
+       engine's decision and passing the key on; LATENCY_DISPATCH each action handler call. */
+    void SetStatistics(CHookStatistics *statistics) { m_statistics = statistics; }
+
+    /* If set, every key is checked against the watchdog's budget, counting the time from
+       its timestamp (so a backlog behind a slow action counts too). There's no hook for
+       the system to take away here, so only its shedding applies. */
+    void SetWatchdog(CHookWatchdog *watchdog) { m_watchdog = watchdog; }
+
+    virtual void OnInputEvents(struct input_event const *events, size_t count);
+
+    /* Call when the engine's sequence deadline passes. */
+    void ProcessTimeout(uint32_t now);
+
+    /* Call CMotionBatcher::FRAME_INTERVAL ms after movement starts a batch, while
+       IsMotionPending(). Puts a flick the frame completes through the engine as a tap. */
+    void FlushMotion();
+    bool IsMotionPending() const { return m_motion.IsPending(); }
+    CMotionBatcher const &GetMotion() const { return m_motion; }
+
+    /* Milliseconds on the clock that key events are stamped with (CLOCK_MONOTONIC). */
+    static uint64_t GetTime();
+
+private:
+    void OnRelative(struct input_event const &event, uint32_t time);
+    void EndReport();
+    void EndCallback(uint32_t time, uint64_t start, unsigned result);
+    void ProcessKeyEvents();
+    void EmitKey(KeyEvent const &event);
+    static uint32_t GetEventTime(struct input_event const &event);
+
+    CKeyEngine &m_engine;
+    CUinputOutput &m_output;
+    ActionHandler m_actionHandler;
+    void *m_actionContext;
+    CHookStatistics *m_statistics;
+    CHookWatchdog *m_watchdog;
+
+    // The mouse report being read: movement so far, and the wheel axes (0 vertical,
+    // 1 horizontal) whose notches were swallowed or whose high-resolution reports wait
+    // on that.
+    CMotionBatcher m_motion;
+    int32_t m_reportDx;
+    int32_t m_reportDy;
+    uint32_t m_reportTime;
+    bool m_wheelSwallowed[2];
+    bool m_hiResHeld[2];
+    int32_t m_hiRes[2];
+};
@@ -0,0 +1,158 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "UinputOutput.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+CUinputOutput::CUinputOutput() :
+    m_fd(-1),
+    m_isDevice(false),
+    m_count(0),
+    m_writtenCount(0),
+    m_failedCount(0)
+{
+}
+
+CUinputOutput::~CUinputOutput()
+{
+    Close();
+}
+
+bool CUinputOutput::Open(char const *name, bool pointer)
+{
+    Close();
+    int fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    // Key events only. No EV_REP: autorepeats are passed on as the keyboard sends them,
+    // and the kernel mustn't generate a second set.
+    bool ok = (ioctl(fd, UI_SET_EVBIT, EV_KEY) == 0) && (ioctl(fd, UI_SET_EVBIT, EV_SYN) == 0);
+    for (int code = 1; ok && (code < 256); ++code) {
+        ok = (ioctl(fd, UI_SET_KEYBIT, code) == 0);
+    }
+    if (pointer) {
+        static int const axes[] = { REL_X, REL_Y, REL_HWHEEL, REL_WHEEL, REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES };
+        ok = ok && (ioctl(fd, UI_SET_EVBIT, EV_REL) == 0);
+        for (size_t i = 0; ok && (i < sizeof(axes) / sizeof(axes[0])); ++i) {
+            ok = (ioctl(fd, UI_SET_RELBIT, axes[i]) == 0);
+        }
+        for (int code = BTN_LEFT; ok && (code <= BTN_TASK); ++code) {
+            ok = (ioctl(fd, UI_SET_KEYBIT, code) == 0);
+        }
+    }
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    snprintf(setup.name, sizeof(setup.name), "%s", name);
+    ok = ok && (ioctl(fd, UI_DEV_SETUP, &setup) == 0) && (ioctl(fd, UI_DEV_CREATE) == 0);
+    if (!ok) {
+        close(fd);
+        return false;
+    }
+    m_fd = fd;
+    m_isDevice = true;
+    return true;
+}
+
+bool CUinputOutput::Attach(int fd)
+{
+    Close();
+    m_fd = fd;
+    return fd >= 0;
+}
+
+void CUinputOutput::Close()
+{
+    if (m_fd < 0) {
+        return;
+    }
+    Flush();
+    if (m_isDevice) {
+        ioctl(m_fd, UI_DEV_DESTROY);
+    }
+    close(m_fd);
+    m_fd = -1;
+    m_isDevice = false;
+}
+
+void CUinputOutput::Emit(uint16_t type, uint16_t code, int32_t value)
+{
+    // Leave room for the SYN_REPORT that ends the batch.
+    if (m_count >= BUFFER_EVENTS - 1) {
+        Flush();
+    }
+    struct input_event &event = m_buffer[m_count++];
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.code = code;
+    event.value = value;
+}
+
+bool CUinputOutput::Flush()
+{
+    if (m_count == 0) {
+        return true;
+    }
+    // Emit() always leaves room for this.
+    struct input_event &sync = m_buffer[m_count++];
+    memset(&sync, 0, sizeof(sync));
+    sync.type = EV_SYN;
+    sync.code = SYN_REPORT;
+
+    // The kernel timestamps uinput events itself, so they go out with zero times.
+    size_t count = m_count;
+    m_count = 0;
+    size_t bytes = count * sizeof(struct input_event);
+    size_t written = 0;
+    while (written < bytes) {
+        ssize_t result = write(m_fd, reinterpret_cast<char *>(m_buffer) + written, bytes - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            m_failedCount += (bytes - written) / sizeof(struct input_event);
+            m_writtenCount += written / sizeof(struct input_event);
+            return false;
+        }
+        written += static_cast<size_t>(result);
+    }
+    m_writtenCount += count;
+    return true;
+}
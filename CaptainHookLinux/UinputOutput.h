@@ -0,0 +1,85 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+// The high-resolution wheel axes came with Linux 5.0.
+#ifndef REL_WHEEL_HI_RES
+#define REL_WHEEL_HI_RES 0x0b
+#define REL_HWHEEL_HI_RES 0x0c
+#endif
+
+/* A virtual keyboard, created through /dev/uinput, that passes on the keys the daemon
+   doesn't swallow (the physical keyboards are grabbed, so nothing else sees them).
+   Events are buffered and written with one write() per Flush(), which ends the batch
+   with a SYN_REPORT.
+
+   For running without /dev/uinput, Attach() a file descriptor instead (e.g. a pipe); it
+   receives exactly the input_event records that would have gone to the device. */
+class CUinputOutput
+{
+public:
+    /* Room for a whole batch of macro output (see CUinputSink) in one write. */
+    static size_t const BUFFER_EVENTS = 2048;
+
+    CUinputOutput();
+    ~CUinputOutput();
+
+    /* Create the virtual keyboard. With pointer, it's a mouse too, for passing on the
+       movement, buttons and wheel of grabbed mice. */
+    bool Open(char const *name, bool pointer = false);
+
+    /* Write to fd instead. Takes ownership of it. */
+    bool Attach(int fd);
+
+    void Close();
+
+    void Emit(uint16_t type, uint16_t code, int32_t value);
+    bool Flush();
+
+    /* Records emitted but not yet flushed. */
+    size_t GetPendingCount() const { return m_count; }
+
+    /* Records written, and records lost to failed writes. */
+    uint64_t GetWrittenCount() const { return m_writtenCount; }
+    uint64_t GetFailedCount() const { return m_failedCount; }
+
+private:
+    int m_fd;
+    bool m_isDevice;
+    struct input_event m_buffer[BUFFER_EVENTS];
+    size_t m_count;
+    uint64_t m_writtenCount;
+    uint64_t m_failedCount;
+};
@@ -0,0 +1,56 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "UinputSink.h"
+#include "EvdevKeys.h"
+
+CUinputSink::CUinputSink(CUinputOutput &output) :
+    m_output(output)
+{
+}
+
+size_t CUinputSink::SendKeys(KeyEvent const *keys, size_t count)
+{
+    // Keys the hook has passed on but not yet flushed go out first, in their own report.
+    bool sync = m_output.GetPendingCount() > 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint16_t code = EvdevFromVirtualKey(keys[i].keycode, (keys[i].flags & KeyEvent::FLAG_EXTENDED) != 0);
+        if (!code) {
+            continue;
+        }
+        if (sync) {
+            m_output.Emit(EV_SYN, SYN_REPORT, 0);
+        }
+        m_output.Emit(EV_KEY, code, (keys[i].flags & KeyEvent::FLAG_DOWN) ? 1 : 0);
+        sync = true;
+    }
+    return m_output.Flush() ? count : 0;
+}
@@ -0,0 +1,247 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Reads the running app's statistics from its control plane (see ControlPlane.h) and
+   sends it commands. Built by the CMake build as captainhook-ctl; it talks to whichever
+   app (the Windows tray app or the Linux daemon) this user is running.
+
+       captainhook-ctl [status]        the statistics, once
+       captainhook-ctl watch [MS]      the statistics every MS ms (default 1000)
+       captainhook-ctl wakeups [S]     how often the app wakes up, over S s (default 10)
+       captainhook-ctl pause|resume    stop or start acting on keys
+       captainhook-ctl reload          reload the keymap file
+
+   Each read and command wakes the app (see CControlClient::Wake()), which may otherwise
+   have stopped publishing to save waking up. wakeups leaves out the one wakeup of its own
+   that falls in what it measures, so an idle app in its tickless mode reports none.
+
+   Commands wait until the app has acted on them. The exit status is 0 on success, 1 if
+   the app isn't running or didn't respond and 2 for a bad command line. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include "ControlPlane.h"
+
+// How long to wait for the app to publish before taking it not to be running.
+static unsigned const RESPONSE_TIMEOUT = 20 * CONTROL_INTERVAL;
+
+static void Usage(char const *program);
+static bool WaitForPublish(CControlClient &client, ControlStats &stats, uint64_t after);
+static bool WaitForCommand(CControlClient &client, uint32_t ticket, ControlStats &stats);
+static void PrintStats(CControlClient const &client, ControlStats const &stats);
+static int MeasureWakeups(CControlClient &client, unsigned long seconds);
+
+int main(int argc, char *argv[])
+{
+    char const *command = (argc > 1) ? argv[1] : "status";
+    unsigned control = CONTROL_NONE;
+    unsigned long interval = 1000;
+    bool wakeups = (strcmp(command, "wakeups") == 0);
+    if (wakeups) {
+        interval = 10;
+    }
+    if (strcmp(command, "pause") == 0) {
+        control = CONTROL_PAUSE;
+    } else if (strcmp(command, "resume") == 0) {
+        control = CONTROL_RESUME;
+    } else if (strcmp(command, "reload") == 0) {
+        control = CONTROL_RELOAD;
+    } else if (((strcmp(command, "watch") == 0) || wakeups) && (argc == 3)) {
+        char *end;
+        interval = strtoul(argv[2], &end, 10);
+        if ((*end != '\0') || (interval == 0)) {
+            Usage(argv[0]);
+            return 2;
+        }
+    } else if ((strcmp(command, "status") != 0) && (strcmp(command, "watch") != 0) && !wakeups) {
+        Usage(argv[0]);
+        return (strcmp(command, "-h") == 0) ? 0 : 2;
+    }
+    if (argc > (((strcmp(command, "watch") == 0) || wakeups) ? 3 : 2)) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    char name[64];
+    GetControlPlaneName(name, sizeof(name));
+    CControlClient client;
+    if (!client.Open(name)) {
+        fprintf(stderr, "Captain Hook isn't running (no %s)\n", name);
+        return 1;
+    }
+
+    ControlStats stats;
+    if (control != CONTROL_NONE) {
+        uint32_t ticket;
+        if (!client.Post(control, ticket)) {
+            fprintf(stderr, "Captain Hook isn't taking commands\n");
+            return 1;
+        }
+        client.Wake();
+        if (!WaitForCommand(client, ticket, stats)) {
+            fprintf(stderr, "Captain Hook didn't respond\n");
+            return 1;
+        }
+        printf("%s\n", stats.paused ? "Paused" : "Running");
+        return 0;
+    }
+
+    if (wakeups) {
+        return MeasureWakeups(client, interval);
+    }
+
+    // A segment left behind by an app that crashed never changes, so wait for a publish.
+    bool read = client.Read(stats);
+    client.Wake();
+    if (!read || !WaitForPublish(client, stats, stats.publishCount)) {
+        fprintf(stderr, "Captain Hook isn't responding\n");
+        return 1;
+    }
+    PrintStats(client, stats);
+    if (strcmp(command, "watch") == 0) {
+        for (;;) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+            client.Wake();
+            if (!WaitForPublish(client, stats, stats.publishCount)) {
+                fprintf(stderr, "Captain Hook isn't responding\n");
+                return 1;
+            }
+            printf("\n");
+            PrintStats(client, stats);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+static void Usage(char const *program)
+{
+    fprintf(stderr,
+        "Usage: %s [status | watch [MS] | wakeups [S] | pause | resume | reload]\n"
+        "  status    print the running app's statistics (the default)\n"
+        "  watch     print them every MS ms (default 1000)\n"
+        "  wakeups   measure how often the app wakes up, over S s (default 10)\n"
+        "  pause     pass every key through untouched until resumed\n"
+        "  resume    start acting on keys again\n"
+        "  reload    reload the keymap file\n",
+        program);
+}
+
+static bool WaitForPublish(CControlClient &client, ControlStats &stats, uint64_t after)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RESPONSE_TIMEOUT);
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (client.Read(stats) && (stats.publishCount != after)) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+static bool WaitForCommand(CControlClient &client, uint32_t ticket, ControlStats &stats)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RESPONSE_TIMEOUT);
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (client.Read(stats) && (static_cast<int32_t>(static_cast<uint32_t>(stats.commandsDone) - ticket) >= 0)) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+static void PrintStats(CControlClient const &client, ControlStats const &stats)
+{
+    printf("Captain Hook (process %llu): %s, application \"%s\"\n",
+        static_cast<unsigned long long>(client.GetProcessId()), stats.paused ? "paused" : "running",
+        stats.application);
+    printf("Keys passed %llu, swallowed %llu, dropped %llu, debounced %llu\n",
+        static_cast<unsigned long long>(stats.passed), static_cast<unsigned long long>(stats.swallowed),
+        static_cast<unsigned long long>(stats.dropped), static_cast<unsigned long long>(stats.debounced));
+    printf("Sequences %llu, abbreviations %llu, profile switches %llu, keymap changes %llu\n",
+        static_cast<unsigned long long>(stats.sequences), static_cast<unsigned long long>(stats.expansions),
+        static_cast<unsigned long long>(stats.profileSwitches), static_cast<unsigned long long>(stats.keymapChanges));
+    printf("Tap-hold keys tapped %llu, held %llu; keys held back %llu, %.1f ms on average, %llu ms at most\n",
+        static_cast<unsigned long long>(stats.taps), static_cast<unsigned long long>(stats.holds),
+        static_cast<unsigned long long>(stats.heldBack),
+        stats.heldBack ? static_cast<double>(stats.heldBackTotal) / static_cast<double>(stats.heldBack) : 0.0,
+        static_cast<unsigned long long>(stats.heldBackMax));
+    printf("Near budget %llu, over %llu, hook lost %llu\n",
+        static_cast<unsigned long long>(stats.nearBudget), static_cast<unsigned long long>(stats.overBudget),
+        static_cast<unsigned long long>(stats.hookLost));
+    printf("Wakeups %llu\n", static_cast<unsigned long long>(stats.wakeups));
+    printf("Hook in place %.1f ms after starting (%.2f ms putting it in); memory %llu KB resident, %llu KB private\n",
+        static_cast<double>(stats.startup) / 1e6, static_cast<double>(stats.hookTime) / 1e6,
+        static_cast<unsigned long long>(stats.resident / 1024),
+        static_cast<unsigned long long>(stats.privateBytes / 1024));
+    printf("%-10s %10s %10s %10s %10s %10s\n", "(ns)", "count", "p50", "p99", "p99.9", "max");
+    for (unsigned i = 0; i < LATENCY_COUNT; ++i) {
+        ControlLatency const &latency = stats.latencies[i];
+        printf("%-10s %10llu %10llu %10llu %10llu %10llu\n", CHookStatistics::GetLatencyName(i),
+            static_cast<unsigned long long>(latency.count), static_cast<unsigned long long>(latency.p50),
+            static_cast<unsigned long long>(latency.p99), static_cast<unsigned long long>(latency.p999),
+            static_cast<unsigned long long>(latency.max));
+    }
+}
+
+static int MeasureWakeups(CControlClient &client, unsigned long seconds)
+{
+    ControlStats before;
+    ControlStats after;
+    bool read = client.Read(before);
+    client.Wake();
+    if (!read || !WaitForPublish(client, before, before.publishCount)) {
+        fprintf(stderr, "Captain Hook isn't responding\n");
+        return 1;
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    bool woken = client.Wake();
+    if (!WaitForPublish(client, after, before.publishCount)) {
+        fprintf(stderr, "Captain Hook isn't responding\n");
+        return 1;
+    }
+
+    // One of the two wakes asked for here lands between the reads (which one depends on
+    // whether the app counts a wakeup before or after publishing for it).
+    double elapsed = static_cast<double>(after.time - before.time) / 1000.0;
+    uint64_t wakeups = after.wakeups - before.wakeups;
+    if (woken && (wakeups > 0)) {
+        --wakeups;
+    }
+    uint64_t keys = (after.passed + after.swallowed) - (before.passed + before.swallowed);
+    printf("%llu wakeups in %.1f s: %.2f a second (and %.2f keys a second)\n",
+        static_cast<unsigned long long>(wakeups), elapsed, (elapsed > 0) ? wakeups / elapsed : 0.0,
+        (elapsed > 0) ? keys / elapsed : 0.0);
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* An example handler plugin (see CaptainHookLL/CaptainHookPlugin.h), in plain C. It
+   counts the key events it sees, and consumes keys bound to press=plugin in the range
+   F13 to F24, printing them on stderr, which is where the Linux daemon's output goes.
+   Built by the CMake build as a shared library; load it into the daemon with
+   --plugin, or on Windows put it in the Plugins directory beside CaptainHookLL.exe. */
+#include <stdio.h>
+#include <stdlib.h>
+#include "CaptainHookPlugin.h"
+
+#define VKEY_F13 0x7C
+#define VKEY_F24 0x87
+
+typedef struct ExampleState
+{
+    unsigned long events;
+    unsigned long consumed;
+} ExampleState;
+
+static int HandleEvent(void *context, CaptainHookEvent const *event)
+{
+    ExampleState *state = (ExampleState *)context;
+    ++state->events;
+    if ((event->action != CAPTAINHOOK_ACTION_PLUGIN) || (event->keycode < VKEY_F13) || (event->keycode > VKEY_F24)) {
+        return 0;
+    }
+    ++state->consumed;
+    fprintf(stderr, "example plugin: F%d %s\n", event->keycode - VKEY_F13 + 13,
+        (event->flags & CAPTAINHOOK_EVENT_DOWN) ? "pressed" : "released");
+    return 1;
+}
+
+static void Unload(void *context)
+{
+    ExampleState *state = (ExampleState *)context;
+    fprintf(stderr, "example plugin: %lu events, %lu consumed\n", state->events, state->consumed);
+    free(state);
+}
+
+CAPTAINHOOK_PLUGIN_EXPORT CaptainHookPlugin const *CaptainHookPluginInit(uint32_t abiVersion)
+{
+    static CaptainHookPlugin plugin;
+    unsigned keycode;
+    if (abiVersion < CAPTAINHOOK_PLUGIN_ABI_VERSION) {
+        return NULL;
+    }
+    plugin.size = sizeof(plugin);
+    plugin.abiVersion = CAPTAINHOOK_PLUGIN_ABI_VERSION;
+    plugin.name = "example";
+    /* Ahead of the app, to see every event whether the app acts on it or not. */
+    plugin.priority = CAPTAINHOOK_PRIORITY_APP + 10;
+    for (keycode = 0; keycode < 256; ++keycode) {
+        CaptainHookPluginSetInterest(&plugin, (uint8_t)keycode);
+    }
+    plugin.context = calloc(1, sizeof(ExampleState));
+    plugin.handleEvent = HandleEvent;
+    plugin.unload = Unload;
+    return plugin.context ? &plugin : NULL;
+}
@@ -0,0 +1,155 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+/* Runs scenario scripts (see SimulationScript.h) through the app on a virtual clock, and
+   reports every expectation that fails. Built by the CMake build as captainhook-sim, on
+   any system: nothing here needs a keyboard, a display or real time to pass.
+
+       captainhook-sim [-v] [-n COUNT] SCRIPT...
+
+   -v prints everything that left the app, with its virtual time, after each script. -n
+   runs each script COUNT times over (on a fresh simulator each time), for timing the
+   simulation. The exit status is 0 if every
+   expectation held, 1 if any failed and 2 if a script couldn't be run. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include "SimulationScript.h"
+#include "Simulator.h"
+
+static void Usage(char const *program);
+static bool ReadScript(char const *path, std::string &text);
+
+int main(int argc, char *argv[])
+{
+    bool verbose = false;
+    unsigned long count = 1;
+    int first = 1;
+    for (; first < argc; ++first) {
+        char const *arg = argv[first];
+        if (strcmp(arg, "-v") == 0) {
+            verbose = true;
+        } else if ((strcmp(arg, "-n") == 0) && (first + 1 < argc)) {
+            char *end;
+            count = strtoul(argv[++first], &end, 10);
+            if ((*end != '\0') || (count == 0)) {
+                Usage(argv[0]);
+                return 2;
+            }
+        } else if (strcmp(arg, "--") == 0) {
+            ++first;
+            break;
+        } else if (arg[0] == '-') {
+            Usage(argv[0]);
+            return (strcmp(arg, "-h") == 0) ? 0 : 2;
+        } else {
+            break;
+        }
+    }
+    if (first == argc) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    int status = 0;
+    for (int i = first; i < argc; ++i) {
+        char const *path = argv[i];
+        std::string text;
+        if (!ReadScript(path, text)) {
+            fprintf(stderr, "%s: can't read the script\n", path);
+            status = 2;
+            continue;
+        }
+
+        unsigned checks = 0;
+        unsigned failures = 0;
+        uint64_t keys = 0;
+        uint64_t simulated = 0;
+        bool ran = true;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned long run = 0; ran && (run < count); ++run) {
+            CSimulator simulator;
+            SimulationResult result;
+            // Report failures from the first run only; the rest would say the same.
+            ran = RunSimulationScript(path, text.data(), text.size(), simulator,
+                (run == 0) ? stderr : nullptr, result);
+            checks += result.checks;
+            failures += result.failures;
+            keys += simulator.GetKeyCount();
+            simulated += result.endTime;
+            if (verbose && (run == 0)) {
+                PrintSimulationRecords(simulator, stdout);
+            }
+        }
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (!ran) {
+            status = 2;
+            continue;
+        }
+        if (failures) {
+            status = 1;
+        }
+        printf("%s: %u of %u checks passed; %llu keys, %.3f s simulated in %.3f s (%.0fx real time)\n",
+            path, checks - failures, checks, static_cast<unsigned long long>(keys),
+            simulated / 1000.0, wall, (wall > 0.0) ? simulated / 1000.0 / wall : 0.0);
+    }
+    return status;
+}
+
+static void Usage(char const *program)
+{
+    fprintf(stderr,
+        "Usage: %s [options] SCRIPT...\n"
+        "  -v        print what left the app, with its virtual time, after each script\n"
+        "  -n COUNT  run each script COUNT times over\n",
+        program);
+}
+
+static bool ReadScript(char const *path, std::string &text)
+{
+    FILE *file = (strcmp(path, "-") == 0) ? stdin : fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    char buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, length);
+    }
+    bool ok = !ferror(file);
+    if (file != stdin) {
+        fclose(file);
+    }
+    return ok;
+}
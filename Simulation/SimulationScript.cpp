@@ -0,0 +1,458 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "SimulationScript.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "AppActions.h"
+
+namespace {
+
+char const *const g_iconNames[ICON_COUNT] = {
+    "hook",
+    "fish",
+    "bait",
+};
+
+struct Token
+{
+    char const *text;
+    size_t length;
+
+    bool Is(char const *word) const { return (strlen(word) == length) && (memcmp(text, word, length) == 0); }
+};
+
+void Tokenize(char const *line, size_t length, std::vector<Token> &tokens)
+{
+    tokens.clear();
+    size_t i = 0;
+    while (i < length) {
+        while ((i < length) && ((line[i] == ' ') || (line[i] == '\t'))) {
+            ++i;
+        }
+        if ((i == length) || (line[i] == '#')) {
+            break;
+        }
+        Token token;
+        token.text = line + i;
+        while ((i < length) && (line[i] != ' ') && (line[i] != '\t')) {
+            ++i;
+        }
+        token.length = static_cast<size_t>(line + i - token.text);
+        tokens.push_back(token);
+    }
+}
+
+bool ParseNumber(char const *text, size_t length, uint64_t &value)
+{
+    if ((length == 0) || (length > 18)) {
+        return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if ((text[i] < '0') || (text[i] > '9')) {
+            return false;
+        }
+        value = value * 10 + static_cast<uint64_t>(text[i] - '0');
+    }
+    return true;
+}
+
+bool ParseDecimal(Token const &token, double &value)
+{
+    std::string text(token.text, token.length);
+    char *end;
+    value = strtod(text.c_str(), &end);
+    return (end != text.c_str()) && (*end == '\0');
+}
+
+char const *ActionName(uint16_t action, char *buffer, size_t size)
+{
+    for (size_t i = 0; i < g_actionNameCount; ++i) {
+        if (g_actionNames[i].action == action) {
+            return g_actionNames[i].name;
+        }
+    }
+    snprintf(buffer, size, "%u", action);
+    return buffer;
+}
+
+bool IsKeyRecord(CSimulator::Record const &record)
+{
+    return (record.type == CSimulator::RECORD_PASSED) ||
+        (record.type == CSimulator::RECORD_REPLAYED) ||
+        (record.type == CSimulator::RECORD_TYPED);
+}
+
+void AppendKey(std::string &text, bool down, uint8_t keycode)
+{
+    char buffer[8];
+    snprintf(buffer, sizeof(buffer), " %c0x%02X", down ? '+' : '-', keycode);
+    text += buffer;
+}
+
+/* One script being run, line by line. */
+class CScriptRunner
+{
+public:
+    CScriptRunner(char const *name, CSimulator &simulator, FILE *report, SimulationResult &result) :
+        m_name(name),
+        m_simulator(simulator),
+        m_report(report),
+        m_result(result),
+        m_line(0),
+        m_time(simulator.GetTime()),
+        m_lastKeySwallowed(false),
+        m_haveKey(false),
+        m_keysChecked(0),
+        m_actionsChecked(0)
+    {
+    }
+
+    bool Run(char const *text, size_t length);
+
+private:
+    bool RunLine(std::vector<Token> const &tokens);
+    bool RunExpect(Token const *tokens, size_t count);
+    bool ExpectKeys(Token const *tokens, size_t count);
+    bool ExpectActions(Token const *tokens, size_t count);
+    bool ExpectLatency(Token const *tokens, size_t count);
+    void Check(bool passed, char const *format, ...);
+    bool Error(char const *message, Token const *token = nullptr);
+
+    char const *m_name;
+    CSimulator &m_simulator;
+    FILE *m_report;
+    SimulationResult &m_result;
+    unsigned m_line;
+    uint64_t m_time;
+    bool m_lastKeySwallowed;
+    bool m_haveKey;
+    size_t m_keysChecked;       // records before these have been through "expect keys"
+    size_t m_actionsChecked;    // ...and through "expect action"
+};
+
+bool CScriptRunner::Run(char const *text, size_t length)
+{
+    std::vector<Token> tokens;
+    std::string keymap;
+    unsigned keymapLine = 0;
+    bool inKeymap = false;
+    bool started = false;
+    char const *end = text + length;
+    char const *line = text;
+    while (line < end) {
+        char const *next = static_cast<char const *>(memchr(line, '\n', static_cast<size_t>(end - line)));
+        size_t lineLength = static_cast<size_t>((next ? next : end) - line);
+        ++m_line;
+        Tokenize(line, lineLength, tokens);
+
+        if (inKeymap) {
+            if ((tokens.size() == 1) && tokens[0].Is("end")) {
+                KeymapError error;
+                if (!m_simulator.LoadKeymap(keymap.data(), keymap.size(), &error)) {
+                    m_line = keymapLine + error.line;
+                    return Error(error.message);
+                }
+                inKeymap = false;
+            } else {
+                keymap.append(line, lineLength);
+                keymap += '\n';
+            }
+        } else if ((tokens.size() == 1) && tokens[0].Is("keymap")) {
+            if (started) {
+                return Error("the keymap must come before any events");
+            }
+            inKeymap = true;
+            keymapLine = m_line;
+        } else if (!tokens.empty()) {
+            started = true;
+            if (!RunLine(tokens)) {
+                return false;
+            }
+        }
+        line = next ? next + 1 : end;
+    }
+    if (inKeymap) {
+        return Error("the keymap has no \"end\"");
+    }
+    m_result.endTime = m_simulator.GetTime();
+    return true;
+}
+
+bool CScriptRunner::RunLine(std::vector<Token> const &tokens)
+{
+    Token const *token = tokens.data();
+    size_t count = tokens.size();
+
+    char first = token->text[0];
+    if ((first == '+') || ((first >= '0') && (first <= '9'))) {
+        bool relative = (first == '+');
+        uint64_t value;
+        if (!ParseNumber(token->text + relative, token->length - relative, value)) {
+            return Error("bad time", token);
+        }
+        uint64_t time = relative ? m_time + value : value;
+        if (time < m_time) {
+            return Error("time goes backwards", token);
+        }
+        m_time = time;
+        ++token;
+        --count;
+        if (count == 0) {
+            return Error("nothing happens at this time");
+        }
+    }
+
+    if (token->Is("down") || token->Is("up") || token->Is("tap")) {
+        if (count != 2) {
+            return Error("expected a key name after", token);
+        }
+        uint8_t keycode = CKeymap::KeycodeFromName(token[1].text, token[1].length);
+        if (!keycode) {
+            return Error("unknown key", &token[1]);
+        }
+        if (!token->Is("up")) {
+            m_lastKeySwallowed = m_simulator.Key(m_time, keycode, true);
+        }
+        if (!token->Is("down")) {
+            m_lastKeySwallowed = m_simulator.Key(m_time, keycode, false);
+        }
+        m_haveKey = true;
+    } else if (token->Is("focus")) {
+        if (count > 2) {
+            return Error("expected one application name after", token);
+        }
+        if (count == 2) {
+            m_simulator.Focus(m_time, token[1].text, token[1].length);
+        } else {
+            m_simulator.Focus(m_time, nullptr, 0);
+        }
+    } else if (token->Is("wait")) {
+        if (count != 1) {
+            return Error("nothing goes after", token);
+        }
+        m_simulator.AdvanceTo(m_time);
+    } else if (token->Is("expect")) {
+        m_simulator.AdvanceTo(m_time);
+        return RunExpect(token + 1, count - 1);
+    } else {
+        return Error("unknown command", token);
+    }
+    return true;
+}
+
+bool CScriptRunner::RunExpect(Token const *tokens, size_t count)
+{
+    if (count == 0) {
+        return Error("expected something to expect");
+    }
+    if (tokens->Is("passed") || tokens->Is("swallowed")) {
+        if (count != 1) {
+            return Error("nothing goes after", tokens);
+        }
+        if (!m_haveKey) {
+            return Error("no key to check yet");
+        }
+        bool swallowed = tokens->Is("swallowed");
+        Check(m_lastKeySwallowed == swallowed, "expected the key to be %s, but it was %s",
+            swallowed ? "swallowed" : "passed", m_lastKeySwallowed ? "swallowed" : "passed");
+    } else if (tokens->Is("icon")) {
+        if (count != 2) {
+            return Error("expected an icon name after", tokens);
+        }
+        unsigned icon = 0;
+        while ((icon < ICON_COUNT) && !tokens[1].Is(g_iconNames[icon])) {
+            ++icon;
+        }
+        if (icon == ICON_COUNT) {
+            return Error("unknown icon", &tokens[1]);
+        }
+        unsigned shown = m_simulator.GetIcon();
+        Check(shown == icon, "expected the %s icon, but the %s is showing",
+            g_iconNames[icon], (shown < ICON_COUNT) ? g_iconNames[shown] : "?");
+    } else if (tokens->Is("keys")) {
+        return ExpectKeys(tokens + 1, count - 1);
+    } else if (tokens->Is("action")) {
+        return ExpectActions(tokens + 1, count - 1);
+    } else if (tokens->Is("latency")) {
+        return ExpectLatency(tokens + 1, count - 1);
+    } else {
+        return Error("unknown expectation", tokens);
+    }
+    return true;
+}
+
+bool CScriptRunner::ExpectKeys(Token const *tokens, size_t count)
+{
+    std::string expected;
+    for (size_t i = 0; i < count; ++i) {
+        Token const &token = tokens[i];
+        bool hasSign = (token.length > 1) && ((token.text[0] == '+') || (token.text[0] == '-'));
+        uint8_t keycode = CKeymap::KeycodeFromName(token.text + hasSign, token.length - hasSign);
+        if (!keycode) {
+            return Error("unknown key", &token);
+        }
+        if (!hasSign || (token.text[0] == '+')) {
+            AppendKey(expected, true, keycode);
+        }
+        if (!hasSign || (token.text[0] == '-')) {
+            AppendKey(expected, false, keycode);
+        }
+    }
+
+    std::vector<CSimulator::Record> const &records = m_simulator.GetRecords();
+    std::string actual;
+    for (size_t i = m_keysChecked; i < records.size(); ++i) {
+        if (IsKeyRecord(records[i])) {
+            AppendKey(actual, (records[i].flags & KeyEvent::FLAG_DOWN) != 0, records[i].keycode);
+        }
+    }
+    m_keysChecked = records.size();
+    Check(actual == expected, "expected the keys%s, but the system got%s",
+        expected.empty() ? " (none)" : expected.c_str(), actual.empty() ? " (none)" : actual.c_str());
+    return true;
+}
+
+bool CScriptRunner::ExpectActions(Token const *tokens, size_t count)
+{
+    std::string expected;
+    for (size_t i = 0; i < count; ++i) {
+        expected += ' ';
+        expected.append(tokens[i].text, tokens[i].length);
+    }
+
+    std::vector<CSimulator::Record> const &records = m_simulator.GetRecords();
+    std::string actual;
+    for (size_t i = m_actionsChecked; i < records.size(); ++i) {
+        if ((records[i].type == CSimulator::RECORD_ACTION) && (records[i].flags & KeyEvent::FLAG_DOWN)) {
+            char buffer[8];
+            actual += ' ';
+            actual += ActionName(records[i].value, buffer, sizeof(buffer));
+        }
+    }
+    m_actionsChecked = records.size();
+    Check(actual == expected, "expected the actions%s, but got%s",
+        expected.empty() ? " (none)" : expected.c_str(), actual.empty() ? " (none)" : actual.c_str());
+    return true;
+}
+
+bool CScriptRunner::ExpectLatency(Token const *tokens, size_t count)
+{
+    if (count != 3) {
+        return Error("expected hook or dispatch, a percentile and a budget in microseconds");
+    }
+    CLatencyHistogram const *histogram;
+    if (tokens[0].Is("hook")) {
+        histogram = &m_simulator.GetHookLatency();
+    } else if (tokens[0].Is("dispatch")) {
+        histogram = &m_simulator.GetDispatchLatency();
+    } else {
+        return Error("unknown latency", &tokens[0]);
+    }
+    double percentile;
+    double budget;
+    if (!ParseDecimal(tokens[1], percentile) || (percentile <= 0.0) || (percentile > 100.0)) {
+        return Error("bad percentile", &tokens[1]);
+    }
+    if (!ParseDecimal(tokens[2], budget) || (budget < 0.0)) {
+        return Error("bad budget", &tokens[2]);
+    }
+    double value = static_cast<double>(histogram->GetValueAtPercentile(percentile)) / 1000.0;
+    Check(value <= budget, "expected the %.*s latency's p%g within %g us, but it was %.3f us",
+        static_cast<int>(tokens[0].length), tokens[0].text, percentile, budget, value);
+    return true;
+}
+
+void CScriptRunner::Check(bool passed, char const *format, ...)
+{
+    ++m_result.checks;
+    if (passed) {
+        return;
+    }
+    ++m_result.failures;
+    if (!m_report) {
+        return;
+    }
+    fprintf(m_report, "%s:%u: at %llu ms: ", m_name, m_line, static_cast<unsigned long long>(m_time));
+    va_list args;
+    va_start(args, format);
+    vfprintf(m_report, format, args);
+    va_end(args);
+    fputc('\n', m_report);
+}
+
+bool CScriptRunner::Error(char const *message, Token const *token)
+{
+    if (!m_report) {
+        return false;
+    }
+    if (token) {
+        fprintf(m_report, "%s:%u: %s \"%.*s\"\n", m_name, m_line, message, static_cast<int>(token->length), token->text);
+    } else {
+        fprintf(m_report, "%s:%u: %s\n", m_name, m_line, message);
+    }
+    return false;
+}
+
+} // namespace
+
+bool RunSimulationScript(char const *name, char const *text, size_t length,
+    CSimulator &simulator, FILE *report, SimulationResult &result)
+{
+    result.checks = 0;
+    result.failures = 0;
+    result.endTime = simulator.GetTime();
+    CScriptRunner runner(name, simulator, report, result);
+    return runner.Run(text, length);
+}
+
+void PrintSimulationRecords(CSimulator const &simulator, FILE *report)
+{
+    static char const *const typeNames[] = { "passed", "replayed", "typed", "icon", "action" };
+    std::vector<CSimulator::Record> const &records = simulator.GetRecords();
+    for (size_t i = 0; i < records.size(); ++i) {
+        CSimulator::Record const &record = records[i];
+        fprintf(report, "%10llu ms  %-8s  ", static_cast<unsigned long long>(record.time), typeNames[record.type]);
+        if (record.type == CSimulator::RECORD_ICON) {
+            fprintf(report, "%s\n", (record.value < ICON_COUNT) ? g_iconNames[record.value] : "?");
+        } else if (record.type == CSimulator::RECORD_ACTION) {
+            char buffer[8];
+            fprintf(report, "%s %s\n", ActionName(record.value, buffer, sizeof(buffer)),
+                (record.flags & KeyEvent::FLAG_DOWN) ? "press" : "release");
+        } else {
+            fprintf(report, "%c0x%02X\n", (record.flags & KeyEvent::FLAG_DOWN) ? '+' : '-', record.keycode);
+        }
+    }
+}
@@ -0,0 +1,75 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "Simulator.h"
+
+/* Runs a scenario script against a CSimulator. A script is lines of text, each an event
+   or a check, optionally preceded by the virtual time it happens at: milliseconds since
+   the start, or +N for N milliseconds after the line before. A line with no time happens
+   at the same time as the one before it. # starts a comment.
+
+       down K / up K / tap K     a key goes down, up, or down and straight back up; K is
+                                 a key name as the keymap file has them (A, PageUp, 0x21)
+       focus [app]               the focus moves to app (or to no application)
+       wait                      just let the time pass (firing any timers on the way)
+       expect passed             the last key (a tap's release) went on to the system...
+       expect swallowed          ...or the hook swallowed it
+       expect icon hook|fish|bait  the icon showing now
+       expect keys [+K|-K|K]...  the keys the system got (passed on, replayed or typed),
+                                 in order, since the last "expect keys": +K down, -K up,
+                                 K both; nothing for none
+       expect action [name]...   the actions submitted since the last "expect action",
+                                 by their keymap names; nothing for none
+       expect latency hook|dispatch P US  the Pth percentile of the real time taken by
+                                 the hook's decisions (or the actions) is at most US
+                                 microseconds
+
+   A block between a line "keymap" and a line "end", before any events, replaces the
+   default keymap with its text. */
+struct SimulationResult
+{
+    unsigned checks;        // expectations checked
+    unsigned failures;      // expectations that failed, each reported
+    uint64_t endTime;       // virtual time at the end of the script
+};
+
+/* Returns false, having reported why, if the script can't be run at all. Failed
+   expectations are reported to report (unless it's NULL) as "name:line: ..." and
+   counted in result. */
+bool RunSimulationScript(char const *name, char const *text, size_t length,
+    CSimulator &simulator, FILE *report, SimulationResult &result);
+
+/* Print everything the simulator has recorded, one line each, for following a script. */
+void PrintSimulationRecords(CSimulator const &simulator, FILE *report);
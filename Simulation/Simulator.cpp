@@ -0,0 +1,202 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#include "Simulator.h"
+#include "AppActions.h"
+
+CSimulator::CSimulator() :
+    m_keymap(new CKeymap),
+    m_output(*this),
+    m_controller(m_engine, m_output, m_timers, *this),
+    m_icons(*this),
+    m_iconFlushTimer(INVALID_TIMER),
+    m_keyCount(0),
+    m_swallowedCount(0)
+{
+    m_keymap->Load(g_defaultKeymap, g_defaultKeymapLength, g_actionNames, g_actionNameCount, nullptr);
+    m_engine.SetKeymap(m_keymap.get());
+    m_engine.SetAppFocus(&m_focus);
+    m_output.SetKeymap(m_keymap.get());
+    m_output.SetKeyState(&m_engine.GetKeyState());
+    // As in the tray app, the bare hook is showing from the start.
+    m_icons.SetShownIcon(ICON_HOOK);
+}
+
+CSimulator::~CSimulator()
+{
+}
+
+bool CSimulator::LoadKeymap(char const *text, size_t length, KeymapError *error)
+{
+    std::unique_ptr<CKeymap> keymap(new CKeymap);
+    if (!keymap->Load(text, length, g_actionNames, g_actionNameCount, error)) {
+        return false;
+    }
+    m_engine.SetKeymap(keymap.get());
+    m_output.SetKeymap(keymap.get());
+    m_keymap = std::move(keymap);
+    return true;
+}
+
+void CSimulator::AdvanceTo(uint64_t time)
+{
+    m_timers.Advance(time);
+}
+
+bool CSimulator::Key(uint64_t time, uint8_t keycode, bool down)
+{
+    AdvanceTo(time);
+
+    // As the Linux hook builds them; the engine sees the low 32 bits of the clock.
+    KeyEvent input;
+    input.time = static_cast<uint32_t>(time);
+    input.action = KEYMAP_ACTION_NONE;
+    input.keycode = keycode;
+    input.flags = down ? KeyEvent::FLAG_DOWN : 0;
+    if (m_engine.GetKeyState().GetModifiers() & KEYMOD_ALT) {
+        input.flags |= KeyEvent::FLAG_SYSTEM;
+    }
+
+    uint64_t start = LatencyClockNow();
+    unsigned result = m_engine.ProcessKey(input);
+    m_hookLatency.RecordTicks(start);
+    bool swallowed = (result & CKeyEngine::RESULT_CONSUME) != 0;
+    ++m_keyCount;
+    m_swallowedCount += swallowed;
+    if (!swallowed) {
+        AddRecord(RECORD_PASSED, keycode, input.flags & KeyEvent::FLAG_DOWN, 0);
+    }
+    if (result & CKeyEngine::RESULT_WAKE) {
+        ProcessKeyEvents();
+    }
+    m_controller.ScheduleSequenceTimeout(time);
+    return swallowed;
+}
+
+void CSimulator::Focus(uint64_t time, char const *app, size_t length)
+{
+    AdvanceTo(time);
+    m_engine.ResetExpansions();
+    m_focus.SetApplication(app ? app : "", app ? length : 0);
+}
+
+void CSimulator::ShowIcon(unsigned icon)
+{
+    if (m_icons.SetIcon(icon, static_cast<uint32_t>(GetTime()))) {
+        ScheduleIconFlush();
+    }
+}
+
+void CSimulator::SubmitAction(KeyEvent const &event)
+{
+    AddRecord(RECORD_ACTION, event.keycode, event.flags & KeyEvent::FLAG_DOWN, event.action);
+}
+
+void CSimulator::ProcessTimeout(uint32_t now)
+{
+    if (m_engine.ProcessTimeout(now) & CKeyEngine::RESULT_WAKE) {
+        ProcessKeyEvents();
+    }
+}
+
+size_t CSimulator::SendKeys(KeyEvent const *keys, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        AddRecord(RECORD_TYPED, keys[i].keycode, keys[i].flags & (KeyEvent::FLAG_DOWN | KeyEvent::FLAG_EXTENDED), 0);
+    }
+    return count;
+}
+
+bool CSimulator::ShowIcon(uintptr_t icon)
+{
+    AddRecord(RECORD_ICON, 0, 0, static_cast<uint16_t>(icon));
+    return true;
+}
+
+void CSimulator::ProcessKeyEvents()
+{
+    // As CLinuxKeyboardHook::ProcessKeyEvents(): replayed keys go straight back through
+    // the engine, and may queue more.
+    bool wake;
+    do {
+        m_engine.BeginDrain();
+        wake = false;
+        KeyEvent event;
+        while (m_engine.PopEvent(event)) {
+            if (event.flags & KeyEvent::FLAG_REPLAY) {
+                KeyEvent replay = event;
+                replay.flags |= KeyEvent::FLAG_INJECTED;
+                unsigned result = m_engine.ProcessKey(replay);
+                if (!(result & CKeyEngine::RESULT_CONSUME)) {
+                    AddRecord(RECORD_REPLAYED, event.keycode, event.flags & (KeyEvent::FLAG_DOWN | KeyEvent::FLAG_EXTENDED), 0);
+                }
+                wake = wake || ((result & CKeyEngine::RESULT_WAKE) != 0);
+            } else {
+                uint64_t start = LatencyClockNow();
+                m_controller.HandleKeyEvent(event, GetTime());
+                m_dispatchLatency.RecordTicks(start);
+            }
+        }
+    } while (wake);
+}
+
+void CSimulator::ScheduleIconFlush()
+{
+    // The tray icon's flush timer, on the wheel.
+    uint32_t delay = m_icons.GetFlushDelay(static_cast<uint32_t>(GetTime()));
+    if (delay == CIconUpdateCoalescer::NO_FLUSH_PENDING) {
+        return;
+    }
+    if (!m_timers.Rearm(m_iconFlushTimer, GetTime() + delay)) {
+        m_iconFlushTimer = m_timers.Arm(GetTime() + delay, OnIconFlushTimer, this);
+    }
+}
+
+void CSimulator::AddRecord(RecordType type, uint8_t keycode, uint8_t flags, uint16_t value)
+{
+    Record record;
+    record.time = GetTime();
+    record.type = static_cast<uint8_t>(type);
+    record.keycode = keycode;
+    record.flags = flags;
+    record.value = value;
+    m_records.push_back(record);
+}
+
+void CSimulator::OnIconFlushTimer(void *context, TimerHandle timer)
+{
+    (void)timer;
+    CSimulator *simulator = static_cast<CSimulator *>(context);
+    simulator->m_iconFlushTimer = INVALID_TIMER;
+    if (simulator->m_icons.Flush(static_cast<uint32_t>(simulator->GetTime()))) {
+        simulator->ScheduleIconFlush();
+    }
+}
@@ -0,0 +1,146 @@
+/*  ----------------------------------------------------------------------------
+    Copyright (c) 2017, Jerry Ryle.
+    All Rights Reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its contributors
+      may be used to endorse or promote products derived from this software
+      without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+
+    Author(s):  Jerry Ryle <jerryryle@gmail.com>
+
+------------------------------------------------------------------------- */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "AppController.h"
+#include "AppFocus.h"
+#include "IconUpdateCoalescer.h"
+#include "KeyEngine.h"
+#include "Keymap.h"
+#include "LatencyHistogram.h"
+#include "OutputEngine.h"
+#include "TimerWheel.h"
+
+/* The whole app, minus the OS, on a virtual clock: keys go through the same CKeyEngine
+   the hooks use, the actions through the same CAppController, and the icon through a
+   CIconUpdateCoalescer as the tray app's does, while timers run on a CTimerWheel that only
+   moves when the simulation says so. Nothing waits for real time to pass, so hours of
+   typing take seconds.
+
+   Everything that leaves the app is recorded with its virtual time: the keys the system
+   gets (passed on, replayed after a failed sequence, or typed by a macro), icons as they
+   reach the screen and actions handed over to run off the key thread (which aren't run).
+   Replayed keys go back through the engine straight away, as in the Linux daemon.
+
+   Times are milliseconds from 0 and must never go backwards. The hook's decisions and the
+   actions' handling are also timed for real, for checking latency budgets. */
+class CSimulator : private IAppFrontend, private IOutputSink, private IIconBackend
+{
+public:
+    enum RecordType {
+        RECORD_PASSED,      // a key the hook let through (keycode, flags)
+        RECORD_REPLAYED,    // a key held for a sequence, sent on when it failed
+        RECORD_TYPED,       // a key a macro typed
+        RECORD_ICON,        // the icon on screen changed (value is an app_icons icon)
+        RECORD_ACTION,      // an action was submitted to run off the key thread (value)
+    };
+
+    struct Record
+    {
+        uint64_t time;
+        uint8_t type;
+        uint8_t keycode;
+        uint8_t flags;      // KeyEvent::FLAG_DOWN and FLAG_EXTENDED
+        uint16_t value;
+    };
+
+    CSimulator();
+    ~CSimulator();
+
+    /* Replace the keymap (the default one until then), as text in the keymap file's
+       format with the app's action names. */
+    bool LoadKeymap(char const *text, size_t length, KeymapError *error);
+
+    void SetLockState(uint32_t locks) { m_engine.GetKeyState().SetLockState(locks); }
+
+    /* Run the clock forward to time, firing whatever timers come due on the way. */
+    void AdvanceTo(uint64_t time);
+
+    /* A key goes down (again, if it's held) or up at time, after the clock has been
+       advanced to it. Returns true if the hook swallowed it. */
+    bool Key(uint64_t time, uint8_t keycode, bool down);
+
+    /* The focus moves to an application (NULL for none) at time. */
+    void Focus(uint64_t time, char const *app, size_t length);
+
+    uint64_t GetTime() const { return m_timers.GetTime(); }
+    unsigned GetIcon() const { return static_cast<unsigned>(m_icons.GetShownIcon()); }
+
+    std::vector<Record> const &GetRecords() const { return m_records; }
+    void ClearRecords() { m_records.clear(); }
+
+    CKeyEngine const &GetKeyEngine() const { return m_engine; }
+    uint64_t GetKeyCount() const { return m_keyCount; }
+    uint64_t GetSwallowedCount() const { return m_swallowedCount; }
+
+    /* Real time taken by the hook's decision per key, and by each action. */
+    CLatencyHistogram const &GetHookLatency() const { return m_hookLatency; }
+    CLatencyHistogram const &GetDispatchLatency() const { return m_dispatchLatency; }
+
+private:
+    CSimulator(CSimulator const &) = delete;
+    CSimulator &operator=(CSimulator const &) = delete;
+
+    // IAppFrontend
+    virtual void ShowIcon(unsigned icon);
+    virtual void SubmitAction(KeyEvent const &event);
+    virtual void ProcessTimeout(uint32_t now);
+
+    // IOutputSink
+    virtual size_t SendKeys(KeyEvent const *keys, size_t count);
+
+    // IIconBackend
+    virtual bool ShowIcon(uintptr_t icon);
+
+    void ProcessKeyEvents();
+    void ScheduleIconFlush();
+    void AddRecord(RecordType type, uint8_t keycode, uint8_t flags, uint16_t value);
+    static void OnIconFlushTimer(void *context, TimerHandle timer);
+
+    std::unique_ptr<CKeymap> m_keymap;
+    CAppFocus m_focus;
+    CKeyEngine m_engine;
+    COutputEngine m_output;
+    CTimerWheel m_timers;
+    CAppController m_controller;
+    CIconUpdateCoalescer m_icons;
+    TimerHandle m_iconFlushTimer;
+
+    std::vector<Record> m_records;
+    uint64_t m_keyCount;
+    uint64_t m_swallowedCount;
+    CLatencyHistogram m_hookLatency;
+    CLatencyHistogram m_dispatchLatency;
+};